@@ -244,7 +244,8 @@ daemonConfigNew(bool privileged ATTRIBUTE_UNUSED)
 
     if (VIR_STRDUP(data->unix_sock_rw_perms,
                    data->auth_unix_rw == REMOTE_AUTH_POLKIT ? "0777" : "0700") < 0 ||
-        VIR_STRDUP(data->unix_sock_ro_perms, "0777") < 0)
+        VIR_STRDUP(data->unix_sock_ro_perms, "0777") < 0 ||
+        VIR_STRDUP(data->stats_unix_sock_perms, "0700") < 0)
         goto error;
 
 #if WITH_SASL
@@ -322,6 +323,8 @@ daemonConfigFree(struct daemonConfig *data)
     VIR_FREE(data->unix_sock_rw_perms);
     VIR_FREE(data->unix_sock_group);
     VIR_FREE(data->unix_sock_dir);
+    VIR_FREE(data->stats_unix_sock);
+    VIR_FREE(data->stats_unix_sock_perms);
     VIR_FREE(data->mdns_name);
 
     tmp = data->tls_allowed_dn_list;
@@ -343,6 +346,7 @@ daemonConfigFree(struct daemonConfig *data)
     VIR_FREE(data->cert_file);
     VIR_FREE(data->crl_file);
 
+    VIR_FREE(data->event_loop);
     VIR_FREE(data->host_uuid);
     VIR_FREE(data->log_filters);
     VIR_FREE(data->log_outputs);
@@ -389,6 +393,8 @@ daemonConfigLoadOptions(struct daemonConfig *data,
     GET_CONF_STR(conf, filename, unix_sock_rw_perms);
 
     GET_CONF_STR(conf, filename, unix_sock_dir);
+    GET_CONF_STR(conf, filename, stats_unix_sock);
+    GET_CONF_STR(conf, filename, stats_unix_sock_perms);
 
     GET_CONF_INT(conf, filename, mdns_adv);
     GET_CONF_STR(conf, filename, mdns_name);
@@ -421,6 +427,8 @@ daemonConfigLoadOptions(struct daemonConfig *data,
     GET_CONF_INT(conf, filename, max_requests);
     GET_CONF_INT(conf, filename, max_client_requests);
 
+    GET_CONF_STR(conf, filename, event_loop);
+
     GET_CONF_INT(conf, filename, audit_level);
     GET_CONF_INT(conf, filename, audit_logging);
 
@@ -430,6 +438,7 @@ daemonConfigLoadOptions(struct daemonConfig *data,
     GET_CONF_STR(conf, filename, log_filters);
     GET_CONF_STR(conf, filename, log_outputs);
     GET_CONF_INT(conf, filename, log_buffer_size);
+    GET_CONF_INT(conf, filename, log_async);
 
     GET_CONF_INT(conf, filename, keepalive_interval);
     GET_CONF_INT(conf, filename, keepalive_count);
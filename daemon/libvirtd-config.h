@@ -39,6 +39,8 @@ struct daemonConfig {
     char *unix_sock_rw_perms;
     char *unix_sock_group;
     char *unix_sock_dir;
+    char *stats_unix_sock;
+    char *stats_unix_sock_perms;
 
     int auth_unix_rw;
     int auth_unix_ro;
@@ -70,10 +72,13 @@ struct daemonConfig {
     int max_requests;
     int max_client_requests;
 
+    char *event_loop;
+
     int log_level;
     char *log_filters;
     char *log_outputs;
     int log_buffer_size;
+    int log_async;
 
     int audit_level;
     int audit_logging;
@@ -48,7 +48,9 @@
 #include "viralloc.h"
 #include "virconf.h"
 #include "virnetlink.h"
+#include "virevent.h"
 #include "virnetserver.h"
+#include "virnetsocket.h"
 #include "remote.h"
 #include "virhook.h"
 #include "viraudit.h"
@@ -108,6 +110,9 @@ virNetServerProgramPtr remoteProgram = NULL;
 virNetServerProgramPtr qemuProgram = NULL;
 virNetServerProgramPtr lxcProgram = NULL;
 
+/* Optional socket serving the RPC statistics in plain text */
+static virNetSocketPtr statsSock = NULL;
+
 enum {
     VIR_DAEMON_ERR_NONE = 0,
     VIR_DAEMON_ERR_PIDFILE,
@@ -444,6 +449,181 @@ static void daemonInitialize(void)
 }
 
 
+/* Clients of the stats socket are served from the event loop, so
+ * that neither a stuck reader nor a flood of connections can tie up
+ * threads. Anyone beyond the limit is disconnected straight away, and
+ * whoever does not read the statistics within the timeout is dropped */
+#define DAEMON_STATS_MAX_CLIENTS 8
+#define DAEMON_STATS_TIMEOUT 5000 /* ms */
+
+struct daemonStatsClient {
+    virNetSocketPtr sock;
+    int timer;
+    char *stats;
+    size_t len;
+    size_t done;
+};
+
+static size_t statsClients = 0;
+
+static void daemonStatsClientFree(void *opaque)
+{
+    struct daemonStatsClient *client = opaque;
+
+    virNetSocketClose(client->sock);
+    virObjectUnref(client->sock);
+    VIR_FREE(client->stats);
+    VIR_FREE(client);
+    statsClients--;
+}
+
+/* The client is freed once the event loop has let go of its socket */
+static void daemonStatsClientDone(struct daemonStatsClient *client)
+{
+    if (client->timer != -1) {
+        virEventRemoveTimeout(client->timer);
+        client->timer = -1;
+    }
+    virNetSocketRemoveIOCallback(client->sock);
+}
+
+static void daemonStatsClientTimeout(int timer ATTRIBUTE_UNUSED,
+                                     void *opaque)
+{
+    struct daemonStatsClient *client = opaque;
+
+    VIR_DEBUG("Dropping stats client %p which did not read in time",
+              client);
+    daemonStatsClientDone(client);
+}
+
+static void daemonStatsClientWrite(virNetSocketPtr sock,
+                                   int events,
+                                   void *opaque)
+{
+    struct daemonStatsClient *client = opaque;
+
+    if (events & VIR_EVENT_HANDLE_WRITABLE) {
+        while (client->done < client->len) {
+            ssize_t ret = virNetSocketWrite(sock,
+                                            client->stats + client->done,
+                                            client->len - client->done);
+            if (ret < 0) {
+                virResetLastError();
+                break;
+            }
+            if (ret == 0)
+                return;
+            client->done += ret;
+        }
+    }
+
+    daemonStatsClientDone(client);
+}
+
+static void daemonStatsAccept(virNetSocketPtr sock,
+                              int events ATTRIBUTE_UNUSED,
+                              void *opaque)
+{
+    virNetServerPtr srv = opaque;
+    struct daemonStatsClient *client = NULL;
+    virNetSocketPtr clientsock = NULL;
+
+    if (virNetSocketAccept(sock, &clientsock) < 0 || !clientsock)
+        return;
+
+    if (statsClients >= DAEMON_STATS_MAX_CLIENTS) {
+        VIR_DEBUG("Too many stats clients, dropping a new one");
+        virNetSocketClose(clientsock);
+        virObjectUnref(clientsock);
+        return;
+    }
+
+    if (VIR_ALLOC(client) < 0)
+        goto error;
+    client->sock = clientsock;
+    client->timer = -1;
+
+    if (!(client->stats = virNetServerFormatStats(srv)) ||
+        virNetSocketSetBlocking(clientsock, false) < 0)
+        goto error;
+    client->len = strlen(client->stats);
+
+    if ((client->timer = virEventAddTimeout(DAEMON_STATS_TIMEOUT,
+                                            daemonStatsClientTimeout,
+                                            client, NULL)) < 0)
+        goto error;
+
+    if (virNetSocketAddIOCallback(clientsock,
+                                  VIR_EVENT_HANDLE_WRITABLE,
+                                  daemonStatsClientWrite,
+                                  client,
+                                  daemonStatsClientFree) < 0)
+        goto error;
+
+    statsClients++;
+    return;
+
+error:
+    VIR_WARN("Unable to serve RPC statistics");
+    if (client) {
+        if (client->timer != -1)
+            virEventRemoveTimeout(client->timer);
+        VIR_FREE(client->stats);
+        VIR_FREE(client);
+    }
+    virNetSocketClose(clientsock);
+    virObjectUnref(clientsock);
+}
+
+/*
+ * Everyone connecting to the stats socket just gets the output of
+ * virNetServerFormatStats, which needs neither a libvirt client nor
+ * a free worker. There is no authentication or access control on it,
+ * only the permissions of the socket.
+ */
+static int daemonSetupStatsSocket(virNetServerPtr srv,
+                                  const char *path,
+                                  int mask,
+                                  gid_t grp)
+{
+    VIR_DEBUG("Registering stats socket %s", path);
+    if (virNetSocketNewListenUNIX(path, mask, -1, grp, &statsSock) < 0)
+        return -1;
+
+    if (virNetSocketListen(statsSock, 0) < 0)
+        goto error;
+
+    virObjectRef(srv);
+    if (virNetSocketAddIOCallback(statsSock,
+                                  VIR_EVENT_HANDLE_READABLE,
+                                  daemonStatsAccept,
+                                  srv,
+                                  virObjectFreeCallback) < 0) {
+        virObjectUnref(srv);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    virNetSocketClose(statsSock);
+    virObjectUnref(statsSock);
+    statsSock = NULL;
+    return -1;
+}
+
+static void daemonCloseStatsSocket(void)
+{
+    if (!statsSock)
+        return;
+
+    virNetSocketRemoveIOCallback(statsSock);
+    virNetSocketClose(statsSock);
+    virObjectUnref(statsSock);
+    statsSock = NULL;
+}
+
 static int daemonSetupNetworking(virNetServerPtr srv,
                                  struct daemonConfig *config,
                                  const char *sock_path,
@@ -460,6 +640,7 @@ static int daemonSetupNetworking(virNetServerPtr srv,
     gid_t unix_sock_gid = 0;
     int unix_sock_ro_mask = 0;
     int unix_sock_rw_mask = 0;
+    int stats_unix_sock_mask = 0;
 
     if (config->unix_sock_group) {
         if (virGetGroupID(config->unix_sock_group, &unix_sock_gid) < 0)
@@ -476,6 +657,11 @@ static int daemonSetupNetworking(virNetServerPtr srv,
         goto error;
     }
 
+    if (virStrToLong_i(config->stats_unix_sock_perms, NULL, 8, &stats_unix_sock_mask) != 0) {
+        VIR_ERROR(_("Failed to parse mode '%s'"), config->stats_unix_sock_perms);
+        goto error;
+    }
+
     VIR_DEBUG("Registering unix socket %s", sock_path);
     if (!(svc = virNetServerServiceNewUNIX(sock_path,
                                            unix_sock_rw_mask,
@@ -513,6 +699,11 @@ static int daemonSetupNetworking(virNetServerPtr srv,
         virNetServerAddService(srv, svcRO, NULL) < 0)
         goto error;
 
+    if (config->stats_unix_sock &&
+        daemonSetupStatsSocket(srv, config->stats_unix_sock,
+                               stats_unix_sock_mask, unix_sock_gid) < 0)
+        goto error;
+
     if (ipsock) {
         if (config->listen_tcp) {
             VIR_DEBUG("Registering TCP socket %s:%s",
@@ -797,6 +988,32 @@ static void daemonReloadHandler(virNetServerPtr srv ATTRIBUTE_UNUSED,
             VIR_WARN("Error while reloading drivers");
 }
 
+static void daemonStatsHandler(virNetServerPtr srv,
+                               siginfo_t *sig ATTRIBUTE_UNUSED,
+                               void *opaque ATTRIBUTE_UNUSED)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    size_t i;
+
+    if (virNetServerGetStats(srv, &params, &nparams) < 0) {
+        VIR_WARN("Unable to collect RPC statistics");
+        return;
+    }
+
+    /* Logged as warnings so that they show up by default */
+    for (i = 0; i < nparams; i++) {
+        if (params[i].type == VIR_TYPED_PARAM_UINT)
+            VIR_WARN("RPC statistics: %s=%u",
+                     params[i].field, params[i].value.ui);
+        else
+            VIR_WARN("RPC statistics: %s=%llu",
+                     params[i].field, params[i].value.ul);
+    }
+
+    virTypedParamsFree(params, nparams);
+}
+
 static int daemonSetupSignals(virNetServerPtr srv)
 {
     if (virNetServerAddSignalHandler(srv, SIGINT, daemonShutdownHandler, NULL) < 0)
@@ -807,6 +1024,10 @@ static int daemonSetupSignals(virNetServerPtr srv)
         return -1;
     if (virNetServerAddSignalHandler(srv, SIGHUP, daemonReloadHandler, NULL) < 0)
         return -1;
+#ifdef SIGUSR1
+    if (virNetServerAddSignalHandler(srv, SIGUSR1, daemonStatsHandler, NULL) < 0)
+        return -1;
+#endif
     return 0;
 }
 
@@ -1320,6 +1541,12 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* Only now, as the writer thread would not survive the fork */
+    if (config->log_async && virLogSetAsync(true) < 0) {
+        VIR_ERROR(_("Failed to start asynchronous logging"));
+        goto cleanup;
+    }
+
     /* Ensure the rundir exists (on tmpfs on some systems) */
     if (privileged) {
         if (VIR_STRDUP_QUIET(run_dir, LOCALSTATEDIR "/run/libvirt") < 0) {
@@ -1359,6 +1586,20 @@ int main(int argc, char **argv) {
         goto cleanup;
     }
 
+    if (config->event_loop) {
+        int type = virEventImplTypeFromString(config->event_loop);
+        if (type < 0) {
+            VIR_ERROR(_("unknown event loop implementation '%s'"),
+                      config->event_loop);
+            ret = VIR_DAEMON_ERR_CONFIG;
+            goto cleanup;
+        }
+        if (virEventSetDefaultImpl(type) < 0) {
+            ret = VIR_DAEMON_ERR_CONFIG;
+            goto cleanup;
+        }
+    }
+
     if (!(srv = virNetServerNew(config->min_workers,
                                 config->max_workers,
                                 config->prio_workers,
@@ -1519,6 +1760,7 @@ int main(int argc, char **argv) {
 
 cleanup:
     virNetlinkEventServiceStopAll();
+    daemonCloseStatsSocket();
     virObjectUnref(remoteProgram);
     virObjectUnref(lxcProgram);
     virObjectUnref(qemuProgram);
@@ -1548,5 +1790,8 @@ cleanup:
 
     virStateCleanup();
 
+    /* Flush whatever is still queued for the log writer */
+    virLogSetAsync(false);
+
     return ret;
 }
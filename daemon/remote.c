@@ -45,6 +45,7 @@
 #include "virtypedparam.h"
 #include "virdbus.h"
 #include "virprocess.h"
+#include "viraccessapicheck.h"
 #include "remote_protocol.h"
 #include "qemu_protocol.h"
 #include "lxc_protocol.h"
@@ -5138,6 +5139,153 @@ cleanup:
 }
 
 
+static int
+remoteDispatchConnectGetAllDomainStats(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                       virNetServerClientPtr client,
+                                       virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                       virNetMessageErrorPtr rerr,
+                                       remote_connect_get_all_domain_stats_args *args,
+                                       remote_connect_get_all_domain_stats_ret *ret)
+{
+    int rv = -1;
+    size_t i;
+    struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
+    virDomainStatsRecordPtr *retStats = NULL;
+    int nrecords = 0;
+    virDomainPtr *doms = NULL;
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (args->doms.doms_len) {
+        if (VIR_ALLOC_N(doms, args->doms.doms_len + 1) < 0)
+            goto cleanup;
+
+        for (i = 0; i < args->doms.doms_len; i++) {
+            if (!(doms[i] = get_nonnull_domain(priv->conn,
+                                               args->doms.doms_val[i])))
+                goto cleanup;
+        }
+
+        if ((nrecords = virDomainListGetStats(doms,
+                                              args->stats,
+                                              &retStats,
+                                              args->flags)) < 0)
+            goto cleanup;
+    } else {
+        if ((nrecords = virConnectGetAllDomainStats(priv->conn,
+                                                    args->stats,
+                                                    &retStats,
+                                                    args->flags)) < 0)
+            goto cleanup;
+    }
+
+    if (nrecords > REMOTE_DOMAIN_LIST_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("Too many domain stats records '%d' for limit '%d'"),
+                       nrecords, REMOTE_DOMAIN_LIST_MAX);
+        goto cleanup;
+    }
+
+    if (nrecords) {
+        if (VIR_ALLOC_N(ret->retStats.retStats_val, nrecords) < 0)
+            goto cleanup;
+
+        ret->retStats.retStats_len = nrecords;
+
+        for (i = 0; i < nrecords; i++) {
+            remote_domain_stats_record *dst = ret->retStats.retStats_val + i;
+
+            if (retStats[i]->nparams > REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX) {
+                virReportError(VIR_ERR_RPC,
+                               _("Too many domain stats '%d' for limit '%d'"),
+                               retStats[i]->nparams,
+                               REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX);
+                goto cleanup;
+            }
+
+            make_nonnull_domain(&dst->dom, retStats[i]->dom);
+
+            if (remoteSerializeTypedParameters(retStats[i]->params,
+                                               retStats[i]->nparams,
+                                               &dst->params.params_val,
+                                               &dst->params.params_len,
+                                               VIR_TYPED_PARAM_STRING_OKAY) < 0)
+                goto cleanup;
+        }
+    } else {
+        ret->retStats.retStats_len = 0;
+        ret->retStats.retStats_val = NULL;
+    }
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+
+    virDomainStatsRecordListFree(retStats);
+    if (doms) {
+        for (i = 0; i < args->doms.doms_len && doms[i]; i++)
+            virDomainFree(doms[i]);
+        VIR_FREE(doms);
+    }
+    return rv;
+}
+
+
+static int
+remoteDispatchConnectGetRPCStats(virNetServerPtr server,
+                                 virNetServerClientPtr client,
+                                 virNetMessagePtr msg ATTRIBUTE_UNUSED,
+                                 virNetMessageErrorPtr rerr,
+                                 remote_connect_get_rpc_stats_args *args,
+                                 remote_connect_get_rpc_stats_ret *ret)
+{
+    int rv = -1;
+    struct daemonClientPrivate *priv = virNetServerClientGetPrivateData(client);
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    unsigned int flags = args->flags;
+
+    if (!priv->conn) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    virCheckFlagsGoto(0, cleanup);
+
+    if (virConnectGetRPCStatsEnsureACL(priv->conn) < 0)
+        goto cleanup;
+
+    if (virNetServerGetStats(server, &params, &nparams) < 0)
+        goto cleanup;
+
+    if (nparams > REMOTE_CONNECT_RPC_STATS_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("Too many RPC stats '%d' for limit '%d'"),
+                       nparams, REMOTE_CONNECT_RPC_STATS_MAX);
+        goto cleanup;
+    }
+
+    if (remoteSerializeTypedParameters(params, nparams,
+                                       &ret->params.params_val,
+                                       &ret->params.params_len,
+                                       0) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    virTypedParamsFree(params, nparams);
+    return rv;
+}
+
+
 
 /*----- Helpers. -----*/
 
@@ -281,7 +281,8 @@ daemonStreamFilter(virNetServerClientPtr client ATTRIBUTE_UNUSED,
 
     virMutexLock(&stream->priv->lock);
 
-    if (msg->header.type != VIR_NET_STREAM)
+    if (msg->header.type != VIR_NET_STREAM &&
+        msg->header.type != VIR_NET_STREAM_HOLE)
         goto cleanup;
 
     if (!virNetServerProgramMatches(stream->prog, msg))
@@ -548,6 +549,43 @@ daemonStreamHandleWriteData(virNetServerClientPtr client,
 }
 
 
+/*
+ * Skips over a hole the client sent in a sparse stream.
+ *
+ * Returns:
+ *   -1  if fatal error occurred
+ *    0  if message was fully processed
+ */
+static int
+daemonStreamHandleHole(virNetServerClientPtr client,
+                       daemonClientStream *stream,
+                       virNetMessagePtr msg)
+{
+    virNetStreamHole data;
+    virNetMessageError rerr;
+
+    VIR_DEBUG("client=%p, stream=%p, proc=%d, serial=%d",
+              client, stream, msg->header.proc, msg->header.serial);
+
+    memset(&data, 0, sizeof(data));
+    memset(&rerr, 0, sizeof(rerr));
+
+    if (virNetMessageDecodePayload(msg, (xdrproc_t)xdr_virNetStreamHole,
+                                   &data) < 0 ||
+        virStreamSendHole(stream->st, data.length, data.flags) < 0) {
+        VIR_INFO("Stream hole failed");
+        stream->closed = 1;
+        return virNetServerProgramSendReplyError(stream->prog,
+                                                 client,
+                                                 msg,
+                                                 &rerr,
+                                                 &msg->header);
+    }
+
+    return 0;
+}
+
+
 /*
  * Process a finish handshake from the client.
  *
@@ -652,7 +690,10 @@ daemonStreamHandleWrite(virNetServerClientPtr client,
             break;
 
         case VIR_NET_CONTINUE:
-            ret = daemonStreamHandleWriteData(client, stream, msg);
+            if (msg->header.type == VIR_NET_STREAM_HOLE)
+                ret = daemonStreamHandleHole(client, stream, msg);
+            else
+                ret = daemonStreamHandleWriteData(client, stream, msg);
             break;
 
         case VIR_NET_ERROR:
@@ -709,6 +750,7 @@ daemonStreamHandleRead(virNetServerClientPtr client,
 {
     char *buffer;
     size_t bufferLen = VIR_NET_MESSAGE_PAYLOAD_MAX;
+    long long length = 0;
     int ret;
 
     VIR_DEBUG("client=%p, stream=%p tx=%d closed=%d",
@@ -729,11 +771,34 @@ daemonStreamHandleRead(virNetServerClientPtr client,
     if (VIR_ALLOC_N(buffer, bufferLen) < 0)
         return -1;
 
-    ret = virStreamRecv(stream->st, buffer, bufferLen);
+    /* Only sparse streams ever report holes, and those are only
+     * opened for clients which asked for them */
+    ret = virStreamRecvFlags(stream->st, buffer, bufferLen,
+                             VIR_STREAM_RECV_STOP_AT_HOLE);
+    if (ret == -3 &&
+        virStreamRecvHole(stream->st, &length, 0) < 0)
+        ret = -1;
+
     if (ret == -2) {
         /* Should never get this, since we're only called when we know
          * we're readable, but hey things change... */
         ret = 0;
+    } else if (ret == -3) {
+        virNetMessagePtr msg;
+        stream->tx = 0;
+        if (!(msg = virNetMessageNew(false))) {
+            ret = -1;
+        } else {
+            msg->cb = daemonStreamMessageFinished;
+            msg->opaque = stream;
+            stream->refs++;
+            ret = virNetServerProgramSendStreamHole(remoteProgram,
+                                                    client,
+                                                    msg,
+                                                    stream->procedure,
+                                                    stream->serial,
+                                                    length, 0);
+        }
     } else if (ret < 0) {
         virNetMessagePtr msg;
         virNetMessageError rerr;
@@ -761,12 +826,14 @@ daemonStreamHandleRead(virNetServerClientPtr client,
             msg->cb = daemonStreamMessageFinished;
             msg->opaque = stream;
             stream->refs++;
-            ret = virNetServerProgramSendStreamData(remoteProgram,
-                                                    client,
-                                                    msg,
-                                                    stream->procedure,
-                                                    stream->serial,
-                                                    buffer, ret);
+            /* The message takes over the buffer to avoid a copy */
+            ret = virNetServerProgramSendStreamBuffer(remoteProgram,
+                                                      client,
+                                                      msg,
+                                                      stream->procedure,
+                                                      stream->serial,
+                                                      buffer, ret);
+            buffer = NULL;
         }
     }
 
@@ -293,6 +293,7 @@ foreach my $src (@srcs) {
 $groups{virDriver}->{apis}->{"openAuth"} = "virConnectOpenAuth";
 $groups{virDriver}->{apis}->{"openReadOnly"} = "virConnectOpenReadOnly";
 $groups{virDriver}->{apis}->{"domainMigrate"} = "virDomainMigrate";
+$groups{virDriver}->{apis}->{"domainListGetStats"} = "virDomainListGetStats";
 
 my $openAuthVers = (0 * 1000 * 1000) + (4 * 1000) + 0;
 
@@ -316,6 +317,13 @@ foreach my $drv (keys %{$groups{"virDriver"}->{drivers}}) {
     } else {
         $groups{"virDriver"}->{drivers}->{$drv}->{"connectOpenAuth"} = "0.4.0";
     }
+
+    # virDomainListGetStats is implemented by the same driver method
+    # as virConnectGetAllDomainStats
+    if ($groups{"virDriver"}->{drivers}->{$drv}->{"connectGetAllDomainStats"}) {
+        $groups{"virDriver"}->{drivers}->{$drv}->{"domainListGetStats"} =
+            $groups{"virDriver"}->{drivers}->{$drv}->{"connectGetAllDomainStats"};
+    }
 }
 
 
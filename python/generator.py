@@ -509,6 +509,9 @@ skip_function = (
     'virStreamSendAll', # Pure python libvirt-override-virStream.py
     'virStreamRecv', # overridden in libvirt-override-virStream.py
     'virStreamSend', # overridden in libvirt-override-virStream.py
+    'virStreamRecvFlags', # needs the same manual buffer handling as virStreamRecv
+    'virStreamRecvHole', # needs manual wrapping of the length out parameter
+    'virStreamSendHole', # only useful along with virStreamRecvHole
 
     'virConnectUnregisterCloseCallback', # overridden in virConnect.py
     'virConnectRegisterCloseCallback', # overridden in virConnect.py
@@ -516,6 +519,11 @@ skip_function = (
     'virDomainCreateXMLWithFiles', # overridden in virConnect.py
     'virDomainCreateWithFiles', # overridden in virDomain.py
 
+    'virConnectGetAllDomainStats', # needs manual wrapping of the record list
+    'virDomainListGetStats', # needs manual wrapping of the record list
+    'virDomainStatsRecordListFree', # only useful in C, python uses list
+    'virConnectGetRPCStats', # needs manual wrapping of the typed params
+
     # 'Ref' functions have no use for bindings users.
     "virConnectRef",
     "virDomainRef",
@@ -53,6 +53,8 @@
 #include "device_conf.h"
 #include "virtpm.h"
 #include "virstring.h"
+#include "virhashcode.h"
+#include "virthreadpool.h"
 
 #define VIR_FROM_THIS VIR_FROM_DOMAIN
 
@@ -62,13 +64,37 @@ verify(VIR_DOMAIN_VIRT_LAST <= 32);
 
 
 struct _virDomainObjList {
-    virObjectLockable parent;
+    virObjectRWLockable parent;
 
     /* uuid string -> virDomainObj  mapping
      * for O(1), lockless lookup-by-uuid */
     virHashTable *objs;
+
+    /* name -> virDomainObj mapping for O(1) lookup-by-name,
+     * kept in sync with @objs, which owns the references */
+    virHashTable *objsName;
+
+    /* Guards the lazily filled caches below, which are updated
+     * by readers holding just the shared lock. Writers already
+     * have exclusive access. Never lock a domain while holding it */
+    virMutex cacheLock;
+
+    /* id -> virDomainObj cache for lookup-by-id. Drivers change
+     * def->id directly, so entries are validated on lookup and
+     * refreshed by a full scan on a miss */
+    virHashTable *objsID;
+
+    /* Flat copy of @objs walked by readers, since virHashForEach
+     * can't be used by several threads at once. Dropped on every
+     * add/remove and rebuilt on first use */
+    virDomainObjPtr *snapshot;
+    size_t nsnapshot;
+    bool snapshotValid;
 };
 
+/* Hash tables don't accept NULL keys, so shift IDs by one */
+#define VIR_DOMAIN_OBJ_LIST_ID_KEY(id) ((void *)(intptr_t)((id) + 1))
+
 
 /* This structure holds various callbacks and data needed
  * while parsing and creating domain XMLs */
@@ -791,7 +817,7 @@ static int virDomainObjOnceInit(void)
                                           virDomainObjDispose)))
         return -1;
 
-    if (!(virDomainObjListClass = virClassNew(virClassForObjectLockable(),
+    if (!(virDomainObjListClass = virClassNew(virClassForObjectRWLockable(),
                                               "virDomainObjList",
                                               sizeof(virDomainObjList),
                                               virDomainObjListDispose)))
@@ -943,6 +969,25 @@ virDomainObjListDataFree(void *payload, const void *name ATTRIBUTE_UNUSED)
     virObjectUnref(obj);
 }
 
+static uint32_t
+virDomainObjListIDCode(const void *name, uint32_t seed)
+{
+    intptr_t key = (intptr_t)name;
+    return virHashCodeGen(&key, sizeof(key), seed);
+}
+
+static bool
+virDomainObjListIDEqual(const void *namea, const void *nameb)
+{
+    return namea == nameb;
+}
+
+static void *
+virDomainObjListIDCopy(const void *name)
+{
+    return (void *)name;
+}
+
 virDomainObjListPtr virDomainObjListNew(void)
 {
     virDomainObjListPtr doms;
@@ -950,10 +995,23 @@ virDomainObjListPtr virDomainObjListNew(void)
     if (virDomainObjInitialize() < 0)
         return NULL;
 
-    if (!(doms = virObjectLockableNew(virDomainObjListClass)))
+    if (!(doms = virObjectRWLockableNew(virDomainObjListClass)))
+        return NULL;
+
+    if (virMutexInit(&doms->cacheLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize mutex"));
+        virObjectUnref(doms);
         return NULL;
+    }
 
-    if (!(doms->objs = virHashCreate(50, virDomainObjListDataFree))) {
+    if (!(doms->objs = virHashCreate(50, virDomainObjListDataFree)) ||
+        !(doms->objsName = virHashCreate(50, NULL)) ||
+        !(doms->objsID = virHashCreateFull(50, NULL,
+                                           virDomainObjListIDCode,
+                                           virDomainObjListIDEqual,
+                                           virDomainObjListIDCopy,
+                                           NULL))) {
         virObjectUnref(doms);
         return NULL;
     }
@@ -966,35 +1024,189 @@ static void virDomainObjListDispose(void *obj)
 {
     virDomainObjListPtr doms = obj;
 
+    virHashFree(doms->objsID);
+    virHashFree(doms->objsName);
+    VIR_FREE(doms->snapshot);
+    virMutexDestroy(&doms->cacheLock);
     virHashFree(doms->objs);
 }
 
 
-static int virDomainObjListSearchID(const void *payload,
-                                    const void *name ATTRIBUTE_UNUSED,
-                                    const void *data)
+static void
+virDomainObjListSnapshotCollect(void *payload,
+                                const void *name ATTRIBUTE_UNUSED,
+                                void *opaque)
+{
+    virDomainObjListPtr doms = opaque;
+
+    doms->snapshot[doms->nsnapshot++] = payload;
+}
+
+/*
+ * Call @iter on every domain in @doms. Unlike virHashForEach on
+ * doms->objs this may be called by any number of threads holding
+ * the read lock on @doms at the same time. @iter is not allowed
+ * to add or remove domains.
+ */
+static int
+virDomainObjListSnapshotForEach(virDomainObjListPtr doms,
+                                virHashIterator iter,
+                                void *opaque)
 {
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    const int *id = data;
-    int want = 0;
+    size_t i;
+
+    virMutexLock(&doms->cacheLock);
+    if (!doms->snapshotValid) {
+        if (VIR_ALLOC_N(doms->snapshot, virHashSize(doms->objs) + 1) < 0) {
+            virMutexUnlock(&doms->cacheLock);
+            return -1;
+        }
+        doms->nsnapshot = 0;
+        virHashForEach(doms->objs, virDomainObjListSnapshotCollect, doms);
+        doms->snapshotValid = true;
+    }
+    virMutexUnlock(&doms->cacheLock);
+
+    /* Only writers drop the snapshot, and they are locked out
+     * for as long as our caller holds the read lock */
+    for (i = 0; i < doms->nsnapshot; i++)
+        iter(doms->snapshot[i], NULL, opaque);
+
+    return 0;
+}
+
+
+static int
+virDomainObjListSearchObj(const void *payload,
+                          const void *name ATTRIBUTE_UNUSED,
+                          const void *data)
+{
+    return payload == data;
+}
+
+/*
+ * Add @vm to the secondary indexes. The caller must hold the
+ * write lock on @doms and have checked that the name is unique.
+ */
+static int
+virDomainObjListAddIndexes(virDomainObjListPtr doms,
+                           virDomainObjPtr vm)
+{
+    if (virHashAddEntry(doms->objsName, vm->def->name, vm) < 0)
+        return -1;
+
+    /* Seed the ID cache, it is only a hint so failure is harmless */
+    if (vm->def->id != -1)
+        ignore_value(virHashUpdateEntry(doms->objsID,
+                                        VIR_DOMAIN_OBJ_LIST_ID_KEY(vm->def->id),
+                                        vm));
+
+    doms->snapshotValid = false;
+    VIR_FREE(doms->snapshot);
+    doms->nsnapshot = 0;
+    return 0;
+}
+
+/*
+ * Drop @vm from the secondary indexes. The caller must hold the
+ * write lock on @doms.
+ */
+static void
+virDomainObjListRemoveIndexes(virDomainObjListPtr doms,
+                              virDomainObjPtr vm)
+{
+    if (virHashLookup(doms->objsName, vm->def->name) == vm)
+        virHashRemoveEntry(doms->objsName, vm->def->name);
+    else
+        virHashRemoveSet(doms->objsName, virDomainObjListSearchObj, vm);
+
+    virHashRemoveSet(doms->objsID, virDomainObjListSearchObj, vm);
+
+    doms->snapshotValid = false;
+    VIR_FREE(doms->snapshot);
+    doms->nsnapshot = 0;
+}
+
+
+struct virDomainObjListScanIDData {
+    virDomainObjListPtr doms;
+    int id;
+    virDomainObjPtr match;
+};
+
+static void
+virDomainObjListScanID(void *payload,
+                       const void *name ATTRIBUTE_UNUSED,
+                       void *opaque)
+{
+    virDomainObjPtr obj = payload;
+    struct virDomainObjListScanIDData *data = opaque;
+    int id = -1;
 
     virObjectLock(obj);
-    if (virDomainObjIsActive(obj) &&
-        obj->def->id == *id)
-        want = 1;
+    if (virDomainObjIsActive(obj))
+        id = obj->def->id;
     virObjectUnlock(obj);
-    return want;
+
+    if (id == -1)
+        return;
+
+    if (id == data->id)
+        data->match = obj;
+
+    virMutexLock(&data->doms->cacheLock);
+    ignore_value(virHashUpdateEntry(data->doms->objsID,
+                                    VIR_DOMAIN_OBJ_LIST_ID_KEY(id),
+                                    obj));
+    virMutexUnlock(&data->doms->cacheLock);
 }
 
 virDomainObjPtr virDomainObjListFindByID(const virDomainObjListPtr doms,
                                          int id)
 {
     virDomainObjPtr obj;
-    virObjectLock(doms);
-    obj = virHashSearch(doms->objs, virDomainObjListSearchID, &id);
-    if (obj)
+    struct virDomainObjListScanIDData data = { doms, id, NULL };
+
+    virObjectRWLockRead(doms);
+
+    virMutexLock(&doms->cacheLock);
+    obj = virHashLookup(doms->objsID, VIR_DOMAIN_OBJ_LIST_ID_KEY(id));
+    virMutexUnlock(&doms->cacheLock);
+
+    if (obj) {
         virObjectLock(obj);
-    virObjectUnlock(doms);
+        if (virDomainObjIsActive(obj) &&
+            obj->def->id == id)
+            goto cleanup;
+        virObjectUnlock(obj);
+        obj = NULL;
+    }
+
+    /* Missing or stale entry, rescan all domains which also
+     * refreshes the cache for every other running domain */
+    if (virDomainObjListSnapshotForEach(doms, virDomainObjListScanID,
+                                        &data) < 0) {
+        virResetLastError();
+        goto cleanup;
+    }
+
+    if (!data.match) {
+        virMutexLock(&doms->cacheLock);
+        virHashRemoveEntry(doms->objsID, VIR_DOMAIN_OBJ_LIST_ID_KEY(id));
+        virMutexUnlock(&doms->cacheLock);
+        goto cleanup;
+    }
+
+    obj = data.match;
+    virObjectLock(obj);
+    if (!virDomainObjIsActive(obj) ||
+        obj->def->id != id) {
+        virObjectUnlock(obj);
+        obj = NULL;
+    }
+
+cleanup:
+    virObjectRWUnlock(doms);
     return obj;
 }
 
@@ -1005,39 +1217,26 @@ virDomainObjPtr virDomainObjListFindByUUID(const virDomainObjListPtr doms,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     virDomainObjPtr obj;
 
-    virObjectLock(doms);
+    virObjectRWLockRead(doms);
     virUUIDFormat(uuid, uuidstr);
 
     obj = virHashLookup(doms->objs, uuidstr);
     if (obj)
         virObjectLock(obj);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
     return obj;
 }
 
-static int virDomainObjListSearchName(const void *payload,
-                                      const void *name ATTRIBUTE_UNUSED,
-                                      const void *data)
-{
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    int want = 0;
-
-    virObjectLock(obj);
-    if (STREQ(obj->def->name, (const char *)data))
-        want = 1;
-    virObjectUnlock(obj);
-    return want;
-}
-
 virDomainObjPtr virDomainObjListFindByName(const virDomainObjListPtr doms,
                                            const char *name)
 {
     virDomainObjPtr obj;
-    virObjectLock(doms);
-    obj = virHashSearch(doms->objs, virDomainObjListSearchName, name);
+
+    virObjectRWLockRead(doms);
+    obj = virHashLookup(doms->objsName, name);
     if (obj)
         virObjectLock(obj);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
     return obj;
 }
 
@@ -2175,7 +2374,7 @@ virDomainObjListAddLocked(virDomainObjListPtr doms,
                               oldDef);
     } else {
         /* UUID does not match, but if a name matches, refuse it */
-        if ((vm = virHashSearch(doms->objs, virDomainObjListSearchName, def->name))) {
+        if ((vm = virHashLookup(doms->objsName, def->name))) {
             virObjectLock(vm);
             virUUIDFormat(vm->def->uuid, uuidstr);
             virReportError(VIR_ERR_OPERATION_FAILED,
@@ -2188,8 +2387,14 @@ virDomainObjListAddLocked(virDomainObjListPtr doms,
             goto cleanup;
         vm->def = def;
 
+        if (virDomainObjListAddIndexes(doms, vm) < 0) {
+            virObjectUnref(vm);
+            return NULL;
+        }
+
         virUUIDFormat(def->uuid, uuidstr);
         if (virHashAddEntry(doms->objs, uuidstr, vm) < 0) {
+            virDomainObjListRemoveIndexes(doms, vm);
             virObjectUnref(vm);
             return NULL;
         }
@@ -2212,9 +2417,9 @@ virDomainObjPtr virDomainObjListAdd(virDomainObjListPtr doms,
 {
     virDomainObjPtr ret;
 
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     ret = virDomainObjListAddLocked(doms, def, xmlopt, flags, oldDef);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
     return ret;
 }
 
@@ -2344,15 +2549,16 @@ void virDomainObjListRemove(virDomainObjListPtr doms,
     virObjectRef(dom);
     virObjectUnlock(dom);
 
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virObjectLock(dom);
+    virDomainObjListRemoveIndexes(doms, dom);
     virHashRemoveEntry(doms->objs, uuidstr);
     virObjectUnlock(dom);
     virObjectUnref(dom);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
 }
 
-/* The caller must hold lock on 'doms' in addition to 'virDomainObjListRemove'
+/* The caller must hold the write lock on 'doms' in addition to 'virDomainObjListRemove'
  * requirements
  *
  * Can be used to remove current element while iterating with
@@ -2364,6 +2570,7 @@ void virDomainObjListRemoveLocked(virDomainObjListPtr doms,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
 
     virUUIDFormat(dom->def->uuid, uuidstr);
+    virDomainObjListRemoveIndexes(doms, dom);
     virObjectUnlock(dom);
 
     virHashRemoveEntry(doms->objs, uuidstr);
@@ -9866,6 +10073,7 @@ void virDomainDiskInsertPreAlloced(virDomainDefPtr def,
                                    virDomainDiskDefPtr disk)
 {
     int idx;
+    int diskIdx = virDiskNameToIndex(disk->dst);
     /* Tenatively plan to insert disk at the end. */
     int insertAt = -1;
 
@@ -9878,8 +10086,7 @@ void virDomainDiskInsertPreAlloced(virDomainDefPtr def,
         /* If bus matches and current disk is after
          * new disk, then new disk should go here */
         if (def->disks[idx]->bus == disk->bus &&
-            (virDiskNameToIndex(def->disks[idx]->dst) >
-             virDiskNameToIndex(disk->dst))) {
+            virDiskNameToIndex(def->disks[idx]->dst) > diskIdx) {
             insertAt = idx;
         } else if (def->disks[idx]->bus == disk->bus &&
                    insertAt == -1) {
@@ -9904,6 +10111,72 @@ void virDomainDiskInsertPreAlloced(virDomainDefPtr def,
 }
 
 
+struct virDomainDiskSortEntry {
+    virDomainDiskDefPtr disk;
+    int bus;    /* order in which the bus first appeared */
+    int idx;    /* virDiskNameToIndex of the target */
+    size_t pos; /* original position, keeps the sort stable */
+};
+
+static int
+virDomainDiskSortCompare(const void *a, const void *b)
+{
+    const struct virDomainDiskSortEntry *ea = a;
+    const struct virDomainDiskSortEntry *eb = b;
+
+    if (ea->bus != eb->bus)
+        return ea->bus < eb->bus ? -1 : 1;
+    if (ea->idx != eb->idx)
+        return ea->idx < eb->idx ? -1 : 1;
+    return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+/*
+ * Put the disks of @def in the order virDomainDiskInsertPreAlloced
+ * would have produced had they been inserted one by one into an
+ * empty list: grouped by bus in order of first appearance, and
+ * sorted by target index within each group. This takes
+ * O(n log n) instead of O(n^2) for the whole list.
+ */
+static int
+virDomainDiskSortNew(virDomainDefPtr def)
+{
+    struct virDomainDiskSortEntry *entries;
+    int busOrder[VIR_DOMAIN_DISK_BUS_LAST];
+    int nbuses = 0;
+    size_t i;
+
+    if (def->ndisks < 2)
+        return 0;
+
+    if (VIR_ALLOC_N(entries, def->ndisks) < 0)
+        return -1;
+
+    for (i = 0; i < VIR_DOMAIN_DISK_BUS_LAST; i++)
+        busOrder[i] = -1;
+
+    for (i = 0; i < def->ndisks; i++) {
+        virDomainDiskDefPtr disk = def->disks[i];
+
+        if (busOrder[disk->bus] < 0)
+            busOrder[disk->bus] = nbuses++;
+
+        entries[i].disk = disk;
+        entries[i].bus = busOrder[disk->bus];
+        entries[i].idx = virDiskNameToIndex(disk->dst);
+        entries[i].pos = i;
+    }
+
+    qsort(entries, def->ndisks, sizeof(*entries), virDomainDiskSortCompare);
+
+    for (i = 0; i < def->ndisks; i++)
+        def->disks[i] = entries[i].disk;
+
+    VIR_FREE(entries);
+    return 0;
+}
+
+
 virDomainDiskDefPtr
 virDomainDiskRemove(virDomainDefPtr def, size_t i)
 {
@@ -10770,6 +11043,47 @@ virDomainDefMaybeAddHostdevSCSIcontroller(virDomainDefPtr def)
     return 0;
 }
 
+/*
+ * Store the @name elements found under the <devices> elements of
+ * @root in @list. This is what evaluating "./devices/@name" yields,
+ * without the cost of a separate XPath query for each device type.
+ *
+ * Returns the number of nodes in @list, or -1 on error
+ */
+static int
+virDomainDefDeviceNodeSet(xmlNodePtr root,
+                          const char *name,
+                          xmlNodePtr **list)
+{
+    xmlNodePtr devices;
+    xmlNodePtr cur;
+    size_t nalloc = 0;
+    size_t n = 0;
+
+    *list = NULL;
+
+    for (devices = root->children; devices; devices = devices->next) {
+        if (devices->type != XML_ELEMENT_NODE || devices->ns ||
+            !xmlStrEqual(devices->name, BAD_CAST "devices"))
+            continue;
+
+        for (cur = devices->children; cur; cur = cur->next) {
+            if (cur->type != XML_ELEMENT_NODE || cur->ns ||
+                !xmlStrEqual(cur->name, BAD_CAST name))
+                continue;
+
+            if (VIR_RESIZE_N(*list, nalloc, n, 1) < 0) {
+                VIR_FREE(*list);
+                return -1;
+            }
+            (*list)[n++] = cur;
+        }
+    }
+
+    return n;
+}
+
+
 static virDomainDefPtr
 virDomainDefParseXML(xmlDocPtr xml,
                      xmlNodePtr root,
@@ -11737,7 +12051,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     def->emulator = virXPathString("string(./devices/emulator[1])", ctxt);
 
     /* analysis of the disk devices */
-    if ((n = virXPathNodeSet("./devices/disk", ctxt, &nodes)) < 0)
+    if ((n = virDomainDefDeviceNodeSet(root, "disk", &nodes)) < 0)
         goto error;
 
     if (n && VIR_ALLOC_N(def->disks, n) < 0)
@@ -11754,12 +12068,15 @@ virDomainDefParseXML(xmlDocPtr xml,
         if (!disk)
             goto error;
 
-        virDomainDiskInsertPreAlloced(def, disk);
+        def->disks[def->ndisks++] = disk;
     }
     VIR_FREE(nodes);
 
+    if (virDomainDiskSortNew(def) < 0)
+        goto error;
+
     /* analysis of the controller devices */
-    if ((n = virXPathNodeSet("./devices/controller", ctxt, &nodes)) < 0)
+    if ((n = virDomainDefDeviceNodeSet(root, "controller", &nodes)) < 0)
         goto error;
 
     if (n && VIR_ALLOC_N(def->controllers, n) < 0)
@@ -11809,7 +12126,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
 
     /* analysis of the resource leases */
-    if ((n = virXPathNodeSet("./devices/lease", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "lease", &nodes)) < 0) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        "%s", _("cannot extract device leases"));
         goto error;
@@ -11826,7 +12143,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the filesystems */
-    if ((n = virXPathNodeSet("./devices/filesystem", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "filesystem", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->fss, n) < 0)
@@ -11842,7 +12159,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the network devices */
-    if ((n = virXPathNodeSet("./devices/interface", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "interface", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->nets, n) < 0)
@@ -11868,7 +12185,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
 
     /* analysis of the smartcard devices */
-    if ((n = virXPathNodeSet("./devices/smartcard", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "smartcard", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->smartcards, n) < 0)
@@ -11886,7 +12203,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
 
     /* analysis of the character devices */
-    if ((n = virXPathNodeSet("./devices/parallel", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "parallel", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->parallels, n) < 0)
@@ -11914,7 +12231,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
     VIR_FREE(nodes);
 
-    if ((n = virXPathNodeSet("./devices/serial", ctxt, &nodes)) < 0)
+    if ((n = virDomainDefDeviceNodeSet(root, "serial", &nodes)) < 0)
         goto error;
 
     if (n && VIR_ALLOC_N(def->serials, n) < 0)
@@ -11942,7 +12259,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
     VIR_FREE(nodes);
 
-    if ((n = virXPathNodeSet("./devices/console", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "console", &nodes)) < 0) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        "%s", _("cannot extract console devices"));
         goto error;
@@ -11964,7 +12281,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
     VIR_FREE(nodes);
 
-    if ((n = virXPathNodeSet("./devices/channel", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "channel", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->channels, n) < 0)
@@ -12005,7 +12322,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
 
     /* analysis of the input devices */
-    if ((n = virXPathNodeSet("./devices/input", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "input", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->inputs, n) < 0)
@@ -12045,7 +12362,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the graphics devices */
-    if ((n = virXPathNodeSet("./devices/graphics", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "graphics", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->graphics, n) < 0)
@@ -12086,7 +12403,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
 
     /* analysis of the sound devices */
-    if ((n = virXPathNodeSet("./devices/sound", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "sound", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->sounds, n) < 0)
@@ -12103,7 +12420,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the video devices */
-    if ((n = virXPathNodeSet("./devices/video", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "video", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->videos, n) < 0)
@@ -12160,7 +12477,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
 
     /* analysis of the host devices */
-    if ((n = virXPathNodeSet("./devices/hostdev", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "hostdev", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_REALLOC_N(def->hostdevs, def->nhostdevs + n) < 0)
@@ -12190,7 +12507,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
     /* analysis of the watchdog devices */
     def->watchdog = NULL;
-    if ((n = virXPathNodeSet("./devices/watchdog", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "watchdog", &nodes)) < 0) {
         goto error;
     }
     if (n > 1) {
@@ -12210,7 +12527,7 @@ virDomainDefParseXML(xmlDocPtr xml,
 
     /* analysis of the memballoon devices */
     def->memballoon = NULL;
-    if ((n = virXPathNodeSet("./devices/memballoon", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "memballoon", &nodes)) < 0) {
         goto error;
     }
     if (n > 1) {
@@ -12229,7 +12546,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
 
     /* Parse the RNG device */
-    if ((n = virXPathNodeSet("./devices/rng", ctxt, &nodes)) < 0)
+    if ((n = virDomainDefDeviceNodeSet(root, "rng", &nodes)) < 0)
         goto error;
 
     if (n > 1) {
@@ -12246,7 +12563,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* Parse the TPM devices */
-    if ((n = virXPathNodeSet("./devices/tpm", ctxt, &nodes)) < 0)
+    if ((n = virDomainDefDeviceNodeSet(root, "tpm", &nodes)) < 0)
         goto error;
 
     if (n > 1) {
@@ -12261,7 +12578,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
     VIR_FREE(nodes);
 
-    if ((n = virXPathNodeSet("./devices/nvram", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "nvram", &nodes)) < 0) {
         goto error;
     }
 
@@ -12279,7 +12596,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     }
 
     /* analysis of the hub devices */
-    if ((n = virXPathNodeSet("./devices/hub", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "hub", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->hubs, n) < 0)
@@ -12302,7 +12619,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the redirected devices */
-    if ((n = virXPathNodeSet("./devices/redirdev", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "redirdev", &nodes)) < 0) {
         goto error;
     }
     if (n && VIR_ALLOC_N(def->redirdevs, n) < 0)
@@ -12326,7 +12643,7 @@ virDomainDefParseXML(xmlDocPtr xml,
     VIR_FREE(nodes);
 
     /* analysis of the redirection filter rules */
-    if ((n = virXPathNodeSet("./devices/redirfilter", ctxt, &nodes)) < 0) {
+    if ((n = virDomainDefDeviceNodeSet(root, "redirfilter", &nodes)) < 0) {
         goto error;
     }
     if (n > 1) {
@@ -17111,6 +17428,33 @@ cleanup:
 }
 
 
+/* Upper bound on threads parsing definitions at startup */
+#define VIR_DOMAIN_LOAD_MAX_WORKERS 16
+
+typedef struct _virDomainObjListLoadData virDomainObjListLoadData;
+typedef virDomainObjListLoadData *virDomainObjListLoadDataPtr;
+struct _virDomainObjListLoadData {
+    virMutex lock;
+    virCond cond;
+    size_t pending; /* files queued but not yet loaded */
+
+    virDomainObjListPtr doms;
+    const char *configDir;
+    const char *autostartDir;
+    int liveStatus;
+    virCapsPtr caps;
+    virDomainXMLOptionPtr xmlopt;
+    unsigned int expectedVirtTypes;
+    virDomainLoadConfigNotify notify;
+    void *opaque;
+};
+
+
+/*
+ * The file is parsed without holding any lock on @doms, only
+ * adding the result takes the write lock, so several configs
+ * can be parsed at once.
+ */
 static virDomainObjPtr
 virDomainObjListLoadConfig(virDomainObjListPtr doms,
                            virCapsPtr caps,
@@ -17141,14 +17485,21 @@ virDomainObjListLoadConfig(virDomainObjListPtr doms,
     if ((autostart = virFileLinkPointsTo(autostartLink, configFile)) < 0)
         goto error;
 
-    if (!(dom = virDomainObjListAddLocked(doms, def, xmlopt, 0, &oldDef)))
+    virObjectRWLockWrite(doms);
+
+    if (!(dom = virDomainObjListAddLocked(doms, def, xmlopt, 0, &oldDef))) {
+        virObjectRWUnlock(doms);
         goto error;
+    }
 
     dom->autostart = autostart;
+    dom->persistent = 1;
 
     if (notify)
         (*notify)(dom, oldDef == NULL, opaque);
 
+    virObjectRWUnlock(doms);
+
     virDomainDefFree(oldDef);
     VIR_FREE(configFile);
     VIR_FREE(autostartLink);
@@ -17187,28 +17538,85 @@ virDomainObjListLoadStatus(virDomainObjListPtr doms,
 
     virUUIDFormat(obj->def->uuid, uuidstr);
 
-    if (virHashLookup(doms->objs, uuidstr) != NULL) {
+    virObjectRWLockWrite(doms);
+
+    if (virHashLookup(doms->objs, uuidstr) != NULL ||
+        virHashLookup(doms->objsName, obj->def->name) != NULL) {
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("unexpected domain %s already exists"),
                        obj->def->name);
-        goto error;
+        goto unlock;
     }
 
-    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0)
-        goto error;
+    if (virDomainObjListAddIndexes(doms, obj) < 0)
+        goto unlock;
+
+    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0) {
+        virDomainObjListRemoveIndexes(doms, obj);
+        goto unlock;
+    }
 
     if (notify)
         (*notify)(obj, 1, opaque);
 
+    virObjectRWUnlock(doms);
+
     VIR_FREE(statusFile);
     return obj;
 
+unlock:
+    virObjectRWUnlock(doms);
 error:
     virObjectUnref(obj);
     VIR_FREE(statusFile);
     return NULL;
 }
 
+/* Thread pool job loading the file named by @jobdata */
+static void
+virDomainObjListLoadWorker(void *jobdata, void *opaque)
+{
+    virDomainObjListLoadDataPtr data = opaque;
+    char *name = jobdata;
+    virDomainObjPtr dom;
+
+    /* NB: ignoring errors, so one malformed config doesn't
+       kill the whole process */
+    VIR_INFO("Loading config file '%s.xml'", name);
+    if (data->liveStatus)
+        dom = virDomainObjListLoadStatus(data->doms,
+                                         data->configDir,
+                                         name,
+                                         data->caps,
+                                         data->xmlopt,
+                                         data->expectedVirtTypes,
+                                         data->notify,
+                                         data->opaque);
+    else
+        dom = virDomainObjListLoadConfig(data->doms,
+                                         data->caps,
+                                         data->xmlopt,
+                                         data->configDir,
+                                         data->autostartDir,
+                                         name,
+                                         data->expectedVirtTypes,
+                                         data->notify,
+                                         data->opaque);
+    if (dom)
+        virObjectUnlock(dom);
+    VIR_FREE(name);
+
+    virMutexLock(&data->lock);
+    if (--data->pending == 0)
+        virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+/*
+ * Configs are parsed on a pool of up to one thread per CPU, which
+ * matters with many domains as parsing dominates daemon startup.
+ * Domains are added to @doms in no particular order.
+ */
 int
 virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
                                const char *configDir,
@@ -17222,6 +17630,15 @@ virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
 {
     DIR *dir;
     struct dirent *entry;
+    virDomainObjListLoadData data = {
+        .doms = doms, .configDir = configDir, .autostartDir = autostartDir,
+        .liveStatus = liveStatus, .caps = caps, .xmlopt = xmlopt,
+        .expectedVirtTypes = expectedVirtTypes, .notify = notify,
+        .opaque = opaque,
+    };
+    virThreadPoolPtr pool = NULL;
+    long ncpus;
+    int ret = -1;
 
     VIR_INFO("Scanning for configs in %s", configDir);
 
@@ -17234,10 +17651,34 @@ virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
         return -1;
     }
 
-    virObjectLock(doms);
+    if (virMutexInit(&data.lock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("cannot initialize mutex"));
+        closedir(dir);
+        return -1;
+    }
+    if (virCondInit(&data.cond) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("cannot initialize condition variable"));
+        virMutexDestroy(&data.lock);
+        closedir(dir);
+        return -1;
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > VIR_DOMAIN_LOAD_MAX_WORKERS)
+        ncpus = VIR_DOMAIN_LOAD_MAX_WORKERS;
+
+    /* Without a pool each file is simply loaded in this thread */
+    if (ncpus > 1 &&
+        !(pool = virThreadPoolNew(0, ncpus, 0,
+                                  virDomainObjListLoadWorker, &data))) {
+        VIR_WARN("Cannot create thread pool, loading configs serially");
+        virResetLastError();
+    }
 
     while ((entry = readdir(dir))) {
-        virDomainObjPtr dom;
+        char *name;
 
         if (entry->d_name[0] == '.')
             continue;
@@ -17245,38 +17686,31 @@ virDomainObjListLoadAllConfigs(virDomainObjListPtr doms,
         if (!virFileStripSuffix(entry->d_name, ".xml"))
             continue;
 
-        /* NB: ignoring errors, so one malformed config doesn't
-           kill the whole process */
-        VIR_INFO("Loading config file '%s.xml'", entry->d_name);
-        if (liveStatus)
-            dom = virDomainObjListLoadStatus(doms,
-                                             configDir,
-                                             entry->d_name,
-                                             caps,
-                                             xmlopt,
-                                             expectedVirtTypes,
-                                             notify,
-                                             opaque);
-        else
-            dom = virDomainObjListLoadConfig(doms,
-                                             caps,
-                                             xmlopt,
-                                             configDir,
-                                             autostartDir,
-                                             entry->d_name,
-                                             expectedVirtTypes,
-                                             notify,
-                                             opaque);
-        if (dom) {
-            virObjectUnlock(dom);
-            if (!liveStatus)
-                dom->persistent = 1;
-        }
+        if (VIR_STRDUP(name, entry->d_name) < 0)
+            goto cleanup;
+
+        virMutexLock(&data.lock);
+        data.pending++;
+        virMutexUnlock(&data.lock);
+
+        if (!pool ||
+            virThreadPoolSendJob(pool, VIR_THREAD_POOL_JOB_NORMAL, name) < 0)
+            virDomainObjListLoadWorker(name, &data);
     }
 
+    ret = 0;
+
+cleanup:
+    virMutexLock(&data.lock);
+    while (data.pending)
+        ignore_value(virCondWait(&data.cond, &data.lock));
+    virMutexUnlock(&data.lock);
+
+    virThreadPoolFree(pool);
+    virCondDestroy(&data.cond);
+    virMutexDestroy(&data.lock);
     closedir(dir);
-    virObjectUnlock(doms);
-    return 0;
+    return ret;
 }
 
 int
@@ -17412,9 +17846,13 @@ virDomainObjListNumOfDomains(virDomainObjListPtr doms,
                              virConnectPtr conn)
 {
     struct virDomainObjListData data = { filter, conn, active, 0 };
-    virObjectLock(doms);
-    virHashForEach(doms->objs, virDomainObjListCount, &data);
-    virObjectUnlock(doms);
+    int ret;
+
+    virObjectRWLockRead(doms);
+    ret = virDomainObjListSnapshotForEach(doms, virDomainObjListCount, &data);
+    virObjectRWUnlock(doms);
+    if (ret < 0)
+        return -1;
     return data.count;
 }
 
@@ -17452,9 +17890,14 @@ virDomainObjListGetActiveIDs(virDomainObjListPtr doms,
 {
     struct virDomainIDData data = { filter, conn,
                                     0, maxids, ids };
-    virObjectLock(doms);
-    virHashForEach(doms->objs, virDomainObjListCopyActiveIDs, &data);
-    virObjectUnlock(doms);
+    int ret;
+
+    virObjectRWLockRead(doms);
+    ret = virDomainObjListSnapshotForEach(doms, virDomainObjListCopyActiveIDs,
+                                          &data);
+    virObjectRWUnlock(doms);
+    if (ret < 0)
+        return -1;
     return data.numids;
 }
 
@@ -17503,10 +17946,14 @@ virDomainObjListGetInactiveNames(virDomainObjListPtr doms,
     struct virDomainNameData data = { filter, conn,
                                       0, 0, maxnames, names };
     size_t i;
-    virObjectLock(doms);
-    virHashForEach(doms->objs, virDomainObjListCopyInactiveNames, &data);
-    virObjectUnlock(doms);
-    if (data.oom) {
+    int ret;
+
+    virObjectRWLockRead(doms);
+    ret = virDomainObjListSnapshotForEach(doms,
+                                          virDomainObjListCopyInactiveNames,
+                                          &data);
+    virObjectRWUnlock(doms);
+    if (ret < 0 || data.oom) {
         for (i = 0; i < data.numnames; i++)
             VIR_FREE(data.names[i]);
         return -1;
@@ -17541,9 +17988,9 @@ virDomainObjListForEach(virDomainObjListPtr doms,
     struct virDomainListIterData data = {
         callback, opaque, 0,
     };
-    virObjectLock(doms);
+    virObjectRWLockWrite(doms);
     virHashForEach(doms->objs, virDomainObjListHelper, &data);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
     return data.ret;
 }
 
@@ -18305,7 +18752,7 @@ virDomainListPopulate(void *payload,
     /* just count the machines */
     if (!data->domains) {
         data->ndomains++;
-        return;
+        goto cleanup;
     }
 
     if (!(dom = virGetDomain(data->conn, vm->def->name, vm->def->uuid))) {
@@ -18339,12 +18786,14 @@ virDomainObjListExport(virDomainObjListPtr doms,
         flags, 0, false
     };
 
-    virObjectLock(doms);
+    virObjectRWLockRead(doms);
     if (domains &&
         VIR_ALLOC_N(data.domains, virHashSize(doms->objs) + 1) < 0)
         goto cleanup;
 
-    virHashForEach(doms->objs, virDomainListPopulate, &data);
+    if (virDomainObjListSnapshotForEach(doms, virDomainListPopulate,
+                                        &data) < 0)
+        goto cleanup;
 
     if (data.error)
         goto cleanup;
@@ -18366,7 +18815,7 @@ cleanup:
     }
 
     VIR_FREE(data.domains);
-    virObjectUnlock(doms);
+    virObjectRWUnlock(doms);
     return ret;
 }
 
@@ -406,6 +406,9 @@ virStoragePoolObjFree(virStoragePoolObjPtr obj)
 
     virStoragePoolObjClearVols(obj);
 
+    if (obj->privateDataFreeFunc)
+        (obj->privateDataFreeFunc)(obj->privateData);
+
     virStoragePoolDefFree(obj->def);
     virStoragePoolDefFree(obj->newDef);
 
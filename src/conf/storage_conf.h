@@ -100,6 +100,9 @@ struct _virStorageVolDef {
     int type; /* enum virStorageVolType */
 
     unsigned int building;
+    /* Bytes of the input handled so far while building from another
+     * volume. Written without the pool lock, so only advisory */
+    unsigned long long buildProgress;
 
     unsigned long long allocation; /* bytes */
     unsigned long long capacity; /* bytes */
@@ -335,6 +338,10 @@ struct _virStoragePoolObj {
     virStoragePoolDefPtr newDef;
 
     virStorageVolDefList volumes;
+
+    /* Backend state kept while the pool is active */
+    void *privateData;
+    virFreeCallback privateDataFreeFunc;
 };
 
 typedef struct _virStoragePoolObjList virStoragePoolObjList;
@@ -1122,6 +1122,20 @@ typedef int
                                      unsigned int flags,
                                      int cancelled);
 
+typedef int
+(*virDrvConnectGetAllDomainStats)(virConnectPtr conn,
+                                  virDomainPtr *doms,
+                                  unsigned int ndoms,
+                                  unsigned int stats,
+                                  virDomainStatsRecordPtr **retStats,
+                                  unsigned int flags);
+
+typedef int
+(*virDrvConnectGetRPCStats)(virConnectPtr conn,
+                            virTypedParameterPtr *params,
+                            int *nparams,
+                            unsigned int flags);
+
 typedef struct _virDriver virDriver;
 typedef virDriver *virDriverPtr;
 
@@ -1332,6 +1346,8 @@ struct _virDriver {
     virDrvDomainMigratePerform3Params domainMigratePerform3Params;
     virDrvDomainMigrateFinish3Params domainMigrateFinish3Params;
     virDrvDomainMigrateConfirm3Params domainMigrateConfirm3Params;
+    virDrvConnectGetAllDomainStats connectGetAllDomainStats;
+    virDrvConnectGetRPCStats connectGetRPCStats;
 };
 
 
@@ -2005,6 +2021,22 @@ typedef int
                     char *data,
                     size_t nbytes);
 
+typedef int
+(*virDrvStreamRecvFlags)(virStreamPtr st,
+                         char *data,
+                         size_t nbytes,
+                         unsigned int flags);
+
+typedef int
+(*virDrvStreamSendHole)(virStreamPtr st,
+                        long long length,
+                        unsigned int flags);
+
+typedef int
+(*virDrvStreamRecvHole)(virStreamPtr st,
+                        long long *length,
+                        unsigned int flags);
+
 typedef int
 (*virDrvStreamEventAddCallback)(virStreamPtr stream,
                                 int events,
@@ -2031,6 +2063,9 @@ typedef virStreamDriver *virStreamDriverPtr;
 struct _virStreamDriver {
     virDrvStreamSend streamSend;
     virDrvStreamRecv streamRecv;
+    virDrvStreamRecvFlags streamRecvFlags;
+    virDrvStreamSendHole streamSendHole;
+    virDrvStreamRecvHole streamRecvHole;
     virDrvStreamEventAddCallback streamEventAddCallback;
     virDrvStreamEventUpdateCallback streamEventUpdateCallback;
     virDrvStreamEventRemoveCallback streamEventRemoveCallback;
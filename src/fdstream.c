@@ -52,6 +52,16 @@ struct virFDStreamData {
     unsigned long long offset;
     unsigned long long length;
 
+    /* In sparse mode @fd is a pipe to the I/O helper, which carries
+     * the file as a series of virFileSparseRecord */
+    bool sparse;
+    virFileSparseRecord rec;    /* record being read or written */
+    size_t recOffset;           /* bytes of @rec transferred so far */
+    bool recPending;            /* @rec still has to be written */
+    unsigned long long dataRemaining; /* payload left of a data record */
+    unsigned long long holeRemaining; /* hole left to hand to the reader */
+    unsigned long long holePending;   /* hole not yet sent to the helper */
+
     int watch;
     int events;         /* events the stream callback is subscribed for */
     bool cbRemoved;
@@ -249,6 +259,82 @@ cleanup:
 }
 
 
+/* Adds a record to be written ahead of the next data */
+static int
+virFDStreamQueueRecord(struct virFDStreamData *fdst,
+                       virFileSparseRecordType type,
+                       unsigned long long length)
+{
+    if (fdst->recPending) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("sparse stream record is still pending"));
+        return -1;
+    }
+
+    memset(&fdst->rec, 0, sizeof(fdst->rec));
+    fdst->rec.type = type;
+    fdst->rec.length = length;
+    fdst->recOffset = 0;
+    fdst->recPending = true;
+    return 0;
+}
+
+/* Writes out what is left of a pending record. Returns 0 once
+ * nothing is pending, -2 if the fd would block, -1 on error */
+static int
+virFDStreamWriteRecord(struct virFDStreamData *fdst)
+{
+    while (fdst->recPending) {
+        ssize_t done = write(fdst->fd,
+                             (char *)&fdst->rec + fdst->recOffset,
+                             sizeof(fdst->rec) - fdst->recOffset);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -2;
+            virReportSystemError(errno, "%s",
+                                 _("cannot write to stream"));
+            return -1;
+        }
+
+        fdst->recOffset += done;
+        if (fdst->recOffset == sizeof(fdst->rec))
+            fdst->recPending = false;
+    }
+
+    return 0;
+}
+
+/* Sends the holes which are still held back, waiting if needed,
+ * since the stream is being finished and won't be called again */
+static int
+virFDStreamFlushSparse(struct virFDStreamData *fdst)
+{
+    if (!fdst->sparse || (!fdst->recPending && !fdst->holePending))
+        return 0;
+
+    if (virSetBlocking(fdst->fd, true) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to set stream to blocking mode"));
+        return -1;
+    }
+
+    if (virFDStreamWriteRecord(fdst) < 0)
+        return -1;
+
+    if (fdst->holePending) {
+        if (virFDStreamQueueRecord(fdst, VIR_FILE_SPARSE_HOLE,
+                                   fdst->holePending) < 0 ||
+            virFDStreamWriteRecord(fdst) < 0)
+            return -1;
+        fdst->holePending = 0;
+    }
+
+    return 0;
+}
+
+
 static int
 virFDStreamCloseInt(virStreamPtr st, bool streamAbort)
 {
@@ -292,7 +378,11 @@ virFDStreamCloseInt(virStreamPtr st, bool streamAbort)
     }
 
     /* mutex locked */
-    ret = VIR_CLOSE(fdst->fd);
+    ret = 0;
+    if (!streamAbort && virFDStreamFlushSparse(fdst) < 0)
+        ret = -1;
+    if (VIR_CLOSE(fdst->fd) < 0)
+        ret = -1;
     if (fdst->cmd) {
         char buf[1024];
         ssize_t len;
@@ -365,6 +455,7 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
 {
     struct virFDStreamData *fdst = st->privateData;
     int ret;
+    int rc;
 
     if (nbytes > INT_MAX) {
         virReportSystemError(ERANGE, "%s",
@@ -392,6 +483,31 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
             nbytes = fdst->length - fdst->offset;
     }
 
+    if (fdst->sparse) {
+        /* Every write starts or continues a data record */
+        if ((rc = virFDStreamWriteRecord(fdst)) < 0)
+            goto cleanup_rc;
+        if (fdst->dataRemaining == 0) {
+            /* Holes held back by virFDStreamSendHole go first */
+            if (fdst->holePending) {
+                if ((rc = virFDStreamQueueRecord(fdst, VIR_FILE_SPARSE_HOLE,
+                                                 fdst->holePending)) < 0)
+                    goto cleanup_rc;
+                fdst->holePending = 0;
+                if ((rc = virFDStreamWriteRecord(fdst)) < 0)
+                    goto cleanup_rc;
+            }
+            if ((rc = virFDStreamQueueRecord(fdst, VIR_FILE_SPARSE_DATA,
+                                             nbytes)) < 0)
+                goto cleanup_rc;
+            fdst->dataRemaining = nbytes;
+            if ((rc = virFDStreamWriteRecord(fdst)) < 0)
+                goto cleanup_rc;
+        }
+        if (nbytes > fdst->dataRemaining)
+            nbytes = fdst->dataRemaining;
+    }
+
 retry:
     ret = write(fdst->fd, bytes, nbytes);
     if (ret < 0) {
@@ -404,20 +520,170 @@ retry:
             virReportSystemError(errno, "%s",
                                  _("cannot write to stream"));
         }
-    } else if (fdst->length) {
-        fdst->offset += ret;
+    } else {
+        if (fdst->length)
+            fdst->offset += ret;
+        if (fdst->sparse)
+            fdst->dataRemaining -= ret;
     }
 
     virMutexUnlock(&fdst->lock);
     return ret;
+
+cleanup_rc:
+    virMutexUnlock(&fdst->lock);
+    return rc;
 }
 
 
-static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+static int
+virFDStreamSendHole(virStreamPtr st,
+                    long long length,
+                    unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+    int ret = -1;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "%s", _("stream is not open"));
+        return -1;
+    }
+
+    virMutexLock(&fdst->lock);
+
+    if (!fdst->sparse) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("stream does not support holes"));
+        goto cleanup;
+    }
+
+    if (fdst->dataRemaining) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("cannot send a hole in the middle of data"));
+        goto cleanup;
+    }
+
+    if (fdst->length) {
+        if (length > fdst->length - fdst->offset) {
+            virReportSystemError(ENOSPC, "%s",
+                                 _("cannot write to stream"));
+            goto cleanup;
+        }
+        fdst->offset += length;
+    }
+
+    /* Not sent right away, so that it gets merged with any
+     * hole that follows */
+    fdst->holePending += length;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&fdst->lock);
+    return ret;
+}
+
+
+/* Reads from the records the helper produces for a sparse file.
+ * Holes are returned as -3 if @stopAtHole is set, and filled
+ * with zeroes otherwise */
+static int
+virFDStreamReadSparse(struct virFDStreamData *fdst,
+                      char *bytes,
+                      size_t nbytes,
+                      bool stopAtHole)
+{
+    ssize_t got;
+
+    while (!fdst->dataRemaining && !fdst->holeRemaining) {
+        got = read(fdst->fd,
+                   (char *)&fdst->rec + fdst->recOffset,
+                   sizeof(fdst->rec) - fdst->recOffset);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -2;
+            virReportSystemError(errno, "%s",
+                                 _("cannot read from stream"));
+            return -1;
+        }
+        if (got == 0) {
+            if (fdst->recOffset == 0)
+                return 0;
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("truncated record in sparse stream"));
+            return -1;
+        }
+
+        fdst->recOffset += got;
+        if (fdst->recOffset < sizeof(fdst->rec))
+            continue;
+        fdst->recOffset = 0;
+
+        switch ((virFileSparseRecordType) fdst->rec.type) {
+        case VIR_FILE_SPARSE_DATA:
+            fdst->dataRemaining = fdst->rec.length;
+            break;
+        case VIR_FILE_SPARSE_HOLE:
+            fdst->holeRemaining = fdst->rec.length;
+            break;
+        default:
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unknown record type %u in sparse stream"),
+                           fdst->rec.type);
+            return -1;
+        }
+    }
+
+    if (fdst->holeRemaining) {
+        if (stopAtHole)
+            return -3;
+        if (nbytes > fdst->holeRemaining)
+            nbytes = fdst->holeRemaining;
+        memset(bytes, 0, nbytes);
+        fdst->holeRemaining -= nbytes;
+        return nbytes;
+    }
+
+    if (nbytes > fdst->dataRemaining)
+        nbytes = fdst->dataRemaining;
+
+retry:
+    got = read(fdst->fd, bytes, nbytes);
+    if (got < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -2;
+        if (errno == EINTR)
+            goto retry;
+        virReportSystemError(errno, "%s",
+                             _("cannot read from stream"));
+        return -1;
+    }
+    if (got == 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("truncated data in sparse stream"));
+        return -1;
+    }
+
+    fdst->dataRemaining -= got;
+    return got;
+}
+
+
+static int
+virFDStreamReadFlags(virStreamPtr st,
+                     char *bytes,
+                     size_t nbytes,
+                     unsigned int flags)
 {
     struct virFDStreamData *fdst = st->privateData;
     int ret;
 
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     if (nbytes > INT_MAX) {
         virReportSystemError(ERANGE, "%s",
                              _("Too many bytes to read from stream"));
@@ -432,6 +698,14 @@ static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
 
     virMutexLock(&fdst->lock);
 
+    /* The helper already stops at the requested length */
+    if (fdst->sparse) {
+        ret = virFDStreamReadSparse(fdst, bytes, nbytes,
+                                    flags & VIR_STREAM_RECV_STOP_AT_HOLE);
+        virMutexUnlock(&fdst->lock);
+        return ret;
+    }
+
     if (fdst->length) {
         if (fdst->length == fdst->offset) {
             virMutexUnlock(&fdst->lock);
@@ -463,9 +737,43 @@ retry:
 }
 
 
+static int
+virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+{
+    return virFDStreamReadFlags(st, bytes, nbytes, 0);
+}
+
+
+static int
+virFDStreamRecvHole(virStreamPtr st,
+                    long long *length,
+                    unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "%s", _("stream is not open"));
+        return -1;
+    }
+
+    virMutexLock(&fdst->lock);
+    *length = fdst->holeRemaining;
+    fdst->holeRemaining = 0;
+    virMutexUnlock(&fdst->lock);
+
+    return 0;
+}
+
+
 static virStreamDriver virFDStreamDrv = {
     .streamSend = virFDStreamWrite,
     .streamRecv = virFDStreamRead,
+    .streamRecvFlags = virFDStreamReadFlags,
+    .streamSendHole = virFDStreamSendHole,
+    .streamRecvHole = virFDStreamRecvHole,
     .streamFinish = virFDStreamClose,
     .streamAbort = virFDStreamAbort,
     .streamEventAddCallback = virFDStreamAddCallback,
@@ -582,7 +890,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
                             unsigned long long offset,
                             unsigned long long length,
                             int oflags,
-                            int mode)
+                            int mode,
+                            bool sparse)
 {
     int fd = -1;
     int childfd = -1;
@@ -590,8 +899,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
     virCommandPtr cmd = NULL;
     int errfd = -1;
 
-    VIR_DEBUG("st=%p path=%s oflags=%x offset=%llu length=%llu mode=%o",
-              st, path, oflags, offset, length, mode);
+    VIR_DEBUG("st=%p path=%s oflags=%x offset=%llu length=%llu mode=%o "
+              "sparse=%d", st, path, oflags, offset, length, mode, sparse);
 
     oflags |= O_NOCTTY;
 
@@ -621,12 +930,19 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         goto error;
     }
 
+    /* Holes can only be found in, or punched into, something
+     * seekable */
+    if (S_ISCHR(sb.st_mode) || S_ISFIFO(sb.st_mode))
+        sparse = false;
+
     /* Thanks to the POSIX i/o model, we can't reliably get
      * non-blocking I/O on block devs/regular files. To
      * support those we need to fork a helper process to do
      * the I/O so we just have a fifo. Or use AIO :-(
+     * The helper is also the one taking care of holes, so
+     * that they don't have to go through the fifo.
      */
-    if ((st->flags & VIR_STREAM_NONBLOCK) &&
+    if (((st->flags & VIR_STREAM_NONBLOCK) || sparse) &&
         (!S_ISCHR(sb.st_mode) &&
          !S_ISFIFO(sb.st_mode))) {
         int fds[2] = { -1, -1 };
@@ -651,6 +967,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         virCommandPassFD(cmd, fd,
                          VIR_COMMAND_PASS_FD_CLOSE_PARENT);
         virCommandAddArgFormat(cmd, "%d", fd);
+        if (sparse)
+            virCommandAddArg(cmd, "--sparse");
 
         if ((oflags & O_ACCMODE) == O_RDONLY) {
             childfd = fds[1];
@@ -672,6 +990,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
     if (virFDStreamOpenInternal(st, fd, cmd, errfd, length) < 0)
         goto error;
 
+    ((struct virFDStreamData *) st->privateData)->sparse = sparse;
+
     return 0;
 
 error:
@@ -698,7 +1018,30 @@ int virFDStreamOpenFile(virStreamPtr st,
     }
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       oflags, 0);
+                                       oflags, 0, false);
+}
+
+/*
+ * Like virFDStreamOpenFile, but holes in @path are passed as
+ * such rather than as zeroes: they are reported to readers of
+ * the stream with virStreamRecvFlags, and the ones written with
+ * virStreamSendHole are skipped, or punched into the file.
+ */
+int virFDStreamOpenFileSparse(virStreamPtr st,
+                              const char *path,
+                              unsigned long long offset,
+                              unsigned long long length,
+                              int oflags)
+{
+    if (oflags & O_CREAT) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Attempt to create %s without specifying mode"),
+                       path);
+        return -1;
+    }
+    return virFDStreamOpenFileInternal(st, path,
+                                       offset, length,
+                                       oflags, 0, true);
 }
 
 int virFDStreamCreateFile(virStreamPtr st,
@@ -710,7 +1053,7 @@ int virFDStreamCreateFile(virStreamPtr st,
 {
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       oflags | O_CREAT, mode);
+                                       oflags | O_CREAT, mode, false);
 }
 
 int virFDStreamSetInternalCloseCb(virStreamPtr st,
@@ -14744,12 +14744,19 @@ error:
  * @stream: stream to use as output
  * @offset: position in @vol to start reading from
  * @length: limit on amount of data to download
- * @flags: extra flags; not used yet, so callers should always pass 0
+ * @flags: bitwise-OR of virStorageVolDownloadFlags
  *
  * Download the content of the volume as a stream. If @length
  * is zero, then the remaining contents of the volume after
  * @offset will be downloaded.
  *
+ * If VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM is set in @flags,
+ * holes in the volume are not transferred as zeroes. The reader
+ * finds them by calling virStreamRecvFlags() with
+ * VIR_STREAM_RECV_STOP_AT_HOLE and then virStreamRecvHole().
+ * A reader which does not care about holes can keep using
+ * virStreamRecv(), which returns them as zeroes.
+ *
  * This call sets up an asynchronous stream; subsequent use of
  * stream APIs is necessary to transfer the actual data,
  * determine how much data is successfully transferred, and
@@ -14813,7 +14820,7 @@ error:
  * @stream: stream to use as input
  * @offset: position to start writing to
  * @length: limit on amount of data to upload
- * @flags: extra flags; not used yet, so callers should always pass 0
+ * @flags: bitwise-OR of virStorageVolUploadFlags
  *
  * Upload new content to the volume from a stream. This call
  * will fail if @offset + @length exceeds the size of the
@@ -14821,6 +14828,11 @@ error:
  * will be raised if an attempt is made to upload greater
  * than @length bytes of data.
  *
+ * If VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM is set in @flags,
+ * the writer may call virStreamSendHole() in place of sending
+ * runs of zeroes, and the volume is left sparse where the
+ * storage allows it.
+ *
  * This call sets up an asynchronous stream; subsequent use of
  * stream APIs is necessary to transfer the actual data,
  * determine how much data is successfully transferred, and
@@ -15082,7 +15094,9 @@ virStorageVolRef(virStorageVolPtr vol)
  * @info: pointer at which to store info
  *
  * Fetches volatile information about the storage
- * volume such as its current allocation
+ * volume such as its current allocation. While the volume is
+ * being created by virStorageVolCreateXMLFrom, the allocation
+ * reports how much of the source volume has been copied so far.
  *
  * Returns 0 on success, or -1 on failure
  */
@@ -17165,6 +17179,192 @@ error:
 }
 
 
+/**
+ * virStreamRecvFlags:
+ * @stream: pointer to the stream object
+ * @data: buffer to read into from stream
+ * @nbytes: size of @data buffer
+ * @flags: bitwise-OR of virStreamRecvFlagsValues
+ *
+ * Reads a series of bytes from the stream. This is the same as
+ * virStreamRecv() except for the @flags argument.
+ *
+ * If @flags contains VIR_STREAM_RECV_STOP_AT_HOLE and the stream
+ * is positioned at a hole, -3 is returned and no data is read.
+ * The caller should then call virStreamRecvHole() to learn the
+ * size of the hole and skip over it. Without this flag, holes
+ * are returned as zeroes. Holes only show up in sparse streams,
+ * for example from virStorageVolDownload() with
+ * VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM.
+ *
+ * Returns the number of bytes read, which may be less
+ * than requested.
+ *
+ * Returns 0 when the end of the stream is reached, at
+ * which time the caller should invoke virStreamFinish()
+ * to get confirmation of stream completion.
+ *
+ * Returns -1 upon error, at which time the stream will
+ * be marked as aborted, and the caller should now release
+ * the stream with virStreamFree.
+ *
+ * Returns -2 if there is no data pending to be read & the
+ * stream is marked as non-blocking.
+ *
+ * Returns -3 if there is a hole in the stream and the caller
+ * requested to stop at holes.
+ */
+int
+virStreamRecvFlags(virStreamPtr stream,
+                   char *data,
+                   size_t nbytes,
+                   unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, data=%p, nbytes=%zu, flags=%x",
+              stream, data, nbytes, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    virCheckNonNullArgGoto(data, error);
+
+    if (stream->driver &&
+        stream->driver->streamRecvFlags) {
+        int ret;
+        ret = (stream->driver->streamRecvFlags)(stream, data, nbytes, flags);
+        if (ret == -2 || ret == -3)
+            return ret;
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    /* A driver without sparse support never has holes to stop at */
+    if (stream->driver &&
+        stream->driver->streamRecv) {
+        int ret;
+        ret = (stream->driver->streamRecv)(stream, data, nbytes);
+        if (ret == -2)
+            return -2;
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
+
+/**
+ * virStreamSendHole:
+ * @stream: pointer to the stream object
+ * @length: number of bytes to skip
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Skips @length bytes in the stream, which the receiving end
+ * treats as a run of zeroes it does not need to store. This can
+ * only be used with sparse streams, for example one passed to
+ * virStorageVolUpload() with VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM.
+ * Consecutive holes may be merged by the stream.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virStreamSendHole(virStreamPtr stream,
+                  long long length,
+                  unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, length=%lld, flags=%x",
+              stream, length, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (length < 0) {
+        virReportInvalidArg(length,
+                            _("length in %s must not be negative"),
+                            __FUNCTION__);
+        goto error;
+    }
+
+    if (stream->driver &&
+        stream->driver->streamSendHole) {
+        int ret;
+        ret = (stream->driver->streamSendHole)(stream, length, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
+
+/**
+ * virStreamRecvHole:
+ * @stream: pointer to the stream object
+ * @length: return the size of the hole, in bytes
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Consumes the hole the stream is positioned at, as signalled by
+ * virStreamRecvFlags() returning -3, and stores its size in
+ * @length. The stream then continues with the data following the
+ * hole. If the stream is not at a hole, @length is set to 0.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virStreamRecvHole(virStreamPtr stream,
+                  long long *length,
+                  unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, length=%p, flags=%x",
+              stream, length, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    virCheckNonNullArgGoto(length, error);
+
+    if (stream->driver &&
+        stream->driver->streamRecvHole) {
+        int ret;
+        ret = (stream->driver->streamRecvHole)(stream, length, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
 /**
  * virStreamSendAll:
  * @stream: pointer to the stream object
@@ -21966,3 +22166,371 @@ error:
     virDispatchError(dom->conn);
     return -1;
 }
+
+
+/**
+ * virConnectGetAllDomainStats:
+ * @conn: pointer to the hypervisor connection
+ * @stats: stats to return, binary-OR of virDomainStatsTypes
+ * @retStats: Pointer that will be filled with the array of returned stats
+ * @flags: extra flags; binary-OR of virConnectGetAllDomainStatsFlags
+ *
+ * Query statistics for all domains on a given connection in a single
+ * call.  This is much cheaper than querying each domain and each of its
+ * devices individually, as the hypervisor driver is able to gather all
+ * the data in one pass.
+ *
+ * Report statistics of various parameters for a running VM according to
+ * @stats field. The statistics are returned as an array of structures for
+ * each queried domain. The structure contains an array of typed parameters
+ * containing the individual statistics. The typed parameter name for each
+ * statistic field consists of a dot-separated string containing name of
+ * the requested group followed by a group specific description of the
+ * statistic value.
+ *
+ * The statistic groups are enabled using the @stats parameter which is a
+ * binary-OR of enum virDomainStatsTypes. The following groups are available
+ * (although not necessarily implemented for each hypervisor):
+ *
+ * VIR_DOMAIN_STATS_STATE: Return domain state and reason for entering that
+ * state. The typed parameter keys are in this format:
+ * "state.state" - state of the VM, returned as int from virDomainState enum
+ * "state.reason" - reason for entering given state, returned as int from
+ *                  virDomain*Reason enum corresponding to given state.
+ *
+ * VIR_DOMAIN_STATS_CPU_TOTAL: Return CPU statistics and usage information.
+ * The typed parameter keys are in this format:
+ * "cpu.time" - total cpu time spent for this domain in nanoseconds
+ *              as unsigned long long.
+ * "cpu.user" - user cpu time spent in nanoseconds as unsigned long long.
+ * "cpu.system" - system cpu time spent in nanoseconds as unsigned long long.
+ *
+ * VIR_DOMAIN_STATS_BALLOON: Return memory balloon device information.
+ * The typed parameter keys are in this format:
+ * "balloon.current" - the memory in kiB currently used
+ *                     as unsigned long long.
+ * "balloon.maximum" - the maximum memory in kiB allowed
+ *                     as unsigned long long.
+ *
+ * VIR_DOMAIN_STATS_VCPU: Return virtual CPU statistics.
+ * The typed parameter keys are in this format:
+ * "vcpu.current" - current number of online virtual CPUs as unsigned int.
+ * "vcpu.maximum" - maximum number of online virtual CPUs as unsigned int.
+ * "vcpu.<num>.state" - state of the virtual CPU <num>, as int
+ *                      from virVcpuState enum.
+ * "vcpu.<num>.time" - virtual cpu time spent by virtual CPU <num>
+ *                     as unsigned long long.
+ *
+ * VIR_DOMAIN_STATS_INTERFACE: Return network interface statistics.
+ * The typed parameter keys are in this format:
+ * "net.count" - number of network interfaces on this domain
+ *               as unsigned int.
+ * "net.<num>.name" - name of the interface <num> as string.
+ * "net.<num>.rx.bytes" - bytes received as unsigned long long.
+ * "net.<num>.rx.pkts" - packets received as unsigned long long.
+ * "net.<num>.rx.errs" - receive errors as unsigned long long.
+ * "net.<num>.rx.drop" - receive packets dropped as unsigned long long.
+ * "net.<num>.tx.bytes" - bytes transmitted as unsigned long long.
+ * "net.<num>.tx.pkts" - packets transmitted as unsigned long long.
+ * "net.<num>.tx.errs" - transmission errors as unsigned long long.
+ * "net.<num>.tx.drop" - transmit packets dropped as unsigned long long.
+ *
+ * VIR_DOMAIN_STATS_BLOCK: Return block devices statistics.
+ * The typed parameter keys are in this format:
+ * "block.count" - number of block devices on this domain
+ *                 as unsigned int.
+ * "block.<num>.name" - name of the block device <num> as string.
+ *                      matches the target name (vda/sda/hda) of the
+ *                      block device.
+ * "block.<num>.rd.reqs" - number of read requests as unsigned long long.
+ * "block.<num>.rd.bytes" - number of read bytes as unsigned long long.
+ * "block.<num>.rd.times" - total time (ns) spent on reads as
+ *                          unsigned long long.
+ * "block.<num>.wr.reqs" - number of write requests as unsigned long long.
+ * "block.<num>.wr.bytes" - number of written bytes as unsigned long long.
+ * "block.<num>.wr.times" - total time (ns) spent on writes as
+ *                          unsigned long long.
+ * "block.<num>.fl.reqs" - total flush requests as unsigned long long.
+ * "block.<num>.fl.times" - total time (ns) spent on cache flushing as
+ *                          unsigned long long.
+ *
+ * Using 0 for @stats returns all stats groups supported by the given
+ * hypervisor.
+ *
+ * Specifying VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS as @flags makes
+ * the function return error in case some of the stat types in @stats were
+ * not recognized by the daemon.  Without the flag, groups that could not
+ * be gathered for a particular domain are silently omitted from its record.
+ *
+ * Similarly to virConnectListAllDomains, @flags can contain various flags to
+ * filter the list of domains to provide stats for.
+ *
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE selects online domains while
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE selects offline ones.
+ *
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_PERSISTENT and
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_TRANSIENT allow to filter the list
+ * according to their persistence.
+ *
+ * To filter the list of VMs by domain state @flags can contain
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_RUNNING,
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_PAUSED,
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_SHUTOFF and/or
+ * VIR_CONNECT_GET_ALL_DOMAINS_STATS_OTHER for all other states.
+ *
+ * Returns the count of returned statistics structures on success, -1 on
+ * error. The requested data are returned in the @retStats parameter. The
+ * returned array should be freed by the caller. See
+ * virDomainStatsRecordListFree.
+ */
+int
+virConnectGetAllDomainStats(virConnectPtr conn,
+                            unsigned int stats,
+                            virDomainStatsRecordPtr **retStats,
+                            unsigned int flags)
+{
+    int ret = -1;
+
+    VIR_DEBUG("conn=%p, stats=0x%x, retStats=%p, flags=0x%x",
+              conn, stats, retStats, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    virCheckNonNullArgGoto(retStats, error);
+    *retStats = NULL;
+
+    if (!conn->driver->connectGetAllDomainStats) {
+        virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+        goto error;
+    }
+
+    ret = conn->driver->connectGetAllDomainStats(conn, NULL, 0, stats,
+                                                 retStats, flags);
+    if (ret < 0)
+        goto error;
+
+    return ret;
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+
+/**
+ * virDomainListGetStats:
+ * @doms: NULL terminated array of domains
+ * @stats: stats to return, binary-OR of virDomainStatsTypes
+ * @retStats: Pointer that will be filled with the array of returned stats
+ * @flags: extra flags; binary-OR of virConnectGetAllDomainStatsFlags
+ *
+ * Query statistics for domains provided by @doms. Note that all domains in
+ * @doms must share the same connection.
+ *
+ * Report statistics of various parameters for a running VM according to
+ * @stats field. The statistics are returned as an array of structures for
+ * each queried domain. The structure contains an array of typed parameters
+ * containing the individual statistics. The typed parameter name for each
+ * statistic field consists of a dot-separated string containing name of
+ * the requested group followed by a group specific description of the
+ * statistic value.
+ *
+ * The statistic groups are enabled using the @stats parameter which is a
+ * binary-OR of enum virDomainStatsTypes. The stats groups are documented
+ * in virConnectGetAllDomainStats.
+ *
+ * Using 0 for @stats returns all stats groups supported by the given
+ * hypervisor.
+ *
+ * Specifying VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS as @flags makes
+ * the function return error in case some of the stat types in @stats were
+ * not recognized by the daemon.
+ *
+ * Note that any of the domain list filtering flags in @flags will be rejected
+ * by this function.
+ *
+ * Returns the count of returned statistics structures on success, -1 on
+ * error. The requested data are returned in the @retStats parameter. The
+ * returned array should be freed by the caller. See
+ * virDomainStatsRecordListFree.  Note that the count of returned stats may
+ * be less than the domain count provided via @doms.
+ */
+int
+virDomainListGetStats(virDomainPtr *doms,
+                      unsigned int stats,
+                      virDomainStatsRecordPtr **retStats,
+                      unsigned int flags)
+{
+    virConnectPtr conn = NULL;
+    virDomainPtr *nextdom = doms;
+    unsigned int ndoms = 0;
+    int ret = -1;
+
+    VIR_DEBUG("doms=%p, stats=0x%x, retStats=%p, flags=0x%x",
+              doms, stats, retStats, flags);
+
+    virResetLastError();
+
+    virCheckNonNullArgGoto(doms, error);
+    virCheckNonNullArgGoto(retStats, error);
+
+    *retStats = NULL;
+
+    if (!*doms) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("doms array in %s must contain at least one domain"),
+                       __FUNCTION__);
+        goto error;
+    }
+
+    conn = doms[0]->conn;
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!conn->driver->connectGetAllDomainStats) {
+        virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+        goto error;
+    }
+
+    while (*nextdom) {
+        virDomainPtr dom = *nextdom;
+
+        if (!VIR_IS_CONNECTED_DOMAIN(dom)) {
+            virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+            goto error;
+        }
+
+        if (dom->conn != conn) {
+            virReportError(VIR_ERR_INVALID_ARG,
+                           _("domains in 'doms' array must belong to a "
+                             "single connection in %s"), __FUNCTION__);
+            goto error;
+        }
+
+        ndoms++;
+        nextdom++;
+    }
+
+    ret = conn->driver->connectGetAllDomainStats(conn, doms, ndoms,
+                                                 stats, retStats, flags);
+    if (ret < 0)
+        goto error;
+
+    return ret;
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+
+/**
+ * virDomainStatsRecordListFree:
+ * @stats: NULL terminated array of virDomainStatsRecords to free
+ *
+ * Convenience function to free a list of domain stats returned by
+ * virDomainListGetStats and virConnectGetAllDomainStats.
+ */
+void
+virDomainStatsRecordListFree(virDomainStatsRecordPtr *stats)
+{
+    virDomainStatsRecordPtr *next;
+
+    if (!stats)
+        return;
+
+    for (next = stats; *next; next++) {
+        virTypedParamsFree((*next)->params, (*next)->nparams);
+        virDomainFree((*next)->dom);
+        VIR_FREE(*next);
+    }
+
+    VIR_FREE(stats);
+}
+
+
+/**
+ * virConnectGetRPCStats:
+ * @conn: pointer to the hypervisor connection
+ * @params: pointer that will be filled with an array of statistics
+ * @nparams: pointer that will be filled with the size of @params
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Query statistics about the RPC server which handles @conn, which is
+ * the libvirtd the connection is talking to. This is only supported
+ * for connections going through the remote driver.
+ *
+ * The statistics of the worker pool are reported as
+ * "workers.min", "workers.max", "workers.priority", "workers.current"
+ * and "workers.free", along with the number of calls waiting for a
+ * worker as "jobs.queued", all as unsigned int.
+ *
+ * Every RPC procedure which was called at least once is then reported
+ * under "rpc.<program>.<procedure>." where <program> is the program
+ * number in hex and <procedure> is the name of the procedure, or its
+ * number if the name is unknown. The fields, all unsigned long long, are:
+ *
+ * "calls" - number of completed calls
+ * "errors" - number of calls which failed
+ * "queued" - number of calls waiting for a worker
+ * "wait" - total time calls spent waiting for a worker in microseconds
+ * "service" - total time spent running calls in microseconds
+ * "bytes_in" - total size of the calls in bytes
+ * "bytes_out" - total size of the replies in bytes
+ * "lane" - which queue the next call will go to: 0 for calls which may
+ *          block, 1 for high priority calls and 2 for calls which
+ *          have proven cheap enough to skip ahead of the others
+ * "hist.<bound>" - number of calls whose service time was at most
+ *                  <bound> microseconds and above the previous bound
+ * "hist.inf" - number of calls slower than the largest bound
+ *
+ * The returned @params should be freed with virTypedParamsFree.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virConnectGetRPCStats(virConnectPtr conn,
+                      virTypedParameterPtr *params,
+                      int *nparams,
+                      unsigned int flags)
+{
+    VIR_DEBUG("conn=%p, params=%p, nparams=%p, flags=%x",
+              conn, params, nparams, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    virCheckNonNullArgGoto(params, error);
+    virCheckNonNullArgGoto(nparams, error);
+    *params = NULL;
+    *nparams = 0;
+
+    if (conn->driver->connectGetRPCStats) {
+        int ret;
+        ret = conn->driver->connectGetRPCStats(conn, params, nparams, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
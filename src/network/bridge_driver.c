@@ -1540,10 +1540,18 @@ networkRefreshDaemons(virNetworkDriverStatePtr driver)
 static void
 networkReloadFirewallRules(virNetworkDriverStatePtr driver)
 {
+    virNetworkObjPtr *networks = NULL;
+    size_t nnetworks = 0;
     size_t i;
 
     VIR_INFO("Reloading iptables rules");
 
+    if (driver->networks.count == 0 ||
+        VIR_ALLOC_N(networks, driver->networks.count) < 0)
+        return;
+
+    /* Networks are locked in list order and stay locked until their
+     * rules are back, so they cannot be stopped in between. */
     for (i = 0; i < driver->networks.count; i++) {
         virNetworkObjPtr network = driver->networks.objs[i];
 
@@ -1555,13 +1563,20 @@ networkReloadFirewallRules(virNetworkDriverStatePtr driver)
             /* Only the three L3 network types that are configured by libvirt
              * need to have iptables rules reloaded.
              */
-            networkRemoveFirewallRules(network);
-            if (networkAddFirewallRules(network) < 0) {
-                /* failed to add but already logged */
-            }
+            networks[nnetworks++] = network;
+        } else {
+            virNetworkObjUnlock(network);
         }
-        virNetworkObjUnlock(network);
     }
+
+    if (nnetworks &&
+        networkRefreshFirewallRules(networks, nnetworks) < 0) {
+        /* failed to add but already logged */
+    }
+
+    for (i = 0; i < nnetworks; i++)
+        virNetworkObjUnlock(networks[i]);
+    VIR_FREE(networks);
 }
 
 /* Enable IP Forwarding. Return 0 for success, -1 for failure. */
@@ -2750,8 +2765,7 @@ networkUpdate(virNetworkPtr net,
             network->def->forward.type == VIR_NETWORK_FORWARD_NAT ||
             network->def->forward.type == VIR_NETWORK_FORWARD_ROUTE)) {
             /* these could affect the iptables rules */
-            networkRemoveFirewallRules(network);
-            if (networkAddFirewallRules(network) < 0)
+            if (networkRefreshFirewallRules(&network, 1) < 0)
                 goto cleanup;
 
         }
@@ -127,7 +127,8 @@ out:
     return ret;
 }
 
-int networkAddMasqueradingFirewallRules(virNetworkObjPtr network,
+int networkAddMasqueradingFirewallRules(iptablesTransactionPtr trans,
+                                        virNetworkObjPtr network,
                                         virNetworkIpDefPtr ipdef)
 {
     int prefix = virNetworkIpDefPrefix(ipdef);
@@ -137,32 +138,26 @@ int networkAddMasqueradingFirewallRules(virNetworkObjPtr network,
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("Invalid prefix or netmask for '%s'"),
                        network->def->bridge);
-        goto masqerr1;
+        return -1;
     }
 
     /* allow forwarding packets from the bridge interface */
-    if (iptablesAddForwardAllowOut(&ipdef->address,
+    if (iptablesAddForwardAllowOut(trans,
+                                   &ipdef->address,
                                    prefix,
                                    network->def->bridge,
-                                   forwardIf) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow forwarding from '%s'"),
-                       network->def->bridge);
-        goto masqerr1;
-    }
+                                   forwardIf) < 0)
+        return -1;
 
     /* allow forwarding packets to the bridge interface if they are
      * part of an existing connection
      */
-    if (iptablesAddForwardAllowRelatedIn(&ipdef->address,
+    if (iptablesAddForwardAllowRelatedIn(trans,
+                                         &ipdef->address,
                                          prefix,
                                          network->def->bridge,
-                                         forwardIf) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow forwarding to '%s'"),
-                       network->def->bridge);
-        goto masqerr2;
-    }
+                                         forwardIf) < 0)
+        return -1;
 
     /*
      * Enable masquerading.
@@ -188,124 +183,83 @@ int networkAddMasqueradingFirewallRules(virNetworkObjPtr network,
      */
 
     /* First the generic masquerade rule for other protocols */
-    if (iptablesAddForwardMasquerade(&ipdef->address,
+    if (iptablesAddForwardMasquerade(trans,
+                                     &ipdef->address,
                                      prefix,
                                      forwardIf,
                                      &network->def->forward.addr,
                                      &network->def->forward.port,
-                                     NULL) < 0) {
-        if (forwardIf)
-            virReportError(VIR_ERR_SYSTEM_ERROR,
-                           _("failed to add iptables rule to enable masquerading to %s"),
-                           forwardIf);
-        else
-            virReportError(VIR_ERR_SYSTEM_ERROR, "%s",
-                           _("failed to add iptables rule to enable masquerading"));
-        goto masqerr3;
-    }
+                                     NULL) < 0)
+        return -1;
 
     /* UDP with a source port restriction */
-    if (iptablesAddForwardMasquerade(&ipdef->address,
+    if (iptablesAddForwardMasquerade(trans,
+                                     &ipdef->address,
                                      prefix,
                                      forwardIf,
                                      &network->def->forward.addr,
                                      &network->def->forward.port,
-                                     "udp") < 0) {
-        if (forwardIf)
-            virReportError(VIR_ERR_SYSTEM_ERROR,
-                           _("failed to add iptables rule to enable UDP masquerading to %s"),
-                           forwardIf);
-        else
-            virReportError(VIR_ERR_SYSTEM_ERROR, "%s",
-                           _("failed to add iptables rule to enable UDP masquerading"));
-        goto masqerr4;
-    }
+                                     "udp") < 0)
+        return -1;
 
     /* TCP with a source port restriction */
-    if (iptablesAddForwardMasquerade(&ipdef->address,
+    if (iptablesAddForwardMasquerade(trans,
+                                     &ipdef->address,
                                      prefix,
                                      forwardIf,
                                      &network->def->forward.addr,
                                      &network->def->forward.port,
-                                     "tcp") < 0) {
-        if (forwardIf)
-            virReportError(VIR_ERR_SYSTEM_ERROR,
-                           _("failed to add iptables rule to enable TCP masquerading to %s"),
-                           forwardIf);
-        else
-            virReportError(VIR_ERR_SYSTEM_ERROR, "%s",
-                           _("failed to add iptables rule to enable TCP masquerading"));
-        goto masqerr5;
-    }
+                                     "tcp") < 0)
+        return -1;
 
     return 0;
-
- masqerr5:
-    iptablesRemoveForwardMasquerade(&ipdef->address,
-                                    prefix,
-                                    forwardIf,
-                                    &network->def->forward.addr,
-                                    &network->def->forward.port,
-                                    "udp");
- masqerr4:
-    iptablesRemoveForwardMasquerade(&ipdef->address,
-                                    prefix,
-                                    forwardIf,
-                                    &network->def->forward.addr,
-                                    &network->def->forward.port,
-                                    NULL);
- masqerr3:
-    iptablesRemoveForwardAllowRelatedIn(&ipdef->address,
-                                        prefix,
-                                        network->def->bridge,
-                                        forwardIf);
- masqerr2:
-    iptablesRemoveForwardAllowOut(&ipdef->address,
-                                  prefix,
-                                  network->def->bridge,
-                                  forwardIf);
- masqerr1:
-    return -1;
 }
 
-void networkRemoveMasqueradingFirewallRules(virNetworkObjPtr network,
+void networkRemoveMasqueradingFirewallRules(iptablesTransactionPtr trans,
+                                            virNetworkObjPtr network,
                                             virNetworkIpDefPtr ipdef)
 {
     int prefix = virNetworkIpDefPrefix(ipdef);
     const char *forwardIf = virNetworkDefForwardIf(network->def, 0);
 
     if (prefix >= 0) {
-        iptablesRemoveForwardMasquerade(&ipdef->address,
+        iptablesRemoveForwardMasquerade(trans,
+                                        &ipdef->address,
                                         prefix,
                                         forwardIf,
                                         &network->def->forward.addr,
                                         &network->def->forward.port,
                                         "tcp");
-        iptablesRemoveForwardMasquerade(&ipdef->address,
+        iptablesRemoveForwardMasquerade(trans,
+                                        &ipdef->address,
                                         prefix,
                                         forwardIf,
                                         &network->def->forward.addr,
                                         &network->def->forward.port,
                                         "udp");
-        iptablesRemoveForwardMasquerade(&ipdef->address,
+        iptablesRemoveForwardMasquerade(trans,
+                                        &ipdef->address,
                                         prefix,
                                         forwardIf,
                                         &network->def->forward.addr,
                                         &network->def->forward.port,
                                         NULL);
 
-        iptablesRemoveForwardAllowRelatedIn(&ipdef->address,
+        iptablesRemoveForwardAllowRelatedIn(trans,
+                                            &ipdef->address,
                                             prefix,
                                             network->def->bridge,
                                             forwardIf);
-        iptablesRemoveForwardAllowOut(&ipdef->address,
+        iptablesRemoveForwardAllowOut(trans,
+                                      &ipdef->address,
                                       prefix,
                                       network->def->bridge,
                                       forwardIf);
     }
 }
 
-int networkAddRoutingFirewallRules(virNetworkObjPtr network,
+int networkAddRoutingFirewallRules(iptablesTransactionPtr trans,
+                                   virNetworkObjPtr network,
                                    virNetworkIpDefPtr ipdef)
 {
     int prefix = virNetworkIpDefPrefix(ipdef);
@@ -315,55 +269,44 @@ int networkAddRoutingFirewallRules(virNetworkObjPtr network,
         virReportError(VIR_ERR_INTERNAL_ERROR,
                        _("Invalid prefix or netmask for '%s'"),
                        network->def->bridge);
-        goto routeerr1;
+        return -1;
     }
 
     /* allow routing packets from the bridge interface */
-    if (iptablesAddForwardAllowOut(&ipdef->address,
+    if (iptablesAddForwardAllowOut(trans,
+                                   &ipdef->address,
                                    prefix,
                                    network->def->bridge,
-                                   forwardIf) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow routing from '%s'"),
-                       network->def->bridge);
-        goto routeerr1;
-    }
+                                   forwardIf) < 0)
+        return -1;
 
     /* allow routing packets to the bridge interface */
-    if (iptablesAddForwardAllowIn(&ipdef->address,
+    if (iptablesAddForwardAllowIn(trans,
+                                  &ipdef->address,
                                   prefix,
                                   network->def->bridge,
-                                  forwardIf) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow routing to '%s'"),
-                       network->def->bridge);
-        goto routeerr2;
-    }
+                                  forwardIf) < 0)
+        return -1;
 
     return 0;
-
-routeerr2:
-    iptablesRemoveForwardAllowOut(&ipdef->address,
-                                  prefix,
-                                  network->def->bridge,
-                                  forwardIf);
-routeerr1:
-    return -1;
 }
 
-void networkRemoveRoutingFirewallRules(virNetworkObjPtr network,
+void networkRemoveRoutingFirewallRules(iptablesTransactionPtr trans,
+                                       virNetworkObjPtr network,
                                        virNetworkIpDefPtr ipdef)
 {
     int prefix = virNetworkIpDefPrefix(ipdef);
     const char *forwardIf = virNetworkDefForwardIf(network->def, 0);
 
     if (prefix >= 0) {
-        iptablesRemoveForwardAllowIn(&ipdef->address,
+        iptablesRemoveForwardAllowIn(trans,
+                                     &ipdef->address,
                                      prefix,
                                      network->def->bridge,
                                      forwardIf);
 
-        iptablesRemoveForwardAllowOut(&ipdef->address,
+        iptablesRemoveForwardAllowOut(trans,
+                                      &ipdef->address,
                                       prefix,
                                       network->def->bridge,
                                       forwardIf);
@@ -376,7 +319,8 @@ void networkRemoveRoutingFirewallRules(virNetworkObjPtr network,
  * If any IPv6 addresses are defined, then add the rules for regular operation.
  */
 static int
-networkAddGeneralIp6tablesRules(virNetworkObjPtr network)
+networkAddGeneralIp6tablesRules(iptablesTransactionPtr trans,
+                                virNetworkObjPtr network)
 {
 
     if (!virNetworkDefGetIpByIndex(network->def, AF_INET6, 0) &&
@@ -386,93 +330,57 @@ networkAddGeneralIp6tablesRules(virNetworkObjPtr network)
 
     /* Catch all rules to block forwarding to/from bridges */
 
-    if (iptablesAddForwardRejectOut(AF_INET6, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to block outbound traffic from '%s'"),
-                       network->def->bridge);
-        goto err1;
-    }
+    if (iptablesAddForwardRejectOut(trans, AF_INET6, network->def->bridge) < 0)
+        return -1;
 
-    if (iptablesAddForwardRejectIn(AF_INET6, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to block inbound traffic to '%s'"),
-                       network->def->bridge);
-        goto err2;
-    }
+    if (iptablesAddForwardRejectIn(trans, AF_INET6, network->def->bridge) < 0)
+        return -1;
 
     /* Allow traffic between guests on the same bridge */
-    if (iptablesAddForwardAllowCross(AF_INET6, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to allow cross bridge traffic on '%s'"),
-                       network->def->bridge);
-        goto err3;
-    }
+    if (iptablesAddForwardAllowCross(trans, AF_INET6, network->def->bridge) < 0)
+        return -1;
 
     /* if no IPv6 addresses are defined, we are done. */
     if (!virNetworkDefGetIpByIndex(network->def, AF_INET6, 0))
         return 0;
 
     /* allow DNS over IPv6 */
-    if (iptablesAddTcpInput(AF_INET6, network->def->bridge, 53) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to allow DNS requests from '%s'"),
-                       network->def->bridge);
-        goto err4;
-    }
+    if (iptablesAddTcpInput(trans, AF_INET6, network->def->bridge, 53) < 0)
+        return -1;
 
-    if (iptablesAddUdpInput(AF_INET6, network->def->bridge, 53) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to allow DNS requests from '%s'"),
-                       network->def->bridge);
-        goto err5;
-    }
+    if (iptablesAddUdpInput(trans, AF_INET6, network->def->bridge, 53) < 0)
+        return -1;
 
-    if (iptablesAddUdpInput(AF_INET6, network->def->bridge, 547) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add ip6tables rule to allow DHCP6 requests from '%s'"),
-                       network->def->bridge);
-        goto err6;
-    }
+    if (iptablesAddUdpInput(trans, AF_INET6, network->def->bridge, 547) < 0)
+        return -1;
 
     return 0;
-
-    /* unwind in reverse order from the point of failure */
-err6:
-    iptablesRemoveUdpInput(AF_INET6, network->def->bridge, 53);
-err5:
-    iptablesRemoveTcpInput(AF_INET6, network->def->bridge, 53);
-err4:
-    iptablesRemoveForwardAllowCross(AF_INET6, network->def->bridge);
-err3:
-    iptablesRemoveForwardRejectIn(AF_INET6, network->def->bridge);
-err2:
-    iptablesRemoveForwardRejectOut(AF_INET6, network->def->bridge);
-err1:
-    return -1;
 }
 
 static void
-networkRemoveGeneralIp6tablesRules(virNetworkObjPtr network)
+networkRemoveGeneralIp6tablesRules(iptablesTransactionPtr trans,
+                                   virNetworkObjPtr network)
 {
     if (!virNetworkDefGetIpByIndex(network->def, AF_INET6, 0) &&
         !network->def->ipv6nogw) {
         return;
     }
     if (virNetworkDefGetIpByIndex(network->def, AF_INET6, 0)) {
-        iptablesRemoveUdpInput(AF_INET6, network->def->bridge, 547);
-        iptablesRemoveUdpInput(AF_INET6, network->def->bridge, 53);
-        iptablesRemoveTcpInput(AF_INET6, network->def->bridge, 53);
+        iptablesRemoveUdpInput(trans, AF_INET6, network->def->bridge, 547);
+        iptablesRemoveUdpInput(trans, AF_INET6, network->def->bridge, 53);
+        iptablesRemoveTcpInput(trans, AF_INET6, network->def->bridge, 53);
     }
 
     /* the following rules are there if no IPv6 address has been defined
      * but network->def->ipv6nogw == true
      */
-    iptablesRemoveForwardAllowCross(AF_INET6, network->def->bridge);
-    iptablesRemoveForwardRejectIn(AF_INET6, network->def->bridge);
-    iptablesRemoveForwardRejectOut(AF_INET6, network->def->bridge);
+    iptablesRemoveForwardAllowCross(trans, AF_INET6, network->def->bridge);
+    iptablesRemoveForwardRejectIn(trans, AF_INET6, network->def->bridge);
+    iptablesRemoveForwardRejectOut(trans, AF_INET6, network->def->bridge);
 }
 
-int networkAddGeneralFirewallRules(virNetworkObjPtr network)
+int networkAddGeneralFirewallRules(iptablesTransactionPtr trans,
+                                   virNetworkObjPtr network)
 {
     size_t i;
     virNetworkIpDefPtr ipv4def;
@@ -488,19 +396,11 @@ int networkAddGeneralFirewallRules(virNetworkObjPtr network)
 
     /* allow DHCP requests through to dnsmasq */
 
-    if (iptablesAddTcpInput(AF_INET, network->def->bridge, 67) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow DHCP requests from '%s'"),
-                       network->def->bridge);
-        goto err1;
-    }
+    if (iptablesAddTcpInput(trans, AF_INET, network->def->bridge, 67) < 0)
+        return -1;
 
-    if (iptablesAddUdpInput(AF_INET, network->def->bridge, 67) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow DHCP requests from '%s'"),
-                       network->def->bridge);
-        goto err2;
-    }
+    if (iptablesAddUdpInput(trans, AF_INET, network->def->bridge, 67) < 0)
+        return -1;
 
     /* If we are doing local DHCP service on this network, attempt to
      * add a rule that will fixup the checksum of DHCP response
@@ -509,96 +409,47 @@ int networkAddGeneralFirewallRules(virNetworkObjPtr network)
      */
 
     if (ipv4def && (ipv4def->nranges || ipv4def->nhosts) &&
-        (iptablesAddOutputFixUdpChecksum(network->def->bridge, 68) < 0)) {
-        VIR_WARN("Could not add rule to fixup DHCP response checksums "
-                 "on network '%s'.", network->def->name);
-        VIR_WARN("May need to update iptables package & kernel to support CHECKSUM rule.");
-    }
+        (iptablesAddOutputFixUdpChecksum(trans, network->def->bridge, 68) < 0))
+        return -1;
 
     /* allow DNS requests through to dnsmasq */
-    if (iptablesAddTcpInput(AF_INET, network->def->bridge, 53) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow DNS requests from '%s'"),
-                       network->def->bridge);
-        goto err3;
-    }
+    if (iptablesAddTcpInput(trans, AF_INET, network->def->bridge, 53) < 0)
+        return -1;
 
-    if (iptablesAddUdpInput(AF_INET, network->def->bridge, 53) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow DNS requests from '%s'"),
-                       network->def->bridge);
-        goto err4;
-    }
+    if (iptablesAddUdpInput(trans, AF_INET, network->def->bridge, 53) < 0)
+        return -1;
 
     /* allow TFTP requests through to dnsmasq if necessary */
     if (ipv4def && ipv4def->tftproot &&
-        iptablesAddUdpInput(AF_INET, network->def->bridge, 69) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow TFTP requests from '%s'"),
-                       network->def->bridge);
-        goto err5;
-    }
+        iptablesAddUdpInput(trans, AF_INET, network->def->bridge, 69) < 0)
+        return -1;
 
     /* Catch all rules to block forwarding to/from bridges */
 
-    if (iptablesAddForwardRejectOut(AF_INET, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to block outbound traffic from '%s'"),
-                       network->def->bridge);
-        goto err6;
-    }
+    if (iptablesAddForwardRejectOut(trans, AF_INET, network->def->bridge) < 0)
+        return -1;
 
-    if (iptablesAddForwardRejectIn(AF_INET, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to block inbound traffic to '%s'"),
-                       network->def->bridge);
-        goto err7;
-    }
+    if (iptablesAddForwardRejectIn(trans, AF_INET, network->def->bridge) < 0)
+        return -1;
 
     /* Allow traffic between guests on the same bridge */
-    if (iptablesAddForwardAllowCross(AF_INET, network->def->bridge) < 0) {
-        virReportError(VIR_ERR_SYSTEM_ERROR,
-                       _("failed to add iptables rule to allow cross bridge traffic on '%s'"),
-                       network->def->bridge);
-        goto err8;
-    }
+    if (iptablesAddForwardAllowCross(trans, AF_INET, network->def->bridge) < 0)
+        return -1;
 
     /* add IPv6 general rules, if needed */
-    if (networkAddGeneralIp6tablesRules(network) < 0) {
-        goto err9;
-    }
+    if (networkAddGeneralIp6tablesRules(trans, network) < 0)
+        return -1;
 
     return 0;
-
-    /* unwind in reverse order from the point of failure */
-err9:
-    iptablesRemoveForwardAllowCross(AF_INET, network->def->bridge);
-err8:
-    iptablesRemoveForwardRejectIn(AF_INET, network->def->bridge);
-err7:
-    iptablesRemoveForwardRejectOut(AF_INET, network->def->bridge);
-err6:
-    if (ipv4def && ipv4def->tftproot) {
-        iptablesRemoveUdpInput(AF_INET, network->def->bridge, 69);
-    }
-err5:
-    iptablesRemoveUdpInput(AF_INET, network->def->bridge, 53);
-err4:
-    iptablesRemoveTcpInput(AF_INET, network->def->bridge, 53);
-err3:
-    iptablesRemoveUdpInput(AF_INET, network->def->bridge, 67);
-err2:
-    iptablesRemoveTcpInput(AF_INET, network->def->bridge, 67);
-err1:
-    return -1;
 }
 
-void networkRemoveGeneralFirewallRules(virNetworkObjPtr network)
+void networkRemoveGeneralFirewallRules(iptablesTransactionPtr trans,
+                                       virNetworkObjPtr network)
 {
     size_t i;
     virNetworkIpDefPtr ipv4def;
 
-    networkRemoveGeneralIp6tablesRules(network);
+    networkRemoveGeneralIp6tablesRules(trans, network);
 
     for (i = 0;
          (ipv4def = virNetworkDefGetIpByIndex(network->def, AF_INET, i));
@@ -607,22 +458,23 @@ void networkRemoveGeneralFirewallRules(virNetworkObjPtr network)
             break;
     }
 
-    iptablesRemoveForwardAllowCross(AF_INET, network->def->bridge);
-    iptablesRemoveForwardRejectIn(AF_INET, network->def->bridge);
-    iptablesRemoveForwardRejectOut(AF_INET, network->def->bridge);
+    iptablesRemoveForwardAllowCross(trans, AF_INET, network->def->bridge);
+    iptablesRemoveForwardRejectIn(trans, AF_INET, network->def->bridge);
+    iptablesRemoveForwardRejectOut(trans, AF_INET, network->def->bridge);
     if (ipv4def && ipv4def->tftproot) {
-        iptablesRemoveUdpInput(AF_INET, network->def->bridge, 69);
+        iptablesRemoveUdpInput(trans, AF_INET, network->def->bridge, 69);
     }
-    iptablesRemoveUdpInput(AF_INET, network->def->bridge, 53);
-    iptablesRemoveTcpInput(AF_INET, network->def->bridge, 53);
+    iptablesRemoveUdpInput(trans, AF_INET, network->def->bridge, 53);
+    iptablesRemoveTcpInput(trans, AF_INET, network->def->bridge, 53);
     if (ipv4def && (ipv4def->nranges || ipv4def->nhosts)) {
-        iptablesRemoveOutputFixUdpChecksum(network->def->bridge, 68);
+        iptablesRemoveOutputFixUdpChecksum(trans, network->def->bridge, 68);
     }
-    iptablesRemoveUdpInput(AF_INET, network->def->bridge, 67);
-    iptablesRemoveTcpInput(AF_INET, network->def->bridge, 67);
+    iptablesRemoveUdpInput(trans, AF_INET, network->def->bridge, 67);
+    iptablesRemoveTcpInput(trans, AF_INET, network->def->bridge, 67);
 }
 
-int networkAddIpSpecificFirewallRules(virNetworkObjPtr network,
+int networkAddIpSpecificFirewallRules(iptablesTransactionPtr trans,
+                                      virNetworkObjPtr network,
                                       virNetworkIpDefPtr ipdef)
 {
     /* NB: in the case of IPv6, routing rules are added when the
@@ -631,79 +483,152 @@ int networkAddIpSpecificFirewallRules(virNetworkObjPtr network,
 
     if (network->def->forward.type == VIR_NETWORK_FORWARD_NAT) {
         if (VIR_SOCKET_ADDR_IS_FAMILY(&ipdef->address, AF_INET))
-            return networkAddMasqueradingFirewallRules(network, ipdef);
+            return networkAddMasqueradingFirewallRules(trans, network, ipdef);
         else if (VIR_SOCKET_ADDR_IS_FAMILY(&ipdef->address, AF_INET6))
-            return networkAddRoutingFirewallRules(network, ipdef);
+            return networkAddRoutingFirewallRules(trans, network, ipdef);
     } else if (network->def->forward.type == VIR_NETWORK_FORWARD_ROUTE) {
-        return networkAddRoutingFirewallRules(network, ipdef);
+        return networkAddRoutingFirewallRules(trans, network, ipdef);
     }
     return 0;
 }
 
-void networkRemoveIpSpecificFirewallRules(virNetworkObjPtr network,
+void networkRemoveIpSpecificFirewallRules(iptablesTransactionPtr trans,
+                                          virNetworkObjPtr network,
                                           virNetworkIpDefPtr ipdef)
 {
     if (network->def->forward.type == VIR_NETWORK_FORWARD_NAT) {
         if (VIR_SOCKET_ADDR_IS_FAMILY(&ipdef->address, AF_INET))
-            networkRemoveMasqueradingFirewallRules(network, ipdef);
+            networkRemoveMasqueradingFirewallRules(trans, network, ipdef);
         else if (VIR_SOCKET_ADDR_IS_FAMILY(&ipdef->address, AF_INET6))
-            networkRemoveRoutingFirewallRules(network, ipdef);
+            networkRemoveRoutingFirewallRules(trans, network, ipdef);
     } else if (network->def->forward.type == VIR_NETWORK_FORWARD_ROUTE) {
-        networkRemoveRoutingFirewallRules(network, ipdef);
+        networkRemoveRoutingFirewallRules(trans, network, ipdef);
     }
 }
 
-/* Add all rules for all ip addresses (and general rules) on a network */
-int networkAddFirewallRules(virNetworkObjPtr network)
+/* Queue all rules for all ip addresses (and general rules) on a network */
+int networkQueueAddFirewallRules(iptablesTransactionPtr trans,
+                                 virNetworkObjPtr network)
 {
-    size_t i, j;
+    size_t i;
     virNetworkIpDefPtr ipdef;
-    virErrorPtr orig_error;
 
     /* Add "once per network" rules */
-    if (networkAddGeneralFirewallRules(network) < 0)
+    if (networkAddGeneralFirewallRules(trans, network) < 0)
         return -1;
 
     for (i = 0;
          (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, i));
          i++) {
         /* Add address-specific iptables rules */
-        if (networkAddIpSpecificFirewallRules(network, ipdef) < 0) {
-            goto err;
-        }
+        if (networkAddIpSpecificFirewallRules(trans, network, ipdef) < 0)
+            return -1;
     }
     return 0;
+}
 
-err:
-    /* store the previous error message before attempting removal of rules */
-    orig_error = virSaveLastError();
+/* Queue removal of all rules for all ip addresses (and general rules)
+ * on a network */
+void networkQueueRemoveFirewallRules(iptablesTransactionPtr trans,
+                                     virNetworkObjPtr network)
+{
+    size_t i;
+    virNetworkIpDefPtr ipdef;
 
-    /* The final failed call to networkAddIpSpecificFirewallRules will
-     * have removed any rules it created, but we need to remove those
-     * added for previous IP addresses.
-     */
-    for (j = 0; j < i; j++) {
-        if ((ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, j)))
-            networkRemoveIpSpecificFirewallRules(network, ipdef);
+    for (i = 0;
+         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, i));
+         i++) {
+        networkRemoveIpSpecificFirewallRules(trans, network, ipdef);
     }
-    networkRemoveGeneralFirewallRules(network);
+    networkRemoveGeneralFirewallRules(trans, network);
+}
 
-    /* return the original error */
-    virSetError(orig_error);
-    virFreeError(orig_error);
-    return -1;
+/* Add all rules for all ip addresses (and general rules) on a network */
+int networkAddFirewallRules(virNetworkObjPtr network)
+{
+    iptablesTransactionPtr trans;
+    virErrorPtr orig_error;
+    int ret = -1;
+
+    if (!(trans = iptablesTransactionNew(network->def->name)))
+        return -1;
+
+    if (networkQueueAddFirewallRules(trans, network) < 0)
+        goto cleanup;
+
+    if (iptablesTransactionCommit(trans) < 0) {
+        /* store the error message before attempting removal of rules */
+        orig_error = virSaveLastError();
+
+        /* Each table is committed as a whole, but the ones before the
+         * failing one are in place already, so remove everything.
+         */
+        networkRemoveFirewallRules(network);
+
+        /* return the original error */
+        virSetError(orig_error);
+        virFreeError(orig_error);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    iptablesTransactionFree(trans);
+    return ret;
 }
 
 /* Remove all rules for all ip addresses (and general rules) on a network */
 void networkRemoveFirewallRules(virNetworkObjPtr network)
 {
+    iptablesTransactionPtr trans;
+
+    if (!(trans = iptablesTransactionNew(network->def->name)))
+        return;
+
+    networkQueueRemoveFirewallRules(trans, network);
+    ignore_value(iptablesTransactionCommit(trans));
+    iptablesTransactionFree(trans);
+}
+
+/* Remove and re-add the rules of all @networks, which must be locked,
+ * with a single transaction. If that fails, fall back to refreshing
+ * each network on its own so one broken network does not leave the
+ * others without rules.
+ */
+int networkRefreshFirewallRules(virNetworkObjPtr *networks,
+                                size_t nnetworks)
+{
+    iptablesTransactionPtr trans;
     size_t i;
-    virNetworkIpDefPtr ipdef;
+    int ret = 0;
 
-    for (i = 0;
-         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, i));
-         i++) {
-        networkRemoveIpSpecificFirewallRules(network, ipdef);
+    if (!(trans = iptablesTransactionNew(NULL)))
+        return -1;
+
+    for (i = 0; i < nnetworks; i++)
+        networkQueueRemoveFirewallRules(trans, networks[i]);
+
+    for (i = 0; i < nnetworks; i++) {
+        if (networkQueueAddFirewallRules(trans, networks[i]) < 0)
+            break;
     }
-    networkRemoveGeneralFirewallRules(network);
+
+    if (i == nnetworks &&
+        iptablesTransactionCommit(trans) == 0)
+        goto cleanup;
+
+    VIR_WARN("Failed to refresh firewall rules of %zu networks at once, "
+             "retrying one network at a time", nnetworks);
+    virResetLastError();
+
+    for (i = 0; i < nnetworks; i++) {
+        networkRemoveFirewallRules(networks[i]);
+        if (networkAddFirewallRules(networks[i]) < 0)
+            ret = -1;
+    }
+
+cleanup:
+    iptablesTransactionFree(trans);
+    return ret;
 }
@@ -26,48 +26,67 @@ int networkCheckRouteCollision(virNetworkObjPtr network ATTRIBUTE_UNUSED)
     return 0;
 }
 
-int networkAddMasqueradingFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+int networkAddMasqueradingFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                        virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                         virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
     return 0;
 }
 
-void networkRemoveMasqueradingFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+void networkRemoveMasqueradingFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                            virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                             virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
 }
 
-int networkAddRoutingFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+int networkAddRoutingFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                   virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                    virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
     return 0;
 }
 
-void networkRemoveRoutingFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+void networkRemoveRoutingFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                       virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                        virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
 }
 
-int networkAddGeneralFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED)
+int networkAddGeneralFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                   virNetworkObjPtr network ATTRIBUTE_UNUSED)
 {
     return 0;
 }
 
-void networkRemoveGeneralFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED)
+void networkRemoveGeneralFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                       virNetworkObjPtr network ATTRIBUTE_UNUSED)
 {
 }
 
-int networkAddIpSpecificFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+int networkAddIpSpecificFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                      virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                       virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
     return 0;
 }
 
-void networkRemoveIpSpecificFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED,
+void networkRemoveIpSpecificFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                          virNetworkObjPtr network ATTRIBUTE_UNUSED,
                                           virNetworkIpDefPtr ipdef ATTRIBUTE_UNUSED)
 {
 }
 
+int networkQueueAddFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                 virNetworkObjPtr network ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+
+void networkQueueRemoveFirewallRules(iptablesTransactionPtr trans ATTRIBUTE_UNUSED,
+                                     virNetworkObjPtr network ATTRIBUTE_UNUSED)
+{
+}
+
 int networkAddFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED)
 {
     return 0;
@@ -76,3 +95,9 @@ int networkAddFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED)
 void networkRemoveFirewallRules(virNetworkObjPtr network ATTRIBUTE_UNUSED)
 {
 }
+
+int networkRefreshFirewallRules(virNetworkObjPtr *networks ATTRIBUTE_UNUSED,
+                                size_t nnetworks ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
@@ -28,6 +28,7 @@
 # include "virlog.h"
 # include "virthread.h"
 # include "virdnsmasq.h"
+# include "viriptables.h"
 # include "network_conf.h"
 
 /* Main driver state */
@@ -50,30 +51,47 @@ typedef virNetworkDriverState *virNetworkDriverStatePtr;
 
 int networkCheckRouteCollision(virNetworkObjPtr network);
 
-int networkAddMasqueradingFirewallRules(virNetworkObjPtr network,
+int networkAddMasqueradingFirewallRules(iptablesTransactionPtr trans,
+                                        virNetworkObjPtr network,
                                         virNetworkIpDefPtr ipdef);
 
-void networkRemoveMasqueradingFirewallRules(virNetworkObjPtr network,
+void networkRemoveMasqueradingFirewallRules(iptablesTransactionPtr trans,
+                                            virNetworkObjPtr network,
                                             virNetworkIpDefPtr ipdef);
 
-int networkAddRoutingFirewallRules(virNetworkObjPtr network,
+int networkAddRoutingFirewallRules(iptablesTransactionPtr trans,
+                                   virNetworkObjPtr network,
                                    virNetworkIpDefPtr ipdef);
 
-void networkRemoveRoutingFirewallRules(virNetworkObjPtr network,
+void networkRemoveRoutingFirewallRules(iptablesTransactionPtr trans,
+                                       virNetworkObjPtr network,
                                        virNetworkIpDefPtr ipdef);
 
-int networkAddGeneralFirewallRules(virNetworkObjPtr network);
+int networkAddGeneralFirewallRules(iptablesTransactionPtr trans,
+                                   virNetworkObjPtr network);
 
-void networkRemoveGeneralFirewallRules(virNetworkObjPtr network);
+void networkRemoveGeneralFirewallRules(iptablesTransactionPtr trans,
+                                       virNetworkObjPtr network);
 
-int networkAddIpSpecificFirewallRules(virNetworkObjPtr network,
+int networkAddIpSpecificFirewallRules(iptablesTransactionPtr trans,
+                                      virNetworkObjPtr network,
                                       virNetworkIpDefPtr ipdef);
 
-void networkRemoveIpSpecificFirewallRules(virNetworkObjPtr network,
+void networkRemoveIpSpecificFirewallRules(iptablesTransactionPtr trans,
+                                          virNetworkObjPtr network,
                                           virNetworkIpDefPtr ipdef);
 
+int networkQueueAddFirewallRules(iptablesTransactionPtr trans,
+                                 virNetworkObjPtr network);
+
+void networkQueueRemoveFirewallRules(iptablesTransactionPtr trans,
+                                     virNetworkObjPtr network);
+
 int networkAddFirewallRules(virNetworkObjPtr network);
 
 void networkRemoveFirewallRules(virNetworkObjPtr network);
 
+int networkRefreshFirewallRules(virNetworkObjPtr *networks,
+                                size_t nnetworks);
+
 #endif /* __VIR_BRIDGE_DRIVER_PLATFORM_H__ */
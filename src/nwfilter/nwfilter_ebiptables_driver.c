@@ -40,6 +40,7 @@
 #include "nwfilter_driver.h"
 #include "nwfilter_gentech_driver.h"
 #include "nwfilter_ebiptables_driver.h"
+#include "nwfilter_ebiptables_driverpriv.h"
 #include "virfile.h"
 #include "vircommand.h"
 #include "configmake.h"
@@ -85,6 +86,8 @@ static char *ebtables_cmd_path;
 static char *iptables_cmd_path;
 static char *ip6tables_cmd_path;
 static char *grep_cmd_path;
+static char *iptables_restore_cmd_path;
+static char *ip6tables_restore_cmd_path;
 
 /*
  * --ctdir original vs. --ctdir reply's meaning was inverted in netfilter
@@ -2846,6 +2849,285 @@ ebiptablesExecCLI(virBufferPtr buf,
     return rc;
 }
 
+/*
+ * Batched instantiation
+ *
+ * Running one process per rule makes instantiating large filters slow
+ * and has the kernel replace the whole table for every single rule.
+ * Where the tools allow it, the iptables rules of an interface are
+ * therefore loaded in one transaction with ip(6)tables-restore --noflush.
+ * The ebtables chains and rules are created by a single shell script
+ * run. ebtables' --atomic-commit is not used for them: it would replace
+ * the whole nat table with a copy taken before the rules were added, and
+ * tear down as well as the IP address learning threads change that table
+ * without holding the filter update lock. The rules still go into the
+ * temporary chains, which ebiptablesTearOldRules renames once the old
+ * rules are gone.
+ */
+
+/*
+ * iptablesRuleToRestore:
+ * @buf: buffer to append the line to
+ * @templ: the command template of an iptables rule instance
+ *
+ * Convert the command template of a rule into a line appending the
+ * rule for ip(6)tables-restore. The comment the template may refer to
+ * is inlined.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+iptablesRuleToRestore(virBufferPtr buf, const char *templ)
+{
+    static const char commentDef[] = COMMENT_VARNAME "='";
+    static const char commentRef[] = "\"$" COMMENT_VARNAME "\"";
+    static const char cmdDef[] = CMD_DEF_PRE "$IPT -%c ";
+    virBuffer commentBuf = VIR_BUFFER_INITIALIZER;
+    char *comment = NULL;
+    const char *p = templ;
+    bool quoted = false;
+    bool space = false;
+    bool started = false;
+    int ret = -1;
+
+    if (STRPREFIX(p, commentDef)) {
+        /* undo the quoting of printCommentVar, then quote for restore */
+        p += strlen(commentDef);
+        for (;;) {
+            if (STRPREFIX(p, "'\\''")) {
+                virBufferAddChar(&commentBuf, '\'');
+                p += 4;
+                continue;
+            }
+            if (!*p || *p == '\'')
+                break;
+            if (*p == '"' || *p == '\\')
+                virBufferAddChar(&commentBuf, '\\');
+            virBufferAddChar(&commentBuf, *p++);
+        }
+        if (!STRPREFIX(p, "'" CMD_SEPARATOR))
+            goto malformed;
+        p += 2;
+
+        if (virBufferError(&commentBuf)) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        comment = virBufferContentAndReset(&commentBuf);
+    }
+
+    if (!STRPREFIX(p, cmdDef))
+        goto malformed;
+    p += strlen(cmdDef);
+
+    virBufferAddLit(buf, "-A");
+    for (; *p && *p != '\''; p++) {
+        if (!quoted) {
+            if (*p == ' ') {
+                space = true;
+                continue;
+            }
+            /* the position placeholder is empty when appending */
+            if (STRPREFIX(p, "%s")) {
+                p++;
+                continue;
+            }
+        }
+        if (space || !started)
+            virBufferAddChar(buf, ' ');
+        space = false;
+        started = true;
+
+        if (!quoted && STRPREFIX(p, commentRef)) {
+            if (!comment)
+                goto malformed;
+            virBufferAsprintf(buf, "\"%s\"", comment);
+            p += strlen(commentRef) - 1;
+            continue;
+        }
+
+        if (*p == '"')
+            quoted = !quoted;
+        virBufferAddChar(buf, *p);
+    }
+    if (*p != '\'' || quoted)
+        goto malformed;
+    virBufferAddLit(buf, "\n");
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&commentBuf);
+    VIR_FREE(comment);
+    return ret;
+
+malformed:
+    virReportError(VIR_ERR_INTERNAL_ERROR,
+                   _("cannot convert rule '%s' for iptables-restore"),
+                   templ);
+    goto cleanup;
+}
+
+
+/**
+ * ebiptablesCreateRestoreBatch:
+ * @buf: buffer to write the input for ip(6)tables-restore into
+ * @ifname: the name of the interface the rules are for
+ * @nruleInstances: the number of rule instances in @inst
+ * @inst: the rule instances, in the order they are to be applied
+ * @isIPv6: whether to collect the ip6tables rather than iptables rules
+ *
+ * Build the input for 'ip(6)tables-restore --noflush' that creates the
+ * temporary root chains of @ifname, fills them with the rules and
+ * links them into the libvirt base chains in one transaction.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+ebiptablesCreateRestoreBatch(virBufferPtr buf,
+                             const char *ifname,
+                             int nruleInstances,
+                             ebiptablesRuleInstPtr *inst,
+                             bool isIPv6)
+{
+    static const struct {
+        const char *basechain;
+        char prefix;
+        bool incoming;
+    } rootChains[] = {
+        { VIRT_OUT_CHAIN, 'F', false },
+        { VIRT_IN_CHAIN,  'F', true },
+        { HOST_IN_CHAIN,  'H', true },
+    };
+    enum RuleType ruleType = isIPv6 ? RT_IP6TABLES : RT_IPTABLES;
+    char chain[MAX_CHAINNAME_LENGTH];
+    char chainPrefix[2];
+    size_t i;
+
+    virBufferAddLit(buf, "*filter\n");
+
+    for (i = 0; i < ARRAY_CARDINALITY(rootChains); i++) {
+        chainPrefix[0] = rootChains[i].prefix;
+        chainPrefix[1] = rootChains[i].incoming ? CHAINPREFIX_HOST_IN_TEMP
+                                                : CHAINPREFIX_HOST_OUT_TEMP;
+        PRINT_IPT_ROOT_CHAIN(chain, chainPrefix, ifname);
+        virBufferAsprintf(buf, ":%s - [0:0]\n", chain);
+    }
+
+    for (i = 0; i < nruleInstances; i++) {
+        if (inst[i]->ruleType != ruleType)
+            continue;
+        if (iptablesRuleToRestore(buf, inst[i]->commandTemplate) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(rootChains); i++) {
+        chainPrefix[0] = rootChains[i].prefix;
+        chainPrefix[1] = rootChains[i].incoming ? CHAINPREFIX_HOST_IN_TEMP
+                                                : CHAINPREFIX_HOST_OUT_TEMP;
+        PRINT_IPT_ROOT_CHAIN(chain, chainPrefix, ifname);
+        virBufferAsprintf(buf, "-A %s %s %s -g %s\n",
+                          rootChains[i].basechain,
+                          rootChains[i].incoming ? MATCH_PHYSDEV_IN
+                                                 : MATCH_PHYSDEV_OUT,
+                          ifname, chain);
+    }
+
+    virBufferAddLit(buf, "COMMIT\n");
+
+    if (virBufferError(buf)) {
+        virReportOOMError();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * iptablesExecRestore:
+ * @buf: the input for ip(6)tables-restore; consumed
+ * @isIPv6: whether to run ip6tables-restore rather than iptables-restore
+ * @errmsg: pointer to a string that will hold the error output
+ *
+ * Returns 0 if all rules were loaded, -1 otherwise.
+ */
+static int
+iptablesExecRestore(virBufferPtr buf,
+                    bool isIPv6,
+                    char **errmsg)
+{
+    virCommandPtr cmd;
+    char *input;
+    int rc;
+
+    if (virBufferError(buf)) {
+        virBufferFreeAndReset(buf);
+        virReportOOMError();
+        return -1;
+    }
+    input = virBufferContentAndReset(buf);
+
+    VIR_FREE(*errmsg);
+
+    cmd = virCommandNewArgList(isIPv6 ? ip6tables_restore_cmd_path
+                                      : iptables_restore_cmd_path,
+                               "--noflush", NULL);
+    virCommandSetInputBuffer(cmd, input);
+    virCommandSetErrorBuffer(cmd, errmsg);
+
+    virMutexLock(&execCLIMutex);
+
+    rc = virCommandRun(cmd, NULL);
+
+    virMutexUnlock(&execCLIMutex);
+
+    virCommandFree(cmd);
+    VIR_FREE(input);
+
+    return rc;
+}
+
+
+/*
+ * iptablesApplyNewRulesBatch:
+ *
+ * Make sure the base chains exist, then create, fill and link the
+ * temporary root chains of @ifname in a single restore transaction.
+ */
+static int
+iptablesApplyNewRulesBatch(const char *ifname,
+                           int nruleInstances,
+                           ebiptablesRuleInstPtr *inst,
+                           bool isIPv6,
+                           char **errmsg)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+
+    if (isIPv6) {
+        NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
+    } else {
+        NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
+    }
+
+    iptablesUnlinkTmpRootChains(&buf, ifname);
+    iptablesRemoveTmpRootChains(&buf, ifname);
+
+    iptablesCreateBaseChains(&buf);
+    iptablesSetupVirtInPost(&buf, ifname);
+
+    if (ebiptablesExecCLI(&buf, NULL, errmsg) < 0)
+        return -1;
+
+    if (ebiptablesCreateRestoreBatch(&buf, ifname, nruleInstances,
+                                     inst, isIPv6) < 0) {
+        virBufferFreeAndReset(&buf);
+        return -1;
+    }
+
+    return iptablesExecRestore(&buf, isIPv6, errmsg);
+}
+
 
 static int
 ebtablesCreateTmpRootChain(virBufferPtr buf,
@@ -3771,11 +4053,6 @@ ebiptablesApplyNewRules(const char *ifname,
         qsort(&ebtChains[0], nEbtChains, sizeof(ebtChains[0]),
               ebiptablesRuleOrderSort);
 
-    if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
-        goto tear_down_tmpebchains;
-
-    NWFILTER_SET_EBTABLES_SHELLVAR(&buf);
-
     /* process ebtables commands; interleave commands from filters with
        commands for creating and connecting ebtables chains */
     j = 0;
@@ -3807,10 +4084,17 @@ ebiptablesApplyNewRules(const char *ifname,
                               ebtChains[j++].commandTemplate,
                               'A', -1, 1);
 
+    /* the chains are created by the same script as the rules */
     if (ebiptablesExecCLI(&buf, NULL, &errmsg) < 0)
         goto tear_down_tmpebchains;
 
-    if (haveIptables) {
+    if (haveIptables && iptables_restore_cmd_path) {
+        if (iptablesApplyNewRulesBatch(ifname, nruleInstances, inst,
+                                       false, &errmsg) < 0)
+            goto tear_down_tmpiptchains;
+
+        iptablesCheckBridgeNFCallEnabled(false);
+    } else if (haveIptables) {
         NWFILTER_SET_IPTABLES_SHELLVAR(&buf);
 
         iptablesUnlinkTmpRootChains(&buf, ifname);
@@ -3851,7 +4135,13 @@ ebiptablesApplyNewRules(const char *ifname,
         iptablesCheckBridgeNFCallEnabled(false);
     }
 
-    if (haveIp6tables) {
+    if (haveIp6tables && ip6tables_restore_cmd_path) {
+        if (iptablesApplyNewRulesBatch(ifname, nruleInstances, inst,
+                                       true, &errmsg) < 0)
+            goto tear_down_tmpip6tchains;
+
+        iptablesCheckBridgeNFCallEnabled(true);
+    } else if (haveIp6tables) {
         NWFILTER_SET_IP6TABLES_SHELLVAR(&buf);
 
         iptablesUnlinkTmpRootChains(&buf, ifname);
@@ -4243,6 +4533,10 @@ ebiptablesDriverInitCLITools(void)
     if (!ip6tables_cmd_path)
         VIR_WARN("Could not find 'ip6tables' executable");
 
+    /* optional, rules are added one by one without them */
+    iptables_restore_cmd_path = virFindFileInPath("iptables-restore");
+    ip6tables_restore_cmd_path = virFindFileInPath("ip6tables-restore");
+
     return 0;
 }
 
@@ -4432,6 +4726,28 @@ ebiptablesDriverInit(bool privileged)
 }
 
 
+/**
+ * ebiptablesDriverInitForTests:
+ *
+ * Set up the driver as if the command line tools had been found, so
+ * that the test suite can instantiate rules without running anything.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+ebiptablesDriverInitForTests(void)
+{
+    if (VIR_STRDUP(ebtables_cmd_path, "/sbin/ebtables") < 0 ||
+        VIR_STRDUP(iptables_cmd_path, "/sbin/iptables") < 0 ||
+        VIR_STRDUP(ip6tables_cmd_path, "/sbin/ip6tables") < 0) {
+        ebiptablesDriverShutdown();
+        return -1;
+    }
+
+    return 0;
+}
+
+
 static void
 ebiptablesDriverShutdown(void)
 {
@@ -4439,5 +4755,7 @@ ebiptablesDriverShutdown(void)
     VIR_FREE(ebtables_cmd_path);
     VIR_FREE(iptables_cmd_path);
     VIR_FREE(ip6tables_cmd_path);
+    VIR_FREE(iptables_restore_cmd_path);
+    VIR_FREE(ip6tables_restore_cmd_path);
     ebiptables_driver.flags = 0;
 }
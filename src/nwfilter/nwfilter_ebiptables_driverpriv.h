@@ -0,0 +1,39 @@
+/*
+ * nwfilter_ebiptables_driverpriv.h: ebtables/iptables driver internals
+ *                                   exported for the test suite
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NWFILTER_EBIPTABLES_DRIVERPRIV_H__
+# define __NWFILTER_EBIPTABLES_DRIVERPRIV_H__
+
+# include "virbuffer.h"
+# include "nwfilter_conf.h"
+# include "nwfilter_ebiptables_driver.h"
+
+/*
+ * This header file should never be used outside unit tests.
+ */
+
+int ebiptablesDriverInitForTests(void);
+
+int ebiptablesCreateRestoreBatch(virBufferPtr buf,
+                                 const char *ifname,
+                                 int nruleInstances,
+                                 ebiptablesRuleInstPtr *inst,
+                                 bool isIPv6);
+
+#endif /* __NWFILTER_EBIPTABLES_DRIVERPRIV_H__ */
@@ -41,6 +41,7 @@
 #include "virprocess.h"
 #include "virtime.h"
 #include "virobject.h"
+#include "vireventthread.h"
 #include "virstring.h"
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
@@ -89,6 +90,10 @@ struct _qemuAgent {
     int fd;
     int watch;
 
+    /* Set when the agent is serviced by its own thread
+     * instead of the event loop */
+    virEventThreadPtr iothread;
+
     bool connectPending;
 
     virDomainObjPtr vm;
@@ -566,7 +571,10 @@ static void qemuAgentUpdateWatch(qemuAgentPtr mon)
             events |= VIR_EVENT_HANDLE_WRITABLE;
     }
 
-    virEventUpdateHandle(mon->watch, events);
+    if (mon->iothread)
+        virEventThreadUpdate(mon->iothread, events);
+    else
+        virEventUpdateHandle(mon->watch, events);
 }
 
 
@@ -706,9 +714,11 @@ qemuAgentIO(int watch, int fd, int events, void *opaque) {
 qemuAgentPtr
 qemuAgentOpen(virDomainObjPtr vm,
               virDomainChrSourceDefPtr config,
+              bool iothread,
               qemuAgentCallbacksPtr cb)
 {
     qemuAgentPtr mon;
+    int events;
 
     if (!cb || !cb->eofNotify) {
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -752,17 +762,25 @@ qemuAgentOpen(virDomainObjPtr vm,
     if (mon->fd == -1)
         goto cleanup;
 
+    events = VIR_EVENT_HANDLE_HANGUP |
+        VIR_EVENT_HANDLE_ERROR |
+        VIR_EVENT_HANDLE_READABLE |
+        (mon->connectPending ? VIR_EVENT_HANDLE_WRITABLE : 0);
+
     virObjectRef(mon);
-    if ((mon->watch = virEventAddHandle(mon->fd,
-                                        VIR_EVENT_HANDLE_HANGUP |
-                                        VIR_EVENT_HANDLE_ERROR |
-                                        VIR_EVENT_HANDLE_READABLE |
-                                        (mon->connectPending ?
-                                         VIR_EVENT_HANDLE_WRITABLE :
-                                         0),
-                                        qemuAgentIO,
-                                        mon,
-                                        virObjectFreeCallback)) < 0) {
+    if (iothread) {
+        if (!(mon->iothread = virEventThreadNew(mon->fd, events,
+                                                qemuAgentIO,
+                                                mon,
+                                                virObjectFreeCallback))) {
+            virObjectUnref(mon);
+            goto cleanup;
+        }
+        mon->watch = virEventThreadGetWatch(mon->iothread);
+    } else if ((mon->watch = virEventAddHandle(mon->fd, events,
+                                               qemuAgentIO,
+                                               mon,
+                                               virObjectFreeCallback)) < 0) {
         virObjectUnref(mon);
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                        _("unable to register monitor events"));
@@ -795,8 +813,12 @@ void qemuAgentClose(qemuAgentPtr mon)
     virObjectLock(mon);
 
     if (mon->fd >= 0) {
-        if (mon->watch)
+        if (mon->iothread) {
+            virEventThreadRemove(mon->iothread);
+            mon->iothread = NULL;
+        } else if (mon->watch) {
             virEventRemoveHandle(mon->watch);
+        }
         VIR_FORCE_CLOSE(mon->fd);
     }
 
@@ -38,6 +38,10 @@
 #include "virnodesuspend.h"
 #include "qemu_monitor.h"
 #include "virstring.h"
+#include "viratomic.h"
+#include "virthreadpool.h"
+#include "virxml.h"
+#include "sha256.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -250,6 +254,7 @@ struct _virQEMUCaps {
 
     char *binary;
     time_t mtime;
+    time_t ctime;
 
     virBitmapPtr flags;
 
@@ -271,6 +276,7 @@ struct _virQEMUCapsCache {
     virMutex lock;
     virHashTablePtr binaries;
     char *libDir;
+    char *cacheDir;
     char *runDir;
     uid_t runUid;
     gid_t runGid;
@@ -874,6 +880,134 @@ error:
 }
 
 
+#define VIR_QEMU_CAPS_PROBE_MAX_WORKERS 8
+
+struct virQEMUCapsPrefetchData {
+    virQEMUCapsCachePtr cache;
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+};
+
+/* Thread pool job looking up the binary named by @jobdata */
+static void
+virQEMUCapsPrefetchWorker(void *jobdata, void *opaque)
+{
+    struct virQEMUCapsPrefetchData *data = opaque;
+    char *binary = jobdata;
+
+    /* Errors are reported again by the lookups done afterwards */
+    virObjectUnref(virQEMUCapsCacheLookup(data->cache, binary));
+    virResetLastError();
+    VIR_FREE(binary);
+
+    virMutexLock(&data->lock);
+    if (--data->pending == 0)
+        virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+static int
+virQEMUCapsPrefetchAdd(char ***binaries,
+                       size_t *nbinaries,
+                       char *binary)
+{
+    size_t i;
+
+    if (!binary)
+        return 0;
+
+    for (i = 0; i < *nbinaries; i++) {
+        if (STREQ((*binaries)[i], binary)) {
+            VIR_FREE(binary);
+            return 0;
+        }
+    }
+
+    if (VIR_APPEND_ELEMENT(*binaries, *nbinaries, binary) < 0) {
+        VIR_FREE(binary);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Look up all the binaries virQEMUCapsInitGuest is going to need in
+ * parallel, so that those without valid cached capabilities are probed
+ * at the same time rather than one after another. Failures are left for
+ * virQEMUCapsInitGuest to deal with.
+ */
+static void
+virQEMUCapsCachePrefetch(virQEMUCapsCachePtr cache,
+                         virArch hostarch)
+{
+    struct virQEMUCapsPrefetchData data = { .cache = cache };
+    const char *const kvmbins[] = { "/usr/libexec/qemu-kvm",
+                                    "qemu-kvm",
+                                    "kvm" };
+    virThreadPoolPtr pool = NULL;
+    char **binaries = NULL;
+    size_t nbinaries = 0;
+    size_t i;
+
+    for (i = 0; i < VIR_ARCH_LAST; i++) {
+        if (virQEMUCapsPrefetchAdd(&binaries, &nbinaries,
+                                   virQEMUCapsFindBinaryForArch(hostarch, i)) < 0)
+            goto cleanup;
+    }
+    for (i = 0; i < ARRAY_CARDINALITY(kvmbins); i++) {
+        char *kvmbin = virFindFileInPath(kvmbins[i]);
+
+        if (kvmbin) {
+            if (virQEMUCapsPrefetchAdd(&binaries, &nbinaries, kvmbin) < 0)
+                goto cleanup;
+            break;
+        }
+    }
+
+    if (nbinaries < 2)
+        goto cleanup;
+
+    if (virMutexInit(&data.lock) < 0)
+        goto cleanup;
+    if (virCondInit(&data.cond) < 0) {
+        virMutexDestroy(&data.lock);
+        goto cleanup;
+    }
+
+    if (!(pool = virThreadPoolNew(0, MIN(nbinaries,
+                                         VIR_QEMU_CAPS_PROBE_MAX_WORKERS),
+                                  0, virQEMUCapsPrefetchWorker, &data)))
+        goto destroy;
+
+    for (i = 0; i < nbinaries; i++) {
+        virMutexLock(&data.lock);
+        data.pending++;
+        virMutexUnlock(&data.lock);
+
+        if (virThreadPoolSendJob(pool, VIR_THREAD_POOL_JOB_NORMAL,
+                                 binaries[i]) < 0)
+            virQEMUCapsPrefetchWorker(binaries[i], &data);
+        binaries[i] = NULL;
+    }
+
+    virMutexLock(&data.lock);
+    while (data.pending)
+        ignore_value(virCondWait(&data.cond, &data.lock));
+    virMutexUnlock(&data.lock);
+
+destroy:
+    virThreadPoolFree(pool);
+    virCondDestroy(&data.cond);
+    virMutexDestroy(&data.lock);
+cleanup:
+    virResetLastError();
+    for (i = 0; i < nbinaries; i++)
+        VIR_FREE(binaries[i]);
+    VIR_FREE(binaries);
+}
+
+
 virCapsPtr virQEMUCapsInit(virQEMUCapsCachePtr cache)
 {
     virCapsPtr caps;
@@ -904,6 +1038,8 @@ virCapsPtr virQEMUCapsInit(virQEMUCapsCachePtr cache)
     virCapabilitiesAddHostMigrateTransport(caps,
                                            "tcp");
 
+    virQEMUCapsCachePrefetch(cache, hostarch);
+
     /* QEMU can support pretty much every arch that exists,
      * so just probe for them all - we gracefully fail
      * if a qemu-system-$ARCH binary can't be found
@@ -2509,11 +2645,15 @@ virQEMUCapsInitQMP(virQEMUCapsPtr qemuCaps,
     char *pidfile = NULL;
     pid_t pid = 0;
     virDomainObj vm;
+    static int probes = 0;
+    int probe = virAtomicIntInc(&probes);
 
     /* the ".sock" sufix is important to avoid a possible clash with a qemu
-     * domain called "capabilities"
+     * domain called "capabilities", the number keeps binaries probed in
+     * parallel apart
      */
-    if (virAsprintf(&monpath, "%s/%s", libDir, "capabilities.monitor.sock") < 0)
+    if (virAsprintf(&monpath, "%s/capabilities.%d.monitor.sock",
+                    libDir, probe) < 0)
         goto cleanup;
     if (virAsprintf(&monarg, "unix:%s,server,nowait", monpath) < 0)
         goto cleanup;
@@ -2524,7 +2664,7 @@ virQEMUCapsInitQMP(virQEMUCapsPtr qemuCaps,
      * -daemonize we need QEMU to be allowed to create them, rather
      * than libvirtd. So we're using libDir which QEMU can write to
      */
-    if (virAsprintf(&pidfile, "%s/%s", libDir, "capabilities.pidfile") < 0)
+    if (virAsprintf(&pidfile, "%s/capabilities.%d.pidfile", libDir, probe) < 0)
         goto cleanup;
 
     memset(&config, 0, sizeof(config));
@@ -2574,7 +2714,8 @@ virQEMUCapsInitQMP(virQEMUCapsPtr qemuCaps,
     memset(&vm, 0, sizeof(vm));
     vm.pid = pid;
 
-    if (!(mon = qemuMonitorOpen(&vm, &config, true, &callbacks, NULL))) {
+    if (!(mon = qemuMonitorOpen(&vm, &config, true, false,
+                                &callbacks, NULL))) {
         ret = 0;
         goto cleanup;
     }
@@ -2653,6 +2794,8 @@ cleanup:
     virCommandAbort(cmd);
     virCommandFree(cmd);
     VIR_FREE(monarg);
+    if (monpath)
+        unlink(monpath);
     VIR_FREE(monpath);
     VIR_FREE(package);
 
@@ -2673,18 +2816,357 @@ cleanup:
 }
 
 
+/*
+ * Capabilities are kept on disk in the capabilities directory under the
+ * driver's cache dir, one file per binary named after the SHA-256 of its
+ * path:
+ *
+ *   <qemuCaps>
+ *     <emulator path='/usr/bin/qemu-system-x86_64'/>
+ *     <qemuctime>1375349287</qemuctime>
+ *     <qemumtime>1375349287</qemumtime>
+ *     <selfvers>1001002</selfvers>
+ *     <hostKVM/>
+ *     <usedQMP/>
+ *     <flag name='kvm'/>
+ *     ...
+ *     <version>1006000</version>
+ *     <kvmVersion>0</kvmVersion>
+ *     <arch>x86_64</arch>
+ *     <cpu name='qemu64'/>
+ *     ...
+ *     <machine name='pc-i440fx-1.6' alias='pc' maxCpus='255'/>
+ *     ...
+ *   </qemuCaps>
+ *
+ * A file is only trusted if the binary was not touched since it was
+ * written, by this very version of libvirt and with /dev/kvm in the
+ * same state, as QEMU reports different capabilities without KVM.
+ */
+static char *
+virQEMUCapsCacheFile(const char *cacheDir,
+                     const char *binary)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char buf[SHA256_DIGEST_SIZE];
+    char name[SHA256_DIGEST_SIZE * 2 + 1];
+    char *ret;
+    size_t i;
+
+    if (!sha256_buffer(binary, strlen(binary), buf)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to compute sha256 checksum"));
+        return NULL;
+    }
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        name[i * 2] = hex[(buf[i] >> 4) & 0xf];
+        name[i * 2 + 1] = hex[buf[i] & 0xf];
+    }
+    name[SHA256_DIGEST_SIZE * 2] = '\0';
+
+    ignore_value(virAsprintf(&ret, "%s/capabilities/%s.xml", cacheDir, name));
+    return ret;
+}
+
+
+char *
+virQEMUCapsFormatCache(virQEMUCapsPtr qemuCaps,
+                       bool hostKVM)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t i;
+
+    virBufferAddLit(&buf, "<qemuCaps>\n");
+    virBufferAdjustIndent(&buf, 2);
+
+    virBufferEscapeString(&buf, "<emulator path='%s'/>\n", qemuCaps->binary);
+    virBufferAsprintf(&buf, "<qemuctime>%lld</qemuctime>\n",
+                      (long long) qemuCaps->ctime);
+    virBufferAsprintf(&buf, "<qemumtime>%lld</qemumtime>\n",
+                      (long long) qemuCaps->mtime);
+    virBufferAsprintf(&buf, "<selfvers>%lu</selfvers>\n",
+                      (unsigned long) LIBVIR_VERSION_NUMBER);
+    if (hostKVM)
+        virBufferAddLit(&buf, "<hostKVM/>\n");
+
+    if (qemuCaps->usedQMP)
+        virBufferAddLit(&buf, "<usedQMP/>\n");
+
+    for (i = 0; i < QEMU_CAPS_LAST; i++) {
+        if (virQEMUCapsGet(qemuCaps, i))
+            virBufferAsprintf(&buf, "<flag name='%s'/>\n",
+                              virQEMUCapsTypeToString(i));
+    }
+
+    virBufferAsprintf(&buf, "<version>%u</version>\n", qemuCaps->version);
+    virBufferAsprintf(&buf, "<kvmVersion>%u</kvmVersion>\n",
+                      qemuCaps->kvmVersion);
+    if (qemuCaps->arch)
+        virBufferAsprintf(&buf, "<arch>%s</arch>\n",
+                          virArchToString(qemuCaps->arch));
+
+    for (i = 0; i < qemuCaps->ncpuDefinitions; i++)
+        virBufferEscapeString(&buf, "<cpu name='%s'/>\n",
+                              qemuCaps->cpuDefinitions[i]);
+
+    for (i = 0; i < qemuCaps->nmachineTypes; i++) {
+        virBufferEscapeString(&buf, "<machine name='%s'",
+                              qemuCaps->machineTypes[i]);
+        virBufferEscapeString(&buf, " alias='%s'",
+                              qemuCaps->machineAliases[i]);
+        if (qemuCaps->machineMaxCpus[i])
+            virBufferAsprintf(&buf, " maxCpus='%u'",
+                              qemuCaps->machineMaxCpus[i]);
+        virBufferAddLit(&buf, "/>\n");
+    }
+
+    virBufferAdjustIndent(&buf, -2);
+    virBufferAddLit(&buf, "</qemuCaps>\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return NULL;
+    }
+
+    return virBufferContentAndReset(&buf);
+}
+
+
+/*
+ * Fill @qemuCaps, whose binary, ctime and mtime must already be set,
+ * from the cached @xml.
+ *
+ * Returns 1 if the cache was loaded, 0 if it is out of date and
+ * -1 on error.
+ */
+int
+virQEMUCapsParseCache(virQEMUCapsPtr qemuCaps,
+                      const char *xml,
+                      bool hostKVM)
+{
+    xmlDocPtr doc = NULL;
+    xmlXPathContextPtr ctxt = NULL;
+    xmlNodePtr *nodes = NULL;
+    char *str = NULL;
+    long long qemuctime;
+    long long qemumtime;
+    unsigned long selfvers;
+    int n;
+    size_t i;
+    int ret = -1;
+
+    if (!(doc = virXMLParseStringCtxt(xml, _("(QEMU capabilities cache)"),
+                                      &ctxt)))
+        goto cleanup;
+
+    if (!xmlStrEqual(ctxt->node->name, BAD_CAST "qemuCaps")) {
+        virReportError(VIR_ERR_XML_ERROR,
+                       _("unexpected root element <%s>, "
+                         "expecting <qemuCaps>"),
+                       ctxt->node->name);
+        goto cleanup;
+    }
+
+    str = virXPathString("string(./emulator/@path)", ctxt);
+    if (virXPathLongLong("string(./qemuctime)", ctxt, &qemuctime) < 0 ||
+        virXPathLongLong("string(./qemumtime)", ctxt, &qemumtime) < 0 ||
+        virXPathULong("string(./selfvers)", ctxt, &selfvers) < 0 ||
+        STRNEQ_NULLABLE(str, qemuCaps->binary) ||
+        qemuctime != qemuCaps->ctime ||
+        qemumtime != qemuCaps->mtime ||
+        selfvers != LIBVIR_VERSION_NUMBER ||
+        virXPathBoolean("boolean(./hostKVM)", ctxt) != hostKVM) {
+        VIR_DEBUG("Cached capabilities of %s are out of date",
+                  NULLSTR(qemuCaps->binary));
+        ret = 0;
+        goto cleanup;
+    }
+    VIR_FREE(str);
+
+    qemuCaps->usedQMP = virXPathBoolean("boolean(./usedQMP)", ctxt) > 0;
+
+    if ((n = virXPathNodeSet("./flag", ctxt, &nodes)) < 0)
+        goto cleanup;
+    for (i = 0; i < n; i++) {
+        int flag;
+
+        if (!(str = virXMLPropString(nodes[i], "name"))) {
+            virReportError(VIR_ERR_XML_ERROR, "%s",
+                           _("missing flag name in QEMU capabilities cache"));
+            goto cleanup;
+        }
+        /* Written by a build knowing about different flags */
+        if ((flag = virQEMUCapsTypeFromString(str)) < 0) {
+            VIR_DEBUG("Unknown flag %s in cached capabilities", str);
+            ret = 0;
+            goto cleanup;
+        }
+        VIR_FREE(str);
+        virQEMUCapsSet(qemuCaps, flag);
+    }
+    VIR_FREE(nodes);
+
+    if (virXPathUInt("string(./version)", ctxt, &qemuCaps->version) < 0 ||
+        virXPathUInt("string(./kvmVersion)", ctxt,
+                     &qemuCaps->kvmVersion) < 0) {
+        virReportError(VIR_ERR_XML_ERROR, "%s",
+                       _("missing version in QEMU capabilities cache"));
+        goto cleanup;
+    }
+
+    if ((str = virXPathString("string(./arch)", ctxt)) &&
+        !(qemuCaps->arch = virArchFromString(str))) {
+        virReportError(VIR_ERR_XML_ERROR,
+                       _("unknown arch %s in QEMU capabilities cache"), str);
+        goto cleanup;
+    }
+    VIR_FREE(str);
+
+    if ((n = virXPathNodeSet("./cpu", ctxt, &nodes)) < 0)
+        goto cleanup;
+    if (n > 0) {
+        if (VIR_ALLOC_N(qemuCaps->cpuDefinitions, n) < 0)
+            goto cleanup;
+        for (i = 0; i < n; i++) {
+            if (!(qemuCaps->cpuDefinitions[i] =
+                  virXMLPropString(nodes[i], "name"))) {
+                virReportError(VIR_ERR_XML_ERROR, "%s",
+                               _("missing CPU name in QEMU capabilities cache"));
+                goto cleanup;
+            }
+            qemuCaps->ncpuDefinitions++;
+        }
+    }
+    VIR_FREE(nodes);
+
+    if ((n = virXPathNodeSet("./machine", ctxt, &nodes)) < 0)
+        goto cleanup;
+    if (n > 0) {
+        if (VIR_ALLOC_N(qemuCaps->machineTypes, n) < 0 ||
+            VIR_ALLOC_N(qemuCaps->machineAliases, n) < 0 ||
+            VIR_ALLOC_N(qemuCaps->machineMaxCpus, n) < 0)
+            goto cleanup;
+        for (i = 0; i < n; i++) {
+            qemuCaps->nmachineTypes++;
+            if (!(qemuCaps->machineTypes[i] =
+                  virXMLPropString(nodes[i], "name"))) {
+                virReportError(VIR_ERR_XML_ERROR, "%s",
+                               _("missing machine name in QEMU capabilities cache"));
+                goto cleanup;
+            }
+            qemuCaps->machineAliases[i] = virXMLPropString(nodes[i], "alias");
+
+            if ((str = virXMLPropString(nodes[i], "maxCpus")) &&
+                virStrToLong_ui(str, NULL, 10,
+                                &qemuCaps->machineMaxCpus[i]) < 0) {
+                virReportError(VIR_ERR_XML_ERROR,
+                               _("malformed machine maxCpus '%s' in "
+                                 "QEMU capabilities cache"), str);
+                goto cleanup;
+            }
+            VIR_FREE(str);
+        }
+    }
+
+    ret = 1;
+
+cleanup:
+    VIR_FREE(str);
+    VIR_FREE(nodes);
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
+    return ret;
+}
+
+
+static int
+virQEMUCapsLoadCache(virQEMUCapsPtr qemuCaps,
+                     const char *filename,
+                     bool hostKVM)
+{
+    char *xml = NULL;
+    int ret;
+
+    if (!virFileExists(filename))
+        return 0;
+
+    if (virFileReadAll(filename, 1024 * 1024, &xml) < 0)
+        return -1;
+
+    ret = virQEMUCapsParseCache(qemuCaps, xml, hostKVM);
+    VIR_FREE(xml);
+    return ret;
+}
+
+
+static int
+virQEMUCapsSaveCache(virQEMUCapsPtr qemuCaps,
+                     const char *filename,
+                     bool hostKVM)
+{
+    char *xml = NULL;
+    char *dir = NULL;
+    int ret = -1;
+
+    if (!(xml = virQEMUCapsFormatCache(qemuCaps, hostKVM)))
+        goto cleanup;
+
+    if (VIR_STRDUP(dir, filename) < 0)
+        goto cleanup;
+    *strrchr(dir, '/') = '\0';
+    if (virFileMakePath(dir) < 0) {
+        virReportSystemError(errno,
+                             _("cannot create directory '%s'"), dir);
+        goto cleanup;
+    }
+
+    if (virXMLSaveFile(filename, NULL, NULL, xml) < 0)
+        goto cleanup;
+
+    VIR_DEBUG("Saved capabilities of %s to %s", qemuCaps->binary, filename);
+    ret = 0;
+
+cleanup:
+    VIR_FREE(dir);
+    VIR_FREE(xml);
+    return ret;
+}
+
+
+static virQEMUCapsPtr
+virQEMUCapsNewBinary(const char *binary,
+                     struct stat *sb)
+{
+    virQEMUCapsPtr qemuCaps;
+
+    if (!(qemuCaps = virQEMUCapsNew()))
+        return NULL;
+
+    if (VIR_STRDUP(qemuCaps->binary, binary) < 0) {
+        virObjectUnref(qemuCaps);
+        return NULL;
+    }
+    qemuCaps->mtime = sb->st_mtime;
+    qemuCaps->ctime = sb->st_ctime;
+
+    return qemuCaps;
+}
+
+
 virQEMUCapsPtr virQEMUCapsNewForBinary(const char *binary,
                                        const char *libDir,
+                                       const char *cacheDir,
                                        uid_t runUid,
                                        gid_t runGid)
 {
-    virQEMUCapsPtr qemuCaps = virQEMUCapsNew();
+    virQEMUCapsPtr qemuCaps = NULL;
+    char *cacheFile = NULL;
+    bool hostKVM = virFileExists("/dev/kvm");
     struct stat sb;
     int rv;
 
-    if (VIR_STRDUP(qemuCaps->binary, binary) < 0)
-        goto error;
-
     /* We would also want to check faccessat if we cared about ACLs,
      * but we don't.  */
     if (stat(binary, &sb) < 0) {
@@ -2692,7 +3174,6 @@ virQEMUCapsPtr virQEMUCapsNewForBinary(const char *binary,
                              binary);
         goto error;
     }
-    qemuCaps->mtime = sb.st_mtime;
 
     /* Make sure the binary we are about to try exec'ing exists.
      * Technically we could catch the exec() failure, but that's
@@ -2704,6 +3185,32 @@ virQEMUCapsPtr virQEMUCapsNewForBinary(const char *binary,
         goto error;
     }
 
+    if (cacheDir &&
+        !(cacheFile = virQEMUCapsCacheFile(cacheDir, binary)))
+        goto error;
+
+    if (cacheFile) {
+        if (!(qemuCaps = virQEMUCapsNewBinary(binary, &sb)))
+            goto error;
+
+        if ((rv = virQEMUCapsLoadCache(qemuCaps, cacheFile, hostKVM)) > 0) {
+            VIR_DEBUG("Loaded capabilities of %s from %s", binary, cacheFile);
+            goto cleanup;
+        }
+        if (rv < 0) {
+            virErrorPtr err = virGetLastError();
+            VIR_WARN("Ignoring capabilities cache %s: %s", cacheFile,
+                     err ? err->message : "<unknown problem>");
+            virResetLastError();
+        }
+
+        /* Whatever a stale cache left behind must not be mixed in */
+        virObjectUnref(qemuCaps);
+    }
+
+    if (!(qemuCaps = virQEMUCapsNewBinary(binary, &sb)))
+        goto error;
+
     if ((rv = virQEMUCapsInitQMP(qemuCaps, libDir, runUid, runGid)) < 0)
         goto error;
 
@@ -2711,12 +3218,22 @@ virQEMUCapsPtr virQEMUCapsNewForBinary(const char *binary,
         virQEMUCapsInitHelp(qemuCaps, runUid, runGid) < 0)
         goto error;
 
+    if (cacheFile &&
+        virQEMUCapsSaveCache(qemuCaps, cacheFile, hostKVM) < 0) {
+        virErrorPtr err = virGetLastError();
+        VIR_WARN("Failed to cache capabilities of %s: %s", binary,
+                 err ? err->message : "<unknown problem>");
+        virResetLastError();
+    }
+
+cleanup:
+    VIR_FREE(cacheFile);
     return qemuCaps;
 
 error:
     virObjectUnref(qemuCaps);
     qemuCaps = NULL;
-    return NULL;
+    goto cleanup;
 }
 
 
@@ -2730,7 +3247,8 @@ bool virQEMUCapsIsValid(virQEMUCapsPtr qemuCaps)
     if (stat(qemuCaps->binary, &sb) < 0)
         return false;
 
-    return sb.st_mtime == qemuCaps->mtime;
+    return sb.st_mtime == qemuCaps->mtime &&
+           sb.st_ctime == qemuCaps->ctime;
 }
 
 
@@ -2743,6 +3261,7 @@ virQEMUCapsHashDataFree(void *payload, const void *key ATTRIBUTE_UNUSED)
 
 virQEMUCapsCachePtr
 virQEMUCapsCacheNew(const char *libDir,
+                    const char *cacheDir,
                     uid_t runUid,
                     gid_t runGid)
 {
@@ -2760,7 +3279,8 @@ virQEMUCapsCacheNew(const char *libDir,
 
     if (!(cache->binaries = virHashCreate(10, virQEMUCapsHashDataFree)))
         goto error;
-    if (VIR_STRDUP(cache->libDir, libDir) < 0)
+    if (VIR_STRDUP(cache->libDir, libDir) < 0 ||
+        VIR_STRDUP(cache->cacheDir, cacheDir) < 0)
         goto error;
 
     cache->runUid = runUid;
@@ -2778,6 +3298,7 @@ virQEMUCapsPtr
 virQEMUCapsCacheLookup(virQEMUCapsCachePtr cache, const char *binary)
 {
     virQEMUCapsPtr ret = NULL;
+    virQEMUCapsPtr qemuCaps;
     virMutexLock(&cache->lock);
     ret = virHashLookup(cache->binaries, binary);
     if (ret &&
@@ -2788,17 +3309,26 @@ virQEMUCapsCacheLookup(virQEMUCapsCachePtr cache, const char *binary)
         ret = NULL;
     }
     if (!ret) {
+        /* Probing takes a while, let other binaries be looked up
+         * meanwhile */
+        virMutexUnlock(&cache->lock);
         VIR_DEBUG("Creating capabilities for %s",
                   binary);
-        ret = virQEMUCapsNewForBinary(binary, cache->libDir,
-                                      cache->runUid, cache->runGid);
-        if (ret) {
+        qemuCaps = virQEMUCapsNewForBinary(binary, cache->libDir,
+                                           cache->cacheDir,
+                                           cache->runUid, cache->runGid);
+        virMutexLock(&cache->lock);
+        if (qemuCaps &&
+            !(ret = virHashLookup(cache->binaries, binary))) {
             VIR_DEBUG("Caching capabilities %p for %s",
-                      ret, binary);
-            if (virHashAddEntry(cache->binaries, binary, ret) < 0) {
-                virObjectUnref(ret);
-                ret = NULL;
-            }
+                      qemuCaps, binary);
+            if (virHashAddEntry(cache->binaries, binary, qemuCaps) < 0)
+                virObjectUnref(qemuCaps);
+            else
+                ret = qemuCaps;
+        } else {
+            /* Somebody else probed the binary in the meantime */
+            virObjectUnref(qemuCaps);
         }
     }
     VIR_DEBUG("Returning caps %p for %s", ret, binary);
@@ -2830,6 +3360,7 @@ virQEMUCapsCacheFree(virQEMUCapsCachePtr cache)
         return;
 
     VIR_FREE(cache->libDir);
+    VIR_FREE(cache->cacheDir);
     virHashFree(cache->binaries);
     virMutexDestroy(&cache->lock);
     VIR_FREE(cache);
@@ -210,6 +210,7 @@ virQEMUCapsPtr virQEMUCapsNew(void);
 virQEMUCapsPtr virQEMUCapsNewCopy(virQEMUCapsPtr qemuCaps);
 virQEMUCapsPtr virQEMUCapsNewForBinary(const char *binary,
                                        const char *libDir,
+                                       const char *cacheDir,
                                        uid_t runUid,
                                        gid_t runGid);
 
@@ -251,6 +252,7 @@ bool virQEMUCapsIsValid(virQEMUCapsPtr qemuCaps);
 
 
 virQEMUCapsCachePtr virQEMUCapsCacheNew(const char *libDir,
+                                        const char *cacheDir,
                                         uid_t uid, gid_t gid);
 virQEMUCapsPtr virQEMUCapsCacheLookup(virQEMUCapsCachePtr cache,
                                       const char *binary);
@@ -274,6 +276,13 @@ int virQEMUCapsParseHelpStr(const char *qemu,
                             bool check_yajl);
 /* Only for use by test suite */
 int virQEMUCapsParseDeviceStr(virQEMUCapsPtr qemuCaps, const char *str);
+/* Only for use by test suite */
+char *virQEMUCapsFormatCache(virQEMUCapsPtr qemuCaps,
+                             bool hostKVM);
+/* Only for use by test suite */
+int virQEMUCapsParseCache(virQEMUCapsPtr qemuCaps,
+                          const char *xml,
+                          bool hostKVM);
 
 VIR_ENUM_DECL(virQEMUCaps);
 
@@ -503,6 +503,7 @@ int virQEMUDriverConfigLoadFile(virQEMUDriverConfigPtr cfg,
 
     GET_VALUE_STR("save_image_format", cfg->saveImageFormat);
     GET_VALUE_STR("dump_image_format", cfg->dumpImageFormat);
+    GET_VALUE_LONG("save_image_threads", cfg->saveImageThreads);
     GET_VALUE_STR("auto_dump_path", cfg->autoDumpPath);
     GET_VALUE_BOOL("auto_dump_bypass_cache", cfg->autoDumpBypassCache);
     GET_VALUE_BOOL("auto_start_bypass_cache", cfg->autoStartBypassCache);
@@ -522,6 +523,7 @@ int virQEMUDriverConfigLoadFile(virQEMUDriverConfigPtr cfg,
     GET_VALUE_STR("lock_manager", cfg->lockManagerName);
 
     GET_VALUE_LONG("max_queued", cfg->maxQueuedJobs);
+    GET_VALUE_BOOL("monitor_io_threads", cfg->monitorIOThreads);
 
     GET_VALUE_LONG("keepalive_interval", cfg->keepAliveInterval);
     GET_VALUE_LONG("keepalive_count", cfg->keepAliveCount);
@@ -138,12 +138,15 @@ struct _virQEMUDriverConfig {
 
     int maxQueuedJobs;
 
+    bool monitorIOThreads;
+
     char **securityDriverNames;
     bool securityDefaultConfined;
     bool securityRequireConfined;
 
     char *saveImageFormat;
     char *dumpImageFormat;
+    unsigned int saveImageThreads;
 
     char *autoDumpPath;
     bool autoDumpBypassCache;
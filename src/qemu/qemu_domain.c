@@ -163,6 +163,8 @@ qemuDomainObjResetAsyncJob(qemuDomainObjPrivatePtr priv)
     job->asyncAbort = false;
     memset(&job->status, 0, sizeof(job->status));
     memset(&job->info, 0, sizeof(job->info));
+    job->tunnel_set = false;
+    memset(&job->tunnel, 0, sizeof(job->tunnel));
 }
 
 void
@@ -1002,9 +1004,18 @@ qemuDomainNestedJobAllowed(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
     return !priv->job.asyncJob || (priv->job.mask & JOB_MASK(job)) != 0;
 }
 
+/*
+ * Whether @job could be started right now. Callers use this to
+ * decide whether to ask the monitor or answer from the saved state,
+ * so queries are refused while the domain is still being reconnected,
+ * just like qemuDomainObjBeginJob would
+ */
 bool
 qemuDomainJobAllowed(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
 {
+    if (job == QEMU_JOB_QUERY && priv->reconnecting)
+        return false;
+
     return !priv->job.active && qemuDomainNestedJobAllowed(priv, job);
 }
 
@@ -1026,6 +1037,17 @@ qemuDomainObjBeginJobInternal(virQEMUDriverPtr driver,
     bool nested = job == QEMU_JOB_ASYNC_NESTED;
     virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
 
+    /* Queries need the monitor which is not back until reconnecting
+     * finishes, fail them right away instead of tying up a worker
+     * for the whole wait while the daemon is starting up */
+    if (job == QEMU_JOB_QUERY && priv->reconnecting) {
+        virReportError(VIR_ERR_OPERATION_INVALID,
+                       _("domain '%s' is still being reconnected"),
+                       obj->def->name);
+        virObjectUnref(cfg);
+        return -1;
+    }
+
     priv->jobs_queued++;
 
     if (virTimeMillisNow(&now) < 0) {
@@ -2174,6 +2196,85 @@ error:
     return -1;
 }
 
+/* Upper bound on the number of disks probed at once */
+#define QEMU_DOMAIN_DISK_CHAIN_THREADS 8
+
+typedef struct _qemuDomainDiskChainJob qemuDomainDiskChainJob;
+typedef qemuDomainDiskChainJob *qemuDomainDiskChainJobPtr;
+struct _qemuDomainDiskChainJob {
+    virQEMUDriverPtr driver;
+    virDomainDiskDefPtr disk;
+    virThread thread;
+};
+
+static void
+qemuDomainDetermineDiskChainWorker(void *opaque)
+{
+    qemuDomainDiskChainJobPtr job = opaque;
+
+    /* Failures are reported again when the caller retries the disk */
+    ignore_value(qemuDomainDetermineDiskChain(job->driver, job->disk, false));
+}
+
+/* Walk the backing chains of independent disks concurrently, as on
+ * network filesystems each image costs several round trips. This
+ * only pre-populates disk->backingChain; disks that fail here are
+ * simply probed again by the caller, which then reports the error. */
+static void
+qemuDomainDetermineDiskChains(virQEMUDriverPtr driver,
+                              virDomainObjPtr vm)
+{
+    qemuDomainDiskChainJobPtr jobs = NULL;
+    size_t njobs = 0;
+    size_t i, j;
+
+    if (VIR_ALLOC_N(jobs, vm->def->ndisks) < 0) {
+        virResetLastError();
+        return;
+    }
+
+    for (i = 0; i < vm->def->ndisks; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+
+        if (!disk->src || disk->backingChain ||
+            disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK ||
+            disk->type == VIR_DOMAIN_DISK_TYPE_VOLUME)
+            continue;
+
+        jobs[njobs].driver = driver;
+        jobs[njobs].disk = disk;
+        njobs++;
+    }
+
+    if (njobs < 2)
+        goto cleanup;
+
+    for (i = 0; i < njobs; i += QEMU_DOMAIN_DISK_CHAIN_THREADS) {
+        size_t nstarted = 0;
+        bool failed = false;
+
+        for (j = i; j < njobs && j < i + QEMU_DOMAIN_DISK_CHAIN_THREADS; j++) {
+            if (virThreadCreate(&jobs[j].thread, true,
+                                qemuDomainDetermineDiskChainWorker,
+                                &jobs[j]) < 0) {
+                failed = true;
+                break;
+            }
+            nstarted++;
+        }
+
+        for (j = i; j < i + nstarted; j++)
+            virThreadJoin(&jobs[j].thread);
+
+        /* Leave the remaining disks to the caller */
+        if (failed)
+            break;
+    }
+
+cleanup:
+    VIR_FREE(jobs);
+}
+
 int
 qemuDomainCheckDiskPresence(virQEMUDriverPtr driver,
                             virDomainObjPtr vm,
@@ -2184,6 +2285,8 @@ qemuDomainCheckDiskPresence(virQEMUDriverPtr driver,
     virDomainDiskDefPtr disk;
 
     VIR_DEBUG("Checking for disk presence");
+    qemuDomainDetermineDiskChains(driver, vm);
+
     for (i = vm->def->ndisks; i > 0; i--) {
         disk = vm->def->disks[i - 1];
 
@@ -2302,6 +2405,22 @@ qemuDiskChainCheckBroken(virDomainDiskDefPtr disk)
     return 0;
 }
 
+/* Drop the cached metadata of every image in the chain of @disk,
+ * for use once a block job or snapshot has rewritten some of them */
+void
+qemuDomainInvalidateDiskChain(virDomainDiskDefPtr disk)
+{
+    virStorageFileMetadataPtr meta;
+
+    if (disk->src)
+        virStorageFileMetadataCacheInvalidate(disk->src);
+
+    for (meta = disk->backingChain; meta; meta = meta->backingMeta) {
+        if (meta->backingStore)
+            virStorageFileMetadataCacheInvalidate(meta->backingStore);
+    }
+}
+
 int
 qemuDomainDetermineDiskChain(virQEMUDriverPtr driver,
                              virDomainDiskDefPtr disk,
@@ -2317,6 +2436,7 @@ qemuDomainDetermineDiskChain(virQEMUDriverPtr driver,
 
     if (disk->backingChain) {
         if (force) {
+            qemuDomainInvalidateDiskChain(disk);
             virStorageFileFreeMetadata(disk->backingChain);
             disk->backingChain = NULL;
         } else {
@@ -99,6 +99,18 @@ enum qemuDomainAsyncJob {
 };
 VIR_ENUM_DECL(qemuDomainAsyncJob)
 
+/* Progress of the stream forwarding a tunnelled migration */
+typedef struct _qemuDomainJobTunnelStats qemuDomainJobTunnelStats;
+typedef qemuDomainJobTunnelStats *qemuDomainJobTunnelStatsPtr;
+struct _qemuDomainJobTunnelStats {
+    unsigned long long bytes;       /* Data sent over the stream */
+    unsigned long long throughput;  /* Average bytes per second so far */
+    unsigned long long chunk;       /* Current stream packet size */
+    unsigned long long readTime;    /* ms spent reading from qemu */
+    unsigned long long sendTime;    /* ms spent sending to the stream */
+    unsigned long long stallTime;   /* ms qemu waited for a free buffer */
+};
+
 struct qemuDomainJobObj {
     virCond cond;                       /* Use to coordinate jobs */
     enum qemuDomainJob active;          /* Currently running job */
@@ -113,6 +125,8 @@ struct qemuDomainJobObj {
     bool dump_memory_only;              /* use dump-guest-memory to do dump */
     qemuMonitorMigrationStatus status;  /* Raw async job progress data */
     virDomainJobInfo info;              /* Processed async job progress data */
+    bool tunnel_set;                    /* Job runs a migration tunnel */
+    qemuDomainJobTunnelStats tunnel;    /* Migration tunnel progress */
     bool asyncAbort;                    /* abort of async job requested */
 };
 
@@ -154,6 +168,7 @@ struct _qemuDomainObjPrivate {
     char *lockState;
 
     bool fakeReboot;
+    bool reconnecting; /* monitor not yet reconnected after daemon restart */
 
     int jobs_queued;
 
@@ -350,6 +365,8 @@ int qemuDomainCheckDiskPresence(virQEMUDriverPtr driver,
 
 int qemuDiskChainCheckBroken(virDomainDiskDefPtr disk);
 
+void qemuDomainInvalidateDiskChain(virDomainDiskDefPtr disk);
+
 int qemuDomainDetermineDiskChain(virQEMUDriverPtr driver,
                                  virDomainDiskDefPtr disk,
                                  bool force);
@@ -92,6 +92,7 @@
 #include "virtypedparam.h"
 #include "virbitmap.h"
 #include "virstring.h"
+#include "vircompress.h"
 #include "viraccessapicheck.h"
 #include "viraccessapicheckqemu.h"
 
@@ -740,6 +741,7 @@ qemuStateInitialize(bool privileged,
     }
 
     qemu_driver->qemuCapsCache = virQEMUCapsCacheNew(cfg->libDir,
+                                                     cfg->cacheDir,
                                                      run_uid,
                                                      run_gid);
     if (!qemu_driver->qemuCapsCache)
@@ -1256,13 +1258,14 @@ cleanup:
 
 static int
 qemuGetProcessInfo(unsigned long long *cpuTime, int *lastCpu, long *vm_rss,
-                   pid_t pid, int tid)
+                   char *procState, pid_t pid, int tid)
 {
     char *proc;
     FILE *pidinfo;
     unsigned long long usertime, systime;
     long rss;
     int cpu;
+    char state;
     int ret;
 
     /* In general, we cannot assume pid_t fits in int; but /proc parsing
@@ -1282,6 +1285,8 @@ qemuGetProcessInfo(unsigned long long *cpuTime, int *lastCpu, long *vm_rss,
             *lastCpu = 0;
         if (vm_rss)
             *vm_rss = 0;
+        if (procState)
+            *procState = 'X';
         VIR_FREE(proc);
         return 0;
     }
@@ -1291,12 +1296,12 @@ qemuGetProcessInfo(unsigned long long *cpuTime, int *lastCpu, long *vm_rss,
      * only interested in a very few of them */
     if (fscanf(pidinfo,
                /* pid -> stime */
-               "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
+               "%*d %*s %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
                /* cutime -> endcode */
                "%*d %*d %*d %*d %*d %*d %*u %*u %ld %*u %*u %*u"
                /* startstack -> processor */
                "%*u %*u %*u %*u %*u %*u %*u %*u %*u %*u %*d %d",
-               &usertime, &systime, &rss, &cpu) != 4) {
+               &state, &usertime, &systime, &rss, &cpu) != 5) {
         VIR_FORCE_FCLOSE(pidinfo);
         VIR_WARN("cannot parse process status data");
         errno = -EINVAL;
@@ -1312,6 +1317,8 @@ qemuGetProcessInfo(unsigned long long *cpuTime, int *lastCpu, long *vm_rss,
         *cpuTime = 1000ull * 1000ull * 1000ull * (usertime + systime) / (unsigned long long)sysconf(_SC_CLK_TCK);
     if (lastCpu)
         *lastCpu = cpu;
+    if (procState)
+        *procState = state;
 
     /* We got pages
      * We want kiloBytes
@@ -2488,7 +2495,7 @@ static int qemuDomainGetInfo(virDomainPtr dom,
     if (!virDomainObjIsActive(vm)) {
         info->cpuTime = 0;
     } else {
-        if (qemuGetProcessInfo(&(info->cpuTime), NULL, NULL, vm->pid, 0) < 0) {
+        if (qemuGetProcessInfo(&(info->cpuTime), NULL, NULL, NULL, vm->pid, 0) < 0) {
             virReportError(VIR_ERR_OPERATION_FAILED, "%s",
                            _("cannot read cputime for domain"));
             goto cleanup;
@@ -2647,6 +2654,8 @@ typedef enum {
      */
     QEMU_SAVE_FORMAT_XZ = 3,
     QEMU_SAVE_FORMAT_LZOP = 4,
+    /* Block parallel LZ4 done by libvirt_iohelper, not an lz4 frame */
+    QEMU_SAVE_FORMAT_LZ4 = 5,
     /* Note: add new members only at the end.
        These values are used in the on-disk format.
        Do not change or re-use numbers. */
@@ -2660,7 +2669,8 @@ VIR_ENUM_IMPL(qemuSaveCompression, QEMU_SAVE_FORMAT_LAST,
               "gzip",
               "bzip2",
               "xz",
-              "lzop")
+              "lzop",
+              "lz4")
 
 typedef struct _virQEMUSaveHeader virQEMUSaveHeader;
 typedef virQEMUSaveHeader *virQEMUSaveHeaderPtr;
@@ -2707,17 +2717,52 @@ endjob:
     return ret;
 }
 
-/* Given a virQEMUSaveFormat compression level, return the name
- * of the program to run, or NULL if no program is needed.  */
-static const char *
-qemuCompressProgramName(int compress)
+#define QEMU_IOHELPER LIBEXECDIR "/libvirt_iohelper"
+
+/* Given a virQEMUSaveFormat compression level, fill @argv with the
+ * command line of the program to run, or NULL if no program is
+ * needed.  Returns 0 on success, -1 on error.  */
+static int
+qemuCompressGetArgv(virQEMUDriverPtr driver,
+                    virQEMUSaveFormat compress,
+                    char ***argv)
 {
-    return (compress == QEMU_SAVE_FORMAT_RAW ? NULL :
-            qemuSaveCompressionTypeToString(compress));
+    virQEMUDriverConfigPtr cfg = NULL;
+    char **args = NULL;
+    int ret = -1;
+
+    *argv = NULL;
+    if (compress == QEMU_SAVE_FORMAT_RAW)
+        return 0;
+
+    if (VIR_ALLOC_N(args, 4) < 0)
+        goto cleanup;
+
+    if (compress == QEMU_SAVE_FORMAT_LZ4) {
+        cfg = virQEMUDriverGetConfig(driver);
+        if (VIR_STRDUP(args[0], QEMU_IOHELPER) < 0 ||
+            VIR_STRDUP(args[1], "--compress") < 0 ||
+            virAsprintf(&args[2], "%u", cfg->saveImageThreads) < 0)
+            goto cleanup;
+    } else {
+        if (VIR_STRDUP(args[0], qemuSaveCompressionTypeToString(compress)) < 0 ||
+            VIR_STRDUP(args[1], "-c") < 0)
+            goto cleanup;
+    }
+
+    *argv = args;
+    args = NULL;
+    ret = 0;
+
+cleanup:
+    virStringFreeList(args);
+    virObjectUnref(cfg);
+    return ret;
 }
 
 static virCommandPtr
-qemuCompressGetCommand(virQEMUSaveFormat compression)
+qemuCompressGetCommand(virQEMUDriverConfigPtr cfg,
+                       virQEMUSaveFormat compression)
 {
     virCommandPtr ret = NULL;
     const char *prog = qemuSaveCompressionTypeToString(compression);
@@ -2729,6 +2774,12 @@ qemuCompressGetCommand(virQEMUSaveFormat compression)
         return NULL;
     }
 
+    if (compression == QEMU_SAVE_FORMAT_LZ4) {
+        ret = virCommandNewArgList(QEMU_IOHELPER, "--decompress", NULL);
+        virCommandAddArgFormat(ret, "%u", cfg->saveImageThreads);
+        return ret;
+    }
+
     ret = virCommandNew(prog);
     virCommandAddArg(ret, "-dc");
 
@@ -2913,6 +2964,7 @@ qemuDomainSaveMemory(virQEMUDriverPtr driver,
     unsigned long long offset;
     size_t len;
     char *xml = NULL;
+    char **compressor = NULL;
 
     memset(&header, 0, sizeof(header));
     memcpy(header.magic, QEMU_SAVE_PARTIAL, sizeof(header.magic));
@@ -2966,8 +3018,11 @@ qemuDomainSaveMemory(virQEMUDriverPtr driver,
         goto cleanup;
 
     /* Perform the migration */
+    if (qemuCompressGetArgv(driver, compressed, &compressor) < 0)
+        goto cleanup;
+
     if (qemuMigrationToFile(driver, vm, fd, offset, path,
-                            qemuCompressProgramName(compressed),
+                            (const char *const *) compressor,
                             bypassSecurityDriver,
                             asyncJob) < 0)
         goto cleanup;
@@ -3007,6 +3062,7 @@ cleanup:
     VIR_FORCE_CLOSE(fd);
     virFileWrapperFdFree(wrapperFd);
     VIR_FREE(xml);
+    virStringFreeList(compressor);
 
     if (ret != 0 && needUnlink)
         unlink(path);
@@ -3144,6 +3200,8 @@ static bool qemuCompressProgramAvailable(virQEMUSaveFormat compress)
 
     if (compress == QEMU_SAVE_FORMAT_RAW)
         return true;
+    if (compress == QEMU_SAVE_FORMAT_LZ4)
+        return virCompressAvailable() && virFileIsExecutable(QEMU_IOHELPER);
     prog = qemuSaveCompressionTypeToString(compress);
     c = virFindFileInPath(prog);
     if (!c)
@@ -3396,6 +3454,7 @@ doCoreDump(virQEMUDriverPtr driver,
     virFileWrapperFdPtr wrapperFd = NULL;
     int directFlag = 0;
     unsigned int flags = VIR_FILE_WRAPPER_NON_BLOCKING;
+    char **compressor = NULL;
 
     /* Create an empty file with appropriate ownership.  */
     if (dump_flags & VIR_DUMP_BYPASS_CACHE) {
@@ -3421,8 +3480,10 @@ doCoreDump(virQEMUDriverPtr driver,
     if (dump_flags & VIR_DUMP_MEMORY_ONLY) {
         ret = qemuDumpToFd(driver, vm, fd, QEMU_ASYNC_JOB_DUMP);
     } else {
+        if (qemuCompressGetArgv(driver, compress, &compressor) < 0)
+            goto cleanup;
         ret = qemuMigrationToFile(driver, vm, fd, 0, path,
-                                  qemuCompressProgramName(compress), false,
+                                  (const char *const *) compressor, false,
                                   QEMU_ASYNC_JOB_DUMP);
     }
 
@@ -3445,6 +3506,7 @@ cleanup:
     if (ret != 0)
         unlink(path);
     virFileWrapperFdFree(wrapperFd);
+    virStringFreeList(compressor);
     return ret;
 }
 
@@ -3469,6 +3531,14 @@ getCompressionType(virQEMUDriverPtr driver)
             ret = QEMU_SAVE_FORMAT_RAW;
             goto cleanup;
         }
+        /* Dumps are meant for tools like crash, which cannot
+         * read libvirt's own block format */
+        if (ret == QEMU_SAVE_FORMAT_LZ4) {
+            VIR_WARN("%s", _("lz4 is not supported as dump image "
+                             "format, using raw"));
+            ret = QEMU_SAVE_FORMAT_RAW;
+            goto cleanup;
+        }
         if (!qemuCompressProgramAvailable(ret)) {
             VIR_WARN("%s", _("Compression program for dump image format "
                              "in configuration file isn't available, "
@@ -4438,12 +4508,12 @@ qemuDomainGetVcpuPinInfo(virDomainPtr dom,
     virDomainObjPtr vm = NULL;
     virDomainDefPtr targetDef = NULL;
     int ret = -1;
-    int maxcpu, hostcpus, vcpu, pcpu;
+    int maxcpu, hostcpus, vcpu;
+    ssize_t pcpu;
     int n;
     virDomainVcpuPinDefPtr *vcpupin_list;
     virBitmapPtr cpumask = NULL;
     unsigned char *cpumap;
-    bool pinned;
     virCapsPtr caps = NULL;
 
     virCheckFlags(VIR_DOMAIN_AFFECT_LIVE |
@@ -4499,12 +4569,16 @@ qemuDomainGetVcpuPinInfo(virDomainPtr dom,
         vcpu = vcpupin_list[n]->vcpuid;
         cpumask = vcpupin_list[n]->cpumask;
         cpumap = VIR_GET_CPUMAP(cpumaps, maplen, vcpu);
-        for (pcpu = 0; pcpu < maxcpu; pcpu++) {
-            if (virBitmapGetBit(cpumask, pcpu, &pinned) < 0)
-                goto cleanup;
-            if (!pinned)
-                VIR_UNUSE_CPU(cpumap, pcpu);
+        if (virBitmapSize(cpumask) < maxcpu) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("Failed to query pinning of vcpu %d"), vcpu);
+            goto cleanup;
         }
+        memset(cpumap, 0, maplen);
+        pcpu = -1;
+        while ((pcpu = virBitmapNextSetBit(cpumask, pcpu)) >= 0 &&
+               pcpu < maxcpu)
+            VIR_USE_CPU(cpumap, pcpu);
     }
     ret = ncpumaps;
 
@@ -4686,9 +4760,9 @@ qemuDomainGetEmulatorPinInfo(virDomainPtr dom,
     virDomainObjPtr vm = NULL;
     virDomainDefPtr targetDef = NULL;
     int ret = -1;
-    int maxcpu, hostcpus, pcpu;
+    int maxcpu, hostcpus;
+    ssize_t pcpu;
     virBitmapPtr cpumask = NULL;
-    bool pinned;
     virCapsPtr caps = NULL;
 
     virCheckFlags(VIR_DOMAIN_AFFECT_LIVE |
@@ -4735,13 +4809,18 @@ qemuDomainGetEmulatorPinInfo(virDomainPtr dom,
         goto cleanup;
     }
 
-    for (pcpu = 0; pcpu < maxcpu; pcpu++) {
-        if (virBitmapGetBit(cpumask, pcpu, &pinned) < 0)
-            goto cleanup;
-        if (!pinned)
-            VIR_UNUSE_CPU(cpumaps, pcpu);
+    if (virBitmapSize(cpumask) < maxcpu) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Failed to query emulator pinning"));
+        goto cleanup;
     }
 
+    memset(cpumaps, 0, maplen);
+    pcpu = -1;
+    while ((pcpu = virBitmapNextSetBit(cpumask, pcpu)) >= 0 &&
+           pcpu < maxcpu)
+        VIR_USE_CPU(cpumaps, pcpu);
+
     ret = 1;
 
 cleanup:
@@ -4800,6 +4879,7 @@ qemuDomainGetVcpus(virDomainPtr dom,
                     qemuGetProcessInfo(&(info[i].cpuTime),
                                        &(info[i].cpu),
                                        NULL,
+                                       NULL,
                                        vm->pid,
                                        priv->vcpupids[i]) < 0) {
                     virReportSystemError(errno, "%s",
@@ -5299,7 +5379,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
 
     if ((header->version == 2) &&
         (header->compressed != QEMU_SAVE_FORMAT_RAW)) {
-        if (!(cmd = qemuCompressGetCommand(header->compressed)))
+        if (!(cmd = qemuCompressGetCommand(cfg, header->compressed)))
             goto cleanup;
 
         intermediatefd = *fd;
@@ -9500,7 +9580,7 @@ qemuDomainMemoryStats(virDomainPtr dom,
 
         if (ret >= 0 && ret < nr_stats) {
             long rss;
-            if (qemuGetProcessInfo(NULL, NULL, &rss, vm->pid, 0) < 0) {
+            if (qemuGetProcessInfo(NULL, NULL, &rss, NULL, vm->pid, 0) < 0) {
                 virReportError(VIR_ERR_OPERATION_FAILED, "%s",
                                _("cannot get RSS for domain"));
             } else {
@@ -11046,6 +11126,28 @@ qemuDomainGetJobStats(virDomainPtr dom,
             goto cleanup;
     }
 
+    if (priv->job.tunnel_set) {
+        if (virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_BYTES,
+                                    priv->job.tunnel.bytes) < 0 ||
+            virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_THROUGHPUT,
+                                    priv->job.tunnel.throughput) < 0 ||
+            virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_CHUNK,
+                                    priv->job.tunnel.chunk) < 0 ||
+            virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_READ_TIME,
+                                    priv->job.tunnel.readTime) < 0 ||
+            virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_SEND_TIME,
+                                    priv->job.tunnel.sendTime) < 0 ||
+            virTypedParamsAddULLong(&par, &npar, &maxpar,
+                                    VIR_DOMAIN_JOB_TUNNEL_STALL_TIME,
+                                    priv->job.tunnel.stallTime) < 0)
+            goto cleanup;
+    }
+
     *type = priv->job.info.type;
     *params = par;
     *nparams = npar;
@@ -11871,6 +11973,8 @@ qemuDomainSnapshotCreateSingleDiskActive(virQEMUDriverPtr driver,
      * ourselves rather than reprobing, but this requires modifying
      * domain_conf and our XML to fully track the chain across
      * libvirtd restarts.  */
+    qemuDomainInvalidateDiskChain(disk);
+    virStorageFileMetadataCacheInvalidate(source);
     virStorageFileFreeMetadata(disk->backingChain);
     disk->backingChain = NULL;
 
@@ -13895,6 +13999,7 @@ qemuDomainBlockPivot(virConnectPtr conn,
     disk->src = disk->mirror;
     disk->format = disk->mirrorFormat;
     disk->backingChain = NULL;
+    virStorageFileMetadataCacheInvalidate(disk->src);
     if (qemuDomainDetermineDiskChain(driver, disk, false) < 0) {
         disk->src = oldsrc;
         disk->format = oldformat;
@@ -15847,6 +15952,610 @@ qemuNodeSuspendForDuration(virConnectPtr conn,
 }
 
 
+/* The stats worker holds a QEMU_JOB_QUERY job on the domain and may
+ * therefore talk to the monitor */
+#define QEMU_DOMAIN_STATS_HAVE_JOB  (1 << 0)
+
+#define HAVE_JOB(flags) ((flags) & QEMU_DOMAIN_STATS_HAVE_JOB)
+
+static int
+qemuDomainGetStatsState(virQEMUDriverPtr driver ATTRIBUTE_UNUSED,
+                        virDomainObjPtr vm,
+                        virDomainStatsRecordPtr record,
+                        int *maxparams,
+                        unsigned int privflags ATTRIBUTE_UNUSED)
+{
+    int state;
+    int reason;
+
+    state = virDomainObjGetState(vm, &reason);
+
+    if (virTypedParamsAddInt(&record->params,
+                             &record->nparams,
+                             maxparams,
+                             "state.state",
+                             state) < 0)
+        return -1;
+
+    if (virTypedParamsAddInt(&record->params,
+                             &record->nparams,
+                             maxparams,
+                             "state.reason",
+                             reason) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static int
+qemuDomainGetStatsCpu(virQEMUDriverPtr driver ATTRIBUTE_UNUSED,
+                      virDomainObjPtr vm,
+                      virDomainStatsRecordPtr record,
+                      int *maxparams,
+                      unsigned int privflags ATTRIBUTE_UNUSED)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long cpu_time = 0;
+    unsigned long long user_time = 0;
+    unsigned long long sys_time = 0;
+
+    if (!virDomainObjIsActive(vm) || !priv->cgroup ||
+        !virCgroupHasController(priv->cgroup, VIR_CGROUP_CONTROLLER_CPUACCT))
+        return 0;
+
+    /* Failing to read the accounting data is not fatal, the group
+     * is simply left out of the record */
+    if (virCgroupGetCpuacctUsage(priv->cgroup, &cpu_time) < 0 ||
+        virCgroupGetCpuacctStat(priv->cgroup, &user_time, &sys_time) < 0) {
+        virResetLastError();
+        return 0;
+    }
+
+    if (virTypedParamsAddULLong(&record->params,
+                                &record->nparams,
+                                maxparams,
+                                "cpu.time",
+                                cpu_time) < 0)
+        return -1;
+
+    if (virTypedParamsAddULLong(&record->params,
+                                &record->nparams,
+                                maxparams,
+                                "cpu.user",
+                                user_time) < 0)
+        return -1;
+
+    if (virTypedParamsAddULLong(&record->params,
+                                &record->nparams,
+                                maxparams,
+                                "cpu.system",
+                                sys_time) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static int
+qemuDomainGetStatsBalloon(virQEMUDriverPtr driver,
+                          virDomainObjPtr vm,
+                          virDomainStatsRecordPtr record,
+                          int *maxparams,
+                          unsigned int privflags)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long cur_balloon = vm->def->mem.cur_balloon;
+    unsigned long long balloon;
+    int err;
+
+    if (virDomainObjIsActive(vm)) {
+        if (vm->def->memballoon &&
+            vm->def->memballoon->model == VIR_DOMAIN_MEMBALLOON_MODEL_NONE) {
+            cur_balloon = vm->def->mem.max_balloon;
+        } else if (!virQEMUCapsGet(priv->qemuCaps, QEMU_CAPS_BALLOON_EVENT) &&
+                   HAVE_JOB(privflags)) {
+            qemuDomainObjEnterMonitor(driver, vm);
+            err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
+            qemuDomainObjExitMonitor(driver, vm);
+
+            /* Not being able to query the balloon is no reason to
+             * fail, just report the last known value */
+            if (err < 0)
+                virResetLastError();
+            else if (err == 0)
+                cur_balloon = vm->def->mem.max_balloon;
+            else
+                cur_balloon = balloon;
+        }
+    }
+
+    if (virTypedParamsAddULLong(&record->params,
+                                &record->nparams,
+                                maxparams,
+                                "balloon.current",
+                                cur_balloon) < 0)
+        return -1;
+
+    if (virTypedParamsAddULLong(&record->params,
+                                &record->nparams,
+                                maxparams,
+                                "balloon.maximum",
+                                vm->def->mem.max_balloon) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+static int
+qemuDomainGetStatsVcpu(virQEMUDriverPtr driver ATTRIBUTE_UNUSED,
+                       virDomainObjPtr vm,
+                       virDomainStatsRecordPtr record,
+                       int *maxparams,
+                       unsigned int privflags ATTRIBUTE_UNUSED)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    size_t i;
+    char param_name[VIR_TYPED_PARAM_FIELD_LENGTH];
+
+    if (virTypedParamsAddUInt(&record->params,
+                              &record->nparams,
+                              maxparams,
+                              "vcpu.current",
+                              (unsigned) vm->def->vcpus) < 0)
+        return -1;
+
+    if (virTypedParamsAddUInt(&record->params,
+                              &record->nparams,
+                              maxparams,
+                              "vcpu.maximum",
+                              (unsigned) vm->def->maxvcpus) < 0)
+        return -1;
+
+    if (!virDomainObjIsActive(vm) || !priv->vcpupids)
+        return 0;
+
+    for (i = 0; i < priv->nvcpupids; i++) {
+        unsigned long long cpu_time;
+        char procstate;
+        int state;
+
+        if (qemuGetProcessInfo(&cpu_time, NULL, NULL, &procstate,
+                               vm->pid, priv->vcpupids[i]) < 0) {
+            virResetLastError();
+            continue;
+        }
+
+        /* A vCPU thread sleeps while the guest CPU is halted, or while
+         * all vCPUs are stopped for a paused domain */
+        switch (procstate) {
+        case 'R':
+            state = VIR_VCPU_RUNNING;
+            break;
+        case 'Z':
+        case 'X':
+            state = VIR_VCPU_OFFLINE;
+            break;
+        default:
+            state = VIR_VCPU_BLOCKED;
+            break;
+        }
+
+        snprintf(param_name, VIR_TYPED_PARAM_FIELD_LENGTH,
+                 "vcpu.%zu.state", i);
+        if (virTypedParamsAddInt(&record->params,
+                                 &record->nparams,
+                                 maxparams,
+                                 param_name,
+                                 state) < 0)
+            return -1;
+
+        snprintf(param_name, VIR_TYPED_PARAM_FIELD_LENGTH,
+                 "vcpu.%zu.time", i);
+        if (virTypedParamsAddULLong(&record->params,
+                                    &record->nparams,
+                                    maxparams,
+                                    param_name,
+                                    cpu_time) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+#define QEMU_ADD_COUNT_PARAM(record, maxparams, type, count)                \
+do {                                                                        \
+    char param_name[VIR_TYPED_PARAM_FIELD_LENGTH];                          \
+    snprintf(param_name, VIR_TYPED_PARAM_FIELD_LENGTH, "%s.count", type);   \
+    if (virTypedParamsAddUInt(&(record)->params,                            \
+                              &(record)->nparams,                           \
+                              maxparams,                                    \
+                              param_name,                                   \
+                              count) < 0)                                   \
+        goto cleanup;                                                       \
+} while (0)
+
+#define QEMU_ADD_NAME_PARAM(record, maxparams, type, num, name)             \
+do {                                                                        \
+    char param_name[VIR_TYPED_PARAM_FIELD_LENGTH];                          \
+    snprintf(param_name, VIR_TYPED_PARAM_FIELD_LENGTH,                      \
+             "%s.%zu.name", type, num);                                     \
+    if (virTypedParamsAddString(&(record)->params,                          \
+                                &(record)->nparams,                         \
+                                maxparams,                                  \
+                                param_name,                                 \
+                                name) < 0)                                  \
+        goto cleanup;                                                       \
+} while (0)
+
+/* Values of -1 mean the statistic is not provided by the hypervisor */
+#define QEMU_ADD_STAT_PARAM(record, maxparams, type, num, name, value)     \
+do {                                                                        \
+    char param_name[VIR_TYPED_PARAM_FIELD_LENGTH];                          \
+    if ((value) >= 0) {                                                     \
+        snprintf(param_name, VIR_TYPED_PARAM_FIELD_LENGTH,                  \
+                 "%s.%zu.%s", type, num, name);                             \
+        if (virTypedParamsAddULLong(&(record)->params,                      \
+                                    &(record)->nparams,                     \
+                                    maxparams,                              \
+                                    param_name,                             \
+                                    value) < 0)                             \
+            goto cleanup;                                                   \
+    }                                                                       \
+} while (0)
+
+#ifdef __linux__
+static int
+qemuDomainGetStatsInterface(virQEMUDriverPtr driver ATTRIBUTE_UNUSED,
+                            virDomainObjPtr vm,
+                            virDomainStatsRecordPtr record,
+                            int *maxparams,
+                            unsigned int privflags ATTRIBUTE_UNUSED)
+{
+    size_t i;
+    struct _virDomainInterfaceStats tmp;
+    int ret = -1;
+
+    if (!virDomainObjIsActive(vm))
+        return 0;
+
+    QEMU_ADD_COUNT_PARAM(record, maxparams, "net", vm->def->nnets);
+
+    for (i = 0; i < vm->def->nnets; i++) {
+        virDomainNetDefPtr net = vm->def->nets[i];
+
+        if (!net->ifname)
+            continue;
+
+        QEMU_ADD_NAME_PARAM(record, maxparams, "net", i, net->ifname);
+
+        if (linuxDomainInterfaceStats(net->ifname, &tmp) < 0) {
+            virResetLastError();
+            continue;
+        }
+
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "rx.bytes",
+                             tmp.rx_bytes);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "rx.pkts",
+                             tmp.rx_packets);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "rx.errs",
+                             tmp.rx_errs);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "rx.drop",
+                             tmp.rx_drop);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "tx.bytes",
+                             tmp.tx_bytes);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "tx.pkts",
+                             tmp.tx_packets);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "tx.errs",
+                             tmp.tx_errs);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "net", i, "tx.drop",
+                             tmp.tx_drop);
+    }
+
+    ret = 0;
+
+cleanup:
+    return ret;
+}
+#endif /* __linux__ */
+
+
+static int
+qemuDomainGetStatsBlock(virQEMUDriverPtr driver,
+                        virDomainObjPtr vm,
+                        virDomainStatsRecordPtr record,
+                        int *maxparams,
+                        unsigned int privflags)
+{
+    size_t i;
+    int ret = -1;
+    virHashTablePtr stats = NULL;
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    if (!HAVE_JOB(privflags) || !virDomainObjIsActive(vm))
+        return 0;
+
+    /* A single query-blockstats covers all disks of the domain */
+    qemuDomainObjEnterMonitor(driver, vm);
+    stats = qemuMonitorGetAllBlockStatsInfo(priv->mon);
+    qemuDomainObjExitMonitor(driver, vm);
+
+    if (!stats) {
+        virResetLastError();
+        return 0;
+    }
+
+    QEMU_ADD_COUNT_PARAM(record, maxparams, "block", vm->def->ndisks);
+
+    for (i = 0; i < vm->def->ndisks; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        qemuBlockStatsPtr entry;
+
+        QEMU_ADD_NAME_PARAM(record, maxparams, "block", i, disk->dst);
+
+        if (!disk->info.alias ||
+            !(entry = virHashLookup(stats, disk->info.alias)))
+            continue;
+
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "rd.reqs",
+                             entry->rd_req);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "rd.bytes",
+                             entry->rd_bytes);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "rd.times",
+                             entry->rd_total_times);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "wr.reqs",
+                             entry->wr_req);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "wr.bytes",
+                             entry->wr_bytes);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "wr.times",
+                             entry->wr_total_times);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "fl.reqs",
+                             entry->flush_req);
+        QEMU_ADD_STAT_PARAM(record, maxparams, "block", i, "fl.times",
+                             entry->flush_total_times);
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(stats);
+    return ret;
+}
+
+#undef QEMU_ADD_STAT_PARAM
+#undef QEMU_ADD_NAME_PARAM
+#undef QEMU_ADD_COUNT_PARAM
+
+typedef int
+(*qemuDomainGetStatsFunc)(virQEMUDriverPtr driver,
+                          virDomainObjPtr vm,
+                          virDomainStatsRecordPtr record,
+                          int *maxparams,
+                          unsigned int flags);
+
+struct qemuDomainGetStatsWorker {
+    qemuDomainGetStatsFunc func;
+    unsigned int stats;
+    bool monitor;
+};
+
+static struct qemuDomainGetStatsWorker qemuDomainGetStatsWorkers[] = {
+    { qemuDomainGetStatsState, VIR_DOMAIN_STATS_STATE, false },
+    { qemuDomainGetStatsCpu, VIR_DOMAIN_STATS_CPU_TOTAL, false },
+    { qemuDomainGetStatsBalloon, VIR_DOMAIN_STATS_BALLOON, true },
+    { qemuDomainGetStatsVcpu, VIR_DOMAIN_STATS_VCPU, false },
+#ifdef __linux__
+    { qemuDomainGetStatsInterface, VIR_DOMAIN_STATS_INTERFACE, false },
+#endif
+    { qemuDomainGetStatsBlock, VIR_DOMAIN_STATS_BLOCK, true },
+    { NULL, 0, false }
+};
+
+
+static int
+qemuDomainGetStatsCheckSupport(unsigned int *stats,
+                               bool enforce)
+{
+    unsigned int supportedstats = 0;
+    size_t i;
+
+    for (i = 0; qemuDomainGetStatsWorkers[i].func; i++)
+        supportedstats |= qemuDomainGetStatsWorkers[i].stats;
+
+    if (*stats == 0) {
+        *stats = supportedstats;
+        return 0;
+    }
+
+    if (enforce &&
+        *stats & ~supportedstats) {
+        virReportError(VIR_ERR_ARGUMENT_UNSUPPORTED,
+                       _("Stats types bits 0x%x are not supported by this daemon"),
+                       *stats & ~supportedstats);
+        return -1;
+    }
+
+    *stats &= supportedstats;
+
+    return 0;
+}
+
+
+static bool
+qemuDomainGetStatsNeedMonitor(unsigned int stats)
+{
+    size_t i;
+
+    for (i = 0; qemuDomainGetStatsWorkers[i].func; i++) {
+        if (stats & qemuDomainGetStatsWorkers[i].stats &&
+            qemuDomainGetStatsWorkers[i].monitor)
+            return true;
+    }
+
+    return false;
+}
+
+
+static int
+qemuDomainGetStats(virConnectPtr conn,
+                   virDomainObjPtr vm,
+                   unsigned int stats,
+                   virDomainStatsRecordPtr *record,
+                   unsigned int flags)
+{
+    int maxparams = 0;
+    virDomainStatsRecordPtr tmp;
+    size_t i;
+    int ret = -1;
+
+    if (VIR_ALLOC(tmp) < 0)
+        goto cleanup;
+
+    for (i = 0; qemuDomainGetStatsWorkers[i].func; i++) {
+        if (stats & qemuDomainGetStatsWorkers[i].stats) {
+            if (qemuDomainGetStatsWorkers[i].func(conn->privateData, vm, tmp,
+                                                  &maxparams, flags) < 0)
+                goto cleanup;
+        }
+    }
+
+    if (!(tmp->dom = virGetDomain(conn, vm->def->name, vm->def->uuid)))
+        goto cleanup;
+    tmp->dom->id = vm->def->id;
+
+    *record = tmp;
+    tmp = NULL;
+    ret = 0;
+
+cleanup:
+    if (tmp) {
+        virTypedParamsFree(tmp->params, tmp->nparams);
+        VIR_FREE(tmp);
+    }
+
+    return ret;
+}
+
+
+static int
+qemuConnectGetAllDomainStats(virConnectPtr conn,
+                             virDomainPtr *doms,
+                             unsigned int ndoms,
+                             unsigned int stats,
+                             virDomainStatsRecordPtr **retStats,
+                             unsigned int flags)
+{
+    virQEMUDriverPtr driver = conn->privateData;
+    virDomainPtr *domlist = NULL;
+    virDomainObjPtr vm = NULL;
+    virDomainStatsRecordPtr *tmpstats = NULL;
+    bool enforce = !!(flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
+    int ntempdoms;
+    int nstats = 0;
+    size_t i;
+    int ret = -1;
+    unsigned int privflags = 0;
+    unsigned int domflags;
+    unsigned int lflags = flags & (VIR_CONNECT_LIST_DOMAINS_FILTERS_ACTIVE |
+                                   VIR_CONNECT_LIST_DOMAINS_FILTERS_PERSISTENT |
+                                   VIR_CONNECT_LIST_DOMAINS_FILTERS_STATE);
+
+    if (ndoms)
+        virCheckFlags(VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS, -1);
+    else
+        virCheckFlags(VIR_CONNECT_LIST_DOMAINS_FILTERS_ACTIVE |
+                      VIR_CONNECT_LIST_DOMAINS_FILTERS_PERSISTENT |
+                      VIR_CONNECT_LIST_DOMAINS_FILTERS_STATE |
+                      VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS, -1);
+
+    if (virConnectGetAllDomainStatsEnsureACL(conn) < 0)
+        return -1;
+
+    if (qemuDomainGetStatsCheckSupport(&stats, enforce) < 0)
+        return -1;
+
+    if (!ndoms) {
+        if ((ntempdoms = virDomainObjListExport(driver->domains,
+                                                conn,
+                                                &domlist,
+                                                virConnectGetAllDomainStatsCheckACL,
+                                                lflags)) < 0)
+            goto cleanup;
+
+        ndoms = ntempdoms;
+        doms = domlist;
+    }
+
+    if (VIR_ALLOC_N(tmpstats, ndoms + 1) < 0)
+        goto cleanup;
+
+    if (qemuDomainGetStatsNeedMonitor(stats))
+        privflags |= QEMU_DOMAIN_STATS_HAVE_JOB;
+
+    for (i = 0; i < ndoms; i++) {
+        virDomainStatsRecordPtr tmp = NULL;
+        int rc;
+
+        /* Domains may vanish between listing and querying them */
+        if (!(vm = qemuDomObjFromDomain(doms[i]))) {
+            virResetLastError();
+            continue;
+        }
+
+        if (doms != domlist &&
+            !virConnectGetAllDomainStatsCheckACL(conn, vm->def)) {
+            virObjectUnlock(vm);
+            vm = NULL;
+            continue;
+        }
+
+        domflags = privflags;
+        if (HAVE_JOB(domflags) &&
+            qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0) {
+            /* report the stats we can gather without the monitor */
+            virResetLastError();
+            domflags &= ~QEMU_DOMAIN_STATS_HAVE_JOB;
+        }
+
+        rc = qemuDomainGetStats(conn, vm, stats, &tmp, domflags);
+
+        if (HAVE_JOB(domflags) && !qemuDomainObjEndJob(driver, vm))
+            vm = NULL;
+
+        if (rc < 0)
+            goto cleanup;
+
+        tmpstats[nstats++] = tmp;
+
+        if (vm)
+            virObjectUnlock(vm);
+        vm = NULL;
+    }
+
+    *retStats = tmpstats;
+    tmpstats = NULL;
+
+    ret = nstats;
+
+cleanup:
+    if (vm)
+        virObjectUnlock(vm);
+
+    virDomainStatsRecordListFree(tmpstats);
+
+    if (domlist) {
+        for (i = 0; i < ndoms; i++)
+            virDomainFree(domlist[i]);
+        VIR_FREE(domlist);
+    }
+
+    return ret;
+}
+
+#undef HAVE_JOB
+
+
 static virDriver qemuDriver = {
     .no = VIR_DRV_QEMU,
     .name = QEMU_DRIVER_NAME,
@@ -16033,6 +16742,7 @@ static virDriver qemuDriver = {
     .domainMigratePerform3Params = qemuDomainMigratePerform3Params, /* 1.1.0 */
     .domainMigrateFinish3Params = qemuDomainMigrateFinish3Params, /* 1.1.0 */
     .domainMigrateConfirm3Params = qemuDomainMigrateConfirm3Params, /* 1.1.0 */
+    .connectGetAllDomainStats = qemuConnectGetAllDomainStats, /* 1.1.2 */
 };
 
 
@@ -1610,6 +1610,12 @@ qemuMigrationWaitForSpice(virQEMUDriverPtr driver,
     return 0;
 }
 
+typedef struct _qemuMigrationIOThread qemuMigrationIOThread;
+typedef qemuMigrationIOThread *qemuMigrationIOThreadPtr;
+
+static void qemuMigrationIOGetStats(qemuMigrationIOThreadPtr io,
+                                    qemuDomainJobTunnelStatsPtr stats);
+
 static int
 qemuMigrationUpdateJobStatus(virQEMUDriverPtr driver,
                              virDomainObjPtr vm,
@@ -1692,7 +1698,8 @@ qemuMigrationUpdateJobStatus(virQEMUDriverPtr driver,
 static int
 qemuMigrationWaitForCompletion(virQEMUDriverPtr driver, virDomainObjPtr vm,
                                enum qemuDomainAsyncJob asyncJob,
-                               virConnectPtr dconn, bool abort_on_error)
+                               virConnectPtr dconn, bool abort_on_error,
+                               qemuMigrationIOThreadPtr iothread)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
     const char *job;
@@ -1727,6 +1734,11 @@ qemuMigrationWaitForCompletion(virQEMUDriverPtr driver, virDomainObjPtr vm,
         if (qemuMigrationUpdateJobStatus(driver, vm, job, asyncJob) < 0)
             goto cleanup;
 
+        if (iothread) {
+            qemuMigrationIOGetStats(iothread, &priv->job.tunnel);
+            priv->job.tunnel_set = true;
+        }
+
         if (dconn && virConnectIsAlive(dconn) <= 0) {
             virReportError(VIR_ERR_OPERATION_FAILED, "%s",
                            _("Lost connection to destination host"));
@@ -2818,32 +2830,137 @@ struct _qemuMigrationSpec {
     } fwd;
 };
 
-#define TUNNEL_SEND_BUF_SIZE 65536
+/* Up to TUNNEL_SEND_WINDOW packets can be read ahead of the stream,
+ * so reading from qemu overlaps with sending to the destination
+ * instead of alternating with it. Their size is picked by
+ * qemuMigrationTunnelNextChunk.
+ */
+#define TUNNEL_SEND_WINDOW 4
+
+typedef struct _qemuMigrationIOBuf qemuMigrationIOBuf;
+typedef qemuMigrationIOBuf *qemuMigrationIOBufPtr;
+struct _qemuMigrationIOBuf {
+    char *data;
+    size_t size;
+    size_t len;
+};
 
-typedef struct _qemuMigrationIOThread qemuMigrationIOThread;
-typedef qemuMigrationIOThread *qemuMigrationIOThreadPtr;
 struct _qemuMigrationIOThread {
-    virThread thread;
+    virThread thread;   /* reads from qemu */
+    virThread sender;   /* writes into the stream */
     virStreamPtr st;
     int sock;
     virError err;
+    virError sendErr;
     int wakeupRecvFD;
     int wakeupSendFD;
+
+    virMutex lock;
+    virCond cond;
+    qemuMigrationIOBuf bufs[TUNNEL_SEND_WINDOW];
+    size_t head;        /* oldest filled buffer */
+    size_t count;       /* number of filled buffers */
+    bool eof;           /* no more data, finish the stream once sent */
+    bool abort;         /* abort the stream, dropping pending data */
+    bool failed;        /* sending failed, stop reading */
+
+    /* Progress, times are in microseconds */
+    unsigned long long start;
+    unsigned long long bytes;
+    unsigned long long chunk;
+    unsigned long long readTime;
+    unsigned long long sendTime;
+    unsigned long long stallTime;
 };
 
+/* Microseconds since @then, 0 if the clock could not be read */
+static unsigned long long
+qemuMigrationIOSince(unsigned long long then)
+{
+    unsigned long long now;
+
+    if (!then || virTimeMicrosNowRaw(&now) < 0)
+        return 0;
+
+    return now > then ? now - then : 0;
+}
+
+/**
+ * qemuMigrationTunnelNextChunk:
+ * @chunk: size of the last stream packet read from qemu
+ * @len: how much of it qemu filled
+ *
+ * Stream packets start out at QEMU_MIGRATION_TUNNEL_CHUNK_MIN and
+ * double up to QEMU_MIGRATION_TUNNEL_CHUNK_MAX while qemu keeps
+ * filling them. Once it fills less than a quarter of one, they are
+ * halved again.
+ *
+ * Returns the size of the next packet
+ */
+size_t
+qemuMigrationTunnelNextChunk(size_t chunk, size_t len)
+{
+    if (len == chunk && chunk < QEMU_MIGRATION_TUNNEL_CHUNK_MAX)
+        return chunk * 2;
+    if (len < chunk / 4 && chunk > QEMU_MIGRATION_TUNNEL_CHUNK_MIN)
+        return chunk / 2;
+    return chunk;
+}
+
+/* Wait for a free buffer to read into; NULL if the stream failed */
+static qemuMigrationIOBufPtr
+qemuMigrationIOReserve(qemuMigrationIOThreadPtr data)
+{
+    qemuMigrationIOBufPtr buf = NULL;
+    unsigned long long then = 0;
+
+    ignore_value(virTimeMicrosNowRaw(&then));
+    virMutexLock(&data->lock);
+    while (data->count == TUNNEL_SEND_WINDOW && !data->failed) {
+        if (virCondWait(&data->cond, &data->lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("failed to wait on migration tunnel"));
+            goto cleanup;
+        }
+    }
+    data->stallTime += qemuMigrationIOSince(then);
+
+    if (!data->failed)
+        buf = &data->bufs[(data->head + data->count) % TUNNEL_SEND_WINDOW];
+
+cleanup:
+    virMutexUnlock(&data->lock);
+    return buf;
+}
+
+static void
+qemuMigrationIOStop(qemuMigrationIOThreadPtr data, bool failure)
+{
+    virMutexLock(&data->lock);
+    if (failure)
+        data->abort = true;
+    else
+        data->eof = true;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
 static void qemuMigrationIOFunc(void *arg)
 {
     qemuMigrationIOThreadPtr data = arg;
-    char *buffer = NULL;
     struct pollfd fds[2];
     int timeout = -1;
-    virErrorPtr err = NULL;
+    size_t chunk = QEMU_MIGRATION_TUNNEL_CHUNK_MIN;
 
     VIR_DEBUG("Running migration tunnel; stream=%p, sock=%d",
               data->st, data->sock);
 
-    if (VIR_ALLOC_N(buffer, TUNNEL_SEND_BUF_SIZE) < 0)
+    /* Drain whatever qemu has ready into each packet without blocking */
+    if (virSetNonBlock(data->sock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to set migration tunnel non-blocking"));
         goto abrt;
+    }
 
     fds[0].fd = data->sock;
     fds[1].fd = data->wakeupRecvFD;
@@ -2892,46 +3009,184 @@ static void qemuMigrationIOFunc(void *arg)
         }
 
         if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
-            int nbytes;
+            qemuMigrationIOBufPtr buf;
+            unsigned long long then = 0;
+            size_t len;
+            bool eof = false;
+
+            if (!(buf = qemuMigrationIOReserve(data))) {
+                if (virGetLastError())
+                    goto abrt;
+                /* The sender failed and kept its error */
+                return;
+            }
 
-            nbytes = saferead(data->sock, buffer, TUNNEL_SEND_BUF_SIZE);
-            if (nbytes > 0) {
-                if (virStreamSend(data->st, buffer, nbytes) < 0)
-                    goto error;
-            } else if (nbytes < 0) {
-                virReportSystemError(errno, "%s",
-                        _("tunnelled migration failed to read from qemu"));
-                goto abrt;
-            } else {
-                /* EOF; get out of here */
-                break;
+            if (buf->size < chunk) {
+                if (VIR_REALLOC_N(buf->data, chunk) < 0)
+                    goto abrt;
+                buf->size = chunk;
             }
-        }
-    }
 
-    if (virStreamFinish(data->st) < 0)
-        goto error;
+            ignore_value(virTimeMicrosNowRaw(&then));
+            while (buf->len < chunk) {
+                ssize_t nbytes = read(data->sock, buf->data + buf->len,
+                                      chunk - buf->len);
+                if (nbytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    virReportSystemError(errno, "%s",
+                            _("tunnelled migration failed to read from qemu"));
+                    goto abrt;
+                } else if (nbytes == 0) {
+                    eof = true;
+                    break;
+                }
+                buf->len += nbytes;
+            }
+
+            /* The buffer belongs to the sender once queued */
+            len = buf->len;
+            chunk = qemuMigrationTunnelNextChunk(chunk, len);
 
-    VIR_FREE(buffer);
+            virMutexLock(&data->lock);
+            data->readTime += qemuMigrationIOSince(then);
+            data->chunk = chunk;
+            if (len) {
+                data->count++;
+                virCondBroadcast(&data->cond);
+            }
+            virMutexUnlock(&data->lock);
+
+            /* EOF; get out of here */
+            if (eof)
+                break;
+        }
+    }
 
+    qemuMigrationIOStop(data, false);
     return;
 
 abrt:
-    err = virSaveLastError();
-    if (err && err->code == VIR_ERR_OK) {
-        virFreeError(err);
-        err = NULL;
+    virCopyLastError(&data->err);
+    virResetLastError();
+    qemuMigrationIOStop(data, true);
+}
+
+
+static void qemuMigrationIOSendFunc(void *arg)
+{
+    qemuMigrationIOThreadPtr data = arg;
+    bool aborted = false;
+
+    virMutexLock(&data->lock);
+
+    for (;;) {
+        qemuMigrationIOBufPtr buf;
+        unsigned long long then;
+        int rc;
+
+        while (!data->count && !data->eof &&
+               !data->abort && !data->failed) {
+            if (virCondWait(&data->cond, &data->lock) < 0) {
+                virReportSystemError(errno, "%s",
+                                     _("failed to wait on migration tunnel"));
+                goto error;
+            }
+        }
+
+        if (data->failed) {
+            /* The tunnel never started */
+            virMutexUnlock(&data->lock);
+            return;
+        }
+
+        if (data->abort) {
+            aborted = true;
+            break;
+        }
+
+        if (!data->count)
+            break;
+
+        buf = &data->bufs[data->head];
+        virMutexUnlock(&data->lock);
+
+        then = 0;
+        ignore_value(virTimeMicrosNowRaw(&then));
+        rc = virStreamSend(data->st, buf->data, buf->len);
+
+        virMutexLock(&data->lock);
+        data->sendTime += qemuMigrationIOSince(then);
+        if (rc < 0)
+            goto error;
+
+        data->bytes += buf->len;
+        buf->len = 0;
+        data->head = (data->head + 1) % TUNNEL_SEND_WINDOW;
+        data->count--;
+        virCondBroadcast(&data->cond);
     }
-    virStreamAbort(data->st);
-    if (err) {
-        virSetError(err);
-        virFreeError(err);
+
+    virMutexUnlock(&data->lock);
+
+    if (aborted) {
+        /* The reader keeps the error which made it abort */
+        virStreamAbort(data->st);
+        virResetLastError();
+        return;
     }
 
+    if (virStreamFinish(data->st) < 0) {
+        virMutexLock(&data->lock);
+        goto error;
+    }
+
+    return;
+
 error:
-    virCopyLastError(&data->err);
+    data->failed = true;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+    virCopyLastError(&data->sendErr);
     virResetLastError();
-    VIR_FREE(buffer);
+}
+
+
+static void
+qemuMigrationIOGetStats(qemuMigrationIOThreadPtr io,
+                        qemuDomainJobTunnelStatsPtr stats)
+{
+    unsigned long long elapsed;
+
+    virMutexLock(&io->lock);
+    elapsed = qemuMigrationIOSince(io->start);
+    stats->bytes = io->bytes;
+    stats->throughput = elapsed ? io->bytes * 1000000ull / elapsed : 0;
+    stats->chunk = io->chunk;
+    stats->readTime = io->readTime / 1000;
+    stats->sendTime = io->sendTime / 1000;
+    stats->stallTime = io->stallTime / 1000;
+    virMutexUnlock(&io->lock);
+}
+
+
+static void
+qemuMigrationIOFree(qemuMigrationIOThreadPtr io)
+{
+    size_t i;
+
+    if (!io)
+        return;
+
+    for (i = 0; i < TUNNEL_SEND_WINDOW; i++)
+        VIR_FREE(io->bufs[i].data);
+    virCondDestroy(&io->cond);
+    virMutexDestroy(&io->lock);
+    VIR_FORCE_CLOSE(io->wakeupSendFD);
+    VIR_FORCE_CLOSE(io->wakeupRecvFD);
+    VIR_FREE(io);
 }
 
 
@@ -2942,42 +3197,74 @@ qemuMigrationStartTunnel(virStreamPtr st,
     qemuMigrationIOThreadPtr io = NULL;
     int wakeupFD[2] = { -1, -1 };
 
+    if (VIR_ALLOC(io) < 0)
+        return NULL;
+
+    io->st = st;
+    io->sock = sock;
+    io->wakeupRecvFD = io->wakeupSendFD = -1;
+    io->chunk = QEMU_MIGRATION_TUNNEL_CHUNK_MIN;
+
+    if (virMutexInit(&io->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        VIR_FREE(io);
+        return NULL;
+    }
+
+    if (virCondInit(&io->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        virMutexDestroy(&io->lock);
+        VIR_FREE(io);
+        return NULL;
+    }
+
     if (pipe2(wakeupFD, O_CLOEXEC) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to make pipe"));
         goto error;
     }
 
-    if (VIR_ALLOC(io) < 0)
-        goto error;
-
-    io->st = st;
-    io->sock = sock;
     io->wakeupRecvFD = wakeupFD[0];
     io->wakeupSendFD = wakeupFD[1];
+    ignore_value(virTimeMicrosNowRaw(&io->start));
+
+    if (virThreadCreate(&io->sender, true,
+                        qemuMigrationIOSendFunc,
+                        io) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create migration thread"));
+        goto error;
+    }
 
     if (virThreadCreate(&io->thread, true,
                         qemuMigrationIOFunc,
                         io) < 0) {
         virReportSystemError(errno, "%s",
                              _("Unable to create migration thread"));
+        virMutexLock(&io->lock);
+        io->failed = true;
+        virCondBroadcast(&io->cond);
+        virMutexUnlock(&io->lock);
+        virThreadJoin(&io->sender);
         goto error;
     }
 
     return io;
 
 error:
-    VIR_FORCE_CLOSE(wakeupFD[0]);
-    VIR_FORCE_CLOSE(wakeupFD[1]);
-    VIR_FREE(io);
+    qemuMigrationIOFree(io);
     return NULL;
 }
 
 static int
-qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io, bool error)
+qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io, bool error,
+                        qemuDomainJobTunnelStatsPtr stats)
 {
     int rv = -1;
     char stop = error ? 1 : 0;
+    virErrorPtr err;
 
     /* make sure the thread finishes its job and is joinable */
     if (safewrite(io->wakeupSendFD, &stop, 1) != 1) {
@@ -2987,23 +3274,30 @@ qemuMigrationStopTunnel(qemuMigrationIOThreadPtr io, bool error)
     }
 
     virThreadJoin(&io->thread);
+    virThreadJoin(&io->sender);
+
+    qemuMigrationIOGetStats(io, stats);
+    VIR_DEBUG("Migration tunnel sent %llu bytes at %llu bytes/s; "
+              "read %llums send %llums stall %llums",
+              stats->bytes, stats->throughput, stats->readTime,
+              stats->sendTime, stats->stallTime);
 
-    /* Forward error from the IO thread, to this thread */
-    if (io->err.code != VIR_ERR_OK) {
+    /* Forward error from the IO threads, to this thread */
+    err = io->err.code != VIR_ERR_OK ? &io->err : &io->sendErr;
+    if (err->code != VIR_ERR_OK) {
         if (error)
             rv = 0;
         else
-            virSetError(&io->err);
-        virResetError(&io->err);
+            virSetError(err);
         goto cleanup;
     }
 
     rv = 0;
 
 cleanup:
-    VIR_FORCE_CLOSE(io->wakeupSendFD);
-    VIR_FORCE_CLOSE(io->wakeupRecvFD);
-    VIR_FREE(io);
+    virResetError(&io->err);
+    virResetError(&io->sendErr);
+    qemuMigrationIOFree(io);
     return rv;
 }
 
@@ -3226,7 +3520,7 @@ qemuMigrationRun(virQEMUDriverPtr driver,
 
     if (qemuMigrationWaitForCompletion(driver, vm,
                                        QEMU_ASYNC_JOB_MIGRATION_OUT,
-                                       dconn, abort_on_error) < 0)
+                                       dconn, abort_on_error, iothread) < 0)
         goto cleanup;
 
     /* When migration completed, QEMU will have paused the
@@ -3252,7 +3546,9 @@ cleanup:
     qemuMigrationCancelDriveMirror(mig, driver, vm);
 
     if (spec->fwdType != MIGRATION_FWD_DIRECT) {
-        if (iothread && qemuMigrationStopTunnel(iothread, ret < 0) < 0)
+        if (iothread &&
+            qemuMigrationStopTunnel(iothread, ret < 0,
+                                    &priv->job.tunnel) < 0)
             ret = -1;
         VIR_FORCE_CLOSE(fd);
     }
@@ -4516,11 +4812,13 @@ cleanup:
 }
 
 
-/* Helper function called while vm is active.  */
+/* Helper function called while vm is active.  @compressor is the
+ * NULL terminated command line of a program to filter the stream
+ * through, or NULL to write it out unchanged.  */
 int
 qemuMigrationToFile(virQEMUDriverPtr driver, virDomainObjPtr vm,
                     int fd, off_t offset, const char *path,
-                    const char *compressor,
+                    const char *const *compressor,
                     bool bypassSecurityDriver,
                     enum qemuDomainAsyncJob asyncJob)
 {
@@ -4593,14 +4891,8 @@ qemuMigrationToFile(virQEMUDriverPtr driver, virDomainObjPtr vm,
                                           args, path, offset);
         }
     } else {
-        const char *prog = compressor;
-        const char *args[] = {
-            prog,
-            "-c",
-            NULL
-        };
         if (pipeFD[0] != -1) {
-            cmd = virCommandNewArgs(args);
+            cmd = virCommandNewArgs(compressor);
             virCommandSetInputFD(cmd, pipeFD[0]);
             virCommandSetOutputFD(cmd, &fd);
             virCommandSetErrorBuffer(cmd, &errbuf);
@@ -4624,7 +4916,7 @@ qemuMigrationToFile(virQEMUDriverPtr driver, virDomainObjPtr vm,
         } else {
             rc = qemuMonitorMigrateToFile(priv->mon,
                                           QEMU_MONITOR_MIGRATE_BACKGROUND,
-                                          args, path, offset);
+                                          compressor, path, offset);
         }
     }
     qemuDomainObjExitMonitor(driver, vm);
@@ -4632,7 +4924,8 @@ qemuMigrationToFile(virQEMUDriverPtr driver, virDomainObjPtr vm,
     if (rc < 0)
         goto cleanup;
 
-    rc = qemuMigrationWaitForCompletion(driver, vm, asyncJob, NULL, false);
+    rc = qemuMigrationWaitForCompletion(driver, vm, asyncJob, NULL, false,
+                                        NULL);
 
     if (rc < 0)
         goto cleanup;
@@ -50,6 +50,10 @@
     VIR_MIGRATE_PARAM_GRAPHICS_URI, VIR_TYPED_PARAM_STRING,     \
     NULL
 
+/* Bounds of the stream packet size of tunnelled migration */
+# define QEMU_MIGRATION_TUNNEL_CHUNK_MIN (64 * 1024)
+# define QEMU_MIGRATION_TUNNEL_CHUNK_MAX (4 * 1024 * 1024)
+
 
 enum qemuMigrationJobPhase {
     QEMU_MIGRATION_PHASE_NONE = 0,
@@ -166,10 +170,12 @@ bool qemuMigrationIsAllowed(virQEMUDriverPtr driver, virDomainObjPtr vm,
 
 int qemuMigrationToFile(virQEMUDriverPtr driver, virDomainObjPtr vm,
                         int fd, off_t offset, const char *path,
-                        const char *compressor,
+                        const char *const *compressor,
                         bool bypassSecurityDriver,
                         enum qemuDomainAsyncJob asyncJob)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5)
     ATTRIBUTE_RETURN_CHECK;
 
+size_t qemuMigrationTunnelNextChunk(size_t chunk, size_t len);
+
 #endif /* __QEMU_MIGRATION_H__ */
@@ -38,6 +38,7 @@
 #include "virfile.h"
 #include "virprocess.h"
 #include "virobject.h"
+#include "vireventthread.h"
 #include "virstring.h"
 
 #ifdef WITH_DTRACE_PROBES
@@ -49,6 +50,11 @@
 #define DEBUG_IO 0
 #define DEBUG_RAW_IO 0
 
+/* Minimum free space to read into, and the largest receive
+ * buffer kept around once all its data has been processed */
+#define QEMU_MONITOR_BUFFER_MIN 1024
+#define QEMU_MONITOR_BUFFER_KEEP (64 * 1024)
+
 struct _qemuMonitor {
     virObjectLockable parent;
 
@@ -58,6 +64,10 @@ struct _qemuMonitor {
     int watch;
     int hasSendFD;
 
+    /* Set when the monitor is serviced by its own thread
+     * instead of the event loop */
+    virEventThreadPtr iothread;
+
     virDomainObjPtr vm;
 
     qemuMonitorCallbacksPtr cb;
@@ -68,7 +78,12 @@ struct _qemuMonitor {
     qemuMonitorMessagePtr msg;
 
     /* Buffer incoming data ready for Text/QMP monitor
-     * code to process & find message boundaries */
+     * code to process & find message boundaries. Data
+     * between bufferStart and bufferOffset is still to be
+     * processed, and its first bufferScanned bytes are
+     * known not to complete a message */
+    size_t bufferStart;
+    size_t bufferScanned;
     size_t bufferOffset;
     size_t bufferLength;
     char *buffer;
@@ -335,6 +350,8 @@ static int
 qemuMonitorIOProcess(qemuMonitorPtr mon)
 {
     int len;
+    char *data;
+    size_t avail;
     qemuMonitorMessagePtr msg = NULL;
 
     /* See if there's a message & whether its ready for its reply
@@ -354,17 +371,17 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
 # endif
 #endif
 
+    data = mon->buffer + mon->bufferStart;
+    avail = mon->bufferOffset - mon->bufferStart;
+
     PROBE(QEMU_MONITOR_IO_PROCESS,
-          "mon=%p buf=%s len=%zu", mon, mon->buffer, mon->bufferOffset);
+          "mon=%p buf=%s len=%zu", mon, data, avail);
 
     if (mon->json)
-        len = qemuMonitorJSONIOProcess(mon,
-                                       mon->buffer, mon->bufferOffset,
-                                       msg);
+        len = qemuMonitorJSONIOProcess(mon, data, avail,
+                                       &mon->bufferScanned, msg);
     else
-        len = qemuMonitorTextIOProcess(mon,
-                                       mon->buffer, mon->bufferOffset,
-                                       msg);
+        len = qemuMonitorTextIOProcess(mon, data, avail, msg);
 
     if (len < 0)
         return -1;
@@ -372,12 +389,18 @@ qemuMonitorIOProcess(qemuMonitorPtr mon)
     if (len && mon->waitGreeting)
         mon->waitGreeting = false;
 
-    if (len < mon->bufferOffset) {
-        memmove(mon->buffer, mon->buffer + len, mon->bufferOffset - len);
-        mon->bufferOffset -= len;
+    /* Consumed data is only reclaimed once more room is
+     * needed, see qemuMonitorIOReserve */
+    if (len < avail) {
+        mon->bufferStart += len;
     } else {
-        VIR_FREE(mon->buffer);
-        mon->bufferOffset = mon->bufferLength = 0;
+        mon->bufferStart = mon->bufferOffset = mon->bufferScanned = 0;
+        if (mon->bufferLength > QEMU_MONITOR_BUFFER_KEEP) {
+            VIR_FREE(mon->buffer);
+            mon->bufferLength = 0;
+        } else if (mon->buffer) {
+            mon->buffer[0] = '\0';
+        }
     }
 #if DEBUG_IO
     VIR_DEBUG("Process done %d used %d", (int)mon->bufferOffset, len);
@@ -482,6 +505,47 @@ qemuMonitorIOWrite(qemuMonitorPtr mon)
     return done;
 }
 
+/*
+ * Make sure there are at least QEMU_MONITOR_BUFFER_MIN bytes
+ * free at the end of the receive buffer. The space taken by
+ * already processed replies is reused when it is at least as
+ * large as the pending data, so each byte is moved at most a
+ * constant number of times. Otherwise the buffer doubles in
+ * size, so a large reply only needs a logarithmic number of
+ * reallocations.
+ *
+ * Returns -1 on error, 0 on success
+ */
+static int
+qemuMonitorIOReserve(qemuMonitorPtr mon)
+{
+    size_t pending = mon->bufferOffset - mon->bufferStart;
+    size_t want;
+
+    if (mon->bufferLength - mon->bufferOffset >= QEMU_MONITOR_BUFFER_MIN)
+        return 0;
+
+    if (mon->bufferStart && mon->bufferStart >= pending) {
+        memmove(mon->buffer, mon->buffer + mon->bufferStart, pending);
+        mon->bufferStart = 0;
+        mon->bufferOffset = pending;
+        mon->buffer[mon->bufferOffset] = '\0';
+
+        if (mon->bufferLength - mon->bufferOffset >= QEMU_MONITOR_BUFFER_MIN)
+            return 0;
+    }
+
+    want = mon->bufferLength * 2;
+    if (want < mon->bufferOffset + QEMU_MONITOR_BUFFER_MIN)
+        want = mon->bufferOffset + QEMU_MONITOR_BUFFER_MIN;
+
+    if (VIR_REALLOC_N(mon->buffer, want) < 0)
+        return -1;
+    mon->bufferLength = want;
+    return 0;
+}
+
+
 /*
  * Called when the monitor has incoming data to read
  * Call this function while holding the monitor lock.
@@ -491,16 +555,12 @@ qemuMonitorIOWrite(qemuMonitorPtr mon)
 static int
 qemuMonitorIORead(qemuMonitorPtr mon)
 {
-    size_t avail = mon->bufferLength - mon->bufferOffset;
+    size_t avail;
     int ret = 0;
 
-    if (avail < 1024) {
-        if (VIR_REALLOC_N(mon->buffer,
-                          mon->bufferLength + 1024) < 0)
-            return -1;
-        mon->bufferLength += 1024;
-        avail += 1024;
-    }
+    if (qemuMonitorIOReserve(mon) < 0)
+        return -1;
+    avail = mon->bufferLength - mon->bufferOffset;
 
     /* Read as much as we can get into our buffer,
        until we block on EAGAIN, or hit EOF */
@@ -521,9 +581,14 @@ qemuMonitorIORead(qemuMonitorPtr mon)
             break;
 
         ret += got;
-        avail -= got;
         mon->bufferOffset += got;
         mon->buffer[mon->bufferOffset] = '\0';
+
+        if (qemuMonitorIOReserve(mon) < 0) {
+            ret = -1;
+            break;
+        }
+        avail = mon->bufferLength - mon->bufferOffset;
     }
 
 #if DEBUG_IO
@@ -551,7 +616,10 @@ static void qemuMonitorUpdateWatch(qemuMonitorPtr mon)
             events |= VIR_EVENT_HANDLE_WRITABLE;
     }
 
-    virEventUpdateHandle(mon->watch, events);
+    if (mon->iothread)
+        virEventThreadUpdate(mon->iothread, events);
+    else
+        virEventUpdateHandle(mon->watch, events);
 }
 
 
@@ -692,6 +760,7 @@ qemuMonitorOpenInternal(virDomainObjPtr vm,
                         int fd,
                         bool hasSendFD,
                         bool json,
+                        bool iothread,
                         qemuMonitorCallbacksPtr cb,
                         void *opaque)
 {
@@ -743,13 +812,26 @@ qemuMonitorOpenInternal(virDomainObjPtr vm,
 
     virObjectLock(mon);
     virObjectRef(mon);
-    if ((mon->watch = virEventAddHandle(mon->fd,
-                                        VIR_EVENT_HANDLE_HANGUP |
-                                        VIR_EVENT_HANDLE_ERROR |
-                                        VIR_EVENT_HANDLE_READABLE,
-                                        qemuMonitorIO,
-                                        mon,
-                                        virObjectFreeCallback)) < 0) {
+    if (iothread) {
+        if (!(mon->iothread = virEventThreadNew(mon->fd,
+                                                VIR_EVENT_HANDLE_HANGUP |
+                                                VIR_EVENT_HANDLE_ERROR |
+                                                VIR_EVENT_HANDLE_READABLE,
+                                                qemuMonitorIO,
+                                                mon,
+                                                virObjectFreeCallback))) {
+            virObjectUnref(mon);
+            virObjectUnlock(mon);
+            goto cleanup;
+        }
+        mon->watch = virEventThreadGetWatch(mon->iothread);
+    } else if ((mon->watch = virEventAddHandle(mon->fd,
+                                               VIR_EVENT_HANDLE_HANGUP |
+                                               VIR_EVENT_HANDLE_ERROR |
+                                               VIR_EVENT_HANDLE_READABLE,
+                                               qemuMonitorIO,
+                                               mon,
+                                               virObjectFreeCallback)) < 0) {
         virObjectUnref(mon);
         virObjectUnlock(mon);
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -781,6 +863,7 @@ qemuMonitorPtr
 qemuMonitorOpen(virDomainObjPtr vm,
                 virDomainChrSourceDefPtr config,
                 bool json,
+                bool iothread,
                 qemuMonitorCallbacksPtr cb,
                 void *opaque)
 {
@@ -807,7 +890,8 @@ qemuMonitorOpen(virDomainObjPtr vm,
         return NULL;
     }
 
-    ret = qemuMonitorOpenInternal(vm, fd, hasSendFD, json, cb, opaque);
+    ret = qemuMonitorOpenInternal(vm, fd, hasSendFD, json, iothread,
+                                  cb, opaque);
     if (!ret)
         VIR_FORCE_CLOSE(fd);
     return ret;
@@ -817,10 +901,12 @@ qemuMonitorOpen(virDomainObjPtr vm,
 qemuMonitorPtr qemuMonitorOpenFD(virDomainObjPtr vm,
                                  int sockfd,
                                  bool json,
+                                 bool iothread,
                                  qemuMonitorCallbacksPtr cb,
                                  void *opaque)
 {
-    return qemuMonitorOpenInternal(vm, sockfd, true, json, cb, opaque);
+    return qemuMonitorOpenInternal(vm, sockfd, true, json, iothread,
+                                   cb, opaque);
 }
 
 
@@ -834,7 +920,11 @@ void qemuMonitorClose(qemuMonitorPtr mon)
           "mon=%p refs=%d", mon, mon->parent.parent.refs);
 
     if (mon->fd >= 0) {
-        if (mon->watch) {
+        if (mon->iothread) {
+            virEventThreadRemove(mon->iothread);
+            mon->iothread = NULL;
+            mon->watch = 0;
+        } else if (mon->watch) {
             virEventRemoveHandle(mon->watch);
             mon->watch = 0;
         }
@@ -1660,6 +1750,41 @@ int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
     return ret;
 }
 
+/* Return a hash table of qemuBlockStats keyed by the guest side disk
+ * name, filled in from a single query of all block devices, or NULL
+ * on failure.
+ */
+virHashTablePtr
+qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon)
+{
+    virHashTablePtr table;
+
+    VIR_DEBUG("mon=%p", mon);
+
+    if (!mon) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("monitor must not be NULL"));
+        return NULL;
+    }
+
+    if (!mon->json) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("querying statistics of all block devices "
+                         "requires JSON monitor"));
+        return NULL;
+    }
+
+    if (!(table = virHashCreate(32, (virHashDataFree) free)))
+        return NULL;
+
+    if (qemuMonitorJSONGetAllBlockStatsInfo(mon, table) < 0) {
+        virHashFree(table);
+        return NULL;
+    }
+
+    return table;
+}
+
 /* Return 0 and update @nparams with the number of block stats
  * QEMU supports if success. Return -1 if failure.
  */
@@ -52,11 +52,15 @@ struct _qemuMonitorMessage {
     int txOffset;
     int txLength;
 
-    /* Used by the text monitor reply / error */
+    /* Used by the text monitor reply / error, and by the JSON
+     * monitor for a successful reply when rxRaw is set */
     char *rxBuffer;
     int rxLength;
     /* Used by the JSON monitor to hold reply / error */
     void *rxObject;
+    /* Set by the JSON monitor for a reply which is scanned rather
+     * than parsed, see qemuMonitorJSONCommandScan */
+    bool rxRaw;
 
     /* True if rxBuffer / rxObject are ready, or a
      * fatal error occurred on the monitor channel
@@ -195,15 +199,17 @@ char *qemuMonitorUnescapeArg(const char *in);
 qemuMonitorPtr qemuMonitorOpen(virDomainObjPtr vm,
                                virDomainChrSourceDefPtr config,
                                bool json,
+                               bool iothread,
                                qemuMonitorCallbacksPtr cb,
                                void *opaque)
-    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4);
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5);
 qemuMonitorPtr qemuMonitorOpenFD(virDomainObjPtr vm,
                                  int sockfd,
                                  bool json,
+                                 bool iothread,
                                  qemuMonitorCallbacksPtr cb,
                                  void *opaque)
-    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(4);
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(5);
 
 void qemuMonitorClose(qemuMonitorPtr mon);
 
@@ -337,6 +343,21 @@ int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
 int qemuMonitorGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                          int *nparams);
 
+typedef struct _qemuBlockStats qemuBlockStats;
+typedef qemuBlockStats *qemuBlockStatsPtr;
+struct _qemuBlockStats {
+    long long rd_req;
+    long long rd_bytes;
+    long long rd_total_times;
+    long long wr_req;
+    long long wr_bytes;
+    long long wr_total_times;
+    long long flush_req;
+    long long flush_total_times;
+};
+
+virHashTablePtr qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon);
+
 int qemuMonitorGetBlockExtent(qemuMonitorPtr mon,
                               const char *dev_name,
                               unsigned long long *extent);
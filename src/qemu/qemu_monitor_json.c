@@ -50,8 +50,6 @@
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
 
-#define LINE_ENDING "\r\n"
-
 static void qemuMonitorJSONHandleShutdown(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandleReset(qemuMonitorPtr mon, virJSONValuePtr data);
 static void qemuMonitorJSONHandlePowerdown(qemuMonitorPtr mon, virJSONValuePtr data);
@@ -144,6 +142,25 @@ qemuMonitorJSONIOProcessEvent(qemuMonitorPtr mon,
     return 0;
 }
 
+/* Keys telling the kind of a line apart, only a line with "return"
+ * and none of the others is a successful reply */
+static const char *qemuMonitorJSONReplyKeys[] = {
+    "return/", "QMP", "event", "error",
+};
+
+static int
+qemuMonitorJSONIOFoundReplyKey(size_t field,
+                               const size_t *elems ATTRIBUTE_UNUSED,
+                               size_t nelems ATTRIBUTE_UNUSED,
+                               virJSONValuePtr value ATTRIBUTE_UNUSED,
+                               void *opaque)
+{
+    unsigned int *found = opaque;
+
+    *found |= 1 << field;
+    return 0;
+}
+
 static int
 qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
                              const char *line,
@@ -154,6 +171,29 @@ qemuMonitorJSONIOProcessLine(qemuMonitorPtr mon,
 
     VIR_DEBUG("Line [%s]", line);
 
+    /* A successful reply wanted raw is passed on without building a
+     * tree for it. Anything else, including lines the scan can make
+     * no sense of, is parsed as usual below */
+    if (msg && msg->rxRaw) {
+        unsigned int found = 0;
+
+        if (virJSONValueScan(line, qemuMonitorJSONReplyKeys,
+                             ARRAY_CARDINALITY(qemuMonitorJSONReplyKeys),
+                             qemuMonitorJSONIOFoundReplyKey,
+                             &found) < 0) {
+            /* The parser reports it again */
+            virResetLastError();
+        } else if (found == 1) {
+            PROBE(QEMU_MONITOR_RECV_REPLY,
+                  "mon=%p reply=%s", mon, line);
+            if (VIR_STRDUP(msg->rxBuffer, line) < 0)
+                return -1;
+            msg->rxLength = strlen(line);
+            msg->finished = 1;
+            return 0;
+        }
+    }
+
     if (!(obj = virJSONValueFromString(line)))
         goto cleanup;
 
@@ -192,44 +232,71 @@ cleanup:
     return ret;
 }
 
+/*
+ * Split @data into lines and process each complete one. The
+ * first *@scanned bytes are known not to hold a line ending
+ * from an earlier call, so a reply arriving in many pieces is
+ * only searched once. On return *@scanned is updated for the
+ * data left unprocessed.
+ *
+ * Returns the number of bytes consumed, or -1 on error
+ */
 int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
                              const char *data,
                              size_t len,
+                             size_t *scanned,
                              qemuMonitorMessagePtr msg)
 {
-    int used = 0;
+    size_t used = 0;
+    size_t from = *scanned;
     /*VIR_DEBUG("Data %d bytes [%s]", len, data);*/
 
-    while (used < len) {
-        char *nl = strstr(data + used, LINE_ENDING);
+    if (from > len)
+        from = len;
 
-        if (nl) {
-            int got = nl - (data + used);
-            char *line;
-            if (VIR_STRNDUP(line, data + used, got) < 0)
-                return -1;
-            used += got + strlen(LINE_ENDING);
-            line[got] = '\0'; /* kill \n */
-            if (qemuMonitorJSONIOProcessLine(mon, line, msg) < 0) {
-                VIR_FREE(line);
-                return -1;
-            }
+    while (from < len) {
+        const char *nl = memchr(data + from, '\n', len - from);
+        size_t got;
+        char *line;
 
-            VIR_FREE(line);
-        } else {
+        if (!nl) {
+            from = len;
             break;
         }
+
+        from = nl - data + 1;
+        if (nl == data + used || nl[-1] != '\r')
+            continue;
+
+        got = nl - (data + used) - 1;
+        if (VIR_STRNDUP(line, data + used, got) < 0)
+            return -1;
+        used = from;
+        if (qemuMonitorJSONIOProcessLine(mon, line, msg) < 0) {
+            VIR_FREE(line);
+            return -1;
+        }
+
+        VIR_FREE(line);
     }
 
-    VIR_DEBUG("Total used %d bytes out of %zd available in buffer", used, len);
+    *scanned = from - used;
+
+    VIR_DEBUG("Total used %zu bytes out of %zu available in buffer", used, len);
     return used;
 }
 
+/*
+ * Send @cmd and wait for the reply. If @rawreply is given, a
+ * successful reply is stored there as it was received instead of
+ * being parsed into @reply. Error replies always end up in @reply.
+ */
 static int
-qemuMonitorJSONCommandWithFd(qemuMonitorPtr mon,
-                             virJSONValuePtr cmd,
-                             int scm_fd,
-                             virJSONValuePtr *reply)
+qemuMonitorJSONCommandFull(qemuMonitorPtr mon,
+                           virJSONValuePtr cmd,
+                           int scm_fd,
+                           virJSONValuePtr *reply,
+                           char **rawreply)
 {
     int ret = -1;
     qemuMonitorMessage msg;
@@ -238,8 +305,11 @@ qemuMonitorJSONCommandWithFd(qemuMonitorPtr mon,
     virJSONValuePtr exe;
 
     *reply = NULL;
+    if (rawreply)
+        *rawreply = NULL;
 
     memset(&msg, 0, sizeof(msg));
+    msg.rxRaw = !!rawreply;
 
     exe = virJSONValueObjectGet(cmd, "execute");
     if (exe) {
@@ -263,12 +333,15 @@ qemuMonitorJSONCommandWithFd(qemuMonitorPtr mon,
 
     ret = qemuMonitorSend(mon, &msg);
 
-    VIR_DEBUG("Receive command reply ret=%d rxObject=%p",
-              ret, msg.rxObject);
+    VIR_DEBUG("Receive command reply ret=%d rxObject=%p rxBuffer=%p",
+              ret, msg.rxObject, msg.rxBuffer);
 
 
     if (ret == 0) {
-        if (!msg.rxObject) {
+        if (msg.rxBuffer) {
+            *rawreply = msg.rxBuffer;
+            msg.rxBuffer = NULL;
+        } else if (!msg.rxObject) {
             virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                            _("Missing monitor reply object"));
             ret = -1;
@@ -281,11 +354,22 @@ cleanup:
     VIR_FREE(id);
     VIR_FREE(cmdstr);
     VIR_FREE(msg.txBuffer);
+    VIR_FREE(msg.rxBuffer);
 
     return ret;
 }
 
 
+static int
+qemuMonitorJSONCommandWithFd(qemuMonitorPtr mon,
+                             virJSONValuePtr cmd,
+                             int scm_fd,
+                             virJSONValuePtr *reply)
+{
+    return qemuMonitorJSONCommandFull(mon, cmd, scm_fd, reply, NULL);
+}
+
+
 static int
 qemuMonitorJSONCommand(qemuMonitorPtr mon,
                        virJSONValuePtr cmd,
@@ -293,6 +377,7 @@ qemuMonitorJSONCommand(qemuMonitorPtr mon,
     return qemuMonitorJSONCommandWithFd(mon, cmd, -1, reply);
 }
 
+
 /* Ignoring OOM in this method, since we're already reporting
  * a more important error
  *
@@ -371,6 +456,46 @@ qemuMonitorJSONCheckError(virJSONValuePtr cmd,
 }
 
 
+/*
+ * Send @cmd and pass the values found at @paths in a successful
+ * reply to @cb, see virJSONValueScan. The reply is never built as
+ * a tree, which is much cheaper for large replies polled often.
+ * Error replies are reported like qemuMonitorJSONCheckError does.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int
+qemuMonitorJSONCommandScan(qemuMonitorPtr mon,
+                           virJSONValuePtr cmd,
+                           const char *const *paths,
+                           size_t npaths,
+                           virJSONValueScanCallback cb,
+                           void *opaque)
+{
+    virJSONValuePtr reply = NULL;
+    char *rawreply = NULL;
+    int ret = -1;
+
+    if (qemuMonitorJSONCommandFull(mon, cmd, -1, &reply, &rawreply) < 0)
+        goto cleanup;
+
+    /* Not handed over raw, which is unusual for a successful reply
+     * but must work all the same */
+    if (reply) {
+        if (qemuMonitorJSONCheckError(cmd, reply) < 0 ||
+            !(rawreply = virJSONValueToString(reply, false)))
+            goto cleanup;
+    }
+
+    ret = virJSONValueScan(rawreply, paths, npaths, cb, opaque);
+
+cleanup:
+    virJSONValueFree(reply);
+    VIR_FREE(rawreply);
+    return ret;
+}
+
+
 static int
 qemuMonitorJSONHasError(virJSONValuePtr reply,
                         const char *klass)
@@ -1618,13 +1743,9 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
                                      long long *flush_total_times,
                                      long long *errs)
 {
-    int ret;
-    size_t i;
-    bool found = false;
-    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
-                                                     NULL);
-    virJSONValuePtr reply = NULL;
-    virJSONValuePtr devices;
+    int ret = -1;
+    virHashTablePtr blockstats = NULL;
+    qemuBlockStatsPtr stats;
 
     *rd_req = *rd_bytes = -1;
     *wr_req = *wr_bytes = *errs = -1;
@@ -1638,130 +1759,247 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
     if (flush_total_times)
         *flush_total_times = -1;
 
-    if (!cmd)
+    if (!(blockstats = virHashCreate(10, (virHashDataFree) free)))
         return -1;
 
-    ret = qemuMonitorJSONCommand(mon, cmd, &reply);
+    if (qemuMonitorJSONGetAllBlockStatsInfo(mon, blockstats) < 0)
+        goto cleanup;
 
-    if (ret == 0)
-        ret = qemuMonitorJSONCheckError(cmd, reply);
-    if (ret < 0)
+    if (!(stats = virHashLookup(blockstats, dev_name))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("cannot find statistics for device '%s'"), dev_name);
         goto cleanup;
-    ret = -1;
+    }
 
-    devices = virJSONValueObjectGet(reply, "return");
-    if (!devices || devices->type != VIR_JSON_TYPE_ARRAY) {
+    *rd_req = stats->rd_req;
+    *rd_bytes = stats->rd_bytes;
+    *wr_req = stats->wr_req;
+    *wr_bytes = stats->wr_bytes;
+
+    if (rd_total_times)
+        *rd_total_times = stats->rd_total_times;
+    if (wr_total_times)
+        *wr_total_times = stats->wr_total_times;
+    if (flush_req)
+        *flush_req = stats->flush_req;
+    if (flush_total_times)
+        *flush_total_times = stats->flush_total_times;
+
+    ret = 0;
+
+cleanup:
+    virHashFree(blockstats);
+    return ret;
+}
+
+
+/* Values picked out of a query-blockstats reply. The device list, its
+ * entries and their names come first, followed by the statistics in
+ * the order of qemuMonitorJSONBlockStatsFields */
+enum {
+    QEMU_MONITOR_JSON_BLOCKSTATS_LIST,
+    QEMU_MONITOR_JSON_BLOCKSTATS_ENTRY,
+    QEMU_MONITOR_JSON_BLOCKSTATS_DEVICE,
+    QEMU_MONITOR_JSON_BLOCKSTATS_FIRST_STAT,
+};
+
+static const char *qemuMonitorJSONBlockStatsPaths[] = {
+    "return/",
+    "return/*/",
+    "return/*/device",
+    "return/*/stats/rd_bytes",
+    "return/*/stats/rd_operations",
+    "return/*/stats/rd_total_time_ns",
+    "return/*/stats/wr_bytes",
+    "return/*/stats/wr_operations",
+    "return/*/stats/wr_total_time_ns",
+    "return/*/stats/flush_operations",
+    "return/*/stats/flush_total_time_ns",
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+    bool optional;
+} qemuMonitorJSONBlockStatsFields[] = {
+    { "rd_bytes", offsetof(qemuBlockStats, rd_bytes), false },
+    { "rd_operations", offsetof(qemuBlockStats, rd_req), false },
+    { "rd_total_time_ns", offsetof(qemuBlockStats, rd_total_times), true },
+    { "wr_bytes", offsetof(qemuBlockStats, wr_bytes), false },
+    { "wr_operations", offsetof(qemuBlockStats, wr_req), false },
+    { "wr_total_time_ns", offsetof(qemuBlockStats, wr_total_times), true },
+    { "flush_operations", offsetof(qemuBlockStats, flush_req), true },
+    { "flush_total_time_ns", offsetof(qemuBlockStats, flush_total_times), true },
+};
+
+verify(ARRAY_CARDINALITY(qemuMonitorJSONBlockStatsPaths) ==
+       ARRAY_CARDINALITY(qemuMonitorJSONBlockStatsFields) +
+       QEMU_MONITOR_JSON_BLOCKSTATS_FIRST_STAT);
+
+struct qemuMonitorJSONBlockStatsDevice {
+    char *name;
+    qemuBlockStats stats;
+    unsigned int found;         /* bit set for each field seen */
+};
+
+struct qemuMonitorJSONBlockStatsData {
+    bool haveList;
+    struct qemuMonitorJSONBlockStatsDevice *devices;
+    size_t ndevices;
+};
+
+static int
+qemuMonitorJSONBlockStatsCollect(size_t field,
+                                 const size_t *elems,
+                                 size_t nelems ATTRIBUTE_UNUSED,
+                                 virJSONValuePtr value,
+                                 void *opaque)
+{
+    struct qemuMonitorJSONBlockStatsData *data = opaque;
+    struct qemuMonitorJSONBlockStatsDevice *dev;
+    long long *stat;
+    size_t i;
+
+    if (field == QEMU_MONITOR_JSON_BLOCKSTATS_LIST) {
+        if (value->type != VIR_JSON_TYPE_ARRAY) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("blockstats reply was missing device list"));
+            return -1;
+        }
+        data->haveList = true;
+        return 0;
+    }
+
+    /* Entries are reported in order, so this adds one at a time */
+    if (elems[0] >= data->ndevices) {
+        size_t first = data->ndevices;
+
+        if (VIR_EXPAND_N(data->devices, data->ndevices,
+                         elems[0] + 1 - data->ndevices) < 0)
+            return -1;
+
+        for (i = first; i < data->ndevices; i++) {
+            qemuBlockStatsPtr stats = &data->devices[i].stats;
+
+            stats->rd_req = stats->rd_bytes = stats->rd_total_times = -1;
+            stats->wr_req = stats->wr_bytes = stats->wr_total_times = -1;
+            stats->flush_req = stats->flush_total_times = -1;
+        }
+    }
+    dev = &data->devices[elems[0]];
+
+    if (field == QEMU_MONITOR_JSON_BLOCKSTATS_ENTRY) {
+        if (value->type != VIR_JSON_TYPE_OBJECT) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("blockstats device entry was not in expected format"));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (field == QEMU_MONITOR_JSON_BLOCKSTATS_DEVICE) {
+        const char *name = virJSONValueGetString(value);
+
+        if (!name) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("blockstats device entry was not in expected format"));
+            return -1;
+        }
+        VIR_FREE(dev->name);
+        return VIR_STRDUP(dev->name, name);
+    }
+
+    field -= QEMU_MONITOR_JSON_BLOCKSTATS_FIRST_STAT;
+    stat = (long long *)((char *)&dev->stats +
+                         qemuMonitorJSONBlockStatsFields[field].offset);
+    if (virJSONValueGetNumberLong(value, stat) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("cannot read %s statistic"),
+                       qemuMonitorJSONBlockStatsFields[field].name);
+        return -1;
+    }
+    dev->found |= 1 << field;
+
+    return 0;
+}
+
+/* Fill @hash with qemuBlockStats for every device reported by a single
+ * query-blockstats command. Entries are keyed by the guest side disk name,
+ * i.e. without the 'drive-' prefix libvirt gives to the host side.
+ * Statistics not provided by this QEMU are set to -1.
+ *
+ * This is polled for every disk of every guest by management
+ * applications, so the reply is scanned rather than parsed.
+ */
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr hash)
+{
+    int ret = -1;
+    size_t i, j;
+    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
+                                                     NULL);
+    struct qemuMonitorJSONBlockStatsData data = { false, NULL, 0 };
+    qemuBlockStatsPtr bstats = NULL;
+
+    if (!cmd)
+        return -1;
+
+    if (qemuMonitorJSONCommandScan(mon, cmd, qemuMonitorJSONBlockStatsPaths,
+                                   ARRAY_CARDINALITY(qemuMonitorJSONBlockStatsPaths),
+                                   qemuMonitorJSONBlockStatsCollect,
+                                   &data) < 0)
+        goto cleanup;
+
+    if (!data.haveList) {
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                        _("blockstats reply was missing device list"));
         goto cleanup;
     }
 
-    for (i = 0; i < virJSONValueArraySize(devices); i++) {
-        virJSONValuePtr dev = virJSONValueArrayGet(devices, i);
-        virJSONValuePtr stats;
-        const char *thisdev;
-        if (!dev || dev->type != VIR_JSON_TYPE_OBJECT) {
+    for (i = 0; i < data.ndevices; i++) {
+        struct qemuMonitorJSONBlockStatsDevice *dev = &data.devices[i];
+        const char *thisdev = dev->name;
+
+        if (!thisdev) {
             virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                            _("blockstats device entry was not in expected format"));
             goto cleanup;
         }
 
-        if ((thisdev = virJSONValueObjectGetString(dev, "device")) == NULL) {
-            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                           _("blockstats device entry was not in expected format"));
-            goto cleanup;
+        for (j = 0; j < ARRAY_CARDINALITY(qemuMonitorJSONBlockStatsFields); j++) {
+            if (!qemuMonitorJSONBlockStatsFields[j].optional &&
+                !(dev->found & (1 << j))) {
+                virReportError(VIR_ERR_INTERNAL_ERROR,
+                               _("cannot read %s statistic"),
+                               qemuMonitorJSONBlockStatsFields[j].name);
+                goto cleanup;
+            }
         }
 
         /* New QEMU has separate names for host & guest side of the disk
-         * and libvirt gives the host side a 'drive-' prefix. The passed
-         * in dev_name is the guest side though
+         * and libvirt gives the host side a 'drive-' prefix. Callers
+         * look devices up by the guest side name though
          */
         if (STRPREFIX(thisdev, QEMU_DRIVE_HOST_PREFIX))
             thisdev += strlen(QEMU_DRIVE_HOST_PREFIX);
 
-        if (STRNEQ(thisdev, dev_name))
-            continue;
-
-        found = true;
-        if ((stats = virJSONValueObjectGet(dev, "stats")) == NULL ||
-            stats->type != VIR_JSON_TYPE_OBJECT) {
-            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                           _("blockstats stats entry was not in expected format"));
+        if (VIR_ALLOC(bstats) < 0)
             goto cleanup;
-        }
+        *bstats = dev->stats;
 
-        if (virJSONValueObjectGetNumberLong(stats, "rd_bytes", rd_bytes) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "rd_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "rd_operations", rd_req) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                            "rd_operations");
-            goto cleanup;
-        }
-        if (rd_total_times &&
-            virJSONValueObjectHasKey(stats, "rd_total_time_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "rd_total_time_ns",
-                                             rd_total_times) < 0)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "rd_total_time_ns");
+        if (virHashUpdateEntry(hash, thisdev, bstats) < 0)
             goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_bytes", wr_bytes) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "wr_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_operations", wr_req) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "wr_operations");
-            goto cleanup;
-        }
-        if (wr_total_times &&
-            virJSONValueObjectHasKey(stats, "wr_total_time_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "wr_total_time_ns",
-                                             wr_total_times) < 0)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "wr_total_time_ns");
-            goto cleanup;
-        }
-        if (flush_req &&
-            virJSONValueObjectHasKey(stats, "flush_operations") &&
-            (virJSONValueObjectGetNumberLong(stats, "flush_operations",
-                                            flush_req) < 0)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "flush_operations");
-            goto cleanup;
-        }
-        if (flush_total_times &&
-            virJSONValueObjectHasKey(stats, "flush_total_time_ns") &&
-            (virJSONValueObjectGetNumberLong(stats, "flush_total_time_ns",
-                                            flush_total_times) < 0)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("cannot read %s statistic"),
-                           "flush_total_time_ns");
-            goto cleanup;
-        }
+        bstats = NULL;
     }
 
-    if (!found) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("cannot find statistics for device '%s'"), dev_name);
-        goto cleanup;
-    }
     ret = 0;
 
 cleanup:
+    VIR_FREE(bstats);
+    for (i = 0; i < data.ndevices; i++)
+        VIR_FREE(data.devices[i].name);
+    VIR_FREE(data.devices);
     virJSONValueFree(cmd);
-    virJSONValueFree(reply);
     return ret;
 }
 
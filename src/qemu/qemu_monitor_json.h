@@ -33,6 +33,7 @@
 int qemuMonitorJSONIOProcess(qemuMonitorPtr mon,
                              const char *data,
                              size_t len,
+                             size_t *scanned,
                              qemuMonitorMessagePtr msg);
 
 int qemuMonitorJSONHumanCommandWithFd(qemuMonitorPtr mon,
@@ -78,6 +79,8 @@ int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
                                      long long *flush_req,
                                      long long *flush_total_times,
                                      long long *errs);
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr hash);
 int qemuMonitorJSONGetBlockStatsParamsNumber(qemuMonitorPtr mon,
                                              int *nparams);
 int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
@@ -220,10 +220,13 @@ qemuConnectAgent(virQEMUDriverPtr driver, virDomainObjPtr vm)
     int ret = -1;
     qemuAgentPtr agent = NULL;
     virDomainChrSourceDefPtr config = qemuFindAgentConfig(vm->def);
+    virQEMUDriverConfigPtr cfg;
 
     if (!config)
         return 0;
 
+    cfg = virQEMUDriverGetConfig(driver);
+
     if (virSecurityManagerSetDaemonSocketLabel(driver->securityManager,
                                                vm->def) < 0) {
         VIR_ERROR(_("Failed to set security context for agent for %s"),
@@ -240,6 +243,7 @@ qemuConnectAgent(virQEMUDriverPtr driver, virDomainObjPtr vm)
 
     agent = qemuAgentOpen(vm,
                           config,
+                          cfg->monitorIOThreads,
                           &agentCallbacks);
 
     virObjectLock(vm);
@@ -269,6 +273,7 @@ qemuConnectAgent(virQEMUDriverPtr driver, virDomainObjPtr vm)
     ret = 0;
 
 cleanup:
+    virObjectUnref(cfg);
     return ret;
 }
 
@@ -1392,6 +1397,7 @@ static int
 qemuConnectMonitor(virQEMUDriverPtr driver, virDomainObjPtr vm)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
+    virQEMUDriverConfigPtr cfg = virQEMUDriverGetConfig(driver);
     int ret = -1;
     qemuMonitorPtr mon = NULL;
 
@@ -1412,6 +1418,7 @@ qemuConnectMonitor(virQEMUDriverPtr driver, virDomainObjPtr vm)
     mon = qemuMonitorOpen(vm,
                           priv->monConfig,
                           priv->monJSON,
+                          cfg->monitorIOThreads,
                           &monitorCallbacks,
                           driver);
 
@@ -1446,7 +1453,7 @@ qemuConnectMonitor(virQEMUDriverPtr driver, virDomainObjPtr vm)
     qemuDomainObjExitMonitor(driver, vm);
 
 error:
-
+    virObjectUnref(cfg);
     return ret;
 }
 
@@ -1898,7 +1905,7 @@ virBitmapPtr
 qemuPrepareCpumap(virQEMUDriverPtr driver,
                   virBitmapPtr nodemask)
 {
-    size_t i;
+    ssize_t i = -1;
     int hostcpus, maxcpu = QEMUD_CPUMASK_LEN;
     virBitmapPtr cpumap = NULL;
     virCapsPtr caps = NULL;
@@ -1921,22 +1928,22 @@ qemuPrepareCpumap(virQEMUDriverPtr driver,
             goto cleanup;
         }
 
-        for (i = 0; i < caps->host.nnumaCell; i++) {
+        if (virBitmapSize(nodemask) < caps->host.nnumaCell) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("Failed to convert nodeset to cpuset"));
+            virBitmapFree(cpumap);
+            cpumap = NULL;
+            goto cleanup;
+        }
+
+        while ((i = virBitmapNextSetBit(nodemask, i)) >= 0 &&
+               i < caps->host.nnumaCell) {
             size_t j;
             int cur_ncpus = caps->host.numaCell[i]->ncpus;
-            bool result;
-            if (virBitmapGetBit(nodemask, i, &result) < 0) {
-                virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                               _("Failed to convert nodeset to cpuset"));
-                virBitmapFree(cpumap);
-                cpumap = NULL;
-                goto cleanup;
-            }
-            if (result) {
-                for (j = 0; j < cur_ncpus; j++)
-                    ignore_value(virBitmapSetBit(cpumap,
-                                                 caps->host.numaCell[i]->cpus[j].id));
-            }
+
+            for (j = 0; j < cur_ncpus; j++)
+                ignore_value(virBitmapSetBit(cpumap,
+                                             caps->host.numaCell[i]->cpus[j].id));
         }
     }
 
@@ -3183,6 +3190,7 @@ qemuProcessReconnect(void *opaque)
         driver->inhibitCallback(true, driver->inhibitOpaque);
 
 endjob:
+    priv->reconnecting = false;
     if (!qemuDomainObjEndJob(driver, obj))
         obj = NULL;
 
@@ -3195,6 +3203,7 @@ endjob:
     return;
 
 error:
+    priv->reconnecting = false;
     if (!qemuDomainObjEndJob(driver, obj))
         obj = NULL;
 
@@ -3238,6 +3247,7 @@ qemuProcessReconnectHelper(virDomainObjPtr obj,
     virThread thread;
     struct qemuProcessReconnectData *src = opaque;
     struct qemuProcessReconnectData *data;
+    qemuDomainObjPrivatePtr priv;
 
     if (VIR_ALLOC(data) < 0)
         return -1;
@@ -3267,6 +3277,11 @@ qemuProcessReconnectHelper(virDomainObjPtr obj,
     if (qemuDomainObjBeginJob(src->driver, obj, QEMU_JOB_MODIFY) < 0)
         goto error;
 
+    /* Read-only APIs keep working from the loaded status until
+     * the reconnect thread clears this */
+    priv = obj->privateData;
+    priv->reconnecting = true;
+
     /* Since we close the connection later on, we have to make sure
      * that the threads we start see a valid connection throughout their
      * lifetime. We simply increase the reference counter here.
@@ -3280,6 +3295,7 @@ qemuProcessReconnectHelper(virDomainObjPtr obj,
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                        _("Could not create thread. QEMU initialization "
                          "might be incomplete"));
+        priv->reconnecting = false;
         if (!qemuDomainObjEndJob(src->driver, obj)) {
             obj = NULL;
         } else if (virObjectUnref(obj)) {
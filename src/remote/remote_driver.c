@@ -122,6 +122,20 @@ static int callFull(virConnectPtr conn, struct private_data *priv,
                     int proc_nr,
                     xdrproc_t args_filter, char *args,
                     xdrproc_t ret_filter, char *ret);
+
+/* Outcome of a call made with callAsync, valid after callAsyncWait */
+struct remoteAsyncCall {
+    int rv;
+    virErrorPtr err;
+};
+
+static int callAsync(virConnectPtr conn, struct private_data *priv,
+                     unsigned int flags,
+                     struct remoteAsyncCall *call,
+                     int proc_nr,
+                     xdrproc_t args_filter, char *args,
+                     xdrproc_t ret_filter, char *ret);
+static int callAsyncWait(struct private_data *priv);
 static int remoteAuthenticate(virConnectPtr conn, struct private_data *priv,
                               virConnectAuthPtr auth, const char *authtype);
 #if WITH_SASL
@@ -817,32 +831,54 @@ doRemoteOpen(virConnectPtr conn,
     if (remoteAuthenticate(conn, priv, auth, authtype) == -1)
         goto failed;
 
-    if (virNetClientKeepAliveIsSupported(priv->client)) {
-        remote_connect_supports_feature_args args =
+    /* The keepalive probe does not depend on the connection being
+     * open, so pipeline it with the remote side's open function
+     * rather than paying for two round trips. */
+    {
+        remote_connect_supports_feature_args kaargs =
             { VIR_DRV_FEATURE_PROGRAM_KEEPALIVE };
-        remote_connect_supports_feature_ret ret = { 0 };
-        int rc;
+        remote_connect_supports_feature_ret karet = { 0 };
+        struct remoteAsyncCall kacall = { -1, NULL };
+        remote_connect_open_args args = { &name, flags };
+        struct remoteAsyncCall opencall = { -1, NULL };
+        bool keepalive = virNetClientKeepAliveIsSupported(priv->client);
+        int rc = 0;
 
-        rc = call(conn, priv, 0, REMOTE_PROC_CONNECT_SUPPORTS_FEATURE,
-                  (xdrproc_t)xdr_remote_connect_supports_feature_args, (char *) &args,
-                  (xdrproc_t)xdr_remote_connect_supports_feature_ret, (char *) &ret);
+        if (keepalive &&
+            callAsync(conn, priv, 0, &kacall,
+                      REMOTE_PROC_CONNECT_SUPPORTS_FEATURE,
+                      (xdrproc_t)xdr_remote_connect_supports_feature_args, (char *) &kaargs,
+                      (xdrproc_t)xdr_remote_connect_supports_feature_ret, (char *) &karet) < 0)
+            keepalive = false;
 
-        if (rc != -1 && ret.supported) {
-            priv->serverKeepAlive = true;
-        } else {
-            VIR_INFO("Disabling keepalive protocol since it is not supported"
-                     " by the server");
+        VIR_DEBUG("Trying to open URI %s", name);
+        if (callAsync(conn, priv, 0, &opencall, REMOTE_PROC_CONNECT_OPEN,
+                      (xdrproc_t) xdr_remote_connect_open_args, (char *) &args,
+                      (xdrproc_t) xdr_void, (char *) NULL) < 0)
+            rc = -1;
+
+        /* Even on error, replies may still be written into our stack */
+        if (callAsyncWait(priv) < 0)
+            rc = -1;
+
+        if (keepalive) {
+            if (kacall.rv != -1 && karet.supported) {
+                priv->serverKeepAlive = true;
+            } else {
+                VIR_INFO("Disabling keepalive protocol since it is not supported"
+                         " by the server");
+            }
         }
-    }
+        virFreeError(kacall.err);
 
-    /* Finally we can call the remote side's open function. */
-    {
-        remote_connect_open_args args = { &name, flags };
+        if (rc == 0 && opencall.rv < 0) {
+            if (opencall.err)
+                virSetError(opencall.err);
+            rc = -1;
+        }
+        virFreeError(opencall.err);
 
-        VIR_DEBUG("Trying to open URI %s", name);
-        if (call(conn, priv, 0, REMOTE_PROC_CONNECT_OPEN,
-                 (xdrproc_t) xdr_remote_connect_open_args, (char *) &args,
-                 (xdrproc_t) xdr_void, (char *) NULL) == -1)
+        if (rc < 0)
             goto failed;
     }
 
@@ -4851,15 +4887,18 @@ remoteStreamSend(virStreamPtr st,
 
 
 static int
-remoteStreamRecv(virStreamPtr st,
-                 char *data,
-                 size_t nbytes)
+remoteStreamRecvFlags(virStreamPtr st,
+                      char *data,
+                      size_t nbytes,
+                      unsigned int flags)
 {
-    VIR_DEBUG("st=%p data=%p nbytes=%zu", st, data, nbytes);
+    VIR_DEBUG("st=%p data=%p nbytes=%zu flags=%x", st, data, nbytes, flags);
     struct private_data *priv = st->conn->privateData;
     virNetClientStreamPtr privst = st->privateData;
     int rv;
 
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     if (virNetClientStreamRaiseError(privst))
         return -1;
 
@@ -4871,7 +4910,8 @@ remoteStreamRecv(virStreamPtr st,
                                       priv->client,
                                       data,
                                       nbytes,
-                                      (st->flags & VIR_STREAM_NONBLOCK));
+                                      (st->flags & VIR_STREAM_NONBLOCK),
+                                      (flags & VIR_STREAM_RECV_STOP_AT_HOLE));
 
     VIR_DEBUG("Done %d", rv);
 
@@ -4881,6 +4921,63 @@ remoteStreamRecv(virStreamPtr st,
     return rv;
 }
 
+
+static int
+remoteStreamRecv(virStreamPtr st,
+                 char *data,
+                 size_t nbytes)
+{
+    return remoteStreamRecvFlags(st, data, nbytes, 0);
+}
+
+
+static int
+remoteStreamSendHole(virStreamPtr st,
+                     long long length,
+                     unsigned int flags)
+{
+    VIR_DEBUG("st=%p length=%lld flags=%x", st, length, flags);
+    struct private_data *priv = st->conn->privateData;
+    virNetClientStreamPtr privst = st->privateData;
+    int rv;
+
+    virCheckFlags(0, -1);
+
+    if (virNetClientStreamRaiseError(privst))
+        return -1;
+
+    remoteDriverLock(priv);
+    priv->localUses++;
+    remoteDriverUnlock(priv);
+
+    rv = virNetClientStreamSendHole(privst,
+                                    priv->client,
+                                    length,
+                                    flags);
+
+    remoteDriverLock(priv);
+    priv->localUses--;
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
+
+static int
+remoteStreamRecvHole(virStreamPtr st,
+                     long long *length,
+                     unsigned int flags)
+{
+    VIR_DEBUG("st=%p length=%p flags=%x", st, length, flags);
+    virNetClientStreamPtr privst = st->privateData;
+
+    virCheckFlags(0, -1);
+
+    if (virNetClientStreamRaiseError(privst))
+        return -1;
+
+    return virNetClientStreamRecvHole(privst, length);
+}
+
 struct remoteStreamCallbackData {
     virStreamPtr st;
     virStreamEventCallback cb;
@@ -5053,7 +5150,10 @@ cleanup:
 
 static virStreamDriver remoteStreamDrv = {
     .streamRecv = remoteStreamRecv,
+    .streamRecvFlags = remoteStreamRecvFlags,
     .streamSend = remoteStreamSend,
+    .streamSendHole = remoteStreamSendHole,
+    .streamRecvHole = remoteStreamRecvHole,
     .streamFinish = remoteStreamFinish,
     .streamAbort = remoteStreamAbort,
     .streamEventAddCallback = remoteStreamEventAddCallback,
@@ -5736,6 +5836,78 @@ call(virConnectPtr conn,
 }
 
 
+static void
+remoteAsyncCallDone(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
+                    virNetClientPtr client ATTRIBUTE_UNUSED,
+                    int rv,
+                    void *ret ATTRIBUTE_UNUSED,
+                    void *opaque)
+{
+    struct remoteAsyncCall *call = opaque;
+
+    call->rv = rv;
+    if (rv < 0)
+        call->err = virSaveLastError();
+}
+
+/*
+ * Serial a set of arguments into a method call message and send
+ * that to the server without waiting for the reply, so that several
+ * independent calls can be pipelined over the connection. Both @args
+ * and @ret must stay valid until callAsyncWait returns, at which point
+ * @call holds the result and any error. Note the server may process
+ * pipelined calls in any order.
+ */
+static int
+callAsync(virConnectPtr conn ATTRIBUTE_UNUSED,
+          struct private_data *priv,
+          unsigned int flags,
+          struct remoteAsyncCall *call,
+          int proc_nr,
+          xdrproc_t args_filter, char *args,
+          xdrproc_t ret_filter, char *ret)
+{
+    virNetClientProgramPtr prog;
+
+    if (flags & REMOTE_CALL_QEMU)
+        prog = priv->qemuProgram;
+    else if (flags & REMOTE_CALL_LXC)
+        prog = priv->lxcProgram;
+    else
+        prog = priv->remoteProgram;
+
+    call->rv = -1;
+    call->err = NULL;
+
+    return virNetClientProgramCallAsync(prog,
+                                        priv->client,
+                                        priv->counter++,
+                                        proc_nr,
+                                        args_filter, args,
+                                        ret_filter, ret,
+                                        remoteAsyncCallDone, call);
+}
+
+/*
+ * Wait for all calls made with callAsync to finish
+ */
+static int
+callAsyncWait(struct private_data *priv)
+{
+    int rv;
+    virNetClientPtr client = priv->client;
+    priv->localUses++;
+
+    /* Unlock for the same reason as callFull does */
+    remoteDriverUnlock(priv);
+    rv = virNetClientWaitAsync(client);
+    remoteDriverLock(priv);
+    priv->localUses--;
+
+    return rv;
+}
+
+
 static int
 remoteDomainGetInterfaceParameters(virDomainPtr domain,
                                    const char *device,
@@ -6599,6 +6771,135 @@ done:
     return rv;
 }
 
+static int
+remoteConnectGetAllDomainStats(virConnectPtr conn,
+                               virDomainPtr *doms,
+                               unsigned int ndoms,
+                               unsigned int stats,
+                               virDomainStatsRecordPtr **retStats,
+                               unsigned int flags)
+{
+    struct private_data *priv = conn->privateData;
+    int rv = -1;
+    size_t i;
+    remote_connect_get_all_domain_stats_args args;
+    remote_connect_get_all_domain_stats_ret ret;
+    virDomainStatsRecordPtr elem = NULL;
+    virDomainStatsRecordPtr *tmpret = NULL;
+
+    memset(&args, 0, sizeof(args));
+
+    if (ndoms) {
+        if (VIR_ALLOC_N(args.doms.doms_val, ndoms) < 0)
+            goto cleanup;
+
+        for (i = 0; i < ndoms; i++)
+            make_nonnull_domain(args.doms.doms_val + i, doms[i]);
+    }
+    args.doms.doms_len = ndoms;
+
+    args.stats = stats;
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+
+    remoteDriverLock(priv);
+    if (call(conn, priv, 0, REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS,
+             (xdrproc_t)xdr_remote_connect_get_all_domain_stats_args, (char *)&args,
+             (xdrproc_t)xdr_remote_connect_get_all_domain_stats_ret, (char *)&ret) == -1) {
+        remoteDriverUnlock(priv);
+        goto cleanup;
+    }
+    remoteDriverUnlock(priv);
+
+    if (ret.retStats.retStats_len > REMOTE_DOMAIN_LIST_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("Too many domain stats records '%d' for limit '%d'"),
+                       ret.retStats.retStats_len, REMOTE_DOMAIN_LIST_MAX);
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(tmpret, ret.retStats.retStats_len + 1) < 0)
+        goto cleanup;
+
+    for (i = 0; i < ret.retStats.retStats_len; i++) {
+        remote_domain_stats_record *rec = ret.retStats.retStats_val + i;
+
+        if (VIR_ALLOC(elem) < 0)
+            goto cleanup;
+
+        if (!(elem->dom = get_nonnull_domain(conn, rec->dom)))
+            goto cleanup;
+
+        if (remoteDeserializeTypedParameters(rec->params.params_val,
+                                             rec->params.params_len,
+                                             REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX,
+                                             &elem->params,
+                                             &elem->nparams))
+            goto cleanup;
+
+        tmpret[i] = elem;
+        elem = NULL;
+    }
+
+    *retStats = tmpret;
+    tmpret = NULL;
+    rv = ret.retStats.retStats_len;
+
+cleanup:
+    if (elem) {
+        if (elem->dom)
+            virDomainFree(elem->dom);
+        VIR_FREE(elem);
+    }
+    virDomainStatsRecordListFree(tmpret);
+    for (i = 0; i < args.doms.doms_len; i++)
+        VIR_FREE(args.doms.doms_val[i].name);
+    VIR_FREE(args.doms.doms_val);
+    xdr_free((xdrproc_t)xdr_remote_connect_get_all_domain_stats_ret,
+             (char *) &ret);
+
+    return rv;
+}
+
+static int
+remoteConnectGetRPCStats(virConnectPtr conn,
+                         virTypedParameterPtr *params,
+                         int *nparams,
+                         unsigned int flags)
+{
+    int rv = -1;
+    remote_connect_get_rpc_stats_args args;
+    remote_connect_get_rpc_stats_ret ret;
+    struct private_data *priv = conn->privateData;
+
+    remoteDriverLock(priv);
+
+    args.flags = flags;
+
+    memset(&ret, 0, sizeof(ret));
+    if (call(conn, priv, 0, REMOTE_PROC_CONNECT_GET_RPC_STATS,
+             (xdrproc_t) xdr_remote_connect_get_rpc_stats_args, (char *) &args,
+             (xdrproc_t) xdr_remote_connect_get_rpc_stats_ret, (char *) &ret) == -1)
+        goto done;
+
+    if (remoteDeserializeTypedParameters(ret.params.params_val,
+                                         ret.params.params_len,
+                                         REMOTE_CONNECT_RPC_STATS_MAX,
+                                         params,
+                                         nparams) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    xdr_free((xdrproc_t) xdr_remote_connect_get_rpc_stats_ret,
+             (char *) &ret);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
 static void
 remoteDomainEventQueue(struct private_data *priv, virDomainEventPtr event)
 {
@@ -6933,6 +7234,8 @@ static virDriver remote_driver = {
     .domainMigratePerform3Params = remoteDomainMigratePerform3Params, /* 1.1.0 */
     .domainMigrateFinish3Params = remoteDomainMigrateFinish3Params, /* 1.1.0 */
     .domainMigrateConfirm3Params = remoteDomainMigrateConfirm3Params, /* 1.1.0 */
+    .connectGetAllDomainStats = remoteConnectGetAllDomainStats, /* 1.1.2 */
+    .connectGetRPCStats = remoteConnectGetRPCStats, /* 1.1.2 */
 };
 
 static virNetworkDriver network_driver = {
@@ -232,6 +232,12 @@ const REMOTE_DOMAIN_MIGRATE_PARAM_LIST_MAX = 64;
 /* Upper limit on number of job stats */
 const REMOTE_DOMAIN_JOB_STATS_MAX = 16;
 
+/* Upper limit on number of stats parameters per domain record */
+const REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX = 4096;
+
+/* Upper limit on number of RPC statistics */
+const REMOTE_CONNECT_RPC_STATS_MAX = 16384;
+
 /* UUID.  VIR_UUID_BUFLEN definition comes from libvirt.h */
 typedef opaque remote_uuid[VIR_UUID_BUFLEN];
 
@@ -2835,6 +2841,29 @@ struct remote_domain_event_device_removed_msg {
     remote_nonnull_string devAlias;
 };
 
+struct remote_domain_stats_record {
+    remote_nonnull_domain dom;
+    remote_typed_param params<REMOTE_CONNECT_GET_ALL_DOMAIN_STATS_MAX>;
+};
+
+struct remote_connect_get_all_domain_stats_args {
+    remote_nonnull_domain doms<REMOTE_DOMAIN_LIST_MAX>;
+    unsigned int stats;
+    unsigned int flags;
+};
+
+struct remote_connect_get_all_domain_stats_ret {
+    remote_domain_stats_record retStats<REMOTE_DOMAIN_LIST_MAX>;
+};
+
+struct remote_connect_get_rpc_stats_args {
+    unsigned int flags;
+};
+
+struct remote_connect_get_rpc_stats_ret {
+    remote_typed_param params<REMOTE_CONNECT_RPC_STATS_MAX>;
+};
+
 /*----- Protocol. -----*/
 
 /* Define the program number, protocol version and procedure numbers here. */
@@ -4998,5 +5027,18 @@ enum remote_procedure {
      * @generate: both
      * @acl: none
      */
-    REMOTE_PROC_DOMAIN_EVENT_DEVICE_REMOVED = 311
+    REMOTE_PROC_DOMAIN_EVENT_DEVICE_REMOVED = 311,
+
+    /**
+     * @generate: none
+     * @acl: connect:search_domains
+     * @aclfilter: domain:read
+     */
+    REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS = 312,
+
+    /**
+     * @generate: none
+     * @acl: connect:read
+     */
+    REMOTE_PROC_CONNECT_GET_RPC_STATS = 313
 };
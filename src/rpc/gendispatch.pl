@@ -66,6 +66,7 @@ sub fixup_name {
     $name =~ s/Fstrim$/FSTrim/;
     $name =~ s/Scsi/SCSI/;
     $name =~ s/Wwn$/WWN/;
+    $name =~ s/Rpc$/RPC/;
 
     return $name;
 }
@@ -1030,7 +1031,7 @@ elsif ($mode eq "server") {
 
     print "virNetServerProgramProc ${structprefix}Procs[] = {\n";
     for ($id = 0 ; $id <= $#calls ; $id++) {
-        my ($comment, $name, $argtype, $arglen, $argfilter, $retlen, $retfilter, $priority);
+        my ($comment, $name, $argtype, $arglen, $argfilter, $retlen, $retfilter, $priority, $procname);
 
         if (defined $calls[$id] && !$calls[$id]->{msg}) {
             $comment = "/* Method $calls[$id]->{ProcName} => $id */";
@@ -1041,6 +1042,7 @@ elsif ($mode eq "server") {
             $retlen = $rettype ne "void" ? "sizeof($rettype)" : "0";
             $argfilter = $argtype ne "void" ? "xdr_$argtype" : "xdr_void";
             $retfilter = $rettype ne "void" ? "xdr_$rettype" : "xdr_void";
+            $procname = "\"$calls[$id]->{ProcName}\"";
         } else {
             if ($calls[$id]->{msg}) {
                 $comment = "/* Async event $calls[$id]->{ProcName} => $id */";
@@ -1051,11 +1053,12 @@ elsif ($mode eq "server") {
             $arglen = $retlen = 0;
             $argfilter = "xdr_void";
             $retfilter = "xdr_void";
+            $procname = "NULL";
         }
 
     $priority = defined $calls[$id]->{priority} ? $calls[$id]->{priority} : 0;
 
-        print "{ $comment\n   ${name},\n   $arglen,\n   (xdrproc_t)$argfilter,\n   $retlen,\n   (xdrproc_t)$retfilter,\n   true,\n   $priority\n},\n";
+        print "{ $comment\n   ${name},\n   $arglen,\n   (xdrproc_t)$argfilter,\n   $retlen,\n   (xdrproc_t)$retfilter,\n   true,\n   $priority,\n   $procname\n},\n";
     }
     print "};\n";
     print "size_t ${structprefix}NProcs = ARRAY_CARDINALITY(${structprefix}Procs);\n";
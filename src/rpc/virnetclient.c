@@ -56,6 +56,11 @@ struct _virNetClientCall {
     bool expectReply;
     bool nonBlock;
     bool haveThread;
+    bool barrier;       /* completes once no async call is pending */
+
+    /* Set for async calls, which have no thread waiting for the reply */
+    virNetClientAsyncFunc asyncCb;
+    void *asyncOpaque;
 
     virCond cond;
 
@@ -92,12 +97,21 @@ struct _virNetClient {
      * List of calls currently waiting for dispatch
      * The calls should all have threads waiting for
      * them, except possibly the first call in the list
-     * which might be a partially sent non-blocking call.
+     * which might be a partially sent non-blocking call,
+     * and async calls which never have a thread.
      */
     virNetClientCallPtr waitDispatch;
     /* True if a thread holds the buck */
     bool haveTheBuck;
 
+    /* Number of async calls still waiting for their reply */
+    size_t nasync;
+    /* Async calls which are done, but whose callback has not run yet */
+    virNetClientCallPtr asyncDone;
+    /* Number of async callbacks being run, signals asyncCond at 0 */
+    size_t nasyncRunning;
+    virCond asyncCond;
+
     size_t nstreams;
     virNetClientStreamPtr *streams;
 
@@ -133,6 +147,10 @@ static int virNetClientQueueNonBlocking(virNetClientPtr client,
                                         virNetMessagePtr msg);
 static void virNetClientCloseInternal(virNetClientPtr client,
                                       int reason);
+static void virNetClientAsyncFailAll(virNetClientPtr client);
+static virNetClientCallPtr virNetClientAsyncSteal(virNetClientPtr client);
+static void virNetClientAsyncRun(virNetClientPtr client,
+                                 virNetClientCallPtr call);
 
 
 void virNetClientSetCloseCallback(virNetClientPtr client,
@@ -313,6 +331,12 @@ static virNetClientPtr virNetClientNew(virNetSocketPtr sock,
     if (!(client = virObjectLockableNew(virNetClientClass)))
         goto error;
 
+    if (virCondInit(&client->asyncCond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize condition variable"));
+        goto error;
+    }
+
     client->sock = sock;
     client->wakeupReadFD = wakeupFD[0];
     client->wakeupSendFD = wakeupFD[1];
@@ -622,6 +646,8 @@ void virNetClientDispose(void *obj)
 
     virNetMessageClear(&client->msg);
 
+    virCondDestroy(&client->asyncCond);
+
     virObjectUnlock(client);
 }
 
@@ -718,7 +744,18 @@ static void virNetClientCloseInternal(virNetClientPtr client,
 
 void virNetClientClose(virNetClientPtr client)
 {
+    virNetClientCallPtr done;
+
     virNetClientCloseInternal(client, VIR_CONNECT_CLOSE_REASON_CLIENT);
+
+    if (!client)
+        return;
+
+    /* Closing failed any async calls still waiting for a reply */
+    virObjectLock(client);
+    done = virNetClientAsyncSteal(client);
+    virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
 }
 
 
@@ -959,6 +996,98 @@ int virNetClientGetTLSKeySize(virNetClientPtr client)
 }
 #endif
 
+/* Wake up threads waiting for all async calls to finish */
+static void
+virNetClientAsyncWakeBarriers(virNetClientPtr client)
+{
+    virNetClientCallPtr call;
+
+    for (call = client->waitDispatch; call; call = call->next) {
+        if (call->barrier)
+            call->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+    }
+}
+
+
+/* Move an async call off the dispatch queue; its callback runs
+ * once the client lock is dropped */
+static void
+virNetClientAsyncComplete(virNetClientPtr client,
+                          virNetClientCallPtr call)
+{
+    virNetClientCallRemove(&client->waitDispatch, call);
+    virNetClientCallQueue(&client->asyncDone, call);
+
+    if (--client->nasync == 0)
+        virNetClientAsyncWakeBarriers(client);
+}
+
+
+/* The connection is going away, so no more replies will arrive */
+static void
+virNetClientAsyncFailAll(virNetClientPtr client)
+{
+    virNetClientCallPtr call = client->waitDispatch;
+
+    while (call) {
+        virNetClientCallPtr next = call->next;
+
+        if (call->asyncCb)
+            virNetClientAsyncComplete(client, call);
+        call = next;
+    }
+}
+
+
+/* Take the list of finished async calls, with the client locked */
+static virNetClientCallPtr
+virNetClientAsyncSteal(virNetClientPtr client)
+{
+    virNetClientCallPtr call = client->asyncDone;
+    virNetClientCallPtr tmp;
+
+    client->asyncDone = NULL;
+    for (tmp = call; tmp; tmp = tmp->next)
+        client->nasyncRunning++;
+
+    return call;
+}
+
+
+/*
+ * Invoke the callbacks of async calls taken by virNetClientAsyncSteal.
+ * Must be called without the client lock held, so that callbacks are
+ * free to issue further calls.
+ */
+static void
+virNetClientAsyncRun(virNetClientPtr client,
+                     virNetClientCallPtr call)
+{
+    while (call) {
+        virNetClientCallPtr next = call->next;
+        int rv = 0;
+
+        if (call->mode != VIR_NET_CLIENT_MODE_COMPLETE) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("client socket is closed"));
+            rv = -1;
+        }
+
+        call->asyncCb(client, call->msg, rv, call->asyncOpaque);
+
+        virCondDestroy(&call->cond);
+        VIR_FREE(call);
+
+        virObjectLock(client);
+        if (--client->nasyncRunning == 0)
+            virCondBroadcast(&client->asyncCond);
+        virObjectUnlock(client);
+        virObjectUnref(client);
+        call = next;
+    }
+}
+
+
 static int
 virNetClientCallDispatchReply(virNetClientPtr client)
 {
@@ -968,9 +1097,10 @@ virNetClientCallDispatchReply(virNetClientPtr client)
        out which waiting call is associated with it */
     thecall = client->waitDispatch;
     while (thecall &&
-           !(thecall->msg->header.prog == client->msg.header.prog &&
-             thecall->msg->header.vers == client->msg.header.vers &&
-             thecall->msg->header.serial == client->msg.header.serial))
+           (thecall->barrier ||
+            !(thecall->msg->header.prog == client->msg.header.prog &&
+              thecall->msg->header.vers == client->msg.header.vers &&
+              thecall->msg->header.serial == client->msg.header.serial)))
         thecall = thecall->next;
 
     if (!thecall) {
@@ -980,13 +1110,16 @@ virNetClientCallDispatchReply(virNetClientPtr client)
         return -1;
     }
 
-    if (VIR_REALLOC_N(thecall->msg->buffer, client->msg.bufferLength) < 0)
-        return -1;
-
-    memcpy(thecall->msg->buffer, client->msg.buffer, client->msg.bufferLength);
+    /* Hand the receive buffer over to the call rather than
+     * copying the reply, the next read takes a fresh one */
+    virNetMessageReleaseBuffer(thecall->msg);
     memcpy(&thecall->msg->header, &client->msg.header, sizeof(client->msg.header));
+    thecall->msg->buffer = client->msg.buffer;
+    thecall->msg->bufferSize = client->msg.bufferSize;
     thecall->msg->bufferLength = client->msg.bufferLength;
     thecall->msg->bufferOffset = client->msg.bufferOffset;
+    client->msg.buffer = NULL;
+    client->msg.bufferSize = 0;
 
     thecall->msg->nfds = client->msg.nfds;
     thecall->msg->fds = client->msg.fds;
@@ -995,6 +1128,9 @@ virNetClientCallDispatchReply(virNetClientPtr client)
 
     thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
 
+    if (thecall->asyncCb)
+        virNetClientAsyncComplete(client, thecall);
+
     return 0;
 }
 
@@ -1058,7 +1194,8 @@ static int virNetClientCallDispatchStream(virNetClientPtr client)
     /* Status is either
      *   - REMOTE_OK - no payload for streams
      *   - REMOTE_ERROR - followed by a remote_error struct
-     *   - REMOTE_CONTINUE - followed by a raw data packet
+     *   - REMOTE_CONTINUE - followed by a raw data packet, or by a
+     *                       virNetStreamHole for VIR_NET_STREAM_HOLE
      */
     switch (client->msg.header.status) {
     case VIR_NET_CONTINUE: {
@@ -1140,6 +1277,7 @@ virNetClientCallDispatch(virNetClientPtr client)
         return virNetClientCallDispatchMessage(client);
 
     case VIR_NET_STREAM: /* Stream protocol */
+    case VIR_NET_STREAM_HOLE:
         return virNetClientCallDispatchStream(client);
 
     default:
@@ -1159,9 +1297,10 @@ virNetClientIOWriteMessage(virNetClientPtr client,
     ssize_t ret = 0;
 
     if (thecall->msg->bufferOffset < thecall->msg->bufferLength) {
-        ret = virNetSocketWrite(client->sock,
-                                thecall->msg->buffer + thecall->msg->bufferOffset,
-                                thecall->msg->bufferLength - thecall->msg->bufferOffset);
+        struct iovec iov[2];
+        size_t niov = virNetMessageGetIOV(thecall->msg, iov);
+
+        ret = virNetSocketWritev(client->sock, iov, niov);
         if (ret <= 0)
             return ret;
 
@@ -1179,9 +1318,8 @@ virNetClientIOWriteMessage(virNetClientPtr client,
             thecall->msg->donefds++;
         }
         thecall->msg->donefds = 0;
-        thecall->msg->bufferOffset = thecall->msg->bufferLength = 0;
         VIR_FREE(thecall->msg->fds);
-        VIR_FREE(thecall->msg->buffer);
+        virNetMessageReleaseBuffer(thecall->msg);
         if (thecall->expectReply)
             thecall->mode = VIR_NET_CLIENT_MODE_WAIT_RX;
         else
@@ -1230,7 +1368,8 @@ virNetClientIOReadMessage(virNetClientPtr client)
     /* Start by reading length word */
     if (client->msg.bufferLength == 0) {
         client->msg.bufferLength = 4;
-        if (VIR_ALLOC_N(client->msg.buffer, client->msg.bufferLength) < 0)
+        if (virNetMessageReserveBuffer(&client->msg,
+                                       client->msg.bufferLength) < 0)
             return -ENOMEM;
     }
 
@@ -1434,6 +1573,7 @@ virNetClientIOEventLoopPassTheBuck(virNetClientPtr client,
     VIR_DEBUG("No thread to pass the buck to");
     if (client->wantClose) {
         virNetClientCloseLocked(client);
+        virNetClientAsyncFailAll(client);
         virNetClientCallRemovePredicate(&client->waitDispatch,
                                         virNetClientIOEventLoopRemoveAll,
                                         thiscall);
@@ -1595,7 +1735,10 @@ static int virNetClientIOEventLoop(virNetClientPtr client,
             return 1;
         }
 
-        if (fds[0].revents & (POLLHUP | POLLERR)) {
+        /* Replies sent before a hangup may still be waiting to be
+         * read, in which case reading reports the EOF once they are */
+        if (fds[0].revents & (POLLHUP | POLLERR) &&
+            !(fds[0].revents & POLLIN)) {
             virNetClientMarkClose(client, VIR_CONNECT_CLOSE_REASON_EOF);
             virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                            _("received hangup / error event on socket"));
@@ -1810,6 +1953,7 @@ void virNetClientIncomingEvent(virNetSocketPtr sock,
                                void *opaque)
 {
     virNetClientPtr client = opaque;
+    virNetClientCallPtr done;
 
     virObjectLock(client);
 
@@ -1833,7 +1977,8 @@ void virNetClientIncomingEvent(virNetSocketPtr sock,
             virNetClientMarkClose(client, VIR_CONNECT_CLOSE_REASON_ERROR);
     }
 
-    if (events & (VIR_EVENT_HANDLE_HANGUP | VIR_EVENT_HANDLE_ERROR)) {
+    if (events & (VIR_EVENT_HANDLE_HANGUP | VIR_EVENT_HANDLE_ERROR) &&
+        !(events & VIR_EVENT_HANDLE_READABLE)) {
         VIR_DEBUG("VIR_EVENT_HANDLE_HANGUP or "
                   "VIR_EVENT_HANDLE_ERROR encountered");
         virNetClientMarkClose(client,
@@ -1852,11 +1997,15 @@ void virNetClientIncomingEvent(virNetSocketPtr sock,
 done:
     if (client->wantClose && !client->haveTheBuck) {
         virNetClientCloseLocked(client);
+        virNetClientAsyncFailAll(client);
         virNetClientCallRemovePredicate(&client->waitDispatch,
                                         virNetClientIOEventLoopRemoveAll,
                                         NULL);
     }
+    done = virNetClientAsyncSteal(client);
     virObjectUnlock(client);
+
+    virNetClientAsyncRun(client, done);
 }
 
 
@@ -1987,10 +2136,13 @@ static int virNetClientSendInternal(virNetClientPtr client,
 int virNetClientSendWithReply(virNetClientPtr client,
                               virNetMessagePtr msg)
 {
+    virNetClientCallPtr done;
     int ret;
     virObjectLock(client);
     ret = virNetClientSendInternal(client, msg, true, false);
+    done = virNetClientAsyncSteal(client);
     virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
     if (ret < 0)
         return -1;
     return 0;
@@ -2010,10 +2162,13 @@ int virNetClientSendWithReply(virNetClientPtr client,
 int virNetClientSendNoReply(virNetClientPtr client,
                             virNetMessagePtr msg)
 {
+    virNetClientCallPtr done;
     int ret;
     virObjectLock(client);
     ret = virNetClientSendInternal(client, msg, false, false);
+    done = virNetClientAsyncSteal(client);
     virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
     if (ret < 0)
         return -1;
     return 0;
@@ -2033,10 +2188,13 @@ int virNetClientSendNoReply(virNetClientPtr client,
 int virNetClientSendNonBlock(virNetClientPtr client,
                              virNetMessagePtr msg)
 {
+    virNetClientCallPtr done;
     int ret;
     virObjectLock(client);
     ret = virNetClientSendInternal(client, msg, false, true);
+    done = virNetClientAsyncSteal(client);
     virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
     return ret;
 }
 
@@ -2054,6 +2212,7 @@ int virNetClientSendWithReplyStream(virNetClientPtr client,
                                     virNetMessagePtr msg,
                                     virNetClientStreamPtr st)
 {
+    virNetClientCallPtr done;
     int ret;
     virObjectLock(client);
     /* Other thread might have already received
@@ -2066,8 +2225,184 @@ int virNetClientSendWithReplyStream(virNetClientPtr client,
     }
 
     ret = virNetClientSendInternal(client, msg, true, false);
+    done = virNetClientAsyncSteal(client);
     virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
     if (ret < 0)
         return -1;
     return 0;
 }
+
+/*
+ * @msg: a message allocated on the heap
+ * @cb: function to call with the reply
+ * @opaque: data to pass to @cb
+ *
+ * Send a message expecting a reply, but without waiting for it.
+ * As many calls as the server allows can be in flight at once.
+ *
+ * Once the reply arrives, @cb is called with @msg filled in and
+ * @rv set to 0. If the connection is closed first, @rv is -1 and
+ * an error has been reported. Either way @cb takes over @msg.
+ *
+ * Callbacks run from whichever thread drives the connection: the
+ * event loop, a thread making a synchronous call, or one waiting
+ * in virNetClientWaitAsync. They are called without the client
+ * lock held.
+ *
+ * Returns 0 if the message was queued, or -1 on failure in which
+ * case @cb is not called and the caller still owns @msg.
+ */
+int virNetClientSendAsync(virNetClientPtr client,
+                          virNetMessagePtr msg,
+                          virNetClientAsyncFunc cb,
+                          void *opaque)
+{
+    virNetClientCallPtr call;
+    virNetClientCallPtr done;
+    int ret = -1;
+
+    virObjectLock(client);
+
+    PROBE(RPC_CLIENT_MSG_TX_QUEUE,
+          "client=%p len=%zu prog=%u vers=%u proc=%u type=%u status=%u serial=%u",
+          client, msg->bufferLength,
+          msg->header.prog, msg->header.vers, msg->header.proc,
+          msg->header.type, msg->header.status, msg->header.serial);
+
+    if (!client->sock || client->wantClose) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("client socket is closed"));
+        goto cleanup;
+    }
+
+    if (!(call = virNetClientCallNew(msg, true, false)))
+        goto cleanup;
+
+    call->asyncCb = cb;
+    call->asyncOpaque = opaque;
+
+    /* Pending calls keep the client alive until their callback ran */
+    virObjectRef(client);
+    virNetClientCallQueue(&client->waitDispatch, call);
+    client->nasync++;
+
+    if (client->haveTheBuck) {
+        char ignore = 1;
+
+        /* Let the polling thread pick up the new call */
+        if (safewrite(client->wakeupSendFD, &ignore, sizeof(ignore)) != sizeof(ignore))
+            VIR_WARN("failed to wake up polling thread");
+    } else {
+        /* Nobody is polling, write out as much as we can right away
+         * and leave the rest, as well as the reply, to the event loop
+         * or the next thread to use the connection */
+        if (virNetClientIOHandleOutput(client) < 0)
+            virNetClientMarkClose(client, VIR_CONNECT_CLOSE_REASON_ERROR);
+
+        if (client->wantClose) {
+            virNetClientCloseLocked(client);
+            virNetClientAsyncFailAll(client);
+            virNetClientCallRemovePredicate(&client->waitDispatch,
+                                            virNetClientIOEventLoopRemoveAll,
+                                            NULL);
+        } else {
+            /* Writing may have finished a queued non-blocking call */
+            virNetClientCallRemovePredicate(&client->waitDispatch,
+                                            virNetClientIOEventLoopRemoveDone,
+                                            NULL);
+            virNetClientIOUpdateCallback(client, true);
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    done = virNetClientAsyncSteal(client);
+    virObjectUnlock(client);
+    virNetClientAsyncRun(client, done);
+    return ret;
+}
+
+/* Drive the connection until no async call is waiting for its reply */
+static int
+virNetClientWaitAsyncReplies(virNetClientPtr client)
+{
+    virNetClientCallPtr call = NULL;
+    virNetMessagePtr msg = NULL;
+    int ret = -1;
+
+    if (!client->sock || client->wantClose) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("client socket is closed"));
+        return -1;
+    }
+
+    /* An empty call which never matches a reply, but is completed
+     * as soon as the last async call is */
+    if (!(msg = virNetMessageNew(false)) ||
+        !(call = virNetClientCallNew(msg, true, false)))
+        goto cleanup;
+
+    call->barrier = true;
+    call->haveThread = true;
+    ret = virNetClientIO(client, call);
+
+cleanup:
+    if (call) {
+        virCondDestroy(&call->cond);
+        VIR_FREE(call);
+    }
+    virNetMessageFree(msg);
+    return ret;
+}
+
+/*
+ * Wait until every call sent with virNetClientSendAsync has got
+ * its reply and its callback finished, driving the connection from
+ * this thread if nobody else does. Calls issued by the callbacks
+ * themselves are waited for too.
+ *
+ * Returns 0 on success, -1 if the connection failed
+ */
+int virNetClientWaitAsync(virNetClientPtr client)
+{
+    virNetClientCallPtr done;
+    int ret = 0;
+
+    virObjectLock(client);
+
+    for (;;) {
+        if (client->asyncDone) {
+            done = virNetClientAsyncSteal(client);
+            virObjectUnlock(client);
+            virNetClientAsyncRun(client, done);
+            virObjectLock(client);
+        } else if (client->nasync) {
+            if (virNetClientWaitAsyncReplies(client) < 0) {
+                virErrorPtr err = virSaveLastError();
+
+                /* Calls failed by closing the connection are still
+                 * owed their callback */
+                done = virNetClientAsyncSteal(client);
+                virObjectUnlock(client);
+                virNetClientAsyncRun(client, done);
+                virSetError(err);
+                virFreeError(err);
+                return -1;
+            }
+        } else if (client->nasyncRunning) {
+            if (virCondWait(&client->asyncCond, &client->parent.lock) < 0) {
+                virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("failed to wait on condition"));
+                ret = -1;
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+
+    virObjectUnlock(client);
+    return ret;
+}
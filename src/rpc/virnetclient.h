@@ -106,6 +106,19 @@ int virNetClientSendWithReplyStream(virNetClientPtr client,
                                     virNetMessagePtr msg,
                                     virNetClientStreamPtr st);
 
+typedef void (*virNetClientAsyncFunc)(virNetClientPtr client,
+                                      virNetMessagePtr msg,
+                                      int rv,
+                                      void *opaque);
+
+int virNetClientSendAsync(virNetClientPtr client,
+                          virNetMessagePtr msg,
+                          virNetClientAsyncFunc cb,
+                          void *opaque)
+    ATTRIBUTE_NONNULL(3);
+
+int virNetClientWaitAsync(virNetClientPtr client);
+
 # ifdef WITH_SASL
 void virNetClientSetSASLSession(virNetClientPtr client,
                                 virNetSASLSessionPtr sasl);
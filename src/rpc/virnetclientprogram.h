@@ -81,6 +81,22 @@ int virNetClientProgramCall(virNetClientProgramPtr prog,
                             xdrproc_t args_filter, void *args,
                             xdrproc_t ret_filter, void *ret);
 
+typedef void (*virNetClientProgramCallFunc)(virNetClientProgramPtr prog,
+                                            virNetClientPtr client,
+                                            int rv,
+                                            void *ret,
+                                            void *opaque);
+
+int virNetClientProgramCallAsync(virNetClientProgramPtr prog,
+                                 virNetClientPtr client,
+                                 unsigned serial,
+                                 int proc,
+                                 xdrproc_t args_filter, void *args,
+                                 xdrproc_t ret_filter, void *ret,
+                                 virNetClientProgramCallFunc cb,
+                                 void *opaque)
+    ATTRIBUTE_NONNULL(9);
+
 
 
 #endif /* __VIR_NET_CLIENT_PROGRAM_H__ */
@@ -31,6 +31,14 @@
 
 #define VIR_FROM_THIS VIR_FROM_RPC
 
+/* A hole received in a sparse stream, which comes after @offset
+ * bytes of the data currently held in the incoming buffer */
+typedef struct _virNetClientStreamHole virNetClientStreamHole;
+struct _virNetClientStreamHole {
+    size_t offset;
+    long long length;
+};
+
 struct _virNetClientStream {
     virObjectLockable parent;
 
@@ -52,6 +60,9 @@ struct _virNetClientStream {
     size_t incomingLength;
     bool incomingEOF;
 
+    virNetClientStreamHole *holes;
+    size_t nholes;
+
     virNetClientStreamEventCallback cb;
     void *cbOpaque;
     virFreeCallback cbFree;
@@ -86,7 +97,7 @@ virNetClientStreamEventTimerUpdate(virNetClientStreamPtr st)
 
     VIR_DEBUG("Check timer offset=%zu %d", st->incomingOffset, st->cbEvents);
 
-    if (((st->incomingOffset || st->incomingEOF) &&
+    if (((st->incomingOffset || st->nholes || st->incomingEOF) &&
          (st->cbEvents & VIR_STREAM_EVENT_READABLE)) ||
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE)) {
         VIR_DEBUG("Enabling event timer");
@@ -108,7 +119,7 @@ virNetClientStreamEventTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
 
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_READABLE) &&
-        (st->incomingOffset || st->incomingEOF))
+        (st->incomingOffset || st->nholes || st->incomingEOF))
         events |= VIR_STREAM_EVENT_READABLE;
     if (st->cb &&
         (st->cbEvents & VIR_STREAM_EVENT_WRITABLE))
@@ -160,6 +171,7 @@ void virNetClientStreamDispose(void *obj)
 
     virResetError(&st->err);
     VIR_FREE(st->incoming);
+    VIR_FREE(st->holes);
     virObjectUnref(st->prog);
 }
 
@@ -259,6 +271,44 @@ cleanup:
 }
 
 
+static int
+virNetClientStreamQueueHole(virNetClientStreamPtr st,
+                            virNetMessagePtr msg)
+{
+    virNetStreamHole data;
+    virNetClientStreamHole *last;
+
+    memset(&data, 0, sizeof(data));
+    if (virNetMessageDecodePayload(msg, (xdrproc_t)xdr_virNetStreamHole,
+                                   &data) < 0)
+        return -1;
+
+    if (data.length < 0) {
+        virReportError(VIR_ERR_RPC,
+                       _("malformed stream hole of length %lld"),
+                       (long long) data.length);
+        return -1;
+    }
+
+    if (data.length == 0)
+        return 0;
+
+    /* Adjacent holes are merged, there is no data between them */
+    last = st->nholes ? &st->holes[st->nholes - 1] : NULL;
+    if (last && last->offset == st->incomingOffset) {
+        last->length += data.length;
+    } else {
+        virNetClientStreamHole hole = { st->incomingOffset, data.length };
+        if (VIR_APPEND_ELEMENT(st->holes, st->nholes, hole) < 0)
+            return -1;
+    }
+
+    VIR_DEBUG("Stream hole at offset %zu length %lld, %zu holes pending",
+              st->incomingOffset, (long long) data.length, st->nholes);
+    return 0;
+}
+
+
 int virNetClientStreamQueuePacket(virNetClientStreamPtr st,
                                   virNetMessagePtr msg)
 {
@@ -266,6 +316,14 @@ int virNetClientStreamQueuePacket(virNetClientStreamPtr st,
     size_t need;
 
     virObjectLock(st);
+    if (msg->header.type == VIR_NET_STREAM_HOLE) {
+        if (virNetClientStreamQueueHole(st, msg) < 0)
+            goto cleanup;
+        virNetClientStreamEventTimerUpdate(st);
+        ret = 0;
+        goto cleanup;
+    }
+
     need = msg->bufferLength - msg->bufferOffset;
     if (need) {
         size_t avail = st->incomingLength - st->incomingOffset;
@@ -327,10 +385,11 @@ int virNetClientStreamSendPacket(virNetClientStreamPtr st,
         goto error;
 
     /* Data packets are async fire&forget, but OK/ERROR packets
-     * need a synchronous confirmation
+     * need a synchronous confirmation. Either way we wait for
+     * the packet to be written, so @data can be sent in place
      */
     if (status == VIR_NET_CONTINUE) {
-        if (virNetMessageEncodePayloadRaw(msg, data, nbytes) < 0)
+        if (virNetMessageEncodePayloadRef(msg, data, nbytes, false) < 0)
             goto error;
 
         if (virNetClientSendNoReply(client, msg) < 0)
@@ -353,17 +412,67 @@ error:
     return -1;
 }
 
+int virNetClientStreamSendHole(virNetClientStreamPtr st,
+                               virNetClientPtr client,
+                               long long length,
+                               unsigned int flags)
+{
+    virNetMessagePtr msg;
+    virNetStreamHole data;
+
+    VIR_DEBUG("st=%p length=%lld flags=%x", st, length, flags);
+
+    memset(&data, 0, sizeof(data));
+    data.length = length;
+    data.flags = flags;
+
+    if (!(msg = virNetMessageNew(false)))
+        return -1;
+
+    virObjectLock(st);
+
+    msg->header.prog = virNetClientProgramGetProgram(st->prog);
+    msg->header.vers = virNetClientProgramGetVersion(st->prog);
+    msg->header.status = VIR_NET_CONTINUE;
+    msg->header.type = VIR_NET_STREAM_HOLE;
+    msg->header.serial = st->serial;
+    msg->header.proc = st->proc;
+
+    virObjectUnlock(st);
+
+    if (virNetMessageEncodeHeader(msg) < 0)
+        goto error;
+
+    if (virNetMessageEncodePayload(msg,
+                                   (xdrproc_t)xdr_virNetStreamHole,
+                                   &data) < 0)
+        goto error;
+
+    if (virNetClientSendNoReply(client, msg) < 0)
+        goto error;
+
+    virNetMessageFree(msg);
+    return 0;
+
+error:
+    virNetMessageFree(msg);
+    return -1;
+}
+
+
 int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
                                  virNetClientPtr client,
                                  char *data,
                                  size_t nbytes,
-                                 bool nonblock)
+                                 bool nonblock,
+                                 bool stopAtHole)
 {
     int rv = -1;
-    VIR_DEBUG("st=%p client=%p data=%p nbytes=%zu nonblock=%d",
-              st, client, data, nbytes, nonblock);
+    size_t avail;
+    VIR_DEBUG("st=%p client=%p data=%p nbytes=%zu nonblock=%d stopAtHole=%d",
+              st, client, data, nbytes, nonblock, stopAtHole);
     virObjectLock(st);
-    if (!st->incomingOffset && !st->incomingEOF) {
+    if (!st->incomingOffset && !st->nholes && !st->incomingEOF) {
         virNetMessagePtr msg;
         int ret;
 
@@ -393,9 +502,16 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
             goto cleanup;
     }
 
-    VIR_DEBUG("After IO %zu", st->incomingOffset);
-    if (st->incomingOffset) {
-        int want = st->incomingOffset;
+    VIR_DEBUG("After IO %zu holes %zu", st->incomingOffset, st->nholes);
+
+    /* Only hand out the data which precedes the next hole */
+    avail = st->incomingOffset;
+    if (st->nholes)
+        avail = st->holes[0].offset;
+
+    if (avail) {
+        int want = avail;
+        size_t i;
         if (want > nbytes)
             want = nbytes;
         memcpy(data, st->incoming, want);
@@ -406,7 +522,24 @@ int virNetClientStreamRecvPacket(virNetClientStreamPtr st,
             VIR_FREE(st->incoming);
             st->incomingOffset = st->incomingLength = 0;
         }
+        for (i = 0; i < st->nholes; i++)
+            st->holes[i].offset -= want;
         rv = want;
+    } else if (st->nholes) {
+        if (stopAtHole) {
+            VIR_DEBUG("Stopping at hole of length %lld", st->holes[0].length);
+            rv = -3;
+        } else {
+            /* The caller doesn't know about holes, so fill in the zeroes */
+            int want = nbytes > INT_MAX ? INT_MAX : nbytes;
+            if (want > st->holes[0].length)
+                want = st->holes[0].length;
+            memset(data, 0, want);
+            st->holes[0].length -= want;
+            if (st->holes[0].length == 0)
+                VIR_DELETE_ELEMENT(st->holes, 0, st->nholes);
+            rv = want;
+        }
     } else {
         rv = 0;
     }
@@ -419,6 +552,27 @@ cleanup:
 }
 
 
+int virNetClientStreamRecvHole(virNetClientStreamPtr st,
+                               long long *length)
+{
+    virObjectLock(st);
+
+    /* A hole is only reached once the data before it was read */
+    if (st->nholes && st->holes[0].offset == 0) {
+        *length = st->holes[0].length;
+        VIR_DELETE_ELEMENT(st->holes, 0, st->nholes);
+    } else {
+        *length = 0;
+    }
+
+    VIR_DEBUG("st=%p length=%lld", st, *length);
+    virNetClientStreamEventTimerUpdate(st);
+
+    virObjectUnlock(st);
+    return 0;
+}
+
+
 int virNetClientStreamEventAddCallback(virNetClientStreamPtr st,
                                        int events,
                                        virNetClientStreamEventCallback cb,
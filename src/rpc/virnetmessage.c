@@ -30,9 +30,182 @@
 #include "virfile.h"
 #include "virutil.h"
 #include "virstring.h"
+#include "virthread.h"
 
 #define VIR_FROM_THIS VIR_FROM_RPC
 
+/*
+ * Message buffers are recycled through a pool with a free list
+ * per size class. The classes follow the sizes the encoder asks
+ * for as it grows a buffer by a factor of 4, so under steady RPC
+ * load buffers rarely go back to the allocator. Buffers larger
+ * than the biggest class are rare and are not kept around.
+ */
+#define VIR_NET_MESSAGE_POOL_CLASSES 5
+#define VIR_NET_MESSAGE_POOL_CLASS_MIN (VIR_NET_MESSAGE_INITIAL / 16)
+#define VIR_NET_MESSAGE_POOL_CLASS_BYTES (4 * 1024 * 1024)
+#define VIR_NET_MESSAGE_POOL_CLASS_BUFFERS 64
+
+/* Stream data smaller than this is cheaper to copy than to send
+ * as a separate segment */
+#define VIR_NET_MESSAGE_PAYLOAD_REF_MIN 4096
+
+typedef struct _virNetMessagePoolClass virNetMessagePoolClass;
+struct _virNetMessagePoolClass {
+    size_t size;
+    size_t max;
+    size_t nbuffers;
+    void *buffers; /* Free list linked through the first word */
+};
+
+static virMutex virNetMessagePoolLock;
+static virNetMessagePoolClass virNetMessagePool[VIR_NET_MESSAGE_POOL_CLASSES];
+
+static int virNetMessageOnceInit(void)
+{
+    size_t i;
+
+    if (virMutexInit(&virNetMessagePoolLock) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to initialize mutex"));
+        return -1;
+    }
+
+    for (i = 0; i < VIR_NET_MESSAGE_POOL_CLASSES; i++) {
+        virNetMessagePool[i].size = (VIR_NET_MESSAGE_POOL_CLASS_MIN << (2 * i)) +
+            VIR_NET_MESSAGE_LEN_MAX;
+        virNetMessagePool[i].max = MIN(VIR_NET_MESSAGE_POOL_CLASS_BUFFERS,
+                                       VIR_NET_MESSAGE_POOL_CLASS_BYTES /
+                                       virNetMessagePool[i].size);
+    }
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virNetMessage)
+
+
+static virNetMessagePoolClass *
+virNetMessagePoolClassFor(size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < VIR_NET_MESSAGE_POOL_CLASSES; i++) {
+        if (len <= virNetMessagePool[i].size)
+            return &virNetMessagePool[i];
+    }
+    return NULL;
+}
+
+
+static char *
+virNetMessageBufferAlloc(size_t len, size_t *size)
+{
+    virNetMessagePoolClass *class;
+    char *buf = NULL;
+
+    if (virNetMessageInitialize() < 0)
+        return NULL;
+
+    if (!(class = virNetMessagePoolClassFor(len))) {
+        if (VIR_ALLOC_N(buf, len) < 0)
+            return NULL;
+        *size = len;
+        return buf;
+    }
+
+    virMutexLock(&virNetMessagePoolLock);
+    if (class->buffers) {
+        buf = class->buffers;
+        memcpy(&class->buffers, buf, sizeof(void *));
+        class->nbuffers--;
+    }
+    virMutexUnlock(&virNetMessagePoolLock);
+
+    if (!buf && VIR_ALLOC_N(buf, class->size) < 0)
+        return NULL;
+
+    *size = class->size;
+    return buf;
+}
+
+
+static void
+virNetMessageBufferRelease(char *buf, size_t size)
+{
+    virNetMessagePoolClass *class;
+
+    if (!buf)
+        return;
+
+    if ((class = virNetMessagePoolClassFor(size)) &&
+        class->size == size) {
+        virMutexLock(&virNetMessagePoolLock);
+        if (class->nbuffers < class->max) {
+            memcpy(buf, &class->buffers, sizeof(void *));
+            class->buffers = buf;
+            class->nbuffers++;
+            buf = NULL;
+        }
+        virMutexUnlock(&virNetMessagePoolLock);
+    }
+
+    VIR_FREE(buf);
+}
+
+
+/*
+ * @msg: the message whose buffer to grow
+ * @len: the minimum size needed
+ *
+ * Makes sure msg->buffer has room for at least @len bytes, taking
+ * a buffer from the pool if needed. Data already in the buffer
+ * is preserved, bufferLength and bufferOffset are not changed.
+ *
+ * returns 0 on success, -1 on OOM
+ */
+int virNetMessageReserveBuffer(virNetMessagePtr msg, size_t len)
+{
+    char *buf;
+    size_t size;
+
+    if (msg->buffer && msg->bufferSize >= len)
+        return 0;
+
+    if (!(buf = virNetMessageBufferAlloc(len, &size)))
+        return -1;
+
+    if (msg->buffer) {
+        memcpy(buf, msg->buffer, msg->bufferSize);
+        virNetMessageBufferRelease(msg->buffer, msg->bufferSize);
+    }
+
+    msg->buffer = buf;
+    msg->bufferSize = size;
+    return 0;
+}
+
+
+/*
+ * @msg: the message whose buffer to drop
+ *
+ * Returns the message buffer to the pool and releases any
+ * payload attached with virNetMessageEncodePayloadRef.
+ */
+void virNetMessageReleaseBuffer(virNetMessagePtr msg)
+{
+    virNetMessageBufferRelease(msg->buffer, msg->bufferSize);
+    msg->buffer = NULL;
+    msg->bufferSize = 0;
+    msg->bufferLength = 0;
+    msg->bufferOffset = 0;
+
+    msg->payload = NULL;
+    msg->payloadLength = 0;
+    VIR_FREE(msg->payloadOwned);
+}
+
+
 virNetMessagePtr virNetMessageNew(bool tracked)
 {
     virNetMessagePtr msg;
@@ -57,7 +230,7 @@ void virNetMessageClear(virNetMessagePtr msg)
     for (i = 0; i < msg->nfds; i++)
         VIR_FORCE_CLOSE(msg->fds[i]);
     VIR_FREE(msg->fds);
-    VIR_FREE(msg->buffer);
+    virNetMessageReleaseBuffer(msg);
     memset(msg, 0, sizeof(*msg));
     msg->tracked = tracked;
 }
@@ -76,7 +249,7 @@ void virNetMessageFree(virNetMessagePtr msg)
 
     for (i = 0; i < msg->nfds; i++)
         VIR_FORCE_CLOSE(msg->fds[i]);
-    VIR_FREE(msg->buffer);
+    virNetMessageReleaseBuffer(msg);
     VIR_FREE(msg->fds);
     VIR_FREE(msg);
 }
@@ -142,7 +315,7 @@ int virNetMessageDecodeLength(virNetMessagePtr msg)
     /* Extend our declared buffer length and carry
        on reading the header + payload */
     msg->bufferLength += len;
-    if (VIR_REALLOC_N(msg->buffer, msg->bufferLength) < 0)
+    if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0)
         goto cleanup;
 
     VIR_DEBUG("Got length, now need %zu total (%u more)",
@@ -219,7 +392,7 @@ int virNetMessageEncodeHeader(virNetMessagePtr msg)
     unsigned int len = 0;
 
     msg->bufferLength = VIR_NET_MESSAGE_INITIAL + VIR_NET_MESSAGE_LEN_MAX;
-    if (VIR_REALLOC_N(msg->buffer, msg->bufferLength) < 0)
+    if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0)
         return ret;
     msg->bufferOffset = 0;
 
@@ -356,7 +529,7 @@ int virNetMessageEncodePayload(virNetMessagePtr msg,
         msg->bufferLength = (msg->bufferLength - VIR_NET_MESSAGE_LEN_MAX) * 4 +
             VIR_NET_MESSAGE_LEN_MAX;
 
-        if (VIR_REALLOC_N(msg->buffer, msg->bufferLength) < 0)
+        if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0)
             goto error;
 
         xdrmem_create(&xdr, msg->buffer + msg->bufferOffset,
@@ -435,7 +608,7 @@ int virNetMessageEncodePayloadRaw(virNetMessagePtr msg,
 
         msg->bufferLength = msg->bufferOffset + len;
 
-        if (VIR_REALLOC_N(msg->buffer, msg->bufferLength) < 0)
+        if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0)
             return -1;
 
         VIR_DEBUG("Increased message buffer length = %zu", msg->bufferLength);
@@ -464,6 +637,68 @@ error:
 }
 
 
+/*
+ * @msg: the outgoing message, whose header is already encoded
+ * @data: the stream data to send
+ * @len: the length of @data
+ * @owned: whether the message takes over @data
+ *
+ * Like virNetMessageEncodePayloadRaw, but large payloads are not
+ * copied into the message buffer. Instead the writer sends them
+ * straight from @data, see virNetMessageGetIOV. If @owned is
+ * false, @data must stay valid until the message has been sent,
+ * otherwise it is freed along with the message, even on failure.
+ *
+ * returns 0 if successfully encoded, -1 upon fatal error
+ */
+int virNetMessageEncodePayloadRef(virNetMessagePtr msg,
+                                  const char *data,
+                                  size_t len,
+                                  bool owned)
+{
+    XDR xdr;
+    unsigned int msglen;
+    char *tmp = owned ? (char *)data : NULL;
+
+    if (len < VIR_NET_MESSAGE_PAYLOAD_REF_MIN) {
+        int ret = virNetMessageEncodePayloadRaw(msg, data, len);
+        VIR_FREE(tmp);
+        return ret;
+    }
+
+    if ((msg->bufferOffset + len) > VIR_NET_MESSAGE_MAX) {
+        virReportError(VIR_ERR_RPC,
+                       _("Stream data too long to send (%zu bytes needed, %zu bytes available)"),
+                       len, (VIR_NET_MESSAGE_MAX - msg->bufferOffset));
+        VIR_FREE(tmp);
+        return -1;
+    }
+
+    /* Re-encode the length word. */
+    VIR_DEBUG("Encode length as %zu", msg->bufferOffset + len);
+    xdrmem_create(&xdr, msg->buffer, VIR_NET_MESSAGE_HEADER_XDR_LEN, XDR_ENCODE);
+    msglen = msg->bufferOffset + len;
+    if (!xdr_u_int(&xdr, &msglen)) {
+        virReportError(VIR_ERR_RPC, "%s", _("Unable to encode message length"));
+        goto error;
+    }
+    xdr_destroy(&xdr);
+
+    msg->payload = data;
+    msg->payloadLength = len;
+    msg->payloadOwned = tmp;
+
+    msg->bufferLength = msg->bufferOffset + len;
+    msg->bufferOffset = 0;
+    return 0;
+
+error:
+    xdr_destroy(&xdr);
+    VIR_FREE(tmp);
+    return -1;
+}
+
+
 int virNetMessageEncodePayloadEmpty(virNetMessagePtr msg)
 {
     XDR xdr;
@@ -489,6 +724,43 @@ error:
 }
 
 
+/*
+ * @msg: the outgoing message
+ * @iov: array of at least 2 elements to fill in
+ *
+ * Describes the part of the message still to be sent, starting
+ * at bufferOffset, so it can be written with a single gathering
+ * write. Any payload attached by virNetMessageEncodePayloadRef
+ * follows the encoded header.
+ *
+ * returns the number of elements filled in @iov
+ */
+size_t virNetMessageGetIOV(virNetMessagePtr msg,
+                           struct iovec *iov)
+{
+    size_t headLength = msg->bufferLength - msg->payloadLength;
+    size_t niov = 0;
+
+    if (msg->bufferOffset < headLength) {
+        iov[niov].iov_base = msg->buffer + msg->bufferOffset;
+        iov[niov].iov_len = headLength - msg->bufferOffset;
+        niov++;
+        if (msg->payloadLength) {
+            iov[niov].iov_base = (char *)msg->payload;
+            iov[niov].iov_len = msg->payloadLength;
+            niov++;
+        }
+    } else if (msg->bufferOffset < msg->bufferLength) {
+        iov[niov].iov_base = (char *)msg->payload +
+            (msg->bufferOffset - headLength);
+        iov[niov].iov_len = msg->bufferLength - msg->bufferOffset;
+        niov++;
+    }
+
+    return niov;
+}
+
+
 void virNetMessageSaveError(virNetMessageErrorPtr rerr)
 {
     /* This func may be called several times & the first
@@ -21,6 +21,8 @@
 #ifndef __VIR_NET_MESSAGE_H__
 # define __VIR_NET_MESSAGE_H__
 
+# include <sys/uio.h>
+
 # include "virnetprotocol.h"
 
 typedef struct virNetMessageHeader *virNetMessageHeaderPtr;
@@ -38,6 +40,14 @@ struct _virNetMessage {
                   /* Maximum   VIR_NET_MESSAGE_MAX     + VIR_NET_MESSAGE_LEN_MAX */
     size_t bufferLength;
     size_t bufferOffset;
+    size_t bufferSize; /* Allocated size of buffer, >= bufferLength */
+
+    /* Stream data sent straight after the encoded header instead
+     * of being copied into buffer. When set, bufferLength covers
+     * the header and payloadLength bytes of payload */
+    const char *payload;
+    size_t payloadLength;
+    char *payloadOwned; /* Freed with the message, if non-NULL */
 
     virNetMessageHeader header;
 
@@ -58,6 +68,11 @@ void virNetMessageClear(virNetMessagePtr);
 
 void virNetMessageFree(virNetMessagePtr msg);
 
+int virNetMessageReserveBuffer(virNetMessagePtr msg, size_t len)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
+void virNetMessageReleaseBuffer(virNetMessagePtr msg)
+    ATTRIBUTE_NONNULL(1);
+
 virNetMessagePtr virNetMessageQueueServe(virNetMessagePtr *queue)
     ATTRIBUTE_NONNULL(1);
 void virNetMessageQueuePush(virNetMessagePtr *queue,
@@ -87,9 +102,18 @@ int virNetMessageEncodePayloadRaw(virNetMessagePtr msg,
                                   const char *buf,
                                   size_t len)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
+int virNetMessageEncodePayloadRef(virNetMessagePtr msg,
+                                  const char *data,
+                                  size_t len,
+                                  bool owned)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
 int virNetMessageEncodePayloadEmpty(virNetMessagePtr msg)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
 
+size_t virNetMessageGetIOV(virNetMessagePtr msg,
+                           struct iovec *iov)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
 void virNetMessageSaveError(virNetMessageErrorPtr rerr)
     ATTRIBUTE_NONNULL(1);
 
@@ -100,6 +100,9 @@ const VIR_NET_MESSAGE_NUM_FDS_MAX = 32;
  *  - type == VIR_NET_STREAM
  *      * serial matches that from the corresponding VIR_NET_CALL
  *
+ *  - type == VIR_NET_STREAM_HOLE
+ *      * serial matches that from the corresponding VIR_NET_CALL
+ *
  * and the 'status' field varies according to:
  *
  *  - type == VIR_NET_CALL
@@ -117,6 +120,9 @@ const VIR_NET_MESSAGE_NUM_FDS_MAX = 32;
  *     * VIR_NET_OK if stream is complete
  *     * VIR_NET_ERROR if stream had an error
  *
+ *  - type == VIR_NET_STREAM_HOLE
+ *     * VIR_NET_CONTINUE always
+ *
  * Payload varies according to type and status:
  *
  *  - type == VIR_NET_CALL
@@ -140,6 +146,10 @@ const VIR_NET_MESSAGE_NUM_FDS_MAX = 32;
  *     * status == VIR_NET_OK
  *          <empty>
  *
+ *  - type == VIR_NET_STREAM_HOLE
+ *     * status == VIR_NET_CONTINUE
+ *          virNetStreamHole  size of the hole to skip
+ *
  *  - type == VIR_NET_CALL_WITH_FDS
  *          int8 - number of FDs
  *          XXX_args  for procedure
@@ -164,7 +174,9 @@ enum virNetMessageType {
     /* client -> server. args from a method call, with passed FDs */
     VIR_NET_CALL_WITH_FDS = 4,
     /* server -> client. reply/error from a method call, with passed FDs */
-    VIR_NET_REPLY_WITH_FDS = 5
+    VIR_NET_REPLY_WITH_FDS = 5,
+    /* either direction. hole in a sparse stream */
+    VIR_NET_STREAM_HOLE = 6
 };
 
 enum virNetMessageStatus {
@@ -244,3 +256,11 @@ struct virNetMessageError {
     int int2;
     virNetMessageNetwork net; /* unused */
 };
+
+/* Skipped region of a sparse stream, sent as a VIR_NET_STREAM_HOLE
+ * message in place of that many bytes of zeroes.
+ */
+struct virNetStreamHole {
+    hyper length;
+    unsigned int flags;
+};
@@ -38,6 +38,9 @@
 #include "virnetservermdns.h"
 #include "virdbus.h"
 #include "virstring.h"
+#include "virtime.h"
+#include "virtypedparam.h"
+#include "virbuffer.h"
 
 #ifndef SA_SIGINFO
 # define SA_SIGINFO 0
@@ -62,6 +65,8 @@ struct _virNetServerJob {
     virNetServerClientPtr client;
     virNetMessagePtr msg;
     virNetServerProgramPtr prog;
+    int procedure;
+    unsigned long long queued; /* microseconds */
 };
 
 struct _virNetServer {
@@ -179,11 +184,29 @@ static void virNetServerHandleJob(void *jobOpaque, void *opaque)
 {
     virNetServerPtr srv = opaque;
     virNetServerJobPtr job = jobOpaque;
+    unsigned long long start = 0;
+    unsigned long long end = 0;
+    int ret;
 
     VIR_DEBUG("server=%p client=%p message=%p prog=%p",
               srv, job->client, job->msg, job->prog);
 
-    if (virNetServerProcessMsg(srv, job->client, job->prog, job->msg) < 0)
+    if (job->prog) {
+        ignore_value(virTimeMicrosNowRaw(&start));
+        virNetServerProgramJobStarted(job->prog, job->procedure,
+                                      start > job->queued ?
+                                      start - job->queued : 0);
+    }
+
+    ret = virNetServerProcessMsg(srv, job->client, job->prog, job->msg);
+
+    if (job->prog) {
+        ignore_value(virTimeMicrosNowRaw(&end));
+        virNetServerProgramJobFinished(job->prog, job->procedure,
+                                       end > start ? end - start : 0);
+    }
+
+    if (ret < 0)
         goto error;
 
     virObjectUnref(job->prog);
@@ -232,12 +255,17 @@ static int virNetServerDispatchNewMessage(virNetServerClientPtr client,
         if (prog) {
             virObjectRef(prog);
             job->prog = prog;
+            job->procedure = msg->header.proc;
             priority = virNetServerProgramGetPriority(prog, msg->header.proc);
+            ignore_value(virTimeMicrosNowRaw(&job->queued));
+            virNetServerProgramJobQueued(prog, job->procedure);
         }
 
         ret = virThreadPoolSendJob(srv->workers, priority, job);
 
         if (ret < 0) {
+            if (prog)
+                virNetServerProgramJobStarted(prog, job->procedure, 0);
             VIR_FREE(job);
             virObjectUnref(prog);
         }
@@ -1223,6 +1251,226 @@ void virNetServerClose(virNetServerPtr srv)
     virObjectUnlock(srv);
 }
 
+/*
+ * Fill @params with statistics about the worker pool and the
+ * procedures of every registered program (see
+ * virNetServerProgramGetStats for the latter)
+ *
+ * Returns 0 on success, -1 on error
+ */
+int virNetServerGetStats(virNetServerPtr srv,
+                         virTypedParameterPtr *params,
+                         int *nparams)
+{
+    virTypedParameterPtr par = NULL;
+    int npar = 0;
+    int maxpar = 0;
+    size_t i;
+    int ret = -1;
+
+    virObjectLock(srv);
+
+    if (srv->workers) {
+        if (virTypedParamsAddUInt(&par, &npar, &maxpar, "workers.min",
+                                  virThreadPoolGetMinWorkers(srv->workers)) < 0 ||
+            virTypedParamsAddUInt(&par, &npar, &maxpar, "workers.max",
+                                  virThreadPoolGetMaxWorkers(srv->workers)) < 0 ||
+            virTypedParamsAddUInt(&par, &npar, &maxpar, "workers.priority",
+                                  virThreadPoolGetPriorityWorkers(srv->workers)) < 0 ||
+            virTypedParamsAddUInt(&par, &npar, &maxpar, "workers.current",
+                                  virThreadPoolGetCurrentWorkers(srv->workers)) < 0 ||
+            virTypedParamsAddUInt(&par, &npar, &maxpar, "workers.free",
+                                  virThreadPoolGetFreeWorkers(srv->workers)) < 0 ||
+            virTypedParamsAddUInt(&par, &npar, &maxpar, "jobs.queued",
+                                  virThreadPoolGetJobQueueDepth(srv->workers)) < 0)
+            goto cleanup;
+    }
+
+    for (i = 0; i < srv->nprograms; i++) {
+        if (virNetServerProgramGetStats(srv->programs[i],
+                                        &par, &npar, &maxpar) < 0)
+            goto cleanup;
+    }
+
+    *params = par;
+    *nparams = npar;
+    par = NULL;
+    npar = 0;
+    ret = 0;
+
+cleanup:
+    virObjectUnlock(srv);
+    virTypedParamsFree(par, npar);
+    return ret;
+}
+
+typedef struct _virNetServerProcStats virNetServerProcStats;
+typedef virNetServerProcStats *virNetServerProcStatsPtr;
+
+struct _virNetServerProcStats {
+    virNetServerProgramPtr prog;
+    int procedure;
+    virNetServerProgramProcStats stats;
+};
+
+static void
+virNetServerFormatLabels(virBufferPtr buf,
+                         virNetServerProcStatsPtr proc)
+{
+    const char *name = virNetServerProgramGetProcName(proc->prog,
+                                                      proc->procedure);
+
+    virBufferAsprintf(buf, "{program=\"%x\",procedure=\"",
+                      virNetServerProgramGetID(proc->prog));
+    if (name)
+        virBufferAdd(buf, name, -1);
+    else
+        virBufferAsprintf(buf, "%d", proc->procedure);
+    virBufferAddChar(buf, '"');
+}
+
+static void
+virNetServerFormatSeconds(virBufferPtr buf,
+                          unsigned long long us)
+{
+    virBufferAsprintf(buf, "%llu.%06llu", us / 1000000, us % 1000000);
+}
+
+/*
+ * Format the statistics of virNetServerGetStats in the Prometheus
+ * text exposition format, with times in seconds
+ *
+ * Returns the text, or NULL on error
+ */
+char *virNetServerFormatStats(virNetServerPtr srv)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virNetServerProcStatsPtr procs = NULL;
+    size_t nprocs = 0;
+    size_t i;
+    size_t j;
+
+    virObjectLock(srv);
+
+    for (i = 0; i < srv->nprograms; i++)
+        nprocs += virNetServerProgramGetNProcs(srv->programs[i]);
+
+    if (VIR_ALLOC_N(procs, nprocs) < 0) {
+        virObjectUnlock(srv);
+        return NULL;
+    }
+
+    /* Take a snapshot first, as each family is listed in one go */
+    nprocs = 0;
+    for (i = 0; i < srv->nprograms; i++) {
+        virNetServerProgramPtr prog = srv->programs[i];
+
+        for (j = 0; j < virNetServerProgramGetNProcs(prog); j++) {
+            if (!virNetServerProgramGetProcStats(prog, j,
+                                                 &procs[nprocs].stats))
+                continue;
+            procs[nprocs].prog = virObjectRef(prog);
+            procs[nprocs].procedure = j;
+            nprocs++;
+        }
+    }
+
+    if (srv->workers) {
+        virBufferAddLit(&buf,
+                        "# HELP libvirtd_rpc_workers Number of RPC worker threads.\n"
+                        "# TYPE libvirtd_rpc_workers gauge\n");
+        virBufferAsprintf(&buf, "libvirtd_rpc_workers{state=\"current\"} %zu\n",
+                          virThreadPoolGetCurrentWorkers(srv->workers));
+        virBufferAsprintf(&buf, "libvirtd_rpc_workers{state=\"free\"} %zu\n",
+                          virThreadPoolGetFreeWorkers(srv->workers));
+        virBufferAsprintf(&buf, "libvirtd_rpc_workers{state=\"max\"} %zu\n",
+                          virThreadPoolGetMaxWorkers(srv->workers));
+        virBufferAddLit(&buf,
+                        "# HELP libvirtd_rpc_jobs_queued Number of RPC calls waiting for a worker.\n"
+                        "# TYPE libvirtd_rpc_jobs_queued gauge\n");
+        virBufferAsprintf(&buf, "libvirtd_rpc_jobs_queued %zu\n",
+                          virThreadPoolGetJobQueueDepth(srv->workers));
+    }
+
+    virObjectUnlock(srv);
+
+#define FORMAT_FAMILY(family, type, help, field)                        \
+    virBufferAddLit(&buf,                                               \
+                    "# HELP libvirtd_rpc_" family " " help "\n"         \
+                    "# TYPE libvirtd_rpc_" family " " type "\n");       \
+    for (i = 0; i < nprocs; i++) {                                      \
+        virBufferAddLit(&buf, "libvirtd_rpc_" family);                  \
+        virNetServerFormatLabels(&buf, &procs[i]);                      \
+        virBufferAsprintf(&buf, "} %llu\n", procs[i].stats.field);      \
+    }
+
+    FORMAT_FAMILY("calls_total", "counter",
+                  "Number of completed RPC calls.", calls);
+    FORMAT_FAMILY("errors_total", "counter",
+                  "Number of RPC calls which failed.", errors);
+    FORMAT_FAMILY("queued_calls", "gauge",
+                  "Number of RPC calls waiting for a worker.", queued);
+    FORMAT_FAMILY("received_bytes_total", "counter",
+                  "Total size of RPC requests.", bytesIn);
+    FORMAT_FAMILY("sent_bytes_total", "counter",
+                  "Total size of RPC replies.", bytesOut);
+
+#undef FORMAT_FAMILY
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirtd_rpc_wait_seconds_total Time RPC calls spent waiting for a worker.\n"
+                    "# TYPE libvirtd_rpc_wait_seconds_total counter\n");
+    for (i = 0; i < nprocs; i++) {
+        virBufferAddLit(&buf, "libvirtd_rpc_wait_seconds_total");
+        virNetServerFormatLabels(&buf, &procs[i]);
+        virBufferAddLit(&buf, "} ");
+        virNetServerFormatSeconds(&buf, procs[i].stats.waitTime);
+        virBufferAddChar(&buf, '\n');
+    }
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirtd_rpc_service_seconds Time RPC calls took to process.\n"
+                    "# TYPE libvirtd_rpc_service_seconds histogram\n");
+    for (i = 0; i < nprocs; i++) {
+        unsigned long long count = 0;
+
+        for (j = 0; j < VIR_NET_SERVER_PROGRAM_HIST_BUCKETS - 1; j++) {
+            count += procs[i].stats.hist[j];
+            virBufferAddLit(&buf, "libvirtd_rpc_service_seconds_bucket");
+            virNetServerFormatLabels(&buf, &procs[i]);
+            virBufferAddLit(&buf, ",le=\"");
+            virNetServerFormatSeconds(&buf, VIR_NET_SERVER_PROGRAM_HIST_BOUND(j));
+            virBufferAsprintf(&buf, "\"} %llu\n", count);
+        }
+        count += procs[i].stats.hist[j];
+        virBufferAddLit(&buf, "libvirtd_rpc_service_seconds_bucket");
+        virNetServerFormatLabels(&buf, &procs[i]);
+        virBufferAsprintf(&buf, ",le=\"+Inf\"} %llu\n", count);
+
+        virBufferAddLit(&buf, "libvirtd_rpc_service_seconds_sum");
+        virNetServerFormatLabels(&buf, &procs[i]);
+        virBufferAddLit(&buf, "} ");
+        virNetServerFormatSeconds(&buf, procs[i].stats.serviceTime);
+        virBufferAddChar(&buf, '\n');
+
+        virBufferAddLit(&buf, "libvirtd_rpc_service_seconds_count");
+        virNetServerFormatLabels(&buf, &procs[i]);
+        virBufferAsprintf(&buf, "} %llu\n", count);
+    }
+
+    for (i = 0; i < nprocs; i++)
+        virObjectUnref(procs[i].prog);
+    VIR_FREE(procs);
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return NULL;
+    }
+
+    return virBufferContentAndReset(&buf);
+}
+
 bool virNetServerKeepAliveRequired(virNetServerPtr srv)
 {
     bool required;
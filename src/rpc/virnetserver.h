@@ -97,4 +97,10 @@ void virNetServerClose(virNetServerPtr srv);
 
 bool virNetServerKeepAliveRequired(virNetServerPtr srv);
 
+int virNetServerGetStats(virNetServerPtr srv,
+                         virTypedParameterPtr *params,
+                         int *nparams);
+
+char *virNetServerFormatStats(virNetServerPtr srv);
+
 #endif
@@ -313,7 +313,7 @@ virNetServerClientCheckAccess(virNetServerClientPtr client)
      * (NB. The '\1' byte is sent in an encrypted record).
      */
     confirm->bufferLength = 1;
-    if (VIR_ALLOC_N(confirm->buffer, confirm->bufferLength) < 0) {
+    if (virNetMessageReserveBuffer(confirm, confirm->bufferLength) < 0) {
         virNetMessageFree(confirm);
         return -1;
     }
@@ -375,7 +375,7 @@ virNetServerClientNewInternal(virNetSocketPtr sock,
     if (!(client->rx = virNetMessageNew(true)))
         goto error;
     client->rx->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
-    if (VIR_ALLOC_N(client->rx->buffer, client->rx->bufferLength) < 0)
+    if (virNetMessageReserveBuffer(client->rx, client->rx->bufferLength) < 0)
         goto error;
     client->nrequests = 1;
 
@@ -1232,8 +1232,8 @@ readmore:
                 client->wantClose = true;
             } else {
                 client->rx->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
-                if (VIR_ALLOC_N(client->rx->buffer,
-                                client->rx->bufferLength) < 0) {
+                if (virNetMessageReserveBuffer(client->rx,
+                                               client->rx->bufferLength) < 0) {
                     client->wantClose = true;
                 } else {
                     client->nrequests++;
@@ -1255,6 +1255,8 @@ readmore:
  */
 static ssize_t virNetServerClientWrite(virNetServerClientPtr client)
 {
+    struct iovec iov[2];
+    size_t niov;
     ssize_t ret;
 
     if (client->tx->bufferLength < client->tx->bufferOffset) {
@@ -1268,9 +1270,8 @@ static ssize_t virNetServerClientWrite(virNetServerClientPtr client)
     if (client->tx->bufferLength == client->tx->bufferOffset)
         return 1;
 
-    ret = virNetSocketWrite(client->sock,
-                            client->tx->buffer + client->tx->bufferOffset,
-                            client->tx->bufferLength - client->tx->bufferOffset);
+    niov = virNetMessageGetIOV(client->tx, iov);
+    ret = virNetSocketWritev(client->sock, iov, niov);
     if (ret <= 0)
         return ret; /* -1 error, 0 = egain */
 
@@ -1335,7 +1336,7 @@ virNetServerClientDispatchWrite(virNetServerClientPtr client)
                     /* Ready to recv more messages */
                     virNetMessageClear(msg);
                     msg->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
-                    if (VIR_ALLOC_N(msg->buffer, msg->bufferLength) < 0) {
+                    if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0) {
                         virNetMessageFree(msg);
                         return;
                     }
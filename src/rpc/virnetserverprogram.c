@@ -30,10 +30,42 @@
 #include "virerror.h"
 #include "virlog.h"
 #include "virfile.h"
+#include "viratomic.h"
 #include "virthread.h"
+#include "intprops.h"
+#include "virthreadpool.h"
+#include "virtypedparam.h"
 
 #define VIR_FROM_THIS VIR_FROM_RPC
 
+/* A procedure averaging less than this many microseconds per call,
+ * once we've seen enough calls, is dispatched in the fast lane */
+#define VIR_NET_SERVER_PROGRAM_FAST_LIMIT 2000
+#define VIR_NET_SERVER_PROGRAM_FAST_SAMPLES 8
+
+/* Calls are accounted in one of several shards, each thread sticking
+ * to the one it was handed first, so that workers finishing calls at
+ * the same time rarely contend. Readers add the shards up. */
+#define VIR_NET_SERVER_PROGRAM_STATS_SHARDS 8
+
+typedef struct _virNetServerProgramStatsShard virNetServerProgramStatsShard;
+typedef virNetServerProgramStatsShard *virNetServerProgramStatsShardPtr;
+
+struct _virNetServerProgramStatsShard {
+    virMutex lock;
+    virNetServerProgramProcStatsPtr stats; /* one per procedure */
+};
+
+/* What the dispatcher needs to route calls, updated atomically */
+typedef struct _virNetServerProgramProcState virNetServerProgramProcState;
+typedef virNetServerProgramProcState *virNetServerProgramProcStatePtr;
+
+struct _virNetServerProgramProcState {
+    int queued;         /* calls currently waiting for a worker */
+    int samples;        /* calls seen, up to FAST_SAMPLES */
+    int avgServiceTime; /* moving average, in microseconds */
+};
+
 struct _virNetServerProgram {
     virObject object;
 
@@ -41,12 +73,19 @@ struct _virNetServerProgram {
     unsigned version;
     virNetServerProgramProcPtr procs;
     size_t nprocs;
+
+    virNetServerProgramProcStatePtr state;
+    virNetServerProgramStatsShard shards[VIR_NET_SERVER_PROGRAM_STATS_SHARDS];
 };
 
 
 static virClassPtr virNetServerProgramClass;
 static void virNetServerProgramDispose(void *obj);
 
+/* Index + 1 of the stats shard the current thread uses */
+static virThreadLocal virNetServerProgramShard;
+static int virNetServerProgramLastShard;
+
 static int virNetServerProgramOnceInit(void)
 {
     if (!(virNetServerProgramClass = virClassNew(virClassForObject(),
@@ -55,6 +94,12 @@ static int virNetServerProgramOnceInit(void)
                                                  virNetServerProgramDispose)))
         return -1;
 
+    if (virThreadLocalInit(&virNetServerProgramShard, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize thread local variable"));
+        return -1;
+    }
+
     return 0;
 }
 
@@ -67,6 +112,7 @@ virNetServerProgramPtr virNetServerProgramNew(unsigned program,
                                               size_t nprocs)
 {
     virNetServerProgramPtr prog;
+    size_t i;
 
     if (virNetServerProgramInitialize() < 0)
         return NULL;
@@ -79,9 +125,29 @@ virNetServerProgramPtr virNetServerProgramNew(unsigned program,
     prog->procs = procs;
     prog->nprocs = nprocs;
 
+    if (VIR_ALLOC_N(prog->state, nprocs) < 0)
+        goto error;
+
+    for (i = 0; i < VIR_NET_SERVER_PROGRAM_STATS_SHARDS; i++) {
+        if (virMutexInit(&prog->shards[i].lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("cannot initialize mutex"));
+            goto error;
+        }
+        /* Only shards with their lock initialized have stats */
+        if (VIR_ALLOC_N(prog->shards[i].stats, nprocs) < 0) {
+            virMutexDestroy(&prog->shards[i].lock);
+            goto error;
+        }
+    }
+
     VIR_DEBUG("prog=%p", prog);
 
     return prog;
+
+error:
+    virObjectUnref(prog);
+    return NULL;
 }
 
 
@@ -125,16 +191,302 @@ static virNetServerProgramProcPtr virNetServerProgramGetProc(virNetServerProgram
     return proc;
 }
 
+/*
+ * Returns the virThreadPoolJobLane to dispatch @procedure in.
+ * Procedures annotated as high priority go to the priority lane.
+ * Others are classified by their measured cost: those which have
+ * proven cheap go to the fast lane, so they don't queue behind slow
+ * calls. The classification follows the moving average, so a
+ * procedure which gets slow falls back to the normal lane.
+ */
 unsigned int
 virNetServerProgramGetPriority(virNetServerProgramPtr prog,
                                int procedure)
 {
     virNetServerProgramProcPtr proc = virNetServerProgramGetProc(prog, procedure);
+    virNetServerProgramProcStatePtr state;
 
     if (!proc)
-        return 0;
+        return VIR_THREAD_POOL_JOB_NORMAL;
+
+    if (proc->priority)
+        return VIR_THREAD_POOL_JOB_PRIORITY;
+
+    state = &prog->state[procedure];
+    if (virAtomicIntGet(&state->samples) >= VIR_NET_SERVER_PROGRAM_FAST_SAMPLES &&
+        virAtomicIntGet(&state->avgServiceTime) < VIR_NET_SERVER_PROGRAM_FAST_LIMIT)
+        return VIR_THREAD_POOL_JOB_FAST;
+
+    return VIR_THREAD_POOL_JOB_NORMAL;
+}
+
+
+/*
+ * Returns the stats shard of the calling thread locked, or NULL
+ * if @procedure doesn't exist
+ */
+static virNetServerProgramProcStatsPtr
+virNetServerProgramLockStats(virNetServerProgramPtr prog,
+                             int procedure,
+                             virNetServerProgramStatsShardPtr *shard)
+{
+    size_t idx;
+
+    if (procedure < 0 || procedure >= prog->nprocs)
+        return NULL;
 
-    return proc->priority;
+    if (!(idx = (size_t)virThreadLocalGet(&virNetServerProgramShard))) {
+        idx = virAtomicIntInc(&virNetServerProgramLastShard);
+        idx = idx % VIR_NET_SERVER_PROGRAM_STATS_SHARDS + 1;
+        /* Without it we just pick a shard again next time */
+        ignore_value(virThreadLocalSet(&virNetServerProgramShard,
+                                       (void *)idx));
+    }
+
+    *shard = &prog->shards[idx - 1];
+    virMutexLock(&(*shard)->lock);
+    return &(*shard)->stats[procedure];
+}
+
+
+/*
+ * Account a call to @procedure being queued for a worker
+ */
+void
+virNetServerProgramJobQueued(virNetServerProgramPtr prog,
+                             int procedure)
+{
+    if (procedure < 0 || procedure >= prog->nprocs)
+        return;
+
+    virAtomicIntInc(&prog->state[procedure].queued);
+}
+
+
+/*
+ * Account a call to @procedure being picked up by a worker after
+ * waiting @waitTime microseconds in the queue
+ */
+void
+virNetServerProgramJobStarted(virNetServerProgramPtr prog,
+                              int procedure,
+                              unsigned long long waitTime)
+{
+    virNetServerProgramStatsShardPtr shard;
+    virNetServerProgramProcStatsPtr stats;
+
+    if (!(stats = virNetServerProgramLockStats(prog, procedure, &shard)))
+        return;
+
+    stats->waitTime += waitTime;
+    virMutexUnlock(&shard->lock);
+
+    ignore_value(virAtomicIntDecAndTest(&prog->state[procedure].queued));
+}
+
+
+/*
+ * Account a call to @procedure having taken @serviceTime
+ * microseconds to process
+ */
+void
+virNetServerProgramJobFinished(virNetServerProgramPtr prog,
+                               int procedure,
+                               unsigned long long serviceTime)
+{
+    virNetServerProgramStatsShardPtr shard;
+    virNetServerProgramProcStatsPtr stats;
+    virNetServerProgramProcStatePtr state;
+    size_t bucket = 0;
+    int avg;
+    int sample = MIN(serviceTime, INT_MAX);
+
+    if (!(stats = virNetServerProgramLockStats(prog, procedure, &shard)))
+        return;
+
+    while (bucket < VIR_NET_SERVER_PROGRAM_HIST_BUCKETS - 1 &&
+           serviceTime > VIR_NET_SERVER_PROGRAM_HIST_BOUND(bucket))
+        bucket++;
+
+    stats->calls++;
+    stats->serviceTime += serviceTime;
+    stats->hist[bucket]++;
+    virMutexUnlock(&shard->lock);
+
+    /* A racing update may get lost, which the average can live with */
+    state = &prog->state[procedure];
+    if (virAtomicIntGet(&state->samples) == 0) {
+        virAtomicIntSet(&state->avgServiceTime, sample);
+    } else {
+        avg = virAtomicIntGet(&state->avgServiceTime);
+        virAtomicIntSet(&state->avgServiceTime,
+                        ((long long)avg * 7 + sample) / 8);
+    }
+    if (virAtomicIntGet(&state->samples) < VIR_NET_SERVER_PROGRAM_FAST_SAMPLES)
+        virAtomicIntInc(&state->samples);
+}
+
+
+/*
+ * Account the outcome of a call to @procedure, whose request was
+ * @bytesIn long and reply @bytesOut long
+ */
+static void
+virNetServerProgramCallDone(virNetServerProgramPtr prog,
+                            int procedure,
+                            bool failed,
+                            size_t bytesIn,
+                            size_t bytesOut)
+{
+    virNetServerProgramStatsShardPtr shard;
+    virNetServerProgramProcStatsPtr stats;
+
+    if (!(stats = virNetServerProgramLockStats(prog, procedure, &shard)))
+        return;
+
+    if (failed)
+        stats->errors++;
+    stats->bytesIn += bytesIn;
+    stats->bytesOut += bytesOut;
+    virMutexUnlock(&shard->lock);
+}
+
+
+size_t
+virNetServerProgramGetNProcs(virNetServerProgramPtr prog)
+{
+    return prog->nprocs;
+}
+
+
+/*
+ * Returns the name of @procedure, or NULL if it has none
+ */
+const char *
+virNetServerProgramGetProcName(virNetServerProgramPtr prog,
+                               int procedure)
+{
+    virNetServerProgramProcPtr proc = virNetServerProgramGetProc(prog, procedure);
+
+    return proc ? proc->name : NULL;
+}
+
+
+/*
+ * Fill @stats with the statistics of @procedure, adding up all
+ * the shards.
+ *
+ * Returns true if @procedure was called at least once or has
+ * calls waiting, false otherwise
+ */
+bool
+virNetServerProgramGetProcStats(virNetServerProgramPtr prog,
+                                int procedure,
+                                virNetServerProgramProcStatsPtr stats)
+{
+    size_t i;
+    size_t j;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (procedure < 0 || procedure >= prog->nprocs)
+        return false;
+
+    for (i = 0; i < VIR_NET_SERVER_PROGRAM_STATS_SHARDS; i++) {
+        virNetServerProgramStatsShardPtr shard = &prog->shards[i];
+        virNetServerProgramProcStatsPtr tmp = &shard->stats[procedure];
+
+        virMutexLock(&shard->lock);
+        stats->calls += tmp->calls;
+        stats->errors += tmp->errors;
+        stats->waitTime += tmp->waitTime;
+        stats->serviceTime += tmp->serviceTime;
+        stats->bytesIn += tmp->bytesIn;
+        stats->bytesOut += tmp->bytesOut;
+        for (j = 0; j < VIR_NET_SERVER_PROGRAM_HIST_BUCKETS; j++)
+            stats->hist[j] += tmp->hist[j];
+        virMutexUnlock(&shard->lock);
+    }
+
+    stats->queued = MAX(virAtomicIntGet(&prog->state[procedure].queued), 0);
+
+    return stats->calls || stats->queued;
+}
+
+
+/*
+ * Append per procedure statistics of @prog to @params, for every
+ * procedure which has been called at least once. The fields are
+ * named "rpc.<program>.<procedure>.<stat>", with procedure being
+ * the name, or number if it has none, and stat being:
+ *
+ *   calls      - number of completed calls
+ *   errors     - number of calls which failed
+ *   queued     - number of calls waiting for a worker
+ *   wait       - total time calls spent queued, in microseconds
+ *   service    - total time calls took to process, in microseconds
+ *   bytes_in   - total size of requests
+ *   bytes_out  - total size of replies
+ *   lane       - virThreadPoolJobLane the next call will go to
+ *   hist.<N>   - number of calls processed in at most N microseconds,
+ *                but more than the bound of the previous bucket
+ *   hist.inf   - number of calls slower than any bucket
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+virNetServerProgramGetStats(virNetServerProgramPtr prog,
+                            virTypedParameterPtr *params,
+                            int *nparams,
+                            int *maxparams)
+{
+    virNetServerProgramProcStats stats;
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    char procnum[INT_BUFSIZE_BOUND(size_t)];
+    char bucket[32];
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < prog->nprocs; i++) {
+        const char *name;
+        unsigned int lane;
+
+        if (!virNetServerProgramGetProcStats(prog, i, &stats))
+            continue;
+
+        lane = virNetServerProgramGetPriority(prog, i);
+
+        if (!(name = virNetServerProgramGetProcName(prog, i))) {
+            snprintf(procnum, sizeof(procnum), "%zu", i);
+            name = procnum;
+        }
+
+#define ADD_STAT(stat, value)                                           \
+        snprintf(field, sizeof(field), "rpc.%x.%s.%s",                  \
+                 prog->program, name, stat);                            \
+        if (virTypedParamsAddULLong(params, nparams, maxparams,         \
+                                    field, value) < 0)                  \
+            return -1
+
+        ADD_STAT("calls", stats.calls);
+        ADD_STAT("errors", stats.errors);
+        ADD_STAT("queued", stats.queued);
+        ADD_STAT("wait", stats.waitTime);
+        ADD_STAT("service", stats.serviceTime);
+        ADD_STAT("bytes_in", stats.bytesIn);
+        ADD_STAT("bytes_out", stats.bytesOut);
+        ADD_STAT("lane", lane);
+        for (j = 0; j < VIR_NET_SERVER_PROGRAM_HIST_BUCKETS - 1; j++) {
+            snprintf(bucket, sizeof(bucket), "hist.%llu",
+                     VIR_NET_SERVER_PROGRAM_HIST_BOUND(j));
+            ADD_STAT(bucket, stats.hist[j]);
+        }
+        ADD_STAT("hist.inf", stats.hist[j]);
+
+#undef ADD_STAT
+    }
+
+    return 0;
 }
 
 static int
@@ -145,7 +497,8 @@ virNetServerProgramSendError(unsigned program,
                              virNetMessageErrorPtr rerr,
                              int procedure,
                              int type,
-                             int serial)
+                             int serial,
+                             size_t *replyLen)
 {
     VIR_DEBUG("prog=%d ver=%d proc=%d type=%d serial=%d msg=%p rerr=%p",
               program, version, procedure, type, serial, msg, rerr);
@@ -167,6 +520,9 @@ virNetServerProgramSendError(unsigned program,
         goto error;
     xdr_free((xdrproc_t)xdr_virNetMessageError, (void*)rerr);
 
+    if (replyLen)
+        *replyLen = msg->bufferLength;
+
     /* Put reply on end of tx queue to send out  */
     if (virNetServerClientSendMessage(client, msg) < 0)
         return -1;
@@ -206,7 +562,8 @@ virNetServerProgramSendReplyError(virNetServerProgramPtr prog,
                                         rerr,
                                         req->proc,
                                         req->type == VIR_NET_STREAM ? VIR_NET_STREAM : VIR_NET_REPLY,
-                                        req->serial);
+                                        req->serial,
+                                        NULL);
 }
 
 
@@ -224,7 +581,8 @@ int virNetServerProgramSendStreamError(virNetServerProgramPtr prog,
                                         rerr,
                                         procedure,
                                         VIR_NET_STREAM,
-                                        serial);
+                                        serial,
+                                        NULL);
 }
 
 
@@ -245,7 +603,8 @@ int virNetServerProgramUnknownError(virNetServerClientPtr client,
                                         &rerr,
                                         req->proc,
                                         VIR_NET_REPLY,
-                                        req->serial);
+                                        req->serial,
+                                        NULL);
 }
 
 
@@ -306,6 +665,7 @@ int virNetServerProgramDispatch(virNetServerProgramPtr prog,
         break;
 
     case VIR_NET_STREAM:
+    case VIR_NET_STREAM_HOLE:
         /* Since stream data is non-acked, async, we may continue to receive
          * stream packets after we closed down a stream. Just drop & ignore
          * these.
@@ -376,6 +736,9 @@ virNetServerProgramDispatchCall(virNetServerProgramPtr prog,
     virNetMessageError rerr;
     size_t i;
     virIdentityPtr identity = NULL;
+    int procedure = msg->header.proc;
+    size_t bytesIn = msg->bufferLength;
+    size_t bytesOut = 0;
 
     memset(&rerr, 0, sizeof(rerr));
 
@@ -488,13 +851,24 @@ virNetServerProgramDispatchCall(virNetServerProgramPtr prog,
     VIR_FREE(ret);
 
     virObjectUnref(identity);
+    virNetServerProgramCallDone(prog, procedure, false,
+                                bytesIn, msg->bufferLength);
     /* Put reply on end of tx queue to send out  */
     return virNetServerClientSendMessage(client, msg);
 
 error:
     /* Bad stuff (de-)serializing message, but we have an
      * RPC error message we can send back to the client */
-    rv = virNetServerProgramSendReplyError(prog, client, msg, &rerr, &msg->header);
+    rv = virNetServerProgramSendError(prog->program,
+                                      prog->version,
+                                      client,
+                                      msg,
+                                      &rerr,
+                                      procedure,
+                                      VIR_NET_REPLY,
+                                      msg->header.serial,
+                                      &bytesOut);
+    virNetServerProgramCallDone(prog, procedure, true, bytesIn, bytesOut);
 
     VIR_FREE(arg);
     VIR_FREE(ret);
@@ -504,15 +878,20 @@ error:
 }
 
 
-int virNetServerProgramSendStreamData(virNetServerProgramPtr prog,
-                                      virNetServerClientPtr client,
-                                      virNetMessagePtr msg,
-                                      int procedure,
-                                      int serial,
-                                      const char *data,
-                                      size_t len)
+static int
+virNetServerProgramSendStreamDataInternal(virNetServerProgramPtr prog,
+                                          virNetServerClientPtr client,
+                                          virNetMessagePtr msg,
+                                          int procedure,
+                                          int serial,
+                                          const char *data,
+                                          size_t len,
+                                          bool owned)
 {
-    VIR_DEBUG("client=%p msg=%p data=%p len=%zu", client, msg, data, len);
+    int ret = -1;
+
+    VIR_DEBUG("client=%p msg=%p data=%p len=%zu owned=%d",
+              client, msg, data, len, owned);
 
     /* Return header. We're reusing same message object, so
      * only need to tweak type/status fields */
@@ -530,22 +909,113 @@ int virNetServerProgramSendStreamData(virNetServerProgramPtr prog,
     msg->header.status = data ? VIR_NET_CONTINUE : VIR_NET_OK;
 
     if (virNetMessageEncodeHeader(msg) < 0)
-        return -1;
+        goto cleanup;
 
     if (data && len) {
-        if (virNetMessageEncodePayloadRaw(msg, data, len) < 0)
-            return -1;
+        if (owned) {
+            /* The message owns data from here on */
+            owned = false;
+            if (virNetMessageEncodePayloadRef(msg, data, len, true) < 0)
+                goto cleanup;
+        } else {
+            if (virNetMessageEncodePayloadRaw(msg, data, len) < 0)
+                goto cleanup;
+        }
 
     } else {
         if (virNetMessageEncodePayloadEmpty(msg) < 0)
-            return -1;
+            goto cleanup;
     }
     VIR_DEBUG("Total %zu", msg->bufferLength);
 
+    ret = virNetServerClientSendMessage(client, msg);
+
+cleanup:
+    if (owned)
+        VIR_FREE(data);
+    return ret;
+}
+
+
+int virNetServerProgramSendStreamData(virNetServerProgramPtr prog,
+                                      virNetServerClientPtr client,
+                                      virNetMessagePtr msg,
+                                      int procedure,
+                                      int serial,
+                                      const char *data,
+                                      size_t len)
+{
+    return virNetServerProgramSendStreamDataInternal(prog, client, msg,
+                                                     procedure, serial,
+                                                     data, len, false);
+}
+
+
+/*
+ * Like virNetServerProgramSendStreamData, but the message takes
+ * over @data and sends it without copying it first. @data is
+ * freed along with the message, or right away upon failure.
+ */
+int virNetServerProgramSendStreamBuffer(virNetServerProgramPtr prog,
+                                        virNetServerClientPtr client,
+                                        virNetMessagePtr msg,
+                                        int procedure,
+                                        int serial,
+                                        char *data,
+                                        size_t len)
+{
+    return virNetServerProgramSendStreamDataInternal(prog, client, msg,
+                                                     procedure, serial,
+                                                     data, len, true);
+}
+
+
+int virNetServerProgramSendStreamHole(virNetServerProgramPtr prog,
+                                      virNetServerClientPtr client,
+                                      virNetMessagePtr msg,
+                                      int procedure,
+                                      int serial,
+                                      long long length,
+                                      unsigned int flags)
+{
+    virNetStreamHole data;
+
+    VIR_DEBUG("client=%p msg=%p length=%lld flags=%x",
+              client, msg, length, flags);
+
+    memset(&data, 0, sizeof(data));
+    data.length = length;
+    data.flags = flags;
+
+    msg->header.prog = prog->program;
+    msg->header.vers = prog->version;
+    msg->header.proc = procedure;
+    msg->header.type = VIR_NET_STREAM_HOLE;
+    msg->header.serial = serial;
+    msg->header.status = VIR_NET_CONTINUE;
+
+    if (virNetMessageEncodeHeader(msg) < 0)
+        return -1;
+
+    if (virNetMessageEncodePayload(msg,
+                                   (xdrproc_t)xdr_virNetStreamHole,
+                                   &data) < 0)
+        return -1;
+
     return virNetServerClientSendMessage(client, msg);
 }
 
 
-void virNetServerProgramDispose(void *obj ATTRIBUTE_UNUSED)
+void virNetServerProgramDispose(void *obj)
 {
+    virNetServerProgramPtr prog = obj;
+    size_t i;
+
+    for (i = 0; i < VIR_NET_SERVER_PROGRAM_STATS_SHARDS; i++) {
+        if (!prog->shards[i].stats)
+            continue;
+        virMutexDestroy(&prog->shards[i].lock);
+        VIR_FREE(prog->shards[i].stats);
+    }
+    VIR_FREE(prog->state);
 }
@@ -55,6 +55,26 @@ struct _virNetServerProgramProc {
     xdrproc_t ret_filter;
     bool needAuth;
     unsigned int priority;
+    const char *name;
+};
+
+/* Service times are counted in buckets growing by a factor of four,
+ * the first one up to 16 microseconds, the last one unbounded */
+# define VIR_NET_SERVER_PROGRAM_HIST_BUCKETS 12
+# define VIR_NET_SERVER_PROGRAM_HIST_BOUND(bucket) (16ULL << (2 * (bucket)))
+
+typedef struct _virNetServerProgramProcStats virNetServerProgramProcStats;
+typedef virNetServerProgramProcStats *virNetServerProgramProcStatsPtr;
+
+struct _virNetServerProgramProcStats {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long queued;      /* currently waiting for a worker */
+    unsigned long long waitTime;    /* total, in microseconds */
+    unsigned long long serviceTime; /* total, in microseconds */
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long hist[VIR_NET_SERVER_PROGRAM_HIST_BUCKETS];
 };
 
 virNetServerProgramPtr virNetServerProgramNew(unsigned program,
@@ -68,6 +88,27 @@ int virNetServerProgramGetVersion(virNetServerProgramPtr prog);
 unsigned int virNetServerProgramGetPriority(virNetServerProgramPtr prog,
                                             int procedure);
 
+void virNetServerProgramJobQueued(virNetServerProgramPtr prog,
+                                  int procedure);
+void virNetServerProgramJobStarted(virNetServerProgramPtr prog,
+                                   int procedure,
+                                   unsigned long long waitTime);
+void virNetServerProgramJobFinished(virNetServerProgramPtr prog,
+                                    int procedure,
+                                    unsigned long long serviceTime);
+
+size_t virNetServerProgramGetNProcs(virNetServerProgramPtr prog);
+const char *virNetServerProgramGetProcName(virNetServerProgramPtr prog,
+                                           int procedure);
+bool virNetServerProgramGetProcStats(virNetServerProgramPtr prog,
+                                     int procedure,
+                                     virNetServerProgramProcStatsPtr stats);
+
+int virNetServerProgramGetStats(virNetServerProgramPtr prog,
+                                virTypedParameterPtr *params,
+                                int *nparams,
+                                int *maxparams);
+
 int virNetServerProgramMatches(virNetServerProgramPtr prog,
                                virNetMessagePtr msg);
 
@@ -101,4 +142,20 @@ int virNetServerProgramSendStreamData(virNetServerProgramPtr prog,
                                       const char *data,
                                       size_t len);
 
+int virNetServerProgramSendStreamBuffer(virNetServerProgramPtr prog,
+                                        virNetServerClientPtr client,
+                                        virNetMessagePtr msg,
+                                        int procedure,
+                                        int serial,
+                                        char *data,
+                                        size_t len);
+
+int virNetServerProgramSendStreamHole(virNetServerProgramPtr prog,
+                                      virNetServerClientPtr client,
+                                      virNetMessagePtr msg,
+                                      int procedure,
+                                      int serial,
+                                      long long length,
+                                      unsigned int flags);
+
 #endif /* __VIR_NET_SERVER_PROGRAM_H__ */
@@ -25,6 +25,7 @@
 
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -1424,6 +1425,37 @@ rewrite:
 }
 
 
+#ifdef HAVE_WRITEV
+static ssize_t virNetSocketWritevWire(virNetSocketPtr sock,
+                                      const struct iovec *iov,
+                                      size_t niov)
+{
+    ssize_t ret;
+
+rewrite:
+    ret = writev(sock->fd, iov, niov);
+
+    if (ret < 0) {
+        if (errno == EINTR)
+            goto rewrite;
+        if (errno == EAGAIN)
+            return 0;
+
+        virReportSystemError(errno, "%s",
+                             _("Cannot write data"));
+        return -1;
+    }
+    if (ret == 0) {
+        virReportSystemError(EIO, "%s",
+                             _("End of file while writing data"));
+        return -1;
+    }
+
+    return ret;
+}
+#endif
+
+
 #if WITH_SASL
 static ssize_t virNetSocketReadSASL(virNetSocketPtr sock, char *buf, size_t len)
 {
@@ -1551,6 +1583,51 @@ ssize_t virNetSocketWrite(virNetSocketPtr sock, const char *buf, size_t len)
 }
 
 
+
+/*
+ * Writes the data described by @iov. Only plain sockets gather
+ * all segments in a single syscall; with TLS, SASL or SSH in
+ * use just the first segment is written and the caller comes
+ * back for the rest.
+ */
+ssize_t virNetSocketWritev(virNetSocketPtr sock,
+                           const struct iovec *iov,
+                           size_t niov)
+{
+    ssize_t ret;
+#ifdef HAVE_WRITEV
+    bool gather = niov > 1;
+#endif
+
+    if (niov == 0)
+        return 0;
+
+    virObjectLock(sock);
+#ifdef HAVE_WRITEV
+# if WITH_GNUTLS
+    if (sock->tlsSession)
+        gather = false;
+# endif
+# if WITH_SSH2
+    if (sock->sshSession)
+        gather = false;
+# endif
+#endif
+#if WITH_SASL
+    if (sock->saslSession)
+        ret = virNetSocketWriteSASL(sock, iov[0].iov_base, iov[0].iov_len);
+    else
+#endif
+#ifdef HAVE_WRITEV
+    if (gather)
+        ret = virNetSocketWritevWire(sock, iov, niov);
+    else
+#endif
+        ret = virNetSocketWriteWire(sock, iov[0].iov_base, iov[0].iov_len);
+    virObjectUnlock(sock);
+    return ret;
+}
+
 /*
  * Returns 1 if an FD was sent, 0 if it would block, -1 on error
  */
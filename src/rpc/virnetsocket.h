@@ -24,6 +24,8 @@
 #ifndef __VIR_NET_SOCKET_H__
 # define __VIR_NET_SOCKET_H__
 
+# include <sys/uio.h>
+
 # include "virsocketaddr.h"
 # include "vircommand.h"
 # ifdef WITH_GNUTLS
@@ -124,6 +126,8 @@ int virNetSocketSetBlocking(virNetSocketPtr sock,
 
 ssize_t virNetSocketRead(virNetSocketPtr sock, char *buf, size_t len);
 ssize_t virNetSocketWrite(virNetSocketPtr sock, const char *buf, size_t len);
+ssize_t virNetSocketWritev(virNetSocketPtr sock, const struct iovec *iov,
+                           size_t niov);
 
 int virNetSocketSendFD(virNetSocketPtr sock, int fd);
 int virNetSocketRecvFD(virNetSocketPtr sock, int *fd);
@@ -55,6 +55,7 @@
 #include "virfile.h"
 #include "stat-time.h"
 #include "virstring.h"
+#include "virthread.h"
 
 #if WITH_STORAGE_LVM
 # include "storage_backend_logical.h"
@@ -123,6 +124,432 @@ enum {
 
 #define READ_BLOCK_SIZE_DEFAULT  (1024 * 1024)
 #define WRITE_BLOCK_SIZE_DEFAULT (4 * 1024)
+#define COPY_CHUNK_SIZE          (8 * 1024 * 1024)
+#define COPY_THREADS_DEFAULT     4
+#define COPY_ALIGN_MASK          (64 * 1024 - 1)
+
+static ssize_t
+virStorageBackendPRead(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t got = pread(fd, buf + done, count - done, offset + done);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            break;
+        done += got;
+    }
+
+    return done;
+}
+
+static int
+virStorageBackendPWrite(int fd, const char *buf, size_t count, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t got = pwrite(fd, buf + done, count - done, offset + done);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += got;
+    }
+
+    return 0;
+}
+
+/* Try to share the extents of the whole input with the new file, so
+ * that nothing needs copying at all. Returns 1 on success, 0 if the
+ * filesystem can't do it and -errno on error. */
+#if defined(__linux__) && defined(FICLONE)
+static int
+virStorageBackendCopyReflink(virStorageVolDefPtr vol,
+                             int inputfd,
+                             int fd)
+{
+    int err;
+
+    if (ioctl(fd, FICLONE, inputfd) == 0)
+        return 1;
+
+    err = errno;
+    switch (err) {
+    case EXDEV:
+    case EINVAL:
+    case EOPNOTSUPP:
+    case ENOTTY:
+    case ENOSYS:
+        VIR_DEBUG("cannot reflink into '%s', copying instead: %d",
+                  vol->target.path, err);
+        return 0;
+    }
+
+    virReportSystemError(err, _("cannot clone data into file '%s'"),
+                         vol->target.path);
+    return -err;
+}
+#else /* !(defined(__linux__) && defined(FICLONE)) */
+static int
+virStorageBackendCopyReflink(virStorageVolDefPtr vol ATTRIBUTE_UNUSED,
+                             int inputfd ATTRIBUTE_UNUSED,
+                             int fd ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+#endif /* !(defined(__linux__) && defined(FICLONE)) */
+
+/* Copy @length bytes at @offset with read()/write(), leaving blocks
+ * that are all zeroes as holes in the destination file */
+static int
+virStorageBackendCopyRange(virStorageVolDefPtr vol,
+                           virStorageVolDefPtr inputvol,
+                           int inputfd,
+                           int fd,
+                           off_t offset,
+                           unsigned long long length,
+                           char *buf,
+                           const char *zerobuf,
+                           size_t wbytes)
+{
+    while (length > 0) {
+        size_t want = READ_BLOCK_SIZE_DEFAULT;
+        ssize_t got;
+        size_t done;
+
+        if (length < want)
+            want = length;
+
+        if ((got = virStorageBackendPRead(inputfd, buf, want, offset)) < 0) {
+            int err = errno;
+            virReportSystemError(err,
+                                 _("failed reading from file '%s'"),
+                                 inputvol->target.path);
+            return -err;
+        }
+        if (got == 0)
+            break;
+
+        for (done = 0; done < (size_t) got; done += wbytes) {
+            size_t interval = got - done < wbytes ? got - done : wbytes;
+
+            if (memcmp(buf + done, zerobuf, interval) == 0)
+                continue;
+
+            if (virStorageBackendPWrite(fd, buf + done, interval,
+                                        offset + done) < 0) {
+                int err = errno;
+                virReportSystemError(err,
+                                     _("failed writing to file '%s'"),
+                                     vol->target.path);
+                return -err;
+            }
+        }
+
+        offset += got;
+        length -= got;
+        vol->buildProgress += got;
+    }
+
+    return 0;
+}
+
+/* Copy the data extents of the input into a new, already sized file.
+ * Holes are skipped using SEEK_DATA/SEEK_HOLE, and data is handed to
+ * copy_file_range() so the kernel or a network filesystem server can
+ * do the copy (or share the blocks) without a round trip through
+ * userspace. */
+static int
+virStorageBackendCopySparse(virStorageVolDefPtr vol,
+                            virStorageVolDefPtr inputvol,
+                            int inputfd,
+                            int fd,
+                            unsigned long long length,
+                            size_t wbytes)
+{
+    char *zerobuf = NULL;
+    char *buf = NULL;
+    unsigned long long offset = 0;
+#if HAVE_COPY_FILE_RANGE
+    bool offload = true;
+#endif
+    int ret = -1;
+
+    if (VIR_ALLOC_N(zerobuf, wbytes) < 0 ||
+        VIR_ALLOC_N(buf, READ_BLOCK_SIZE_DEFAULT) < 0) {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+
+    while (offset < length) {
+        int inData;
+        unsigned long long len;
+
+        if (lseek(inputfd, offset, SEEK_SET) < 0) {
+            ret = -errno;
+            virReportSystemError(errno, _("cannot seek in file '%s'"),
+                                 inputvol->target.path);
+            goto cleanup;
+        }
+
+        if (virFileInData(inputfd, &inData, &len) < 0)
+            goto cleanup;
+
+        /* The input got shorter under our feet */
+        if (len == 0)
+            break;
+
+        if (len > length - offset)
+            len = length - offset;
+
+        if (!inData) {
+            offset += len;
+            vol->buildProgress += len;
+            continue;
+        }
+
+#if HAVE_COPY_FILE_RANGE
+        while (offload && len > 0) {
+            loff_t inoff = offset;
+            loff_t outoff = offset;
+            ssize_t got;
+
+            if ((got = copy_file_range(inputfd, &inoff, fd, &outoff,
+                                       len, 0)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EXDEV && errno != EINVAL &&
+                    errno != ENOSYS && errno != EOPNOTSUPP) {
+                    ret = -errno;
+                    virReportSystemError(errno,
+                                         _("cannot copy '%s' to '%s'"),
+                                         inputvol->target.path,
+                                         vol->target.path);
+                    goto cleanup;
+                }
+                VIR_DEBUG("copy_file_range not usable for '%s': %d",
+                          vol->target.path, errno);
+                offload = false;
+                break;
+            }
+            if (got == 0)
+                break;
+
+            offset += got;
+            len -= got;
+            vol->buildProgress += got;
+        }
+#endif
+
+        if (len > 0) {
+            if ((ret = virStorageBackendCopyRange(vol, inputvol, inputfd, fd,
+                                                  offset, len, buf,
+                                                  zerobuf, wbytes)) < 0)
+                goto cleanup;
+            offset += len;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(zerobuf);
+    VIR_FREE(buf);
+    return ret;
+}
+
+typedef struct _virStorageBackendCopyJob virStorageBackendCopyJob;
+typedef virStorageBackendCopyJob *virStorageBackendCopyJobPtr;
+struct _virStorageBackendCopyJob {
+    virMutex lock;
+
+    virStorageVolDefPtr vol;
+    int inputfd;
+    int fd;             /* for chunks not suitable for O_DIRECT */
+    int directfd;       /* opened with O_DIRECT, or -1 */
+    size_t align;
+
+    unsigned long long length;
+    unsigned long long next; /* start of the next chunk to hand out */
+    unsigned long long done;
+
+    int err;            /* errno of the first failure */
+    bool readErr;
+};
+
+static void
+virStorageBackendCopyWorker(void *opaque)
+{
+    virStorageBackendCopyJobPtr job = opaque;
+    char *base = NULL;
+    char *buf;
+
+    if (VIR_ALLOC_N_QUIET(base, COPY_CHUNK_SIZE + COPY_ALIGN_MASK) < 0) {
+        virMutexLock(&job->lock);
+        if (!job->err)
+            job->err = ENOMEM;
+        virMutexUnlock(&job->lock);
+        return;
+    }
+    buf = (char *) (((intptr_t) base + COPY_ALIGN_MASK) & ~COPY_ALIGN_MASK);
+
+    while (true) {
+        unsigned long long offset;
+        size_t want;
+        ssize_t got;
+        int wfd = job->fd;
+        int err = 0;
+        bool readErr = false;
+
+        virMutexLock(&job->lock);
+        if (job->err || job->next >= job->length) {
+            virMutexUnlock(&job->lock);
+            break;
+        }
+        offset = job->next;
+        want = COPY_CHUNK_SIZE;
+        if (job->length - offset < want)
+            want = job->length - offset;
+        job->next += want;
+        virMutexUnlock(&job->lock);
+
+        if ((got = virStorageBackendPRead(job->inputfd, buf,
+                                          want, offset)) < 0) {
+            err = errno;
+            readErr = true;
+        } else {
+            if (job->directfd >= 0 && (got & (job->align - 1)) == 0)
+                wfd = job->directfd;
+            if (virStorageBackendPWrite(wfd, buf, got, offset) < 0)
+                err = errno;
+        }
+
+        virMutexLock(&job->lock);
+        if (err) {
+            if (!job->err) {
+                job->err = err;
+                job->readErr = readErr;
+            }
+        } else {
+            job->done += got;
+            job->vol->buildProgress = job->done;
+        }
+        virMutexUnlock(&job->lock);
+    }
+
+    VIR_FREE(base);
+}
+
+/* Copy into a block device in fixed size chunks spread over a few
+ * threads, bypassing the page cache for the destination where the
+ * device allows it. */
+static int
+virStorageBackendCopyThreaded(virStorageVolDefPtr vol,
+                              virStorageVolDefPtr inputvol,
+                              int inputfd,
+                              int fd,
+                              unsigned long long length)
+{
+    virStorageBackendCopyJob job;
+    virThreadPtr threads = NULL;
+    size_t nthreads = COPY_THREADS_DEFAULT;
+    size_t nstarted = 0;
+    size_t i;
+    int ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.vol = vol;
+    job.inputfd = inputfd;
+    job.fd = fd;
+    job.directfd = -1;
+    job.align = 512;
+    job.length = length;
+
+    if (virMutexInit(&job.lock) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize mutex"));
+        return -errno;
+    }
+
+    if ((length + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE < nthreads)
+        nthreads = (length + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+    if (nthreads == 0)
+        nthreads = 1;
+
+#if defined(__linux__) && defined(BLKSSZGET)
+    {
+        int sector;
+        if (ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0)
+            job.align = sector;
+    }
+#endif
+
+    if (O_DIRECT && job.align <= COPY_ALIGN_MASK + 1 &&
+        (job.directfd = open(vol->target.path, O_WRONLY | O_DIRECT)) < 0)
+        VIR_DEBUG("cannot open '%s' with O_DIRECT: %d",
+                  vol->target.path, errno);
+
+    if (VIR_ALLOC_N(threads, nthreads) < 0) {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+
+    for (nstarted = 0; nstarted < nthreads; nstarted++) {
+        if (virThreadCreate(&threads[nstarted], true,
+                            virStorageBackendCopyWorker, &job) < 0) {
+            int err = errno;
+            virMutexLock(&job.lock);
+            if (!job.err)
+                job.err = err;
+            virMutexUnlock(&job.lock);
+            break;
+        }
+    }
+
+    for (i = 0; i < nstarted; i++)
+        virThreadJoin(&threads[i]);
+
+    if (nstarted < nthreads) {
+        ret = -job.err;
+        virReportSystemError(job.err, "%s",
+                             _("cannot create copy thread"));
+        goto cleanup;
+    }
+
+    if (job.err) {
+        ret = -job.err;
+        if (job.readErr)
+            virReportSystemError(job.err,
+                                 _("failed reading from file '%s'"),
+                                 inputvol->target.path);
+        else
+            virReportSystemError(job.err,
+                                 _("failed writing to file '%s'"),
+                                 vol->target.path);
+        goto cleanup;
+    }
+
+    if (VIR_CLOSE(job.directfd) < 0) {
+        ret = -errno;
+        virReportSystemError(errno, _("cannot close file '%s'"),
+                             vol->target.path);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(job.directfd);
+    VIR_FREE(threads);
+    virMutexDestroy(&job.lock);
+    return ret;
+}
 
 static int ATTRIBUTE_NONNULL(2)
 virStorageBackendCopyToFD(virStorageVolDefPtr vol,
@@ -132,14 +559,12 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
                           int is_dest_file)
 {
     int inputfd = -1;
-    int amtread = -1;
     int ret = 0;
-    size_t rbytes = READ_BLOCK_SIZE_DEFAULT;
     size_t wbytes = 0;
-    int interval;
-    char *zerobuf = NULL;
-    char *buf = NULL;
+    off_t inputlen;
+    unsigned long long length;
     struct stat st;
+    struct stat inputst;
 
     if ((inputfd = open(inputvol->target.path, O_RDONLY)) < 0) {
         ret = -errno;
@@ -149,67 +574,62 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
         goto cleanup;
     }
 
+    if (fstat(inputfd, &inputst) < 0 ||
+        (inputlen = lseek(inputfd, 0, SEEK_END)) < 0 ||
+        lseek(inputfd, 0, SEEK_SET) < 0) {
+        ret = -errno;
+        virReportSystemError(errno,
+                             _("cannot determine size of '%s'"),
+                             inputvol->target.path);
+        goto cleanup;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        virReportSystemError(errno, _("stat of '%s' failed"),
+                             vol->target.path);
+        goto cleanup;
+    }
+
 #ifdef __linux__
     if (ioctl(fd, BLKBSZGET, &wbytes) < 0) {
         wbytes = 0;
     }
 #endif
-    if ((wbytes == 0) && fstat(fd, &st) == 0)
+    if (wbytes == 0)
         wbytes = st.st_blksize;
     if (wbytes < WRITE_BLOCK_SIZE_DEFAULT)
         wbytes = WRITE_BLOCK_SIZE_DEFAULT;
 
-    if (VIR_ALLOC_N(zerobuf, wbytes) < 0) {
-        ret = -errno;
-        goto cleanup;
-    }
-
-    if (VIR_ALLOC_N(buf, rbytes) < 0) {
-        ret = -errno;
-        goto cleanup;
-    }
-
-    while (amtread != 0) {
-        int amtleft;
+    length = *total;
+    if (inputlen < length)
+        length = inputlen;
+    vol->buildProgress = 0;
 
-        if (*total < rbytes)
-            rbytes = *total;
+    if (is_dest_file) {
+        int rc = 0;
 
-        if ((amtread = saferead(inputfd, buf, rbytes)) < 0) {
-            ret = -errno;
-            virReportSystemError(errno,
-                                 _("failed reading from file '%s'"),
-                                 inputvol->target.path);
+        if (length == inputlen &&
+            S_ISREG(inputst.st_mode) &&
+            st.st_dev == inputst.st_dev &&
+            (rc = virStorageBackendCopyReflink(vol, inputfd, fd)) < 0) {
+            ret = rc;
             goto cleanup;
         }
-        *total -= amtread;
-
-        /* Loop over amt read in 512 byte increments, looking for sparse
-         * blocks */
-        amtleft = amtread;
-        do {
-            interval = ((wbytes > amtleft) ? amtleft : wbytes);
-            int offset = amtread - amtleft;
 
-            if (is_dest_file && memcmp(buf+offset, zerobuf, interval) == 0) {
-                if (lseek(fd, interval, SEEK_CUR) < 0) {
-                    ret = -errno;
-                    virReportSystemError(errno,
-                                         _("cannot extend file '%s'"),
-                                         vol->target.path);
-                    goto cleanup;
-                }
-            } else if (safewrite(fd, buf+offset, interval) < 0) {
-                ret = -errno;
-                virReportSystemError(errno,
-                                     _("failed writing to file '%s'"),
-                                     vol->target.path);
-                goto cleanup;
-
-            }
-        } while ((amtleft -= interval) > 0);
+        if (rc == 0 &&
+            (ret = virStorageBackendCopySparse(vol, inputvol, inputfd, fd,
+                                               length, wbytes)) < 0)
+            goto cleanup;
+    } else {
+        if ((ret = virStorageBackendCopyThreaded(vol, inputvol, inputfd, fd,
+                                                 length)) < 0)
+            goto cleanup;
     }
 
+    *total -= length;
+    vol->buildProgress = length;
+
     if (fdatasync(fd) < 0) {
         ret = -errno;
         virReportSystemError(errno, _("cannot sync data to file '%s'"),
@@ -230,9 +650,6 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
 cleanup:
     VIR_FORCE_CLOSE(inputfd);
 
-    VIR_FREE(zerobuf);
-    VIR_FREE(buf);
-
     return ret;
 }
 
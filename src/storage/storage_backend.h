@@ -70,6 +70,9 @@ typedef virStorageBackend *virStorageBackendPtr;
 
 struct _virStorageBackend {
     int type;
+    /* refreshPool updates the existing volume list in place rather
+     * than expecting it to be empty */
+    bool refreshIncremental;
 
     virStorageBackendFindPoolSources findPoolSources;
     virStorageBackendCheckPool checkPool;
@@ -41,6 +41,10 @@
 # include <blkid/blkid.h>
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
 #include "virerror.h"
 #include "storage_backend_fs.h"
 #include "storage_conf.h"
@@ -51,6 +55,9 @@
 #include "virfile.h"
 #include "virlog.h"
 #include "virstring.h"
+#include "virhash.h"
+#include "virthreadpool.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -801,18 +808,466 @@ error:
 }
 
 
+/*
+ * Incremental refresh
+ *
+ * Probing a volume means opening it and parsing its header, which on
+ * large network pools dominates the time spent refreshing. We remember
+ * what each directory entry looked like when it was last probed and
+ * keep the existing volume object as long as that has not changed.
+ *
+ * For local pools an inotify watch on the target directory records the
+ * names that changed since the previous refresh, so entries it did not
+ * report do not even need to be stat'd. NFS clients are not told about
+ * changes made by other hosts, so netfs pools always fall back to
+ * comparing stat data.
+ */
+#define VIR_STORAGE_BACKEND_FS_PROBE_MAX_WORKERS 8
+
+typedef struct _virStorageBackendFSVolStamp virStorageBackendFSVolStamp;
+typedef virStorageBackendFSVolStamp *virStorageBackendFSVolStampPtr;
+struct _virStorageBackendFSVolStamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool ignored;       /* entry is not a volume, eg. '.' or a FIFO */
+    bool watched;       /* changes show up on the directory watch */
+};
+
+typedef struct _virStorageBackendFSState virStorageBackendFSState;
+typedef virStorageBackendFSState *virStorageBackendFSStatePtr;
+struct _virStorageBackendFSState {
+    virHashTablePtr stamps;     /* entry name -> virStorageBackendFSVolStamp */
+    virHashTablePtr dirty;      /* names reported by the watch */
+    int watchfd;                /* inotify FD, -1 if not watching */
+};
+
+typedef struct _virStorageBackendFSProbeJob virStorageBackendFSProbeJob;
+typedef virStorageBackendFSProbeJob *virStorageBackendFSProbeJobPtr;
+struct _virStorageBackendFSProbeJob {
+    virStorageVolDefPtr vol;
+    virStorageBackendFSVolStamp stamp;
+    bool haveStamp;     /* @stamp was filled in before probing */
+    bool complete;      /* probe did not hit an unavailable backing file */
+    int ret;
+    virErrorPtr err;
+};
+
+struct virStorageBackendFSProbeData {
+    virMutex lock;
+    virCond cond;
+    size_t pending;
+};
+
+
+static void
+virStorageBackendFileSystemStampFree(void *payload,
+                                     const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+static void
+virStorageBackendFileSystemWatchClose(virStorageBackendFSStatePtr state)
+{
+    VIR_FORCE_CLOSE(state->watchfd);
+    virHashRemoveAll(state->dirty);
+}
+
+static void
+virStorageBackendFileSystemStateFree(void *opaque)
+{
+    virStorageBackendFSStatePtr state = opaque;
+
+    if (!state)
+        return;
+
+    VIR_FORCE_CLOSE(state->watchfd);
+    virHashFree(state->stamps);
+    virHashFree(state->dirty);
+    VIR_FREE(state);
+}
+
+static virStorageBackendFSStatePtr
+virStorageBackendFileSystemGetState(virStoragePoolObjPtr pool)
+{
+    virStorageBackendFSStatePtr state;
+
+    if (pool->privateData)
+        return pool->privateData;
+
+    if (VIR_ALLOC(state) < 0)
+        return NULL;
+    state->watchfd = -1;
+
+    if (!(state->stamps = virHashCreate(32,
+                                        virStorageBackendFileSystemStampFree)) ||
+        !(state->dirty = virHashCreate(32, NULL))) {
+        virStorageBackendFileSystemStateFree(state);
+        return NULL;
+    }
+
+    pool->privateData = state;
+    pool->privateDataFreeFunc = virStorageBackendFileSystemStateFree;
+    return state;
+}
+
+/* Drop everything remembered about the pool's volumes */
+static void
+virStorageBackendFileSystemResetState(virStoragePoolObjPtr pool)
+{
+    if (pool->privateDataFreeFunc)
+        (pool->privateDataFreeFunc)(pool->privateData);
+    pool->privateData = NULL;
+    pool->privateDataFreeFunc = NULL;
+}
+
+
+#if HAVE_SYS_INOTIFY_H
+# define VIR_STORAGE_BACKEND_FS_WATCH_MASK \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+     IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | \
+     IN_DELETE_SELF | IN_MOVE_SELF)
+
+static void
+virStorageBackendFileSystemWatchOpen(virStoragePoolObjPtr pool,
+                                     virStorageBackendFSStatePtr state)
+{
+    int fd;
+
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        VIR_DEBUG("Cannot watch pool '%s': %s",
+                  pool->def->name, strerror(errno));
+        return;
+    }
+
+    if (inotify_add_watch(fd, pool->def->target.path,
+                          VIR_STORAGE_BACKEND_FS_WATCH_MASK) < 0) {
+        VIR_DEBUG("Cannot watch '%s': %s",
+                  pool->def->target.path, strerror(errno));
+        VIR_FORCE_CLOSE(fd);
+        return;
+    }
+
+    state->watchfd = fd;
+}
+
+/*
+ * Collect the names the watch reported since the last call into
+ * state->dirty. Returns true if those are all the changes made to
+ * the directory in the meantime, false if that is unknown because
+ * the watch was just set up or lost events.
+ */
+static bool
+virStorageBackendFileSystemWatchDrain(virStoragePoolObjPtr pool,
+                                      virStorageBackendFSStatePtr state)
+{
+    union {
+        struct inotify_event e;
+        char buf[4096];
+    } events;
+    bool complete = true;
+    ssize_t got;
+
+    if (pool->def->type == VIR_STORAGE_POOL_NETFS)
+        return false;
+
+    if (state->watchfd < 0) {
+        virStorageBackendFileSystemWatchOpen(pool, state);
+        return false;
+    }
+
+    while ((got = read(state->watchfd, events.buf, sizeof(events.buf))) > 0) {
+        char *p = events.buf;
+
+        while (p < events.buf + got) {
+            struct inotify_event *e = (struct inotify_event *)p;
+
+            if (e->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_UNMOUNT |
+                           IN_DELETE_SELF | IN_MOVE_SELF))
+                complete = false;
+            else if (e->len &&
+                     virHashUpdateEntry(state->dirty, e->name,
+                                        (void *)0x1) < 0)
+                complete = false;
+
+            p += sizeof(*e) + e->len;
+        }
+    }
+    if (got < 0 && errno != EAGAIN && errno != EINTR)
+        complete = false;
+
+    if (!complete) {
+        virResetLastError();
+        virStorageBackendFileSystemWatchClose(state);
+        virStorageBackendFileSystemWatchOpen(pool, state);
+    }
+
+    return complete;
+}
+
+/* Whether changes to @ent's content are reported by the watch */
+static bool
+virStorageBackendFileSystemWatchCovers(struct dirent *ent)
+{
+    /* Writes to a symlink target or into a sub-directory do not raise
+     * events on the pool directory itself */
+    return ent->d_type == DT_REG;
+}
+#else /* !HAVE_SYS_INOTIFY_H */
+static bool
+virStorageBackendFileSystemWatchDrain(virStoragePoolObjPtr pool ATTRIBUTE_UNUSED,
+                                      virStorageBackendFSStatePtr state ATTRIBUTE_UNUSED)
+{
+    return false;
+}
+
+static bool
+virStorageBackendFileSystemWatchCovers(struct dirent *ent ATTRIBUTE_UNUSED)
+{
+    return false;
+}
+#endif /* !HAVE_SYS_INOTIFY_H */
+
+
+static void
+virStorageBackendFileSystemStampFill(virStorageBackendFSVolStampPtr stamp,
+                                     struct stat *sb,
+                                     struct dirent *ent)
+{
+    stamp->dev = sb->st_dev;
+    stamp->ino = sb->st_ino;
+    stamp->size = sb->st_size;
+    stamp->mtime = get_stat_mtime(sb);
+    stamp->ctime = get_stat_ctime(sb);
+    stamp->ignored = false;
+    stamp->watched = virStorageBackendFileSystemWatchCovers(ent);
+}
+
+static bool
+virStorageBackendFileSystemStampEqual(virStorageBackendFSVolStampPtr a,
+                                      virStorageBackendFSVolStampPtr b)
+{
+    return a->dev == b->dev &&
+        a->ino == b->ino &&
+        a->size == b->size &&
+        a->watched == b->watched &&
+        a->mtime.tv_sec == b->mtime.tv_sec &&
+        a->mtime.tv_nsec == b->mtime.tv_nsec &&
+        a->ctime.tv_sec == b->ctime.tv_sec &&
+        a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+static int
+virStorageBackendFileSystemStampAdd(virHashTablePtr stamps,
+                                    const char *name,
+                                    virStorageBackendFSVolStampPtr stamp)
+{
+    virStorageBackendFSVolStampPtr copy;
+
+    if (VIR_ALLOC(copy) < 0)
+        return -1;
+    *copy = *stamp;
+
+    if (virHashAddEntry(stamps, name, copy) < 0) {
+        VIR_FREE(copy);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Probe a single volume. Sets job->ret to 0 if the volume should be
+ * listed, -2 if the entry is to be skipped and -1 on error, which is
+ * saved in job->err since this may run in a worker thread.
+ */
+static void
+virStorageBackendFileSystemProbeVol(virStorageBackendFSProbeJobPtr job)
+{
+    virStorageVolDefPtr vol = job->vol;
+    char *backingStore;
+    int backingStoreFormat;
+    int ret;
+
+    job->complete = true;
+
+    if ((ret = virStorageBackendProbeTarget(&vol->target,
+                                            &backingStore,
+                                            &backingStoreFormat,
+                                            &vol->allocation,
+                                            &vol->capacity,
+                                            &vol->target.encryption)) < 0) {
+        if (ret == -2) {
+            /* Silently ignore non-regular files,
+             * eg '.' '..', 'lost+found', dangling symbolic link */
+            job->ret = -2;
+            goto cleanup;
+        } else if (ret == -3) {
+            /* The backing file is currently unavailable, its format is not
+             * explicitly specified, the probe to auto detect the format
+             * failed: continue with faked RAW format, since AUTO will
+             * break virStorageVolTargetDefFormat() generating the line
+             * <format type='...'/>. */
+            backingStoreFormat = VIR_STORAGE_FILE_RAW;
+            job->complete = false;
+        } else {
+            job->ret = -1;
+            job->err = virSaveLastError();
+            goto cleanup;
+        }
+    }
+
+    /* directory based volume */
+    if (vol->target.format == VIR_STORAGE_FILE_DIR)
+        vol->type = VIR_STORAGE_VOL_DIR;
+
+    if (backingStore != NULL) {
+        vol->backingStore.path = backingStore;
+        vol->backingStore.format = backingStoreFormat;
+
+        if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
+                                    NULL, NULL,
+                                    VIR_STORAGE_VOL_OPEN_DEFAULT) < 0) {
+            /* The backing file is currently unavailable, the capacity,
+             * allocation, owner, group and mode are unknown. Just log the
+             * error and continue.
+             * Unfortunately virStorageBackendProbeTarget() might already
+             * have logged a similar message for the same problem, but only
+             * if AUTO format detection was used. */
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("cannot probe backing volume info: %s"),
+                           vol->backingStore.path);
+            job->complete = false;
+        }
+    }
+
+    job->ret = 0;
+
+cleanup:
+    virResetLastError();
+}
+
+/* Thread pool job probing the volume of @jobdata */
+static void
+virStorageBackendFileSystemProbeWorker(void *jobdata, void *opaque)
+{
+    struct virStorageBackendFSProbeData *data = opaque;
+
+    virStorageBackendFileSystemProbeVol(jobdata);
+
+    virMutexLock(&data->lock);
+    if (--data->pending == 0)
+        virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+/*
+ * Probe all volumes in @jobs, spreading the work over a few threads
+ * when there is more than one.
+ */
+static int
+virStorageBackendFileSystemProbeVols(virStorageBackendFSProbeJobPtr jobs,
+                                     size_t njobs)
+{
+    struct virStorageBackendFSProbeData data;
+    virThreadPoolPtr pool = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (njobs < 2) {
+        for (i = 0; i < njobs; i++)
+            virStorageBackendFileSystemProbeVol(&jobs[i]);
+        return 0;
+    }
+
+    memset(&data, 0, sizeof(data));
+    if (virMutexInit(&data.lock) < 0) {
+        virReportSystemError(errno, "%s", _("cannot initialize mutex"));
+        return -1;
+    }
+    if (virCondInit(&data.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot initialize condition variable"));
+        virMutexDestroy(&data.lock);
+        return -1;
+    }
+
+    if (!(pool = virThreadPoolNew(0, MIN(njobs,
+                                         VIR_STORAGE_BACKEND_FS_PROBE_MAX_WORKERS),
+                                  0, virStorageBackendFileSystemProbeWorker,
+                                  &data)))
+        goto cleanup;
+
+    for (i = 0; i < njobs; i++) {
+        virMutexLock(&data.lock);
+        data.pending++;
+        virMutexUnlock(&data.lock);
+
+        if (virThreadPoolSendJob(pool, VIR_THREAD_POOL_JOB_NORMAL,
+                                 &jobs[i]) < 0)
+            virStorageBackendFileSystemProbeWorker(&jobs[i], &data);
+    }
+
+    virMutexLock(&data.lock);
+    while (data.pending)
+        ignore_value(virCondWait(&data.cond, &data.lock));
+    virMutexUnlock(&data.lock);
+
+    virResetLastError();
+    ret = 0;
+
+cleanup:
+    virThreadPoolFree(pool);
+    virCondDestroy(&data.cond);
+    virMutexDestroy(&data.lock);
+    return ret;
+}
+
+
 /**
  * Iterate over the pool's directory and enumerate all disk images
  * within it. This is non-recursive.
+ *
+ * Volumes already known from a previous refresh are kept as they are
+ * unless their directory entry changed, everything else is probed.
  */
 static int
 virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
                                    virStoragePoolObjPtr pool)
 {
-    DIR *dir;
+    DIR *dir = NULL;
     struct dirent *ent;
     struct statvfs sb;
+    virStorageBackendFSStatePtr state;
+    virHashTablePtr known = NULL;
+    virHashTablePtr stamps = NULL;
+    virStorageVolDefPtr *vols = NULL;
+    size_t nvols = 0;
+    virStorageBackendFSProbeJobPtr jobs = NULL;
+    size_t njobs = 0;
     virStorageVolDefPtr vol = NULL;
+    bool watched;
+    size_t i;
+    int ret = -1;
+
+    if (!(state = virStorageBackendFileSystemGetState(pool)))
+        goto cleanup;
+
+    watched = virStorageBackendFileSystemWatchDrain(pool, state);
+
+    /* Volumes we can reuse, by name */
+    if (!(known = virHashCreate(pool->volumes.count + 1, NULL)) ||
+        !(stamps = virHashCreate(virHashSize(state->stamps) + 1,
+                                 virStorageBackendFileSystemStampFree)))
+        goto cleanup;
+    for (i = 0; i < pool->volumes.count; i++) {
+        if (virHashAddEntry(known, pool->volumes.objs[i]->name,
+                            pool->volumes.objs[i]) < 0)
+            goto cleanup;
+    }
 
     if (!(dir = opendir(pool->def->target.path))) {
         virReportSystemError(errno,
@@ -822,87 +1277,140 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 
     while ((ent = readdir(dir)) != NULL) {
-        int ret;
-        char *backingStore;
-        int backingStoreFormat;
+        virStorageBackendFSVolStampPtr old;
+        virStorageBackendFSVolStamp stamp;
+        virStorageVolDefPtr prev;
+        struct stat st;
+        bool haveStamp = false;
+        bool reuse = false;
+        char *path;
+
+        old = virHashLookup(state->stamps, ent->d_name);
+        prev = virHashLookup(known, ent->d_name);
+        path = NULL;
+
+        if (old && (old->ignored || prev) &&
+            watched && old->watched &&
+            !virHashLookup(state->dirty, ent->d_name)) {
+            /* Nothing happened to it since the last refresh */
+            stamp = *old;
+            reuse = true;
+        } else {
+            if (virAsprintf(&path, "%s/%s",
+                            pool->def->target.path, ent->d_name) < 0)
+                goto cleanup;
 
-        if (VIR_ALLOC(vol) < 0)
+            if (stat(path, &st) == 0) {
+                virStorageBackendFileSystemStampFill(&stamp, &st, ent);
+                haveStamp = true;
+
+                if (old && (old->ignored || prev) &&
+                    virStorageBackendFileSystemStampEqual(old, &stamp)) {
+                    stamp.ignored = old->ignored;
+                    reuse = true;
+                }
+            }
+        }
+
+        if (reuse) {
+            VIR_FREE(path);
+            if (virStorageBackendFileSystemStampAdd(stamps, ent->d_name,
+                                                    &stamp) < 0)
+                goto cleanup;
+            if (prev && !stamp.ignored) {
+                if (VIR_APPEND_ELEMENT(vols, nvols, prev) < 0)
+                    goto cleanup;
+                ignore_value(virHashSteal(known, ent->d_name));
+            }
+            continue;
+        }
+
+        if (VIR_ALLOC(vol) < 0) {
+            VIR_FREE(path);
             goto cleanup;
+        }
+        vol->target.path = path;
 
         if (VIR_STRDUP(vol->name, ent->d_name) < 0)
             goto cleanup;
 
         vol->type = VIR_STORAGE_VOL_FILE;
         vol->target.format = VIR_STORAGE_FILE_RAW; /* Real value is filled in during probe */
-        if (virAsprintf(&vol->target.path, "%s/%s",
-                        pool->def->target.path,
-                        vol->name) == -1)
-            goto cleanup;
 
         if (VIR_STRDUP(vol->key, vol->target.path) < 0)
             goto cleanup;
 
-        if ((ret = virStorageBackendProbeTarget(&vol->target,
-                                                &backingStore,
-                                                &backingStoreFormat,
-                                                &vol->allocation,
-                                                &vol->capacity,
-                                                &vol->target.encryption)) < 0) {
-            if (ret == -2) {
-                /* Silently ignore non-regular files,
-                 * eg '.' '..', 'lost+found', dangling symbolic link */
-                virStorageVolDefFree(vol);
-                vol = NULL;
-                continue;
-            } else if (ret == -3) {
-                /* The backing file is currently unavailable, its format is not
-                 * explicitly specified, the probe to auto detect the format
-                 * failed: continue with faked RAW format, since AUTO will
-                 * break virStorageVolTargetDefFormat() generating the line
-                 * <format type='...'/>. */
-                backingStoreFormat = VIR_STORAGE_FILE_RAW;
-            } else
-                goto cleanup;
+        if (VIR_EXPAND_N(jobs, njobs, 1) < 0)
+            goto cleanup;
+        jobs[njobs - 1].vol = vol;
+        jobs[njobs - 1].stamp = stamp;
+        jobs[njobs - 1].haveStamp = haveStamp;
+        vol = NULL;
+    }
+    closedir(dir);
+    dir = NULL;
+
+    VIR_DEBUG("Pool '%s': %zu volumes unchanged, %zu entries to probe",
+              pool->def->name, nvols, njobs);
+
+    if (virStorageBackendFileSystemProbeVols(jobs, njobs) < 0)
+        goto cleanup;
+
+    for (i = 0; i < njobs; i++) {
+        virStorageBackendFSProbeJobPtr job = &jobs[i];
+
+        if (job->ret == -1) {
+            if (job->err)
+                virSetError(job->err);
+            else
+                virReportOOMError();
+            goto cleanup;
         }
 
-        /* directory based volume */
-        if (vol->target.format == VIR_STORAGE_FILE_DIR)
-            vol->type = VIR_STORAGE_VOL_DIR;
-
-        if (backingStore != NULL) {
-            vol->backingStore.path = backingStore;
-            vol->backingStore.format = backingStoreFormat;
-
-            if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
-                                        NULL, NULL,
-                                        VIR_STORAGE_VOL_OPEN_DEFAULT) < 0) {
-                /* The backing file is currently unavailable, the capacity,
-                 * allocation, owner, group and mode are unknown. Just log the
-                 * error and continue.
-                 * Unfortunately virStorageBackendProbeTarget() might already
-                 * have logged a similar message for the same problem, but only
-                 * if AUTO format detection was used. */
-                virReportError(VIR_ERR_INTERNAL_ERROR,
-                               _("cannot probe backing volume info: %s"),
-                               vol->backingStore.path);
-            }
+        if (job->haveStamp && job->complete) {
+            job->stamp.ignored = job->ret == -2;
+            if (virStorageBackendFileSystemStampAdd(stamps, job->vol->name,
+                                                    &job->stamp) < 0)
+                goto cleanup;
         }
 
+        if (job->ret == 0) {
+            if (VIR_APPEND_ELEMENT(vols, nvols, job->vol) < 0)
+                goto cleanup;
+        }
+    }
 
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count+1) < 0)
-            goto cleanup;
-        pool->volumes.objs[pool->volumes.count++] = vol;
-        vol = NULL;
+    /* Everything still in @known is gone or has been re-probed */
+    for (i = 0; i < pool->volumes.count; i++) {
+        vol = pool->volumes.objs[i];
+        if (virHashLookup(known, vol->name) == vol)
+            virStorageVolDefFree(vol);
     }
-    closedir(dir);
+    vol = NULL;
+    VIR_FREE(pool->volumes.objs);
+    pool->volumes.objs = vols;
+    pool->volumes.count = nvols;
+    vols = NULL;
+    nvols = 0;
+
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].ret != 0)
+            virStorageVolDefFree(jobs[i].vol);
+        virFreeError(jobs[i].err);
+    }
+    VIR_FREE(jobs);
+    njobs = 0;
 
+    virHashFree(state->stamps);
+    state->stamps = stamps;
+    stamps = NULL;
+    virHashRemoveAll(state->dirty);
 
     if (statvfs(pool->def->target.path, &sb) < 0) {
         virReportSystemError(errno,
                              _("cannot statvfs path '%s'"),
                              pool->def->target.path);
-        return -1;
+        goto cleanup;
     }
     pool->def->capacity = ((unsigned long long)sb.f_frsize *
                            (unsigned long long)sb.f_blocks);
@@ -910,14 +1418,25 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
                             (unsigned long long)sb.f_frsize);
     pool->def->allocation = pool->def->capacity - pool->def->available;
 
-    return 0;
+    ret = 0;
 
- cleanup:
+cleanup:
     if (dir)
         closedir(dir);
     virStorageVolDefFree(vol);
-    virStoragePoolObjClearVols(pool);
-    return -1;
+    for (i = 0; i < njobs; i++) {
+        virStorageVolDefFree(jobs[i].vol);
+        virFreeError(jobs[i].err);
+    }
+    VIR_FREE(jobs);
+    VIR_FREE(vols);
+    virHashFree(known);
+    virHashFree(stamps);
+    if (ret < 0) {
+        virStoragePoolObjClearVols(pool);
+        virStorageBackendFileSystemResetState(pool);
+    }
+    return ret;
 }
 
 
@@ -930,17 +1449,20 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
  *  - If it is a FS based pool, unmounts the unlying source device on the pool
  *  - Releases all cached data about volumes
  */
-#if WITH_STORAGE_FS
 static int
 virStorageBackendFileSystemStop(virConnectPtr conn ATTRIBUTE_UNUSED,
                                 virStoragePoolObjPtr pool)
 {
-    if (virStorageBackendFileSystemUnmount(pool) < 0)
+    virStorageBackendFileSystemResetState(pool);
+
+#if WITH_STORAGE_FS
+    if (pool->def->type != VIR_STORAGE_POOL_DIR &&
+        virStorageBackendFileSystemUnmount(pool) < 0)
         return -1;
+#endif /* WITH_STORAGE_FS */
 
     return 0;
 }
-#endif /* WITH_STORAGE_FS */
 
 
 /**
@@ -1265,10 +1787,12 @@ virStorageBackendFileSystemVolResize(virConnectPtr conn ATTRIBUTE_UNUSED,
 
 virStorageBackend virStorageBackendDirectory = {
     .type = VIR_STORAGE_POOL_DIR,
+    .refreshIncremental = true,
 
     .buildPool = virStorageBackendFileSystemBuild,
     .checkPool = virStorageBackendFileSystemCheck,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
     .buildVolFrom = virStorageBackendFileSystemVolBuildFrom,
@@ -1281,6 +1805,7 @@ virStorageBackend virStorageBackendDirectory = {
 #if WITH_STORAGE_FS
 virStorageBackend virStorageBackendFileSystem = {
     .type = VIR_STORAGE_POOL_FS,
+    .refreshIncremental = true,
 
     .buildPool = virStorageBackendFileSystemBuild,
     .checkPool = virStorageBackendFileSystemCheck,
@@ -1297,6 +1822,7 @@ virStorageBackend virStorageBackendFileSystem = {
 };
 virStorageBackend virStorageBackendNetFileSystem = {
     .type = VIR_STORAGE_POOL_NETFS,
+    .refreshIncremental = true,
 
     .buildPool = virStorageBackendFileSystemBuild,
     .checkPool = virStorageBackendFileSystemCheck,
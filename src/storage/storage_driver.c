@@ -990,7 +990,8 @@ storagePoolRefresh(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    virStoragePoolObjClearVols(pool);
+    if (!backend->refreshIncremental)
+        virStoragePoolObjClearVols(pool);
     if (backend->refreshPool(obj->conn, pool) < 0) {
         if (backend->stopPool)
             backend->stopPool(obj->conn, pool);
@@ -1808,7 +1809,7 @@ storageVolDownload(virStorageVolPtr obj,
     virStorageVolDefPtr vol = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM, -1);
 
     storageDriverLock(driver);
     pool = virStoragePoolObjFindByName(&driver->pools, obj->pool);
@@ -1846,11 +1847,18 @@ storageVolDownload(virStorageVolPtr obj,
         goto out;
     }
 
-    if (virFDStreamOpenFile(stream,
-                            vol->target.path,
-                            offset, length,
-                            O_RDONLY) < 0)
+    if (flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM) {
+        if (virFDStreamOpenFileSparse(stream,
+                                      vol->target.path,
+                                      offset, length,
+                                      O_RDONLY) < 0)
+            goto out;
+    } else if (virFDStreamOpenFile(stream,
+                                   vol->target.path,
+                                   offset, length,
+                                   O_RDONLY) < 0) {
         goto out;
+    }
 
     ret = 0;
 
@@ -1874,7 +1882,7 @@ storageVolUpload(virStorageVolPtr obj,
     virStorageVolDefPtr vol = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM, -1);
 
     storageDriverLock(driver);
     pool = virStoragePoolObjFindByName(&driver->pools, obj->pool);
@@ -1914,11 +1922,18 @@ storageVolUpload(virStorageVolPtr obj,
 
     /* Not using O_CREAT because the file is required to
      * already exist at this point */
-    if (virFDStreamOpenFile(stream,
-                            vol->target.path,
-                            offset, length,
-                            O_WRONLY) < 0)
+    if (flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM) {
+        if (virFDStreamOpenFileSparse(stream,
+                                      vol->target.path,
+                                      offset, length,
+                                      O_WRONLY) < 0)
+            goto out;
+    } else if (virFDStreamOpenFile(stream,
+                                   vol->target.path,
+                                   offset, length,
+                                   O_WRONLY) < 0) {
         goto out;
+    }
 
     ret = 0;
 
@@ -2451,6 +2466,9 @@ storageVolGetInfo(virStorageVolPtr obj,
     info->type = vol->type;
     info->capacity = vol->capacity;
     info->allocation = vol->allocation;
+    /* While a clone is in progress, report how far it has got */
+    if (vol->building && vol->buildProgress)
+        info->allocation = vol->buildProgress;
     ret = 0;
 
 cleanup:
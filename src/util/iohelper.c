@@ -23,6 +23,8 @@
  *   - Read existing file
  *   - Write existing file
  *   - Create & write new file
+ *   - Compress or decompress stdin to stdout
+ *   - Read or write a sparse file, passing holes as records
  */
 
 #include <config.h>
@@ -32,6 +34,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "virutil.h"
 #include "virthread.h"
@@ -41,6 +44,7 @@
 #include "configmake.h"
 #include "virrandom.h"
 #include "virstring.h"
+#include "vircompress.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -73,6 +77,290 @@ cleanup:
     return fd;
 }
 
+/* Moves up to @len bytes from @fdin to @fdout without copying them
+ * through userspace, which needs one of them to be a pipe. Returns
+ * the number of bytes moved, 0 at EOF, or -1 with errno set. EINVAL
+ * and ENOSYS mean that splice() can't be used for these fds. */
+static ssize_t
+spliceData(int fdin, int fdout, size_t len)
+{
+#if HAVE_SPLICE
+    ssize_t ret;
+
+    do {
+        ret = splice(fdin, NULL, fdout, NULL, len,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Copies exactly @len bytes, failing if @fdin ends before that */
+static int
+copyData(int fdin, const char *fdinname,
+         int fdout, const char *fdoutname,
+         unsigned long long len,
+         char *buf, size_t buflen,
+         bool *useSplice)
+{
+    while (len) {
+        size_t want = len < buflen ? len : buflen;
+        ssize_t got;
+
+        if (*useSplice) {
+            if ((got = spliceData(fdin, fdout, want)) < 0) {
+                if (errno == EINVAL || errno == ENOSYS) {
+                    *useSplice = false;
+                    continue;
+                }
+                virReportSystemError(errno, _("Unable to copy %s to %s"),
+                                     fdinname, fdoutname);
+                return -1;
+            }
+        } else {
+            if ((got = saferead(fdin, buf, want)) < 0) {
+                virReportSystemError(errno, _("Unable to read %s"), fdinname);
+                return -1;
+            }
+            if (got > 0 && safewrite(fdout, buf, got) < 0) {
+                virReportSystemError(errno, _("Unable to write %s"), fdoutname);
+                return -1;
+            }
+        }
+
+        if (got == 0) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("Unexpected end of file on %s"), fdinname);
+            return -1;
+        }
+        len -= got;
+    }
+
+    return 0;
+}
+
+/* Sends the file from its current position as a series of sparse
+ * records, looking the holes up with SEEK_DATA/SEEK_HOLE */
+static int
+runSparseRead(const char *path, int fd, unsigned long long length,
+              char *buf, size_t buflen)
+{
+    unsigned long long total = 0;
+    bool useSplice = true;
+
+    while (!length || total < length) {
+        virFileSparseRecord rec;
+        int inData;
+        unsigned long long len;
+
+        if (virFileInData(fd, &inData, &len) < 0)
+            return -1;
+
+        if (len == 0)
+            break; /* End of file */
+
+        if (length && len > length - total)
+            len = length - total;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.type = inData ? VIR_FILE_SPARSE_DATA : VIR_FILE_SPARSE_HOLE;
+        rec.length = len;
+
+        if (safewrite(STDOUT_FILENO, &rec, sizeof(rec)) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to write stdout"));
+            return -1;
+        }
+
+        if (inData) {
+            if (copyData(fd, path, STDOUT_FILENO, "stdout",
+                         len, buf, buflen, &useSplice) < 0)
+                return -1;
+        } else if (lseek(fd, len, SEEK_CUR) == (off_t) -1) {
+            virReportSystemError(errno, _("Unable to seek %s"), path);
+            return -1;
+        }
+
+        total += len;
+    }
+
+    return 0;
+}
+
+/* Skips @len bytes of @fd which must read back as zeroes. Regular
+ * files get the range deallocated where possible, anything else
+ * gets the zeroes written out */
+static int
+skipHole(const char *path, int fd, bool regular, unsigned long long len,
+         char *buf, size_t buflen)
+{
+    off_t cur;
+    struct stat sb;
+
+    if (regular) {
+        if ((cur = lseek(fd, 0, SEEK_CUR)) == (off_t) -1 ||
+            fstat(fd, &sb) < 0) {
+            virReportSystemError(errno, _("Unable to access %s"), path);
+            return -1;
+        }
+
+        /* Nothing is allocated past the end of the file, it just
+         * needs to be extended at the end */
+        if (cur >= sb.st_size ||
+            virFilePunchHole(fd, cur,
+                             MIN(len, sb.st_size - cur)) == 0) {
+            if (lseek(fd, len, SEEK_CUR) == (off_t) -1) {
+                virReportSystemError(errno, _("Unable to seek %s"), path);
+                return -1;
+            }
+            return 0;
+        }
+
+        if (errno != ENOSYS && errno != EOPNOTSUPP) {
+            virReportSystemError(errno, _("Unable to punch hole in %s"),
+                                 path);
+            return -1;
+        }
+    }
+
+    memset(buf, 0, buflen);
+    while (len) {
+        size_t want = len < buflen ? len : buflen;
+
+        if (safewrite(fd, buf, want) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"), path);
+            return -1;
+        }
+        len -= want;
+    }
+
+    return 0;
+}
+
+/* Writes the sparse records read from stdin out to the file */
+static int
+runSparseWrite(const char *path, int fd, unsigned long long length,
+               char *buf, size_t buflen)
+{
+    unsigned long long total = 0;
+    bool useSplice = true;
+    bool regular;
+    struct stat sb;
+    off_t end;
+
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, _("Unable to access %s"), path);
+        return -1;
+    }
+    regular = S_ISREG(sb.st_mode);
+
+    while (1) {
+        virFileSparseRecord rec;
+        ssize_t got;
+
+        if ((got = saferead(STDIN_FILENO, &rec, sizeof(rec))) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to read stdin"));
+            return -1;
+        }
+        if (got == 0)
+            break; /* End of data from client */
+        if (got != sizeof(rec)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("Truncated sparse record on stdin"));
+            return -1;
+        }
+
+        if (length && rec.length > length - total) {
+            virReportSystemError(ENOSPC, _("Unable to write %s"), path);
+            return -1;
+        }
+
+        switch ((virFileSparseRecordType) rec.type) {
+        case VIR_FILE_SPARSE_DATA:
+            if (copyData(STDIN_FILENO, "stdin", fd, path,
+                         rec.length, buf, buflen, &useSplice) < 0)
+                return -1;
+            break;
+
+        case VIR_FILE_SPARSE_HOLE:
+            if (skipHole(path, fd, regular, rec.length, buf, buflen) < 0)
+                return -1;
+            break;
+
+        default:
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("Unknown sparse record type %u"), rec.type);
+            return -1;
+        }
+
+        total += rec.length;
+    }
+
+    /* A trailing hole was only seeked over */
+    if (regular) {
+        if ((end = lseek(fd, 0, SEEK_CUR)) == (off_t) -1 ||
+            fstat(fd, &sb) < 0) {
+            virReportSystemError(errno, _("Unable to access %s"), path);
+            return -1;
+        }
+        if (end > sb.st_size && ftruncate(fd, end) < 0) {
+            virReportSystemError(errno, _("Unable to truncate %s"), path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+runSparse(const char *path, int fd, int oflags, unsigned long long length)
+{
+    char *buf = NULL;
+    size_t buflen = 1024*1024;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, buflen) < 0)
+        goto cleanup;
+
+    switch (oflags & O_ACCMODE) {
+    case O_RDONLY:
+        if (runSparseRead(path, fd, length, buf, buflen) < 0)
+            goto cleanup;
+        break;
+
+    case O_WRONLY:
+        if (runSparseWrite(path, fd, length, buf, buflen) < 0)
+            goto cleanup;
+        if (fdatasync(fd) < 0 && errno != EINVAL && errno != EROFS) {
+            virReportSystemError(errno, _("unable to fsync %s"), path);
+            goto cleanup;
+        }
+        break;
+
+    case O_RDWR:
+    default:
+        virReportSystemError(EINVAL,
+                             _("Unable to process file with flags %d"),
+                             (oflags & O_ACCMODE));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0 &&
+        ret == 0) {
+        virReportSystemError(errno, _("Unable to close %s"), path);
+        ret = -1;
+    }
+
+    VIR_FREE(buf);
+    return ret;
+}
+
 static int
 runIO(const char *path, int fd, int oflags, unsigned long long length)
 {
@@ -85,6 +373,7 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
     const char *fdinname, *fdoutname;
     unsigned long long total = 0;
     bool direct = O_DIRECT && ((oflags & O_DIRECT) != 0);
+    bool useSplice = !direct;
     bool shortRead = false; /* true if we hit a short read */
     off_t end = 0;
 
@@ -147,6 +436,22 @@ runIO(const char *path, int fd, int oflags, unsigned long long length)
         if (buflen == 0)
             break; /* End of requested data from client */
 
+        if (useSplice) {
+            if ((got = spliceData(fdin, fdout, buflen)) < 0) {
+                if (errno == EINVAL || errno == ENOSYS) {
+                    useSplice = false;
+                    continue;
+                }
+                virReportSystemError(errno, _("Unable to copy %s to %s"),
+                                     fdinname, fdoutname);
+                goto cleanup;
+            }
+            if (got == 0)
+                break; /* End of file before end of requested data */
+            total += got;
+            continue;
+        }
+
         if ((got = saferead(fdin, buf, buflen)) < 0) {
             virReportSystemError(errno, _("Unable to read %s"), fdinname);
             goto cleanup;
@@ -209,8 +514,10 @@ usage(int status)
         fprintf(stderr, _("%s: try --help for more details"), program_name);
     } else {
         printf(_("Usage: %s FILENAME OFLAGS MODE OFFSET LENGTH DELETE\n"
-                 "   or: %s FILENAME LENGTH FD\n"),
-               program_name, program_name);
+                 "   or: %s FILENAME LENGTH FD [--sparse]\n"
+                 "   or: %s --compress THREADS\n"
+                 "   or: %s --decompress THREADS\n"),
+               program_name, program_name, program_name, program_name);
     }
     exit(status);
 }
@@ -227,6 +534,7 @@ main(int argc, char **argv)
     unsigned int delete = 0;
     int fd = -1;
     int lengthIndex = 0;
+    bool sparse = false;
 
     program_name = argv[0];
 
@@ -247,7 +555,27 @@ main(int argc, char **argv)
 
     if (argc > 1 && STREQ(argv[1], "--help"))
         usage(EXIT_SUCCESS);
-    if (argc == 7) { /* FILENAME OFLAGS MODE OFFSET LENGTH DELETE */
+    if (argc == 3 &&
+        (STREQ(argv[1], "--compress") || STREQ(argv[1], "--decompress"))) {
+        unsigned int nthreads;
+        int rc;
+
+        if (virStrToLong_ui(argv[2], NULL, 10, &nthreads) < 0) {
+            fprintf(stderr, _("%s: malformed thread count %s"),
+                    program_name, argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        path = "stdin";
+        if (STREQ(argv[1], "--compress"))
+            rc = virCompressStream(STDIN_FILENO, "stdin",
+                                   STDOUT_FILENO, "stdout", nthreads);
+        else
+            rc = virDecompressStream(STDIN_FILENO, "stdin",
+                                     STDOUT_FILENO, "stdout", nthreads);
+        if (rc < 0)
+            goto error;
+        return 0;
+    } else if (argc == 7) { /* FILENAME OFLAGS MODE OFFSET LENGTH DELETE */
         lengthIndex = 5;
         if (virStrToLong_i(argv[2], NULL, 10, &oflags) < 0) {
             fprintf(stderr, _("%s: malformed file flags %s"),
@@ -270,8 +598,10 @@ main(int argc, char **argv)
             exit(EXIT_FAILURE);
         }
         fd = prepare(path, oflags, mode, offset);
-    } else if (argc == 4) { /* FILENAME LENGTH FD */
+    } else if (argc == 4 || /* FILENAME LENGTH FD */
+               (argc == 5 && STREQ(argv[4], "--sparse"))) {
         lengthIndex = 2;
+        sparse = argc == 5;
         if (virStrToLong_i(argv[3], NULL, 10, &fd) < 0) {
             fprintf(stderr, _("%s: malformed fd %s"),
                     program_name, argv[3]);
@@ -301,8 +631,15 @@ main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if (fd < 0 || runIO(path, fd, oflags, length) < 0)
+    if (fd < 0)
+        goto error;
+
+    if (sparse) {
+        if (runSparse(path, fd, oflags, length) < 0)
+            goto error;
+    } else if (runIO(path, fd, oflags, length) < 0) {
         goto error;
+    }
 
     if (delete)
         unlink(path);
@@ -152,6 +152,32 @@ int virBitmapClearBit(virBitmapPtr bitmap, size_t b)
     return 0;
 }
 
+/* Set bits @start to @last inclusive a word at a time. Returns -1
+ * if the range doesn't fit in @bitmap */
+static int virBitmapSetBitRange(virBitmapPtr bitmap, size_t start, size_t last)
+{
+    size_t nl = VIR_BITMAP_UNIT_OFFSET(start);
+    size_t ml = VIR_BITMAP_UNIT_OFFSET(last);
+    unsigned long first = -1UL << VIR_BITMAP_BIT_OFFSET(start);
+    unsigned long tail = -1UL >> (VIR_BITMAP_BITS_PER_UNIT - 1 -
+                                  VIR_BITMAP_BIT_OFFSET(last));
+
+    if (last < start || bitmap->max_bit <= last)
+        return -1;
+
+    if (nl == ml) {
+        bitmap->map[nl] |= first & tail;
+        return 0;
+    }
+
+    bitmap->map[nl++] |= first;
+    while (nl < ml)
+        bitmap->map[nl++] = -1UL;
+    bitmap->map[ml] |= tail;
+
+    return 0;
+}
+
 /* Helper function. caller must ensure b < bitmap->max_bit */
 static bool virBitmapIsSet(virBitmapPtr bitmap, size_t b)
 {
@@ -225,40 +251,37 @@ char *virBitmapFormat(virBitmapPtr bitmap)
 {
     virBuffer buf = VIR_BUFFER_INITIALIZER;
     bool first = true;
-    int start, cur, prev;
+    ssize_t start, last;
 
     if (!bitmap)
         return NULL;
 
-    cur = virBitmapNextSetBit(bitmap, -1);
-    if (cur < 0) {
+    start = virBitmapNextSetBit(bitmap, -1);
+    if (start < 0) {
         char *ret;
         ignore_value(VIR_STRDUP(ret, ""));
         return ret;
     }
 
-    start = prev = cur;
-    while (prev >= 0) {
-        cur = virBitmapNextSetBit(bitmap, prev);
-
-        if (cur == prev + 1) {
-            prev = cur;
-            continue;
-        }
-
-        /* cur < 0 or cur > prev + 1 */
+    /* Find each run of set bits by searching for its end, rather
+     * than stepping through it bit by bit */
+    while (start >= 0) {
+        last = virBitmapNextClearBit(bitmap, start);
+        if (last < 0)
+            last = bitmap->max_bit;
+        last--;
 
         if (!first)
             virBufferAddLit(&buf, ",");
         else
             first = false;
 
-        if (prev == start)
-            virBufferAsprintf(&buf, "%d", start);
+        if (last == start)
+            virBufferAsprintf(&buf, "%zd", start);
         else
-            virBufferAsprintf(&buf, "%d-%d", start, prev);
+            virBufferAsprintf(&buf, "%zd-%zd", start, last);
 
-        start = prev = cur;
+        start = virBitmapNextSetBit(bitmap, last);
     }
 
     if (virBufferError(&buf)) {
@@ -300,7 +323,6 @@ virBitmapParse(const char *str,
     bool neg = false;
     const char *cur = str;
     char *tmp;
-    size_t i;
     int start, last;
 
     if (!(*bitmap = virBitmapNew(bitmapSize)))
@@ -360,10 +382,8 @@ virBitmapParse(const char *str,
 
             cur = tmp;
 
-            for (i = start; i <= last; i++) {
-                if (virBitmapSetBit(*bitmap, i) < 0)
-                    goto error;
-            }
+            if (virBitmapSetBitRange(*bitmap, start, last) < 0)
+                goto error;
 
             virSkipSpaces(&cur);
         }
@@ -708,3 +728,149 @@ virBitmapCountBits(virBitmapPtr bitmap)
 
     return ret;
 }
+
+/**
+ * virBitmapIntersect:
+ * @a: bitmap, modified to hold the result
+ * @b: other bitmap
+ *
+ * Clear each bit in @a that is not also set in @b. Bits of @a past
+ * the end of @b are cleared as well.
+ */
+void
+virBitmapIntersect(virBitmapPtr a, virBitmapPtr b)
+{
+    size_t i;
+
+    for (i = 0; i < a->map_len && i < b->map_len; i++)
+        a->map[i] &= b->map[i];
+
+    for (; i < a->map_len; i++)
+        a->map[i] = 0;
+}
+
+/**
+ * virBitmapUnion:
+ * @a: bitmap, modified to hold the result
+ * @b: other bitmap
+ *
+ * Set each bit in @a that is set in @b.
+ *
+ * Returns 0 on success, or -1 if @b has a bit set past the end of
+ * @a, in which case @a is left unchanged.
+ */
+int
+virBitmapUnion(virBitmapPtr a, virBitmapPtr b)
+{
+    size_t i;
+
+    if (b->max_bit > a->max_bit &&
+        virBitmapNextSetBit(b, a->max_bit - 1) >= 0)
+        return -1;
+
+    for (i = 0; i < a->map_len && i < b->map_len; i++)
+        a->map[i] |= b->map[i];
+
+    return 0;
+}
+
+/**
+ * virBitmapSubtract:
+ * @a: bitmap, modified to hold the result
+ * @b: other bitmap
+ *
+ * Clear each bit in @a that is set in @b.
+ */
+void
+virBitmapSubtract(virBitmapPtr a, virBitmapPtr b)
+{
+    size_t i;
+
+    for (i = 0; i < a->map_len && i < b->map_len; i++)
+        a->map[i] &= ~b->map[i];
+}
+
+/**
+ * virBitmapOverlaps:
+ * @b1: bitmap 1
+ * @b2: bitmap 2
+ *
+ * Returns true if at least one bit is set in both bitmaps.
+ */
+bool
+virBitmapOverlaps(virBitmapPtr b1, virBitmapPtr b2)
+{
+    size_t i;
+
+    for (i = 0; i < b1->map_len && i < b2->map_len; i++) {
+        if (b1->map[i] & b2->map[i])
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * virBitmapIsSubset:
+ * @sub: bitmap to check
+ * @super: bitmap to check against
+ *
+ * Returns true if every bit set in @sub is also set in @super. The
+ * bitmaps may have different sizes.
+ */
+bool
+virBitmapIsSubset(virBitmapPtr sub, virBitmapPtr super)
+{
+    size_t i;
+
+    for (i = 0; i < sub->map_len && i < super->map_len; i++) {
+        if (sub->map[i] & ~super->map[i])
+            return false;
+    }
+
+    for (; i < sub->map_len; i++) {
+        if (sub->map[i])
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * virBitmapNextClearRange:
+ * @bitmap: the bitmap
+ * @pos: the position after which to search
+ * @count: number of consecutive clear bits wanted
+ *
+ * Search for the first run of at least @count clear bits starting
+ * after position @pos. @pos can be -1 to search from the start.
+ *
+ * Returns the position of the first bit of the run, or -1 if there
+ * is no such run or @count is 0.
+ */
+ssize_t
+virBitmapNextClearRange(virBitmapPtr bitmap, ssize_t pos, size_t count)
+{
+    ssize_t start;
+    ssize_t end;
+
+    if (count == 0)
+        return -1;
+
+    start = virBitmapNextClearBit(bitmap, pos);
+    while (start >= 0) {
+        end = virBitmapNextSetBit(bitmap, start);
+        if (end < 0)
+            end = bitmap->max_bit;
+
+        if (end - start >= count)
+            return start;
+
+        if (end == bitmap->max_bit)
+            break;
+
+        start = virBitmapNextClearBit(bitmap, end);
+    }
+
+    return -1;
+}
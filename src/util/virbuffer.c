@@ -124,7 +124,11 @@ virBufferGrow(virBufferPtr buf, unsigned int len)
     if ((len + buf->use) < buf->size)
         return 0;
 
+    /* Grow at least geometrically so that building a large
+     * document does not take a quadratic number of copies */
     size = buf->use + len + 1000;
+    if (buf->size < INT_MAX / 2 && size < (int) buf->size * 2)
+        size = buf->size * 2;
 
     if (VIR_REALLOC_N_QUIET(buf->content, size) < 0) {
         virBufferSetError(buf, errno);
@@ -21,6 +21,7 @@
 
 #include <config.h>
 
+#include <dirent.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -28,6 +29,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#if HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
 
 #if WITH_CAPNG
 # include <cap-ng.h>
@@ -389,6 +393,253 @@ virCommandHandshakeChild(virCommandPtr cmd)
     return 0;
 }
 
+/*
+ * Whether @fd must survive into the child, either as the source of
+ * its stdio or because it was passed with virCommandPassFD
+ */
+static bool
+virCommandFDIsKept(virCommandPtr cmd, int fd,
+                   int childin, int childout, int childerr)
+{
+    return fd == childin || fd == childout || fd == childerr ||
+        virCommandFDIsSet(cmd, fd);
+}
+
+# if HAVE_CLOSE_RANGE
+/*
+ * Close the gaps between the fds to keep with one close_range()
+ * each. Returns -1 with errno set if the kernel lacks it.
+ */
+static int
+virCommandMassCloseRange(virCommandPtr cmd,
+                         int childin, int childout, int childerr)
+{
+    int first = STDERR_FILENO + 1;
+
+    for (;;) {
+        int keep[] = { childin, childout, childerr };
+        int next = -1;
+        size_t i;
+
+        for (i = 0; i < ARRAY_CARDINALITY(keep); i++) {
+            if (keep[i] >= first && (next < 0 || keep[i] < next))
+                next = keep[i];
+        }
+        for (i = 0; i < cmd->npassfd; i++) {
+            int fd = cmd->passfd[i].fd;
+            if (fd >= first && (next < 0 || fd < next))
+                next = fd;
+        }
+
+        if (next < 0)
+            return close_range(first, ~0U, 0);
+
+        if (next > first && close_range(first, next - 1, 0) < 0)
+            return -1;
+        first = next + 1;
+    }
+}
+# endif /* HAVE_CLOSE_RANGE */
+
+# ifdef __linux__
+/*
+ * Close only the fds which are actually open, as listed in
+ * /proc/self/fd. Returns -1 if that cannot be read.
+ */
+static int
+virCommandMassCloseProc(virCommandPtr cmd,
+                        int childin, int childout, int childerr)
+{
+    DIR *dir;
+    struct dirent *ent;
+    int procfd;
+
+    if (!(dir = opendir("/proc/self/fd")))
+        return -1;
+    procfd = dirfd(dir);
+
+    /* Entries are keyed by fd number, so closing fds while
+     * reading does not make us skip any */
+    while ((ent = readdir(dir))) {
+        int fd;
+
+        if (virStrToLong_i(ent->d_name, NULL, 10, &fd) < 0 ||
+            fd <= STDERR_FILENO || fd == procfd ||
+            virCommandFDIsKept(cmd, fd, childin, childout, childerr))
+            continue;
+
+        VIR_MASS_CLOSE(fd);
+    }
+
+    closedir(dir);
+    return 0;
+}
+# endif /* __linux__ */
+
+/*
+ * Close every fd above stderr in the child, other than those it
+ * is meant to keep, and make the passed ones inheritable. With a
+ * raised open files limit, walking each possible fd would take
+ * millions of close() calls, so close_range() or the list of open
+ * fds are used where available.
+ */
+static int
+virCommandMassClose(virCommandPtr cmd,
+                    int childin, int childout, int childerr)
+{
+    int openmax;
+    int fd;
+    size_t i;
+
+    for (i = 0; i < cmd->npassfd; i++) {
+        fd = cmd->passfd[i].fd;
+        if (fd == childin || fd == childout || fd == childerr)
+            continue;
+        if (virSetInherit(fd, true) < 0) {
+            virReportSystemError(errno, _("failed to preserve fd %d"), fd);
+            return -1;
+        }
+    }
+
+# if HAVE_CLOSE_RANGE
+    if (virCommandMassCloseRange(cmd, childin, childout, childerr) == 0)
+        return 0;
+# endif
+# ifdef __linux__
+    if (virCommandMassCloseProc(cmd, childin, childout, childerr) == 0)
+        return 0;
+# endif
+
+    openmax = sysconf(_SC_OPEN_MAX);
+    if (openmax < 0) {
+        virReportSystemError(errno,  "%s",
+                             _("sysconf(_SC_OPEN_MAX) failed"));
+        return -1;
+    }
+    for (fd = STDERR_FILENO + 1; fd < openmax; fd++) {
+        int tmpfd = fd;
+
+        if (virCommandFDIsKept(cmd, fd, childin, childout, childerr))
+            continue;
+        VIR_MASS_CLOSE(tmpfd);
+    }
+
+    return 0;
+}
+
+# if HAVE_POSIX_SPAWN && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/*
+ * virExecSpawn:
+ *
+ * Start @cmd with posix_spawn() instead of fork(), which on Linux
+ * shares the address space with the child until it execs rather
+ * than copying the page tables of a possibly huge daemon. This is
+ * only possible when nothing has to be done in the child besides
+ * setting up stdio and closing all other fds, as is the case for
+ * most of the helpers we run.
+ *
+ * Returns 1 if the child was started, 0 if @cmd needs a full
+ * fork(), -1 on error
+ */
+static int
+virExecSpawn(virCommandPtr cmd, const char *binary,
+             int childin, int childout, int childerr,
+             pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    int rc;
+    int ret = -1;
+
+    if (cmd->hook || cmd->handshake || cmd->pwd || cmd->npassfd ||
+        (cmd->flags & (VIR_EXEC_DAEMON | VIR_EXEC_CLEAR_CAPS)) ||
+        cmd->capabilities ||
+        cmd->uid != (uid_t)-1 || cmd->gid != (gid_t)-1 ||
+        cmd->maxMemLock || cmd->maxProcesses || cmd->maxFiles)
+        return 0;
+#  if defined(WITH_SECDRIVER_SELINUX)
+    if (cmd->seLinuxLabel)
+        return 0;
+#  endif
+#  if defined(WITH_SECDRIVER_APPARMOR)
+    if (cmd->appArmorProfile)
+        return 0;
+#  endif
+
+    /* Keep the dup2() actions below simple, a stdio source which is
+     * already one of the standard fds is left to the fork() path */
+    if (childin <= STDERR_FILENO || childout <= STDERR_FILENO ||
+        childerr <= STDERR_FILENO)
+        return 0;
+
+    /* A binary which cannot be run has to show up as a child
+     * failing to exec, just as it does after fork() */
+    if (!virFileIsExecutable(binary))
+        return 0;
+
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0) {
+        virReportSystemError(rc, "%s", _("cannot prepare child process"));
+        return -1;
+    }
+    if ((rc = posix_spawnattr_init(&attr)) != 0) {
+        virReportSystemError(rc, "%s", _("cannot prepare child process"));
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    /* Same signal state as virFork() leaves the child in */
+    sigfillset(&mask);
+    if ((rc = posix_spawnattr_setsigdefault(&attr, &mask)) != 0)
+        goto error;
+    sigemptyset(&mask);
+    if ((rc = posix_spawnattr_setsigmask(&attr, &mask)) != 0 ||
+        (rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                       POSIX_SPAWN_SETSIGMASK)) != 0)
+        goto error;
+
+    if ((rc = posix_spawn_file_actions_adddup2(&actions, childin,
+                                               STDIN_FILENO)) != 0 ||
+        (rc = posix_spawn_file_actions_adddup2(&actions, childout,
+                                               STDOUT_FILENO)) != 0 ||
+        (rc = posix_spawn_file_actions_adddup2(&actions, childerr,
+                                               STDERR_FILENO)) != 0 ||
+        (rc = posix_spawn_file_actions_addclosefrom_np(&actions,
+                                                       STDERR_FILENO + 1)) != 0)
+        goto error;
+
+    if ((rc = posix_spawn(pid, binary, &actions, &attr, cmd->args,
+                          cmd->env ? cmd->env : environ)) != 0) {
+        virReportSystemError(rc, _("cannot execute binary %s"),
+                             cmd->args[0]);
+        goto cleanup;
+    }
+
+    VIR_DEBUG("Spawned %s as %lld", binary, (long long) *pid);
+    ret = 1;
+
+cleanup:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+
+error:
+    virReportSystemError(rc, "%s", _("cannot prepare child process"));
+    goto cleanup;
+}
+# else /* !(HAVE_POSIX_SPAWN && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP) */
+static int
+virExecSpawn(virCommandPtr cmd ATTRIBUTE_UNUSED,
+             const char *binary ATTRIBUTE_UNUSED,
+             int childin ATTRIBUTE_UNUSED,
+             int childout ATTRIBUTE_UNUSED,
+             int childerr ATTRIBUTE_UNUSED,
+             pid_t *pid ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+# endif /* !(HAVE_POSIX_SPAWN && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP) */
+
 /*
  * virExec:
  * @cmd virCommandPtr containing all information about the program to
@@ -398,16 +649,16 @@ static int
 virExec(virCommandPtr cmd)
 {
     pid_t pid;
-    int null = -1, fd, openmax;
+    int null = -1;
     int pipeout[2] = {-1,-1};
     int pipeerr[2] = {-1,-1};
     int childin = cmd->infd;
     int childout = -1;
     int childerr = -1;
-    int tmpfd;
     char *binarystr = NULL;
     const char *binary = NULL;
     int forkRet, ret;
+    int spawned;
     struct sigaction waxon, waxoff;
     gid_t *groups = NULL;
     int ngroups;
@@ -484,7 +735,11 @@ virExec(virCommandPtr cmd)
     if ((ngroups = virGetGroupList(cmd->uid, cmd->gid, &groups)) < 0)
         goto cleanup;
 
-    forkRet = virFork(&pid);
+    if ((spawned = virExecSpawn(cmd, binary, childin, childout, childerr,
+                                &pid)) < 0)
+        goto cleanup;
+
+    forkRet = spawned ? 0 : virFork(&pid);
 
     if (pid < 0) {
         goto cleanup;
@@ -522,23 +777,8 @@ virExec(virCommandPtr cmd)
         goto fork_error;
     }
 
-    openmax = sysconf(_SC_OPEN_MAX);
-    if (openmax < 0) {
-        virReportSystemError(errno,  "%s",
-                             _("sysconf(_SC_OPEN_MAX) failed"));
+    if (virCommandMassClose(cmd, childin, childout, childerr) < 0)
         goto fork_error;
-    }
-    for (fd = 3; fd < openmax; fd++) {
-        if (fd == childin || fd == childout || fd == childerr)
-            continue;
-        if (!virCommandFDIsSet(cmd, fd)) {
-            tmpfd = fd;
-            VIR_MASS_CLOSE(tmpfd);
-        } else if (virSetInherit(fd, true) < 0) {
-            virReportSystemError(errno, _("failed to preserve fd %d"), fd);
-            goto fork_error;
-        }
-    }
 
     if (prepareStdFd(childin, STDIN_FILENO) < 0) {
         virReportSystemError(errno,
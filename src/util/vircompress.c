@@ -0,0 +1,650 @@
+/*
+ * vircompress.c: block parallel compression of save image streams
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#if WITH_LZ4
+# include <lz4.h>
+#endif
+#include <string.h>
+#include <unistd.h>
+
+#include "vircompress.h"
+#include "viralloc.h"
+#include "virendian.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virthread.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+/*
+ * Stream layout, all integers are big endian:
+ *
+ *   header:  "LibvirtC", uint32 version, uint32 block size
+ *   block:   uint32 raw length, uint32 payload length, uint32 flags,
+ *            zero page bitmap, payload
+ *   trailer: a block header with a raw length of 0
+ *
+ * The bitmap has one bit per page of the raw block, set when the page
+ * contains only zeros and was left out of the payload.  The payload
+ * holds the remaining pages back to back, LZ4 compressed if the block
+ * flags say so.  Since every block can be decoded on its own, both
+ * directions hand blocks to a pool of worker threads while the
+ * calling thread reads and writes the stream strictly in order.
+ */
+
+#define VIR_COMPRESS_MAGIC "LibvirtC"
+#define VIR_COMPRESS_VERSION 1
+
+#define VIR_COMPRESS_HEADER_LEN (sizeof(VIR_COMPRESS_MAGIC) - 1 + 8)
+#define VIR_COMPRESS_BLOCK_HEADER_LEN 12
+
+#define VIR_COMPRESS_PAGE_SIZE 4096
+#define VIR_COMPRESS_BLOCK_SIZE (1024 * 1024)
+#define VIR_COMPRESS_BLOCK_SIZE_MAX (64 * 1024 * 1024)
+#define VIR_COMPRESS_BITMAP_LEN(len)                            \
+    (((len) + VIR_COMPRESS_PAGE_SIZE * 8 - 1) /                 \
+     (VIR_COMPRESS_PAGE_SIZE * 8))
+
+#define VIR_COMPRESS_THREADS_MAX 16
+
+enum {
+    VIR_COMPRESS_BLOCK_LZ4 = (1 << 0),
+
+    VIR_COMPRESS_BLOCK_FLAGS = VIR_COMPRESS_BLOCK_LZ4,
+};
+
+typedef struct _virCompressBlock virCompressBlock;
+typedef virCompressBlock *virCompressBlockPtr;
+struct _virCompressBlock {
+    char *in;           /* data read from the input stream */
+    size_t inlen;
+    char *out;          /* data to be written to the output stream */
+    size_t outlen;
+    char *scratch;      /* the non-zero pages of the block */
+
+    /* Taken from the block header when decompressing */
+    size_t rawlen;
+    unsigned int flags;
+
+    bool done;
+    bool failed;
+    virErrorPtr error;
+};
+
+typedef struct _virCompressPipeline virCompressPipeline;
+typedef virCompressPipeline *virCompressPipelinePtr;
+
+typedef int (*virCompressReadFunc)(virCompressPipelinePtr pipeline,
+                                   int fd, const char *name,
+                                   virCompressBlockPtr block);
+typedef int (*virCompressProcessFunc)(virCompressBlockPtr block);
+
+struct _virCompressPipeline {
+    virMutex lock;
+    virCond queueCond;  /* a block was queued or quit was set */
+    virCond doneCond;   /* a worker finished a block */
+    bool quit;
+
+    size_t blocksize;
+    virCompressReadFunc readBlock;
+    virCompressProcessFunc processBlock;
+
+    virCompressBlockPtr blocks;
+    size_t nblocks;
+    unsigned long long queued;  /* blocks handed to the workers */
+    unsigned long long taken;   /* blocks picked up by a worker */
+
+    virThreadPtr threads;
+    size_t nthreads;
+};
+
+
+bool
+virCompressAvailable(void)
+{
+#if WITH_LZ4
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+static void
+virCompressWriteInt32BE(char *buf, uint32_t val)
+{
+    buf[0] = (val >> 24) & 0xff;
+    buf[1] = (val >> 16) & 0xff;
+    buf[2] = (val >> 8) & 0xff;
+    buf[3] = val & 0xff;
+}
+
+
+static bool
+virCompressPageIsZero(const char *page, size_t len)
+{
+    return page[0] == 0 && memcmp(page, page + 1, len - 1) == 0;
+}
+
+
+static int
+virCompressBlockEncode(virCompressBlockPtr block)
+{
+    size_t bitmaplen = VIR_COMPRESS_BITMAP_LEN(block->inlen);
+    char *bitmap = block->out + VIR_COMPRESS_BLOCK_HEADER_LEN;
+    char *payload = bitmap + bitmaplen;
+    size_t datalen = 0;
+    size_t offset;
+    size_t i;
+    unsigned int flags = 0;
+
+    memset(bitmap, 0, bitmaplen);
+    for (i = 0, offset = 0; offset < block->inlen;
+         i++, offset += VIR_COMPRESS_PAGE_SIZE) {
+        size_t len = MIN(VIR_COMPRESS_PAGE_SIZE, block->inlen - offset);
+
+        if (virCompressPageIsZero(block->in + offset, len)) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            continue;
+        }
+        memcpy(block->scratch + datalen, block->in + offset, len);
+        datalen += len;
+    }
+
+#if WITH_LZ4
+    if (datalen) {
+        /* A zero return means the result would not be smaller than
+         * the input, in which case the pages are stored as they are */
+        int rc = LZ4_compress_default(block->scratch, payload,
+                                      datalen, datalen);
+        if (rc > 0) {
+            datalen = rc;
+            flags |= VIR_COMPRESS_BLOCK_LZ4;
+        }
+    }
+#endif
+    if (!(flags & VIR_COMPRESS_BLOCK_LZ4))
+        memcpy(payload, block->scratch, datalen);
+
+    virCompressWriteInt32BE(block->out, block->inlen);
+    virCompressWriteInt32BE(block->out + 4, datalen);
+    virCompressWriteInt32BE(block->out + 8, flags);
+    block->outlen = VIR_COMPRESS_BLOCK_HEADER_LEN + bitmaplen + datalen;
+
+    return 0;
+}
+
+
+static int
+virCompressBlockDecode(virCompressBlockPtr block)
+{
+    size_t bitmaplen = VIR_COMPRESS_BITMAP_LEN(block->rawlen);
+    const char *bitmap = block->in;
+    const char *payload = bitmap + bitmaplen;
+    size_t payloadlen = block->inlen - bitmaplen;
+    const char *data = payload;
+    size_t datalen = 0;
+    size_t offset;
+    size_t i;
+
+    for (i = 0, offset = 0; offset < block->rawlen;
+         i++, offset += VIR_COMPRESS_PAGE_SIZE) {
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+            datalen += MIN(VIR_COMPRESS_PAGE_SIZE, block->rawlen - offset);
+    }
+
+    if (block->flags & VIR_COMPRESS_BLOCK_LZ4) {
+#if WITH_LZ4
+        int rc = LZ4_decompress_safe(payload, block->scratch,
+                                     payloadlen, datalen);
+        if (rc < 0 || (size_t) rc != datalen) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("corrupted compressed block in stream"));
+            return -1;
+        }
+        data = block->scratch;
+#else
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("LZ4 decompression is not supported "
+                         "by this build"));
+        return -1;
+#endif
+    } else if (payloadlen != datalen) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("stored block length %zu does not match "
+                         "expected length %zu"),
+                       payloadlen, datalen);
+        return -1;
+    }
+
+    for (i = 0, offset = 0; offset < block->rawlen;
+         i++, offset += VIR_COMPRESS_PAGE_SIZE) {
+        size_t len = MIN(VIR_COMPRESS_PAGE_SIZE, block->rawlen - offset);
+
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            memset(block->out + offset, 0, len);
+        } else {
+            memcpy(block->out + offset, data, len);
+            data += len;
+        }
+    }
+    block->outlen = block->rawlen;
+
+    return 0;
+}
+
+
+/* Returns 1 if a block was read, 0 at the end of the input */
+static int
+virCompressReadRaw(virCompressPipelinePtr pipeline,
+                   int fd, const char *name,
+                   virCompressBlockPtr block)
+{
+    ssize_t got;
+
+    if ((got = saferead(fd, block->in, pipeline->blocksize)) < 0) {
+        virReportSystemError(errno, _("Unable to read %s"), name);
+        return -1;
+    }
+    block->inlen = got;
+
+    return got > 0 ? 1 : 0;
+}
+
+
+/* Returns 1 if a block was read, 0 once the trailer was reached */
+static int
+virCompressReadEncoded(virCompressPipelinePtr pipeline,
+                       int fd, const char *name,
+                       virCompressBlockPtr block)
+{
+    char header[VIR_COMPRESS_BLOCK_HEADER_LEN];
+    size_t rawlen;
+    size_t datalen;
+    ssize_t got;
+
+    if ((got = saferead(fd, header, sizeof(header))) < 0) {
+        virReportSystemError(errno, _("Unable to read %s"), name);
+        return -1;
+    }
+    if (got != sizeof(header)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unexpected end of compressed stream in %s"), name);
+        return -1;
+    }
+
+    rawlen = virReadBufInt32BE(header);
+    datalen = virReadBufInt32BE(header + 4);
+    block->flags = virReadBufInt32BE(header + 8);
+
+    if (rawlen == 0)
+        return 0;
+
+    if (rawlen > pipeline->blocksize ||
+        datalen > rawlen ||
+        (block->flags & ~VIR_COMPRESS_BLOCK_FLAGS)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("malformed block header in compressed stream %s"),
+                       name);
+        return -1;
+    }
+
+    block->rawlen = rawlen;
+    block->inlen = VIR_COMPRESS_BITMAP_LEN(rawlen) + datalen;
+
+    if ((got = saferead(fd, block->in, block->inlen)) < 0) {
+        virReportSystemError(errno, _("Unable to read %s"), name);
+        return -1;
+    }
+    if (got != block->inlen) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unexpected end of compressed stream in %s"), name);
+        return -1;
+    }
+
+    return 1;
+}
+
+
+static void
+virCompressWorker(void *opaque)
+{
+    virCompressPipelinePtr pipeline = opaque;
+    virCompressBlockPtr block;
+
+    virMutexLock(&pipeline->lock);
+    while (true) {
+        while (!pipeline->quit && pipeline->taken == pipeline->queued)
+            ignore_value(virCondWait(&pipeline->queueCond, &pipeline->lock));
+        if (pipeline->quit)
+            break;
+
+        block = &pipeline->blocks[pipeline->taken++ % pipeline->nblocks];
+        virMutexUnlock(&pipeline->lock);
+
+        if (pipeline->processBlock(block) < 0) {
+            block->failed = true;
+            block->error = virSaveLastError();
+        }
+
+        virMutexLock(&pipeline->lock);
+        block->done = true;
+        virCondBroadcast(&pipeline->doneCond);
+    }
+    virMutexUnlock(&pipeline->lock);
+}
+
+
+static void
+virCompressPipelineFree(virCompressPipelinePtr pipeline)
+{
+    size_t i;
+
+    if (!pipeline)
+        return;
+
+    virMutexLock(&pipeline->lock);
+    pipeline->quit = true;
+    virCondBroadcast(&pipeline->queueCond);
+    virMutexUnlock(&pipeline->lock);
+
+    for (i = 0; i < pipeline->nthreads; i++)
+        virThreadJoin(&pipeline->threads[i]);
+    VIR_FREE(pipeline->threads);
+
+    for (i = 0; i < pipeline->nblocks; i++) {
+        VIR_FREE(pipeline->blocks[i].in);
+        VIR_FREE(pipeline->blocks[i].out);
+        VIR_FREE(pipeline->blocks[i].scratch);
+        virFreeError(pipeline->blocks[i].error);
+    }
+    VIR_FREE(pipeline->blocks);
+
+    virCondDestroy(&pipeline->queueCond);
+    virCondDestroy(&pipeline->doneCond);
+    virMutexDestroy(&pipeline->lock);
+    VIR_FREE(pipeline);
+}
+
+
+static virCompressPipelinePtr
+virCompressPipelineNew(unsigned int nthreads,
+                       size_t blocksize,
+                       virCompressReadFunc readBlock,
+                       virCompressProcessFunc processBlock)
+{
+    virCompressPipelinePtr pipeline;
+    size_t buflen = VIR_COMPRESS_BLOCK_HEADER_LEN +
+        VIR_COMPRESS_BITMAP_LEN(blocksize) + blocksize;
+    size_t i;
+
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+    nthreads = MIN(nthreads, VIR_COMPRESS_THREADS_MAX);
+
+    if (VIR_ALLOC(pipeline) < 0)
+        return NULL;
+
+    if (virMutexInit(&pipeline->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        VIR_FREE(pipeline);
+        return NULL;
+    }
+    if (virCondInit(&pipeline->queueCond) < 0 ||
+        virCondInit(&pipeline->doneCond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        virMutexDestroy(&pipeline->lock);
+        VIR_FREE(pipeline);
+        return NULL;
+    }
+
+    pipeline->blocksize = blocksize;
+    pipeline->readBlock = readBlock;
+    pipeline->processBlock = processBlock;
+
+    /* Two blocks per thread keep the workers busy while the
+     * calling thread waits on input or output */
+    if (VIR_ALLOC_N(pipeline->blocks, nthreads * 2) < 0)
+        goto error;
+    pipeline->nblocks = nthreads * 2;
+
+    for (i = 0; i < pipeline->nblocks; i++) {
+        if (VIR_ALLOC_N(pipeline->blocks[i].in, buflen) < 0 ||
+            VIR_ALLOC_N(pipeline->blocks[i].out, buflen) < 0 ||
+            VIR_ALLOC_N(pipeline->blocks[i].scratch, buflen) < 0)
+            goto error;
+    }
+
+    if (VIR_ALLOC_N(pipeline->threads, nthreads) < 0)
+        goto error;
+
+    for (i = 0; i < nthreads; i++) {
+        if (virThreadCreate(&pipeline->threads[i], true,
+                            virCompressWorker, pipeline) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create compression thread"));
+            goto error;
+        }
+        pipeline->nthreads++;
+    }
+
+    VIR_DEBUG("Started %zu compression threads, block size %zu",
+              pipeline->nthreads, blocksize);
+
+    return pipeline;
+
+error:
+    virCompressPipelineFree(pipeline);
+    return NULL;
+}
+
+
+/* Feed the input through the workers, writing their results to the
+ * output in the order the input was read */
+static int
+virCompressPipelineRun(virCompressPipelinePtr pipeline,
+                       int infd, const char *inname,
+                       int outfd, const char *outname)
+{
+    virCompressBlockPtr block;
+    unsigned long long nread = 0;
+    unsigned long long nwritten = 0;
+    bool eof = false;
+    int rc;
+
+    while (true) {
+        while (!eof && nread - nwritten < pipeline->nblocks) {
+            block = &pipeline->blocks[nread % pipeline->nblocks];
+
+            if ((rc = pipeline->readBlock(pipeline, infd, inname, block)) < 0)
+                return -1;
+            if (rc == 0) {
+                eof = true;
+                break;
+            }
+
+            virMutexLock(&pipeline->lock);
+            block->done = false;
+            pipeline->queued++;
+            virCondSignal(&pipeline->queueCond);
+            virMutexUnlock(&pipeline->lock);
+            nread++;
+        }
+
+        if (nwritten == nread)
+            break;
+
+        block = &pipeline->blocks[nwritten % pipeline->nblocks];
+
+        virMutexLock(&pipeline->lock);
+        while (!block->done)
+            ignore_value(virCondWait(&pipeline->doneCond, &pipeline->lock));
+        virMutexUnlock(&pipeline->lock);
+
+        if (block->failed) {
+            if (block->error)
+                virSetError(block->error);
+            else
+                virReportOOMError();
+            return -1;
+        }
+
+        if (safewrite(outfd, block->out, block->outlen) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"), outname);
+            return -1;
+        }
+        nwritten++;
+    }
+
+    return 0;
+}
+
+
+/**
+ * virCompressStream:
+ * @infd: file descriptor to read raw data from
+ * @inname: name of @infd for error messages
+ * @outfd: file descriptor to write the compressed stream to
+ * @outname: name of @outfd for error messages
+ * @nthreads: number of worker threads, or 0 for one per online CPU
+ *
+ * Compress everything read from @infd until end of file, leaving out
+ * pages that contain only zeros.  Blocks are compressed with LZ4 when
+ * libvirt was built with it, and stored otherwise.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virCompressStream(int infd, const char *inname,
+                  int outfd, const char *outname,
+                  unsigned int nthreads)
+{
+    virCompressPipelinePtr pipeline = NULL;
+    char header[VIR_COMPRESS_HEADER_LEN];
+    char trailer[VIR_COMPRESS_BLOCK_HEADER_LEN];
+    int ret = -1;
+
+    memcpy(header, VIR_COMPRESS_MAGIC, sizeof(VIR_COMPRESS_MAGIC) - 1);
+    virCompressWriteInt32BE(header + 8, VIR_COMPRESS_VERSION);
+    virCompressWriteInt32BE(header + 12, VIR_COMPRESS_BLOCK_SIZE);
+    memset(trailer, 0, sizeof(trailer));
+
+    if (safewrite(outfd, header, sizeof(header)) < 0) {
+        virReportSystemError(errno, _("Unable to write %s"), outname);
+        goto cleanup;
+    }
+
+    if (!(pipeline = virCompressPipelineNew(nthreads,
+                                            VIR_COMPRESS_BLOCK_SIZE,
+                                            virCompressReadRaw,
+                                            virCompressBlockEncode)))
+        goto cleanup;
+
+    if (virCompressPipelineRun(pipeline, infd, inname, outfd, outname) < 0)
+        goto cleanup;
+
+    if (safewrite(outfd, trailer, sizeof(trailer)) < 0) {
+        virReportSystemError(errno, _("Unable to write %s"), outname);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virCompressPipelineFree(pipeline);
+    return ret;
+}
+
+
+/**
+ * virDecompressStream:
+ * @infd: file descriptor to read the compressed stream from
+ * @inname: name of @infd for error messages
+ * @outfd: file descriptor to write raw data to
+ * @outname: name of @outfd for error messages
+ * @nthreads: number of worker threads, or 0 for one per online CPU
+ *
+ * Reverse virCompressStream, stopping at the end of the compressed
+ * stream.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+virDecompressStream(int infd, const char *inname,
+                    int outfd, const char *outname,
+                    unsigned int nthreads)
+{
+    virCompressPipelinePtr pipeline = NULL;
+    char header[VIR_COMPRESS_HEADER_LEN];
+    unsigned int version;
+    size_t blocksize;
+    ssize_t got;
+    int ret = -1;
+
+    if ((got = saferead(infd, header, sizeof(header))) < 0) {
+        virReportSystemError(errno, _("Unable to read %s"), inname);
+        goto cleanup;
+    }
+    if (got != sizeof(header) ||
+        memcmp(header, VIR_COMPRESS_MAGIC,
+               sizeof(VIR_COMPRESS_MAGIC) - 1) != 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("%s is not a compressed stream"), inname);
+        goto cleanup;
+    }
+
+    version = virReadBufInt32BE(header + 8);
+    blocksize = virReadBufInt32BE(header + 12);
+
+    if (version != VIR_COMPRESS_VERSION) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                       _("unsupported compressed stream version %u"),
+                       version);
+        goto cleanup;
+    }
+    if (blocksize == 0 || blocksize > VIR_COMPRESS_BLOCK_SIZE_MAX) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("invalid block size %zu in compressed stream"),
+                       blocksize);
+        goto cleanup;
+    }
+
+    if (!(pipeline = virCompressPipelineNew(nthreads, blocksize,
+                                            virCompressReadEncoded,
+                                            virCompressBlockDecode)))
+        goto cleanup;
+
+    if (virCompressPipelineRun(pipeline, infd, inname, outfd, outname) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virCompressPipelineFree(pipeline);
+    return ret;
+}
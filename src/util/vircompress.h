@@ -0,0 +1,39 @@
+/*
+ * vircompress.h: block parallel compression of save image streams
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_COMPRESS_H__
+# define __VIR_COMPRESS_H__
+
+# include "internal.h"
+
+bool virCompressAvailable(void);
+
+int virCompressStream(int infd, const char *inname,
+                      int outfd, const char *outname,
+                      unsigned int nthreads)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4) ATTRIBUTE_RETURN_CHECK;
+
+int virDecompressStream(int infd, const char *inname,
+                        int outfd, const char *outname,
+                        unsigned int nthreads)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4) ATTRIBUTE_RETURN_CHECK;
+
+#endif /* __VIR_COMPRESS_H__ */
@@ -25,11 +25,21 @@
 
 #include "virevent.h"
 #include "vireventpoll.h"
+#include "vireventepoll.h"
 #include "virlog.h"
 #include "virerror.h"
 
 #include <stdlib.h>
 
+#define VIR_FROM_THIS VIR_FROM_EVENT
+
+VIR_ENUM_IMPL(virEventImpl, VIR_EVENT_IMPL_LAST,
+              "poll",
+              "epoll")
+
+/* Backend used by virEventRegisterDefaultImpl and virEventRunDefaultImpl */
+static int defaultImpl = VIR_EVENT_IMPL_POLL;
+
 static virEventAddHandleFunc addHandleImpl = NULL;
 static virEventUpdateHandleFunc updateHandleImpl = NULL;
 static virEventRemoveHandleFunc removeHandleImpl = NULL;
@@ -210,6 +220,39 @@ void virEventRegisterImpl(virEventAddHandleFunc addHandle,
     removeTimeoutImpl = removeTimeout;
 }
 
+/**
+ * virEventSetDefaultImpl:
+ * @type: the virEventImplType backend to use
+ *
+ * Choose the backend that a later call to virEventRegisterDefaultImpl
+ * will register. Must be called before the default implementation
+ * is registered, since handles and timers can't be moved between
+ * backends.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int virEventSetDefaultImpl(int type)
+{
+    VIR_DEBUG("type=%d", type);
+
+    if (type < 0 || type >= VIR_EVENT_IMPL_LAST) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("unknown event loop implementation %d"), type);
+        return -1;
+    }
+
+#if !HAVE_SYS_EPOLL_H
+    if (type == VIR_EVENT_IMPL_EPOLL) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("epoll event loop is not supported on this platform"));
+        return -1;
+    }
+#endif
+
+    defaultImpl = type;
+    return 0;
+}
+
 /**
  * virEventRegisterDefaultImpl:
  *
@@ -219,6 +262,10 @@ void virEventRegisterImpl(virEventAddHandleFunc addHandle,
  * not have a need to integrate with an external event
  * loop impl.
  *
+ * Within libvirtd the implementation can instead be based
+ * on epoll(), which scales better to large numbers of file
+ * handles, see the event_loop setting in libvirtd.conf.
+ *
  * Once registered, the application has to invoke virEventRunDefaultImpl in
  * a loop to process events.  Failure to do so may result in connections being
  * closed unexpectedly as a result of keepalive timeout.
@@ -231,6 +278,23 @@ int virEventRegisterDefaultImpl(void)
 
     virResetLastError();
 
+    if (defaultImpl == VIR_EVENT_IMPL_EPOLL) {
+        if (virEventEpollInit() < 0) {
+            virDispatchError(NULL);
+            return -1;
+        }
+
+        virEventRegisterImpl(
+            virEventEpollAddHandle,
+            virEventEpollUpdateHandle,
+            virEventEpollRemoveHandle,
+            virEventEpollAddTimeout,
+            virEventEpollUpdateTimeout,
+            virEventEpollRemoveTimeout
+            );
+        return 0;
+    }
+
     if (virEventPollInit() < 0) {
         virDispatchError(NULL);
         return -1;
@@ -270,7 +334,8 @@ int virEventRunDefaultImpl(void)
     VIR_DEBUG("running default event implementation");
     virResetLastError();
 
-    if (virEventPollRunOnce() < 0) {
+    if ((defaultImpl == VIR_EVENT_IMPL_EPOLL ?
+         virEventEpollRunOnce() : virEventPollRunOnce()) < 0) {
         virDispatchError(NULL);
         return -1;
     }
@@ -0,0 +1,1058 @@
+/*
+ * vireventepoll.c: epoll based event loop for monitoring file handles
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#include "virthread.h"
+#include "virlog.h"
+#include "vireventepoll.h"
+#include "viralloc.h"
+#include "virhash.h"
+#include "virhashcode.h"
+#include "virutil.h"
+#include "virfile.h"
+#include "virerror.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_EVENT
+
+#if HAVE_SYS_EPOLL_H
+
+# define EVENT_DEBUG(fmt, ...) VIR_DEBUG(fmt, __VA_ARGS__)
+
+static int virEventEpollInterruptLocked(void);
+
+typedef struct _virEventEpollHandle virEventEpollHandle;
+typedef virEventEpollHandle *virEventEpollHandlePtr;
+
+/* State for a single file handle being monitored */
+struct _virEventEpollHandle {
+    int watch;
+    int fd;
+    int events;
+    virEventHandleCallback cb;
+    virFreeCallback ff;
+    void *opaque;
+    bool deleted;
+
+    virEventEpollHandlePtr next;      /* next watch on the same fd */
+    virEventEpollHandlePtr nextPurge; /* next deleted watch to release */
+};
+
+/* All watches registered for a single file descriptor. The kernel
+ * only allows an fd to be added to an epoll set once, so it is
+ * given the union of the events wanted by every watch on the fd */
+typedef struct _virEventEpollFD virEventEpollFD;
+typedef virEventEpollFD *virEventEpollFDPtr;
+struct _virEventEpollFD {
+    virEventEpollHandlePtr handles;
+    int events;         /* EPOLLnnn mask currently requested */
+    bool registered;    /* fd is present in the epoll set */
+    bool alwaysReady;   /* fd type not supported by epoll */
+};
+
+typedef struct _virEventEpollTimeout virEventEpollTimeout;
+typedef virEventEpollTimeout *virEventEpollTimeoutPtr;
+
+/* State for a single timer being generated */
+struct _virEventEpollTimeout {
+    int timer;
+    int frequency;
+    unsigned long long expiresAt;
+    virEventTimeoutCallback cb;
+    virFreeCallback ff;
+    void *opaque;
+    bool deleted;
+
+    ssize_t heapIndex;                  /* -1 when not armed */
+    virEventEpollTimeoutPtr nextExpired;
+    virEventEpollTimeoutPtr nextPurge;
+};
+
+/* State for the main event loop */
+struct virEventEpollLoop {
+    virMutex lock;
+    int running;
+    virThread leader;
+    int wakeupfd[2];
+    int epollfd;
+
+    virHashTablePtr handles;        /* watch -> virEventEpollHandlePtr */
+    virEventEpollFDPtr fds;         /* indexed by file descriptor */
+    size_t nfds;
+    size_t nregistered;
+    size_t nalwaysReady;
+    virEventEpollHandlePtr purgeHandles;
+
+    struct epoll_event *ready;
+    size_t readyAlloc;
+
+    virHashTablePtr timeouts;       /* timer -> virEventEpollTimeoutPtr */
+    size_t ntimeouts;
+    virEventEpollTimeoutPtr *heap;  /* armed timers, soonest first */
+    size_t nheap;
+    size_t heapAlloc;
+    virEventEpollTimeoutPtr purgeTimeouts;
+};
+
+/* Only have one event loop */
+static struct virEventEpollLoop eventLoop;
+
+/* Unique ID for the next FD watch to be registered */
+static int nextWatch = 1;
+
+/* Unique ID for the next timer to be registered */
+static int nextTimer = 1;
+
+
+static uint32_t
+virEventEpollIDCode(const void *name, uint32_t seed)
+{
+    int id = (intptr_t)name;
+    return virHashCodeGen(&id, sizeof(id), seed);
+}
+
+
+static bool
+virEventEpollIDEqual(const void *namea, const void *nameb)
+{
+    return namea == nameb;
+}
+
+
+static void *
+virEventEpollIDCopy(const void *name)
+{
+    return (void *)name;
+}
+
+
+static int
+virEventEpollToNativeEvents(int events)
+{
+    int ret = 0;
+    if (events & VIR_EVENT_HANDLE_READABLE)
+        ret |= EPOLLIN;
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+        ret |= EPOLLOUT;
+    if (events & VIR_EVENT_HANDLE_ERROR)
+        ret |= EPOLLERR;
+    if (events & VIR_EVENT_HANDLE_HANGUP)
+        ret |= EPOLLHUP;
+    return ret;
+}
+
+
+static int
+virEventEpollFromNativeEvents(int events)
+{
+    int ret = 0;
+    if (events & EPOLLIN)
+        ret |= VIR_EVENT_HANDLE_READABLE;
+    if (events & EPOLLOUT)
+        ret |= VIR_EVENT_HANDLE_WRITABLE;
+    if (events & EPOLLERR)
+        ret |= VIR_EVENT_HANDLE_ERROR;
+    if (events & EPOLLHUP)
+        ret |= VIR_EVENT_HANDLE_HANGUP;
+    return ret;
+}
+
+
+/*
+ * Push the union of the events wanted by all live watches on
+ * @fd into the kernel. An fd with no events wanted is removed
+ * from the epoll set entirely, since the kernel would otherwise
+ * keep reporting EPOLLHUP/EPOLLERR for it, which poll() does not.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int
+virEventEpollUpdateFD(int fd)
+{
+    virEventEpollFDPtr info = &eventLoop.fds[fd];
+    virEventEpollHandlePtr handle;
+    struct epoll_event ev;
+    int events = 0;
+    int op;
+
+    for (handle = info->handles; handle; handle = handle->next) {
+        if (!handle->deleted)
+            events |= virEventEpollToNativeEvents(handle->events);
+    }
+
+    if (events == 0) {
+        if (info->registered) {
+            if (epoll_ctl(eventLoop.epollfd, EPOLL_CTL_DEL, fd, NULL) < 0 &&
+                errno != ENOENT && errno != EBADF)
+                VIR_WARN("Unable to remove fd %d from epoll set: %d",
+                         fd, errno);
+            info->registered = false;
+            eventLoop.nregistered--;
+        }
+        if (info->alwaysReady) {
+            info->alwaysReady = false;
+            eventLoop.nalwaysReady--;
+        }
+        info->events = 0;
+        return 0;
+    }
+
+    if (info->alwaysReady || (info->registered && info->events == events)) {
+        info->events = events;
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    op = info->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(eventLoop.epollfd, op, fd, &ev) < 0) {
+        /* The kernel drops an fd from the set on its own once the
+         * last reference to the file is closed, and keeps it if
+         * a dup survives, so our bookkeeping can be out of date */
+        if (op == EPOLL_CTL_MOD && errno == ENOENT)
+            op = EPOLL_CTL_ADD;
+        else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+            op = EPOLL_CTL_MOD;
+
+        if (epoll_ctl(eventLoop.epollfd, op, fd, &ev) < 0) {
+            if (errno != EPERM) {
+                virReportSystemError(errno,
+                                     _("Unable to watch fd %d with epoll"),
+                                     fd);
+                return -1;
+            }
+            /* Regular files and directories can't be used with epoll,
+             * but poll() always reports them as ready, so emulate that */
+            EVENT_DEBUG("fd %d not supported by epoll, always ready", fd);
+            if (info->registered) {
+                info->registered = false;
+                eventLoop.nregistered--;
+            }
+            info->alwaysReady = true;
+            eventLoop.nalwaysReady++;
+            info->events = events;
+            return 0;
+        }
+    }
+
+    if (!info->registered) {
+        info->registered = true;
+        eventLoop.nregistered++;
+    }
+    info->events = events;
+    return 0;
+}
+
+
+/*
+ * Register a callback for monitoring file handle events.
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever append to existing list.
+ */
+int virEventEpollAddHandle(int fd, int events,
+                           virEventHandleCallback cb,
+                           void *opaque,
+                           virFreeCallback ff)
+{
+    virEventEpollHandlePtr handle;
+    virEventEpollHandlePtr *tail;
+    int watch;
+
+    if (fd < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Invalid file descriptor %d"), fd);
+        return -1;
+    }
+
+    if (VIR_ALLOC(handle) < 0)
+        return -1;
+
+    virMutexLock(&eventLoop.lock);
+    if (fd >= eventLoop.nfds &&
+        VIR_RESIZE_N(eventLoop.fds, eventLoop.nfds, fd, 1) < 0)
+        goto error;
+
+    watch = nextWatch;
+    handle->watch = watch;
+    handle->fd = fd;
+    handle->events = events;
+    handle->cb = cb;
+    handle->ff = ff;
+    handle->opaque = opaque;
+
+    if (virHashAddEntry(eventLoop.handles, (void *)(intptr_t)watch, handle) < 0)
+        goto error;
+
+    for (tail = &eventLoop.fds[fd].handles; *tail; tail = &(*tail)->next)
+        ;
+    *tail = handle;
+
+    if (virEventEpollUpdateFD(fd) < 0) {
+        *tail = NULL;
+        virHashRemoveEntry(eventLoop.handles, (void *)(intptr_t)watch);
+        goto error;
+    }
+    nextWatch++;
+
+    /* The kernel picks up epoll set changes while another thread
+     * is blocked in epoll_wait(), except for emulated fds */
+    if (eventLoop.fds[fd].alwaysReady)
+        virEventEpollInterruptLocked();
+
+    EVENT_DEBUG("watch=%d fd=%d events=%d cb=%p opaque=%p ff=%p",
+                watch, fd, events, cb, opaque, ff);
+    virMutexUnlock(&eventLoop.lock);
+
+    return watch;
+
+error:
+    virMutexUnlock(&eventLoop.lock);
+    VIR_FREE(handle);
+    return -1;
+}
+
+void virEventEpollUpdateHandle(int watch, int events)
+{
+    virEventEpollHandlePtr handle;
+
+    EVENT_DEBUG("watch=%d events=%d", watch, events);
+
+    if (watch <= 0) {
+        VIR_WARN("Ignoring invalid update watch %d", watch);
+        return;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    if (!(handle = virHashLookup(eventLoop.handles, (void *)(intptr_t)watch))) {
+        virMutexUnlock(&eventLoop.lock);
+        VIR_WARN("Got update for non-existent handle watch %d", watch);
+        return;
+    }
+
+    handle->events = events;
+    if (virEventEpollUpdateFD(handle->fd) < 0)
+        VIR_WARN("Unable to update events for watch %d", watch);
+    if (eventLoop.fds[handle->fd].alwaysReady)
+        virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+}
+
+/*
+ * Unregister a callback from a file handle
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever set a flag in the existing list.
+ * Actual deletion will be done out-of-band
+ */
+int virEventEpollRemoveHandle(int watch)
+{
+    virEventEpollHandlePtr handle;
+
+    EVENT_DEBUG("watch=%d", watch);
+
+    if (watch <= 0) {
+        VIR_WARN("Ignoring invalid remove watch %d", watch);
+        return -1;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    handle = virHashLookup(eventLoop.handles, (void *)(intptr_t)watch);
+    if (!handle || handle->deleted) {
+        virMutexUnlock(&eventLoop.lock);
+        return -1;
+    }
+
+    EVENT_DEBUG("mark delete %d %d", handle->watch, handle->fd);
+    handle->deleted = true;
+    handle->nextPurge = eventLoop.purgeHandles;
+    eventLoop.purgeHandles = handle;
+
+    /* Drop the fd from the kernel now, since callers usually
+     * close it straight after removing the watch */
+    ignore_value(virEventEpollUpdateFD(handle->fd));
+
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+}
+
+
+static void
+virEventEpollHeapSwap(size_t i, size_t j)
+{
+    virEventEpollTimeoutPtr tmp = eventLoop.heap[i];
+
+    eventLoop.heap[i] = eventLoop.heap[j];
+    eventLoop.heap[j] = tmp;
+    eventLoop.heap[i]->heapIndex = i;
+    eventLoop.heap[j]->heapIndex = j;
+}
+
+static void
+virEventEpollHeapUp(size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (eventLoop.heap[parent]->expiresAt <= eventLoop.heap[i]->expiresAt)
+            break;
+        virEventEpollHeapSwap(i, parent);
+        i = parent;
+    }
+}
+
+static void
+virEventEpollHeapDown(size_t i)
+{
+    while (true) {
+        size_t child = 2 * i + 1;
+
+        if (child >= eventLoop.nheap)
+            break;
+        if (child + 1 < eventLoop.nheap &&
+            eventLoop.heap[child + 1]->expiresAt <
+            eventLoop.heap[child]->expiresAt)
+            child++;
+        if (eventLoop.heap[i]->expiresAt <= eventLoop.heap[child]->expiresAt)
+            break;
+        virEventEpollHeapSwap(i, child);
+        i = child;
+    }
+}
+
+/* Space for every registered timer is reserved in the heap
+ * when the timer is added, so this can never fail */
+static void
+virEventEpollHeapInsert(virEventEpollTimeoutPtr timeout)
+{
+    timeout->heapIndex = eventLoop.nheap;
+    eventLoop.heap[eventLoop.nheap++] = timeout;
+    virEventEpollHeapUp(timeout->heapIndex);
+}
+
+static void
+virEventEpollHeapRemove(virEventEpollTimeoutPtr timeout)
+{
+    size_t i;
+
+    if (timeout->heapIndex < 0)
+        return;
+
+    i = timeout->heapIndex;
+    timeout->heapIndex = -1;
+    if (i == --eventLoop.nheap)
+        return;
+
+    eventLoop.heap[i] = eventLoop.heap[eventLoop.nheap];
+    eventLoop.heap[i]->heapIndex = i;
+    virEventEpollHeapUp(i);
+    virEventEpollHeapDown(eventLoop.heap[i]->heapIndex);
+}
+
+/* (Re-)arm a timer to expire at @now + its frequency,
+ * or disarm it if the frequency is negative */
+static void
+virEventEpollTimeoutSchedule(virEventEpollTimeoutPtr timeout,
+                             unsigned long long now)
+{
+    if (timeout->frequency < 0) {
+        timeout->expiresAt = 0;
+        virEventEpollHeapRemove(timeout);
+        return;
+    }
+
+    timeout->expiresAt = now + timeout->frequency;
+    if (timeout->heapIndex < 0) {
+        virEventEpollHeapInsert(timeout);
+    } else {
+        virEventEpollHeapUp(timeout->heapIndex);
+        virEventEpollHeapDown(timeout->heapIndex);
+    }
+}
+
+
+/*
+ * Register a callback for a timer event
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever append to existing list.
+ */
+int virEventEpollAddTimeout(int frequency,
+                            virEventTimeoutCallback cb,
+                            void *opaque,
+                            virFreeCallback ff)
+{
+    virEventEpollTimeoutPtr timeout;
+    unsigned long long now;
+    int ret;
+
+    if (virTimeMillisNow(&now) < 0)
+        return -1;
+
+    if (VIR_ALLOC(timeout) < 0)
+        return -1;
+
+    virMutexLock(&eventLoop.lock);
+    if (VIR_RESIZE_N(eventLoop.heap, eventLoop.heapAlloc,
+                     eventLoop.ntimeouts, 1) < 0)
+        goto error;
+
+    timeout->timer = nextTimer;
+    timeout->frequency = frequency;
+    timeout->cb = cb;
+    timeout->ff = ff;
+    timeout->opaque = opaque;
+    timeout->heapIndex = -1;
+
+    if (virHashAddEntry(eventLoop.timeouts,
+                        (void *)(intptr_t)timeout->timer, timeout) < 0)
+        goto error;
+
+    eventLoop.ntimeouts++;
+    virEventEpollTimeoutSchedule(timeout, now);
+    ret = nextTimer++;
+    virEventEpollInterruptLocked();
+
+    EVENT_DEBUG("timer=%d frequency=%d cb=%p opaque=%p ff=%p",
+                ret, frequency, cb, opaque, ff);
+    virMutexUnlock(&eventLoop.lock);
+    return ret;
+
+error:
+    virMutexUnlock(&eventLoop.lock);
+    VIR_FREE(timeout);
+    return -1;
+}
+
+void virEventEpollUpdateTimeout(int timer, int frequency)
+{
+    virEventEpollTimeoutPtr timeout;
+    unsigned long long now;
+
+    EVENT_DEBUG("timer=%d frequency=%d", timer, frequency);
+
+    if (timer <= 0) {
+        VIR_WARN("Ignoring invalid update timer %d", timer);
+        return;
+    }
+
+    if (virTimeMillisNow(&now) < 0)
+        return;
+
+    virMutexLock(&eventLoop.lock);
+    if (!(timeout = virHashLookup(eventLoop.timeouts,
+                                  (void *)(intptr_t)timer)) ||
+        timeout->deleted) {
+        virMutexUnlock(&eventLoop.lock);
+        VIR_WARN("Got update for non-existent timer %d", timer);
+        return;
+    }
+
+    timeout->frequency = frequency;
+    virEventEpollTimeoutSchedule(timeout, now);
+    VIR_DEBUG("Set timer freq=%d expires=%llu", frequency,
+              timeout->expiresAt);
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+}
+
+/*
+ * Unregister a callback for a timer
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever set a flag in the existing list.
+ * Actual deletion will be done out-of-band
+ */
+int virEventEpollRemoveTimeout(int timer)
+{
+    virEventEpollTimeoutPtr timeout;
+
+    EVENT_DEBUG("timer=%d", timer);
+
+    if (timer <= 0) {
+        VIR_WARN("Ignoring invalid remove timer %d", timer);
+        return -1;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    timeout = virHashLookup(eventLoop.timeouts, (void *)(intptr_t)timer);
+    if (!timeout || timeout->deleted) {
+        virMutexUnlock(&eventLoop.lock);
+        return -1;
+    }
+
+    timeout->deleted = true;
+    virEventEpollHeapRemove(timeout);
+    timeout->nextPurge = eventLoop.purgeTimeouts;
+    eventLoop.purgeTimeouts = timeout;
+
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+}
+
+/* Determine how long to sleep for, which is the time until
+ * the soonest armed timer expires.
+ * @timeout: filled with expiry time of soonest timer, or -1 if
+ *           no timeout is pending
+ * returns: 0 on success, -1 on error
+ */
+static int virEventEpollCalculateTimeout(int *timeout)
+{
+    unsigned long long then;
+    unsigned long long now;
+
+    if (eventLoop.nalwaysReady) {
+        *timeout = 0;
+        return 0;
+    }
+
+    if (eventLoop.nheap == 0) {
+        *timeout = -1;
+        return 0;
+    }
+
+    then = eventLoop.heap[0]->expiresAt;
+    if (virTimeMillisNow(&now) < 0)
+        return -1;
+
+    if (then <= now)
+        *timeout = 0;
+    else if (then - now > INT_MAX)
+        *timeout = INT_MAX;
+    else
+        *timeout = then - now;
+
+    EVENT_DEBUG("Timeout at %llu due in %d ms", then, *timeout);
+
+    return 0;
+}
+
+
+/*
+ * Pull all timers which have expired off the heap and invoke
+ * the user supplied callback for each, then schedule the next
+ * timeout. Does not try to 'catch up' on time if the actual
+ * expiry time was later than the requested time.
+ *
+ * Each timer fires at most once per iteration, timers
+ * registered by a callback are not considered, and timers
+ * deleted or rescheduled by an earlier callback are skipped.
+ *
+ * Returns 0 upon success, -1 if an error occurred
+ */
+static int virEventEpollDispatchTimeouts(void)
+{
+    virEventEpollTimeoutPtr expired = NULL;
+    virEventEpollTimeoutPtr *tail = &expired;
+    unsigned long long now;
+
+    if (virTimeMillisNow(&now) < 0)
+        return -1;
+
+    /* Add 20ms fuzz so we don't pointlessly spin doing
+     * <10ms sleeps, particularly on kernels with low HZ
+     * it is fine that a timer expires 20ms earlier than
+     * requested
+     */
+    while (eventLoop.nheap &&
+           eventLoop.heap[0]->expiresAt <= (now + 20)) {
+        virEventEpollTimeoutPtr timeout = eventLoop.heap[0];
+
+        virEventEpollHeapRemove(timeout);
+        timeout->nextExpired = NULL;
+        *tail = timeout;
+        tail = &timeout->nextExpired;
+    }
+
+    while (expired) {
+        virEventEpollTimeoutPtr timeout = expired;
+        virEventTimeoutCallback cb;
+        void *opaque;
+        int timer;
+
+        expired = timeout->nextExpired;
+
+        if (timeout->deleted ||
+            timeout->frequency < 0 ||
+            timeout->heapIndex >= 0)
+            continue;
+
+        cb = timeout->cb;
+        timer = timeout->timer;
+        opaque = timeout->opaque;
+        virEventEpollTimeoutSchedule(timeout, now);
+
+        EVENT_DEBUG("Dispatch timer=%d", timer);
+        virMutexUnlock(&eventLoop.lock);
+        (cb)(timer, opaque);
+        virMutexLock(&eventLoop.lock);
+    }
+
+    return 0;
+}
+
+
+/* Invoke the callback of every live watch on @fd whose event
+ * set intersects @revents. Watches with a number of @firstNew
+ * or higher were registered after the kernel was queried and
+ * are skipped, matching the poll() implementation.
+ */
+static void virEventEpollDispatchFD(int fd, int revents, int firstNew)
+{
+    virEventEpollHandlePtr handle;
+
+    if (fd >= eventLoop.nfds)
+        return;
+
+    for (handle = eventLoop.fds[fd].handles; handle; handle = handle->next) {
+        virEventHandleCallback cb;
+        void *opaque;
+        int watch;
+        int hEvents;
+
+        if (handle->deleted || !handle->events || handle->watch >= firstNew)
+            continue;
+
+        /* Errors and hangups are always reported, just like poll() */
+        hEvents = virEventEpollFromNativeEvents(revents) &
+            (handle->events | VIR_EVENT_HANDLE_ERROR | VIR_EVENT_HANDLE_HANGUP);
+        if (!hEvents)
+            continue;
+
+        cb = handle->cb;
+        watch = handle->watch;
+        opaque = handle->opaque;
+        EVENT_DEBUG("Dispatch watch=%d fd=%d events=%d", watch, fd, hEvents);
+        virMutexUnlock(&eventLoop.lock);
+        (cb)(watch, fd, hEvents, opaque);
+        virMutexLock(&eventLoop.lock);
+    }
+}
+
+
+/* Dispatch the file handles reported ready by epoll_wait(),
+ * plus any which epoll can't watch and are always ready.
+ *
+ * This method must cope with new handles being registered
+ * by a callback, and must skip any handles marked as deleted.
+ */
+static void virEventEpollDispatchHandles(int nready, int firstNew)
+{
+    size_t i;
+
+    VIR_DEBUG("Dispatch %d", nready);
+
+    for (i = 0; i < nready; i++)
+        virEventEpollDispatchFD(eventLoop.ready[i].data.fd,
+                                eventLoop.ready[i].events,
+                                firstNew);
+
+    for (i = 0; eventLoop.nalwaysReady && i < eventLoop.nfds; i++) {
+        if (eventLoop.fds[i].alwaysReady)
+            virEventEpollDispatchFD(i, eventLoop.fds[i].events, firstNew);
+    }
+}
+
+
+/* Used post dispatch to actually free any timers that
+ * were previously marked as deleted. This asynchronous
+ * cleanup is needed to make dispatch re-entrant safe.
+ */
+static void virEventEpollCleanupTimeouts(void)
+{
+    while (eventLoop.purgeTimeouts) {
+        virEventEpollTimeoutPtr timeout = eventLoop.purgeTimeouts;
+
+        eventLoop.purgeTimeouts = timeout->nextPurge;
+        virHashRemoveEntry(eventLoop.timeouts,
+                           (void *)(intptr_t)timeout->timer);
+        eventLoop.ntimeouts--;
+
+        EVENT_DEBUG("Purge timer=%d", timeout->timer);
+        if (timeout->ff) {
+            virFreeCallback ff = timeout->ff;
+            void *opaque = timeout->opaque;
+            virMutexUnlock(&eventLoop.lock);
+            ff(opaque);
+            virMutexLock(&eventLoop.lock);
+        }
+        VIR_FREE(timeout);
+    }
+}
+
+/* Used post dispatch to actually free any handles that
+ * were previously marked as deleted. This asynchronous
+ * cleanup is needed to make dispatch re-entrant safe.
+ */
+static void virEventEpollCleanupHandles(void)
+{
+    while (eventLoop.purgeHandles) {
+        virEventEpollHandlePtr handle = eventLoop.purgeHandles;
+        virEventEpollHandlePtr *prev;
+
+        eventLoop.purgeHandles = handle->nextPurge;
+        for (prev = &eventLoop.fds[handle->fd].handles;
+             *prev != handle;
+             prev = &(*prev)->next)
+            ;
+        *prev = handle->next;
+        virHashRemoveEntry(eventLoop.handles,
+                           (void *)(intptr_t)handle->watch);
+
+        EVENT_DEBUG("Purge watch=%d", handle->watch);
+        if (handle->ff) {
+            virFreeCallback ff = handle->ff;
+            void *opaque = handle->opaque;
+            virMutexUnlock(&eventLoop.lock);
+            ff(opaque);
+            virMutexLock(&eventLoop.lock);
+        }
+        VIR_FREE(handle);
+    }
+}
+
+/*
+ * Run a single iteration of the event loop, blocking until
+ * at least one file handle has an event, or a timer expires
+ */
+int virEventEpollRunOnce(void)
+{
+    int nready, timeout, firstNew;
+
+    virMutexLock(&eventLoop.lock);
+    eventLoop.running = 1;
+    virThreadSelf(&eventLoop.leader);
+
+    virEventEpollCleanupTimeouts();
+    virEventEpollCleanupHandles();
+
+    if (eventLoop.readyAlloc <= eventLoop.nregistered &&
+        VIR_RESIZE_N(eventLoop.ready, eventLoop.readyAlloc,
+                     eventLoop.nregistered, 1) < 0)
+        goto error;
+
+    if (virEventEpollCalculateTimeout(&timeout) < 0)
+        goto error;
+
+    firstNew = nextWatch;
+    virMutexUnlock(&eventLoop.lock);
+
+ retry:
+    EVENT_DEBUG("Epoll on %zu handles with timeout %d",
+                eventLoop.nregistered, timeout);
+    nready = epoll_wait(eventLoop.epollfd, eventLoop.ready,
+                        eventLoop.readyAlloc, timeout);
+    if (nready < 0) {
+        EVENT_DEBUG("Epoll got error event %d", errno);
+        if (errno == EINTR || errno == EAGAIN)
+            goto retry;
+        virReportSystemError(errno, "%s",
+                             _("Unable to epoll on file handles"));
+        goto error_unlocked;
+    }
+    EVENT_DEBUG("Epoll got %d event(s)", nready);
+
+    virMutexLock(&eventLoop.lock);
+    if (virEventEpollDispatchTimeouts() < 0)
+        goto error;
+
+    virEventEpollDispatchHandles(nready, firstNew);
+
+    virEventEpollCleanupTimeouts();
+    virEventEpollCleanupHandles();
+
+    eventLoop.running = 0;
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+
+error:
+    eventLoop.running = 0;
+    virMutexUnlock(&eventLoop.lock);
+error_unlocked:
+    return -1;
+}
+
+
+static void virEventEpollHandleWakeup(int watch ATTRIBUTE_UNUSED,
+                                      int fd,
+                                      int events ATTRIBUTE_UNUSED,
+                                      void *opaque ATTRIBUTE_UNUSED)
+{
+    char c;
+    virMutexLock(&eventLoop.lock);
+    ignore_value(saferead(fd, &c, sizeof(c)));
+    virMutexUnlock(&eventLoop.lock);
+}
+
+int virEventEpollInit(void)
+{
+    eventLoop.wakeupfd[0] = eventLoop.wakeupfd[1] = -1;
+
+    if (virMutexInit(&eventLoop.lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        return -1;
+    }
+
+    if (!(eventLoop.handles = virHashCreateFull(64, NULL,
+                                                virEventEpollIDCode,
+                                                virEventEpollIDEqual,
+                                                virEventEpollIDCopy,
+                                                NULL)) ||
+        !(eventLoop.timeouts = virHashCreateFull(64, NULL,
+                                                 virEventEpollIDCode,
+                                                 virEventEpollIDEqual,
+                                                 virEventEpollIDCopy,
+                                                 NULL)))
+        goto error;
+
+    if ((eventLoop.epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create epoll instance"));
+        goto error;
+    }
+
+    if (pipe2(eventLoop.wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to setup wakeup pipe"));
+        goto error;
+    }
+
+    if (virEventEpollAddHandle(eventLoop.wakeupfd[0],
+                               VIR_EVENT_HANDLE_READABLE,
+                               virEventEpollHandleWakeup, NULL, NULL) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("Unable to add handle %d to event loop"),
+                       eventLoop.wakeupfd[0]);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    VIR_FORCE_CLOSE(eventLoop.wakeupfd[0]);
+    VIR_FORCE_CLOSE(eventLoop.wakeupfd[1]);
+    VIR_FORCE_CLOSE(eventLoop.epollfd);
+    virHashFree(eventLoop.handles);
+    virHashFree(eventLoop.timeouts);
+    eventLoop.handles = eventLoop.timeouts = NULL;
+    return -1;
+}
+
+static int virEventEpollInterruptLocked(void)
+{
+    char c = '\0';
+
+    if (!eventLoop.running ||
+        virThreadIsSelf(&eventLoop.leader)) {
+        VIR_DEBUG("Skip interrupt, %d %llu", eventLoop.running,
+                  virThreadID(&eventLoop.leader));
+        return 0;
+    }
+
+    VIR_DEBUG("Interrupting");
+    if (safewrite(eventLoop.wakeupfd[1], &c, sizeof(c)) != sizeof(c))
+        return -1;
+    return 0;
+}
+
+int virEventEpollInterrupt(void)
+{
+    int ret;
+    virMutexLock(&eventLoop.lock);
+    ret = virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return ret;
+}
+
+#else /* ! HAVE_SYS_EPOLL_H */
+
+int virEventEpollAddHandle(int fd ATTRIBUTE_UNUSED,
+                           int events ATTRIBUTE_UNUSED,
+                           virEventHandleCallback cb ATTRIBUTE_UNUSED,
+                           void *opaque ATTRIBUTE_UNUSED,
+                           virFreeCallback ff ATTRIBUTE_UNUSED)
+{
+    virReportSystemError(ENOSYS, "%s",
+                         _("epoll is not supported on this platform"));
+    return -1;
+}
+
+void virEventEpollUpdateHandle(int watch ATTRIBUTE_UNUSED,
+                               int events ATTRIBUTE_UNUSED)
+{
+}
+
+int virEventEpollRemoveHandle(int watch ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+int virEventEpollAddTimeout(int frequency ATTRIBUTE_UNUSED,
+                            virEventTimeoutCallback cb ATTRIBUTE_UNUSED,
+                            void *opaque ATTRIBUTE_UNUSED,
+                            virFreeCallback ff ATTRIBUTE_UNUSED)
+{
+    virReportSystemError(ENOSYS, "%s",
+                         _("epoll is not supported on this platform"));
+    return -1;
+}
+
+void virEventEpollUpdateTimeout(int timer ATTRIBUTE_UNUSED,
+                                int frequency ATTRIBUTE_UNUSED)
+{
+}
+
+int virEventEpollRemoveTimeout(int timer ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+int virEventEpollInit(void)
+{
+    virReportSystemError(ENOSYS, "%s",
+                         _("epoll is not supported on this platform"));
+    return -1;
+}
+
+int virEventEpollRunOnce(void)
+{
+    virReportSystemError(ENOSYS, "%s",
+                         _("epoll is not supported on this platform"));
+    return -1;
+}
+
+int virEventEpollInterrupt(void)
+{
+    return -1;
+}
+
+#endif /* ! HAVE_SYS_EPOLL_H */
@@ -0,0 +1,264 @@
+/*
+ * vireventthread.c: dedicated threads for monitoring a single file handle
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vireventthread.h"
+#include "vireventpoll.h"
+#include "viratomic.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virthread.h"
+
+#define VIR_FROM_THIS VIR_FROM_EVENT
+
+/*
+ * A single file handle serviced by its own thread rather than by
+ * the shared event loop. Callbacks get the same arguments as with
+ * virEventAddHandle, but are run from the handle's own thread, so a
+ * busy or slow handle cannot hold up any other.
+ *
+ * The thread owns this struct: once asked to quit it invokes the
+ * free callback and releases everything itself, much like a
+ * deleted handle in the event loop is only freed on the next
+ * iteration.
+ */
+struct _virEventThread {
+    virMutex lock;
+    virThread thread;
+
+    int watch;
+    int fd;
+    int events;
+    int wakeupfd[2];
+    bool quit;
+
+    virEventHandleCallback cb;
+    virFreeCallback ff;
+    void *opaque;
+};
+
+/* Watches are only unique among event threads, which is all
+ * callers need to tell their own handles apart */
+static int virEventThreadLastWatch;
+
+
+static void
+virEventThreadWakeup(virEventThreadPtr evt)
+{
+    char c = '\0';
+
+    if (virThreadIsSelf(&evt->thread))
+        return;
+
+    /* A full pipe already guarantees a wakeup */
+    ignore_value(safewrite(evt->wakeupfd[1], &c, sizeof(c)));
+}
+
+
+static void
+virEventThreadWorker(void *opaque)
+{
+    virEventThreadPtr evt = opaque;
+    struct pollfd fds[2];
+    bool failed = false;
+    char buf[64];
+
+    virMutexLock(&evt->lock);
+
+    while (!evt->quit) {
+        int events;
+
+        fds[0].fd = failed ? -1 : evt->fd;
+        fds[0].events = virEventPollToNativeEvents(evt->events);
+        fds[0].revents = 0;
+        fds[1].fd = evt->wakeupfd[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        virMutexUnlock(&evt->lock);
+
+        if (poll(fds, ARRAY_CARDINALITY(fds), -1) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                /* Let the owner see the failure once, then
+                 * just wait for it to remove the handle */
+                char ebuf[1024];
+                VIR_WARN("Unable to poll on fd %d: %s", evt->fd,
+                         virStrerror(errno, ebuf, sizeof(ebuf)));
+                fds[0].revents = POLLERR;
+                failed = true;
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            while (saferead(evt->wakeupfd[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        virMutexLock(&evt->lock);
+        if (evt->quit)
+            break;
+
+        if ((events = virEventPollFromNativeEvents(fds[0].revents))) {
+            virMutexUnlock(&evt->lock);
+            (evt->cb)(evt->watch, evt->fd, events, evt->opaque);
+            virMutexLock(&evt->lock);
+        }
+    }
+
+    virMutexUnlock(&evt->lock);
+
+    VIR_DEBUG("Stopping thread for watch %d", evt->watch);
+
+    if (evt->ff)
+        (evt->ff)(evt->opaque);
+
+    VIR_FORCE_CLOSE(evt->wakeupfd[0]);
+    VIR_FORCE_CLOSE(evt->wakeupfd[1]);
+    virMutexDestroy(&evt->lock);
+    VIR_FREE(evt);
+}
+
+
+/**
+ * virEventThreadNew:
+ * @fd: file handle to monitor for events
+ * @events: bitset of VIR_EVENT_HANDLE_* to watch for
+ * @cb: callback to invoke when an event occurs
+ * @opaque: user data to pass to callback
+ * @ff: callback to free @opaque once the thread stops
+ *
+ * Start a thread which watches @fd and invokes @cb just as
+ * virEventAddHandle would. On failure @ff is not called.
+ *
+ * Returns the new thread, or NULL on error
+ */
+virEventThreadPtr
+virEventThreadNew(int fd, int events,
+                  virEventHandleCallback cb,
+                  void *opaque,
+                  virFreeCallback ff)
+{
+    virEventThreadPtr evt;
+
+    if (VIR_ALLOC(evt) < 0)
+        return NULL;
+
+    evt->wakeupfd[0] = evt->wakeupfd[1] = -1;
+
+    if (virMutexInit(&evt->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        VIR_FREE(evt);
+        return NULL;
+    }
+
+    if (pipe2(evt->wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create wakeup pipe"));
+        goto error;
+    }
+
+    evt->watch = virAtomicIntInc(&virEventThreadLastWatch);
+    evt->fd = fd;
+    evt->events = events;
+    evt->cb = cb;
+    evt->opaque = opaque;
+    evt->ff = ff;
+
+    /* Keep the worker away from @evt until 'thread' is filled in */
+    virMutexLock(&evt->lock);
+    if (virThreadCreate(&evt->thread, false,
+                        virEventThreadWorker, evt) < 0) {
+        virMutexUnlock(&evt->lock);
+        virReportSystemError(errno, "%s",
+                             _("Unable to create event thread"));
+        goto error;
+    }
+    virMutexUnlock(&evt->lock);
+
+    VIR_DEBUG("Started thread for fd %d watch %d", fd, evt->watch);
+
+    return evt;
+
+error:
+    VIR_FORCE_CLOSE(evt->wakeupfd[0]);
+    VIR_FORCE_CLOSE(evt->wakeupfd[1]);
+    virMutexDestroy(&evt->lock);
+    VIR_FREE(evt);
+    return NULL;
+}
+
+
+int
+virEventThreadGetWatch(virEventThreadPtr evt)
+{
+    return evt->watch;
+}
+
+
+/**
+ * virEventThreadUpdate:
+ * @evt: the event thread
+ * @events: new bitset of VIR_EVENT_HANDLE_* to watch for
+ *
+ * Change the events being watched, safe to call from within
+ * the callback itself.
+ */
+void
+virEventThreadUpdate(virEventThreadPtr evt, int events)
+{
+    virMutexLock(&evt->lock);
+    if (evt->events != events) {
+        evt->events = events;
+        virEventThreadWakeup(evt);
+    }
+    virMutexUnlock(&evt->lock);
+}
+
+
+/**
+ * virEventThreadRemove:
+ * @evt: the event thread
+ *
+ * Ask the thread to stop. No callback is invoked once this returns
+ * other than the one which may already be running, and the free
+ * callback runs from the thread as it exits. @evt must not be used
+ * afterwards. The file handle is left open for the caller to close.
+ */
+void
+virEventThreadRemove(virEventThreadPtr evt)
+{
+    if (!evt)
+        return;
+
+    virMutexLock(&evt->lock);
+    evt->quit = true;
+    virEventThreadWakeup(evt);
+    virMutexUnlock(&evt->lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * vireventthread.h: dedicated threads for monitoring a single file handle
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_EVENT_THREAD_H__
+# define __VIR_EVENT_THREAD_H__
+
+# include "internal.h"
+
+typedef struct _virEventThread virEventThread;
+typedef virEventThread *virEventThreadPtr;
+
+virEventThreadPtr virEventThreadNew(int fd, int events,
+                                    virEventHandleCallback cb,
+                                    void *opaque,
+                                    virFreeCallback ff)
+    ATTRIBUTE_NONNULL(3);
+
+int virEventThreadGetWatch(virEventThreadPtr evt)
+    ATTRIBUTE_NONNULL(1);
+
+void virEventThreadUpdate(virEventThreadPtr evt, int events)
+    ATTRIBUTE_NONNULL(1);
+
+void virEventThreadRemove(virEventThreadPtr evt);
+
+#endif /* __VIR_EVENT_THREAD_H__ */
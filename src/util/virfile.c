@@ -42,6 +42,9 @@
 #if HAVE_MMAP
 # include <sys/mman.h>
 #endif
+#if HAVE_LINUX_FALLOC_H
+# include <linux/falloc.h>
+#endif
 
 #if defined(__linux__) && HAVE_DECL_LO_FLAGS_AUTOCLEAR
 # include <linux/loop.h>
@@ -1099,6 +1102,114 @@ safezero(int fd, off_t offset, off_t len)
 # endif /* HAVE_MMAP */
 #endif /* HAVE_POSIX_FALLOCATE */
 
+/**
+ * virFileInData:
+ * @fd: file to check
+ * @inData: set to 1 if the current position is in data, 0 in a hole
+ * @length: set to the number of bytes until the data or hole ends
+ *
+ * Looks up whether the current position of @fd is in data or in a
+ * hole, and how far that extends. At the end of the file, @inData
+ * is 0 and @length is 0. Where the OS or filesystem can't tell,
+ * the whole rest of the file is reported as data. The position of
+ * @fd is left unchanged.
+ *
+ * Returns 0 on success, -1 with an error reported otherwise.
+ */
+int
+virFileInData(int fd,
+              int *inData,
+              unsigned long long *length)
+{
+    int ret = -1;
+    off_t cur;
+    off_t end;
+
+    if ((cur = lseek(fd, 0, SEEK_CUR)) == (off_t) -1) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to get current position in file"));
+        return -1;
+    }
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    {
+        off_t data;
+        off_t hole;
+
+        if ((data = lseek(fd, cur, SEEK_DATA)) == (off_t) -1) {
+            if (errno == ENXIO) {
+                /* Either a trailing hole, or the end of the file */
+                if ((end = lseek(fd, 0, SEEK_END)) == (off_t) -1) {
+                    virReportSystemError(errno, "%s",
+                                         _("Unable to seek to end of file"));
+                    goto cleanup;
+                }
+                *inData = 0;
+                *length = end > cur ? end - cur : 0;
+                ret = 0;
+                goto cleanup;
+            } else if (errno != EINVAL && errno != ENOTSUP) {
+                virReportSystemError(errno, "%s",
+                                     _("Unable to seek to data"));
+                goto cleanup;
+            }
+            /* Holes are not supported here, treat it all as data */
+        } else if (data > cur) {
+            *inData = 0;
+            *length = data - cur;
+            ret = 0;
+            goto cleanup;
+        } else {
+            /* There's always an implicit hole at the end of the file */
+            if ((hole = lseek(fd, cur, SEEK_HOLE)) == (off_t) -1) {
+                virReportSystemError(errno, "%s",
+                                     _("Unable to seek to hole"));
+                goto cleanup;
+            }
+            *inData = 1;
+            *length = hole - cur;
+            ret = 0;
+            goto cleanup;
+        }
+    }
+#endif /* SEEK_DATA && SEEK_HOLE */
+
+    if ((end = lseek(fd, 0, SEEK_END)) == (off_t) -1) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to seek to end of file"));
+        goto cleanup;
+    }
+    *inData = end > cur;
+    *length = end > cur ? end - cur : 0;
+    ret = 0;
+
+cleanup:
+    if (lseek(fd, cur, SEEK_SET) == (off_t) -1 && ret == 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to restore position in file"));
+        ret = -1;
+    }
+    return ret;
+}
+
+
+/* Deallocates @length bytes at @offset of @fd, which afterwards read
+ * back as zeroes, without changing the file size. Returns -1 with
+ * errno set if the filesystem or platform can't do that, in which
+ * case the caller has to write the zeroes itself. */
+int
+virFilePunchHole(int fd, off_t offset, off_t length)
+{
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE) && \
+    defined(FALLOC_FL_KEEP_SIZE)
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     offset, length);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 
 #if defined HAVE_MNTENT_H && defined HAVE_GETMNTENT_R
 /* search /proc/mounts for mount point of *type; return pointer to
@@ -43,6 +43,28 @@ ssize_t safewrite(int fd, const void *buf, size_t count)
 int safezero(int fd, off_t offset, off_t len)
     ATTRIBUTE_RETURN_CHECK;
 
+int virFileInData(int fd,
+                  int *inData,
+                  unsigned long long *length)
+    ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+int virFilePunchHole(int fd, off_t offset, off_t length)
+    ATTRIBUTE_RETURN_CHECK;
+
+/* Framing used by libvirt_iohelper to pass a sparse file through a
+ * pipe: each record is followed by @length bytes of payload if it
+ * describes data, or by nothing if it describes a hole */
+typedef enum {
+    VIR_FILE_SPARSE_DATA = 0,
+    VIR_FILE_SPARSE_HOLE = 1,
+} virFileSparseRecordType;
+
+typedef struct _virFileSparseRecord virFileSparseRecord;
+typedef virFileSparseRecord *virFileSparseRecordPtr;
+struct _virFileSparseRecord {
+    unsigned int type; /* virFileSparseRecordType */
+    unsigned long long length;
+};
+
 /* Don't call these directly - use the macros below */
 int virFileClose(int *fdptr, virFileCloseFlags flags)
         ATTRIBUTE_RETURN_CHECK;
@@ -31,6 +31,8 @@
 #include "virhashcode.h"
 #include "virrandom.h"
 #include "virstring.h"
+#include "virthread.h"
+#include "viratomic.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -725,3 +727,749 @@ bool virHashEqual(const virHashTablePtr table1,
 
     return data.equal;
 }
+
+
+/*
+ * The concurrent hash table is split into stripes, each being an
+ * independent chained hash with its own lock. A key always lives in
+ * the stripe picked by the low bits of its hash code, so operations
+ * on keys in different stripes never wait for each other and lookups
+ * only share their stripe's lock with other readers.
+ *
+ * Stripes grow on their own, and without rehashing all entries at
+ * once: the old bucket array is kept and every following write to
+ * the stripe moves a few of its buckets over, until it is empty.
+ * Until then, entries are looked up in both arrays.
+ */
+
+/* Must be a power of two */
+#define VIR_HASH_STRIPES 16
+
+/* Average number of entries per bucket above which a stripe grows */
+#define VIR_HASH_STRIPE_LOAD 4
+
+/* Number of old buckets every write moves over while growing */
+#define VIR_HASH_MIGRATE_STEP 8
+
+#define VIR_HASH_STRIPE_MAX_SIZE (1 << 20)
+
+typedef struct _virHashStripe virHashStripe;
+typedef virHashStripe *virHashStripePtr;
+struct _virHashStripe {
+    virRWLock lock;
+    virHashEntryPtr *table;
+    size_t size;
+    size_t nbElems;
+
+    /* While growing, the buckets of oldtable from index 'migrated'
+     * on still have to be moved to table */
+    virHashEntryPtr *oldtable;
+    size_t oldsize;
+    size_t migrated;
+};
+
+struct _virHashConcurrentTable {
+    virHashStripe stripes[VIR_HASH_STRIPES];
+    uint32_t seed;
+    int nbElems;
+    virHashDataFree dataFree;
+    virHashKeyCode keyCode;
+    virHashKeyEqual keyEqual;
+    virHashKeyCopy keyCopy;
+    virHashKeyFree keyFree;
+};
+
+
+static virHashStripePtr
+virHashConcurrentGetStripe(virHashConcurrentTablePtr table,
+                           const void *name,
+                           uint32_t *code)
+{
+    *code = table->keyCode(name, table->seed);
+    return &table->stripes[*code % VIR_HASH_STRIPES];
+}
+
+static size_t
+virHashStripeBucket(uint32_t code, size_t size)
+{
+    return (code / VIR_HASH_STRIPES) % size;
+}
+
+/*
+ * Returns the pointer linking to the entry matching @name, or NULL
+ * if there is none. Must be called with the stripe lock held.
+ */
+static virHashEntryPtr *
+virHashStripeFind(virHashConcurrentTablePtr table,
+                  virHashStripePtr stripe,
+                  uint32_t code,
+                  const void *name)
+{
+    virHashEntryPtr *nextptr;
+    size_t key;
+
+    nextptr = stripe->table + virHashStripeBucket(code, stripe->size);
+    for (; *nextptr; nextptr = &(*nextptr)->next) {
+        if (table->keyEqual((*nextptr)->name, name))
+            return nextptr;
+    }
+
+    if (!stripe->oldtable)
+        return NULL;
+
+    key = virHashStripeBucket(code, stripe->oldsize);
+    if (key < stripe->migrated)
+        return NULL;
+
+    for (nextptr = stripe->oldtable + key; *nextptr;
+         nextptr = &(*nextptr)->next) {
+        if (table->keyEqual((*nextptr)->name, name))
+            return nextptr;
+    }
+
+    return NULL;
+}
+
+/*
+ * Move up to @nbuckets buckets of a growing stripe to its new
+ * bucket array. Must be called with the stripe write lock held.
+ */
+static void
+virHashStripeMigrate(virHashConcurrentTablePtr table,
+                     virHashStripePtr stripe,
+                     size_t nbuckets)
+{
+    while (stripe->oldtable && nbuckets-- > 0) {
+        virHashEntryPtr entry = stripe->oldtable[stripe->migrated];
+
+        while (entry) {
+            virHashEntryPtr next = entry->next;
+            uint32_t code = table->keyCode(entry->name, table->seed);
+            size_t key = virHashStripeBucket(code, stripe->size);
+
+            entry->next = stripe->table[key];
+            stripe->table[key] = entry;
+            entry = next;
+        }
+        stripe->oldtable[stripe->migrated] = NULL;
+
+        if (++stripe->migrated == stripe->oldsize) {
+            VIR_FREE(stripe->oldtable);
+            stripe->oldsize = 0;
+            stripe->migrated = 0;
+        }
+    }
+}
+
+/*
+ * Start growing the stripe if it got too crowded. Entries are moved
+ * over later by virHashStripeMigrate. Failing to grow is harmless,
+ * it is simply tried again on the next addition.
+ */
+static void
+virHashStripeMaybeGrow(virHashStripePtr stripe)
+{
+    virHashEntryPtr *newtable;
+    size_t newsize = stripe->size * 4;
+
+    if (stripe->oldtable ||
+        stripe->nbElems <= stripe->size * VIR_HASH_STRIPE_LOAD ||
+        newsize > VIR_HASH_STRIPE_MAX_SIZE)
+        return;
+
+    if (VIR_ALLOC_N_QUIET(newtable, newsize) < 0)
+        return;
+
+    stripe->oldtable = stripe->table;
+    stripe->oldsize = stripe->size;
+    stripe->migrated = 0;
+    stripe->table = newtable;
+    stripe->size = newsize;
+}
+
+static void
+virHashStripeFreeEntries(virHashConcurrentTablePtr table,
+                         virHashEntryPtr *buckets,
+                         size_t from,
+                         size_t size)
+{
+    size_t i;
+
+    for (i = from; i < size; i++) {
+        virHashEntryPtr entry = buckets[i];
+        while (entry) {
+            virHashEntryPtr next = entry->next;
+
+            if (table->dataFree)
+                table->dataFree(entry->payload, entry->name);
+            if (table->keyFree)
+                table->keyFree(entry->name);
+            VIR_FREE(entry);
+            entry = next;
+        }
+    }
+}
+
+/**
+ * virHashConcurrentCreateFull:
+ * @size: the expected number of entries, or 0
+ * @dataFree: callback to free data
+ * @keyCode: callback to compute hash code
+ * @keyEqual: callback to compare hash keys
+ * @keyCopy: callback to copy hash keys
+ * @keyFree: callback to free keys
+ *
+ * Create a new virHashConcurrentTablePtr, which can be used from
+ * several threads at once without any locking by the caller. The
+ * callbacks are the same as for virHashCreateFull. @dataFree is
+ * called with the lock of part of the table held, so it must not
+ * use the table itself.
+ *
+ * Returns the newly created object, or NULL if an error occurred.
+ */
+virHashConcurrentTablePtr
+virHashConcurrentCreateFull(ssize_t size,
+                            virHashDataFree dataFree,
+                            virHashKeyCode keyCode,
+                            virHashKeyEqual keyEqual,
+                            virHashKeyCopy keyCopy,
+                            virHashKeyFree keyFree)
+{
+    virHashConcurrentTablePtr table = NULL;
+    size_t i;
+
+    if (size <= 0)
+        size = 256;
+    size = (size + VIR_HASH_STRIPES - 1) / VIR_HASH_STRIPES;
+
+    if (VIR_ALLOC(table) < 0)
+        return NULL;
+
+    table->seed = virRandomBits(32);
+    table->dataFree = dataFree;
+    table->keyCode = keyCode;
+    table->keyEqual = keyEqual;
+    table->keyCopy = keyCopy;
+    table->keyFree = keyFree;
+
+    for (i = 0; i < VIR_HASH_STRIPES; i++) {
+        virHashStripePtr stripe = &table->stripes[i];
+
+        if (VIR_ALLOC_N(stripe->table, size) < 0)
+            goto error;
+        stripe->size = size;
+
+        if (virRWLockInit(&stripe->lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to initialize lock"));
+            VIR_FREE(stripe->table);
+            goto error;
+        }
+    }
+
+    return table;
+
+error:
+    while (i-- > 0) {
+        virRWLockDestroy(&table->stripes[i].lock);
+        VIR_FREE(table->stripes[i].table);
+    }
+    VIR_FREE(table);
+    return NULL;
+}
+
+
+/**
+ * virHashConcurrentCreate:
+ * @size: the expected number of entries, or 0
+ * @dataFree: callback to free data
+ *
+ * Create a new virHashConcurrentTablePtr with string keys.
+ *
+ * Returns the newly created object, or NULL if an error occurred.
+ */
+virHashConcurrentTablePtr
+virHashConcurrentCreate(ssize_t size, virHashDataFree dataFree)
+{
+    return virHashConcurrentCreateFull(size,
+                                       dataFree,
+                                       virHashStrCode,
+                                       virHashStrEqual,
+                                       virHashStrCopy,
+                                       virHashStrFree);
+}
+
+
+/**
+ * virHashConcurrentFree:
+ * @table: the hash table
+ *
+ * Free the hash @table and its contents. No other thread may be
+ * using the table anymore.
+ */
+void
+virHashConcurrentFree(virHashConcurrentTablePtr table)
+{
+    size_t i;
+
+    if (table == NULL)
+        return;
+
+    for (i = 0; i < VIR_HASH_STRIPES; i++) {
+        virHashStripePtr stripe = &table->stripes[i];
+
+        virHashStripeFreeEntries(table, stripe->table, 0, stripe->size);
+        if (stripe->oldtable)
+            virHashStripeFreeEntries(table, stripe->oldtable,
+                                     stripe->migrated, stripe->oldsize);
+        VIR_FREE(stripe->table);
+        VIR_FREE(stripe->oldtable);
+        virRWLockDestroy(&stripe->lock);
+    }
+
+    VIR_FREE(table);
+}
+
+
+static int
+virHashConcurrentAddOrUpdateEntry(virHashConcurrentTablePtr table,
+                                  const void *name,
+                                  void *userdata,
+                                  bool is_update)
+{
+    virHashStripePtr stripe;
+    virHashEntryPtr *nextptr;
+    virHashEntryPtr entry = NULL;
+    uint32_t code;
+    size_t key;
+    int ret = -1;
+
+    if (table == NULL || name == NULL)
+        return -1;
+
+    stripe = virHashConcurrentGetStripe(table, name, &code);
+
+    virRWLockWrite(&stripe->lock);
+    virHashStripeMigrate(table, stripe, VIR_HASH_MIGRATE_STEP);
+
+    if ((nextptr = virHashStripeFind(table, stripe, code, name))) {
+        if (is_update) {
+            if (table->dataFree)
+                table->dataFree((*nextptr)->payload, (*nextptr)->name);
+            (*nextptr)->payload = userdata;
+            ret = 0;
+        }
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC(entry) < 0 || !(entry->name = table->keyCopy(name))) {
+        VIR_FREE(entry);
+        goto cleanup;
+    }
+
+    key = virHashStripeBucket(code, stripe->size);
+    entry->payload = userdata;
+    entry->next = stripe->table[key];
+    stripe->table[key] = entry;
+
+    stripe->nbElems++;
+    virAtomicIntInc(&table->nbElems);
+
+    virHashStripeMaybeGrow(stripe);
+    ret = 0;
+
+cleanup:
+    virRWLockUnlock(&stripe->lock);
+    return ret;
+}
+
+
+/**
+ * virHashConcurrentAddEntry:
+ * @table: the hash table
+ * @name: the name of the userdata
+ * @userdata: a pointer to the userdata
+ *
+ * Add the @userdata to the hash @table. This can later be retrieved
+ * by using @name. Duplicate entries generate errors.
+ *
+ * Returns 0 the addition succeeded and -1 in case of error.
+ */
+int
+virHashConcurrentAddEntry(virHashConcurrentTablePtr table,
+                          const void *name,
+                          void *userdata)
+{
+    return virHashConcurrentAddOrUpdateEntry(table, name, userdata, false);
+}
+
+
+/**
+ * virHashConcurrentUpdateEntry:
+ * @table: the hash table
+ * @name: the name of the userdata
+ * @userdata: a pointer to the userdata
+ *
+ * Add the @userdata to the hash @table, replacing and freeing any
+ * existing userdata for @name.
+ *
+ * Returns 0 the addition succeeded and -1 in case of error.
+ */
+int
+virHashConcurrentUpdateEntry(virHashConcurrentTablePtr table,
+                             const void *name,
+                             void *userdata)
+{
+    return virHashConcurrentAddOrUpdateEntry(table, name, userdata, true);
+}
+
+
+/**
+ * virHashConcurrentLookupFull:
+ * @table: the hash table
+ * @name: the name of the userdata
+ * @iter: callback to run on the userdata, or NULL
+ * @data: opaque data to pass to @iter
+ *
+ * Find the userdata specified by @name. Only the part of the table
+ * holding @name is locked, and only against writers.
+ *
+ * As the entry may be removed by another thread as soon as this
+ * returns, @iter is called with the userdata while it is known to
+ * still be in the table, for example to take a reference on it.
+ * @iter must not use the table.
+ *
+ * Returns a pointer to the userdata
+ */
+void *
+virHashConcurrentLookupFull(virHashConcurrentTablePtr table,
+                            const void *name,
+                            virHashIterator iter,
+                            void *data)
+{
+    virHashStripePtr stripe;
+    virHashEntryPtr *nextptr;
+    void *payload = NULL;
+    uint32_t code;
+
+    if (!table || !name)
+        return NULL;
+
+    stripe = virHashConcurrentGetStripe(table, name, &code);
+
+    virRWLockRead(&stripe->lock);
+    if ((nextptr = virHashStripeFind(table, stripe, code, name))) {
+        payload = (*nextptr)->payload;
+        if (iter)
+            iter(payload, (*nextptr)->name, data);
+    }
+    virRWLockUnlock(&stripe->lock);
+
+    return payload;
+}
+
+
+/**
+ * virHashConcurrentLookup:
+ * @table: the hash table
+ * @name: the name of the userdata
+ *
+ * Find the userdata specified by @name
+ *
+ * Returns a pointer to the userdata
+ */
+void *
+virHashConcurrentLookup(virHashConcurrentTablePtr table, const void *name)
+{
+    return virHashConcurrentLookupFull(table, name, NULL, NULL);
+}
+
+
+static int
+virHashConcurrentRemove(virHashConcurrentTablePtr table,
+                        const void *name,
+                        bool steal,
+                        void **payload)
+{
+    virHashStripePtr stripe;
+    virHashEntryPtr *nextptr;
+    virHashEntryPtr entry;
+    uint32_t code;
+
+    if (table == NULL || name == NULL)
+        return -1;
+
+    stripe = virHashConcurrentGetStripe(table, name, &code);
+
+    virRWLockWrite(&stripe->lock);
+    virHashStripeMigrate(table, stripe, VIR_HASH_MIGRATE_STEP);
+
+    if (!(nextptr = virHashStripeFind(table, stripe, code, name))) {
+        virRWLockUnlock(&stripe->lock);
+        return -1;
+    }
+
+    entry = *nextptr;
+    *nextptr = entry->next;
+    stripe->nbElems--;
+    virAtomicIntAdd(&table->nbElems, -1);
+
+    if (payload)
+        *payload = entry->payload;
+    if (!steal && table->dataFree)
+        table->dataFree(entry->payload, entry->name);
+    virRWLockUnlock(&stripe->lock);
+
+    if (table->keyFree)
+        table->keyFree(entry->name);
+    VIR_FREE(entry);
+    return 0;
+}
+
+
+/**
+ * virHashConcurrentRemoveEntry:
+ * @table: the hash table
+ * @name: the name of the userdata
+ *
+ * Find the userdata specified by the @name and remove it from the
+ * hash @table, freeing it with the callback given at creation.
+ *
+ * Returns 0 if the removal succeeded and -1 in case of error or not found.
+ */
+int
+virHashConcurrentRemoveEntry(virHashConcurrentTablePtr table,
+                             const void *name)
+{
+    return virHashConcurrentRemove(table, name, false, NULL);
+}
+
+
+/**
+ * virHashConcurrentSteal:
+ * @table: the hash table
+ * @name: the name of the userdata
+ *
+ * Find the userdata specified by @name
+ * and remove it from the hash without freeing it.
+ *
+ * Returns a pointer to the userdata
+ */
+void *
+virHashConcurrentSteal(virHashConcurrentTablePtr table, const void *name)
+{
+    void *payload = NULL;
+
+    ignore_value(virHashConcurrentRemove(table, name, true, &payload));
+    return payload;
+}
+
+
+/**
+ * virHashConcurrentSize:
+ * @table: the hash table
+ *
+ * Query the number of elements installed in the hash @table. With
+ * other threads modifying the table this is only a snapshot.
+ *
+ * Returns the number of elements in the hash table or
+ * -1 in case of error
+ */
+ssize_t
+virHashConcurrentSize(virHashConcurrentTablePtr table)
+{
+    if (table == NULL)
+        return -1;
+    return virAtomicIntGet(&table->nbElems);
+}
+
+
+/**
+ * virHashConcurrentForEach
+ * @table: the hash table to process
+ * @iter: callback to process each element
+ * @data: opaque data to pass to the iterator
+ *
+ * Iterates over every element in the hash table, invoking the
+ * 'iter' callback. One part of the table is locked at a time, so
+ * other threads can keep using the rest, and elements added or
+ * removed meanwhile may or may not be visited. The callback must
+ * not use the table; use virHashConcurrentRemoveSet to remove
+ * elements while iterating.
+ *
+ * Returns number of items iterated over upon completion, -1 on failure
+ */
+ssize_t
+virHashConcurrentForEach(virHashConcurrentTablePtr table,
+                         virHashIterator iter,
+                         void *data)
+{
+    size_t i, j, count = 0;
+
+    if (table == NULL || iter == NULL)
+        return -1;
+
+    for (i = 0; i < VIR_HASH_STRIPES; i++) {
+        virHashStripePtr stripe = &table->stripes[i];
+        virHashEntryPtr entry;
+
+        virRWLockRead(&stripe->lock);
+        for (j = 0; j < stripe->size; j++) {
+            for (entry = stripe->table[j]; entry; entry = entry->next) {
+                iter(entry->payload, entry->name, data);
+                count++;
+            }
+        }
+        for (j = stripe->migrated; stripe->oldtable && j < stripe->oldsize; j++) {
+            for (entry = stripe->oldtable[j]; entry; entry = entry->next) {
+                iter(entry->payload, entry->name, data);
+                count++;
+            }
+        }
+        virRWLockUnlock(&stripe->lock);
+    }
+
+    return count;
+}
+
+
+/**
+ * virHashConcurrentRemoveSet
+ * @table: the hash table to process
+ * @iter: callback to identify elements for removal
+ * @data: opaque data to pass to the iterator
+ *
+ * Iterates over all elements in the hash table, invoking the 'iter'
+ * callback. If the callback returns a non-zero value, the element
+ * will be removed from the hash table & its payload passed to the
+ * data freer callback registered at creation. The callback must not
+ * use the table.
+ *
+ * Returns number of items removed on success, -1 on failure
+ */
+ssize_t
+virHashConcurrentRemoveSet(virHashConcurrentTablePtr table,
+                           virHashSearcher iter,
+                           const void *data)
+{
+    size_t i, j, count = 0;
+
+    if (table == NULL || iter == NULL)
+        return -1;
+
+    for (i = 0; i < VIR_HASH_STRIPES; i++) {
+        virHashStripePtr stripe = &table->stripes[i];
+
+        virRWLockWrite(&stripe->lock);
+        /* Everything is visited anyway, so finish growing first */
+        virHashStripeMigrate(table, stripe, stripe->oldsize);
+
+        for (j = 0; j < stripe->size; j++) {
+            virHashEntryPtr *nextptr = stripe->table + j;
+
+            while (*nextptr) {
+                virHashEntryPtr entry = *nextptr;
+                if (!iter(entry->payload, entry->name, data)) {
+                    nextptr = &entry->next;
+                } else {
+                    count++;
+                    if (table->dataFree)
+                        table->dataFree(entry->payload, entry->name);
+                    if (table->keyFree)
+                        table->keyFree(entry->name);
+                    *nextptr = entry->next;
+                    VIR_FREE(entry);
+                    stripe->nbElems--;
+                    virAtomicIntAdd(&table->nbElems, -1);
+                }
+            }
+        }
+        virRWLockUnlock(&stripe->lock);
+    }
+
+    return count;
+}
+
+
+/**
+ * virHashConcurrentRemoveAll
+ * @table: the hash table to clear
+ *
+ * Free the hash @table's contents. The userdata is
+ * deallocated with the function provided at creation time.
+ *
+ * Returns the number of items removed on success, -1 on failure
+ */
+ssize_t
+virHashConcurrentRemoveAll(virHashConcurrentTablePtr table)
+{
+    return virHashConcurrentRemoveSet(table,
+                                      _virHashRemoveAllIter,
+                                      NULL);
+}
+
+
+static virHashEntryPtr
+virHashStripeSearch(virHashStripePtr stripe,
+                    virHashSearcher iter,
+                    const void *data)
+{
+    virHashEntryPtr entry;
+    size_t i;
+
+    for (i = 0; i < stripe->size; i++) {
+        for (entry = stripe->table[i]; entry; entry = entry->next) {
+            if (iter(entry->payload, entry->name, data))
+                return entry;
+        }
+    }
+
+    for (i = stripe->migrated; stripe->oldtable && i < stripe->oldsize; i++) {
+        for (entry = stripe->oldtable[i]; entry; entry = entry->next) {
+            if (iter(entry->payload, entry->name, data))
+                return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * virHashConcurrentSearch:
+ * @table: the hash table to search
+ * @iter: an iterator to identify the desired element
+ * @data: extra opaque information passed to the iter
+ *
+ * Iterates over the hash table calling the 'iter' callback
+ * for each element, with the same locking as virHashConcurrentForEach.
+ * The first element for which the iter returns non-zero will be
+ * returned by this function. The elements are processed in a
+ * undefined order.
+ */
+void *
+virHashConcurrentSearch(virHashConcurrentTablePtr table,
+                        virHashSearcher iter,
+                        const void *data)
+{
+    size_t i;
+    void *payload = NULL;
+
+    if (table == NULL || iter == NULL)
+        return NULL;
+
+    for (i = 0; i < VIR_HASH_STRIPES; i++) {
+        virHashStripePtr stripe = &table->stripes[i];
+        virHashEntryPtr entry;
+
+        virRWLockRead(&stripe->lock);
+        if ((entry = virHashStripeSearch(stripe, iter, data)))
+            payload = entry->payload;
+        virRWLockUnlock(&stripe->lock);
+
+        if (entry)
+            break;
+    }
+
+    return payload;
+}
@@ -183,4 +183,49 @@ ssize_t virHashForEach(virHashTablePtr table, virHashIterator iter, void *data);
 ssize_t virHashRemoveSet(virHashTablePtr table, virHashSearcher iter, const void *data);
 void *virHashSearch(virHashTablePtr table, virHashSearcher iter, const void *data);
 
+
+/*
+ * A hash table which can be used by several threads at once without
+ * any locking by the caller. It is split in independently locked
+ * stripes which grow incrementally, and lookups only exclude writers
+ * of the same stripe. The key callbacks are the same as above.
+ */
+typedef struct _virHashConcurrentTable virHashConcurrentTable;
+typedef virHashConcurrentTable *virHashConcurrentTablePtr;
+
+virHashConcurrentTablePtr virHashConcurrentCreate(ssize_t size,
+                                                  virHashDataFree dataFree);
+virHashConcurrentTablePtr virHashConcurrentCreateFull(ssize_t size,
+                                                      virHashDataFree dataFree,
+                                                      virHashKeyCode keyCode,
+                                                      virHashKeyEqual keyEqual,
+                                                      virHashKeyCopy keyCopy,
+                                                      virHashKeyFree keyFree);
+void virHashConcurrentFree(virHashConcurrentTablePtr table);
+ssize_t virHashConcurrentSize(virHashConcurrentTablePtr table);
+
+int virHashConcurrentAddEntry(virHashConcurrentTablePtr table,
+                              const void *name, void *userdata);
+int virHashConcurrentUpdateEntry(virHashConcurrentTablePtr table,
+                                 const void *name, void *userdata);
+int virHashConcurrentRemoveEntry(virHashConcurrentTablePtr table,
+                                 const void *name);
+ssize_t virHashConcurrentRemoveAll(virHashConcurrentTablePtr table);
+
+void *virHashConcurrentLookup(virHashConcurrentTablePtr table,
+                              const void *name);
+void *virHashConcurrentLookupFull(virHashConcurrentTablePtr table,
+                                  const void *name,
+                                  virHashIterator iter,
+                                  void *data);
+void *virHashConcurrentSteal(virHashConcurrentTablePtr table,
+                             const void *name);
+
+ssize_t virHashConcurrentForEach(virHashConcurrentTablePtr table,
+                                 virHashIterator iter, void *data);
+ssize_t virHashConcurrentRemoveSet(virHashConcurrentTablePtr table,
+                                   virHashSearcher iter, const void *data);
+void *virHashConcurrentSearch(virHashConcurrentTablePtr table,
+                              virHashSearcher iter, const void *data);
+
 #endif                          /* ! __VIR_HASH_H__ */
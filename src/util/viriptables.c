@@ -43,6 +43,7 @@
 #include "viriptables.h"
 #include "vircommand.h"
 #include "viralloc.h"
+#include "virbuffer.h"
 #include "virerror.h"
 #include "virfile.h"
 #include "virlog.h"
@@ -88,60 +89,491 @@ enum {
     REMOVE
 };
 
+/* Tables touched by this file, in the order their changes are committed */
+static const char *iptablesTables[] = { "filter", "nat", "mangle" };
+
+typedef struct _iptablesRule iptablesRule;
+typedef iptablesRule *iptablesRulePtr;
+struct _iptablesRule {
+    const char *table;
+    const char *chain;
+    int family;
+    int action;
+    bool optional; /* failure to apply it is only logged */
+    bool oom;
+
+    size_t nargs;
+    char **args;
+};
+
+struct _iptablesTransaction {
+    char *network;  /* for error messages, if the rules are for one */
+    size_t nrules;
+    iptablesRulePtr *rules;
+};
+
+static iptablesRulePtr
+iptablesRuleNew(const char *table, const char *chain, int family, int action)
+{
+    iptablesRulePtr rule;
+
+    if (VIR_ALLOC(rule) < 0)
+        return NULL;
+
+    rule->table = table;
+    rule->chain = chain;
+    rule->family = family;
+    rule->action = action;
+    /* deleting a rule that is no longer there is not an error */
+    rule->optional = action == REMOVE;
+    return rule;
+}
+
+static void
+iptablesRuleFree(iptablesRulePtr rule)
+{
+    size_t i;
+
+    if (!rule)
+        return;
+
+    for (i = 0; i < rule->nargs; i++)
+        VIR_FREE(rule->args[i]);
+    VIR_FREE(rule->args);
+    VIR_FREE(rule);
+}
+
+/* Like virCommandAddArg, an allocation failure is remembered and
+ * reported when the rule is applied */
+static void
+iptablesRuleAddArg(iptablesRulePtr rule, const char *arg)
+{
+    char *tmp = NULL;
+
+    if (rule->oom)
+        return;
+
+    if (VIR_STRDUP_QUIET(tmp, arg) < 0 ||
+        VIR_APPEND_ELEMENT_QUIET(rule->args, rule->nargs, tmp) < 0) {
+        VIR_FREE(tmp);
+        rule->oom = true;
+    }
+}
+
+static void ATTRIBUTE_SENTINEL
+iptablesRuleAddArgList(iptablesRulePtr rule, ...)
+{
+    va_list args;
+    const char *s;
+
+    va_start(args, rule);
+    while ((s = va_arg(args, const char *)))
+        iptablesRuleAddArg(rule, s);
+    va_end(args);
+}
+
 static virCommandPtr
-iptablesCommandNew(const char *table, const char *chain, int family, int action)
+iptablesRuleToCommand(iptablesRulePtr rule)
 {
     virCommandPtr cmd = NULL;
+    size_t i;
 #if HAVE_FIREWALLD
     virIpTablesInitialize();
     if (firewall_cmd_path) {
         cmd = virCommandNew(firewall_cmd_path);
         virCommandAddArgList(cmd, "--direct", "--passthrough",
-                             (family == AF_INET6) ? "ipv6" : "ipv4", NULL);
+                             (rule->family == AF_INET6) ? "ipv6" : "ipv4", NULL);
     }
 #endif
 
     if (cmd == NULL) {
-        cmd = virCommandNew((family == AF_INET6)
+        cmd = virCommandNew((rule->family == AF_INET6)
                         ? IP6TABLES_PATH : IPTABLES_PATH);
     }
 
-    virCommandAddArgList(cmd, "--table", table,
-                         action == ADD ? "--insert" : "--delete",
-                         chain, NULL);
+    virCommandAddArgList(cmd, "--table", rule->table,
+                         rule->action == ADD ? "--insert" : "--delete",
+                         rule->chain, NULL);
+    for (i = 0; i < rule->nargs; i++)
+        virCommandAddArg(cmd, rule->args[i]);
     return cmd;
 }
 
 static int
-iptablesCommandRunAndFree(virCommandPtr cmd)
+iptablesRuleRun(iptablesRulePtr rule, int *exitstatus)
 {
+    virCommandPtr cmd = iptablesRuleToCommand(rule);
     int ret;
-    ret = virCommandRun(cmd, NULL);
+
+    ret = virCommandRun(cmd, exitstatus);
     virCommandFree(cmd);
     return ret;
 }
 
+/* Queue @rule in @trans, or run it straight away if @trans is NULL.
+ * The rule is consumed in either case. */
+static int
+iptablesRuleApply(iptablesTransactionPtr trans, iptablesRulePtr rule)
+{
+    int ret = -1;
+
+    if (rule->oom) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (trans) {
+        if (VIR_APPEND_ELEMENT(trans->rules, trans->nrules, rule) < 0)
+            goto cleanup;
+        return 0;
+    }
+
+    ret = iptablesRuleRun(rule, NULL);
+
+cleanup:
+    iptablesRuleFree(rule);
+    return ret;
+}
+
 static int ATTRIBUTE_SENTINEL
-iptablesAddRemoveRule(const char *table, const char *chain, int family, int action,
+iptablesAddRemoveRule(iptablesTransactionPtr trans,
+                      const char *table, const char *chain, int family, int action,
                       const char *arg, ...)
 {
     va_list args;
-    virCommandPtr cmd = NULL;
+    iptablesRulePtr rule;
     const char *s;
 
-    cmd = iptablesCommandNew(table, chain, family, action);
-    virCommandAddArg(cmd, arg);
+    if (!(rule = iptablesRuleNew(table, chain, family, action)))
+        return -1;
+    iptablesRuleAddArg(rule, arg);
 
     va_start(args, arg);
     while ((s = va_arg(args, const char *)))
-        virCommandAddArg(cmd, s);
+        iptablesRuleAddArg(rule, s);
     va_end(args);
 
-    return iptablesCommandRunAndFree(cmd);
+    return iptablesRuleApply(trans, rule);
+}
+
+
+/**
+ * iptablesTransactionNew:
+ * @network: name of the network the rules are for, or NULL
+ *
+ * Create an empty transaction. Rules added to or removed through
+ * the iptables*() helpers with a transaction are only recorded, and
+ * iptablesTransactionCommit() then applies them with one
+ * iptables-restore run per table and address family. @network is
+ * only used to say which rules failed to load.
+ *
+ * Returns the new transaction, or NULL on allocation failure
+ */
+iptablesTransactionPtr
+iptablesTransactionNew(const char *network)
+{
+    iptablesTransactionPtr trans;
+
+    if (VIR_ALLOC(trans) < 0)
+        return NULL;
+
+    if (VIR_STRDUP(trans->network, network) < 0) {
+        VIR_FREE(trans);
+        return NULL;
+    }
+
+    return trans;
+}
+
+/**
+ * iptablesTransactionFree:
+ * @trans: the transaction
+ *
+ * Free @trans and any rules that were not committed
+ */
+void
+iptablesTransactionFree(iptablesTransactionPtr trans)
+{
+    size_t i;
+
+    if (!trans)
+        return;
+
+    for (i = 0; i < trans->nrules; i++)
+        iptablesRuleFree(trans->rules[i]);
+    VIR_FREE(trans->rules);
+    VIR_FREE(trans->network);
+    VIR_FREE(trans);
+}
+
+static void
+iptablesFormatRestoreArg(virBufferPtr buf, const char *arg)
+{
+    const char *p;
+
+    if (*arg && !arg[strcspn(arg, " \t\"'\\")]) {
+        virBufferAdd(buf, arg, -1);
+        return;
+    }
+
+    virBufferAddChar(buf, '"');
+    for (p = arg; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            virBufferAddChar(buf, '\\');
+        virBufferAddChar(buf, *p);
+    }
+    virBufferAddChar(buf, '"');
+}
+
+/* Format the ip(6)tables-restore input for the @action rules of @family
+ * in @table. Returns the number of rules formatted; nothing at all is
+ * written to @buf if there are none. */
+static size_t
+iptablesTransactionFormatTable(iptablesTransactionPtr trans,
+                               virBufferPtr buf,
+                               int family,
+                               int action,
+                               const char *table)
+{
+    size_t i, j;
+    size_t n = 0;
+
+    for (i = 0; i < trans->nrules; i++) {
+        iptablesRulePtr rule = trans->rules[i];
+
+        if (rule->family != family ||
+            rule->action != action ||
+            STRNEQ(rule->table, table))
+            continue;
+
+        if (n++ == 0)
+            virBufferAsprintf(buf, "*%s\n", table);
+
+        virBufferAsprintf(buf, "%s %s", action == ADD ? "-I" : "-D",
+                          rule->chain);
+        for (j = 0; j < rule->nargs; j++) {
+            virBufferAddChar(buf, ' ');
+            iptablesFormatRestoreArg(buf, rule->args[j]);
+        }
+        virBufferAddChar(buf, '\n');
+    }
+
+    if (n)
+        virBufferAddLit(buf, "COMMIT\n");
+    return n;
+}
+
+/**
+ * iptablesTransactionFormat:
+ * @trans: the transaction
+ * @family: AF_INET or AF_INET6
+ *
+ * Format the input iptablesTransactionCommit() feeds to iptables-restore
+ * (or ip6tables-restore) for the @family rules of @trans. Removals come
+ * first, and each table is a separate block because each is committed
+ * by a separate run.
+ *
+ * Returns the formatted rules, an empty string if there are none, or
+ * NULL on allocation failure
+ */
+char *
+iptablesTransactionFormat(iptablesTransactionPtr trans, int family)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *ret = NULL;
+    size_t i;
+
+    for (i = 0; i < ARRAY_CARDINALITY(iptablesTables); i++)
+        iptablesTransactionFormatTable(trans, &buf, family, REMOVE,
+                                       iptablesTables[i]);
+    for (i = 0; i < ARRAY_CARDINALITY(iptablesTables); i++)
+        iptablesTransactionFormatTable(trans, &buf, family, ADD,
+                                       iptablesTables[i]);
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (!virBufferUse(&buf)) {
+        ignore_value(VIR_STRDUP(ret, ""));
+        return ret;
+    }
+
+    return virBufferContentAndReset(&buf);
 }
 
+static const char *
+iptablesRestorePath(int family)
+{
+    const char *path = family == AF_INET6 ?
+        IP6TABLES_RESTORE_PATH : IPTABLES_RESTORE_PATH;
+
+#if HAVE_FIREWALLD
+    /* firewalld only takes rules one at a time via --passthrough */
+    virIpTablesInitialize();
+    if (firewall_cmd_path)
+        return NULL;
+#endif
+
+    if (!virFileIsExecutable(path))
+        return NULL;
+    return path;
+}
+
+/* Run a rule which must not fail, reporting the table and network
+ * it was meant for if it does */
 static int
-iptablesInput(int family,
+iptablesTransactionRunRule(iptablesTransactionPtr trans,
+                           iptablesRulePtr rule)
+{
+    virCommandPtr cmd = iptablesRuleToCommand(rule);
+    const char *prog = rule->family == AF_INET6 ? "ip6tables" : "iptables";
+    char *errbuf = NULL;
+    int status;
+    int ret = -1;
+
+    virCommandSetErrorBuffer(cmd, &errbuf);
+    if (virCommandRun(cmd, &status) < 0)
+        goto cleanup;
+
+    if (status != 0) {
+        if (errbuf)
+            virTrimSpaces(errbuf, NULL);
+        if (trans->network)
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("failed to load %s rules of network '%s' into "
+                             "table '%s', chain %s: %s"),
+                           prog, trans->network, rule->table, rule->chain,
+                           NULLSTR(errbuf));
+        else
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("failed to load %s rules into table '%s', "
+                             "chain %s: %s"),
+                           prog, rule->table, rule->chain, NULLSTR(errbuf));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virCommandFree(cmd);
+    VIR_FREE(errbuf);
+    return ret;
+}
+
+static int
+iptablesTransactionCommitTable(iptablesTransactionPtr trans,
+                               int family,
+                               int action,
+                               const char *table)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virCommandPtr cmd = NULL;
+    const char *restore;
+    char *input = NULL;
+    char *errbuf = NULL;
+    int status;
+    size_t i;
+    int ret = -1;
+
+    if (!iptablesTransactionFormatTable(trans, &buf, family, action, table))
+        return 0;
+
+    if (virBufferError(&buf)) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    input = virBufferContentAndReset(&buf);
+
+    if ((restore = iptablesRestorePath(family))) {
+        VIR_DEBUG("Committing rules with %s:\n%s", restore, input);
+
+        cmd = virCommandNewArgList(restore, "--noflush", NULL);
+        virCommandSetInputBuffer(cmd, input);
+        virCommandSetErrorBuffer(cmd, &errbuf);
+        if (virCommandRun(cmd, &status) == 0 && status == 0) {
+            ret = 0;
+            goto cleanup;
+        }
+
+        /* iptables-restore applies a table all or nothing, so nothing
+         * has changed yet. The usual cause is a removal of a rule that
+         * is already gone, or an optional rule the kernel does not
+         * support; applying the rules one by one sorts both out. */
+        VIR_DEBUG("%s failed for table '%s', applying rules one by one: %s",
+                  restore, table, NULLSTR(errbuf));
+        virResetLastError();
+    }
+
+    for (i = 0; i < trans->nrules; i++) {
+        iptablesRulePtr rule = trans->rules[i];
+
+        if (rule->family != family ||
+            rule->action != action ||
+            STRNEQ(rule->table, table))
+            continue;
+
+        if (!rule->optional) {
+            if (iptablesTransactionRunRule(trans, rule) < 0)
+                goto cleanup;
+        } else if (iptablesRuleRun(rule, &status) < 0 || status != 0) {
+            if (action == ADD)
+                VIR_WARN("Could not add optional rule to %s chain %s",
+                         table, rule->chain);
+            virResetLastError();
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    virCommandFree(cmd);
+    VIR_FREE(input);
+    VIR_FREE(errbuf);
+    return ret;
+}
+
+/**
+ * iptablesTransactionCommit:
+ * @trans: the transaction
+ *
+ * Apply the rules recorded in @trans: all removals first, then all
+ * additions in the order they were recorded. Each table of each
+ * address family is loaded with a single iptables-restore --noflush
+ * run where possible; when firewalld is in use, the restore binary is
+ * missing, or the batch is rejected, the rules of that table are run
+ * one by one as before. Failing removals and optional rules are
+ * ignored.
+ *
+ * Returns 0 on success, -1 if a rule could not be added
+ */
+int
+iptablesTransactionCommit(iptablesTransactionPtr trans)
+{
+    static const int actions[] = { REMOVE, ADD };
+    static const int families[] = { AF_INET, AF_INET6 };
+    size_t i, j, k;
+
+    for (i = 0; i < ARRAY_CARDINALITY(actions); i++) {
+        for (j = 0; j < ARRAY_CARDINALITY(families); j++) {
+            for (k = 0; k < ARRAY_CARDINALITY(iptablesTables); k++) {
+                if (iptablesTransactionCommitTable(trans, families[j],
+                                                   actions[i],
+                                                   iptablesTables[k]) < 0)
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+iptablesInput(iptablesTransactionPtr trans,
+              int family,
               const char *iface,
               int port,
               int action,
@@ -152,7 +584,7 @@ iptablesInput(int family,
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule("filter", "INPUT",
+    return iptablesAddRemoveRule(trans, "filter", "INPUT",
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -164,7 +596,7 @@ iptablesInput(int family,
 
 /**
  * iptablesAddTcpInput:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the TCP port to add
  *
@@ -175,16 +607,17 @@ iptablesInput(int family,
  */
 
 int
-iptablesAddTcpInput(int family,
+iptablesAddTcpInput(iptablesTransactionPtr trans,
+                    int family,
                     const char *iface,
                     int port)
 {
-    return iptablesInput(family, iface, port, ADD, 1);
+    return iptablesInput(trans, family, iface, port, ADD, 1);
 }
 
 /**
  * iptablesRemoveTcpInput:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the TCP port to remove
  *
@@ -194,16 +627,17 @@ iptablesAddTcpInput(int family,
  * Returns 0 in case of success or an error code in case of error
  */
 int
-iptablesRemoveTcpInput(int family,
+iptablesRemoveTcpInput(iptablesTransactionPtr trans,
+                       int family,
                        const char *iface,
                        int port)
 {
-    return iptablesInput(family, iface, port, REMOVE, 1);
+    return iptablesInput(trans, family, iface, port, REMOVE, 1);
 }
 
 /**
  * iptablesAddUdpInput:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the UDP port to add
  *
@@ -214,16 +648,17 @@ iptablesRemoveTcpInput(int family,
  */
 
 int
-iptablesAddUdpInput(int family,
+iptablesAddUdpInput(iptablesTransactionPtr trans,
+                    int family,
                     const char *iface,
                     int port)
 {
-    return iptablesInput(family, iface, port, ADD, 0);
+    return iptablesInput(trans, family, iface, port, ADD, 0);
 }
 
 /**
  * iptablesRemoveUdpInput:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the UDP port to remove
  *
@@ -233,11 +668,12 @@ iptablesAddUdpInput(int family,
  * Returns 0 in case of success or an error code in case of error
  */
 int
-iptablesRemoveUdpInput(int family,
+iptablesRemoveUdpInput(iptablesTransactionPtr trans,
+                       int family,
                        const char *iface,
                        int port)
 {
-    return iptablesInput(family, iface, port, REMOVE, 0);
+    return iptablesInput(trans, family, iface, port, REMOVE, 0);
 }
 
 
@@ -255,6 +691,9 @@ static char *iptablesFormatNetwork(virSocketAddr *netaddr,
         return NULL;
     }
 
+    /* virSocketAddrMaskByPrefix leaves the IPv6 scope id alone, and
+     * getnameinfo() would append it to the network address */
+    memset(&network, 0, sizeof(network));
     if (virSocketAddrMaskByPrefix(netaddr, prefix, &network) < 0) {
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
                        _("Failure to mask address"));
@@ -277,7 +716,8 @@ static char *iptablesFormatNetwork(virSocketAddr *netaddr,
  * to proceed to WAN
  */
 static int
-iptablesForwardAllowOut(virSocketAddr *netaddr,
+iptablesForwardAllowOut(iptablesTransactionPtr trans,
+                        virSocketAddr *netaddr,
                         unsigned int prefix,
                         const char *iface,
                         const char *physdev,
@@ -285,31 +725,34 @@ iptablesForwardAllowOut(virSocketAddr *netaddr,
 {
     int ret;
     char *networkstr;
-    virCommandPtr cmd = NULL;
+    iptablesRulePtr rule = NULL;
 
     if (!(networkstr = iptablesFormatNetwork(netaddr, prefix)))
         return -1;
 
-    cmd = iptablesCommandNew("filter", "FORWARD",
-                             VIR_SOCKET_ADDR_FAMILY(netaddr),
-                             action);
-    virCommandAddArgList(cmd,
-                         "--source", networkstr,
-                         "--in-interface", iface, NULL);
+    if (!(rule = iptablesRuleNew("filter", "FORWARD",
+                                 VIR_SOCKET_ADDR_FAMILY(netaddr),
+                                 action))) {
+        VIR_FREE(networkstr);
+        return -1;
+    }
+    iptablesRuleAddArgList(rule,
+                           "--source", networkstr,
+                           "--in-interface", iface, NULL);
 
     if (physdev && physdev[0])
-        virCommandAddArgList(cmd, "--out-interface", physdev, NULL);
+        iptablesRuleAddArgList(rule, "--out-interface", physdev, NULL);
 
-    virCommandAddArgList(cmd, "--jump", "ACCEPT", NULL);
+    iptablesRuleAddArgList(rule, "--jump", "ACCEPT", NULL);
 
-    ret = iptablesCommandRunAndFree(cmd);
+    ret = iptablesRuleApply(trans, rule);
     VIR_FREE(networkstr);
     return ret;
 }
 
 /**
  * iptablesAddForwardAllowOut:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the source interface name
  * @physdev: the physical output device
@@ -321,17 +764,19 @@ iptablesForwardAllowOut(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardAllowOut(virSocketAddr *netaddr,
+iptablesAddForwardAllowOut(iptablesTransactionPtr trans,
+                           virSocketAddr *netaddr,
                            unsigned int prefix,
                            const char *iface,
                            const char *physdev)
 {
-    return iptablesForwardAllowOut(netaddr, prefix, iface, physdev, ADD);
+    return iptablesForwardAllowOut(trans, netaddr, prefix, iface, physdev,
+                                   ADD);
 }
 
 /**
  * iptablesRemoveForwardAllowOut:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the source interface name
  * @physdev: the physical output device
@@ -343,12 +788,14 @@ iptablesAddForwardAllowOut(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardAllowOut(virSocketAddr *netaddr,
+iptablesRemoveForwardAllowOut(iptablesTransactionPtr trans,
+                              virSocketAddr *netaddr,
                               unsigned int prefix,
                               const char *iface,
                               const char *physdev)
 {
-    return iptablesForwardAllowOut(netaddr, prefix, iface, physdev, REMOVE);
+    return iptablesForwardAllowOut(trans, netaddr, prefix, iface, physdev,
+                                   REMOVE);
 }
 
 
@@ -356,7 +803,8 @@ iptablesRemoveForwardAllowOut(virSocketAddr *netaddr,
  * and associated with an existing connection
  */
 static int
-iptablesForwardAllowRelatedIn(virSocketAddr *netaddr,
+iptablesForwardAllowRelatedIn(iptablesTransactionPtr trans,
+                              virSocketAddr *netaddr,
                               unsigned int prefix,
                               const char *iface,
                               const char *physdev,
@@ -369,7 +817,7 @@ iptablesForwardAllowRelatedIn(virSocketAddr *netaddr,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule("filter", "FORWARD",
+        ret = iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -380,7 +828,7 @@ iptablesForwardAllowRelatedIn(virSocketAddr *netaddr,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule("filter", "FORWARD",
+        ret = iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -396,7 +844,7 @@ iptablesForwardAllowRelatedIn(virSocketAddr *netaddr,
 
 /**
  * iptablesAddForwardAllowRelatedIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the output interface name
  * @physdev: the physical input device or NULL
@@ -408,17 +856,19 @@ iptablesForwardAllowRelatedIn(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardAllowRelatedIn(virSocketAddr *netaddr,
+iptablesAddForwardAllowRelatedIn(iptablesTransactionPtr trans,
+                                 virSocketAddr *netaddr,
                                  unsigned int prefix,
                                  const char *iface,
                                  const char *physdev)
 {
-    return iptablesForwardAllowRelatedIn(netaddr, prefix, iface, physdev, ADD);
+    return iptablesForwardAllowRelatedIn(trans, netaddr, prefix, iface, physdev,
+                                         ADD);
 }
 
 /**
  * iptablesRemoveForwardAllowRelatedIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the output interface name
  * @physdev: the physical input device or NULL
@@ -430,18 +880,21 @@ iptablesAddForwardAllowRelatedIn(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardAllowRelatedIn(virSocketAddr *netaddr,
+iptablesRemoveForwardAllowRelatedIn(iptablesTransactionPtr trans,
+                                    virSocketAddr *netaddr,
                                     unsigned int prefix,
                                     const char *iface,
                                     const char *physdev)
 {
-    return iptablesForwardAllowRelatedIn(netaddr, prefix, iface, physdev, REMOVE);
+    return iptablesForwardAllowRelatedIn(trans, netaddr, prefix, iface, physdev,
+                                         REMOVE);
 }
 
 /* Allow all traffic destined to the bridge, with a valid network address
  */
 static int
-iptablesForwardAllowIn(virSocketAddr *netaddr,
+iptablesForwardAllowIn(iptablesTransactionPtr trans,
+                       virSocketAddr *netaddr,
                        unsigned int prefix,
                        const char *iface,
                        const char *physdev,
@@ -454,7 +907,7 @@ iptablesForwardAllowIn(virSocketAddr *netaddr,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule("filter", "FORWARD",
+        ret = iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -463,7 +916,7 @@ iptablesForwardAllowIn(virSocketAddr *netaddr,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule("filter", "FORWARD",
+        ret = iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                     VIR_SOCKET_ADDR_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -477,7 +930,7 @@ iptablesForwardAllowIn(virSocketAddr *netaddr,
 
 /**
  * iptablesAddForwardAllowIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the output interface name
  * @physdev: the physical input device or NULL
@@ -489,17 +942,19 @@ iptablesForwardAllowIn(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardAllowIn(virSocketAddr *netaddr,
+iptablesAddForwardAllowIn(iptablesTransactionPtr trans,
+                          virSocketAddr *netaddr,
                           unsigned int prefix,
                           const char *iface,
                           const char *physdev)
 {
-    return iptablesForwardAllowIn(netaddr, prefix, iface, physdev, ADD);
+    return iptablesForwardAllowIn(trans, netaddr, prefix, iface, physdev,
+                                  ADD);
 }
 
 /**
  * iptablesRemoveForwardAllowIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @iface: the output interface name
  * @physdev: the physical input device or NULL
@@ -511,12 +966,14 @@ iptablesAddForwardAllowIn(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardAllowIn(virSocketAddr *netaddr,
+iptablesRemoveForwardAllowIn(iptablesTransactionPtr trans,
+                             virSocketAddr *netaddr,
                              unsigned int prefix,
                              const char *iface,
                              const char *physdev)
 {
-    return iptablesForwardAllowIn(netaddr, prefix, iface, physdev, REMOVE);
+    return iptablesForwardAllowIn(trans, netaddr, prefix, iface, physdev,
+                                  REMOVE);
 }
 
 
@@ -524,11 +981,12 @@ iptablesRemoveForwardAllowIn(virSocketAddr *netaddr,
  * with a valid network address
  */
 static int
-iptablesForwardAllowCross(int family,
+iptablesForwardAllowCross(iptablesTransactionPtr trans,
+                          int family,
                           const char *iface,
                           int action)
 {
-    return iptablesAddRemoveRule("filter", "FORWARD",
+    return iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -539,7 +997,7 @@ iptablesForwardAllowCross(int family,
 
 /**
  * iptablesAddForwardAllowCross:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the input/output interface name
  *
  * Add rules to the IP table context to allow traffic to cross that
@@ -549,15 +1007,16 @@ iptablesForwardAllowCross(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardAllowCross(int family,
+iptablesAddForwardAllowCross(iptablesTransactionPtr trans,
+                             int family,
                              const char *iface)
 {
-    return iptablesForwardAllowCross(family, iface, ADD);
+    return iptablesForwardAllowCross(trans, family, iface, ADD);
 }
 
 /**
  * iptablesRemoveForwardAllowCross:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the input/output interface name
  *
  * Remove rules to the IP table context to block traffic to cross that
@@ -567,10 +1026,11 @@ iptablesAddForwardAllowCross(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardAllowCross(int family,
+iptablesRemoveForwardAllowCross(iptablesTransactionPtr trans,
+                                int family,
                                 const char *iface)
 {
-    return iptablesForwardAllowCross(family, iface, REMOVE);
+    return iptablesForwardAllowCross(trans, family, iface, REMOVE);
 }
 
 
@@ -578,11 +1038,12 @@ iptablesRemoveForwardAllowCross(int family,
  * ie the bridge is the in interface
  */
 static int
-iptablesForwardRejectOut(int family,
+iptablesForwardRejectOut(iptablesTransactionPtr trans,
+                         int family,
                          const char *iface,
                          int action)
 {
-    return iptablesAddRemoveRule("filter", "FORWARD",
+    return iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -592,7 +1053,7 @@ iptablesForwardRejectOut(int family,
 
 /**
  * iptablesAddForwardRejectOut:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the output interface name
  *
  * Add rules to the IP table context to forbid all traffic to that
@@ -601,15 +1062,16 @@ iptablesForwardRejectOut(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardRejectOut(int family,
+iptablesAddForwardRejectOut(iptablesTransactionPtr trans,
+                            int family,
                             const char *iface)
 {
-    return iptablesForwardRejectOut(family, iface, ADD);
+    return iptablesForwardRejectOut(trans, family, iface, ADD);
 }
 
 /**
  * iptablesRemoveForwardRejectOut:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the output interface name
  *
  * Remove rules from the IP table context forbidding all traffic to that
@@ -618,10 +1080,11 @@ iptablesAddForwardRejectOut(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardRejectOut(int family,
+iptablesRemoveForwardRejectOut(iptablesTransactionPtr trans,
+                               int family,
                                const char *iface)
 {
-    return iptablesForwardRejectOut(family, iface, REMOVE);
+    return iptablesForwardRejectOut(trans, family, iface, REMOVE);
 }
 
 
@@ -631,11 +1094,12 @@ iptablesRemoveForwardRejectOut(int family,
  * ie the bridge is the out interface
  */
 static int
-iptablesForwardRejectIn(int family,
+iptablesForwardRejectIn(iptablesTransactionPtr trans,
+                        int family,
                         const char *iface,
                         int action)
 {
-    return iptablesAddRemoveRule("filter", "FORWARD",
+    return iptablesAddRemoveRule(trans, "filter", "FORWARD",
                                  family,
                                  action,
                                  "--out-interface", iface,
@@ -645,7 +1109,7 @@ iptablesForwardRejectIn(int family,
 
 /**
  * iptablesAddForwardRejectIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the input interface name
  *
  * Add rules to the IP table context to forbid all traffic from that
@@ -654,15 +1118,16 @@ iptablesForwardRejectIn(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardRejectIn(int family,
+iptablesAddForwardRejectIn(iptablesTransactionPtr trans,
+                           int family,
                            const char *iface)
 {
-    return iptablesForwardRejectIn(family, iface, ADD);
+    return iptablesForwardRejectIn(trans, family, iface, ADD);
 }
 
 /**
  * iptablesRemoveForwardRejectIn:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the input interface name
  *
  * Remove rules from the IP table context forbidding all traffic from that
@@ -671,10 +1136,11 @@ iptablesAddForwardRejectIn(int family,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardRejectIn(int family,
+iptablesRemoveForwardRejectIn(iptablesTransactionPtr trans,
+                              int family,
                               const char *iface)
 {
-    return iptablesForwardRejectIn(family, iface, REMOVE);
+    return iptablesForwardRejectIn(trans, family, iface, REMOVE);
 }
 
 
@@ -682,7 +1148,8 @@ iptablesRemoveForwardRejectIn(int family,
  * with the bridge
  */
 static int
-iptablesForwardMasquerade(virSocketAddr *netaddr,
+iptablesForwardMasquerade(iptablesTransactionPtr trans,
+                          virSocketAddr *netaddr,
                           unsigned int prefix,
                           const char *physdev,
                           virSocketAddrRangePtr addr,
@@ -696,7 +1163,7 @@ iptablesForwardMasquerade(virSocketAddr *netaddr,
     char *addrEndStr = NULL;
     char *portRangeStr = NULL;
     char *natRangeStr = NULL;
-    virCommandPtr cmd = NULL;
+    iptablesRulePtr rule = NULL;
 
     if (!(networkstr = iptablesFormatNetwork(netaddr, prefix)))
         return -1;
@@ -718,16 +1185,17 @@ iptablesForwardMasquerade(virSocketAddr *netaddr,
         }
     }
 
-    cmd = iptablesCommandNew("nat", "POSTROUTING", AF_INET, action);
-    virCommandAddArgList(cmd, "--source", networkstr, NULL);
+    if (!(rule = iptablesRuleNew("nat", "POSTROUTING", AF_INET, action)))
+        goto cleanup;
+    iptablesRuleAddArgList(rule, "--source", networkstr, NULL);
 
     if (protocol && protocol[0])
-        virCommandAddArgList(cmd, "-p", protocol, NULL);
+        iptablesRuleAddArgList(rule, "-p", protocol, NULL);
 
-    virCommandAddArgList(cmd, "!", "--destination", networkstr, NULL);
+    iptablesRuleAddArgList(rule, "!", "--destination", networkstr, NULL);
 
     if (physdev && physdev[0])
-        virCommandAddArgList(cmd, "--out-interface", physdev, NULL);
+        iptablesRuleAddArgList(rule, "--out-interface", physdev, NULL);
 
     if (protocol && protocol[0]) {
         if (port->start == 0 && port->end == 0) {
@@ -761,18 +1229,19 @@ iptablesForwardMasquerade(virSocketAddr *netaddr,
         if (r < 0)
             goto cleanup;
 
-        virCommandAddArgList(cmd, "--jump", "SNAT",
-                                  "--to-source", natRangeStr, NULL);
+        iptablesRuleAddArgList(rule, "--jump", "SNAT",
+                               "--to-source", natRangeStr, NULL);
      } else {
-         virCommandAddArgList(cmd, "--jump", "MASQUERADE", NULL);
+         iptablesRuleAddArgList(rule, "--jump", "MASQUERADE", NULL);
 
          if (portRangeStr && portRangeStr[0])
-             virCommandAddArgList(cmd, "--to-ports", &portRangeStr[1], NULL);
+             iptablesRuleAddArgList(rule, "--to-ports", &portRangeStr[1], NULL);
      }
 
-    ret = virCommandRun(cmd, NULL);
+    ret = iptablesRuleApply(trans, rule);
+    rule = NULL;
 cleanup:
-    virCommandFree(cmd);
+    iptablesRuleFree(rule);
     VIR_FREE(networkstr);
     VIR_FREE(addrStartStr);
     VIR_FREE(addrEndStr);
@@ -783,7 +1252,7 @@ cleanup:
 
 /**
  * iptablesAddForwardMasquerade:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @physdev: the physical input device or NULL
  * @protocol: the network protocol or NULL
@@ -795,20 +1264,21 @@ cleanup:
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesAddForwardMasquerade(virSocketAddr *netaddr,
+iptablesAddForwardMasquerade(iptablesTransactionPtr trans,
+                             virSocketAddr *netaddr,
                              unsigned int prefix,
                              const char *physdev,
                              virSocketAddrRangePtr addr,
                              virPortRangePtr port,
                              const char *protocol)
 {
-    return iptablesForwardMasquerade(netaddr, prefix, physdev, addr, port,
-                                     protocol, ADD);
+    return iptablesForwardMasquerade(trans, netaddr, prefix, physdev,
+                                     addr, port, protocol, ADD);
 }
 
 /**
  * iptablesRemoveForwardMasquerade:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @network: the source network name
  * @physdev: the physical input device or NULL
  * @protocol: the network protocol or NULL
@@ -820,41 +1290,49 @@ iptablesAddForwardMasquerade(virSocketAddr *netaddr,
  * Returns 0 in case of success or an error code otherwise
  */
 int
-iptablesRemoveForwardMasquerade(virSocketAddr *netaddr,
+iptablesRemoveForwardMasquerade(iptablesTransactionPtr trans,
+                                virSocketAddr *netaddr,
                                 unsigned int prefix,
                                 const char *physdev,
                                 virSocketAddrRangePtr addr,
                                 virPortRangePtr port,
                                 const char *protocol)
 {
-    return iptablesForwardMasquerade(netaddr, prefix, physdev, addr, port,
-                                     protocol, REMOVE);
+    return iptablesForwardMasquerade(trans, netaddr, prefix, physdev,
+                                     addr, port, protocol, REMOVE);
 }
 
 
 static int
-iptablesOutputFixUdpChecksum(const char *iface,
+iptablesOutputFixUdpChecksum(iptablesTransactionPtr trans,
+                             const char *iface,
                              int port,
                              int action)
 {
     char portstr[32];
+    iptablesRulePtr rule;
 
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule("mangle", "POSTROUTING",
-                                 AF_INET,
-                                 action,
-                                 "--out-interface", iface,
-                                 "--protocol", "udp",
-                                 "--destination-port", portstr,
-                                 "--jump", "CHECKSUM", "--checksum-fill",
-                                 NULL);
+    if (!(rule = iptablesRuleNew("mangle", "POSTROUTING", AF_INET, action)))
+        return -1;
+
+    /* not all iptables implementations support CHECKSUM */
+    rule->optional = true;
+    iptablesRuleAddArgList(rule,
+                           "--out-interface", iface,
+                           "--protocol", "udp",
+                           "--destination-port", portstr,
+                           "--jump", "CHECKSUM", "--checksum-fill",
+                           NULL);
+
+    return iptablesRuleApply(trans, rule);
 }
 
 /**
  * iptablesAddOutputFixUdpChecksum:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the UDP port to match
  *
@@ -864,19 +1342,21 @@ iptablesOutputFixUdpChecksum(const char *iface,
  *
  * Returns 0 in case of success or an error code in case of error.
  * (NB: if the system's iptables does not support checksum mangling,
- * this will return an error, which should be ignored.)
+ * this will return an error, which should be ignored. When the rule is
+ * queued in a transaction, such a failure is only logged at commit.)
  */
 
 int
-iptablesAddOutputFixUdpChecksum(const char *iface,
+iptablesAddOutputFixUdpChecksum(iptablesTransactionPtr trans,
+                                const char *iface,
                                 int port)
 {
-    return iptablesOutputFixUdpChecksum(iface, port, ADD);
+    return iptablesOutputFixUdpChecksum(trans, iface, port, ADD);
 }
 
 /**
  * iptablesRemoveOutputFixUdpChecksum:
- * @ctx: pointer to the IP table context
+ * @trans: transaction to queue the rule in, or NULL to apply it at once
  * @iface: the interface name
  * @port: the UDP port of the rule to remove
  *
@@ -888,8 +1368,9 @@ iptablesAddOutputFixUdpChecksum(const char *iface,
  * return an error, which should be ignored)
  */
 int
-iptablesRemoveOutputFixUdpChecksum(const char *iface,
+iptablesRemoveOutputFixUdpChecksum(iptablesTransactionPtr trans,
+                                   const char *iface,
                                    int port)
 {
-    return iptablesOutputFixUdpChecksum(iface, port, REMOVE);
+    return iptablesOutputFixUdpChecksum(trans, iface, port, REMOVE);
 }
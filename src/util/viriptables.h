@@ -26,77 +26,107 @@
 
 # include "virsocketaddr.h"
 
-int              iptablesAddTcpInput             (int family,
+typedef struct _iptablesTransaction iptablesTransaction;
+typedef iptablesTransaction *iptablesTransactionPtr;
+
+iptablesTransactionPtr iptablesTransactionNew(const char *network);
+void iptablesTransactionFree(iptablesTransactionPtr trans);
+int iptablesTransactionCommit(iptablesTransactionPtr trans)
+    ATTRIBUTE_NONNULL(1);
+char *iptablesTransactionFormat(iptablesTransactionPtr trans, int family)
+    ATTRIBUTE_NONNULL(1);
+
+int              iptablesAddTcpInput             (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface,
                                                   int port);
-int              iptablesRemoveTcpInput          (int family,
+int              iptablesRemoveTcpInput          (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface,
                                                   int port);
 
-int              iptablesAddUdpInput             (int family,
+int              iptablesAddUdpInput             (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface,
                                                   int port);
-int              iptablesRemoveUdpInput          (int family,
+int              iptablesRemoveUdpInput          (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface,
                                                   int port);
 
-int              iptablesAddForwardAllowOut      (virSocketAddr *netaddr,
+int              iptablesAddForwardAllowOut      (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
-int              iptablesRemoveForwardAllowOut   (virSocketAddr *netaddr,
+int              iptablesRemoveForwardAllowOut   (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
 
-int              iptablesAddForwardAllowRelatedIn(virSocketAddr *netaddr,
+int              iptablesAddForwardAllowRelatedIn(iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
-int              iptablesRemoveForwardAllowRelatedIn(virSocketAddr *netaddr,
+int              iptablesRemoveForwardAllowRelatedIn(iptablesTransactionPtr trans,
+                                                     virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
 
-int              iptablesAddForwardAllowIn       (virSocketAddr *netaddr,
+int              iptablesAddForwardAllowIn       (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
-int              iptablesRemoveForwardAllowIn    (virSocketAddr *netaddr,
+int              iptablesRemoveForwardAllowIn    (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *iface,
                                                   const char *physdev);
 
-int              iptablesAddForwardAllowCross    (int family,
+int              iptablesAddForwardAllowCross    (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
-int              iptablesRemoveForwardAllowCross (int family,
+int              iptablesRemoveForwardAllowCross (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
 
-int              iptablesAddForwardRejectOut     (int family,
+int              iptablesAddForwardRejectOut     (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
-int              iptablesRemoveForwardRejectOut  (int family,
+int              iptablesRemoveForwardRejectOut  (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
 
-int              iptablesAddForwardRejectIn      (int family,
+int              iptablesAddForwardRejectIn      (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
-int              iptablesRemoveForwardRejectIn   (int family,
+int              iptablesRemoveForwardRejectIn   (iptablesTransactionPtr trans,
+                                                  int family,
                                                   const char *iface);
 
-int              iptablesAddForwardMasquerade    (virSocketAddr *netaddr,
+int              iptablesAddForwardMasquerade    (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *physdev,
                                                   virSocketAddrRangePtr addr,
                                                   virPortRangePtr port,
                                                   const char *protocol);
-int              iptablesRemoveForwardMasquerade (virSocketAddr *netaddr,
+int              iptablesRemoveForwardMasquerade (iptablesTransactionPtr trans,
+                                                  virSocketAddr *netaddr,
                                                   unsigned int prefix,
                                                   const char *physdev,
                                                   virSocketAddrRangePtr addr,
                                                   virPortRangePtr port,
                                                   const char *protocol);
-int              iptablesAddOutputFixUdpChecksum (const char *iface,
+int              iptablesAddOutputFixUdpChecksum (iptablesTransactionPtr trans,
+                                                  const char *iface,
                                                   int port);
-int              iptablesRemoveOutputFixUdpChecksum (const char *iface,
+int              iptablesRemoveOutputFixUdpChecksum (iptablesTransactionPtr trans,
+                                                     const char *iface,
                                                      int port);
 
 #endif /* __QEMUD_IPTABLES_H__ */
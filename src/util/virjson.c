@@ -26,6 +26,7 @@
 #include "virjson.h"
 #include "viralloc.h"
 #include "virerror.h"
+#include "virhashcode.h"
 #include "virlog.h"
 #include "virstring.h"
 #include "virutil.h"
@@ -45,6 +46,10 @@
 /* XXX fixme */
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+/* Objects with this many keys get a hash index for lookups. Below
+ * that a linear scan is as fast and saves the memory */
+#define VIR_JSON_OBJECT_INDEX_MIN 16
+
 
 typedef struct _virJSONParserState virJSONParserState;
 typedef virJSONParserState *virJSONParserStatePtr;
@@ -70,6 +75,7 @@ void virJSONValueFree(virJSONValuePtr value)
 
     switch ((virJSONType) value->type) {
     case VIR_JSON_TYPE_OBJECT:
+        virHashFree(value->data.object.index);
         for (i = 0; i < value->data.object.npairs; i++) {
             VIR_FREE(value->data.object.pairs[i].key);
             virJSONValueFree(value->data.object.pairs[i].value);
@@ -259,9 +265,71 @@ virJSONValuePtr virJSONValueNewObject(void)
     return val;
 }
 
+
+/* The index refers to the keys owned by the pairs, no copies */
+static uint32_t virJSONObjectIndexCode(const void *name, uint32_t seed)
+{
+    return virHashCodeGen(name, strlen(name), seed);
+}
+
+static bool virJSONObjectIndexEqual(const void *namea, const void *nameb)
+{
+    return STREQ(namea, nameb);
+}
+
+static void *virJSONObjectIndexCopy(const void *name)
+{
+    return (void *)name;
+}
+
+
+static int virJSONObjectIndexBuild(virJSONObjectPtr object)
+{
+    size_t i;
+
+    virHashFree(object->index);
+    if (!(object->index = virHashCreateFull(object->npairs * 2, NULL,
+                                            virJSONObjectIndexCode,
+                                            virJSONObjectIndexEqual,
+                                            virJSONObjectIndexCopy,
+                                            NULL)))
+        return -1;
+
+    for (i = 0; i < object->npairs; i++) {
+        if (virHashAddEntry(object->index, object->pairs[i].key,
+                            (void *)(intptr_t)(i + 1)) < 0) {
+            virHashFree(object->index);
+            object->index = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Returns the position of @key in @object, or -1 if not present */
+static ssize_t virJSONObjectFind(virJSONObjectPtr object, const char *key)
+{
+    size_t i;
+
+    if (object->index)
+        return (intptr_t)virHashLookup(object->index, key) - 1;
+
+    for (i = 0; i < object->npairs; i++) {
+        if (STREQ(object->pairs[i].key, key))
+            return i;
+    }
+
+    return -1;
+}
+
+
 int virJSONValueObjectAppend(virJSONValuePtr object, const char *key, virJSONValuePtr value)
 {
+    virJSONObjectPtr obj = &object->data.object;
     char *newkey;
+    int rc;
 
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return -1;
@@ -272,15 +340,28 @@ int virJSONValueObjectAppend(virJSONValuePtr object, const char *key, virJSONVal
     if (VIR_STRDUP(newkey, key) < 0)
         return -1;
 
-    if (VIR_REALLOC_N(object->data.object.pairs,
-                      object->data.object.npairs + 1) < 0) {
+    if (VIR_REALLOC_N(obj->pairs, obj->npairs + 1) < 0) {
         VIR_FREE(newkey);
         return -1;
     }
 
-    object->data.object.pairs[object->data.object.npairs].key = newkey;
-    object->data.object.pairs[object->data.object.npairs].value = value;
-    object->data.object.npairs++;
+    obj->pairs[obj->npairs].key = newkey;
+    obj->pairs[obj->npairs].value = value;
+    obj->npairs++;
+
+    if (obj->index)
+        rc = virHashAddEntry(obj->index, newkey,
+                             (void *)(intptr_t)obj->npairs);
+    else if (obj->npairs >= VIR_JSON_OBJECT_INDEX_MIN)
+        rc = virJSONObjectIndexBuild(obj);
+    else
+        rc = 0;
+
+    if (rc < 0) {
+        obj->npairs--;
+        VIR_FREE(newkey);
+        return -1;
+    }
 
     return 0;
 }
@@ -401,32 +482,23 @@ int virJSONValueArrayAppend(virJSONValuePtr array, virJSONValuePtr value)
 
 int virJSONValueObjectHasKey(virJSONValuePtr object, const char *key)
 {
-    size_t i;
-
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return -1;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return 1;
-    }
-
-    return 0;
+    return virJSONObjectFind(&object->data.object, key) >= 0;
 }
 
 virJSONValuePtr virJSONValueObjectGet(virJSONValuePtr object, const char *key)
 {
-    size_t i;
+    ssize_t i;
 
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return NULL;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key))
-            return object->data.object.pairs[i].value;
-    }
+    if ((i = virJSONObjectFind(&object->data.object, key)) < 0)
+        return NULL;
 
-    return NULL;
+    return object->data.object.pairs[i].value;
 }
 
 int virJSONValueObjectKeysNumber(virJSONValuePtr object)
@@ -455,7 +527,8 @@ int
 virJSONValueObjectRemoveKey(virJSONValuePtr object, const char *key,
                             virJSONValuePtr *value)
 {
-    size_t i;
+    virJSONObjectPtr obj = &object->data.object;
+    ssize_t i;
 
     if (value)
         *value = NULL;
@@ -463,21 +536,27 @@ virJSONValueObjectRemoveKey(virJSONValuePtr object, const char *key,
     if (object->type != VIR_JSON_TYPE_OBJECT)
         return -1;
 
-    for (i = 0; i < object->data.object.npairs; i++) {
-        if (STREQ(object->data.object.pairs[i].key, key)) {
-            if (value) {
-                *value = object->data.object.pairs[i].value;
-                object->data.object.pairs[i].value = NULL;
-            }
-            VIR_FREE(object->data.object.pairs[i].key);
-            virJSONValueFree(object->data.object.pairs[i].value);
-            VIR_DELETE_ELEMENT(object->data.object.pairs, i,
-                               object->data.object.npairs);
-            return 1;
-        }
+    if ((i = virJSONObjectFind(obj, key)) < 0)
+        return 0;
+
+    if (value) {
+        *value = obj->pairs[i].value;
+        obj->pairs[i].value = NULL;
     }
 
-    return 0;
+    /* Positions shift, so the index has to be rebuilt. If that
+     * fails lookups just fall back to a linear scan */
+    virHashFree(obj->index);
+    obj->index = NULL;
+
+    VIR_FREE(obj->pairs[i].key);
+    virJSONValueFree(obj->pairs[i].value);
+    VIR_DELETE_ELEMENT(obj->pairs, i, obj->npairs);
+
+    if (obj->npairs >= VIR_JSON_OBJECT_INDEX_MIN)
+        ignore_value(virJSONObjectIndexBuild(obj));
+
+    return 1;
 }
 
 virJSONValuePtr virJSONValueObjectGetValue(virJSONValuePtr object, unsigned int n)
@@ -1023,6 +1102,454 @@ cleanup:
 }
 
 
+/*
+ * Scanner for virJSONValueScan. It follows the location of each
+ * value as the document is parsed, and only builds values whose
+ * location matches one of the requested paths.
+ */
+typedef struct _virJSONScanFrame virJSONScanFrame;
+typedef virJSONScanFrame *virJSONScanFramePtr;
+struct _virJSONScanFrame {
+    bool array;
+    char *key;      /* current key, objects only */
+    size_t elem;    /* current element, arrays only */
+    size_t nelems;  /* elements seen so far, arrays only */
+};
+
+typedef struct _virJSONScanner virJSONScanner;
+typedef virJSONScanner *virJSONScannerPtr;
+struct _virJSONScanner {
+    char ***paths;
+    size_t *npathcomps;
+    bool *shallow;  /* containers are reported empty, see virJSONValueScan */
+    size_t npaths;
+
+    virJSONValueScanCallback cb;
+    void *opaque;
+    bool aborted;
+
+    virJSONScanFramePtr frames;
+    size_t nframes;
+    size_t *elems;
+
+    /* Container matched by a path, being built in full */
+    virJSONParser capture;
+    ssize_t captureField;
+    size_t captureDepth;
+};
+
+
+/* Returns the index of the path matching the current location, or -1.
+ * Array elements matched by "*" are stored in scanner->elems */
+static ssize_t virJSONScannerMatch(virJSONScannerPtr scanner,
+                                   size_t *nelems)
+{
+    size_t i, j;
+
+    for (i = 0; i < scanner->npaths; i++) {
+        if (scanner->npathcomps[i] != scanner->nframes)
+            continue;
+
+        *nelems = 0;
+        for (j = 0; j < scanner->nframes; j++) {
+            virJSONScanFramePtr frame = &scanner->frames[j];
+            const char *comp = scanner->paths[i][j];
+
+            if (frame->array) {
+                unsigned long long elem;
+
+                if (STREQ(comp, "*")) {
+                    scanner->elems[(*nelems)++] = frame->elem;
+                    continue;
+                }
+                if (virStrToLong_ull(comp, NULL, 10, &elem) < 0 ||
+                    elem != frame->elem)
+                    break;
+            } else {
+                if (!frame->key || STRNEQ(comp, frame->key))
+                    break;
+            }
+        }
+
+        if (j == scanner->nframes)
+            return i;
+    }
+
+    return -1;
+}
+
+
+static int virJSONScannerEmit(virJSONScannerPtr scanner,
+                              size_t field,
+                              size_t nelems,
+                              virJSONValuePtr value)
+{
+    int ret = 1;
+
+    if (scanner->cb(field, scanner->elems, nelems,
+                    value, scanner->opaque) < 0) {
+        scanner->aborted = true;
+        ret = 0;
+    }
+
+    virJSONValueFree(value);
+    return ret;
+}
+
+
+/*
+ * Called when a new value starts at the current location. Returns
+ * 1 if the value is wanted, storing the matching path in @field,
+ * 0 if it is to be skipped
+ */
+static int virJSONScannerBeginValue(virJSONScannerPtr scanner,
+                                    size_t *field,
+                                    size_t *nelems)
+{
+    ssize_t match;
+
+    if (scanner->nframes) {
+        virJSONScanFramePtr frame = &scanner->frames[scanner->nframes - 1];
+        if (frame->array)
+            frame->elem = frame->nelems++;
+    }
+
+    if ((match = virJSONScannerMatch(scanner, nelems)) < 0)
+        return 0;
+
+    *field = match;
+    return 1;
+}
+
+
+/* Called after a value completed at the current location */
+static void virJSONScannerEndValue(virJSONScannerPtr scanner)
+{
+    if (scanner->nframes) {
+        virJSONScanFramePtr frame = &scanner->frames[scanner->nframes - 1];
+        if (!frame->array)
+            VIR_FREE(frame->key);
+    }
+}
+
+
+static int virJSONScannerScalar(virJSONScannerPtr scanner,
+                                virJSONValuePtr value)
+{
+    size_t field;
+    size_t nelems;
+
+    if (!value)
+        return 0;
+
+    if (scanner->captureField >= 0) {
+        if (virJSONParserInsertValue(&scanner->capture, value) < 0) {
+            virJSONValueFree(value);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (!virJSONScannerBeginValue(scanner, &field, &nelems)) {
+        virJSONValueFree(value);
+        virJSONScannerEndValue(scanner);
+        return 1;
+    }
+
+    virJSONScannerEndValue(scanner);
+    return virJSONScannerEmit(scanner, field, nelems, value);
+}
+
+
+static int virJSONScannerHandleNull(void *ctx)
+{
+    return virJSONScannerScalar(ctx, virJSONValueNewNull());
+}
+
+static int virJSONScannerHandleBoolean(void *ctx, int boolean_)
+{
+    return virJSONScannerScalar(ctx, virJSONValueNewBoolean(boolean_));
+}
+
+static int virJSONScannerHandleNumber(void *ctx,
+                                      const char *s,
+                                      yajl_size_t l)
+{
+    char *str;
+    virJSONValuePtr value;
+
+    if (VIR_STRNDUP(str, s, l) < 0)
+        return 0;
+    value = virJSONValueNewNumber(str);
+    VIR_FREE(str);
+
+    return virJSONScannerScalar(ctx, value);
+}
+
+static int virJSONScannerHandleString(void *ctx,
+                                      const unsigned char *stringVal,
+                                      yajl_size_t stringLen)
+{
+    return virJSONScannerScalar(ctx,
+                                virJSONValueNewStringLen((const char *)stringVal,
+                                                         stringLen));
+}
+
+static int virJSONScannerHandleMapKey(void *ctx,
+                                      const unsigned char *stringVal,
+                                      yajl_size_t stringLen)
+{
+    virJSONScannerPtr scanner = ctx;
+    virJSONScanFramePtr frame;
+
+    if (scanner->captureField >= 0)
+        return virJSONParserHandleMapKey(&scanner->capture,
+                                         stringVal, stringLen);
+
+    if (!scanner->nframes)
+        return 0;
+
+    frame = &scanner->frames[scanner->nframes - 1];
+    VIR_FREE(frame->key);
+    if (VIR_STRNDUP(frame->key, (const char *)stringVal, stringLen) < 0)
+        return 0;
+    return 1;
+}
+
+static int virJSONScannerHandleStart(virJSONScannerPtr scanner,
+                                     bool array)
+{
+    size_t field;
+    size_t nelems;
+
+    if (scanner->captureField >= 0) {
+        scanner->captureDepth++;
+        return array ?
+            virJSONParserHandleStartArray(&scanner->capture) :
+            virJSONParserHandleStartMap(&scanner->capture);
+    }
+
+    if (virJSONScannerBeginValue(scanner, &field, &nelems)) {
+        if (scanner->shallow[field]) {
+            virJSONValuePtr value = array ?
+                virJSONValueNewArray() : virJSONValueNewObject();
+
+            if (!value ||
+                !virJSONScannerEmit(scanner, field, nelems, value))
+                return 0;
+            goto push;
+        }
+
+        /* Build this one in full, the path elements
+         * stay put until it is complete */
+        scanner->captureField = field;
+        scanner->captureDepth = 1;
+        return array ?
+            virJSONParserHandleStartArray(&scanner->capture) :
+            virJSONParserHandleStartMap(&scanner->capture);
+    }
+
+push:
+    if (VIR_EXPAND_N(scanner->frames, scanner->nframes, 1) < 0 ||
+        VIR_REALLOC_N(scanner->elems, scanner->nframes) < 0)
+        return 0;
+    scanner->frames[scanner->nframes - 1].array = array;
+
+    return 1;
+}
+
+static int virJSONScannerHandleEnd(virJSONScannerPtr scanner,
+                                   bool array)
+{
+    if (scanner->captureField >= 0) {
+        virJSONValuePtr value;
+        size_t nelems;
+        int rc = array ?
+            virJSONParserHandleEndArray(&scanner->capture) :
+            virJSONParserHandleEndMap(&scanner->capture);
+
+        if (!rc || --scanner->captureDepth)
+            return rc;
+
+        value = scanner->capture.head;
+        scanner->capture.head = NULL;
+
+        /* Recompute the "*" elements for the completed value */
+        ignore_value(virJSONScannerMatch(scanner, &nelems));
+        virJSONScannerEndValue(scanner);
+        rc = virJSONScannerEmit(scanner, scanner->captureField,
+                                nelems, value);
+        scanner->captureField = -1;
+        return rc;
+    }
+
+    if (!scanner->nframes ||
+        scanner->frames[scanner->nframes - 1].array != array)
+        return 0;
+
+    VIR_FREE(scanner->frames[scanner->nframes - 1].key);
+    VIR_SHRINK_N(scanner->frames, scanner->nframes, 1);
+    virJSONScannerEndValue(scanner);
+
+    return 1;
+}
+
+static int virJSONScannerHandleStartMap(void *ctx)
+{
+    return virJSONScannerHandleStart(ctx, false);
+}
+
+static int virJSONScannerHandleEndMap(void *ctx)
+{
+    return virJSONScannerHandleEnd(ctx, false);
+}
+
+static int virJSONScannerHandleStartArray(void *ctx)
+{
+    return virJSONScannerHandleStart(ctx, true);
+}
+
+static int virJSONScannerHandleEndArray(void *ctx)
+{
+    return virJSONScannerHandleEnd(ctx, true);
+}
+
+static const yajl_callbacks scannerCallbacks = {
+    virJSONScannerHandleNull,
+    virJSONScannerHandleBoolean,
+    NULL,
+    NULL,
+    virJSONScannerHandleNumber,
+    virJSONScannerHandleString,
+    virJSONScannerHandleStartMap,
+    virJSONScannerHandleMapKey,
+    virJSONScannerHandleEndMap,
+    virJSONScannerHandleStartArray,
+    virJSONScannerHandleEndArray
+};
+
+
+/**
+ * virJSONValueScan:
+ * @jsonstring: the document to parse
+ * @paths: locations of the values wanted
+ * @npaths: number of entries in @paths
+ * @cb: callback invoked for each value found
+ * @opaque: user data for @cb
+ *
+ * Parses @jsonstring without building a tree for it, calling @cb
+ * for every value found at one of @paths, in document order. Path
+ * components are separated by '/' and name an object key, an array
+ * element number, or "*" for any array element. For example
+ * "return/0/device" picks the "device" key of the first element of
+ * the "return" array, and with "*" in place of "0" that of every
+ * element. Values at a matching path are passed to @cb in full,
+ * whatever their type. A path ending in '/' only asks for the type
+ * of the value: an object or array found there is passed to @cb
+ * empty, and its contents are scanned as usual.
+ *
+ * Returns 0 on success, -1 if the document could not be parsed or
+ * @cb asked to stop
+ */
+int virJSONValueScan(const char *jsonstring,
+                     const char *const *paths,
+                     size_t npaths,
+                     virJSONValueScanCallback cb,
+                     void *opaque)
+{
+    yajl_handle hand = NULL;
+    virJSONScanner scanner;
+    size_t i;
+    int ret = -1;
+# ifndef WITH_YAJL2
+    yajl_parser_config cfg = { 1, 1 };
+# endif
+
+    VIR_DEBUG("string=%s npaths=%zu", jsonstring, npaths);
+
+    memset(&scanner, 0, sizeof(scanner));
+    scanner.cb = cb;
+    scanner.opaque = opaque;
+    scanner.captureField = -1;
+
+    if (VIR_ALLOC_N(scanner.paths, npaths) < 0 ||
+        VIR_ALLOC_N(scanner.npathcomps, npaths) < 0 ||
+        VIR_ALLOC_N(scanner.shallow, npaths) < 0)
+        goto cleanup;
+    scanner.npaths = npaths;
+
+    for (i = 0; i < npaths; i++) {
+        if (!(scanner.paths[i] = virStringSplit(paths[i], "/", 0)))
+            goto cleanup;
+        while (scanner.paths[i][scanner.npathcomps[i]])
+            scanner.npathcomps[i]++;
+
+        if (scanner.npathcomps[i] > 1 &&
+            !*scanner.paths[i][scanner.npathcomps[i] - 1]) {
+            scanner.shallow[i] = true;
+            VIR_FREE(scanner.paths[i][--scanner.npathcomps[i]]);
+        }
+    }
+
+# ifdef WITH_YAJL2
+    hand = yajl_alloc(&scannerCallbacks, NULL, &scanner);
+    if (hand) {
+        yajl_config(hand, yajl_allow_comments, 1);
+        yajl_config(hand, yajl_dont_validate_strings, 0);
+    }
+# else
+    hand = yajl_alloc(&scannerCallbacks, &cfg, NULL, &scanner);
+# endif
+    if (!hand) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("Unable to create JSON parser"));
+        goto cleanup;
+    }
+
+    if (yajl_parse(hand,
+                   (const unsigned char *)jsonstring,
+                   strlen(jsonstring)) != yajl_status_ok) {
+        unsigned char *errstr;
+
+        /* The callback reported its own error */
+        if (scanner.aborted)
+            goto cleanup;
+
+        errstr = yajl_get_error(hand, 1,
+                                (const unsigned char*)jsonstring,
+                                strlen(jsonstring));
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("cannot parse json %s: %s"),
+                       jsonstring, (const char*) errstr);
+        VIR_FREE(errstr);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (hand)
+        yajl_free(hand);
+
+    for (i = 0; i < scanner.npaths; i++)
+        virStringFreeList(scanner.paths[i]);
+    VIR_FREE(scanner.paths);
+    VIR_FREE(scanner.npathcomps);
+    VIR_FREE(scanner.shallow);
+
+    for (i = 0; i < scanner.nframes; i++)
+        VIR_FREE(scanner.frames[i].key);
+    VIR_FREE(scanner.frames);
+    VIR_FREE(scanner.elems);
+
+    virJSONValueFree(scanner.capture.head);
+    for (i = 0; i < scanner.capture.nstate; i++)
+        VIR_FREE(scanner.capture.state[i].key);
+    VIR_FREE(scanner.capture.state);
+
+    return ret;
+}
+
 static int virJSONValueToStringOne(virJSONValuePtr object,
                                    yajl_gen g)
 {
@@ -1150,4 +1677,14 @@ char *virJSONValueToString(virJSONValuePtr object ATTRIBUTE_UNUSED,
                    _("No JSON parser implementation is available"));
     return NULL;
 }
+int virJSONValueScan(const char *jsonstring ATTRIBUTE_UNUSED,
+                     const char *const *paths ATTRIBUTE_UNUSED,
+                     size_t npaths ATTRIBUTE_UNUSED,
+                     virJSONValueScanCallback cb ATTRIBUTE_UNUSED,
+                     void *opaque ATTRIBUTE_UNUSED)
+{
+    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                   _("No JSON parser implementation is available"));
+    return -1;
+}
 #endif
@@ -25,6 +25,7 @@
 # define __VIR_JSON_H_
 
 # include "internal.h"
+# include "virhash.h"
 
 
 typedef enum {
@@ -57,6 +58,7 @@ struct _virJSONObjectPair {
 struct _virJSONObject {
     size_t npairs;
     virJSONObjectPairPtr pairs;
+    virHashTablePtr index; /* key -> pair number + 1, for large objects */
 };
 
 struct _virJSONArray {
@@ -136,6 +138,29 @@ int virJSONValueObjectRemoveKey(virJSONValuePtr object, const char *key,
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
 
 virJSONValuePtr virJSONValueFromString(const char *jsonstring);
+
+/**
+ * virJSONValueScanCallback:
+ * @field: index of the matching path given to virJSONValueScan
+ * @elems: array elements matched by the "*" components of the path
+ * @nelems: number of entries in @elems
+ * @value: the value found, only valid for the duration of the call
+ * @opaque: user data passed to virJSONValueScan
+ *
+ * Returns 0 to carry on scanning, -1 to stop with an error
+ */
+typedef int (*virJSONValueScanCallback)(size_t field,
+                                        const size_t *elems,
+                                        size_t nelems,
+                                        virJSONValuePtr value,
+                                        void *opaque);
+
+int virJSONValueScan(const char *jsonstring,
+                     const char *const *paths,
+                     size_t npaths,
+                     virJSONValueScanCallback cb,
+                     void *opaque)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(4);
 char *virJSONValueToString(virJSONValuePtr object,
                            bool pretty);
 
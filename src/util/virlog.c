@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <execinfo.h>
 #include <regex.h>
+#include <sys/uio.h>
 #if HAVE_SYSLOG_H
 # include <syslog.h>
 #endif
@@ -44,6 +45,7 @@
 #include "virerror.h"
 #include "virlog.h"
 #include "viralloc.h"
+#include "viratomic.h"
 #include "virutil.h"
 #include "virbuffer.h"
 #include "virthread.h"
@@ -104,6 +106,30 @@ typedef virLogFilter *virLogFilterPtr;
 static virLogFilterPtr virLogFilters = NULL;
 static int virLogNbFilters = 0;
 
+/*
+ * The result of matching a source file against the filters is cached,
+ * keyed on the address of the file name which callers pass as __FILE__.
+ * An entry is only valid while its serial matches virLogFiltersSerial,
+ * which is bumped whenever the filters change, so a lookup needs neither
+ * the lock nor any string comparison.
+ */
+#define VIR_LOG_FILTER_CACHE_SIZE 1024
+#define VIR_LOG_FILTER_CACHE_PROBES 8
+#define VIR_LOG_FILTER_CACHE_SERIAL(serial) ((serial) & 0x7ffffff)
+#define VIR_LOG_FILTER_CACHE_VALUE(serial, priority, flags)             \
+    ((int) ((VIR_LOG_FILTER_CACHE_SERIAL((unsigned int) (serial)) << 4) | \
+            (((flags) & VIR_LOG_STACK_TRACE) << 3) | (priority)))
+
+struct _virLogFilterCacheEntry {
+    const char *filename;
+    int value;                  /* serial, flags and priority */
+};
+typedef struct _virLogFilterCacheEntry virLogFilterCacheEntry;
+typedef virLogFilterCacheEntry *virLogFilterCacheEntryPtr;
+
+static virLogFilterCacheEntry virLogFilterCache[VIR_LOG_FILTER_CACHE_SIZE];
+static int virLogFiltersSerial = 1;
+
 /*
  * Outputs are used to emit the messages retained
  * after filtering, multiple output can be used simultaneously
@@ -128,8 +154,58 @@ static int virLogNbOutputs = 0;
  */
 static virLogPriority virLogDefaultPriority = VIR_LOG_DEFAULT;
 
+/*
+ * In asynchronous mode each thread appends the messages it emits to
+ * a ring buffer of its own without taking any lock, and a dedicated
+ * writer thread drains the rings into the outputs. Messages which do
+ * not fit in a ring are dropped and counted.
+ */
+#define VIR_LOG_RING_SIZE (32 * 1024)
+#define VIR_LOG_RECORD_ALIGN(len) (((len) + 7) & ~7)
+#define VIR_LOG_RECORD_STR(rec, offset) ((char *) (rec) + (offset))
+#define VIR_LOG_BATCH 64
+
+struct _virLogRecord {
+    int len;                    /* aligned size, 0 marks a wrap around */
+    int source;
+    int priority;
+    int linenr;
+    unsigned int flags;
+    int funcname;               /* offsets of the strings, 0 if NULL */
+    int timestamp;
+    int rawstr;
+    int str;
+    int strsize;
+    /* followed by the file name and the strings above */
+};
+typedef struct _virLogRecord virLogRecord;
+typedef virLogRecord *virLogRecordPtr;
+
+typedef struct _virLogRing virLogRing;
+typedef virLogRing *virLogRingPtr;
+struct _virLogRing {
+    char *data;
+    int head;                   /* only written by the owning thread */
+    int tail;                   /* only written by the writer thread */
+    int dead;                   /* the owning thread has exited */
+    virLogRingPtr next;
+};
+
+static virMutex virLogRingMutex;
+static virCond virLogRingCond;
+static virLogRingPtr virLogRings = NULL;
+static virThreadLocal virLogRingLocal;
+static virThread virLogWriter;
+static pid_t virLogWriterPid = 0;
+static bool virLogWriterQuit = false;
+static int virLogWriterIdle = 0;
+static int virLogAsync = 0;
+static int virLogDropped = 0;
+static bool virLogVersionStderr = true;
+
 static int virLogResetFilters(void);
 static int virLogResetOutputs(void);
+static void virLogRingRelease(void *opaque);
 static void virLogOutputToFd(virLogSource src,
                              virLogPriority priority,
                              const char *filename,
@@ -147,16 +223,25 @@ static void virLogOutputToFd(virLogSource src,
  */
 virMutex virLogMutex;
 
+/*
+ * Outputs have a lock of their own so that writing messages out does
+ * not hold up threads storing into the history buffer, virLogLock()
+ * acquires both.
+ */
+static virMutex virLogOutputMutex;
+
 void
 virLogLock(void)
 {
     virMutexLock(&virLogMutex);
+    virMutexLock(&virLogOutputMutex);
 }
 
 
 void
 virLogUnlock(void)
 {
+    virMutexUnlock(&virLogOutputMutex);
     virMutexUnlock(&virLogMutex);
 }
 
@@ -200,7 +285,11 @@ virLogOnceInit(void)
 {
     const char *pbm = NULL;
 
-    if (virMutexInit(&virLogMutex) < 0)
+    if (virMutexInit(&virLogMutex) < 0 ||
+        virMutexInit(&virLogOutputMutex) < 0 ||
+        virMutexInit(&virLogRingMutex) < 0 ||
+        virCondInit(&virLogRingCond) < 0 ||
+        virThreadLocalInit(&virLogRingLocal, virLogRingRelease) < 0)
         return -1;
 
     virLogLock();
@@ -306,7 +395,8 @@ error:
 int
 virLogReset(void)
 {
-    if (virLogInitialize() < 0)
+    if (virLogInitialize() < 0 ||
+        virLogSetAsync(false) < 0)
         return -1;
 
     virLogLock();
@@ -395,6 +485,8 @@ virLogDumpAllFD(const char *msg, int len)
  * It need to output the debug ring buffer through the log
  * output which are safe to use from a signal handler.
  * In case none is found it is emitted to standard error.
+ * This never relies on the asynchronous writer, messages still queued
+ * for it were already stored in the buffer by the thread logging them.
  */
 void
 virLogEmergencyDumpAll(int signum)
@@ -519,6 +611,7 @@ virLogResetFilters(void)
         VIR_FREE(virLogFilters[i].match);
     VIR_FREE(virLogFilters);
     virLogNbFilters = 0;
+    virAtomicIntInc(&virLogFiltersSerial);
     return i;
 }
 
@@ -555,6 +648,7 @@ virLogDefineFilter(const char *match,
     for (i = 0; i < virLogNbFilters; i++) {
         if (STREQ(virLogFilters[i].match, match)) {
             virLogFilters[i].priority = priority;
+            virAtomicIntInc(&virLogFiltersSerial);
             ret = i;
             goto cleanup;
         }
@@ -571,6 +665,7 @@ virLogDefineFilter(const char *match,
     virLogFilters[i].priority = priority;
     virLogFilters[i].flags = flags;
     virLogNbFilters++;
+    virAtomicIntInc(&virLogFiltersSerial);
 cleanup:
     virLogUnlock();
     if (ret < 0)
@@ -585,7 +680,9 @@ cleanup:
  *
  * Check the input of the message against the existing filters. Currently
  * the match is just a substring check of the category used as the input
- * string, a more subtle approach could be used instead
+ * string, a more subtle approach could be used instead. The result is
+ * cached per input address, so @input must be a static string such as
+ * __FILE__.
  *
  * Returns 0 if not matched or the new priority if found.
  */
@@ -593,10 +690,32 @@ static int
 virLogFiltersCheck(const char *input,
                    unsigned int *flags)
 {
+    virLogFilterCacheEntryPtr entry;
+    size_t slot = ((uintptr_t) input >> 3) % VIR_LOG_FILTER_CACHE_SIZE;
+    int serial;
+    int value;
     int ret = 0;
     size_t i;
 
-    virLogLock();
+    if (!virLogNbFilters)
+        return 0;
+
+    serial = virAtomicIntGet(&virLogFiltersSerial);
+    for (i = 0; i < VIR_LOG_FILTER_CACHE_PROBES; i++) {
+        entry = &virLogFilterCache[(slot + i) % VIR_LOG_FILTER_CACHE_SIZE];
+        if (entry->filename != input)
+            continue;
+
+        value = virAtomicIntGet(&entry->value);
+        if ((value >> 4) == VIR_LOG_FILTER_CACHE_SERIAL(serial)) {
+            if (value & (1 << 3))
+                *flags = VIR_LOG_STACK_TRACE;
+            return value & 7;
+        }
+        break;
+    }
+
+    virMutexLock(&virLogMutex);
     for (i = 0; i < virLogNbFilters; i++) {
         if (strstr(input, virLogFilters[i].match)) {
             ret = virLogFilters[i].priority;
@@ -604,7 +723,20 @@ virLogFiltersCheck(const char *input,
             break;
         }
     }
-    virLogUnlock();
+
+    /* Entries are only ever claimed with the lock held, and never
+     * handed over to another file */
+    for (i = 0; i < VIR_LOG_FILTER_CACHE_PROBES; i++) {
+        entry = &virLogFilterCache[(slot + i) % VIR_LOG_FILTER_CACHE_SIZE];
+        if (entry->filename == input || !entry->filename) {
+            virAtomicIntSet(&entry->value,
+                            VIR_LOG_FILTER_CACHE_VALUE(virLogFiltersSerial,
+                                                       ret, *flags));
+            entry->filename = input;
+            break;
+        }
+    }
+    virMutexUnlock(&virLogMutex);
     return ret;
 }
 
@@ -744,6 +876,453 @@ virLogVersionString(const char **rawmsg,
 }
 
 
+static void
+virLogOutputVersion(virLogOutputFunc f,
+                    void *data,
+                    const char *timestamp)
+{
+    const char *rawver;
+    char *ver = NULL;
+
+    if (virLogVersionString(&rawver, &ver) >= 0)
+        f(VIR_LOG_FROM_FILE, VIR_LOG_INFO,
+          __FILE__, __LINE__, __func__,
+          timestamp, NULL, 0, rawver, ver, data);
+    VIR_FREE(ver);
+}
+
+
+static void
+virLogRingRelease(void *opaque)
+{
+    virLogRingPtr ring = opaque;
+
+    virAtomicIntSet(&ring->dead, 1);
+}
+
+
+/*
+ * Get the ring buffer of the calling thread, allocating it on first use
+ */
+static virLogRingPtr
+virLogRingGet(void)
+{
+    virLogRingPtr ring;
+
+    if ((ring = virThreadLocalGet(&virLogRingLocal)))
+        return ring;
+
+    if (VIR_ALLOC_QUIET(ring) < 0)
+        return NULL;
+    if (VIR_ALLOC_N_QUIET(ring->data, VIR_LOG_RING_SIZE) < 0 ||
+        virThreadLocalSet(&virLogRingLocal, ring) < 0) {
+        VIR_FREE(ring->data);
+        VIR_FREE(ring);
+        return NULL;
+    }
+
+    virMutexLock(&virLogRingMutex);
+    ring->next = virLogRings;
+    virLogRings = ring;
+    virMutexUnlock(&virLogRingMutex);
+
+    return ring;
+}
+
+
+/*
+ * Find room for @len bytes in @ring, head is never allowed to catch up
+ * with tail since that would make a full ring look empty.
+ *
+ * Returns the offset of the room or -1 if the ring is full.
+ */
+static int
+virLogRingReserve(virLogRingPtr ring,
+                  int len)
+{
+    int head = ring->head;
+    int tail = virAtomicIntGet(&ring->tail);
+
+    if (head < tail)
+        return tail - head > len ? head : -1;
+
+    if (VIR_LOG_RING_SIZE - head > len ||
+        (VIR_LOG_RING_SIZE - head == len && tail > 0))
+        return head;
+
+    if (tail <= len)
+        return -1;
+
+    /* Not enough room left at the end, tell the reader to wrap around */
+    if (VIR_LOG_RING_SIZE - head >= (int) sizeof(virLogRecord))
+        ((virLogRecordPtr) (ring->data + head))->len = 0;
+    return 0;
+}
+
+
+/*
+ * Queue a message for the writer thread. Returns false if the message
+ * must be emitted synchronously instead, a message dropped because the
+ * ring is full counts as queued.
+ */
+static bool
+virLogEnqueue(virLogSource source,
+              virLogPriority priority,
+              const char *filename,
+              int linenr,
+              const char *funcname,
+              const char *timestamp,
+              unsigned int flags,
+              const char *rawstr,
+              const char *str)
+{
+    virLogRingPtr ring;
+    virLogRecordPtr rec;
+    size_t filenamelen = strlen(filename) + 1;
+    size_t funcnamelen = funcname ? strlen(funcname) + 1 : 0;
+    size_t timestamplen = strlen(timestamp) + 1;
+    size_t rawstrlen = strlen(rawstr) + 1;
+    size_t strsize = strlen(str);
+    size_t len;
+    int pos;
+
+    len = VIR_LOG_RECORD_ALIGN(sizeof(*rec) + filenamelen + funcnamelen +
+                               timestamplen + rawstrlen + strsize + 1);
+    if (len > VIR_LOG_RING_SIZE / 4 ||
+        !(ring = virLogRingGet()))
+        return false;
+
+    if ((pos = virLogRingReserve(ring, len)) < 0) {
+        virAtomicIntInc(&virLogDropped);
+        return true;
+    }
+
+    rec = (virLogRecordPtr) (ring->data + pos);
+    rec->len = len;
+    rec->source = source;
+    rec->priority = priority;
+    rec->linenr = linenr;
+    rec->flags = flags;
+    rec->strsize = strsize;
+
+    len = sizeof(*rec);
+    memcpy(VIR_LOG_RECORD_STR(rec, len), filename, filenamelen);
+    len += filenamelen;
+    rec->funcname = funcname ? len : 0;
+    if (funcname)
+        memcpy(VIR_LOG_RECORD_STR(rec, len), funcname, funcnamelen);
+    len += funcnamelen;
+    rec->timestamp = len;
+    memcpy(VIR_LOG_RECORD_STR(rec, len), timestamp, timestamplen);
+    len += timestamplen;
+    rec->rawstr = len;
+    memcpy(VIR_LOG_RECORD_STR(rec, len), rawstr, rawstrlen);
+    len += rawstrlen;
+    rec->str = len;
+    memcpy(VIR_LOG_RECORD_STR(rec, len), str, strsize + 1);
+
+    /* The addition doubles as a barrier publishing the record */
+    virAtomicIntAdd(&ring->head,
+                    (pos + rec->len) % VIR_LOG_RING_SIZE - ring->head);
+
+    if (virAtomicIntGet(&virLogWriterIdle)) {
+        virMutexLock(&virLogRingMutex);
+        virCondSignal(&virLogRingCond);
+        virMutexUnlock(&virLogRingMutex);
+    }
+
+    return true;
+}
+
+
+static void
+virLogWritevFd(int fd,
+               struct iovec *iov,
+               int niov)
+{
+    ssize_t done;
+
+    while (niov > 0) {
+#if HAVE_WRITEV
+        if ((done = writev(fd, iov, niov)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+#else
+        if ((done = safewrite(fd, iov->iov_base, iov->iov_len)) < 0)
+            return;
+#endif
+
+        while (niov > 0 && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+
+/*
+ * Emit a batch of queued records through @output. Writes to file
+ * descriptors are gathered into a single writev() call.
+ */
+static void
+virLogOutputRecords(virLogOutputPtr output,
+                    bool skipErrors,
+                    virLogRecordPtr *recs,
+                    size_t nrecs)
+{
+    struct iovec iov[VIR_LOG_BATCH * 3];
+    static const char sep[] = ": ";
+    int fd = (intptr_t) output->data;
+    int niov = 0;
+    size_t i;
+
+    for (i = 0; i < nrecs; i++) {
+        virLogRecordPtr rec = recs[i];
+        const char *timestamp = VIR_LOG_RECORD_STR(rec, rec->timestamp);
+
+        if (rec->priority < output->priority ||
+            (skipErrors && rec->source == VIR_LOG_FROM_ERROR))
+            continue;
+
+        if (output->logVersion) {
+            virLogOutputVersion(output->f, output->data, timestamp);
+            output->logVersion = false;
+        }
+
+        if (output->f != virLogOutputToFd) {
+            output->f(rec->source, rec->priority,
+                      VIR_LOG_RECORD_STR(rec, sizeof(*rec)), rec->linenr,
+                      rec->funcname ?
+                      VIR_LOG_RECORD_STR(rec, rec->funcname) : NULL,
+                      timestamp, NULL, rec->flags,
+                      VIR_LOG_RECORD_STR(rec, rec->rawstr),
+                      VIR_LOG_RECORD_STR(rec, rec->str),
+                      output->data);
+            continue;
+        }
+
+        iov[niov].iov_base = (char *) timestamp;
+        iov[niov++].iov_len = rec->rawstr - rec->timestamp - 1;
+        iov[niov].iov_base = (char *) sep;
+        iov[niov++].iov_len = strlen(sep);
+        iov[niov].iov_base = VIR_LOG_RECORD_STR(rec, rec->str);
+        iov[niov++].iov_len = rec->strsize;
+    }
+
+    if (niov > 0 && fd >= 0)
+        virLogWritevFd(fd, iov, niov);
+}
+
+
+/*
+ * Pass everything queued in @ring to the outputs, in batches of at most
+ * VIR_LOG_BATCH records.
+ *
+ * Returns the number of records written out.
+ */
+static size_t
+virLogRingDrain(virLogRingPtr ring)
+{
+    virLogRecordPtr recs[VIR_LOG_BATCH];
+    int head = virAtomicIntGet(&ring->head);
+    int tail = ring->tail;
+    size_t total = 0;
+    size_t nrecs;
+    size_t i;
+
+    while (tail != head) {
+        nrecs = 0;
+        while (tail != head && nrecs < VIR_LOG_BATCH) {
+            virLogRecordPtr rec = (virLogRecordPtr) (ring->data + tail);
+
+            if (VIR_LOG_RING_SIZE - tail < (int) sizeof(*rec) ||
+                rec->len == 0) {
+                tail = 0;
+                continue;
+            }
+            recs[nrecs++] = rec;
+            tail = (tail + rec->len) % VIR_LOG_RING_SIZE;
+        }
+
+        virMutexLock(&virLogOutputMutex);
+        for (i = 0; i < virLogNbOutputs; i++)
+            virLogOutputRecords(&virLogOutputs[i], false, recs, nrecs);
+        if (virLogNbOutputs == 0) {
+            virLogOutput output = {
+                .logVersion = virLogVersionStderr,
+                .f = virLogOutputToFd,
+                .data = (void *) STDERR_FILENO,
+            };
+
+            virLogOutputRecords(&output, true, recs, nrecs);
+            virLogVersionStderr = output.logVersion;
+        }
+        virMutexUnlock(&virLogOutputMutex);
+
+        /* Hand the space back only once the records are written */
+        virAtomicIntAdd(&ring->tail, tail - ring->tail);
+        total += nrecs;
+        head = virAtomicIntGet(&ring->head);
+    }
+
+    return total;
+}
+
+
+/*
+ * Drain all the rings, report dropped messages and free the rings of
+ * threads which have exited. Only ever called from the writer thread.
+ *
+ * Returns the number of records written out.
+ */
+static size_t
+virLogRingsDrain(void)
+{
+    virLogRingPtr ring;
+    virLogRingPtr *prev;
+    size_t total = 0;
+    int dropped;
+
+    /* Rings are only added at the head and removed below, so the
+     * list can be walked without the lock */
+    virMutexLock(&virLogRingMutex);
+    ring = virLogRings;
+    virMutexUnlock(&virLogRingMutex);
+
+    for (; ring; ring = ring->next)
+        total += virLogRingDrain(ring);
+
+    if ((dropped = virAtomicIntGet(&virLogDropped)) > 0) {
+        virAtomicIntAdd(&virLogDropped, -dropped);
+        VIR_WARN("Dropped %d log messages", dropped);
+    }
+
+    virMutexLock(&virLogRingMutex);
+    prev = &virLogRings;
+    while ((ring = *prev)) {
+        if (virAtomicIntGet(&ring->dead) &&
+            virAtomicIntGet(&ring->head) == ring->tail) {
+            *prev = ring->next;
+            VIR_FREE(ring->data);
+            VIR_FREE(ring);
+        } else {
+            prev = &ring->next;
+        }
+    }
+    virMutexUnlock(&virLogRingMutex);
+
+    return total;
+}
+
+
+/* Must be called with virLogRingMutex held */
+static bool
+virLogRingsPending(void)
+{
+    virLogRingPtr ring;
+
+    if (virAtomicIntGet(&virLogDropped) > 0)
+        return true;
+
+    for (ring = virLogRings; ring; ring = ring->next) {
+        if (virAtomicIntGet(&ring->head) != ring->tail)
+            return true;
+    }
+    return false;
+}
+
+
+static void
+virLogWriterThread(void *opaque ATTRIBUTE_UNUSED)
+{
+    bool quit = false;
+
+    while (true) {
+        if (virLogRingsDrain() > 0)
+            continue;
+        if (quit)
+            break;
+
+        /* Producers check virLogWriterIdle after publishing a record,
+         * so either they see it set or we see their record here */
+        virMutexLock(&virLogRingMutex);
+        virAtomicIntSet(&virLogWriterIdle, 1);
+        if (!virLogWriterQuit && !virLogRingsPending())
+            ignore_value(virCondWait(&virLogRingCond, &virLogRingMutex));
+        virAtomicIntSet(&virLogWriterIdle, 0);
+        quit = virLogWriterQuit;
+        virMutexUnlock(&virLogRingMutex);
+    }
+}
+
+
+/**
+ * virLogSetAsync:
+ * @async: whether to hand messages over to a writer thread
+ *
+ * Switch between emitting log messages from the thread logging them,
+ * and queueing them for a dedicated writer thread so that callers
+ * never wait for the outputs. Messages requesting a stack trace or
+ * carrying metadata are always emitted synchronously. Disabling it
+ * waits for the queued messages to be written out, and should be done
+ * before exiting so that none get lost. In a forked child the writer
+ * thread is simply forgotten. Must not be called concurrently with
+ * itself.
+ *
+ * Returns 0 if successful, -1 in case of error.
+ */
+int
+virLogSetAsync(bool async)
+{
+    int ret = -1;
+
+    if (!async && virLogWriterPid && virLogWriterPid != getpid()) {
+        virAtomicIntSet(&virLogAsync, 0);
+        virLogWriterPid = 0;
+        return 0;
+    }
+
+    if (virLogInitialize() < 0)
+        return -1;
+
+    virMutexLock(&virLogRingMutex);
+    if (async == (virLogWriterPid != 0)) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (async) {
+        virLogWriterQuit = false;
+        if (virThreadCreate(&virLogWriter, true,
+                            virLogWriterThread, NULL) < 0)
+            goto cleanup;
+        virLogWriterPid = getpid();
+        virAtomicIntSet(&virLogAsync, 1);
+    } else {
+        virAtomicIntSet(&virLogAsync, 0);
+        virLogWriterQuit = true;
+        virCondSignal(&virLogRingCond);
+        virMutexUnlock(&virLogRingMutex);
+        virThreadJoin(&virLogWriter);
+        virMutexLock(&virLogRingMutex);
+        virLogWriterPid = 0;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&virLogRingMutex);
+    return ret;
+}
+
+
 /**
  * virLogMessage:
  * @source: where is that message coming from
@@ -800,7 +1379,6 @@ virLogVMessage(virLogSource source,
                const char *fmt,
                va_list vargs)
 {
-    static bool logVersionStderr = true;
     char *str = NULL;
     char *msg = NULL;
     char timestamp[VIR_TIME_STRING_BUFLEN];
@@ -849,29 +1427,30 @@ virLogVMessage(virLogSource source,
      * then if emit push the message on the outputs defined, if none
      * use stderr.
      * NOTE: the locking is a single point of contention for multiple
-     *       threads, but avoid intermixing. Maybe set up locks per output
-     *       to improve paralellism.
+     *       threads, but avoid intermixing. In asynchronous mode the
+     *       outputs are left to the writer thread, at the cost of
+     *       messages emitted synchronously overtaking queued ones.
      */
-    virLogLock();
+    virMutexLock(&virLogMutex);
     virLogStr(timestamp);
     virLogStr(": ");
     virLogStr(msg);
-    virLogUnlock();
+    virMutexUnlock(&virLogMutex);
     if (!emit)
         goto cleanup;
 
-    virLogLock();
+    if (virAtomicIntGet(&virLogAsync) && !metadata &&
+        !(filterflags & VIR_LOG_STACK_TRACE) &&
+        virLogEnqueue(source, priority, filename, linenr, funcname,
+                      timestamp, filterflags, str, msg))
+        goto cleanup;
+
+    virMutexLock(&virLogOutputMutex);
     for (i = 0; i < virLogNbOutputs; i++) {
         if (priority >= virLogOutputs[i].priority) {
             if (virLogOutputs[i].logVersion) {
-                const char *rawver;
-                char *ver = NULL;
-                if (virLogVersionString(&rawver, &ver) >= 0)
-                    virLogOutputs[i].f(VIR_LOG_FROM_FILE, VIR_LOG_INFO,
-                                       __FILE__, __LINE__, __func__,
-                                       timestamp, NULL, 0, rawver, ver,
-                                       virLogOutputs[i].data);
-                VIR_FREE(ver);
+                virLogOutputVersion(virLogOutputs[i].f,
+                                    virLogOutputs[i].data, timestamp);
                 virLogOutputs[i].logVersion = false;
             }
             virLogOutputs[i].f(source, priority,
@@ -881,23 +1460,17 @@ virLogVMessage(virLogSource source,
         }
     }
     if ((virLogNbOutputs == 0) && (source != VIR_LOG_FROM_ERROR)) {
-        if (logVersionStderr) {
-            const char *rawver;
-            char *ver = NULL;
-            if (virLogVersionString(&rawver, &ver) >= 0)
-                virLogOutputToFd(VIR_LOG_FROM_FILE, VIR_LOG_INFO,
-                                 __FILE__, __LINE__, __func__,
-                                 timestamp, NULL, 0, rawver, ver,
-                                 (void *) STDERR_FILENO);
-            VIR_FREE(ver);
-            logVersionStderr = false;
+        if (virLogVersionStderr) {
+            virLogOutputVersion(virLogOutputToFd,
+                                (void *) STDERR_FILENO, timestamp);
+            virLogVersionStderr = false;
         }
         virLogOutputToFd(source, priority,
                          filename, linenr, funcname,
                          timestamp, metadata, filterflags,
                          str, msg, (void *) STDERR_FILENO);
     }
-    virLogUnlock();
+    virMutexUnlock(&virLogOutputMutex);
 
 cleanup:
     VIR_FREE(str);
@@ -188,6 +188,7 @@ extern void virLogVMessage(virLogSource src,
                            const char *fmt,
                            va_list vargs) ATTRIBUTE_FMT_PRINTF(7, 0);
 extern int virLogSetBufferSize(int size);
+extern int virLogSetAsync(bool async);
 extern void virLogEmergencyDumpAll(int signum);
 
 bool virLogProbablyLogMessage(const char *str);
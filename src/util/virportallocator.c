@@ -97,26 +97,20 @@ int virPortAllocatorAcquire(virPortAllocatorPtr pa,
                             unsigned short *port)
 {
     int ret = -1;
+    ssize_t pos = -1;
     size_t i;
     int fd = -1;
 
     *port = 0;
     virObjectLock(pa);
 
-    for (i = pa->start; i <= pa->end && !*port; i++) {
+    /* Skip over the ports we handed out already a word at a time */
+    while (!*port &&
+           (pos = virBitmapNextClearBit(pa->bitmap, pos)) >= 0) {
         int reuse = 1;
         struct sockaddr_in addr;
-        bool used = false;
 
-        if (virBitmapGetBit(pa->bitmap,
-                            i - pa->start, &used) < 0) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("Failed to query port %zu"), i);
-            goto cleanup;
-        }
-
-        if (used)
-            continue;
+        i = pa->start + pos;
 
         addr.sin_family = AF_INET;
         addr.sin_port = htons(i);
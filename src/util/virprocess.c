@@ -323,8 +323,7 @@ cleanup:
 
 int virProcessSetAffinity(pid_t pid, virBitmapPtr map)
 {
-    size_t i;
-    bool set = false;
+    ssize_t i;
 # ifdef CPU_ALLOC
     /* New method dynamically allocates cpu mask, allowing unlimted cpus */
     int numcpus = 1024;
@@ -348,12 +347,9 @@ realloc:
     }
 
     CPU_ZERO_S(masklen, mask);
-    for (i = 0; i < virBitmapSize(map); i++) {
-        if (virBitmapGetBit(map, i, &set) < 0)
-            return -1;
-        if (set)
-            CPU_SET_S(i, masklen, mask);
-    }
+    i = -1;
+    while ((i = virBitmapNextSetBit(map, i)) >= 0)
+        CPU_SET_S(i, masklen, mask);
 
     if (sched_setaffinity(pid, masklen, mask) < 0) {
         CPU_FREE(mask);
@@ -372,12 +368,9 @@ realloc:
     cpu_set_t mask;
 
     CPU_ZERO(&mask);
-    for (i = 0; i < virBitmapSize(map); i++) {
-        if (virBitmapGetBit(map, i, &set) < 0)
-            return -1;
-        if (set)
-            CPU_SET(i, &mask);
-    }
+    i = -1;
+    while ((i = virBitmapNextSetBit(map, i)) >= 0)
+        CPU_SET(i, &mask);
 
     if (sched_setaffinity(pid, sizeof(mask), &mask) < 0) {
         virReportSystemError(errno,
@@ -45,6 +45,8 @@
 #include "virendian.h"
 #include "virstring.h"
 #include "virutil.h"
+#include "virthread.h"
+#include "stat-time.h"
 #if HAVE_SYS_SYSCALL_H
 # include <sys/syscall.h>
 #endif
@@ -752,6 +754,230 @@ qcow2GetFeatures(virBitmapPtr *features,
 }
 
 
+/* Metadata of single images is cached process wide, so that deep
+ * backing chains are not re-read for every domain start, security
+ * relabel and pool refresh. Entries are only trusted while the
+ * image keeps its device, inode, size and modification time. */
+#define VIR_STORAGE_FILE_CACHE_MAX 1024
+
+/* Images modified this recently are not cached, as a further
+ * change within the timestamp granularity would go unnoticed */
+#define VIR_STORAGE_FILE_CACHE_MIN_AGE 2
+
+typedef struct _virStorageFileCacheEntry virStorageFileCacheEntry;
+typedef virStorageFileCacheEntry *virStorageFileCacheEntryPtr;
+struct _virStorageFileCacheEntry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    virStorageFileMetadataPtr meta; /* backingMeta is always NULL */
+};
+
+static virMutex virStorageFileCacheLock;
+static virHashTablePtr virStorageFileCache;
+
+static void
+virStorageFileCacheEntryFree(void *payload,
+                             const void *name ATTRIBUTE_UNUSED)
+{
+    virStorageFileCacheEntryPtr entry = payload;
+
+    if (!entry)
+        return;
+
+    VIR_FREE(entry->path);
+    virStorageFileFreeMetadata(entry->meta);
+    VIR_FREE(entry);
+}
+
+static int
+virStorageFileCacheOnceInit(void)
+{
+    if (virMutexInit(&virStorageFileCacheLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize mutex"));
+        return -1;
+    }
+
+    if (!(virStorageFileCache = virHashCreate(64,
+                                              virStorageFileCacheEntryFree)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virStorageFileCache)
+
+/* Copy everything but the backing chain */
+static virStorageFileMetadataPtr
+virStorageFileMetadataCopyOne(virStorageFileMetadataPtr src)
+{
+    virStorageFileMetadataPtr ret;
+
+    if (VIR_ALLOC(ret) < 0)
+        return NULL;
+
+    ret->backingStoreFormat = src->backingStoreFormat;
+    ret->backingStoreIsFile = src->backingStoreIsFile;
+    ret->capacity = src->capacity;
+    ret->encrypted = src->encrypted;
+
+    if (VIR_STRDUP(ret->backingStore, src->backingStore) < 0 ||
+        VIR_STRDUP(ret->backingStoreRaw, src->backingStoreRaw) < 0 ||
+        VIR_STRDUP(ret->directory, src->directory) < 0 ||
+        VIR_STRDUP(ret->compat, src->compat) < 0)
+        goto error;
+
+    if (src->features &&
+        !(ret->features = virBitmapNewCopy(src->features)))
+        goto error;
+
+    return ret;
+
+error:
+    virStorageFileFreeMetadata(ret);
+    return NULL;
+}
+
+static char *
+virStorageFileCacheKey(const char *path,
+                       const char *directory,
+                       int format)
+{
+    char *key;
+
+    ignore_value(virAsprintf(&key, "%d:%s:%s",
+                             format, directory ? directory : "", path));
+    return key;
+}
+
+/* Returns 1 and a copy of the cached metadata in @meta if @path is
+ * cached and unchanged, 0 if it is not, and -1 on error */
+static int
+virStorageFileCacheLookup(const char *key,
+                          const struct stat *sb,
+                          virStorageFileMetadataPtr *meta)
+{
+    virStorageFileCacheEntryPtr entry;
+    struct timespec mtime;
+    int ret = 0;
+
+    *meta = NULL;
+
+    if (virStorageFileCacheInitialize() < 0)
+        return -1;
+
+    virMutexLock(&virStorageFileCacheLock);
+
+    if (!(entry = virHashLookup(virStorageFileCache, key)))
+        goto cleanup;
+
+    mtime = get_stat_mtime(sb);
+    if (entry->dev != sb->st_dev ||
+        entry->ino != sb->st_ino ||
+        entry->size != sb->st_size ||
+        entry->mtime.tv_sec != mtime.tv_sec ||
+        entry->mtime.tv_nsec != mtime.tv_nsec) {
+        VIR_DEBUG("dropping stale metadata of '%s'", entry->path);
+        virHashRemoveEntry(virStorageFileCache, key);
+        goto cleanup;
+    }
+
+    if (!(*meta = virStorageFileMetadataCopyOne(entry->meta)))
+        ret = -1;
+    else
+        ret = 1;
+
+cleanup:
+    virMutexUnlock(&virStorageFileCacheLock);
+    return ret;
+}
+
+/* Best effort, failures just mean the image is read again next time */
+static void
+virStorageFileCacheStore(const char *key,
+                         const char *path,
+                         const struct stat *sb,
+                         virStorageFileMetadataPtr meta)
+{
+    virStorageFileCacheEntryPtr entry = NULL;
+
+    /* Block devices and such don't change their timestamps when
+     * written to, and broken chains should be resolved again once
+     * the missing backing file appears */
+    if (!S_ISREG(sb->st_mode) ||
+        (meta->backingStoreRaw && !meta->backingStore))
+        return;
+
+    if (get_stat_mtime(sb).tv_sec + VIR_STORAGE_FILE_CACHE_MIN_AGE >
+        time(NULL))
+        return;
+
+    if (virStorageFileCacheInitialize() < 0)
+        return;
+
+    if (VIR_ALLOC(entry) < 0 ||
+        VIR_STRDUP(entry->path, path) < 0 ||
+        !(entry->meta = virStorageFileMetadataCopyOne(meta)))
+        goto error;
+
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    entry->size = sb->st_size;
+    entry->mtime = get_stat_mtime(sb);
+
+    virMutexLock(&virStorageFileCacheLock);
+    if (virHashSize(virStorageFileCache) >= VIR_STORAGE_FILE_CACHE_MAX)
+        virHashRemoveAll(virStorageFileCache);
+    if (virHashUpdateEntry(virStorageFileCache, key, entry) < 0) {
+        virMutexUnlock(&virStorageFileCacheLock);
+        goto error;
+    }
+    virMutexUnlock(&virStorageFileCacheLock);
+    return;
+
+error:
+    virResetLastError();
+    virStorageFileCacheEntryFree(entry, NULL);
+}
+
+static int
+virStorageFileCacheEntryMatch(const void *payload,
+                              const void *name ATTRIBUTE_UNUSED,
+                              const void *data)
+{
+    const virStorageFileCacheEntry *entry = payload;
+
+    return STREQ(entry->path, data);
+}
+
+/**
+ * virStorageFileMetadataCacheInvalidate:
+ * @path: image whose metadata is no longer valid, or NULL for all
+ *
+ * Forget the cached metadata of @path. Needed after rewriting an
+ * image header in place, eg by a block job or a snapshot, as the
+ * change could otherwise be missed within the granularity of the
+ * file timestamps.
+ */
+void
+virStorageFileMetadataCacheInvalidate(const char *path)
+{
+    if (virStorageFileCacheInitialize() < 0)
+        return;
+
+    virMutexLock(&virStorageFileCacheLock);
+    if (path)
+        virHashRemoveSet(virStorageFileCache,
+                         virStorageFileCacheEntryMatch, path);
+    else
+        virHashRemoveAll(virStorageFileCache);
+    virMutexUnlock(&virStorageFileCacheLock);
+}
+
+
 /* Given a file descriptor FD open on PATH, and optionally opened from
  * a given DIRECTORY, return metadata about that file, assuming it has
  * the given FORMAT. */
@@ -766,6 +992,8 @@ virStorageFileGetMetadataInternal(const char *path,
     ssize_t len = STORAGE_MAX_HEAD;
     virStorageFileMetadata *ret = NULL;
     struct stat sb;
+    char *key = NULL;
+    int cached;
 
     VIR_DEBUG("path=%s, fd=%d, format=%d", path, fd, format);
 
@@ -783,6 +1011,16 @@ virStorageFileGetMetadataInternal(const char *path,
     if (S_ISDIR(sb.st_mode))
         return meta;
 
+    if (!(key = virStorageFileCacheKey(path, directory, format)))
+        goto cleanup;
+
+    if ((cached = virStorageFileCacheLookup(key, &sb, &ret)) < 0)
+        goto cleanup;
+    if (cached > 0) {
+        VIR_DEBUG("using cached metadata of '%s'", path);
+        goto cleanup;
+    }
+
     if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
         virReportSystemError(errno, _("cannot seek to start of '%s'"), path);
         goto cleanup;
@@ -891,12 +1129,14 @@ virStorageFileGetMetadataInternal(const char *path,
         goto cleanup;
 
 done:
+    virStorageFileCacheStore(key, path, &sb, meta);
     ret = meta;
     meta = NULL;
 
 cleanup:
     virStorageFileFreeMetadata(meta);
     VIR_FREE(buf);
+    VIR_FREE(key);
     return ret;
 }
 
@@ -101,6 +101,7 @@ const char *virStorageFileChainLookup(virStorageFileMetadataPtr chain,
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
 
 void virStorageFileFreeMetadata(virStorageFileMetadataPtr meta);
+void virStorageFileMetadataCacheInvalidate(const char *path);
 
 int virStorageFileResize(const char *path,
                          unsigned long long capacity,
@@ -29,16 +29,18 @@
 #include "viralloc.h"
 #include "virthread.h"
 #include "virerror.h"
+#include "virtime.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+/* How long a worker above the minimum may sit idle before exiting */
+#define VIR_THREAD_POOL_IDLE_TIMEOUT (30 * 1000)
+
 typedef struct _virThreadPoolJob virThreadPoolJob;
 typedef virThreadPoolJob *virThreadPoolJobPtr;
 
 struct _virThreadPoolJob {
-    virThreadPoolJobPtr prev;
     virThreadPoolJobPtr next;
-    unsigned int priority;
 
     void *data;
 };
@@ -49,7 +51,7 @@ typedef virThreadPoolJobList *virThreadPoolJobListPtr;
 struct _virThreadPoolJobList {
     virThreadPoolJobPtr head;
     virThreadPoolJobPtr tail;
-    virThreadPoolJobPtr firstPrio;
+    size_t depth;
 };
 
 
@@ -58,8 +60,7 @@ struct _virThreadPool {
 
     virThreadPoolJobFunc jobFunc;
     void *jobOpaque;
-    virThreadPoolJobList jobList;
-    size_t jobQueueDepth;
+    virThreadPoolJobList jobLists[VIR_THREAD_POOL_JOB_LAST];
 
     virMutex mutex;
     virCond cond;
@@ -69,10 +70,13 @@ struct _virThreadPool {
     size_t minWorkers;
     size_t freeWorkers;
     size_t nWorkers;
-    virThreadPtr workers;
+
+    /* Jobs from the normal lane may only occupy this many
+     * workers at once, the rest is kept for cheap jobs */
+    size_t maxNormalJobs;
+    size_t nNormalJobs;
 
     size_t nPrioWorkers;
-    virThreadPtr prioWorkers;
     virCond prioCond;
 };
 
@@ -82,6 +86,43 @@ struct virThreadPoolWorkerData {
     bool priority;
 };
 
+/*
+ * Take the next job a worker may run off the queues. Priority
+ * workers only look at the priority lane, the others prefer the
+ * priority and fast lanes to the normal one.
+ *
+ * The caller must hold pool->mutex.
+ */
+static virThreadPoolJobPtr
+virThreadPoolNextJob(virThreadPoolPtr pool,
+                     bool priority,
+                     virThreadPoolJobLane *lane)
+{
+    virThreadPoolJobListPtr list;
+    virThreadPoolJobPtr job;
+
+    if (pool->jobLists[VIR_THREAD_POOL_JOB_PRIORITY].head)
+        *lane = VIR_THREAD_POOL_JOB_PRIORITY;
+    else if (priority)
+        return NULL;
+    else if (pool->jobLists[VIR_THREAD_POOL_JOB_FAST].head)
+        *lane = VIR_THREAD_POOL_JOB_FAST;
+    else if (pool->jobLists[VIR_THREAD_POOL_JOB_NORMAL].head &&
+             pool->nNormalJobs < pool->maxNormalJobs)
+        *lane = VIR_THREAD_POOL_JOB_NORMAL;
+    else
+        return NULL;
+
+    list = &pool->jobLists[*lane];
+    job = list->head;
+    list->head = job->next;
+    if (!list->head)
+        list->tail = NULL;
+    list->depth--;
+
+    return job;
+}
+
 static void virThreadPoolWorker(void *opaque)
 {
     struct virThreadPoolWorkerData *data = opaque;
@@ -89,61 +130,59 @@ static void virThreadPoolWorker(void *opaque)
     virCondPtr cond = data->cond;
     bool priority = data->priority;
     virThreadPoolJobPtr job = NULL;
+    virThreadPoolJobLane lane;
 
     VIR_FREE(data);
 
     virMutexLock(&pool->mutex);
 
     while (1) {
+        bool timedout = false;
+
         while (!pool->quit &&
-               ((!priority && !pool->jobList.head) ||
-                (priority && !pool->jobList.firstPrio))) {
+               !(job = virThreadPoolNextJob(pool, priority, &lane))) {
+            unsigned long long now;
+            int rc;
+
+            if (timedout && pool->nWorkers > pool->minWorkers)
+                goto out;
+
             if (!priority)
                 pool->freeWorkers++;
-            if (virCondWait(cond, &pool->mutex) < 0) {
-                if (!priority)
-                    pool->freeWorkers--;
-                goto out;
-            }
+            /* Workers beyond the minimum go away when idle for long */
+            if (!priority && pool->nWorkers > pool->minWorkers &&
+                virTimeMillisNowRaw(&now) == 0)
+                rc = virCondWaitUntil(cond, &pool->mutex,
+                                      now + VIR_THREAD_POOL_IDLE_TIMEOUT);
+            else
+                rc = virCondWait(cond, &pool->mutex);
             if (!priority)
                 pool->freeWorkers--;
-        }
-
-        if (pool->quit)
-            break;
 
-        if (priority) {
-            job = pool->jobList.firstPrio;
-        } else {
-            job = pool->jobList.head;
-        }
-
-        if (job == pool->jobList.firstPrio) {
-            virThreadPoolJobPtr tmp = job->next;
-            while (tmp) {
-                if (tmp->priority) {
-                    break;
-                }
-                tmp = tmp->next;
+            if (rc < 0) {
+                if (errno != ETIMEDOUT)
+                    goto out;
+                timedout = true;
             }
-            pool->jobList.firstPrio = tmp;
         }
 
-        if (job->prev)
-            job->prev->next = job->next;
-        else
-            pool->jobList.head = job->next;
-        if (job->next)
-            job->next->prev = job->prev;
-        else
-            pool->jobList.tail = job->prev;
+        if (pool->quit)
+            break;
 
-        pool->jobQueueDepth--;
+        if (lane == VIR_THREAD_POOL_JOB_NORMAL)
+            pool->nNormalJobs++;
 
         virMutexUnlock(&pool->mutex);
         (pool->jobFunc)(job->data, pool->jobOpaque);
         VIR_FREE(job);
         virMutexLock(&pool->mutex);
+
+        if (lane == VIR_THREAD_POOL_JOB_NORMAL) {
+            pool->nNormalJobs--;
+            /* A normal job held back by the limit can run now */
+            if (pool->jobLists[VIR_THREAD_POOL_JOB_NORMAL].head)
+                virCondSignal(&pool->cond);
+        }
     }
 
 out:
@@ -156,6 +195,36 @@ out:
     virMutexUnlock(&pool->mutex);
 }
 
+/* The caller must hold pool->mutex */
+static int
+virThreadPoolExpand(virThreadPoolPtr pool, bool priority)
+{
+    struct virThreadPoolWorkerData *data = NULL;
+    virThread thread;
+
+    if (VIR_ALLOC(data) < 0)
+        return -1;
+
+    data->pool = pool;
+    data->cond = priority ? &pool->prioCond : &pool->cond;
+    data->priority = priority;
+
+    if (virThreadCreate(&thread,
+                        false,
+                        virThreadPoolWorker,
+                        data) < 0) {
+        VIR_FREE(data);
+        return -1;
+    }
+
+    if (priority)
+        pool->nPrioWorkers++;
+    else
+        pool->nWorkers++;
+
+    return 0;
+}
+
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
                                   size_t maxWorkers,
                                   size_t prioWorkers,
@@ -164,7 +233,6 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
 {
     virThreadPoolPtr pool;
     size_t i;
-    struct virThreadPoolWorkerData *data = NULL;
 
     if (minWorkers > maxWorkers)
         minWorkers = maxWorkers;
@@ -172,8 +240,6 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
     if (VIR_ALLOC(pool) < 0)
         return NULL;
 
-    pool->jobList.tail = pool->jobList.head = NULL;
-
     pool->jobFunc = func;
     pool->jobOpaque = opaque;
 
@@ -183,55 +249,34 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
         goto error;
     if (virCondInit(&pool->quit_cond) < 0)
         goto error;
-
-    if (VIR_ALLOC_N(pool->workers, minWorkers) < 0)
+    if (virCondInit(&pool->prioCond) < 0)
         goto error;
 
     pool->minWorkers = minWorkers;
     pool->maxWorkers = maxWorkers;
+    /* Keep a quarter of the workers for the fast and priority lanes
+     * so a burst of slow jobs can't hold everything else up */
+    pool->maxNormalJobs = maxWorkers - maxWorkers / 4;
+
+    virMutexLock(&pool->mutex);
 
     for (i = 0; i < minWorkers; i++) {
-        if (VIR_ALLOC(data) < 0)
-            goto error;
-        data->pool = pool;
-        data->cond = &pool->cond;
-
-        if (virThreadCreate(&pool->workers[i],
-                            true,
-                            virThreadPoolWorker,
-                            data) < 0) {
-            goto error;
-        }
-        pool->nWorkers++;
+        if (virThreadPoolExpand(pool, false) < 0)
+            goto error_unlock;
     }
 
-    if (prioWorkers) {
-        if (virCondInit(&pool->prioCond) < 0)
-            goto error;
-        if (VIR_ALLOC_N(pool->prioWorkers, prioWorkers) < 0)
-            goto error;
-
-        for (i = 0; i < prioWorkers; i++) {
-            if (VIR_ALLOC(data) < 0)
-                goto error;
-            data->pool = pool;
-            data->cond = &pool->prioCond;
-            data->priority = true;
-
-            if (virThreadCreate(&pool->prioWorkers[i],
-                                true,
-                                virThreadPoolWorker,
-                                data) < 0) {
-                goto error;
-            }
-            pool->nPrioWorkers++;
-        }
+    for (i = 0; i < prioWorkers; i++) {
+        if (virThreadPoolExpand(pool, true) < 0)
+            goto error_unlock;
     }
 
+    virMutexUnlock(&pool->mutex);
+
     return pool;
 
+error_unlock:
+    virMutexUnlock(&pool->mutex);
 error:
-    VIR_FREE(data);
     virThreadPoolFree(pool);
     return NULL;
 
@@ -240,7 +285,7 @@ error:
 void virThreadPoolFree(virThreadPoolPtr pool)
 {
     virThreadPoolJobPtr job;
-    bool priority = false;
+    size_t i;
 
     if (!pool)
         return;
@@ -249,28 +294,24 @@ void virThreadPoolFree(virThreadPoolPtr pool)
     pool->quit = true;
     if (pool->nWorkers > 0)
         virCondBroadcast(&pool->cond);
-    if (pool->nPrioWorkers > 0) {
-        priority = true;
+    if (pool->nPrioWorkers > 0)
         virCondBroadcast(&pool->prioCond);
-    }
 
     while (pool->nWorkers > 0 || pool->nPrioWorkers > 0)
         ignore_value(virCondWait(&pool->quit_cond, &pool->mutex));
 
-    while ((job = pool->jobList.head)) {
-        pool->jobList.head = pool->jobList.head->next;
-        VIR_FREE(job);
+    for (i = 0; i < VIR_THREAD_POOL_JOB_LAST; i++) {
+        while ((job = pool->jobLists[i].head)) {
+            pool->jobLists[i].head = job->next;
+            VIR_FREE(job);
+        }
     }
 
-    VIR_FREE(pool->workers);
     virMutexUnlock(&pool->mutex);
     virMutexDestroy(&pool->mutex);
     virCondDestroy(&pool->quit_cond);
     virCondDestroy(&pool->cond);
-    if (priority) {
-        VIR_FREE(pool->prioWorkers);
-        virCondDestroy(&pool->prioCond);
-    }
+    virCondDestroy(&pool->prioCond);
     VIR_FREE(pool);
 }
 
@@ -290,65 +331,84 @@ size_t virThreadPoolGetPriorityWorkers(virThreadPoolPtr pool)
     return pool->nPrioWorkers;
 }
 
+size_t virThreadPoolGetCurrentWorkers(virThreadPoolPtr pool)
+{
+    size_t ret;
+
+    virMutexLock(&pool->mutex);
+    ret = pool->nWorkers;
+    virMutexUnlock(&pool->mutex);
+
+    return ret;
+}
+
+size_t virThreadPoolGetFreeWorkers(virThreadPoolPtr pool)
+{
+    size_t ret;
+
+    virMutexLock(&pool->mutex);
+    ret = pool->freeWorkers;
+    virMutexUnlock(&pool->mutex);
+
+    return ret;
+}
+
+size_t virThreadPoolGetJobQueueDepth(virThreadPoolPtr pool)
+{
+    size_t ret = 0;
+    size_t i;
+
+    virMutexLock(&pool->mutex);
+    for (i = 0; i < VIR_THREAD_POOL_JOB_LAST; i++)
+        ret += pool->jobLists[i].depth;
+    virMutexUnlock(&pool->mutex);
+
+    return ret;
+}
+
 /*
- * @priority - job priority
+ * @priority - lane to queue the job in, one of virThreadPoolJobLane
  * Return: 0 on success, -1 otherwise
  */
 int virThreadPoolSendJob(virThreadPoolPtr pool,
                          unsigned int priority,
                          void *jobData)
 {
+    virThreadPoolJobListPtr list;
     virThreadPoolJobPtr job;
-    struct virThreadPoolWorkerData *data = NULL;
+    size_t depth = 0;
+    size_t i;
+
+    if (priority >= VIR_THREAD_POOL_JOB_LAST)
+        priority = VIR_THREAD_POOL_JOB_NORMAL;
 
     virMutexLock(&pool->mutex);
     if (pool->quit)
         goto error;
 
-    if (pool->freeWorkers - pool->jobQueueDepth <= 0 &&
-        pool->nWorkers < pool->maxWorkers) {
-        if (VIR_EXPAND_N(pool->workers, pool->nWorkers, 1) < 0)
-            goto error;
-
-        if (VIR_ALLOC(data) < 0) {
-            pool->nWorkers--;
-            goto error;
-        }
-
-        data->pool = pool;
-        data->cond = &pool->cond;
+    for (i = 0; i < VIR_THREAD_POOL_JOB_LAST; i++)
+        depth += pool->jobLists[i].depth;
 
-        if (virThreadCreate(&pool->workers[pool->nWorkers - 1],
-                            true,
-                            virThreadPoolWorker,
-                            data) < 0) {
-            VIR_FREE(data);
-            pool->nWorkers--;
-            goto error;
-        }
-    }
+    if (pool->freeWorkers <= depth &&
+        pool->nWorkers < pool->maxWorkers &&
+        virThreadPoolExpand(pool, false) < 0)
+        goto error;
 
     if (VIR_ALLOC(job) < 0)
         goto error;
 
     job->data = jobData;
-    job->priority = priority;
-
-    job->prev = pool->jobList.tail;
-    if (pool->jobList.tail)
-        pool->jobList.tail->next = job;
-    pool->jobList.tail = job;
-
-    if (!pool->jobList.head)
-        pool->jobList.head = job;
 
-    if (priority && !pool->jobList.firstPrio)
-        pool->jobList.firstPrio = job;
-
-    pool->jobQueueDepth++;
+    list = &pool->jobLists[priority];
+    if (list->tail)
+        list->tail->next = job;
+    else
+        list->head = job;
+    list->tail = job;
+    list->depth++;
 
     virCondSignal(&pool->cond);
-    if (priority)
+    if (priority == VIR_THREAD_POOL_JOB_PRIORITY)
         virCondSignal(&pool->prioCond);
 
     virMutexUnlock(&pool->mutex);
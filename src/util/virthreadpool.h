@@ -33,6 +33,16 @@ typedef virThreadPool *virThreadPoolPtr;
 
 typedef void (*virThreadPoolJobFunc)(void *jobdata, void *opaque);
 
+/* Lanes a job can be queued in, passed as @priority to
+ * virThreadPoolSendJob */
+typedef enum {
+    VIR_THREAD_POOL_JOB_NORMAL = 0,   /* may block for a long time */
+    VIR_THREAD_POOL_JOB_PRIORITY = 1, /* may run on priority workers too */
+    VIR_THREAD_POOL_JOB_FAST = 2,     /* known to be cheap, jumps the queue */
+
+    VIR_THREAD_POOL_JOB_LAST
+} virThreadPoolJobLane;
+
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
                                   size_t maxWorkers,
                                   size_t prioWorkers,
@@ -42,6 +52,9 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
 size_t virThreadPoolGetMinWorkers(virThreadPoolPtr pool);
 size_t virThreadPoolGetMaxWorkers(virThreadPoolPtr pool);
 size_t virThreadPoolGetPriorityWorkers(virThreadPoolPtr pool);
+size_t virThreadPoolGetCurrentWorkers(virThreadPoolPtr pool);
+size_t virThreadPoolGetFreeWorkers(virThreadPoolPtr pool);
+size_t virThreadPoolGetJobQueueDepth(virThreadPoolPtr pool);
 
 void virThreadPoolFree(virThreadPoolPtr pool);
 
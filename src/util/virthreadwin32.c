@@ -123,6 +123,36 @@ void virMutexUnlock(virMutexPtr m)
 }
 
 
+int virRWLockInit(virRWLockPtr m)
+{
+    if (!(m->lock = CreateMutex(NULL, FALSE, NULL))) {
+        errno = ESRCH;
+        return -1;
+    }
+    return 0;
+}
+
+void virRWLockDestroy(virRWLockPtr m)
+{
+    CloseHandle(m->lock);
+}
+
+void virRWLockRead(virRWLockPtr m)
+{
+    WaitForSingleObject(m->lock, INFINITE);
+}
+
+void virRWLockWrite(virRWLockPtr m)
+{
+    WaitForSingleObject(m->lock, INFINITE);
+}
+
+void virRWLockUnlock(virRWLockPtr m)
+{
+    ReleaseMutex(m->lock);
+}
+
+
 
 int virCondInit(virCondPtr c)
 {
@@ -30,6 +30,12 @@ struct virMutex {
     HANDLE lock;
 };
 
+/* No native reader/writer lock is used on Windows, so
+ * readers are serialized like writers */
+struct virRWLock {
+    HANDLE lock;
+};
+
 struct virCond {
     virMutex lock;
     size_t nwaiters;
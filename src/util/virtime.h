@@ -41,6 +41,8 @@
  * errno on failure */
 int virTimeMillisNowRaw(unsigned long long *now)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
+int virTimeMicrosNowRaw(unsigned long long *now)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
 int virTimeFieldsNowRaw(struct tm *fields)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
 int virTimeFieldsThenRaw(unsigned long long when, struct tm *fields)
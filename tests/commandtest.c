@@ -898,6 +898,61 @@ cleanup:
     return ret;
 }
 
+static int
+test22Hook(void *opaque ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+
+static int
+test22Run(size_t idx ATTRIBUTE_UNUSED, void *opaque)
+{
+    bool *hook = opaque;
+    virCommandPtr cmd = virCommandNew("true");
+    int rv;
+
+    if (*hook)
+        virCommandSetPreExecHook(cmd, test22Hook, NULL);
+    rv = virCommandRun(cmd, NULL);
+    virCommandFree(cmd);
+
+    if (rv < 0) {
+        virErrorPtr err = virGetLastError();
+        printf("Cannot run child %s\n", err->message);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Time running a trivial command, which needs no work in the child
+ * before exec and so can be spawned directly, against the same
+ * command with a no-op pre-exec hook, which forces a full fork().
+ * With debug enabled the time per command is printed.
+ */
+static int test22(const void *unused ATTRIBUTE_UNUSED)
+{
+    size_t rounds = virTestGetExpensive() ? 1000 : 50;
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        bool hook = i == 1;
+        unsigned long long elapsed;
+
+        if (virtTestBenchmark(rounds, test22Run, &hook, &elapsed) < 0)
+            return -1;
+
+        VIR_TEST_DEBUG("\n%-5s %zu runs: %llu us/run",
+                       hook ? "fork" : "spawn", rounds,
+                       elapsed * 1000 / rounds);
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    return 0;
+}
+
 static void virCommandThreadWorker(void *opaque)
 {
     virCommandTestDataPtr test = opaque;
@@ -1045,6 +1100,7 @@ mymain(void)
     DO_TEST(test19);
     DO_TEST(test20);
     DO_TEST(test21);
+    DO_TEST(test22);
 
     virMutexLock(&test->lock);
     if (test->running) {
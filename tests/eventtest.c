@@ -33,10 +33,40 @@
 #include "virlog.h"
 #include "virutil.h"
 #include "vireventpoll.h"
+#include "vireventepoll.h"
 
 #define NUM_FDS 31
 #define NUM_TIME 31
 
+/* Event loop backend under test */
+struct testEventImpl {
+    const char *name;
+    int (*init)(void);
+    int (*runOnce)(void);
+    int (*addHandle)(int fd, int events, virEventHandleCallback cb,
+                     void *opaque, virFreeCallback ff);
+    int (*removeHandle)(int watch);
+    int (*addTimeout)(int frequency, virEventTimeoutCallback cb,
+                      void *opaque, virFreeCallback ff);
+    void (*updateTimeout)(int timer, int frequency);
+    int (*removeTimeout)(int timer);
+};
+
+static const struct testEventImpl impls[] = {
+    { "poll", virEventPollInit, virEventPollRunOnce,
+      virEventPollAddHandle, virEventPollRemoveHandle,
+      virEventPollAddTimeout, virEventPollUpdateTimeout,
+      virEventPollRemoveTimeout },
+#if HAVE_SYS_EPOLL_H
+    { "epoll", virEventEpollInit, virEventEpollRunOnce,
+      virEventEpollAddHandle, virEventEpollRemoveHandle,
+      virEventEpollAddTimeout, virEventEpollUpdateTimeout,
+      virEventEpollRemoveTimeout },
+#endif
+};
+
+static const struct testEventImpl *impl;
+
 static struct handleInfo {
     int pipeFD[2];
     int fired;
@@ -90,7 +120,7 @@ testPipeReader(int watch, int fd, int events, void *data)
     info->error = EV_ERROR_NONE;
 
     if (info->delete != -1)
-        virEventPollRemoveHandle(info->delete);
+        impl->removeHandle(info->delete);
 }
 
 
@@ -109,7 +139,7 @@ testTimer(int timer, void *data)
     info->error = EV_ERROR_NONE;
 
     if (info->delete != -1)
-        virEventPollRemoveTimeout(info->delete);
+        impl->removeTimeout(info->delete);
 }
 
 static pthread_mutex_t eventThreadMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -128,7 +158,7 @@ ATTRIBUTE_NORETURN static void *eventThreadLoop(void *data ATTRIBUTE_UNUSED) {
         eventThreadRunOnce = 0;
         pthread_mutex_unlock(&eventThreadMutex);
 
-        virEventPollRunOnce();
+        impl->runOnce();
 
         pthread_mutex_lock(&eventThreadMutex);
         eventThreadJobDone = 1;
@@ -259,12 +289,15 @@ resetAll(void)
 }
 
 static int
-mymain(void)
+testEventLoop(const struct testEventImpl *eventImpl)
 {
     size_t i;
-    pthread_t eventThread;
     char one = '1';
 
+    impl = eventImpl;
+    if (virTestGetVerbose())
+        fprintf(stderr, "Testing %s event loop\n", impl->name);
+
     for (i = 0; i < NUM_FDS; i++) {
         if (pipe(handles[i].pipeFD) < 0) {
             fprintf(stderr, "Cannot create pipe: %d", errno);
@@ -272,36 +305,31 @@ mymain(void)
         }
     }
 
-    if (virThreadInitialize() < 0)
-        return EXIT_FAILURE;
-    char *debugEnv = getenv("LIBVIRT_DEBUG");
-    if (debugEnv && *debugEnv && (virLogParseDefaultPriority(debugEnv) == -1)) {
-        fprintf(stderr, "Invalid log level setting.\n");
+    if (impl->init() < 0) {
+        fprintf(stderr, "Cannot initialize %s event loop\n", impl->name);
         return EXIT_FAILURE;
     }
 
-    virEventPollInit();
+    resetAll();
 
     for (i = 0; i < NUM_FDS; i++) {
         handles[i].delete = -1;
         handles[i].watch =
-            virEventPollAddHandle(handles[i].pipeFD[0],
-                                  VIR_EVENT_HANDLE_READABLE,
-                                  testPipeReader,
-                                  &handles[i], NULL);
+            impl->addHandle(handles[i].pipeFD[0],
+                            VIR_EVENT_HANDLE_READABLE,
+                            testPipeReader,
+                            &handles[i], NULL);
     }
 
     for (i = 0; i < NUM_TIME; i++) {
         timers[i].delete = -1;
         timers[i].timeout = -1;
         timers[i].timer =
-            virEventPollAddTimeout(timers[i].timeout,
-                                   testTimer,
-                                   &timers[i], NULL);
+            impl->addTimeout(timers[i].timeout,
+                             testTimer,
+                             &timers[i], NULL);
     }
 
-    pthread_create(&eventThread, NULL, eventThreadLoop, NULL);
-
     pthread_mutex_lock(&eventThreadMutex);
 
     /* First time, is easy - just try triggering one of our
@@ -316,7 +344,7 @@ mymain(void)
 
     /* Now lets delete one before starting poll(), and
      * try triggering another handle */
-    virEventPollRemoveHandle(handles[0].watch);
+    impl->removeHandle(handles[0].watch);
     startJob();
     if (safewrite(handles[1].pipeFD[1], &one, 1) != 1)
         return EXIT_FAILURE;
@@ -336,7 +364,7 @@ mymain(void)
     sched_yield();
     usleep(100 * 1000);
     pthread_mutex_lock(&eventThreadMutex);
-    virEventPollRemoveHandle(handles[1].watch);
+    impl->removeHandle(handles[1].watch);
     if (finishJob("Interrupted during poll", -1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
@@ -372,22 +400,22 @@ mymain(void)
 
 
     /* Run a timer on its own */
-    virEventPollUpdateTimeout(timers[1].timer, 100);
+    impl->updateTimeout(timers[1].timer, 100);
     startJob();
     if (finishJob("Firing a timer", -1, 1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[1].timer, -1);
+    impl->updateTimeout(timers[1].timer, -1);
 
     resetAll();
 
     /* Now lets delete one before starting poll(), and
      * try triggering another timer */
-    virEventPollUpdateTimeout(timers[1].timer, 100);
-    virEventPollRemoveTimeout(timers[0].timer);
+    impl->updateTimeout(timers[1].timer, 100);
+    impl->removeTimeout(timers[0].timer);
     startJob();
     if (finishJob("Deleted before poll", -1, 1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[1].timer, -1);
+    impl->updateTimeout(timers[1].timer, -1);
 
     resetAll();
 
@@ -402,7 +430,7 @@ mymain(void)
     sched_yield();
     usleep(100 * 1000);
     pthread_mutex_lock(&eventThreadMutex);
-    virEventPollRemoveTimeout(timers[1].timer);
+    impl->removeTimeout(timers[1].timer);
     if (finishJob("Interrupted during poll", -1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
@@ -415,27 +443,27 @@ mymain(void)
      * before poll() exits for the first safewrite(). We don't
      * see a hard failure in other cases, so nothing to worry
      * about */
-    virEventPollUpdateTimeout(timers[2].timer, 100);
-    virEventPollUpdateTimeout(timers[3].timer, 100);
+    impl->updateTimeout(timers[2].timer, 100);
+    impl->updateTimeout(timers[3].timer, 100);
     startJob();
     timers[2].delete = timers[3].timer;
     if (finishJob("Deleted during dispatch", -1, 2) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[2].timer, -1);
+    impl->updateTimeout(timers[2].timer, -1);
 
     resetAll();
 
     /* Extreme fun, lets delete ourselves during dispatch */
-    virEventPollUpdateTimeout(timers[2].timer, 100);
+    impl->updateTimeout(timers[2].timer, 100);
     startJob();
     timers[2].delete = timers[2].timer;
     if (finishJob("Deleted during dispatch", -1, 2) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
     for (i = 0; i < NUM_FDS - 1; i++)
-        virEventPollRemoveHandle(handles[i].watch);
+        impl->removeHandle(handles[i].watch);
     for (i = 0; i < NUM_TIME - 1; i++)
-        virEventPollRemoveTimeout(timers[i].timer);
+        impl->removeTimeout(timers[i].timer);
 
     resetAll();
 
@@ -456,20 +484,52 @@ mymain(void)
     handles[0].pipeFD[0] = handles[1].pipeFD[0];
     handles[0].pipeFD[1] = handles[1].pipeFD[1];
 
-    handles[0].watch = virEventPollAddHandle(handles[0].pipeFD[0],
-                                             0,
-                                             testPipeReader,
-                                             &handles[0], NULL);
-    handles[1].watch = virEventPollAddHandle(handles[1].pipeFD[0],
-                                             VIR_EVENT_HANDLE_READABLE,
-                                             testPipeReader,
-                                             &handles[1], NULL);
+    handles[0].watch = impl->addHandle(handles[0].pipeFD[0],
+                                       0,
+                                       testPipeReader,
+                                       &handles[0], NULL);
+    handles[1].watch = impl->addHandle(handles[1].pipeFD[0],
+                                       VIR_EVENT_HANDLE_READABLE,
+                                       testPipeReader,
+                                       &handles[1], NULL);
     startJob();
     if (safewrite(handles[1].pipeFD[1], &one, 1) != 1)
         return EXIT_FAILURE;
     if (finishJob("Write duplicate", 1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
+    /* Leave nothing behind for the next backend to trip over */
+    impl->removeHandle(handles[0].watch);
+    impl->removeHandle(handles[1].watch);
+    impl->removeHandle(handles[NUM_FDS - 1].watch);
+    impl->removeTimeout(timers[NUM_TIME - 1].timer);
+
+    pthread_mutex_unlock(&eventThreadMutex);
+
+    return EXIT_SUCCESS;
+}
+
+static int
+mymain(void)
+{
+    size_t i;
+    pthread_t eventThread;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+    char *debugEnv = getenv("LIBVIRT_DEBUG");
+    if (debugEnv && *debugEnv && (virLogParseDefaultPriority(debugEnv) == -1)) {
+        fprintf(stderr, "Invalid log level setting.\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_create(&eventThread, NULL, eventThreadLoop, NULL);
+
+    for (i = 0; i < ARRAY_CARDINALITY(impls); i++) {
+        if (testEventLoop(&impls[i]) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+
     //pthread_kill(eventThread, SIGTERM);
 
     return EXIT_SUCCESS;
@@ -312,6 +312,420 @@ static int testFDStreamWriteNonblock(const void *data)
     return testFDStreamWriteCommon(data, false);
 }
 
+/* Sparse files used below: a chunk of data, a hole of three
+ * chunks, another chunk of data and a trailing hole of three
+ * chunks */
+#define SPARSE_CHUNK (1024 * 1024)
+#define SPARSE_LEN (8 * SPARSE_CHUNK)
+
+static bool
+testFDStreamSparseIsData(size_t offset)
+{
+    return offset < SPARSE_CHUNK ||
+        (offset >= 4 * SPARSE_CHUNK && offset < 5 * SPARSE_CHUNK);
+}
+
+static char *
+testFDStreamSparseContent(void)
+{
+    char *content;
+    size_t i;
+
+    if (VIR_ALLOC_N(content, SPARSE_LEN) < 0)
+        return NULL;
+
+    for (i = 0; i < SPARSE_LEN; i++) {
+        if (testFDStreamSparseIsData(i))
+            content[i] = (i % 251) + 1;
+    }
+
+    return content;
+}
+
+static int
+testFDStreamSparseCreate(const char *file, const char *content)
+{
+    int fd;
+
+    if ((fd = open(file, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
+        return -1;
+
+    if (safewrite(fd, content, SPARSE_CHUNK) != SPARSE_CHUNK ||
+        lseek(fd, 4 * SPARSE_CHUNK, SEEK_SET) < 0 ||
+        safewrite(fd, content + 4 * SPARSE_CHUNK,
+                  SPARSE_CHUNK) != SPARSE_CHUNK ||
+        ftruncate(fd, SPARSE_LEN) < 0) {
+        VIR_FORCE_CLOSE(fd);
+        return -1;
+    }
+
+    return VIR_CLOSE(fd);
+}
+
+
+static int
+testFDStreamSparseReadCommon(const char *scratchdir, bool blocking,
+                             bool stopAtHole)
+{
+    char *file = NULL;
+    char *expected = NULL;
+    char *actual = NULL;
+    char *buf = NULL;
+    virStreamPtr st = NULL;
+    virConnectPtr conn = NULL;
+    size_t offset = 0;
+    int flags = 0;
+    int ret = -1;
+
+    if (!blocking)
+        flags |= VIR_STREAM_NONBLOCK;
+
+    if (!(conn = virConnectOpen("test:///default")))
+        goto cleanup;
+
+    if (!(expected = testFDStreamSparseContent()) ||
+        VIR_ALLOC_N(actual, SPARSE_LEN) < 0 ||
+        VIR_ALLOC_N(buf, PATTERN_LEN) < 0)
+        goto cleanup;
+
+    if (virAsprintf(&file, "%s/sparse.data", scratchdir) < 0)
+        goto cleanup;
+
+    if (testFDStreamSparseCreate(file, expected) < 0)
+        goto cleanup;
+
+    if (!(st = virStreamNew(conn, flags)))
+        goto cleanup;
+
+    if (virFDStreamOpenFileSparse(st, file, 0, 0, O_RDONLY) < 0)
+        goto cleanup;
+
+    while (1) {
+        int got;
+
+        got = st->driver->streamRecvFlags(st, buf, PATTERN_LEN,
+                                          stopAtHole ?
+                                          VIR_STREAM_RECV_STOP_AT_HOLE : 0);
+        if (got == -2 && !blocking) {
+            usleep(20 * 1000);
+            continue;
+        }
+        if (got == -3) {
+            long long len;
+
+            if (st->driver->streamRecvHole(st, &len, 0) < 0 ||
+                len <= 0 || len > SPARSE_LEN - offset) {
+                virFilePrintf(stderr, "Bad hole at offset %zu\n", offset);
+                goto cleanup;
+            }
+            offset += len;
+            continue;
+        }
+        if (got < 0) {
+            virFilePrintf(stderr, "Failed to read stream: %s\n",
+                          virGetLastErrorMessage());
+            goto cleanup;
+        }
+        if (got == 0)
+            break;
+        if (got > SPARSE_LEN - offset) {
+            virFilePrintf(stderr, "Too much data at offset %zu\n", offset);
+            goto cleanup;
+        }
+        memcpy(actual + offset, buf, got);
+        offset += got;
+    }
+
+    if (offset != SPARSE_LEN ||
+        memcmp(expected, actual, SPARSE_LEN) != 0) {
+        virFilePrintf(stderr, "Mismatched sparse data, got %zu bytes\n",
+                      offset);
+        goto cleanup;
+    }
+
+    if (st->driver->streamFinish(st) != 0) {
+        virFilePrintf(stderr, "Failed to finish stream: %s\n",
+                      virGetLastErrorMessage());
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    if (st)
+        virStreamFree(st);
+    if (file != NULL)
+        unlink(file);
+    if (conn)
+        virConnectClose(conn);
+    VIR_FREE(file);
+    VIR_FREE(expected);
+    VIR_FREE(actual);
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+static int testFDStreamSparseReadBlock(const void *data)
+{
+    return testFDStreamSparseReadCommon(data, true, true);
+}
+static int testFDStreamSparseReadNonblock(const void *data)
+{
+    return testFDStreamSparseReadCommon(data, false, true);
+}
+static int testFDStreamSparseReadFill(const void *data)
+{
+    return testFDStreamSparseReadCommon(data, true, false);
+}
+
+
+static int
+testFDStreamSparseWriteCommon(const char *scratchdir, bool blocking)
+{
+    int fd = -1;
+    char *file = NULL;
+    char *expected = NULL;
+    char *actual = NULL;
+    virStreamPtr st = NULL;
+    virConnectPtr conn = NULL;
+    size_t offset = 0;
+    int flags = 0;
+    int ret = -1;
+
+    if (!blocking)
+        flags |= VIR_STREAM_NONBLOCK;
+
+    if (!(conn = virConnectOpen("test:///default")))
+        goto cleanup;
+
+    if (!(expected = testFDStreamSparseContent()) ||
+        VIR_ALLOC_N(actual, SPARSE_LEN + 1) < 0)
+        goto cleanup;
+
+    if (virAsprintf(&file, "%s/sparse.data", scratchdir) < 0)
+        goto cleanup;
+
+    /* Old contents in the first hole have to be punched out, the
+     * rest of the file gets extended */
+    memset(actual, 'x', 2 * SPARSE_CHUNK);
+    if ((fd = open(file, O_CREAT|O_WRONLY|O_EXCL, 0600)) < 0 ||
+        safewrite(fd, actual, 2 * SPARSE_CHUNK) != 2 * SPARSE_CHUNK ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if (!(st = virStreamNew(conn, flags)))
+        goto cleanup;
+
+    if (virFDStreamOpenFileSparse(st, file, 0, SPARSE_LEN, O_WRONLY) < 0)
+        goto cleanup;
+
+    while (offset < SPARSE_LEN) {
+        size_t want;
+        int got;
+
+        if (!testFDStreamSparseIsData(offset)) {
+            if (st->driver->streamSendHole(st, SPARSE_CHUNK, 0) < 0) {
+                virFilePrintf(stderr, "Failed to send hole: %s\n",
+                              virGetLastErrorMessage());
+                goto cleanup;
+            }
+            offset += SPARSE_CHUNK;
+            continue;
+        }
+
+        want = SPARSE_CHUNK - (offset % SPARSE_CHUNK);
+        if (want > PATTERN_LEN * 3)
+            want = PATTERN_LEN * 3;
+        got = st->driver->streamSend(st, expected + offset, want);
+        if (got == -2 && !blocking) {
+            usleep(20 * 1000);
+            continue;
+        }
+        if (got < 0) {
+            virFilePrintf(stderr, "Failed to write stream: %s\n",
+                          virGetLastErrorMessage());
+            goto cleanup;
+        }
+        offset += got;
+    }
+
+    if (st->driver->streamFinish(st) != 0) {
+        virFilePrintf(stderr, "Failed to finish stream: %s\n",
+                      virGetLastErrorMessage());
+        goto cleanup;
+    }
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+        goto cleanup;
+
+    if (saferead(fd, actual, SPARSE_LEN + 1) != SPARSE_LEN ||
+        memcmp(expected, actual, SPARSE_LEN) != 0) {
+        virFilePrintf(stderr, "Mismatched sparse data\n");
+        goto cleanup;
+    }
+
+    if (VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    if (st)
+        virStreamFree(st);
+    VIR_FORCE_CLOSE(fd);
+    if (file != NULL)
+        unlink(file);
+    if (conn)
+        virConnectClose(conn);
+    VIR_FREE(file);
+    VIR_FREE(expected);
+    VIR_FREE(actual);
+    return ret;
+}
+
+
+static int testFDStreamSparseWriteBlock(const void *data)
+{
+    return testFDStreamSparseWriteCommon(data, true);
+}
+static int testFDStreamSparseWriteNonblock(const void *data)
+{
+    return testFDStreamSparseWriteCommon(data, false);
+}
+
+
+struct testFDStreamBenchData {
+    virConnectPtr conn;
+    const char *file;
+    char *buf;
+    size_t buflen;
+    bool sparse;
+    unsigned long long total;
+};
+
+static int
+testFDStreamSparseBenchRun(size_t idx ATTRIBUTE_UNUSED,
+                           void *opaque)
+{
+    struct testFDStreamBenchData *data = opaque;
+    virStreamPtr st;
+    int rc;
+    int ret = -1;
+
+    if (!(st = virStreamNew(data->conn, 0)))
+        return -1;
+
+    if (data->sparse)
+        rc = virFDStreamOpenFileSparse(st, data->file, 0, 0, O_RDONLY);
+    else
+        rc = virFDStreamOpenFile(st, data->file, 0, 0, O_RDONLY);
+    if (rc < 0)
+        goto cleanup;
+
+    while (1) {
+        int got = st->driver->streamRecvFlags(st, data->buf, data->buflen,
+                                              VIR_STREAM_RECV_STOP_AT_HOLE);
+        if (got == -3) {
+            long long len;
+            if (st->driver->streamRecvHole(st, &len, 0) < 0)
+                goto cleanup;
+            data->total += len;
+            continue;
+        }
+        if (got < 0) {
+            virFilePrintf(stderr, "Failed to read stream: %s\n",
+                          virGetLastErrorMessage());
+            goto cleanup;
+        }
+        if (got == 0)
+            break;
+        data->total += got;
+    }
+
+    if (st->driver->streamFinish(st) != 0)
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    virStreamFree(st);
+    return ret;
+}
+
+/*
+ * Download a mostly empty file, once with every byte going through
+ * the stream and once as a sparse stream. With debug enabled the
+ * throughput of both is reported, in bytes of the file per second.
+ */
+static int
+testFDStreamSparseBenchmark(const void *data)
+{
+    const char *scratchdir = data;
+    size_t chunks = virTestGetExpensive() ? 1024 : 64;
+    struct testFDStreamBenchData bench = { NULL };
+    char *file = NULL;
+    size_t i;
+    int fd = -1;
+    int ret = -1;
+
+    if (!(bench.conn = virConnectOpen("test:///default")))
+        goto cleanup;
+
+    bench.buflen = 256 * 1024;
+    if (VIR_ALLOC_N(bench.buf, bench.buflen) < 0)
+        goto cleanup;
+    memset(bench.buf, 'x', bench.buflen);
+
+    if (virAsprintf(&file, "%s/bench.data", scratchdir) < 0)
+        goto cleanup;
+    bench.file = file;
+
+    /* One buffer of data at the start of each chunk */
+    if ((fd = open(file, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
+        goto cleanup;
+    for (i = 0; i < chunks; i++) {
+        if (lseek(fd, i * SPARSE_CHUNK, SEEK_SET) < 0 ||
+            safewrite(fd, bench.buf, bench.buflen) != bench.buflen)
+            goto cleanup;
+    }
+    if (ftruncate(fd, chunks * SPARSE_CHUNK) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    for (i = 0; i < 2; i++) {
+        unsigned long long elapsed;
+
+        bench.sparse = i == 1;
+        bench.total = 0;
+
+        if (virtTestBenchmark(1, testFDStreamSparseBenchRun,
+                              &bench, &elapsed) < 0)
+            goto cleanup;
+
+        if (bench.total != chunks * SPARSE_CHUNK) {
+            virFilePrintf(stderr, "Expected %zu bytes, got %llu\n",
+                          chunks * SPARSE_CHUNK, bench.total);
+            goto cleanup;
+        }
+
+        VIR_TEST_DEBUG("\n%s: %llu MB/s",
+                       bench.sparse ? "sparse" : "  full",
+                       (bench.total / 1024) / (elapsed + 1));
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    if (file != NULL)
+        unlink(file);
+    if (bench.conn)
+        virConnectClose(bench.conn);
+    VIR_FREE(file);
+    VIR_FREE(bench.buf);
+    return ret;
+}
+
+
 #define SCRATCHDIRTEMPLATE abs_builddir "/fakesysfsdir-XXXXXX"
 
 static int
@@ -336,6 +750,18 @@ mymain(void)
         ret = -1;
     if (virtTestRun("Stream write non-blocking ", 1, testFDStreamWriteNonblock, scratchdir) < 0)
         ret = -1;
+    if (virtTestRun("Stream sparse read blocking ", 1, testFDStreamSparseReadBlock, scratchdir) < 0)
+        ret = -1;
+    if (virtTestRun("Stream sparse read non-blocking ", 1, testFDStreamSparseReadNonblock, scratchdir) < 0)
+        ret = -1;
+    if (virtTestRun("Stream sparse read zero fill ", 1, testFDStreamSparseReadFill, scratchdir) < 0)
+        ret = -1;
+    if (virtTestRun("Stream sparse write blocking ", 1, testFDStreamSparseWriteBlock, scratchdir) < 0)
+        ret = -1;
+    if (virtTestRun("Stream sparse write non-blocking ", 1, testFDStreamSparseWriteNonblock, scratchdir) < 0)
+        ret = -1;
+    if (virtTestRun("Stream sparse benchmark ", 1, testFDStreamSparseBenchmark, scratchdir) < 0)
+        ret = -1;
 
     if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
         virFileDeleteTree(scratchdir);
@@ -7,6 +7,7 @@
 
 #include "internal.h"
 #include "virjson.h"
+#include "virbuffer.h"
 #include "testutils.h"
 
 struct testInfo {
@@ -130,6 +131,311 @@ cleanup:
 }
 
 
+static int
+testJSONLargeObject(const void *data ATTRIBUTE_UNUSED)
+{
+    virJSONValuePtr json;
+    virBuffer expect = VIR_BUFFER_INITIALIZER;
+    char *expectstr = NULL;
+    char *result = NULL;
+    char key[32];
+    size_t i;
+    int ret = -1;
+
+    if (!(json = virJSONValueNewObject()))
+        return -1;
+
+    virBufferAddLit(&expect, "{");
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        if (virJSONValueObjectAppendNumberUlong(json, key, i) < 0)
+            goto cleanup;
+        if (i % 3)
+            virBufferAsprintf(&expect, "%s\"%s\":%zu",
+                              i > 1 ? "," : "", key, i);
+    }
+    virBufferAddLit(&expect, "}");
+    if (!(expectstr = virBufferContentAndReset(&expect)))
+        goto cleanup;
+
+    /* Duplicate keys are rejected */
+    if (virJSONValueObjectAppendNull(json, "key42") == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "%s", "unexpected success adding duplicate key\n");
+        goto cleanup;
+    }
+
+    for (i = 0; i < 100; i += 3) {
+        snprintf(key, sizeof(key), "key%zu", i);
+        if (virJSONValueObjectRemoveKey(json, key, NULL) != 1)
+            goto cleanup;
+    }
+
+    for (i = 0; i < 100; i++) {
+        unsigned long long val;
+        int rc;
+
+        snprintf(key, sizeof(key), "key%zu", i);
+        rc = virJSONValueObjectGetNumberUlong(json, key, &val);
+        if ((i % 3) ? (rc < 0 || val != i) : rc == 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "unexpected lookup result for %s\n", key);
+            goto cleanup;
+        }
+    }
+
+    /* Formatting keeps the insertion order */
+    if (!(result = virJSONValueToString(json, false)))
+        goto cleanup;
+    if (STRNEQ(expectstr, result)) {
+        if (virTestGetVerbose())
+            virtTestDifference(stderr, expectstr, result);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&expect);
+    VIR_FREE(expectstr);
+    VIR_FREE(result);
+    virJSONValueFree(json);
+    return ret;
+}
+
+
+static int
+testJSONScanCollect(size_t field,
+                    const size_t *elems,
+                    size_t nelems,
+                    virJSONValuePtr value,
+                    void *opaque)
+{
+    virBufferPtr buf = opaque;
+    char *str;
+    size_t i;
+
+    virBufferAsprintf(buf, "%zu[", field);
+    for (i = 0; i < nelems; i++)
+        virBufferAsprintf(buf, "%s%zu", i ? "," : "", elems[i]);
+    virBufferAddLit(buf, "]=");
+
+    switch (value->type) {
+    case VIR_JSON_TYPE_STRING:
+        virBufferAsprintf(buf, "'%s' ", value->data.string);
+        break;
+    case VIR_JSON_TYPE_NUMBER:
+        virBufferAsprintf(buf, "%s ", value->data.number);
+        break;
+    default:
+        if (!(str = virJSONValueToString(value, false)))
+            return -1;
+        virBufferAsprintf(buf, "%s ", str);
+        VIR_FREE(str);
+    }
+
+    return 0;
+}
+
+static int
+testJSONScan(const void *data)
+{
+    const struct testInfo *info = data;
+    const char *paths[] = {
+        "return/*/device", "return/*/stats/rd_bytes",
+        "return/1/parent", "id", "return/",
+    };
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *result = NULL;
+    int ret = -1;
+
+    if (virJSONValueScan(info->doc, paths, ARRAY_CARDINALITY(paths),
+                         testJSONScanCollect, &buf) < 0) {
+        if (!info->pass)
+            ret = 0;
+        else if (virTestGetVerbose())
+            fprintf(stderr, "Fail to scan %s\n", info->doc);
+        goto cleanup;
+    }
+
+    if (!info->pass) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "Should not have scanned %s\n", info->doc);
+        goto cleanup;
+    }
+
+    if (!(result = virBufferContentAndReset(&buf)))
+        goto cleanup;
+    if (STRNEQ(info->expect, result)) {
+        if (virTestGetVerbose())
+            virtTestDifference(stderr, info->expect, result);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(result);
+    return ret;
+}
+
+
+/* Reply to query-blockstats for a guest with lots of disks */
+static char *
+testJSONBlockstatsReply(size_t ndisks)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    const char *fields[] = {
+        "rd_bytes", "wr_bytes", "rd_operations", "wr_operations",
+        "flush_operations", "rd_total_time_ns", "wr_total_time_ns",
+        "flush_total_time_ns", "wr_highest_offset", "rd_merged",
+        "wr_merged", "idle_time_ns", "failed_rd_operations",
+        "failed_wr_operations", "invalid_rd_operations",
+        "invalid_wr_operations", "timed_stats", "account_invalid",
+        "account_failed", "unmap_operations",
+    };
+    size_t i, j;
+
+    virBufferAddLit(&buf, "{\"return\": [");
+    for (i = 0; i < ndisks; i++) {
+        virBufferAsprintf(&buf, "%s{\"device\": \"drive-virtio-disk%zu\", "
+                          "\"parent\": {\"stats\": {\"wr_highest_offset\": 0}}, "
+                          "\"stats\": {", i ? ", " : "", i);
+        for (j = 0; j < ARRAY_CARDINALITY(fields); j++)
+            virBufferAsprintf(&buf, "%s\"%s\": %zu",
+                              j ? ", " : "", fields[j], i * 1000 + j);
+        virBufferAddLit(&buf, "}}");
+    }
+    virBufferAddLit(&buf, "], \"id\": \"libvirt-42\"}");
+
+    return virBufferContentAndReset(&buf);
+}
+
+static const char *testBenchKeys[] = {
+    "rd_bytes", "wr_bytes", "rd_operations",
+    "wr_operations", "unmap_operations",
+};
+
+static const char *testBenchPaths[] = {
+    "return/*/stats/rd_bytes", "return/*/stats/wr_bytes",
+    "return/*/stats/rd_operations", "return/*/stats/wr_operations",
+    "return/*/stats/unmap_operations",
+};
+
+struct testBenchData {
+    const char *reply;
+    size_t ndisks;
+    unsigned long long sum;
+};
+
+static int
+testJSONBenchCollect(size_t field ATTRIBUTE_UNUSED,
+                     const size_t *elems ATTRIBUTE_UNUSED,
+                     size_t nelems ATTRIBUTE_UNUSED,
+                     virJSONValuePtr value,
+                     void *opaque)
+{
+    struct testBenchData *data = opaque;
+    unsigned long long val;
+
+    if (virJSONValueGetNumberUlong(value, &val) < 0)
+        return -1;
+    data->sum += val;
+    return 0;
+}
+
+static int
+testJSONBenchTree(size_t idx ATTRIBUTE_UNUSED,
+                  void *opaque)
+{
+    struct testBenchData *data = opaque;
+    virJSONValuePtr json;
+    virJSONValuePtr disks;
+    size_t i, j;
+    int ret = -1;
+
+    if (!(json = virJSONValueFromString(data->reply)))
+        return -1;
+    if (!(disks = virJSONValueObjectGet(json, "return")))
+        goto cleanup;
+
+    for (i = 0; i < data->ndisks; i++) {
+        virJSONValuePtr disk = virJSONValueArrayGet(disks, i);
+        virJSONValuePtr stats;
+
+        if (!disk || !(stats = virJSONValueObjectGet(disk, "stats")))
+            goto cleanup;
+
+        for (j = 0; j < ARRAY_CARDINALITY(testBenchKeys); j++) {
+            unsigned long long val;
+            if (virJSONValueObjectGetNumberUlong(stats, testBenchKeys[j],
+                                                 &val) < 0)
+                goto cleanup;
+            data->sum += val;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    virJSONValueFree(json);
+    return ret;
+}
+
+static int
+testJSONBenchScan(size_t idx ATTRIBUTE_UNUSED,
+                  void *opaque)
+{
+    struct testBenchData *data = opaque;
+
+    return virJSONValueScan(data->reply, testBenchPaths,
+                            ARRAY_CARDINALITY(testBenchPaths),
+                            testJSONBenchCollect, data);
+}
+
+/*
+ * Pull a few stats for every disk out of a large reply, once by
+ * building the tree and looking the keys up, once by scanning for
+ * them. With debug enabled the time taken by each is reported.
+ */
+static int
+testJSONBenchmark(const void *data ATTRIBUTE_UNUSED)
+{
+    size_t ndisks = 64;
+    size_t rounds = virTestGetExpensive() ? 2000 : 20;
+    struct testBenchData tree = { NULL, ndisks, 0 };
+    struct testBenchData scan = { NULL, ndisks, 0 };
+    unsigned long long treetime, scantime;
+    char *reply;
+    int ret = -1;
+
+    if (!(reply = testJSONBlockstatsReply(ndisks)))
+        return -1;
+    tree.reply = scan.reply = reply;
+
+    if (virtTestBenchmark(rounds, testJSONBenchTree, &tree, &treetime) < 0 ||
+        virtTestBenchmark(rounds, testJSONBenchScan, &scan, &scantime) < 0)
+        goto cleanup;
+
+    if (tree.sum != scan.sum) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "tree sum %llu != scan sum %llu\n",
+                    tree.sum, scan.sum);
+        goto cleanup;
+    }
+
+    VIR_TEST_DEBUG("\ntree: %llu ms, scan: %llu ms for %zu replies\n",
+                   treetime, scantime, rounds);
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(reply);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -188,6 +494,24 @@ mymain(void)
     DO_TEST_FULL("add and remove", AddRemove,
                  "[ 1 ]", NULL, false);
 
+    if (virtTestRun("large object", 1, testJSONLargeObject, NULL) < 0)
+        ret = -1;
+
+    DO_TEST_FULL("scan", Scan,
+                 "{\"return\": [{\"device\": \"drive-virtio-disk0\", "
+                 "\"parent\": {\"stats\": {\"wr_highest_offset\": 0}}, "
+                 "\"stats\": {\"rd_bytes\": 5, \"wr_bytes\": 7}}, "
+                 "{\"device\": \"drive-ide0\", \"parent\": {\"x\": [1, 2]}, "
+                 "\"stats\": {\"rd_bytes\": 9}}], \"id\": \"libvirt-11\"}",
+                 "4[]=[] 0[0]='drive-virtio-disk0' 1[0]=5 0[1]='drive-ide0' "
+                 "2[]={\"x\":[1,2]} 1[1]=9 3[]='libvirt-11' ",
+                 true);
+    DO_TEST_FULL("scan", Scan,
+                 "{\"return\": [{\"device\" 1}]}", NULL, false);
+
+    if (virtTestRun("benchmark", 1, testJSONBenchmark, NULL) < 0)
+        ret = -1;
+
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
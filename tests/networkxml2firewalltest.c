@@ -0,0 +1,130 @@
+#include <config.h>
+
+#include "testutils.h"
+
+#ifdef __linux__
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+
+# include "internal.h"
+# include "network_conf.h"
+# include "viralloc.h"
+# include "viriptables.h"
+# include "virstring.h"
+# include "network/bridge_driver_platform.h"
+
+# define VIR_FROM_THIS VIR_FROM_NONE
+
+static int
+testCompareRestoreFile(iptablesTransactionPtr trans,
+                       const char *name,
+                       int family)
+{
+    char *outfile = NULL;
+    char *expected = NULL;
+    char *actual = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&outfile, "%s/networkxml2firewalldata/%s-%s.restore",
+                    abs_srcdir, name,
+                    family == AF_INET6 ? "ipv6" : "ipv4") < 0)
+        goto cleanup;
+
+    if (virtTestLoadFile(outfile, &expected) < 0)
+        goto cleanup;
+
+    if (!(actual = iptablesTransactionFormat(trans, family)))
+        goto cleanup;
+
+    if (STRNEQ(expected, actual)) {
+        virtTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(outfile);
+    VIR_FREE(expected);
+    VIR_FREE(actual);
+    return ret;
+}
+
+static int
+testCompareXMLToFirewallHelper(const void *data)
+{
+    const char *name = data;
+    char *inxml = NULL;
+    char *inXmlData = NULL;
+    virNetworkDefPtr def = NULL;
+    virNetworkObjPtr obj = NULL;
+    iptablesTransactionPtr trans = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&inxml, "%s/networkxml2firewalldata/%s.xml",
+                    abs_srcdir, name) < 0)
+        goto cleanup;
+
+    if (virtTestLoadFile(inxml, &inXmlData) < 0)
+        goto cleanup;
+
+    if (!(def = virNetworkDefParseString(inXmlData)))
+        goto cleanup;
+
+    if (VIR_ALLOC(obj) < 0)
+        goto cleanup;
+    obj->def = def;
+    def = NULL;
+
+    if (!(trans = iptablesTransactionNew(obj->def->name)))
+        goto cleanup;
+
+    if (networkQueueAddFirewallRules(trans, obj) < 0)
+        goto cleanup;
+
+    if (testCompareRestoreFile(trans, name, AF_INET) < 0 ||
+        testCompareRestoreFile(trans, name, AF_INET6) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    iptablesTransactionFree(trans);
+    virNetworkObjFree(obj);
+    virNetworkDefFree(def);
+    VIR_FREE(inXmlData);
+    VIR_FREE(inxml);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+# define DO_TEST(NAME)                                                   \
+    do {                                                                \
+        if (virtTestRun("Network XML-2-firewall " NAME,                 \
+                        1, testCompareXMLToFirewallHelper, NAME) < 0)   \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("isolated-network");
+    DO_TEST("routed-network");
+    DO_TEST("nat-network");
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
+
+#else
+int
+main(void)
+{
+    return EXIT_AM_SKIP;
+}
+#endif
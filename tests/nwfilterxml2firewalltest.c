@@ -0,0 +1,143 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "viralloc.h"
+#include "virbuffer.h"
+#include "virstring.h"
+#include "virxml.h"
+#include "nwfilter_params.h"
+#include "nwfilter_conf.h"
+#include "nwfilter/nwfilter_ebiptables_driverpriv.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define TEST_IFNAME "vnet0"
+
+static int
+testCompareRestoreFile(virNWFilterRuleInstPtr res,
+                       const char *name,
+                       bool isIPv6)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *outfile = NULL;
+    char *expected = NULL;
+    char *actual = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&outfile, "%s/nwfilterxml2firewalldata/%s-%s.restore",
+                    abs_srcdir, name, isIPv6 ? "ipv6" : "ipv4") < 0)
+        goto cleanup;
+
+    if (virtTestLoadFile(outfile, &expected) < 0)
+        goto cleanup;
+
+    if (ebiptablesCreateRestoreBatch(&buf, TEST_IFNAME, res->ndata,
+                                     (ebiptablesRuleInstPtr *)res->data,
+                                     isIPv6) < 0)
+        goto cleanup;
+
+    if (!(actual = virBufferContentAndReset(&buf)))
+        goto cleanup;
+
+    if (STRNEQ(expected, actual)) {
+        virtTestDifference(stderr, expected, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(outfile);
+    VIR_FREE(expected);
+    VIR_FREE(actual);
+    return ret;
+}
+
+static int
+testCompareXMLToFirewallHelper(const void *data)
+{
+    const char *name = data;
+    char *inxml = NULL;
+    char *inXmlData = NULL;
+    virNWFilterDefPtr def = NULL;
+    virNWFilterHashTablePtr vars = NULL;
+    virNWFilterRuleInstPtr res = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (virAsprintf(&inxml, "%s/nwfilterxml2firewalldata/%s.xml",
+                    abs_srcdir, name) < 0)
+        goto cleanup;
+
+    if (virtTestLoadFile(inxml, &inXmlData) < 0)
+        goto cleanup;
+
+    if (!(def = virNWFilterDefParseString(NULL, inXmlData)))
+        goto cleanup;
+
+    if (!(vars = virNWFilterHashTableCreate(0)) ||
+        VIR_ALLOC(res) < 0)
+        goto cleanup;
+
+    for (i = 0; i < def->nentries; i++) {
+        virNWFilterRuleDefPtr rule = def->filterEntries[i]->rule;
+
+        if (!rule)
+            continue;
+
+        if (ebiptables_driver.createRuleInstance(VIR_DOMAIN_NET_TYPE_ETHERNET,
+                                                 def, rule, TEST_IFNAME,
+                                                 vars, res) < 0)
+            goto cleanup;
+    }
+
+    if (testCompareRestoreFile(res, name, false) < 0 ||
+        testCompareRestoreFile(res, name, true) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (res) {
+        for (i = 0; i < res->ndata; i++)
+            ebiptables_driver.freeRuleInstance(res->data[i]);
+        VIR_FREE(res->data);
+        VIR_FREE(res);
+    }
+    virNWFilterHashTableFree(vars);
+    virNWFilterDefFree(def);
+    VIR_FREE(inXmlData);
+    VIR_FREE(inxml);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (ebiptablesDriverInitForTests() < 0)
+        return EXIT_FAILURE;
+
+#define DO_TEST(NAME)                                                   \
+    do {                                                                \
+        if (virtTestRun("NWFilter XML-2-firewall " NAME,                \
+                        1, testCompareXMLToFirewallHelper, NAME) < 0)   \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST("restore-test");
+
+    ebiptables_driver.shutdown();
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "qemu/qemu_conf.h"
+#include "qemu/qemu_domain.h"
+#include "testutils.h"
+#include "testutilsqemu.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+static virQEMUDriver driver;
+
+static virDomainObjPtr
+testDomainObjNew(void)
+{
+    virDomainObjPtr vm;
+    char *path = NULL;
+    char *xml = NULL;
+
+    if (!(vm = virDomainObjNew(driver.xmlopt)))
+        return NULL;
+
+    if (virAsprintf(&path, "%s/qemuxml2argvdata/qemuxml2argv-minimal.xml",
+                    abs_srcdir) < 0 ||
+        virtTestLoadFile(path, &xml) < 0 ||
+        !(vm->def = virDomainDefParseString(xml, driver.caps, driver.xmlopt,
+                                            QEMU_EXPECTED_VIRT_TYPES, 0))) {
+        virObjectUnlock(vm);
+        virObjectUnref(vm);
+        vm = NULL;
+    }
+
+    VIR_FREE(path);
+    VIR_FREE(xml);
+    return vm;
+}
+
+/*
+ * While a domain is being reconnected after a daemon restart, queries
+ * must fail right away instead of waiting for the monitor, and APIs
+ * which can answer from the saved state must be told not to try.
+ * Other jobs, such as the reconnect itself, still go through.
+ */
+static int
+testReconnectFastFail(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv;
+    unsigned long long start, end;
+    virErrorPtr err;
+    int ret = -1;
+
+    if (!(vm = testDomainObjNew()))
+        return -1;
+
+    priv = vm->privateData;
+    priv->reconnecting = true;
+
+    if (qemuDomainJobAllowed(priv, QEMU_JOB_QUERY)) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "query job allowed while reconnecting\n");
+        goto cleanup;
+    }
+
+    if (virTimeMillisNow(&start) < 0)
+        goto cleanup;
+
+    if (qemuDomainObjBeginJob(&driver, vm, QEMU_JOB_QUERY) == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "query job started while reconnecting\n");
+        ignore_value(qemuDomainObjEndJob(&driver, vm));
+        goto cleanup;
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        goto cleanup;
+
+    err = virGetLastError();
+    if (!err || err->code != VIR_ERR_OPERATION_INVALID ||
+        !strstr(err->message, "still being reconnected")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "unexpected error: %s\n",
+                    err ? err->message : "none");
+        goto cleanup;
+    }
+    virResetLastError();
+
+    /* The usual job timeout is 30 seconds */
+    if (end - start > 1000) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "query job failed only after %llu ms\n",
+                    end - start);
+        goto cleanup;
+    }
+
+    if (priv->job.active != QEMU_JOB_NONE || priv->jobs_queued != 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "failed query job left state behind\n");
+        goto cleanup;
+    }
+
+    if (qemuDomainObjBeginJob(&driver, vm, QEMU_JOB_MODIFY) < 0)
+        goto cleanup;
+    if (!qemuDomainObjEndJob(&driver, vm)) {
+        vm = NULL;
+        goto cleanup;
+    }
+
+    /* Once reconnected, queries work again */
+    priv->reconnecting = false;
+
+    if (!qemuDomainJobAllowed(priv, QEMU_JOB_QUERY) ||
+        qemuDomainObjBeginJob(&driver, vm, QEMU_JOB_QUERY) < 0)
+        goto cleanup;
+    if (!qemuDomainObjEndJob(&driver, vm)) {
+        vm = NULL;
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (vm) {
+        virObjectUnlock(vm);
+        virObjectUnref(vm);
+    }
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virThreadInitialize() < 0 ||
+        !(driver.caps = testQemuCapsInit()) ||
+        !(driver.xmlopt = virQEMUDriverCreateXMLConf(&driver)) ||
+        !(driver.config = virQEMUDriverConfigNew(false)))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Reconnect fast fail", 1,
+                    testReconnectFastFail, NULL) < 0)
+        ret = -1;
+
+    virObjectUnref(driver.config);
+    virObjectUnref(driver.caps);
+    virObjectUnref(driver.xmlopt);
+
+    return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -36,6 +36,46 @@ static void printMismatchedFlags(virQEMUCapsPtr got,
     }
 }
 
+/* Capabilities must come back unchanged from the on-disk cache */
+static int testCacheRoundTrip(const char *name,
+                              virQEMUCapsPtr qemuCaps)
+{
+    virQEMUCapsPtr loaded = NULL;
+    char *xml = NULL;
+    char *reformatted = NULL;
+    int ret = -1;
+
+    if (virQEMUCapsAddCPUDefinition(qemuCaps, "qemu64") < 0 ||
+        !(xml = virQEMUCapsFormatCache(qemuCaps, true)))
+        goto cleanup;
+
+    if (!(loaded = virQEMUCapsNew()))
+        goto cleanup;
+    if (virQEMUCapsParseCache(loaded, xml, false) != 0) {
+        fprintf(stderr, "%s: cache from a host with KVM was not rejected\n",
+                name);
+        goto cleanup;
+    }
+    virObjectUnref(loaded);
+
+    if (!(loaded = virQEMUCapsNew()) ||
+        virQEMUCapsParseCache(loaded, xml, true) != 1 ||
+        !(reformatted = virQEMUCapsFormatCache(loaded, true)))
+        goto cleanup;
+
+    if (STRNEQ(xml, reformatted)) {
+        virtTestDifference(stderr, xml, reformatted);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    virObjectUnref(loaded);
+    VIR_FREE(xml);
+    VIR_FREE(reformatted);
+    return ret;
+}
+
 static int testHelpStrParsing(const void *data)
 {
     const struct testInfo *info = data;
@@ -117,6 +157,9 @@ static int testHelpStrParsing(const void *data)
         goto cleanup;
     }
 
+    if (testCacheRoundTrip(info->name, flags) < 0)
+        goto cleanup;
+
     ret = 0;
 cleanup:
     VIR_FREE(path);
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "qemu/qemu_migration.h"
+#include "testutils.h"
+#include "virfile.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define CHUNK_MIN QEMU_MIGRATION_TUNNEL_CHUNK_MIN
+#define CHUNK_MAX QEMU_MIGRATION_TUNNEL_CHUNK_MAX
+
+/* How much of each packet qemu fills, relative to the packet size */
+typedef enum {
+    TEST_FILL_FULL,         /* the whole packet */
+    TEST_FILL_HALF,         /* half of it */
+    TEST_FILL_EIGHTH,       /* an eighth of it */
+    TEST_FILL_NONE,         /* nothing, the read would block */
+} testFill;
+
+struct testChunkData {
+    size_t start;
+    testFill fill;
+    size_t steps;
+    size_t expect;
+};
+
+static size_t
+testChunkFill(size_t chunk, testFill fill)
+{
+    switch (fill) {
+    case TEST_FILL_FULL:
+        return chunk;
+    case TEST_FILL_HALF:
+        return chunk / 2;
+    case TEST_FILL_EIGHTH:
+        return chunk / 8;
+    case TEST_FILL_NONE:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Feed the same kind of reads to the packet sizing a number of times,
+ * checking that the size stays a power of two multiple of the minimum
+ * within the bounds, and where it ends up.
+ */
+static int
+testChunk(const void *opaque)
+{
+    const struct testChunkData *data = opaque;
+    size_t chunk = data->start;
+    size_t i;
+
+    for (i = 0; i < data->steps; i++) {
+        chunk = qemuMigrationTunnelNextChunk(chunk,
+                                             testChunkFill(chunk, data->fill));
+
+        if (chunk < CHUNK_MIN || chunk > CHUNK_MAX ||
+            chunk % CHUNK_MIN || (chunk & (chunk - 1))) {
+            virFilePrintf(stderr, "Step %zu: bad packet size %zu\n",
+                          i, chunk);
+            return -1;
+        }
+    }
+
+    if (chunk != data->expect) {
+        virFilePrintf(stderr, "Ended up at %zu, expected %zu\n",
+                      chunk, data->expect);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+#define DO_TEST(name, start, fill, steps, expect)                         \
+    do {                                                                  \
+        struct testChunkData data = { start, fill, steps, expect };       \
+        if (virtTestRun(name, 1, testChunk, &data) < 0)                   \
+            ret = -1;                                                     \
+    } while (0)
+
+    /* Full packets double the size, one step at a time */
+    DO_TEST("grow one", CHUNK_MIN, TEST_FILL_FULL, 1, 2 * CHUNK_MIN);
+    DO_TEST("grow to max", CHUNK_MIN, TEST_FILL_FULL, 6, CHUNK_MAX);
+    DO_TEST("stay at max", CHUNK_MIN, TEST_FILL_FULL, 100, CHUNK_MAX);
+
+    /* Packets filled well enough keep their size */
+    DO_TEST("steady half", 4 * CHUNK_MIN, TEST_FILL_HALF, 100,
+            4 * CHUNK_MIN);
+
+    /* Mostly empty packets halve it again */
+    DO_TEST("shrink one", CHUNK_MAX, TEST_FILL_EIGHTH, 1, CHUNK_MAX / 2);
+    DO_TEST("shrink to min", CHUNK_MAX, TEST_FILL_EIGHTH, 6, CHUNK_MIN);
+    DO_TEST("stay at min", CHUNK_MAX, TEST_FILL_NONE, 100, CHUNK_MIN);
+    DO_TEST("empty at min", CHUNK_MIN, TEST_FILL_NONE, 1, CHUNK_MIN);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
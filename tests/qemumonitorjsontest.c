@@ -24,6 +24,7 @@
 #include "qemumonitortestutils.h"
 #include "qemu/qemu_conf.h"
 #include "qemu/qemu_monitor_json.h"
+#include "virbuffer.h"
 #include "virthread.h"
 #include "virerror.h"
 #include "virstring.h"
@@ -943,6 +944,226 @@ cleanup:
 }
 
 
+static int
+testQemuMonitorJSONGetAllBlockStatsInfo(const void *data)
+{
+    const virDomainXMLOptionPtr xmlopt = (virDomainXMLOptionPtr)data;
+    qemuMonitorTestPtr test = qemuMonitorTestNewSimple(true, xmlopt);
+    virHashTablePtr blockstats = NULL;
+    qemuBlockStatsPtr stats;
+    int ret = -1;
+
+    if (!test)
+        return -1;
+
+    if (!(blockstats = virHashCreate(10, (virHashDataFree) free)))
+        goto cleanup;
+
+    if (qemuMonitorTestAddItem(test,
+                               "query-blockstats",
+                               "{\"return\": ["
+                               " {\"device\": \"drive-virtio-disk0\","
+                               "  \"stats\": {"
+                               "   \"rd_bytes\": 5256192,"
+                               "   \"rd_operations\": 248,"
+                               "   \"rd_total_time_ns\": 76546360,"
+                               "   \"wr_bytes\": 81920,"
+                               "   \"wr_operations\": 29,"
+                               "   \"wr_total_time_ns\": 1314520,"
+                               "   \"flush_operations\": 12,"
+                               "   \"flush_total_time_ns\": 3045670}},"
+                               " {\"device\": \"drive-ide0-1-0\","
+                               "  \"stats\": {"
+                               "   \"rd_bytes\": 49250,"
+                               "   \"rd_operations\": 16,"
+                               "   \"wr_bytes\": 0,"
+                               "   \"wr_operations\": 0}}"
+                               "]}") < 0)
+        goto cleanup;
+
+    if (qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorTestGetMonitor(test),
+                                            blockstats) < 0)
+        goto cleanup;
+
+    if (virHashSize(blockstats) != 2) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "expected 2 block devices, got %zd",
+                       virHashSize(blockstats));
+        goto cleanup;
+    }
+
+#define CHECK_STAT(dev, field, expected)                                \
+    if (stats->field != expected) {                                     \
+        virReportError(VIR_ERR_INTERNAL_ERROR,                          \
+                       "Invalid %s for '%s': expected %lld, got %lld",  \
+                       #field, dev, (long long) expected, stats->field); \
+        goto cleanup;                                                   \
+    }
+
+    if (!(stats = virHashLookup(blockstats, "virtio-disk0"))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "missing stats for 'virtio-disk0'");
+        goto cleanup;
+    }
+    CHECK_STAT("virtio-disk0", rd_bytes, 5256192);
+    CHECK_STAT("virtio-disk0", rd_req, 248);
+    CHECK_STAT("virtio-disk0", rd_total_times, 76546360);
+    CHECK_STAT("virtio-disk0", wr_bytes, 81920);
+    CHECK_STAT("virtio-disk0", wr_req, 29);
+    CHECK_STAT("virtio-disk0", wr_total_times, 1314520);
+    CHECK_STAT("virtio-disk0", flush_req, 12);
+    CHECK_STAT("virtio-disk0", flush_total_times, 3045670);
+
+    if (!(stats = virHashLookup(blockstats, "ide0-1-0"))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "missing stats for 'ide0-1-0'");
+        goto cleanup;
+    }
+    CHECK_STAT("ide0-1-0", rd_bytes, 49250);
+    CHECK_STAT("ide0-1-0", rd_req, 16);
+    CHECK_STAT("ide0-1-0", rd_total_times, -1);
+    CHECK_STAT("ide0-1-0", wr_bytes, 0);
+    CHECK_STAT("ide0-1-0", wr_req, 0);
+    CHECK_STAT("ide0-1-0", wr_total_times, -1);
+    CHECK_STAT("ide0-1-0", flush_req, -1);
+    CHECK_STAT("ide0-1-0", flush_total_times, -1);
+
+#undef CHECK_STAT
+
+    ret = 0;
+
+cleanup:
+    virHashFree(blockstats);
+    qemuMonitorTestFree(test);
+    return ret;
+}
+
+
+static int
+testQemuMonitorJSONLargeReplyCheck(qemuMonitorPtr mon, void *opaque)
+{
+    size_t *ncpus = opaque;
+    char **cpus = NULL;
+    char last[32];
+    int n;
+    size_t i;
+    int ret = -1;
+
+    if ((n = qemuMonitorGetCPUDefinitions(mon, &cpus)) < 0)
+        return -1;
+
+    snprintf(last, sizeof(last), "cpu%zu", *ncpus - 1);
+    if (n != *ncpus || STRNEQ(cpus[n - 1], last)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       "expected %zu cpus ending with %s, got %d",
+                       *ncpus, last, n);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0; i < n; i++)
+        VIR_FREE(cpus[i]);
+    VIR_FREE(cpus);
+    return ret;
+}
+
+/*
+ * Replies spanning many reads must be split and parsed in time
+ * linear in their size. With debug enabled the monitor
+ * throughput is reported for each reply size.
+ */
+static int
+testQemuMonitorJSONLargeReply(const void *data)
+{
+    virDomainXMLOptionPtr xmlopt = (virDomainXMLOptionPtr)data;
+    size_t sizes[] = { 10, 1000, 20000, 200000 };
+    size_t nsizes = ARRAY_CARDINALITY(sizes);
+    size_t rounds = virTestGetExpensive() ? 10 : 2;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *reply = NULL;
+    size_t i, j;
+    int ret = -1;
+
+    if (!virTestGetExpensive())
+        nsizes--;
+
+    for (i = 0; i < nsizes; i++) {
+        unsigned long long elapsed;
+        size_t len;
+
+        virBufferAddLit(&buf, "{ \"return\": [ ");
+        for (j = 0; j < sizes[i]; j++)
+            virBufferAsprintf(&buf, "%s{ \"name\": \"cpu%zu\" }",
+                              j ? ", " : "", j);
+        virBufferAddLit(&buf, " ] }");
+
+        if (virBufferError(&buf)) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        reply = virBufferContentAndReset(&buf);
+        len = strlen(reply);
+
+        if (qemuMonitorTestBenchmark(xmlopt, "query-cpu-definitions", reply,
+                                     rounds, testQemuMonitorJSONLargeReplyCheck,
+                                     &sizes[i], &elapsed) < 0)
+            goto cleanup;
+
+        VIR_TEST_DEBUG("\n%7zu cpus, %8zu bytes: %llu ms/reply",
+                       sizes[i], len, elapsed / rounds);
+
+        VIR_FREE(reply);
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(reply);
+    return ret;
+}
+
+
+/*
+ * Commands on quiet monitors must keep working while another
+ * monitor is flooded with events, whether all of them share the
+ * event loop or each has its own I/O thread. With debug enabled
+ * the latency seen in either mode is reported.
+ */
+static int
+testQemuMonitorJSONEventFlood(const void *data)
+{
+    virDomainXMLOptionPtr xmlopt = (virDomainXMLOptionPtr)data;
+    size_t nevents = virTestGetExpensive() ? 200000 : 20000;
+    size_t nmons = 4;
+    size_t rounds = 20;
+    size_t i;
+
+    for (i = 0; i < 2; i++) {
+        bool iothread = i == 1;
+        unsigned long long worst;
+        unsigned long long elapsed;
+
+        if (qemuMonitorTestLatency(xmlopt, nmons, nevents, rounds, iothread,
+                                   &worst, &elapsed) < 0)
+            return -1;
+
+        VIR_TEST_DEBUG("\n%-10s %zu monitors, %zu events: "
+                       "%llu ms total, %llu ms worst",
+                       iothread ? "iothread" : "eventloop",
+                       nmons, nevents, elapsed, worst);
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    return 0;
+}
+
+
 static int
 mymain(void)
 {
@@ -977,6 +1198,9 @@ mymain(void)
     DO_TEST(GetObjectProperty);
     DO_TEST(SetObjectProperty);
     DO_TEST(GetDeviceAliases);
+    DO_TEST(GetAllBlockStatsInfo);
+    DO_TEST(LargeReply);
+    DO_TEST(EventFlood);
 
     virObjectUnref(xmlopt);
 
@@ -25,6 +25,7 @@
 #include <time.h>
 
 #include "qemumonitortestutils.h"
+#include "testutils.h"
 
 #include "virthread.h"
 #include "qemu/qemu_processpriv.h"
@@ -35,6 +36,7 @@
 #include "virlog.h"
 #include "virerror.h"
 #include "virstring.h"
+#include "virtime.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -809,8 +811,14 @@ error:
 }
 
 
+/*
+ * Only one thread may run the event loop, so when several
+ * monitors are used at once @worker must be set for just one
+ * of them, and that one freed last
+ */
 static int
-qemuMonitorCommonTestInit(qemuMonitorTestPtr test)
+qemuMonitorCommonTestInit(qemuMonitorTestPtr test,
+                          bool worker)
 {
     int events = VIR_EVENT_HANDLE_READABLE;
 
@@ -833,6 +841,9 @@ qemuMonitorCommonTestInit(qemuMonitorTestPtr test)
                                   NULL) < 0)
         goto error;
 
+    if (!worker)
+        return 0;
+
     virMutexLock(&test->lock);
     if (virThreadCreate(&test->thread,
                         true,
@@ -868,11 +879,13 @@ error:
 
 #define QEMU_TEXT_GREETING "QEMU 1.0,1 monitor - type 'help' for more information"
 
-qemuMonitorTestPtr
-qemuMonitorTestNew(bool json,
-                   virDomainXMLOptionPtr xmlopt,
-                   virDomainObjPtr vm,
-                   virQEMUDriverPtr driver)
+static qemuMonitorTestPtr
+qemuMonitorTestNewFull(bool json,
+                       virDomainXMLOptionPtr xmlopt,
+                       virDomainObjPtr vm,
+                       virQEMUDriverPtr driver,
+                       bool iothread,
+                       bool worker)
 {
     qemuMonitorTestPtr test = NULL;
     virDomainChrSourceDef src;
@@ -884,6 +897,7 @@ qemuMonitorTestNew(bool json,
     if (!(test->mon = qemuMonitorOpen(test->vm,
                                       &src,
                                       json,
+                                      iothread,
                                       &qemuMonitorTestCallbacks,
                                       driver)))
         goto error;
@@ -895,7 +909,7 @@ qemuMonitorTestNew(bool json,
                                   QEMU_TEXT_GREETING) < 0)
         goto error;
 
-    if (qemuMonitorCommonTestInit(test) < 0)
+    if (qemuMonitorCommonTestInit(test, worker) < 0)
         goto error;
 
     virDomainChrSourceDefClear(&src);
@@ -908,6 +922,15 @@ error:
     return NULL;
 }
 
+qemuMonitorTestPtr
+qemuMonitorTestNew(bool json,
+                   virDomainXMLOptionPtr xmlopt,
+                   virDomainObjPtr vm,
+                   virQEMUDriverPtr driver)
+{
+    return qemuMonitorTestNewFull(json, xmlopt, vm, driver, false, true);
+}
+
 qemuMonitorTestPtr
 qemuMonitorTestNewAgent(virDomainXMLOptionPtr xmlopt)
 {
@@ -919,12 +942,13 @@ qemuMonitorTestNewAgent(virDomainXMLOptionPtr xmlopt)
 
     if (!(test->agent = qemuAgentOpen(test->vm,
                                       &src,
+                                      false,
                                       &qemuMonitorTestAgentCallbacks)))
         goto error;
 
     virObjectLock(test->agent);
 
-    if (qemuMonitorCommonTestInit(test) < 0)
+    if (qemuMonitorCommonTestInit(test, true) < 0)
         goto error;
 
     virDomainChrSourceDefClear(&src);
@@ -950,3 +974,182 @@ qemuMonitorTestGetAgent(qemuMonitorTestPtr test)
 {
     return test->agent;
 }
+
+
+struct qemuMonitorTestBenchData {
+    qemuMonitorTestPtr test;
+    const char *command_name;
+    const char *reply;
+    qemuMonitorTestBenchCallback cb;
+    void *opaque;
+};
+
+static int
+qemuMonitorTestBenchRun(size_t idx ATTRIBUTE_UNUSED,
+                        void *opaque)
+{
+    struct qemuMonitorTestBenchData *data = opaque;
+
+    if (qemuMonitorTestAddItem(data->test, data->command_name,
+                               data->reply) < 0)
+        return -1;
+
+    return data->cb(qemuMonitorTestGetMonitor(data->test), data->opaque);
+}
+
+/*
+ * Time @rounds runs of @cb against a JSON monitor which answers
+ * each with @reply to @command_name. This is meant for replies
+ * large enough to arrive in many reads, the time taken in
+ * milliseconds is stored in @elapsed.
+ *
+ * Returns -1 if the monitor or @cb fails, 0 otherwise
+ */
+int
+qemuMonitorTestBenchmark(virDomainXMLOptionPtr xmlopt,
+                         const char *command_name,
+                         const char *reply,
+                         size_t rounds,
+                         qemuMonitorTestBenchCallback cb,
+                         void *opaque,
+                         unsigned long long *elapsed)
+{
+    struct qemuMonitorTestBenchData data = {
+        NULL, command_name, reply, cb, opaque
+    };
+    int ret;
+
+    if (!(data.test = qemuMonitorTestNewSimple(true, xmlopt)))
+        return -1;
+
+    ret = virtTestBenchmark(rounds, qemuMonitorTestBenchRun, &data, elapsed);
+
+    qemuMonitorTestFree(data.test);
+    return ret;
+}
+
+
+/*
+ * Queue @count copies of @event to be sent unprompted
+ */
+static int
+qemuMonitorTestQueueEvents(qemuMonitorTestPtr test,
+                           const char *event,
+                           size_t count)
+{
+    size_t i;
+    int ret = -1;
+
+    virMutexLock(&test->lock);
+    for (i = 0; i < count; i++) {
+        if (qemuMonitorTestAddReponse(test, event) < 0)
+            goto cleanup;
+    }
+
+    if (test->client)
+        virNetSocketUpdateIOCallback(test->client,
+                                     VIR_EVENT_HANDLE_READABLE |
+                                     VIR_EVENT_HANDLE_WRITABLE);
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&test->lock);
+    return ret;
+}
+
+
+#define QEMU_MONITOR_TEST_FLOOD_EVENT \
+    "{\"timestamp\": {\"seconds\": 1374137171, \"microseconds\": 2659}," \
+    " \"event\": \"RTC_CHANGE\", \"data\": {\"offset\": 78}}"
+
+#define QEMU_MONITOR_TEST_STATUS_REPLY \
+    "{\"return\": {\"status\": \"running\", \"singlestep\": false," \
+    " \"running\": true}}"
+
+/*
+ * Run @rounds of query-status on each of @nmons - 1 JSON monitors
+ * while one more monitor is flooded with @nevents events, as a
+ * guest stuck in a loop of RTC changes would. All monitors are
+ * serviced by the one event loop unless @iothread is set, in which
+ * case each gets its own thread. The slowest single command and
+ * the time taken overall, both in milliseconds, are stored in
+ * @worst and @elapsed.
+ *
+ * Returns -1 if any monitor fails, 0 otherwise
+ */
+int
+qemuMonitorTestLatency(virDomainXMLOptionPtr xmlopt,
+                       size_t nmons,
+                       size_t nevents,
+                       size_t rounds,
+                       bool iothread,
+                       unsigned long long *worst,
+                       unsigned long long *elapsed)
+{
+    qemuMonitorTestPtr *tests = NULL;
+    unsigned long long first, start, end;
+    size_t i, j;
+    int ret = -1;
+
+    if (nmons < 2) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       "At least two monitors are needed");
+        return -1;
+    }
+
+    if (VIR_ALLOC_N(tests, nmons) < 0)
+        return -1;
+
+    /* The first monitor runs the event loop for all of them */
+    for (i = 0; i < nmons; i++) {
+        if (!(tests[i] = qemuMonitorTestNewFull(true, xmlopt, NULL, NULL,
+                                                iothread, i == 0)))
+            goto cleanup;
+    }
+
+    if (qemuMonitorTestQueueEvents(tests[0], QEMU_MONITOR_TEST_FLOOD_EVENT,
+                                   nevents) < 0)
+        goto cleanup;
+
+    *worst = 0;
+    if (virTimeMillisNow(&first) < 0)
+        goto cleanup;
+
+    for (i = 0; i < rounds; i++) {
+        for (j = 1; j < nmons; j++) {
+            bool running;
+            virDomainPausedReason reason;
+
+            if (virTimeMillisNow(&start) < 0 ||
+                qemuMonitorTestAddItem(tests[j], "query-status",
+                                       QEMU_MONITOR_TEST_STATUS_REPLY) < 0 ||
+                qemuMonitorGetStatus(qemuMonitorTestGetMonitor(tests[j]),
+                                     &running, &reason) < 0 ||
+                virTimeMillisNow(&end) < 0)
+                goto cleanup;
+
+            if (!running) {
+                virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               "Unexpected status reply");
+                goto cleanup;
+            }
+
+            if (end - start > *worst)
+                *worst = end - start;
+        }
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        goto cleanup;
+
+    *elapsed = end - first;
+    ret = 0;
+
+cleanup:
+    if (tests) {
+        for (i = nmons; i > 0; i--)
+            qemuMonitorTestFree(tests[i - 1]);
+    }
+    VIR_FREE(tests);
+    return ret;
+}
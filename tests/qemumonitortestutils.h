@@ -76,4 +76,23 @@ void qemuMonitorTestFree(qemuMonitorTestPtr test);
 qemuMonitorPtr qemuMonitorTestGetMonitor(qemuMonitorTestPtr test);
 qemuAgentPtr qemuMonitorTestGetAgent(qemuMonitorTestPtr test);
 
+typedef int (*qemuMonitorTestBenchCallback)(qemuMonitorPtr mon,
+                                            void *opaque);
+
+int qemuMonitorTestBenchmark(virDomainXMLOptionPtr xmlopt,
+                             const char *command_name,
+                             const char *reply,
+                             size_t rounds,
+                             qemuMonitorTestBenchCallback cb,
+                             void *opaque,
+                             unsigned long long *elapsed);
+
+int qemuMonitorTestLatency(virDomainXMLOptionPtr xmlopt,
+                           size_t nmons,
+                           size_t nevents,
+                           size_t rounds,
+                           bool iothread,
+                           unsigned long long *worst,
+                           unsigned long long *elapsed);
+
 #endif /* __VIR_QEMU_MONITOR_TEST_UTILS_H__ */
@@ -102,6 +102,164 @@ cleanup:
 }
 
 
+struct testBenchData {
+    const char *xml;
+    virDomainDefPtr def;
+};
+
+static virDomainDefPtr
+testBenchParseXML(const char *xml)
+{
+    return virDomainDefParseString(xml, driver.caps, driver.xmlopt,
+                                   QEMU_EXPECTED_VIRT_TYPES,
+                                   VIR_DOMAIN_XML_INACTIVE);
+}
+
+static char *
+testBenchFormatXML(virDomainDefPtr def)
+{
+    return virDomainDefFormat(def, VIR_DOMAIN_XML_SECURE |
+                              VIR_DOMAIN_XML_INACTIVE);
+}
+
+static int
+testBenchParse(size_t idx ATTRIBUTE_UNUSED,
+               void *opaque)
+{
+    struct testBenchData *data = opaque;
+    virDomainDefPtr def;
+
+    if (!(def = testBenchParseXML(data->xml)))
+        return -1;
+    virDomainDefFree(def);
+    return 0;
+}
+
+static int
+testBenchFormat(size_t idx ATTRIBUTE_UNUSED,
+                void *opaque)
+{
+    struct testBenchData *data = opaque;
+    char *xml;
+
+    if (!(xml = testBenchFormatXML(data->def)))
+        return -1;
+    VIR_FREE(xml);
+    return 0;
+}
+
+/*
+ * Parse and format a guest with many disks and NICs. The output
+ * must survive a second round trip unchanged. With debug enabled
+ * the time taken per round trip is reported, which should grow
+ * linearly with the number of devices.
+ */
+static int
+testCompareXMLToXMLBenchmark(const void *data ATTRIBUTE_UNUSED)
+{
+    size_t sizes[] = { 16, 256, 2048 };
+    size_t nsizes = ARRAY_CARDINALITY(sizes);
+    size_t rounds = virTestGetExpensive() ? 20 : 2;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virDomainDefPtr def = NULL;
+    char *inXmlData = NULL;
+    char *first = NULL;
+    char *actual = NULL;
+    size_t i, j;
+    int ret = -1;
+
+    if (!virTestGetExpensive())
+        nsizes--;
+
+    for (i = 0; i < nsizes; i++) {
+        struct testBenchData bench;
+        unsigned long long parsed, formatted;
+
+        virBufferAddLit(&buf,
+                        "<domain type='qemu'>\n"
+                        "  <name>QEMUGuest1</name>\n"
+                        "  <uuid>c7a5fdbd-edaf-9455-926a-d65c16db1809</uuid>\n"
+                        "  <memory unit='KiB'>219136</memory>\n"
+                        "  <vcpu placement='static'>1</vcpu>\n"
+                        "  <os>\n"
+                        "    <type arch='i686' machine='pc'>hvm</type>\n"
+                        "  </os>\n"
+                        "  <devices>\n"
+                        "    <emulator>/usr/bin/qemu</emulator>\n");
+        for (j = 0; j < sizes[i]; j++) {
+            char *dst;
+
+            if (!(dst = virIndexToDiskName(j, "vd")))
+                goto cleanup;
+            virBufferAsprintf(&buf,
+                              "    <disk type='file' device='disk'>\n"
+                              "      <driver name='qemu' type='qcow2'/>\n"
+                              "      <source file='/var/lib/libvirt/images/disk%zu.qcow2'/>\n"
+                              "      <target dev='%s' bus='virtio'/>\n"
+                              "    </disk>\n", j, dst);
+            VIR_FREE(dst);
+        }
+        for (j = 0; j < sizes[i]; j++)
+            virBufferAsprintf(&buf,
+                              "    <interface type='network'>\n"
+                              "      <mac address='52:54:00:00:%02zx:%02zx'/>\n"
+                              "      <source network='default'/>\n"
+                              "      <model type='virtio'/>\n"
+                              "    </interface>\n", j / 256, j % 256);
+        virBufferAddLit(&buf,
+                        "  </devices>\n"
+                        "</domain>\n");
+
+        if (virBufferError(&buf)) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        inXmlData = virBufferContentAndReset(&buf);
+
+        if (!(def = testBenchParseXML(inXmlData)) ||
+            !(first = testBenchFormatXML(def)))
+            goto cleanup;
+        virDomainDefFree(def);
+        def = NULL;
+
+        if (!(def = testBenchParseXML(first)) ||
+            !(actual = testBenchFormatXML(def)))
+            goto cleanup;
+        if (STRNEQ(first, actual)) {
+            virtTestDifference(stderr, first, actual);
+            goto cleanup;
+        }
+        VIR_FREE(actual);
+
+        bench.xml = first;
+        bench.def = def;
+        if (virtTestBenchmark(rounds, testBenchParse, &bench, &parsed) < 0 ||
+            virtTestBenchmark(rounds, testBenchFormat, &bench, &formatted) < 0)
+            goto cleanup;
+
+        VIR_TEST_DEBUG("\n%5zu disks+nics: parse %llu ms, format %llu ms",
+                       sizes[i], parsed / rounds, formatted / rounds);
+
+        virDomainDefFree(def);
+        def = NULL;
+        VIR_FREE(inXmlData);
+        VIR_FREE(first);
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    virDomainDefFree(def);
+    VIR_FREE(inXmlData);
+    VIR_FREE(first);
+    VIR_FREE(actual);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -316,6 +474,10 @@ mymain(void)
     DO_TEST("pcihole64-none");
     DO_TEST("pcihole64-q35");
 
+    if (virtTestRun("QEMU XML-2-XML benchmark", 1,
+                    testCompareXMLToXMLBenchmark, NULL) < 0)
+        ret = -1;
+
     virObjectUnref(driver.caps);
     virObjectUnref(driver.xmlopt);
 
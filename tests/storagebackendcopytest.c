@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "storage/storage_backend.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virstring.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define INPUT_LEN (4 * 1024 * 1024)
+
+struct testCopyData {
+    const char *scratchdir;
+    const char *name;
+    unsigned long long capacity;
+    unsigned long long allocation;
+};
+
+/* Data extents of the input, everything else is a hole. The second
+ * one deliberately does not end on a block boundary. */
+static const struct {
+    off_t offset;
+    size_t len;
+} testExtents[] = {
+    { 0, 64 * 1024 },
+    { 1024 * 1024, 4096 + 13 },
+    { INPUT_LEN - 100, 100 },
+};
+
+static char *
+testInputContent(void)
+{
+    char *buf;
+    size_t i, j;
+
+    if (VIR_ALLOC_N(buf, INPUT_LEN) < 0)
+        return NULL;
+
+    for (i = 0; i < ARRAY_CARDINALITY(testExtents); i++) {
+        for (j = 0; j < testExtents[i].len; j++)
+            buf[testExtents[i].offset + j] = (i + j) % 255 + 1;
+    }
+
+    return buf;
+}
+
+static int
+testInputCreate(const char *path, const char *content)
+{
+    int fd;
+    size_t i;
+
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0)
+        return -1;
+
+    if (ftruncate(fd, INPUT_LEN) < 0)
+        goto error;
+
+    for (i = 0; i < ARRAY_CARDINALITY(testExtents); i++) {
+        if (lseek(fd, testExtents[i].offset, SEEK_SET) < 0 ||
+            safewrite(fd, content + testExtents[i].offset,
+                      testExtents[i].len) < 0)
+            goto error;
+    }
+
+    return VIR_CLOSE(fd);
+
+error:
+    VIR_FORCE_CLOSE(fd);
+    return -1;
+}
+
+static virStorageVolDefPtr
+testVolNew(const char *scratchdir,
+           const char *name,
+           unsigned long long capacity,
+           unsigned long long allocation)
+{
+    virStorageVolDefPtr vol;
+
+    if (VIR_ALLOC(vol) < 0)
+        return NULL;
+
+    vol->type = VIR_STORAGE_VOL_FILE;
+    vol->capacity = capacity;
+    vol->allocation = allocation;
+    vol->target.format = VIR_STORAGE_FILE_RAW;
+    vol->target.perms.mode = 0600;
+    vol->target.perms.uid = getuid();
+    vol->target.perms.gid = getgid();
+
+    if (VIR_STRDUP(vol->name, name) < 0 ||
+        virAsprintf(&vol->target.path, "%s/%s", scratchdir, name) < 0) {
+        virStorageVolDefFree(vol);
+        return NULL;
+    }
+
+    return vol;
+}
+
+/*
+ * Clone a sparse raw file and check that the copy reads back the same,
+ * that any extra capacity reads as zeroes and that the holes of the
+ * input did not get filled in on the way.
+ */
+static int
+testCopySparse(const void *opaque)
+{
+    const struct testCopyData *data = opaque;
+    virStoragePoolDef pooldef = { .type = VIR_STORAGE_POOL_DIR };
+    virStoragePoolObj pool = { .def = &pooldef };
+    virStorageVolDefPtr inputvol = NULL;
+    virStorageVolDefPtr vol = NULL;
+    char *expected = NULL;
+    char *actual = NULL;
+    struct stat inputst;
+    struct stat st;
+    size_t len;
+    size_t i;
+    int ret = -1;
+
+    if (!(expected = testInputContent()))
+        goto cleanup;
+
+    if (!(inputvol = testVolNew(data->scratchdir, "input.img",
+                                INPUT_LEN, INPUT_LEN)) ||
+        !(vol = testVolNew(data->scratchdir, data->name,
+                           data->capacity, data->allocation)))
+        goto cleanup;
+
+    if (testInputCreate(inputvol->target.path, expected) < 0) {
+        virFilePrintf(stderr, "Cannot create %s\n", inputvol->target.path);
+        goto cleanup;
+    }
+
+    if (virStorageBackendCreateRaw(NULL, &pool, vol, inputvol, 0) < 0) {
+        virFilePrintf(stderr, "Cannot clone into %s: %s\n",
+                      vol->target.path, virGetLastErrorMessage());
+        goto cleanup;
+    }
+
+    if (stat(inputvol->target.path, &inputst) < 0 ||
+        stat(vol->target.path, &st) < 0)
+        goto cleanup;
+
+    if (st.st_size != data->capacity) {
+        virFilePrintf(stderr, "Expected %llu bytes, got %llu\n",
+                      data->capacity, (unsigned long long) st.st_size);
+        goto cleanup;
+    }
+
+    if (virFileReadAll(vol->target.path, data->capacity + 1, &actual) < 0)
+        goto cleanup;
+
+    /* Only as much input as was allocated gets copied */
+    len = MIN(data->allocation, INPUT_LEN);
+    if (memcmp(actual, expected, len) != 0) {
+        virFilePrintf(stderr, "Cloned data differs from the input\n");
+        goto cleanup;
+    }
+    for (i = len; i < data->capacity; i++) {
+        if (actual[i] != 0) {
+            virFilePrintf(stderr, "Unexpected data at offset %zu\n", i);
+            goto cleanup;
+        }
+    }
+
+    /* If the scratch filesystem kept the input sparse, the copy must
+     * not use up much more space than the input did */
+    if (inputst.st_blocks * 512 < INPUT_LEN &&
+        st.st_blocks > inputst.st_blocks + 128) {
+        virFilePrintf(stderr, "Holes were filled in: %llu blocks, "
+                      "input has %llu\n",
+                      (unsigned long long) st.st_blocks,
+                      (unsigned long long) inputst.st_blocks);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    if (inputvol)
+        unlink(inputvol->target.path);
+    if (vol)
+        unlink(vol->target.path);
+    virStorageVolDefFree(inputvol);
+    virStorageVolDefFree(vol);
+    VIR_FREE(expected);
+    VIR_FREE(actual);
+    return ret;
+}
+
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/storagebackendcopydata-XXXXXX"
+
+static int
+mymain(void)
+{
+    char scratchdir[] = SCRATCHDIRTEMPLATE;
+    int ret = 0;
+
+    if (!mkdtemp(scratchdir)) {
+        virFilePrintf(stderr, "Cannot create scratch dir\n");
+        return EXIT_FAILURE;
+    }
+
+#define DO_TEST(name, capacity, allocation)                              \
+    do {                                                                  \
+        struct testCopyData data = {                                      \
+            scratchdir, name, capacity, allocation                        \
+        };                                                                \
+        if (virtTestRun("Copy " name, 1, testCopySparse, &data) < 0)      \
+            ret = -1;                                                     \
+    } while (0)
+
+    /* Whole input, which may be cloned by sharing extents */
+    DO_TEST("whole.img", INPUT_LEN, INPUT_LEN);
+    /* Bigger than the input, the tail must read back as zeroes */
+    DO_TEST("larger.img", 2 * INPUT_LEN, INPUT_LEN);
+    /* Only part of the input, which rules out cloning */
+    DO_TEST("partial.img", INPUT_LEN, 1024 * 1024 + 2048);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "storage/storage_backend.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virstring.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+/* Marks volume objects which were kept across a refresh, since they
+ * would otherwise have been probed again and got their file size */
+#define SENTINEL_CAPACITY 42
+
+typedef enum {
+    TEST_REFRESH_PLAIN,     /* change some files between two refreshes */
+    TEST_REFRESH_SWAP,      /* replace the whole pool directory */
+    TEST_REFRESH_STOP,      /* stop the pool in between */
+} testRefreshMode;
+
+struct testRefreshData {
+    const char *scratchdir;
+    const char *name;
+    int type;
+    testRefreshMode mode;
+    unsigned long long keepCapacity;
+};
+
+static int
+testCreateFile(const char *dir, const char *name, off_t size)
+{
+    char *path = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0)
+        goto cleanup;
+
+    if ((fd = open(path, O_CREAT | O_WRONLY, 0600)) < 0 ||
+        ftruncate(fd, size) < 0 ||
+        VIR_CLOSE(fd) < 0) {
+        virFilePrintf(stderr, "Cannot create %s\n", path);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(path);
+    return ret;
+}
+
+static int
+testRemoveFile(const char *dir, const char *name)
+{
+    char *path = NULL;
+    int ret;
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0)
+        return -1;
+
+    if ((ret = unlink(path)) < 0)
+        virFilePrintf(stderr, "Cannot remove %s\n", path);
+
+    VIR_FREE(path);
+    return ret;
+}
+
+/* Check that the pool lists exactly the volumes given, with the given
+ * capacity, a NULL terminated list of name and capacity pairs */
+static int
+testCheckVols(virStoragePoolObjPtr pool,
+              const char *step,
+              ...)
+{
+    va_list args;
+    const char *name;
+    size_t count = 0;
+    int ret = 0;
+
+    va_start(args, step);
+    while ((name = va_arg(args, const char *))) {
+        unsigned long long capacity = va_arg(args, unsigned long long);
+        virStorageVolDefPtr vol;
+
+        count++;
+        if (!(vol = virStorageVolDefFindByName(pool, name))) {
+            virFilePrintf(stderr, "%s: volume %s is missing\n", step, name);
+            ret = -1;
+        } else if (vol->capacity != capacity) {
+            virFilePrintf(stderr, "%s: volume %s has capacity %llu, "
+                          "expected %llu\n", step, name,
+                          vol->capacity, capacity);
+            ret = -1;
+        }
+    }
+    va_end(args);
+
+    if (pool->volumes.count != count) {
+        virFilePrintf(stderr, "%s: %zu volumes listed, expected %zu\n",
+                      step, pool->volumes.count, count);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Refresh a pool, then add, modify and remove files and refresh it
+ * again. Only the entries which changed may be probed again, unless
+ * the pool lost track of the directory, in which case everything has
+ * to be looked at again.
+ */
+static int
+testRefresh(const void *opaque)
+{
+    const struct testRefreshData *data = opaque;
+    virStoragePoolDef def = { .type = data->type };
+    virStoragePoolObj pool = { .def = &def };
+    virStorageBackendPtr backend;
+    char *dir = NULL;
+    char *olddir = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (!(backend = virStorageBackendForType(data->type)))
+        goto cleanup;
+
+    if (virAsprintf(&dir, "%s/%s", data->scratchdir, data->name) < 0 ||
+        virAsprintf(&olddir, "%s.old", dir) < 0)
+        goto cleanup;
+    def.name = (char *) data->name;
+    def.target.path = dir;
+
+    if (mkdir(dir, 0700) < 0 ||
+        testCreateFile(dir, "keep.img", 1024) < 0 ||
+        testCreateFile(dir, "modify.img", 1024) < 0 ||
+        testCreateFile(dir, "remove.img", 1024) < 0)
+        goto cleanup;
+
+    if (backend->refreshPool(NULL, &pool) < 0)
+        goto cleanup;
+
+    if (testCheckVols(&pool, "first refresh",
+                      "keep.img", 1024ULL,
+                      "modify.img", 1024ULL,
+                      "remove.img", 1024ULL,
+                      NULL) < 0)
+        goto cleanup;
+
+    for (i = 0; i < pool.volumes.count; i++)
+        pool.volumes.objs[i]->capacity = SENTINEL_CAPACITY;
+
+    switch (data->mode) {
+    case TEST_REFRESH_PLAIN:
+        break;
+
+    case TEST_REFRESH_SWAP:
+        /* A directory the pool never saw, behind the same path */
+        if (rename(dir, olddir) < 0 ||
+            mkdir(dir, 0700) < 0 ||
+            testCreateFile(dir, "keep.img", data->keepCapacity) < 0 ||
+            testCreateFile(dir, "modify.img", 1024) < 0)
+            goto cleanup;
+        break;
+
+    case TEST_REFRESH_STOP:
+        if (backend->stopPool(NULL, &pool) < 0)
+            goto cleanup;
+        break;
+    }
+
+    if (testCreateFile(dir, "modify.img", 4096) < 0 ||
+        testCreateFile(dir, "add.img", 2048) < 0 ||
+        (data->mode != TEST_REFRESH_SWAP &&
+         testRemoveFile(dir, "remove.img") < 0))
+        goto cleanup;
+
+    if (backend->refreshPool(NULL, &pool) < 0)
+        goto cleanup;
+
+    if (testCheckVols(&pool, "second refresh",
+                      "keep.img", data->keepCapacity,
+                      "modify.img", 4096ULL,
+                      "add.img", 2048ULL,
+                      NULL) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjClearVols(&pool);
+    if (pool.privateDataFreeFunc)
+        (pool.privateDataFreeFunc)(pool.privateData);
+    if (dir)
+        virFileDeleteTree(dir);
+    if (olddir)
+        virFileDeleteTree(olddir);
+    VIR_FREE(dir);
+    VIR_FREE(olddir);
+    return ret;
+}
+
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/storagebackendfsdata-XXXXXX"
+
+static int
+mymain(void)
+{
+    char scratchdir[] = SCRATCHDIRTEMPLATE;
+    int ret = 0;
+
+    if (!mkdtemp(scratchdir)) {
+        virFilePrintf(stderr, "Cannot create scratch dir\n");
+        return EXIT_FAILURE;
+    }
+
+#define DO_TEST(name, type, mode, keepCapacity)                           \
+    do {                                                                  \
+        struct testRefreshData data = {                                   \
+            scratchdir, name, type, mode, keepCapacity                    \
+        };                                                                \
+        if (virtTestRun("Refresh " name, 1, testRefresh, &data) < 0)      \
+            ret = -1;                                                     \
+    } while (0)
+
+    /* Unchanged volumes are kept as they are */
+    DO_TEST("dir", VIR_STORAGE_POOL_DIR,
+            TEST_REFRESH_PLAIN, SENTINEL_CAPACITY);
+#if WITH_STORAGE_FS
+    /* Without a directory watch, by comparing stat data */
+    DO_TEST("netfs", VIR_STORAGE_POOL_NETFS,
+            TEST_REFRESH_PLAIN, SENTINEL_CAPACITY);
+#endif
+    /* The watch is lost, all entries must be looked at again */
+    DO_TEST("swap", VIR_STORAGE_POOL_DIR,
+            TEST_REFRESH_SWAP, 512);
+    /* Stopping the pool drops the state, everything is probed */
+    DO_TEST("stop", VIR_STORAGE_POOL_DIR,
+            TEST_REFRESH_STOP, 1024);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
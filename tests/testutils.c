@@ -46,6 +46,7 @@
 #include "dirname.h"
 #include "virprocess.h"
 #include "virstring.h"
+#include "virtime.h"
 
 #if TEST_OOM_TRACE
 # include <execinfo.h>
@@ -212,6 +213,37 @@ virtTestRun(const char *title, int nloops, int (*body)(const void *data), const
     return ret;
 }
 
+/*
+ * Call @body @rounds times, passing it the index of the round and @opaque,
+ * and store the time taken by all of them in milliseconds in @elapsed.
+ * Benchmarks use this and report the result with VIR_TEST_DEBUG.
+ *
+ * returns: -1 if the clock or @body fails, 0 otherwise
+ */
+int
+virtTestBenchmark(size_t rounds,
+                  int (*body)(size_t idx, void *opaque),
+                  void *opaque,
+                  unsigned long long *elapsed)
+{
+    unsigned long long start, end;
+    size_t i;
+
+    if (virTimeMillisNow(&start) < 0)
+        return -1;
+
+    for (i = 0; i < rounds; i++) {
+        if (body(i, opaque) < 0)
+            return -1;
+    }
+
+    if (virTimeMillisNow(&end) < 0)
+        return -1;
+
+    *elapsed = end - start;
+    return 0;
+}
+
 /* Allocate BUF to the size of FILE. Read FILE into buffer BUF.
    Upon any failure, diagnose it and return -1, but don't bother trying
    to preserve errno. Otherwise, return the number of bytes copied into BUF. */
@@ -49,6 +49,10 @@ int virtTestRun(const char *title,
                 int nloops,
                 int (*body)(const void *data),
                 const void *data);
+int virtTestBenchmark(size_t rounds,
+                      int (*body)(size_t idx, void *opaque),
+                      void *opaque,
+                      unsigned long long *elapsed);
 int virtTestLoadFile(const char *file, char **buf);
 int virtTestCaptureProgramOutput(const char *const argv[], char **buf, int maxlen);
 
@@ -67,6 +71,13 @@ unsigned int virTestGetDebug(void);
 unsigned int virTestGetVerbose(void);
 unsigned int virTestGetExpensive(void);
 
+/* Print to stderr, but only if VIR_TEST_DEBUG is set */
+# define VIR_TEST_DEBUG(...)                    \
+    do {                                        \
+        if (virTestGetDebug())                  \
+            fprintf(stderr, __VA_ARGS__);       \
+    } while (0)
+
 char *virtTestLogContentAndReset(void);
 
 int virtTestMain(int argc,
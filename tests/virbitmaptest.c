@@ -497,6 +497,229 @@ cleanup:
 
 }
 
+/* test bulk operations between bitmaps */
+static int
+test10(const void *opaque ATTRIBUTE_UNUSED)
+{
+    int ret = -1;
+    virBitmapPtr b1 = NULL, b2 = NULL, b3 = NULL;
+    char *str = NULL;
+
+    if (virBitmapParse("0-3,60-70,130-200", 0, &b1, 300) < 0 ||
+        virBitmapParse("2-65,180-190", 0, &b2, 200) < 0 ||
+        virBitmapParse("1,290", 0, &b3, 300) < 0)
+        goto cleanup;
+
+    if (!virBitmapOverlaps(b1, b2) || virBitmapOverlaps(b2, b3))
+        goto cleanup;
+
+    if (virBitmapIsSubset(b1, b2) || virBitmapIsSubset(b3, b2))
+        goto cleanup;
+
+    /* b2 is smaller, b3 has a bit past its end */
+    if (virBitmapUnion(b2, b3) == 0)
+        goto cleanup;
+    if (virBitmapUnion(b3, b2) < 0)
+        goto cleanup;
+    if (!(str = virBitmapFormat(b3)) ||
+        STRNEQ(str, "1-65,180-190,290"))
+        goto cleanup;
+    VIR_FREE(str);
+
+    if (!virBitmapIsSubset(b2, b3))
+        goto cleanup;
+
+    virBitmapIntersect(b1, b2);
+    if (!(str = virBitmapFormat(b1)) ||
+        STRNEQ(str, "2-3,60-65,180-190"))
+        goto cleanup;
+    VIR_FREE(str);
+
+    if (!virBitmapIsSubset(b1, b2))
+        goto cleanup;
+
+    virBitmapSubtract(b3, b1);
+    if (!(str = virBitmapFormat(b3)) ||
+        STRNEQ(str, "1,4-59,290"))
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    virBitmapFree(b1);
+    virBitmapFree(b2);
+    virBitmapFree(b3);
+    VIR_FREE(str);
+    return ret;
+}
+
+/* test searching for runs of clear bits */
+static int
+test11(const void *opaque ATTRIBUTE_UNUSED)
+{
+    int ret = -1;
+    virBitmapPtr bitmap = NULL;
+
+    if (virBitmapParse("0-9,12-62,64-200,203-256", 0, &bitmap, 260) < 0)
+        goto cleanup;
+
+    if (virBitmapNextClearRange(bitmap, -1, 1) != 10 ||
+        virBitmapNextClearRange(bitmap, -1, 2) != 10 ||
+        virBitmapNextClearRange(bitmap, -1, 3) != 257 ||
+        virBitmapNextClearRange(bitmap, 10, 2) != 201 ||
+        virBitmapNextClearRange(bitmap, 63, 1) != 201 ||
+        virBitmapNextClearRange(bitmap, -1, 4) != -1 ||
+        virBitmapNextClearRange(bitmap, -1, 0) != -1)
+        goto cleanup;
+
+    virBitmapClearAll(bitmap);
+    if (virBitmapNextClearRange(bitmap, -1, 260) != 0 ||
+        virBitmapNextClearRange(bitmap, 0, 260) != -1)
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    virBitmapFree(bitmap);
+    return ret;
+}
+
+/* test parsing and formatting ranges across word boundaries */
+static int
+test12(const void *opaque ATTRIBUTE_UNUSED)
+{
+    int ret = -1;
+    virBitmapPtr bitmap = NULL;
+    char *str = NULL;
+    size_t i;
+    const char *ranges[] = {
+        "0-63", "63-64", "1-126", "64-127", "0-4095",
+        "5,31-32,63-65,127-128,191-300,1000-4095",
+    };
+
+    for (i = 0; i < ARRAY_CARDINALITY(ranges); i++) {
+        if (virBitmapParse(ranges[i], 0, &bitmap, 4096) < 0)
+            goto cleanup;
+
+        if (!(str = virBitmapFormat(bitmap)))
+            goto cleanup;
+
+        if (STRNEQ(ranges[i], str)) {
+            fprintf(stderr, "\nexpected '%s', got '%s'", ranges[i], str);
+            goto cleanup;
+        }
+
+        virBitmapFree(bitmap);
+        bitmap = NULL;
+        VIR_FREE(str);
+    }
+
+    if (virBitmapParse("0-4095", 0, &bitmap, 4096) != 4096 ||
+        !virBitmapIsAllSet(bitmap))
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    virBitmapFree(bitmap);
+    VIR_FREE(str);
+    return ret;
+}
+
+struct testBenchData {
+    virBitmapPtr b1;
+    virBitmapPtr b2;
+    char *str;
+};
+
+static int
+testBenchFormatParse(size_t idx ATTRIBUTE_UNUSED,
+                     void *opaque)
+{
+    struct testBenchData *data = opaque;
+    size_t size = virBitmapSize(data->b1);
+
+    VIR_FREE(data->str);
+    virBitmapFree(data->b2);
+    data->b2 = NULL;
+    if (!(data->str = virBitmapFormat(data->b1)) ||
+        virBitmapParse(data->str, 0, &data->b2, size) < 0)
+        return -1;
+    return 0;
+}
+
+static int
+testBenchIterate(size_t idx ATTRIBUTE_UNUSED,
+                 void *opaque)
+{
+    struct testBenchData *data = opaque;
+    size_t count = 0;
+    ssize_t pos = -1;
+
+    while ((pos = virBitmapNextSetBit(data->b1, pos)) >= 0)
+        count++;
+    return count == virBitmapCountBits(data->b1) ? 0 : -1;
+}
+
+static int
+testBenchBulk(size_t idx ATTRIBUTE_UNUSED,
+              void *opaque)
+{
+    struct testBenchData *data = opaque;
+
+    if (!virBitmapIsSubset(data->b1, data->b2) ||
+        virBitmapNextClearRange(data->b1, -1, 4) >= 0)
+        return -1;
+    virBitmapIntersect(data->b2, data->b1);
+    return 0;
+}
+
+/*
+ * Time the operations used for host CPU sets and port allocation on
+ * large bitmaps. With debug enabled the rate of each is reported.
+ */
+static int
+testBenchmark(const void *opaque ATTRIBUTE_UNUSED)
+{
+    int ret = -1;
+    size_t size = virTestGetExpensive() ? 1024 * 1024 : 64 * 1024;
+    size_t loops = 100;
+    struct testBenchData data = { NULL, NULL, NULL };
+    size_t i;
+    unsigned long long elapsed;
+
+    if (!(data.b1 = virBitmapNew(size)) || !(data.b2 = virBitmapNew(size)))
+        goto cleanup;
+
+    /* Runs of set bits with gaps of 3 in between */
+    for (i = 0; i < size; i++) {
+        if (i % 67 > 2)
+            ignore_value(virBitmapSetBit(data.b1, i));
+        if (i % 5 == 0)
+            ignore_value(virBitmapSetBit(data.b2, i));
+    }
+
+    if (virtTestBenchmark(loops, testBenchFormatParse, &data, &elapsed) < 0 ||
+        !virBitmapEqual(data.b1, data.b2))
+        goto cleanup;
+    VIR_TEST_DEBUG("\nformat+parse: %llu bitmaps/s",
+                   loops * 1000 / (elapsed + 1));
+
+    if (virtTestBenchmark(loops, testBenchIterate, &data, &elapsed) < 0)
+        goto cleanup;
+    VIR_TEST_DEBUG("\niterate: %llu bitmaps/s",
+                   loops * 1000 / (elapsed + 1));
+
+    if (virtTestBenchmark(loops * 100, testBenchBulk, &data, &elapsed) < 0)
+        goto cleanup;
+    VIR_TEST_DEBUG("\nbulk: %llu ops/s\n",
+                   loops * 100 * 3 * 1000 / (elapsed + 1));
+
+    ret = 0;
+cleanup:
+    virBitmapFree(data.b1);
+    virBitmapFree(data.b2);
+    VIR_FREE(data.str);
+    return ret;
+}
+
 static int
 mymain(void)
 {
@@ -520,6 +743,14 @@ mymain(void)
         ret = -1;
     if (virtTestRun("test9", 1, test9, NULL) < 0)
         ret = -1;
+    if (virtTestRun("test10", 1, test10, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("test11", 1, test11, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("test12", 1, test12, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("benchmark", 1, testBenchmark, NULL) < 0)
+        ret = -1;
 
     return ret;
 }
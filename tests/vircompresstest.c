@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "vircompress.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virstring.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/compressdir-XXXXXX"
+
+static char scratchdir[] = SCRATCHDIRTEMPLATE;
+
+struct testInfo {
+    const char *name;
+    size_t len;
+    unsigned int nthreads;
+    bool truncate;
+};
+
+/* Mix zero pages, repeated patterns and incompressible data so that
+ * every kind of block gets exercised */
+static void
+testFillData(char *data, size_t len)
+{
+    size_t i;
+    unsigned int seed = 42;
+
+    for (i = 0; i < len; i++) {
+        switch ((i / 4096) % 4) {
+        case 0:
+            data[i] = 0;
+            break;
+        case 1:
+            data[i] = (i / 4096) & 0xff;
+            break;
+        case 2:
+            data[i] = i % 7;
+            break;
+        default:
+            seed = seed * 1103515245 + 12345;
+            data[i] = seed >> 16;
+            break;
+        }
+    }
+}
+
+static int
+testWriteFile(const char *path, const char *data, size_t len)
+{
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+    if (safewrite(fd, data, len) < 0) {
+        VIR_FORCE_CLOSE(fd);
+        return -1;
+    }
+    return VIR_CLOSE(fd);
+}
+
+static int
+testFilter(bool compress, const char *inpath, const char *outpath,
+           unsigned int nthreads)
+{
+    int infd = -1;
+    int outfd = -1;
+    int ret = -1;
+
+    if ((infd = open(inpath, O_RDONLY)) < 0 ||
+        (outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto cleanup;
+
+    if (compress)
+        ret = virCompressStream(infd, inpath, outfd, outpath, nthreads);
+    else
+        ret = virDecompressStream(infd, inpath, outfd, outpath, nthreads);
+
+cleanup:
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(outfd);
+    return ret;
+}
+
+static int
+testRoundTrip(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    char *rawfile = NULL;
+    char *compfile = NULL;
+    char *outfile = NULL;
+    char *data = NULL;
+    char *comp = NULL;
+    char *out = NULL;
+    int complen;
+    int outlen;
+    int ret = -1;
+
+    if (virAsprintf(&rawfile, "%s/%s.raw", scratchdir, info->name) < 0 ||
+        virAsprintf(&compfile, "%s/%s.comp", scratchdir, info->name) < 0 ||
+        virAsprintf(&outfile, "%s/%s.out", scratchdir, info->name) < 0)
+        goto cleanup;
+
+    if (VIR_ALLOC_N(data, info->len + 1) < 0)
+        goto cleanup;
+    testFillData(data, info->len);
+
+    if (testWriteFile(rawfile, data, info->len) < 0 ||
+        testFilter(true, rawfile, compfile, info->nthreads) < 0)
+        goto cleanup;
+
+    if ((complen = virFileReadAll(compfile, INT_MAX, &comp)) < 0)
+        goto cleanup;
+
+    if (info->truncate) {
+        /* Drop the trailer, which must be noticed on decompression */
+        if (testWriteFile(compfile, comp, complen - 1) < 0)
+            goto cleanup;
+        if (testFilter(false, compfile, outfile, info->nthreads) == 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "truncated stream was accepted\n");
+            goto cleanup;
+        }
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (testFilter(false, compfile, outfile, info->nthreads) < 0)
+        goto cleanup;
+
+    if ((outlen = virFileReadAll(outfile, INT_MAX, &out)) < 0)
+        goto cleanup;
+
+    if ((size_t) outlen != info->len || memcmp(data, out, info->len) != 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "decompressed data does not match input\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (rawfile)
+        unlink(rawfile);
+    if (compfile)
+        unlink(compfile);
+    if (outfile)
+        unlink(outfile);
+    VIR_FREE(rawfile);
+    VIR_FREE(compfile);
+    VIR_FREE(outfile);
+    VIR_FREE(data);
+    VIR_FREE(comp);
+    VIR_FREE(out);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (!mkdtemp(scratchdir)) {
+        virFilePrintf(stderr, "Cannot create compressdir");
+        abort();
+    }
+
+#define DO_TEST_FULL(name, len, nthreads, truncate)                     \
+    do {                                                                \
+        struct testInfo info = { name, len, nthreads, truncate };      \
+        if (virtTestRun("Compress " name, 1, testRoundTrip, &info) < 0) \
+            ret = -1;                                                   \
+    } while (0)
+
+#define DO_TEST(name, len, nthreads)                                    \
+    DO_TEST_FULL(name, len, nthreads, false)
+
+    DO_TEST("empty", 0, 1);
+    DO_TEST("partial-page", 1000, 1);
+    DO_TEST("pages", 4096 * 8, 1);
+    DO_TEST("blocks", 5 * 1024 * 1024 + 123, 1);
+    DO_TEST("blocks-threaded", 5 * 1024 * 1024 + 123, 4);
+    DO_TEST("blocks-auto", 5 * 1024 * 1024 + 123, 0);
+    DO_TEST_FULL("truncated", 3 * 1024 * 1024, 2, true);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,495 @@
+/*
+ * virdomainobjlisttest.c: Test the domain object list
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "testutils.h"
+
+#include "domain_conf.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define NDOMAINS 200
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/virdomainobjlistdata-XXXXXX"
+
+static virDomainXMLOptionPtr xmlopt;
+
+static void testQuietError(void *userData ATTRIBUTE_UNUSED,
+                           virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nada */
+}
+
+/* Every odd domain is running with ID i + 1 */
+static virDomainDefPtr
+testDomainDef(size_t i)
+{
+    virDomainDefPtr def;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+    if (VIR_ALLOC(def) < 0)
+        return NULL;
+
+    snprintf(uuidstr, sizeof(uuidstr),
+             "c7a5fdbd-edaf-9455-926a-%012zx", i);
+    if (virAsprintf(&def->name, "dom%zu", i) < 0 ||
+        virUUIDParse(uuidstr, def->uuid) < 0) {
+        virDomainDefFree(def);
+        return NULL;
+    }
+    def->id = (i % 2) ? i + 1 : -1;
+
+    return def;
+}
+
+static virDomainObjListPtr
+testDomainListNew(void)
+{
+    virDomainObjListPtr doms;
+    size_t i;
+
+    if (!(doms = virDomainObjListNew()))
+        return NULL;
+
+    for (i = 0; i < NDOMAINS; i++) {
+        virDomainDefPtr def;
+        virDomainObjPtr vm;
+
+        if (!(def = testDomainDef(i)))
+            goto error;
+
+        if (!(vm = virDomainObjListAdd(doms, def, xmlopt, 0, NULL))) {
+            virDomainDefFree(def);
+            goto error;
+        }
+        virObjectUnlock(vm);
+    }
+
+    return doms;
+
+error:
+    virObjectUnref(doms);
+    return NULL;
+}
+
+
+static int
+testLookup(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjListPtr doms;
+    virDomainObjPtr vm = NULL;
+    virDomainObjPtr expect;
+    virDomainDefPtr def = NULL;
+    int ids[NDOMAINS];
+    size_t i;
+    int ret = -1;
+
+    if (!(doms = testDomainListNew()))
+        return -1;
+
+    for (i = 0; i < NDOMAINS; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "dom%zu", i);
+        if (!(expect = virDomainObjListFindByName(doms, name)))
+            goto cleanup;
+        virObjectUnlock(expect);
+
+        /* vm only ever holds what a lookup returned locked */
+        if (!(def = testDomainDef(i)))
+            goto cleanup;
+        if ((vm = virDomainObjListFindByUUID(doms, def->uuid)) != expect)
+            goto cleanup;
+        virObjectUnlock(vm);
+        vm = NULL;
+        virDomainDefFree(def);
+        def = NULL;
+
+        if (i % 2) {
+            if ((vm = virDomainObjListFindByID(doms, i + 1)) != expect)
+                goto cleanup;
+            virObjectUnlock(vm);
+            vm = NULL;
+        }
+    }
+
+    /* Unused IDs must not match anything */
+    if ((vm = virDomainObjListFindByID(doms, 1)))
+        goto cleanup;
+
+    /* Adding a domain under an existing name must fail */
+    if (!(def = testDomainDef(NDOMAINS)))
+        goto cleanup;
+    VIR_FREE(def->name);
+    if (VIR_STRDUP(def->name, "dom0") < 0)
+        goto cleanup;
+    if ((vm = virDomainObjListAdd(doms, def, xmlopt, 0, NULL)))
+        goto cleanup;
+    virDomainDefFree(def);
+    def = NULL;
+
+    /* Drivers assign IDs directly, the lookup must follow */
+    if (!(vm = virDomainObjListFindByName(doms, "dom1")))
+        goto cleanup;
+    vm->def->id = 1000;
+    virObjectUnlock(vm);
+    vm = NULL;
+    if ((vm = virDomainObjListFindByID(doms, 2)))
+        goto cleanup;
+    if (!(vm = virDomainObjListFindByID(doms, 1000)) ||
+        STRNEQ(vm->def->name, "dom1"))
+        goto cleanup;
+
+    virDomainObjListRemove(doms, vm);
+    vm = NULL;
+
+    if ((vm = virDomainObjListFindByName(doms, "dom1")) ||
+        (vm = virDomainObjListFindByID(doms, 1000)))
+        goto cleanup;
+
+    if (virDomainObjListNumOfDomains(doms, true, NULL, NULL) != NDOMAINS / 2 - 1 ||
+        virDomainObjListNumOfDomains(doms, false, NULL, NULL) != NDOMAINS / 2 ||
+        virDomainObjListGetActiveIDs(doms, ids, NDOMAINS,
+                                     NULL, NULL) != NDOMAINS / 2 - 1 ||
+        virDomainObjListExport(doms, NULL, NULL, NULL, 0) != NDOMAINS - 1)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (vm)
+        virObjectUnlock(vm);
+    virDomainDefFree(def);
+    virObjectUnref(doms);
+    return ret;
+}
+
+
+struct testReaderData {
+    virDomainObjListPtr doms;
+    size_t seed;
+    size_t rounds;
+    bool failed;
+};
+
+static void
+testReaderThread(void *opaque)
+{
+    struct testReaderData *data = opaque;
+    virDomainObjPtr vm;
+    char name[32];
+    size_t i;
+
+    for (i = 0; i < data->rounds; i++) {
+        size_t n = (data->seed + i * 7) % NDOMAINS;
+
+        snprintf(name, sizeof(name), "dom%zu", n);
+        if (!(vm = virDomainObjListFindByName(data->doms, name))) {
+            data->failed = true;
+            return;
+        }
+        virObjectUnlock(vm);
+
+        if (!(vm = virDomainObjListFindByID(data->doms, (n | 1) + 1))) {
+            data->failed = true;
+            return;
+        }
+        virObjectUnlock(vm);
+
+        if ((i % 64) == 0 &&
+            virDomainObjListExport(data->doms, NULL, NULL, NULL,
+                                   0) != NDOMAINS) {
+            data->failed = true;
+            return;
+        }
+    }
+}
+
+struct testContentionData {
+    struct testReaderData *readers;
+    virThread *threads;
+    size_t nthreads;
+};
+
+static int
+testContentionRun(size_t idx ATTRIBUTE_UNUSED,
+                  void *opaque)
+{
+    struct testContentionData *data = opaque;
+    size_t i;
+
+    for (i = 0; i < data->nthreads; i++) {
+        if (virThreadCreate(&data->threads[i], true,
+                            testReaderThread, &data->readers[i]) < 0) {
+            while (i-- > 0)
+                virThreadJoin(&data->threads[i]);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < data->nthreads; i++)
+        virThreadJoin(&data->threads[i]);
+
+    for (i = 0; i < data->nthreads; i++) {
+        if (data->readers[i].failed)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Hammer the list from a growing number of reader threads. With
+ * debug enabled the throughput for each thread count is reported,
+ * which should scale with the number of CPUs since readers don't
+ * exclude each other.
+ */
+static int
+testContention(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjListPtr doms;
+    struct testReaderData readers[16];
+    virThread threads[16];
+    struct testContentionData bench = { readers, threads, 0 };
+    size_t rounds = virTestGetExpensive() ? 200000 : 5000;
+    size_t i;
+    int ret = -1;
+
+    if (!(doms = testDomainListNew()))
+        return -1;
+
+    for (bench.nthreads = 1;
+         bench.nthreads <= ARRAY_CARDINALITY(threads);
+         bench.nthreads *= 2) {
+        unsigned long long elapsed;
+
+        for (i = 0; i < bench.nthreads; i++) {
+            readers[i].doms = doms;
+            readers[i].seed = i * 13;
+            readers[i].rounds = rounds;
+            readers[i].failed = false;
+        }
+
+        if (virtTestBenchmark(1, testContentionRun, &bench, &elapsed) < 0)
+            goto cleanup;
+
+        VIR_TEST_DEBUG("\n%2zu readers: %llu lookups/ms", bench.nthreads,
+                       (unsigned long long)(bench.nthreads * rounds * 2) /
+                       (elapsed + 1));
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+
+cleanup:
+    virObjectUnref(doms);
+    return ret;
+}
+
+
+static virCapsPtr
+testCapsInit(void)
+{
+    virCapsPtr caps;
+    virCapsGuestPtr guest;
+
+    if (!(caps = virCapabilitiesNew(VIR_ARCH_X86_64, 0, 0)))
+        return NULL;
+
+    if (!(guest = virCapabilitiesAddGuest(caps, "hvm", VIR_ARCH_X86_64,
+                                          "/usr/bin/qemu", NULL, 0, NULL)) ||
+        !virCapabilitiesAddGuestDomain(guest, "qemu", NULL, NULL, 0, NULL)) {
+        virObjectUnref(caps);
+        return NULL;
+    }
+
+    return caps;
+}
+
+static int
+testWriteConfig(const char *dir, size_t i)
+{
+    char *path = NULL;
+    char *xml = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&path, "%s/dom%zu.xml", dir, i) < 0 ||
+        virAsprintf(&xml,
+                    "<domain type='qemu'>\n"
+                    "  <name>dom%zu</name>\n"
+                    "  <uuid>c7a5fdbd-edaf-9455-926a-%012zx</uuid>\n"
+                    "  <memory unit='KiB'>219136</memory>\n"
+                    "  <vcpu placement='static'>1</vcpu>\n"
+                    "  <os>\n"
+                    "    <type arch='x86_64'>hvm</type>\n"
+                    "  </os>\n"
+                    "  <devices>\n"
+                    "    <emulator>/usr/bin/qemu</emulator>\n"
+                    "    <disk type='file' device='disk'>\n"
+                    "      <source file='/var/lib/libvirt/images/dom%zu-a.img'/>\n"
+                    "      <target dev='vda' bus='virtio'/>\n"
+                    "    </disk>\n"
+                    "    <disk type='file' device='disk'>\n"
+                    "      <source file='/var/lib/libvirt/images/dom%zu-b.img'/>\n"
+                    "      <target dev='vdb' bus='virtio'/>\n"
+                    "    </disk>\n"
+                    "    <interface type='network'>\n"
+                    "      <source network='default'/>\n"
+                    "      <model type='virtio'/>\n"
+                    "    </interface>\n"
+                    "    <graphics type='vnc' autoport='yes'/>\n"
+                    "  </devices>\n"
+                    "</domain>\n",
+                    i, i, i, i) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(path, xml, 0600) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(path);
+    VIR_FREE(xml);
+    return ret;
+}
+
+struct testLoadData {
+    virDomainObjListPtr doms;
+    const char *dir;
+    const char *autostartDir;
+    virCapsPtr caps;
+};
+
+static int
+testLoadConfigsRun(size_t idx ATTRIBUTE_UNUSED,
+                   void *opaque)
+{
+    struct testLoadData *data = opaque;
+
+    return virDomainObjListLoadAllConfigs(data->doms, data->dir,
+                                          data->autostartDir, 0,
+                                          data->caps, xmlopt,
+                                          1 << VIR_DOMAIN_VIRT_QEMU,
+                                          NULL, NULL);
+}
+
+/*
+ * Load a directory of synthetic definitions the way drivers do at
+ * daemon startup. With debug enabled the time taken is reported.
+ */
+static int
+testLoadConfigs(const void *data)
+{
+    const char *dir = data;
+    size_t ndomains = virTestGetExpensive() ? 5000 : NDOMAINS;
+    virDomainObjListPtr doms = NULL;
+    virDomainObjPtr vm = NULL;
+    virCapsPtr caps = NULL;
+    char *autostartDir = NULL;
+    struct testLoadData load;
+    unsigned long long elapsed;
+    size_t i;
+    int ret = -1;
+
+    if (!(caps = testCapsInit()) ||
+        virAsprintf(&autostartDir, "%s/autostart", dir) < 0)
+        goto cleanup;
+
+    for (i = 0; i < ndomains; i++) {
+        if (testWriteConfig(dir, i) < 0)
+            goto cleanup;
+    }
+
+    if (!(doms = virDomainObjListNew()))
+        goto cleanup;
+
+    load.doms = doms;
+    load.dir = dir;
+    load.autostartDir = autostartDir;
+    load.caps = caps;
+    if (virtTestBenchmark(1, testLoadConfigsRun, &load, &elapsed) < 0)
+        goto cleanup;
+
+    VIR_TEST_DEBUG("\n%zu configs loaded in %llu ms\n", ndomains, elapsed);
+
+    if (virDomainObjListNumOfDomains(doms, false, NULL, NULL) != ndomains)
+        goto cleanup;
+
+    if (!(vm = virDomainObjListFindByName(doms, "dom1")) ||
+        !vm->persistent || vm->autostart || vm->def->ndisks != 2)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (vm)
+        virObjectUnlock(vm);
+    virObjectUnref(doms);
+    virObjectUnref(caps);
+    VIR_FREE(autostartDir);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    char scratchdir[] = SCRATCHDIRTEMPLATE;
+    int ret = 0;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    if (!virTestGetDebug())
+        virSetErrorFunc(NULL, testQuietError);
+
+    if (!mkdtemp(scratchdir)) {
+        virFilePrintf(stderr, "Cannot create scratch dir\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!(xmlopt = virDomainXMLOptionNew(NULL, NULL, NULL)))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("lookup", 1, testLookup, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("contention", 1, testContention, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("load configs", 1, testLoadConfigs, scratchdir) < 0)
+        ret = -1;
+
+    virObjectUnref(xmlopt);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -12,6 +12,7 @@
 #include "viralloc.h"
 #include "virlog.h"
 #include "virstring.h"
+#include "virthread.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
@@ -660,6 +661,406 @@ cleanup:
 }
 
 
+static void
+testHashConcurrentCountIter(void *payload ATTRIBUTE_UNUSED,
+                            const void *name ATTRIBUTE_UNUSED,
+                            void *data)
+{
+    size_t *count = data;
+
+    (*count)++;
+}
+
+static int
+testHashConcurrentSearcher(const void *payload ATTRIBUTE_UNUSED,
+                           const void *name,
+                           const void *data)
+{
+    return STREQ(name, data);
+}
+
+static int
+testHashConcurrentCheckCount(virHashConcurrentTablePtr hash, size_t count)
+{
+    size_t iter_count = 0;
+
+    if (virHashConcurrentSize(hash) != count) {
+        testError("\nhash contains %zd instead of %zu elements\n",
+                  virHashConcurrentSize(hash), count);
+        return -1;
+    }
+
+    if (virHashConcurrentForEach(hash, testHashConcurrentCountIter,
+                                 &iter_count) != count ||
+        iter_count != count) {
+        testError("\nhash claims to have %zu elements but iteration finds %zu\n",
+                  count, iter_count);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+testHashConcurrent(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashConcurrentTablePtr hash;
+    size_t count = 0;
+    size_t i;
+    int ret = -1;
+
+    /* Start small, so that every stripe has to grow several times */
+    if (!(hash = virHashConcurrentCreate(1, NULL)))
+        return -1;
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids); i++) {
+        if (virHashConcurrentAddEntry(hash, uuids[i], (void *) uuids[i]) < 0) {
+            testError("\nfailed to add entry \"%s\"\n", uuids[i]);
+            goto cleanup;
+        }
+
+        /* Entries added before must survive the incremental growth */
+        if (virHashConcurrentLookup(hash, uuids[i / 2]) != uuids[i / 2]) {
+            testError("\nentry \"%s\" could not be found\n", uuids[i / 2]);
+            goto cleanup;
+        }
+    }
+
+    if (virHashConcurrentAddEntry(hash, uuids[0], NULL) == 0) {
+        testError("\nduplicate entry was added\n");
+        goto cleanup;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids); i++) {
+        if (virHashConcurrentLookup(hash, uuids[i]) != uuids[i]) {
+            testError("\nentry \"%s\" could not be found\n", uuids[i]);
+            goto cleanup;
+        }
+    }
+
+    if (testHashConcurrentCheckCount(hash, ARRAY_CARDINALITY(uuids)) < 0)
+        goto cleanup;
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids_subset); i++) {
+        if (virHashConcurrentUpdateEntry(hash, uuids_subset[i], (void *) 1) < 0 ||
+            virHashConcurrentLookup(hash, uuids_subset[i]) != (void *) 1) {
+            testError("\nentry \"%s\" could not be updated\n",
+                      uuids_subset[i]);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids_new); i++) {
+        if (virHashConcurrentUpdateEntry(hash, uuids_new[i], (void *) 2) < 0) {
+            testError("\nnew entry \"%s\" could not be added\n",
+                      uuids_new[i]);
+            goto cleanup;
+        }
+    }
+
+    count = ARRAY_CARDINALITY(uuids) + ARRAY_CARDINALITY(uuids_new);
+    if (testHashConcurrentCheckCount(hash, count) < 0)
+        goto cleanup;
+
+    if (virHashConcurrentSearch(hash, testHashConcurrentSearcher,
+                                uuids_new[0]) != (void *) 2) {
+        testError("\nentry \"%s\" could not be found by search\n",
+                  uuids_new[0]);
+        goto cleanup;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids_new); i++) {
+        if (virHashConcurrentSteal(hash, uuids_new[i]) != (void *) 2 ||
+            virHashConcurrentLookup(hash, uuids_new[i])) {
+            testError("\nentry \"%s\" could not be stolen\n",
+                      uuids_new[i]);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(uuids_subset); i++) {
+        if (virHashConcurrentRemoveEntry(hash, uuids_subset[i]) < 0 ||
+            virHashConcurrentRemoveEntry(hash, uuids_subset[i]) == 0) {
+            testError("\nentry \"%s\" could not be removed\n",
+                      uuids_subset[i]);
+            goto cleanup;
+        }
+    }
+
+    count = ARRAY_CARDINALITY(uuids) - ARRAY_CARDINALITY(uuids_subset);
+    if (testHashConcurrentCheckCount(hash, count) < 0)
+        goto cleanup;
+
+    if (virHashConcurrentRemoveSet(hash, testHashConcurrentSearcher,
+                                   uuids[0]) != 1 ||
+        virHashConcurrentRemoveAll(hash) != count - 1 ||
+        testHashConcurrentCheckCount(hash, 0) < 0) {
+        testError("\nfailed to remove all entries\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashConcurrentFree(hash);
+    return ret;
+}
+
+
+#define NKEYS 4096
+
+struct testHashThreadData {
+    virHashConcurrentTablePtr hash;
+    virHashTablePtr plain;
+    virMutexPtr lock;
+    size_t id;
+    size_t rounds;
+    bool failed;
+};
+
+/*
+ * Every thread adds and removes keys of its own while checking
+ * that the shared keys and its own survivors stay visible
+ */
+static void
+testHashConcurrentWorker(void *opaque)
+{
+    struct testHashThreadData *data = opaque;
+    char key[64];
+    size_t i;
+
+    for (i = 0; i < data->rounds; i++) {
+        snprintf(key, sizeof(key), "thread%zu-%zu", data->id, i);
+        if (virHashConcurrentAddEntry(data->hash, key, (void *) data) < 0)
+            goto error;
+
+        snprintf(key, sizeof(key), "shared%zu", (i * 7 + data->id) % NKEYS);
+        if (!virHashConcurrentLookup(data->hash, key))
+            goto error;
+
+        if (i % 2) {
+            snprintf(key, sizeof(key), "thread%zu-%zu", data->id, i - 1);
+            if (virHashConcurrentRemoveEntry(data->hash, key) < 0)
+                goto error;
+        }
+    }
+
+    for (i = 1; i < data->rounds; i += 2) {
+        snprintf(key, sizeof(key), "thread%zu-%zu", data->id, i);
+        if (virHashConcurrentLookup(data->hash, key) != data)
+            goto error;
+    }
+
+    return;
+
+error:
+    data->failed = true;
+}
+
+static int
+testHashConcurrentThreads(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashConcurrentTablePtr hash;
+    struct testHashThreadData workers[8];
+    virThread threads[ARRAY_CARDINALITY(workers)];
+    size_t rounds = 4000;
+    char key[64];
+    size_t i;
+    int ret = -1;
+
+    if (!(hash = virHashConcurrentCreate(0, NULL)))
+        return -1;
+
+    for (i = 0; i < NKEYS; i++) {
+        snprintf(key, sizeof(key), "shared%zu", i);
+        if (virHashConcurrentAddEntry(hash, key, (void *) 1) < 0)
+            goto cleanup;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(workers); i++) {
+        workers[i].hash = hash;
+        workers[i].id = i;
+        workers[i].rounds = rounds;
+        workers[i].failed = false;
+        if (virThreadCreate(&threads[i], true,
+                            testHashConcurrentWorker, &workers[i]) < 0) {
+            while (i-- > 0)
+                virThreadJoin(&threads[i]);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(workers); i++)
+        virThreadJoin(&threads[i]);
+
+    for (i = 0; i < ARRAY_CARDINALITY(workers); i++) {
+        if (workers[i].failed) {
+            testError("\nthread %zu lost track of its entries\n", i);
+            goto cleanup;
+        }
+    }
+
+    if (testHashConcurrentCheckCount(hash, NKEYS +
+                                     ARRAY_CARDINALITY(workers) * rounds / 2) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virHashConcurrentFree(hash);
+    return ret;
+}
+
+
+/*
+ * A mix of 15 lookups for every update, on either a concurrent
+ * table or a plain one behind a single mutex as most callers use it
+ */
+static void
+testHashBenchWorker(void *opaque)
+{
+    struct testHashThreadData *data = opaque;
+    char key[64];
+    size_t i;
+
+    for (i = 0; i < data->rounds; i++) {
+        bool update = (i % 16) == 0;
+        bool found;
+
+        snprintf(key, sizeof(key), "shared%zu",
+                 (i * 31 + data->id * 257) % NKEYS);
+
+        if (data->hash) {
+            if (update)
+                found = virHashConcurrentUpdateEntry(data->hash, key,
+                                                     (void *) 1) == 0;
+            else
+                found = virHashConcurrentLookup(data->hash, key) != NULL;
+        } else {
+            virMutexLock(data->lock);
+            if (update)
+                found = virHashUpdateEntry(data->plain, key, (void *) 1) == 0;
+            else
+                found = virHashLookup(data->plain, key) != NULL;
+            virMutexUnlock(data->lock);
+        }
+
+        if (!found) {
+            data->failed = true;
+            return;
+        }
+    }
+}
+
+struct testHashBenchData {
+    struct testHashThreadData *workers;
+    virThread *threads;
+    size_t nthreads;
+};
+
+/*
+ * Run one batch of workers set up by testHashConcurrentBench
+ */
+static int
+testHashBenchRun(size_t idx ATTRIBUTE_UNUSED,
+                 void *opaque)
+{
+    struct testHashBenchData *data = opaque;
+    size_t i;
+
+    for (i = 0; i < data->nthreads; i++) {
+        if (virThreadCreate(&data->threads[i], true,
+                            testHashBenchWorker, &data->workers[i]) < 0) {
+            while (i-- > 0)
+                virThreadJoin(&data->threads[i]);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < data->nthreads; i++)
+        virThreadJoin(&data->threads[i]);
+
+    for (i = 0; i < data->nthreads; i++) {
+        if (data->workers[i].failed)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * With debug enabled the throughput of both kinds of tables for a
+ * growing number of threads is reported. The concurrent table should
+ * scale with the number of CPUs, the locked one not at all.
+ */
+static int
+testHashConcurrentBench(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashConcurrentTablePtr hash = NULL;
+    virHashTablePtr plain = NULL;
+    virMutex lock;
+    struct testHashThreadData workers[16];
+    virThread threads[ARRAY_CARDINALITY(workers)];
+    struct testHashBenchData bench = { workers, threads, 0 };
+    size_t rounds = virTestGetExpensive() ? 500000 : 20000;
+    size_t concurrent;
+    char key[64];
+    size_t i;
+    int ret = -1;
+
+    if (virMutexInit(&lock) < 0)
+        return -1;
+
+    if (!(hash = virHashConcurrentCreate(0, NULL)) ||
+        !(plain = virHashCreate(0, NULL)))
+        goto cleanup;
+
+    for (i = 0; i < NKEYS; i++) {
+        snprintf(key, sizeof(key), "shared%zu", i);
+        if (virHashConcurrentAddEntry(hash, key, (void *) 1) < 0 ||
+            virHashAddEntry(plain, key, (void *) 1) < 0)
+            goto cleanup;
+    }
+
+    for (concurrent = 0; concurrent < 2; concurrent++) {
+        VIR_TEST_DEBUG("\n%s table:", concurrent ? "concurrent" : "locked");
+
+        for (bench.nthreads = 1;
+             bench.nthreads <= ARRAY_CARDINALITY(threads);
+             bench.nthreads *= 2) {
+            unsigned long long elapsed;
+
+            for (i = 0; i < bench.nthreads; i++) {
+                workers[i].hash = concurrent ? hash : NULL;
+                workers[i].plain = plain;
+                workers[i].lock = &lock;
+                workers[i].id = i;
+                workers[i].rounds = rounds;
+                workers[i].failed = false;
+            }
+
+            if (virtTestBenchmark(1, testHashBenchRun, &bench, &elapsed) < 0)
+                goto cleanup;
+
+            VIR_TEST_DEBUG("\n%2zu threads: %llu ops/ms", bench.nthreads,
+                           (unsigned long long)(bench.nthreads * rounds) /
+                           (elapsed + 1));
+        }
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+
+cleanup:
+    virHashConcurrentFree(hash);
+    virHashFree(plain);
+    virMutexDestroy(&lock);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -698,6 +1099,9 @@ mymain(void)
     DO_TEST("Search", Search);
     DO_TEST("GetItems", GetItems);
     DO_TEST("Equal", Equal);
+    DO_TEST("Concurrent", Concurrent);
+    DO_TEST("Concurrent threads", ConcurrentThreads);
+    DO_TEST("Concurrent benchmark", ConcurrentBench);
 
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "testutils.h"
+#include "viralloc.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+#define NTHREADS 4
+#define NMSGS 2000
+
+/*
+ * Everything logged by the tests starts with "test <thread> <n> " and
+ * is followed by some padding, so that the records queued in the
+ * rings vary in size and wrap around at odd offsets.
+ */
+struct testLogCapture {
+    virMutex lock;
+    virCond cond;
+    int *next;                  /* next message expected from each thread */
+    size_t nmsgs;
+    size_t dropped;             /* as reported by the writer thread */
+    bool misordered;
+    bool corrupted;
+    bool gated;                 /* hold the writer thread in the output */
+    bool blocked;               /* the writer thread is waiting */
+};
+
+static struct testLogCapture capture;
+static const char testLogPadding[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static int
+testLogPaddingLen(int n)
+{
+    return n % (sizeof(testLogPadding) - 1);
+}
+
+static void
+testLogOutput(virLogSource source ATTRIBUTE_UNUSED,
+              virLogPriority priority ATTRIBUTE_UNUSED,
+              const char *filename ATTRIBUTE_UNUSED,
+              int linenr ATTRIBUTE_UNUSED,
+              const char *funcname ATTRIBUTE_UNUSED,
+              const char *timestamp ATTRIBUTE_UNUSED,
+              virLogMetadataPtr metadata ATTRIBUTE_UNUSED,
+              unsigned int flags ATTRIBUTE_UNUSED,
+              const char *rawstr,
+              const char *str ATTRIBUTE_UNUSED,
+              void *data ATTRIBUTE_UNUSED)
+{
+    unsigned int thread;
+    int n;
+    int padding;
+    int dropped;
+
+    virMutexLock(&capture.lock);
+
+    if (sscanf(rawstr, "Dropped %d log messages", &dropped) == 1) {
+        capture.dropped += dropped;
+    } else if (sscanf(rawstr, "test %u %d %n", &thread, &n, &padding) == 2) {
+        if (thread >= NTHREADS || n < capture.next[thread])
+            capture.misordered = true;
+        else
+            capture.next[thread] = n + 1;
+
+        if (strlen(rawstr + padding) != testLogPaddingLen(n) ||
+            !STRPREFIX(testLogPadding, rawstr + padding))
+            capture.corrupted = true;
+
+        capture.nmsgs++;
+    }
+
+    while (capture.gated) {
+        capture.blocked = true;
+        virCondBroadcast(&capture.cond);
+        ignore_value(virCondWait(&capture.cond, &capture.lock));
+    }
+    capture.blocked = false;
+
+    virMutexUnlock(&capture.lock);
+}
+
+/* Always log from the same spot, the filter cache is keyed on it */
+static void
+testLogEmit(unsigned int thread, int n)
+{
+    virLogMessage(VIR_LOG_FROM_FILE, VIR_LOG_INFO, __FILE__, __LINE__,
+                  __func__, NULL, "test %u %d %.*s", thread, n,
+                  testLogPaddingLen(n), testLogPadding);
+}
+
+/* Bring logging back to a known state, without any filters */
+static int
+testLogReset(void)
+{
+    if (virLogReset() < 0 ||
+        virLogSetDefaultPriority(VIR_LOG_DEBUG) < 0 ||
+        virLogDefineOutput(testLogOutput, NULL, NULL, VIR_LOG_DEBUG,
+                           VIR_LOG_TO_STDERR, NULL, 0) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+testLogSetup(void)
+{
+    virMutexLock(&capture.lock);
+    memset(capture.next, 0, sizeof(*capture.next) * NTHREADS);
+    capture.nmsgs = 0;
+    capture.dropped = 0;
+    capture.misordered = false;
+    capture.corrupted = false;
+    capture.gated = false;
+    capture.blocked = false;
+    virMutexUnlock(&capture.lock);
+
+    return testLogReset();
+}
+
+static int
+testLogCheck(size_t expected, size_t shown)
+{
+    int ret = 0;
+
+    virMutexLock(&capture.lock);
+    if (capture.misordered) {
+        virFilePrintf(stderr, "Messages were written out of order\n");
+        ret = -1;
+    }
+    if (capture.corrupted) {
+        virFilePrintf(stderr, "Messages were garbled\n");
+        ret = -1;
+    }
+    if (capture.nmsgs + capture.dropped != expected) {
+        virFilePrintf(stderr, "Got %zu messages and %zu dropped, "
+                      "expected %zu in total\n",
+                      capture.nmsgs, capture.dropped, expected);
+        ret = -1;
+    }
+    if (capture.nmsgs < shown) {
+        virFilePrintf(stderr, "Only %zu messages written out, "
+                      "expected at least %zu\n", capture.nmsgs, shown);
+        ret = -1;
+    }
+    virMutexUnlock(&capture.lock);
+
+    return ret;
+}
+
+static void
+testLogThread(void *opaque)
+{
+    unsigned int thread = *(unsigned int *) opaque;
+    int n;
+
+    for (n = 0; n < NMSGS; n++)
+        testLogEmit(thread, n);
+}
+
+/*
+ * Several threads logging concurrently through the writer thread: each
+ * thread's messages must come out complete and in the order they were
+ * logged, and anything missing must be accounted for as dropped.
+ */
+static int
+testLogAsyncOrder(const void *data ATTRIBUTE_UNUSED)
+{
+    virThread threads[NTHREADS];
+    unsigned int ids[NTHREADS];
+    size_t i;
+    int ret = -1;
+
+    if (testLogSetup() < 0 ||
+        virLogSetAsync(true) < 0)
+        goto cleanup;
+
+    for (i = 0; i < NTHREADS; i++) {
+        ids[i] = i;
+        if (virThreadCreate(&threads[i], true, testLogThread, &ids[i]) < 0) {
+            while (i-- > 0)
+                virThreadJoin(&threads[i]);
+            goto cleanup;
+        }
+    }
+    for (i = 0; i < NTHREADS; i++)
+        virThreadJoin(&threads[i]);
+
+    /* Waits until everything queued is written out */
+    if (virLogSetAsync(false) < 0)
+        goto cleanup;
+
+    ret = testLogCheck(NTHREADS * NMSGS, 1);
+
+cleanup:
+    virLogReset();
+    return ret;
+}
+
+/*
+ * Hold the writer thread inside the output while logging more than
+ * fits in a ring, so that messages get dropped, then let it go and
+ * keep logging so the ring wraps around after having been full.
+ */
+static int
+testLogAsyncDrops(const void *data ATTRIBUTE_UNUSED)
+{
+    int n = 0;
+    int ret = -1;
+
+    if (testLogSetup() < 0 ||
+        virLogSetAsync(true) < 0)
+        goto cleanup;
+
+    virMutexLock(&capture.lock);
+    capture.gated = true;
+    virMutexUnlock(&capture.lock);
+
+    testLogEmit(0, n++);
+
+    virMutexLock(&capture.lock);
+    while (!capture.blocked)
+        ignore_value(virCondWait(&capture.cond, &capture.lock));
+    virMutexUnlock(&capture.lock);
+
+    for (; n < NMSGS; n++)
+        testLogEmit(0, n);
+
+    virMutexLock(&capture.lock);
+    capture.gated = false;
+    virCondBroadcast(&capture.cond);
+    virMutexUnlock(&capture.lock);
+
+    for (; n < 2 * NMSGS; n++)
+        testLogEmit(0, n);
+
+    if (virLogSetAsync(false) < 0)
+        goto cleanup;
+
+    if (testLogCheck(2 * NMSGS, 1) < 0)
+        goto cleanup;
+
+    if (capture.dropped == 0) {
+        virFilePrintf(stderr, "No messages reported as dropped\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexLock(&capture.lock);
+    capture.gated = false;
+    virCondBroadcast(&capture.cond);
+    virMutexUnlock(&capture.lock);
+    virLogReset();
+    return ret;
+}
+
+/*
+ * Filter matches are cached per source file, check that changing the
+ * filters is noticed the very next time the same file logs something.
+ */
+static int
+testLogFilterCache(const void *data ATTRIBUTE_UNUSED)
+{
+    static const struct {
+        virLogPriority priority; /* 0 means resetting the filters */
+        bool shown;
+    } steps[] = {
+        { VIR_LOG_ERROR, false },
+        { VIR_LOG_DEBUG, true },
+        { VIR_LOG_WARN, false },
+        { 0, true },
+        { VIR_LOG_INFO, true },
+        { VIR_LOG_ERROR, false },
+    };
+    size_t shown = 0;
+    size_t i;
+    int ret = -1;
+
+    if (testLogSetup() < 0)
+        goto cleanup;
+
+    for (i = 0; i < ARRAY_CARDINALITY(steps); i++) {
+        if (steps[i].priority == 0) {
+            if (testLogReset() < 0)
+                goto cleanup;
+        } else {
+            if (virLogDefineFilter("virlogtest", steps[i].priority, 0) < 0)
+                goto cleanup;
+        }
+
+        /* Twice, so the second one is answered from the cache */
+        testLogEmit(0, 2 * i);
+        testLogEmit(0, 2 * i + 1);
+        if (steps[i].shown)
+            shown += 2;
+
+        if (capture.nmsgs != shown) {
+            virFilePrintf(stderr, "Step %zu: %zu messages written out, "
+                          "expected %zu\n", i, capture.nmsgs, shown);
+            goto cleanup;
+        }
+    }
+
+    ret = testLogCheck(shown, shown);
+
+cleanup:
+    virLogReset();
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virMutexInit(&capture.lock) < 0 ||
+        virCondInit(&capture.cond) < 0 ||
+        VIR_ALLOC_N(capture.next, NTHREADS) < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Async ordering", 1, testLogAsyncOrder, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Async drops", 1, testLogAsyncDrops, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Filter cache", 1, testLogFilterCache, NULL) < 0)
+        ret = -1;
+
+    VIR_FREE(capture.next);
+    virCondDestroy(&capture.cond);
+    virMutexDestroy(&capture.lock);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,682 @@
+/*
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virstring.h"
+#include "virthread.h"
+
+#include "rpc/virnetclient.h"
+#include "rpc/virnetclientprogram.h"
+#include "rpc/virnetprotocol.h"
+
+#define VIR_FROM_THIS VIR_FROM_RPC
+
+#define TEST_PROGRAM 0x11223344
+#define TEST_PROC_DOUBLE 1      /* replies with twice its argument */
+#define TEST_PROC_FAIL 2        /* replies with an error */
+#define TEST_ERROR_MESSAGE "procedure failed on purpose"
+
+#define SCRATCHDIRTEMPLATE abs_builddir "/virnetclientdata-XXXXXX"
+
+static char *scratchdir;
+static virNetClientProgramPtr program;
+
+/*
+ * The server side of the connection. It reads calls in batches and
+ * replies to each batch in reverse order, so replies never come back
+ * in the order the calls were sent. It stops answering after
+ * @nreplies replies, and then hangs up if @hangup is set, or waits
+ * for the client to go away otherwise.
+ */
+struct testServer {
+    int listenfd;
+    size_t ncalls;
+    size_t batch;
+    size_t nreplies;
+    bool hangup;
+    size_t nreceived;
+    bool failed;
+};
+
+/* One call made by the client, and what became of it */
+struct testCall {
+    unsigned serial;
+    int proc;
+    int arg;
+    int ret;
+    int rv;
+    int errcode;
+    bool done;
+    bool chain;                 /* issue another call from the callback */
+};
+
+static virNetMessagePtr
+testServerReadCall(int fd)
+{
+    virNetMessagePtr msg;
+
+    if (!(msg = virNetMessageNew(false)))
+        return NULL;
+
+    msg->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
+    if (virNetMessageReserveBuffer(msg, msg->bufferLength) < 0 ||
+        saferead(fd, msg->buffer, msg->bufferLength) != msg->bufferLength ||
+        virNetMessageDecodeLength(msg) < 0 ||
+        saferead(fd, msg->buffer + msg->bufferOffset,
+                 msg->bufferLength - msg->bufferOffset) !=
+        msg->bufferLength - msg->bufferOffset ||
+        virNetMessageDecodeHeader(msg) < 0) {
+        virNetMessageFree(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+static int
+testServerReply(int fd, virNetMessagePtr msg)
+{
+    virNetMessageError rerr;
+    int arg;
+    int ret;
+    int rv = -1;
+
+    if (virNetMessageDecodePayload(msg, (xdrproc_t)xdr_int, &arg) < 0)
+        return -1;
+
+    memset(&rerr, 0, sizeof(rerr));
+    msg->header.type = VIR_NET_REPLY;
+
+    if (msg->header.proc == TEST_PROC_FAIL) {
+        msg->header.status = VIR_NET_ERROR;
+        virReportError(VIR_ERR_OPERATION_FAILED, "%s", TEST_ERROR_MESSAGE);
+        virNetMessageSaveError(&rerr);
+        virResetLastError();
+        if (virNetMessageEncodeHeader(msg) < 0 ||
+            virNetMessageEncodePayload(msg, (xdrproc_t)xdr_virNetMessageError,
+                                       &rerr) < 0)
+            goto cleanup;
+    } else {
+        msg->header.status = VIR_NET_OK;
+        ret = arg * 2;
+        if (virNetMessageEncodeHeader(msg) < 0 ||
+            virNetMessageEncodePayload(msg, (xdrproc_t)xdr_int, &ret) < 0)
+            goto cleanup;
+    }
+
+    if (safewrite(fd, msg->buffer, msg->bufferLength) != msg->bufferLength)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    xdr_free((xdrproc_t)xdr_virNetMessageError, (void *)&rerr);
+    return rv;
+}
+
+static void
+testServerRun(void *opaque)
+{
+    struct testServer *server = opaque;
+    virNetMessagePtr *calls = NULL;
+    size_t nreplies = 0;
+    size_t i;
+    int fd;
+    char c;
+
+    if ((fd = accept(server->listenfd, NULL, NULL)) < 0 ||
+        VIR_ALLOC_N(calls, server->batch) < 0)
+        goto error;
+
+    while (server->nreceived < server->ncalls) {
+        size_t n = 0;
+
+        while (n < server->batch) {
+            if (!(calls[n] = testServerReadCall(fd)))
+                goto error;
+            n++;
+            server->nreceived++;
+        }
+
+        while (n > 0 && nreplies < server->nreplies) {
+            n--;
+            if (testServerReply(fd, calls[n]) < 0)
+                goto error;
+            virNetMessageFree(calls[n]);
+            calls[n] = NULL;
+            nreplies++;
+        }
+
+        for (i = 0; i < n; i++) {
+            virNetMessageFree(calls[i]);
+            calls[i] = NULL;
+        }
+
+        if (server->hangup && nreplies == server->nreplies)
+            goto cleanup;
+    }
+
+    while (saferead(fd, &c, 1) == 1)
+        ;
+
+cleanup:
+    if (calls) {
+        for (i = 0; i < server->batch; i++)
+            virNetMessageFree(calls[i]);
+    }
+    VIR_FREE(calls);
+    VIR_FORCE_CLOSE(fd);
+    return;
+
+error:
+    server->failed = true;
+    goto cleanup;
+}
+
+static virNetClientPtr
+testClientNew(struct testServer *server,
+              virThreadPtr thread,
+              size_t ncalls,
+              size_t batch,
+              size_t nreplies,
+              bool hangup)
+{
+    struct sockaddr_un addr;
+    virNetClientPtr client = NULL;
+    char *path = NULL;
+
+    memset(server, 0, sizeof(*server));
+    server->ncalls = ncalls;
+    server->batch = batch;
+    server->nreplies = nreplies;
+    server->hangup = hangup;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (virAsprintf(&path, "%s/sock", scratchdir) < 0)
+        return NULL;
+    if (virStrcpyStatic(addr.sun_path, path) == NULL) {
+        virFilePrintf(stderr, "Socket path %s is too long\n", path);
+        goto cleanup;
+    }
+
+    unlink(path);
+    if ((server->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(server->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->listenfd, 1) < 0) {
+        virFilePrintf(stderr, "Cannot listen on %s\n", path);
+        VIR_FORCE_CLOSE(server->listenfd);
+        goto cleanup;
+    }
+
+    if (virThreadCreate(thread, true, testServerRun, server) < 0) {
+        VIR_FORCE_CLOSE(server->listenfd);
+        goto cleanup;
+    }
+
+    if (!(client = virNetClientNewUNIX(path, false, NULL))) {
+        /* Let the server thread out of accept() */
+        shutdown(server->listenfd, SHUT_RDWR);
+        virThreadJoin(thread);
+        VIR_FORCE_CLOSE(server->listenfd);
+    }
+
+cleanup:
+    VIR_FREE(path);
+    return client;
+}
+
+static int
+testClientFree(struct testServer *server,
+               virThreadPtr thread,
+               virNetClientPtr client)
+{
+    virNetClientClose(client);
+    virObjectUnref(client);
+    virThreadJoin(thread);
+    VIR_FORCE_CLOSE(server->listenfd);
+
+    if (server->failed) {
+        virFilePrintf(stderr, "Server failed after %zu calls\n",
+                      server->nreceived);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int testCallIssue(virNetClientPtr client, struct testCall *call);
+
+static void
+testCallDone(virNetClientProgramPtr prog ATTRIBUTE_UNUSED,
+             virNetClientPtr client,
+             int rv,
+             void *ret ATTRIBUTE_UNUSED,
+             void *opaque)
+{
+    struct testCall *call = opaque;
+    virErrorPtr err = virGetLastError();
+
+    call->done = true;
+    call->rv = rv;
+    call->errcode = rv < 0 && err ? err->code : VIR_ERR_OK;
+
+    if (call->chain) {
+        /* Reuse the slot for a follow-up call */
+        call->chain = false;
+        call->done = false;
+        call->serial += 1000;
+        call->arg += 1000;
+        if (testCallIssue(client, call) < 0)
+            call->errcode = -1;
+    }
+}
+
+static int
+testCallIssue(virNetClientPtr client, struct testCall *call)
+{
+    call->ret = 0;
+    return virNetClientProgramCallAsync(program, client,
+                                        call->serial, call->proc,
+                                        (xdrproc_t)xdr_int, (char *)&call->arg,
+                                        (xdrproc_t)xdr_int, (char *)&call->ret,
+                                        testCallDone, call);
+}
+
+static void
+testCallInit(struct testCall *calls, size_t ncalls, bool chain)
+{
+    size_t i;
+
+    memset(calls, 0, sizeof(*calls) * ncalls);
+    for (i = 0; i < ncalls; i++) {
+        calls[i].serial = i + 1;
+        calls[i].proc = TEST_PROC_DOUBLE;
+        calls[i].arg = i;
+        calls[i].chain = chain;
+    }
+}
+
+static int
+testCallCheckOK(struct testCall *call)
+{
+    if (!call->done) {
+        virFilePrintf(stderr, "Call %u never completed\n", call->serial);
+        return -1;
+    }
+    if (call->rv < 0) {
+        virFilePrintf(stderr, "Call %u failed with error %d\n",
+                      call->serial, call->errcode);
+        return -1;
+    }
+    if (call->ret != call->arg * 2) {
+        virFilePrintf(stderr, "Call %u got %d, expected %d\n",
+                      call->serial, call->ret, call->arg * 2);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+testCallCheckFailed(struct testCall *call, int errcode)
+{
+    if (!call->done) {
+        virFilePrintf(stderr, "Call %u never completed\n", call->serial);
+        return -1;
+    }
+    if (call->rv == 0 || call->errcode != errcode) {
+        virFilePrintf(stderr, "Call %u completed with %d, error %d, "
+                      "expected error %d\n",
+                      call->serial, call->rv, call->errcode, errcode);
+        return -1;
+    }
+    return 0;
+}
+
+
+#define NCALLS 100
+
+/*
+ * Pipeline a lot of calls, with every reply coming back in the
+ * opposite order of its call. Each reply must reach its own call.
+ */
+static int
+testOutOfOrder(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testServer server;
+    struct testCall calls[NCALLS];
+    virNetClientPtr client;
+    virThread thread;
+    size_t i;
+    int ret = -1;
+
+    if (!(client = testClientNew(&server, &thread, NCALLS, NCALLS, NCALLS, false)))
+        return -1;
+
+    testCallInit(calls, NCALLS, false);
+    for (i = 0; i < NCALLS; i++) {
+        if (testCallIssue(client, &calls[i]) < 0)
+            goto cleanup;
+    }
+
+    if (virNetClientWaitAsync(client) < 0)
+        goto cleanup;
+
+    for (i = 0; i < NCALLS; i++) {
+        if (testCallCheckOK(&calls[i]) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (testClientFree(&server, &thread, client) < 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * The server hangs up with half of the calls unanswered. Those must
+ * still get their callback, with an error, and the connection must
+ * refuse further calls.
+ */
+static int
+testServerClose(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testServer server;
+    struct testCall calls[10];
+    struct testCall extra;
+    virNetClientPtr client;
+    virThread thread;
+    size_t i;
+    int ret = -1;
+
+    if (!(client = testClientNew(&server, &thread, 10, 10, 5, true)))
+        return -1;
+
+    testCallInit(calls, 10, false);
+    for (i = 0; i < 10; i++) {
+        if (testCallIssue(client, &calls[i]) < 0)
+            goto cleanup;
+    }
+
+    if (virNetClientWaitAsync(client) == 0) {
+        virFilePrintf(stderr, "Waiting did not notice the hang up\n");
+        goto cleanup;
+    }
+    virResetLastError();
+
+    /* The last five calls were answered first */
+    for (i = 0; i < 5; i++) {
+        if (testCallCheckFailed(&calls[i], VIR_ERR_INTERNAL_ERROR) < 0)
+            goto cleanup;
+    }
+    for (i = 5; i < 10; i++) {
+        if (testCallCheckOK(&calls[i]) < 0)
+            goto cleanup;
+    }
+
+    testCallInit(&extra, 1, false);
+    if (testCallIssue(client, &extra) == 0) {
+        virFilePrintf(stderr, "Call accepted on a closed connection\n");
+        goto cleanup;
+    }
+    virResetLastError();
+
+    if (extra.done) {
+        virFilePrintf(stderr, "Callback run for a call which was refused\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (testClientFree(&server, &thread, client) < 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * The client closes the connection itself while calls are in flight
+ * and nobody waits for them: closing must complete them with an error.
+ */
+static int
+testClientClose(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testServer server;
+    struct testCall calls[10];
+    virNetClientPtr client;
+    virThread thread;
+    size_t i;
+    int ret = -1;
+
+    /* The server reads the calls but answers none of them */
+    if (!(client = testClientNew(&server, &thread, 10, 10, 0, false)))
+        return -1;
+
+    testCallInit(calls, 10, false);
+    for (i = 0; i < 10; i++) {
+        if (testCallIssue(client, &calls[i]) < 0)
+            goto cleanup;
+    }
+
+    virNetClientClose(client);
+
+    for (i = 0; i < 10; i++) {
+        if (testCallCheckFailed(&calls[i], VIR_ERR_INTERNAL_ERROR) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (testClientFree(&server, &thread, client) < 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * Every callback issues a new call. The server only replies once it
+ * got a full batch, so the second batch only exists because of the
+ * callbacks, and waiting must cover it too.
+ */
+static int
+testCallbackCalls(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testServer server;
+    struct testCall calls[10];
+    virNetClientPtr client;
+    virThread thread;
+    size_t i;
+    int ret = -1;
+
+    if (!(client = testClientNew(&server, &thread, 20, 10, 20, false)))
+        return -1;
+
+    testCallInit(calls, 10, true);
+    for (i = 0; i < 10; i++) {
+        if (testCallIssue(client, &calls[i]) < 0)
+            goto cleanup;
+    }
+
+    if (virNetClientWaitAsync(client) < 0)
+        goto cleanup;
+
+    for (i = 0; i < 10; i++) {
+        if (calls[i].serial != i + 1001 ||
+            testCallCheckOK(&calls[i]) < 0) {
+            virFilePrintf(stderr, "Follow-up of call %zu did not complete\n",
+                          i + 1);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    if (testClientFree(&server, &thread, client) < 0)
+        ret = -1;
+    return ret;
+}
+
+struct testSyncCall {
+    virNetClientPtr client;
+    int arg;
+    int ret;
+    int rv;
+};
+
+static void
+testSyncCallRun(void *opaque)
+{
+    struct testSyncCall *synccall = opaque;
+
+    synccall->rv = virNetClientProgramCall(program, synccall->client, 9999,
+                                           TEST_PROC_DOUBLE,
+                                           0, NULL, NULL, NULL,
+                                           (xdrproc_t)xdr_int,
+                                           (char *)&synccall->arg,
+                                           (xdrproc_t)xdr_int,
+                                           (char *)&synccall->ret);
+}
+
+/*
+ * A thread making a synchronous call, and so driving the connection
+ * for a while, while this one waits for the async calls. The reply
+ * to the synchronous call arrives in the middle of the others, and
+ * one of the async calls gets an error from the server.
+ */
+static int
+testBarrierRace(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testServer server;
+    struct testCall calls[20];
+    struct testSyncCall synccall;
+    virNetClientPtr client;
+    virThread thread;
+    virThread syncthread;
+    bool syncstarted = false;
+    size_t i;
+    int ret = -1;
+
+    if (!(client = testClientNew(&server, &thread, 21, 21, 21, false)))
+        return -1;
+
+    testCallInit(calls, 20, false);
+    calls[15].proc = TEST_PROC_FAIL;
+
+    memset(&synccall, 0, sizeof(synccall));
+    synccall.client = client;
+    synccall.arg = 77;
+    synccall.rv = -2;
+
+    for (i = 0; i < 20; i++) {
+        if (i == 10) {
+            if (virThreadCreate(&syncthread, true,
+                                testSyncCallRun, &synccall) < 0)
+                goto cleanup;
+            syncstarted = true;
+        }
+        if (testCallIssue(client, &calls[i]) < 0)
+            goto cleanup;
+    }
+
+    if (virNetClientWaitAsync(client) < 0)
+        goto cleanup;
+
+    virThreadJoin(&syncthread);
+    syncstarted = false;
+
+    if (synccall.rv < 0 || synccall.ret != synccall.arg * 2) {
+        virFilePrintf(stderr, "Synchronous call returned %d, got %d\n",
+                      synccall.rv, synccall.ret);
+        goto cleanup;
+    }
+
+    for (i = 0; i < 20; i++) {
+        if (i == 15) {
+            if (testCallCheckFailed(&calls[i], VIR_ERR_OPERATION_FAILED) < 0)
+                goto cleanup;
+        } else {
+            if (testCallCheckOK(&calls[i]) < 0)
+                goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    if (syncstarted) {
+        /* Fails the synchronous call if it is still waiting */
+        virNetClientClose(client);
+        virThreadJoin(&syncthread);
+    }
+    if (testClientFree(&server, &thread, client) < 0)
+        ret = -1;
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    char template[] = SCRATCHDIRTEMPLATE;
+    int ret = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!(scratchdir = mkdtemp(template))) {
+        virFilePrintf(stderr, "Cannot create scratch dir\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!(program = virNetClientProgramNew(TEST_PROGRAM, 1, NULL, 0, NULL)))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Out of order replies", 1, testOutOfOrder, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Server close", 1, testServerClose, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Client close", 1, testClientClose, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Calls from callbacks", 1, testCallbackCalls, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Barrier and sync call", 1, testBarrierRace, NULL) < 0)
+        ret = -1;
+
+    virObjectUnref(program);
+
+    if (getenv("LIBVIRT_SKIP_CLEANUP") == NULL)
+        virFileDeleteTree(scratchdir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -513,6 +513,203 @@ cleanup:
 }
 
 
+static int testMessagePayloadStreamRefEncode(const void *args ATTRIBUTE_UNUSED)
+{
+    virNetMessagePtr msg = virNetMessageNew(true);
+    static const char expect[] = {
+        0x00, 0x01, 0x00, 0x1c,  /* Length */
+        0x11, 0x22, 0x33, 0x44,  /* Program */
+        0x00, 0x00, 0x00, 0x01,  /* Version */
+        0x00, 0x00, 0x06, 0x66,  /* Procedure */
+        0x00, 0x00, 0x00, 0x03,  /* Type */
+        0x00, 0x00, 0x00, 0x99,  /* Serial */
+        0x00, 0x00, 0x00, 0x02,  /* Status */
+    };
+    char *stream = NULL;
+    size_t len = 65536;
+    struct iovec iov[2];
+    size_t niov;
+    int ret = -1;
+
+    if (!msg)
+        return -1;
+
+    if (VIR_ALLOC_N(stream, len) < 0)
+        goto cleanup;
+    memset(stream, 'x', len);
+
+    msg->header.prog = 0x11223344;
+    msg->header.vers = 0x01;
+    msg->header.proc = 0x666;
+    msg->header.type = VIR_NET_STREAM;
+    msg->header.serial = 0x99;
+    msg->header.status = VIR_NET_CONTINUE;
+
+    if (virNetMessageEncodeHeader(msg) < 0)
+        goto cleanup;
+
+    if (virNetMessageEncodePayloadRef(msg, stream, len, true) < 0) {
+        stream = NULL;
+        goto cleanup;
+    }
+    stream = NULL;
+
+    if (msg->bufferLength != sizeof(expect) + len) {
+        VIR_DEBUG("Expect message length %zu got %zu",
+                  sizeof(expect) + len, msg->bufferLength);
+        goto cleanup;
+    }
+
+    if (memcmp(expect, msg->buffer, sizeof(expect)) != 0) {
+        virtTestDifferenceBin(stderr, expect, msg->buffer, sizeof(expect));
+        goto cleanup;
+    }
+
+    /* Header and payload are gathered from separate buffers */
+    msg->bufferOffset = 8;
+    niov = virNetMessageGetIOV(msg, iov);
+    if (niov != 2 ||
+        iov[0].iov_base != msg->buffer + 8 ||
+        iov[0].iov_len != sizeof(expect) - 8 ||
+        iov[1].iov_base != msg->payload ||
+        iov[1].iov_len != len) {
+        VIR_DEBUG("Unexpected iov for partial header");
+        goto cleanup;
+    }
+
+    msg->bufferOffset = sizeof(expect) + 100;
+    niov = virNetMessageGetIOV(msg, iov);
+    if (niov != 1 ||
+        iov[0].iov_base != msg->payload + 100 ||
+        iov[0].iov_len != len - 100) {
+        VIR_DEBUG("Unexpected iov for partial payload");
+        goto cleanup;
+    }
+
+    msg->bufferOffset = msg->bufferLength;
+    if (virNetMessageGetIOV(msg, iov) != 0) {
+        VIR_DEBUG("Unexpected iov for complete message");
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    VIR_FREE(stream);
+    virNetMessageFree(msg);
+    return ret;
+}
+
+static int testMessageBufferPool(const void *args ATTRIBUTE_UNUSED)
+{
+    virNetMessagePtr msg = virNetMessageNew(true);
+    char *buffer;
+    int ret = -1;
+
+    if (!msg)
+        return -1;
+
+    if (virNetMessageReserveBuffer(msg, 100) < 0)
+        goto cleanup;
+    buffer = msg->buffer;
+    memcpy(buffer, "libvirt", 8);
+
+    /* Growing must keep the contents */
+    if (virNetMessageReserveBuffer(msg, VIR_NET_MESSAGE_INITIAL) < 0)
+        goto cleanup;
+    if (msg->bufferSize < VIR_NET_MESSAGE_INITIAL ||
+        STRNEQ(msg->buffer, "libvirt")) {
+        VIR_DEBUG("Buffer contents lost on growth");
+        goto cleanup;
+    }
+
+    /* The small buffer went back to the pool and is reused */
+    virNetMessageReleaseBuffer(msg);
+    if (virNetMessageReserveBuffer(msg, 200) < 0)
+        goto cleanup;
+    if (msg->buffer != buffer) {
+        VIR_DEBUG("Expected pooled buffer %p got %p", buffer, msg->buffer);
+        goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    virNetMessageFree(msg);
+    return ret;
+}
+
+
+struct testMessageBenchData {
+    char *stream;
+    size_t len;
+    bool ref;
+};
+
+static int
+testMessageBenchRun(size_t idx, void *opaque)
+{
+    struct testMessageBenchData *data = opaque;
+    virNetMessagePtr msg;
+    int rc;
+
+    if (!(msg = virNetMessageNew(false)))
+        return -1;
+
+    msg->header.prog = 0x11223344;
+    msg->header.vers = 0x01;
+    msg->header.proc = 0x666;
+    msg->header.type = VIR_NET_STREAM;
+    msg->header.serial = idx;
+    msg->header.status = VIR_NET_CONTINUE;
+
+    if ((rc = virNetMessageEncodeHeader(msg)) == 0) {
+        if (data->ref)
+            rc = virNetMessageEncodePayloadRef(msg, data->stream, data->len,
+                                               false);
+        else
+            rc = virNetMessageEncodePayloadRaw(msg, data->stream, data->len);
+    }
+    virNetMessageFree(msg);
+    return rc;
+}
+
+/*
+ * Encode stream packets the way the daemon sends them, copying
+ * the data into the message buffer and referencing it in place.
+ * With debug enabled the throughput of both is reported.
+ */
+static int testMessageBenchmark(const void *args ATTRIBUTE_UNUSED)
+{
+    size_t rounds = virTestGetExpensive() ? 20000 : 200;
+    struct testMessageBenchData data = { NULL, 256 * 1024, false };
+    size_t mode;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(data.stream, data.len) < 0)
+        return -1;
+    memset(data.stream, 'x', data.len);
+
+    for (mode = 0; mode < 2; mode++) {
+        unsigned long long elapsed;
+
+        data.ref = mode == 1;
+        if (virtTestBenchmark(rounds, testMessageBenchRun,
+                              &data, &elapsed) < 0)
+            goto cleanup;
+
+        VIR_TEST_DEBUG("\n%s: %llu MB/s", data.ref ? " ref" : "copy",
+                       (unsigned long long)(rounds * (data.len / 1024)) /
+                       (elapsed + 1));
+    }
+
+    VIR_TEST_DEBUG("\n");
+
+    ret = 0;
+cleanup:
+    VIR_FREE(data.stream);
+    return ret;
+}
+
+
 static int
 mymain(void)
 {
@@ -535,6 +732,15 @@ mymain(void)
     if (virtTestRun("Message Payload Stream Encode", 1, testMessagePayloadStreamEncode, NULL) < 0)
         ret = -1;
 
+    if (virtTestRun("Message Payload Stream Ref Encode", 1, testMessagePayloadStreamRefEncode, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Message Buffer Pool", 1, testMessageBufferPool, NULL) < 0)
+        ret = -1;
+
+    if (virtTestRun("Message Benchmark", 1, testMessageBenchmark, NULL) < 0)
+        ret = -1;
+
     return ret==0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -21,9 +21,12 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include "testutils.h"
 #include "vircommand.h"
+#include "virendian.h"
 #include "virerror.h"
 #include "virfile.h"
 #include "virlog.h"
@@ -295,6 +298,93 @@ cleanup:
     return ret;
 }
 
+/* Rewrite the backing file name in the header of the qcow2 image at
+ * PATH without changing its size, then set its timestamps to WHEN */
+static int
+testStorageCacheRewrite(const char *path, const char *backing, time_t when)
+{
+    unsigned char header[20];
+    unsigned long long offset;
+    struct timeval tv[2];
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return -1;
+
+    if (saferead(fd, header, sizeof(header)) != sizeof(header))
+        goto cleanup;
+
+    offset = virReadBufInt64BE(header + 8);
+    if (virReadBufInt32BE(header + 16) != strlen(backing)) {
+        fprintf(stderr, "unexpected backing name length in %s\n", path);
+        goto cleanup;
+    }
+
+    if (lseek(fd, offset, SEEK_SET) < 0 ||
+        safewrite(fd, backing, strlen(backing)) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    tv[0].tv_sec = tv[1].tv_sec = when;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    if (utimes(path, tv) < 0)
+        goto cleanup;
+
+    ret = 0;
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    return ret;
+}
+
+static int
+testStorageCacheCheck(const char *path, const char *expBacking)
+{
+    virStorageFileMetadataPtr meta;
+    int ret = 0;
+
+    if (!(meta = virStorageFileGetMetadata(path, VIR_STORAGE_FILE_QCOW2,
+                                           -1, -1, false)))
+        return -1;
+
+    if (STRNEQ_NULLABLE(meta->backingStoreRaw, expBacking)) {
+        fprintf(stderr, "expected backing '%s', got '%s'\n",
+                expBacking, NULLSTR(meta->backingStoreRaw));
+        ret = -1;
+    }
+
+    virStorageFileFreeMetadata(meta);
+    return ret;
+}
+
+static int
+testStorageCache(const void *args)
+{
+    const char *path = args;
+
+    /* Old timestamps, so that the image is eligible for caching */
+    if (testStorageCacheRewrite(path, "raw", 1000000000) < 0 ||
+        testStorageCacheCheck(path, "raw") < 0)
+        return -1;
+
+    /* A rewrite keeping size and timestamps is not noticed... */
+    if (testStorageCacheRewrite(path, "qed", 1000000000) < 0 ||
+        testStorageCacheCheck(path, "raw") < 0)
+        return -1;
+
+    /* ... until the cache is told about it */
+    virStorageFileMetadataCacheInvalidate(path);
+    if (testStorageCacheCheck(path, "qed") < 0)
+        return -1;
+
+    /* A new timestamp is enough on its own */
+    if (testStorageCacheRewrite(path, "raw", 1000000001) < 0 ||
+        testStorageCacheCheck(path, "raw") < 0)
+        return -1;
+
+    return 0;
+}
+
 static int
 mymain(void)
 {
@@ -551,6 +641,16 @@ mymain(void)
                chain13c, ALLOW_PROBE | EXP_PASS);
 #endif
 
+    /* Metadata of unchanged images is cached */
+    virCommandFree(cmd);
+    cmd = virCommandNewArgList(qemuimg, "create", "-f", "qcow2",
+                               "-obacking_file=raw,backing_fmt=raw", "cache",
+                               NULL);
+    if (virCommandRun(cmd, NULL) < 0 ||
+        virtTestRun("Storage metadata cache", 1, testStorageCache,
+                    datadir "/cache") < 0)
+        ret = -1;
+
     /* Final cleanup */
     testCleanupImages();
     virCommandFree(cmd);
@@ -0,0 +1,219 @@
+/*
+ * virthreadpooltest.c: Test the thread pool
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "testutils.h"
+
+#include "virthread.h"
+#include "virthreadpool.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_NONE
+
+struct testPoolData {
+    virMutex lock;
+    virCond cond;
+    bool release;    /* let slow jobs finish */
+    size_t running;  /* slow jobs currently running */
+    size_t done;     /* jobs finished */
+};
+
+/* Jobs with non-NULL data block until released */
+static void
+testPoolJob(void *jobdata, void *opaque)
+{
+    struct testPoolData *data = opaque;
+
+    virMutexLock(&data->lock);
+    if (jobdata) {
+        data->running++;
+        virCondBroadcast(&data->cond);
+        while (!data->release)
+            ignore_value(virCondWait(&data->cond, &data->lock));
+        data->running--;
+    }
+    data->done++;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+/* Wait up to 5 seconds for @field to reach @value */
+static int
+testPoolWait(struct testPoolData *data, size_t *field, size_t value)
+{
+    unsigned long long deadline;
+    int ret = 0;
+
+    if (virTimeMillisNowRaw(&deadline) < 0)
+        return -1;
+    deadline += 5000;
+
+    virMutexLock(&data->lock);
+    while (*field < value) {
+        if (virCondWaitUntil(&data->cond, &data->lock, deadline) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    virMutexUnlock(&data->lock);
+    return ret;
+}
+
+static int
+testPoolInit(struct testPoolData *data)
+{
+    memset(data, 0, sizeof(*data));
+    if (virMutexInit(&data->lock) < 0)
+        return -1;
+    if (virCondInit(&data->cond) < 0) {
+        virMutexDestroy(&data->lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+testPoolRelease(struct testPoolData *data)
+{
+    virMutexLock(&data->lock);
+    data->release = true;
+    virCondBroadcast(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+static void
+testPoolFinish(struct testPoolData *data)
+{
+    virMutexDestroy(&data->lock);
+    ignore_value(virCondDestroy(&data->cond));
+}
+
+
+static int
+testRunAll(const void *opaque ATTRIBUTE_UNUSED)
+{
+    struct testPoolData data;
+    virThreadPoolPtr pool;
+    size_t i;
+    int ret = -1;
+
+    if (testPoolInit(&data) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(0, 4, 1, testPoolJob, &data)))
+        goto cleanup;
+
+    for (i = 0; i < 100; i++) {
+        if (virThreadPoolSendJob(pool, i % VIR_THREAD_POOL_JOB_LAST,
+                                 NULL) < 0)
+            goto cleanup;
+    }
+
+    if (testPoolWait(&data, &data.done, 100) < 0)
+        goto cleanup;
+
+    if (virThreadPoolGetCurrentWorkers(pool) > 4 ||
+        virThreadPoolGetJobQueueDepth(pool) != 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virThreadPoolFree(pool);
+    testPoolFinish(&data);
+    return ret;
+}
+
+
+/*
+ * With four workers, at most three may be busy with normal jobs,
+ * so a fast job still gets through while the normal lane is
+ * saturated.
+ */
+static int
+testFastLane(const void *opaque ATTRIBUTE_UNUSED)
+{
+    struct testPoolData data;
+    virThreadPoolPtr pool = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (testPoolInit(&data) < 0)
+        return -1;
+
+    if (!(pool = virThreadPoolNew(4, 4, 0, testPoolJob, &data)))
+        goto cleanup;
+
+    for (i = 0; i < 6; i++) {
+        if (virThreadPoolSendJob(pool, VIR_THREAD_POOL_JOB_NORMAL,
+                                 &data) < 0)
+            goto cleanup;
+    }
+
+    if (testPoolWait(&data, &data.running, 3) < 0)
+        goto cleanup;
+
+    if (virThreadPoolSendJob(pool, VIR_THREAD_POOL_JOB_FAST, NULL) < 0 ||
+        testPoolWait(&data, &data.done, 1) < 0)
+        goto cleanup;
+
+    virMutexLock(&data.lock);
+    if (data.running != 3) {
+        virMutexUnlock(&data.lock);
+        goto cleanup;
+    }
+    virMutexUnlock(&data.lock);
+
+    if (virThreadPoolGetJobQueueDepth(pool) != 3)
+        goto cleanup;
+
+    testPoolRelease(&data);
+    if (testPoolWait(&data, &data.done, 7) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    testPoolRelease(&data);
+    virThreadPoolFree(pool);
+    testPoolFinish(&data);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("run all", 1, testRunAll, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("fast lane", 1, testFastLane, NULL) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
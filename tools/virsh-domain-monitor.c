@@ -1869,6 +1869,189 @@ cleanup:
     vshDomainListFree(list);
     return ret;
 }
+
+/*
+ * "domstats" command
+ */
+static const vshCmdInfo info_domstats[] = {
+    {.name = "help",
+     .data = N_("get statistics about one or multiple domains")
+    },
+    {.name = "desc",
+     .data = N_("Gets statistics about one or more (or all) domains")
+    },
+    {.name = NULL}
+};
+
+static const vshCmdOptDef opts_domstats[] = {
+    {.name = "state",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain state"),
+    },
+    {.name = "cpu-total",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain physical cpu usage"),
+    },
+    {.name = "balloon",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain balloon statistics"),
+    },
+    {.name = "vcpu",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain virtual cpu information"),
+    },
+    {.name = "interface",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain network interface information"),
+    },
+    {.name = "block",
+     .type = VSH_OT_BOOL,
+     .help = N_("report domain block device statistics"),
+    },
+    {.name = "list-active",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only active domains"),
+    },
+    {.name = "list-inactive",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only inactive domains"),
+    },
+    {.name = "list-persistent",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only persistent domains"),
+    },
+    {.name = "list-transient",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only transient domains"),
+    },
+    {.name = "list-running",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only running domains"),
+    },
+    {.name = "list-paused",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only paused domains"),
+    },
+    {.name = "list-shutoff",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only shutoff domains"),
+    },
+    {.name = "list-other",
+     .type = VSH_OT_BOOL,
+     .help = N_("list only domains in other states"),
+    },
+    {.name = "enforce",
+     .type = VSH_OT_BOOL,
+     .help = N_("enforce requested stats parameters"),
+    },
+    {.name = "domains",
+     .type = VSH_OT_ARGV,
+     .flags = VSH_OFLAG_NONE,
+     .help = N_("list of domains to get stats for"),
+    },
+    {.name = NULL}
+};
+
+
+static bool
+vshDomainStatsPrintRecord(vshControl *ctl,
+                          virDomainStatsRecordPtr record)
+{
+    char *param;
+    size_t i;
+
+    vshPrint(ctl, "Domain: '%s'\n", virDomainGetName(record->dom));
+
+    for (i = 0; i < record->nparams; i++) {
+        if (!(param = vshGetTypedParamValue(ctl, record->params + i)))
+            return false;
+
+        vshPrint(ctl, "  %s=%s\n", record->params[i].field, param);
+
+        VIR_FREE(param);
+    }
+
+    vshPrint(ctl, "\n");
+
+    return true;
+}
+
+static bool
+cmdDomstats(vshControl *ctl, const vshCmd *cmd)
+{
+    unsigned int stats = 0;
+    virDomainPtr *domlist = NULL;
+    size_t ndoms = 0;
+    virDomainStatsRecordPtr *records = NULL;
+    virDomainStatsRecordPtr *next;
+    unsigned int flags = 0;
+    const vshCmdOpt *opt = NULL;
+    size_t i;
+    bool ret = false;
+
+    if (vshCommandOptBool(cmd, "state"))
+        stats |= VIR_DOMAIN_STATS_STATE;
+    if (vshCommandOptBool(cmd, "cpu-total"))
+        stats |= VIR_DOMAIN_STATS_CPU_TOTAL;
+    if (vshCommandOptBool(cmd, "balloon"))
+        stats |= VIR_DOMAIN_STATS_BALLOON;
+    if (vshCommandOptBool(cmd, "vcpu"))
+        stats |= VIR_DOMAIN_STATS_VCPU;
+    if (vshCommandOptBool(cmd, "interface"))
+        stats |= VIR_DOMAIN_STATS_INTERFACE;
+    if (vshCommandOptBool(cmd, "block"))
+        stats |= VIR_DOMAIN_STATS_BLOCK;
+
+    FILTER("list-active", VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE);
+    FILTER("list-inactive", VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE);
+
+    FILTER("list-persistent", VIR_CONNECT_GET_ALL_DOMAINS_STATS_PERSISTENT);
+    FILTER("list-transient", VIR_CONNECT_GET_ALL_DOMAINS_STATS_TRANSIENT);
+
+    FILTER("list-running", VIR_CONNECT_GET_ALL_DOMAINS_STATS_RUNNING);
+    FILTER("list-paused", VIR_CONNECT_GET_ALL_DOMAINS_STATS_PAUSED);
+    FILTER("list-shutoff", VIR_CONNECT_GET_ALL_DOMAINS_STATS_SHUTOFF);
+    FILTER("list-other", VIR_CONNECT_GET_ALL_DOMAINS_STATS_OTHER);
+
+    FILTER("enforce", VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS);
+
+    if (vshCommandOptBool(cmd, "domains")) {
+        while ((opt = vshCommandOptArgv(cmd, opt))) {
+            virDomainPtr dom;
+
+            if (!(dom = vshLookupDomainBy(ctl, opt->data,
+                                          VSH_BYID | VSH_BYUUID | VSH_BYNAME)))
+                goto cleanup;
+
+            /* keep the list NULL terminated */
+            if (VIR_REALLOC_N(domlist, ndoms + 2) < 0) {
+                virDomainFree(dom);
+                goto cleanup;
+            }
+            domlist[ndoms++] = dom;
+            domlist[ndoms] = NULL;
+        }
+
+        if (virDomainListGetStats(domlist, stats, &records, flags) < 0)
+            goto cleanup;
+    } else {
+        if (virConnectGetAllDomainStats(ctl->conn, stats, &records, flags) < 0)
+            goto cleanup;
+    }
+
+    for (next = records; *next; next++) {
+        if (!vshDomainStatsPrintRecord(ctl, *next))
+            goto cleanup;
+    }
+
+    ret = true;
+cleanup:
+    virDomainStatsRecordListFree(records);
+    for (i = 0; i < ndoms; i++)
+        virDomainFree(domlist[i]);
+    VIR_FREE(domlist);
+    return ret;
+}
 #undef FILTER
 
 const vshCmdDef domMonitoringCmds[] = {
@@ -1938,6 +2121,12 @@ const vshCmdDef domMonitoringCmds[] = {
      .info = info_domstate,
      .flags = 0
     },
+    {.name = "domstats",
+     .handler = cmdDomstats,
+     .opts = opts_domstats,
+     .info = info_domstats,
+     .flags = 0
+    },
     {.name = "list",
      .handler = cmdList,
      .opts = opts_list,
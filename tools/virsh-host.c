@@ -507,6 +507,108 @@ cmdNodeMemStats(vshControl *ctl, const vshCmd *cmd)
     return ret;
 }
 
+/*
+ * "rpcstats" command
+ */
+static const vshCmdInfo info_rpcstats[] = {
+    {.name = "help",
+     .data = N_("Prints RPC statistics of the daemon.")
+    },
+    {.name = "desc",
+     .data = N_("Returns worker pool and per procedure RPC statistics "
+                "of the daemon the connection is talking to.")
+    },
+    {.name = NULL}
+};
+
+static const vshCmdOptDef opts_rpcstats[] = {
+    {.name = "raw",
+     .type = VSH_OT_BOOL,
+     .help = N_("print all statistics as reported by the daemon")
+    },
+    {.name = NULL}
+};
+
+static unsigned long long
+vshRPCStatsGet(virTypedParameterPtr params,
+               int nparams,
+               const char *prefix,
+               const char *stat)
+{
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    unsigned long long value = 0;
+
+    snprintf(field, sizeof(field), "%s.%s", prefix, stat);
+    ignore_value(virTypedParamsGetULLong(params, nparams, field, &value));
+    return value;
+}
+
+static bool
+cmdRPCStats(vshControl *ctl, const vshCmd *cmd)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    size_t i;
+    char *value;
+
+    if (virConnectGetRPCStats(ctl->conn, &params, &nparams, 0) < 0) {
+        vshError(ctl, "%s", _("Unable to get RPC stats"));
+        return false;
+    }
+
+    if (vshCommandOptBool(cmd, "raw")) {
+        for (i = 0; i < nparams; i++) {
+            value = vshGetTypedParamValue(ctl, &params[i]);
+            vshPrint(ctl, "%s=%s\n", params[i].field, value);
+            VIR_FREE(value);
+        }
+        goto cleanup;
+    }
+
+    for (i = 0; i < nparams; i++) {
+        if (STRPREFIX(params[i].field, "rpc."))
+            continue;
+        value = vshGetTypedParamValue(ctl, &params[i]);
+        vshPrint(ctl, "%-17s: %s\n", params[i].field, value);
+        VIR_FREE(value);
+    }
+
+    vshPrintExtra(ctl, "\n%-40s %10s %8s %16s %16s %12s %12s\n",
+                  _("Procedure"), _("Calls"), _("Errors"),
+                  _("Avg wait (us)"), _("Avg service (us)"),
+                  _("Bytes in"), _("Bytes out"));
+
+    /* Each procedure starts with its "calls" field, use that to
+     * find them and look up the rest by name */
+    for (i = 0; i < nparams; i++) {
+        char *prefix;
+        char *end;
+        unsigned long long calls;
+
+        if (!STRPREFIX(params[i].field, "rpc.") ||
+            !(end = strrchr(params[i].field, '.')) ||
+            STRNEQ(end, ".calls"))
+            continue;
+
+        prefix = vshStrdup(ctl, params[i].field);
+        prefix[end - params[i].field] = '\0';
+        calls = params[i].value.ul;
+
+        vshPrint(ctl, "%-40s %10llu %8llu %16llu %16llu %12llu %12llu\n",
+                 prefix + strlen("rpc."), calls,
+                 vshRPCStatsGet(params, nparams, prefix, "errors"),
+                 calls ? vshRPCStatsGet(params, nparams, prefix, "wait") / calls : 0,
+                 calls ? vshRPCStatsGet(params, nparams, prefix, "service") / calls : 0,
+                 vshRPCStatsGet(params, nparams, prefix, "bytes_in"),
+                 vshRPCStatsGet(params, nparams, prefix, "bytes_out"));
+        VIR_FREE(prefix);
+    }
+
+cleanup:
+    virTypedParamsFree(params, nparams);
+    return true;
+}
+
 /*
  * "nodesuspend" command
  */
@@ -943,6 +1045,12 @@ const vshCmdDef hostAndHypervisorCmds[] = {
      .info = info_nodesuspend,
      .flags = 0
     },
+    {.name = "rpcstats",
+     .handler = cmdRPCStats,
+     .opts = opts_rpcstats,
+     .info = info_rpcstats,
+     .flags = 0
+    },
     {.name = "sysinfo",
      .handler = cmdSysinfo,
      .opts = NULL,
@@ -620,6 +620,10 @@ static const vshCmdOptDef opts_vol_upload[] = {
      .type = VSH_OT_INT,
      .help = N_("amount of data to upload")
     },
+    {.name = "sparse",
+     .type = VSH_OT_BOOL,
+     .help = N_("preserve sparseness of volume")
+    },
     {.name = NULL}
 };
 
@@ -632,6 +636,65 @@ cmdVolUploadSource(virStreamPtr st ATTRIBUTE_UNUSED,
     return saferead(*fd, bytes, nbytes);
 }
 
+/* Sends @fd over @st, with its holes skipped rather than sent as
+ * zeroes */
+static int
+cmdVolUploadSparse(vshControl *ctl, virStreamPtr st, int fd,
+                   const char *file)
+{
+    char *buf = NULL;
+    size_t buflen = 1024 * 1024;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, buflen) < 0)
+        goto cleanup;
+
+    while (1) {
+        int inData;
+        unsigned long long len;
+
+        if (virFileInData(fd, &inData, &len) < 0)
+            goto cleanup;
+
+        if (len == 0)
+            break;
+
+        if (!inData) {
+            if (virStreamSendHole(st, len, 0) < 0)
+                goto cleanup;
+            if (lseek(fd, len, SEEK_CUR) == (off_t) -1) {
+                vshError(ctl, _("cannot seek in %s"), file);
+                goto cleanup;
+            }
+            continue;
+        }
+
+        while (len) {
+            size_t want = len < buflen ? len : buflen;
+            ssize_t got;
+            ssize_t offset = 0;
+
+            if ((got = saferead(fd, buf, want)) <= 0) {
+                vshError(ctl, _("cannot read %s"), file);
+                goto cleanup;
+            }
+            while (offset < got) {
+                int sent = virStreamSend(st, buf + offset, got - offset);
+                if (sent < 0)
+                    goto cleanup;
+                offset += sent;
+            }
+            len -= got;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
 static bool
 cmdVolUpload(vshControl *ctl, const vshCmd *cmd)
 {
@@ -642,6 +705,8 @@ cmdVolUpload(vshControl *ctl, const vshCmd *cmd)
     virStreamPtr st = NULL;
     const char *name = NULL;
     unsigned long long offset = 0, length = 0;
+    bool sparse = vshCommandOptBool(cmd, "sparse");
+    unsigned int flags = 0;
 
     if (vshCommandOptULongLong(cmd, "offset", &offset) < 0) {
         vshError(ctl, _("Unable to parse integer"));
@@ -653,6 +718,9 @@ cmdVolUpload(vshControl *ctl, const vshCmd *cmd)
         return false;
     }
 
+    if (sparse)
+        flags |= VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM;
+
     if (!(vol = vshCommandOptVol(ctl, cmd, "vol", "pool", &name))) {
         return false;
     }
@@ -666,12 +734,18 @@ cmdVolUpload(vshControl *ctl, const vshCmd *cmd)
     }
 
     st = virStreamNew(ctl->conn, 0);
-    if (virStorageVolUpload(vol, st, offset, length, 0) < 0) {
+    if (virStorageVolUpload(vol, st, offset, length, flags) < 0) {
         vshError(ctl, _("cannot upload to volume %s"), name);
         goto cleanup;
     }
 
-    if (virStreamSendAll(st, cmdVolUploadSource, &fd) < 0) {
+    if (sparse) {
+        if (cmdVolUploadSparse(ctl, st, fd, file) < 0) {
+            vshError(ctl, _("cannot send data to volume %s"), name);
+            virStreamAbort(st);
+            goto cleanup;
+        }
+    } else if (virStreamSendAll(st, cmdVolUploadSource, &fd) < 0) {
         vshError(ctl, _("cannot send data to volume %s"), name);
         goto cleanup;
     }
@@ -734,9 +808,68 @@ static const vshCmdOptDef opts_vol_download[] = {
      .type = VSH_OT_INT,
      .help = N_("amount of data to download")
     },
+    {.name = "sparse",
+     .type = VSH_OT_BOOL,
+     .help = N_("preserve sparseness of volume")
+    },
     {.name = NULL}
 };
 
+/* Receives @st into @fd, seeking over the holes instead of writing
+ * out zeroes */
+static int
+cmdVolDownloadSparse(vshControl *ctl, virStreamPtr st, int fd,
+                     const char *file)
+{
+    char *buf = NULL;
+    size_t buflen = 1024 * 1024;
+    off_t end;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, buflen) < 0)
+        goto cleanup;
+
+    while (1) {
+        int got = virStreamRecvFlags(st, buf, buflen,
+                                     VIR_STREAM_RECV_STOP_AT_HOLE);
+
+        if (got == -3) {
+            long long len;
+
+            if (virStreamRecvHole(st, &len, 0) < 0)
+                goto cleanup;
+            if (lseek(fd, len, SEEK_CUR) == (off_t) -1) {
+                vshError(ctl, _("cannot seek in %s"), file);
+                goto cleanup;
+            }
+            continue;
+        }
+
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+
+        if (safewrite(fd, buf, got) < 0) {
+            vshError(ctl, _("cannot write to %s"), file);
+            goto cleanup;
+        }
+    }
+
+    /* A trailing hole was only seeked over */
+    if ((end = lseek(fd, 0, SEEK_CUR)) == (off_t) -1 ||
+        ftruncate(fd, end) < 0) {
+        vshError(ctl, _("cannot truncate %s"), file);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
 static bool
 cmdVolDownload(vshControl *ctl, const vshCmd *cmd)
 {
@@ -748,6 +881,8 @@ cmdVolDownload(vshControl *ctl, const vshCmd *cmd)
     const char *name = NULL;
     unsigned long long offset = 0, length = 0;
     bool created = false;
+    bool sparse = vshCommandOptBool(cmd, "sparse");
+    unsigned int flags = 0;
 
     if (vshCommandOptULongLong(cmd, "offset", &offset) < 0) {
         vshError(ctl, _("Unable to parse integer"));
@@ -759,6 +894,9 @@ cmdVolDownload(vshControl *ctl, const vshCmd *cmd)
         return false;
     }
 
+    if (sparse)
+        flags |= VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM;
+
     if (!(vol = vshCommandOptVol(ctl, cmd, "vol", "pool", &name)))
         return false;
 
@@ -776,12 +914,18 @@ cmdVolDownload(vshControl *ctl, const vshCmd *cmd)
     }
 
     st = virStreamNew(ctl->conn, 0);
-    if (virStorageVolDownload(vol, st, offset, length, 0) < 0) {
+    if (virStorageVolDownload(vol, st, offset, length, flags) < 0) {
         vshError(ctl, _("cannot download from volume %s"), name);
         goto cleanup;
     }
 
-    if (virStreamRecvAll(st, vshStreamSink, &fd) < 0) {
+    if (sparse) {
+        if (cmdVolDownloadSparse(ctl, st, fd, file) < 0) {
+            vshError(ctl, _("cannot receive data from volume %s"), name);
+            virStreamAbort(st);
+            goto cleanup;
+        }
+    } else if (virStreamRecvAll(st, vshStreamSink, &fd) < 0) {
         vshError(ctl, _("cannot receive data from volume %s"), name);
         goto cleanup;
     }